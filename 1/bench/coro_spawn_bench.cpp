@@ -0,0 +1,62 @@
+/**
+ * Coroutine creation microbenchmark. The cold path spawns
+ * coroutines when the pool is empty, so each of them gets a new
+ * stack and a new context. The hot path spawns the same number
+ * again after they are joined, and all of them come from the
+ * pool.
+ */
+#include "libcoro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if !defined(LIBCORO_CTX_SIGJMP) && (defined(__x86_64__) || defined(__aarch64__))
+static const char *backend_name = "asm";
+#else
+static const char *backend_name = "sigjmp";
+#endif
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+bench_nop_f(void *arg)
+{
+	return arg;
+}
+
+static double
+bench_spawn(struct coro **coros, int count)
+{
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < count; ++i)
+		coros[i] = coro_new(bench_nop_f, NULL);
+	uint64_t duration = bench_now_ns() - start;
+	coro_sched_run();
+	for (int i = 0; i < count; ++i)
+		coro_join(coros[i]);
+	return (double)duration / count;
+}
+
+int
+main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 1000;
+	struct coro **coros = new struct coro *[count];
+
+	coro_sched_init();
+	double cold = bench_spawn(coros, count);
+	double hot = bench_spawn(coros, count);
+	printf("backend %s: %d coros: cold spawn %.2lf ns, pooled spawn "
+		"%.2lf ns\n", backend_name, count, cold, hot);
+	coro_sched_destroy();
+	delete[] coros;
+	return 0;
+}
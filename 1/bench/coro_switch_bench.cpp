@@ -0,0 +1,77 @@
+/**
+ * Context switch microbenchmark. A few coroutines yield to each
+ * other in a loop, so every scheduler iteration makes exactly
+ * coro_count + 1 switches: each coroutine passes the control to
+ * the next one, and the last one returns into the scheduler.
+ *
+ * The same source is built once per context backend, see
+ * CMakeLists.txt. The backend name is printed in the result.
+ *
+ * Usage: coro_switch_bench [yield_count] [shared]
+ * With "shared" the coroutines run on a shared stack, and each
+ * switch copies the stack out and in.
+ */
+#include "libcoro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined(LIBCORO_CTX_SIGJMP) && (defined(__x86_64__) || defined(__aarch64__))
+static const char *backend_name = "asm";
+#else
+static const char *backend_name = "sigjmp";
+#endif
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+bench_yield_f(void *arg)
+{
+	long count = (long)arg;
+	for (long i = 0; i < count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	long yield_count = argc > 1 ? atol(argv[1]) : 1000000;
+	bool is_shared = argc > 2 && strcmp(argv[2], "shared") == 0;
+	const int coro_count = 2;
+	const int run_count = 5;
+
+	coro_sched_init();
+	for (int run = 0; run < run_count; ++run) {
+		struct coro *coros[coro_count];
+		for (int i = 0; i < coro_count; ++i) {
+			coros[i] = is_shared ?
+				coro_new_shared(bench_yield_f, (void *)yield_count) :
+				coro_new(bench_yield_f, (void *)yield_count);
+		}
+		uint64_t start = bench_now_ns();
+		coro_sched_run();
+		uint64_t duration = bench_now_ns() - start;
+		for (int i = 0; i < coro_count; ++i)
+			coro_join(coros[i]);
+		/*
+		 * Joins of finished coroutines are done outside of
+		 * the scheduler, they don't need to switch.
+		 */
+		double switches = (double)yield_count * (coro_count + 1);
+		printf("backend %s%s: run %d: %.2lf ns per switch\n",
+			backend_name, is_shared ? " shared" : "", run,
+			duration / switches);
+	}
+	coro_sched_destroy();
+	return 0;
+}
@@ -0,0 +1,261 @@
+/**
+ * Coroutine bus benchmarks. Each scenario is run several times on
+ * a new bus, and the min, median and max durations per message
+ * are printed:
+ *
+ * - spsc: one producer and one consumer on a single channel;
+ * - pingpong: a round trip of one message over two channels, to
+ *   measure the latency of a wakeup, not the throughput;
+ * - N:M: several producers and consumers on a single channel;
+ * - broadcast: one producer broadcasts to a channel per consumer;
+ * - batch N: vectored send and recv of N messages at once.
+ *
+ * With "run_next" as the second argument the woken up coroutines go
+ * to the run-next slot of the scheduler.
+ */
+#include "corobus.h"
+#include "libcoro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum {
+	BENCH_RUN_COUNT = 7,
+	BENCH_CHANNEL_SIZE = 64,
+	BENCH_CORO_MAX = 16,
+	BENCH_BATCH_MAX = 64,
+};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+	printf("Error: %s failed\n", what);
+	exit(-1);
+}
+
+struct bench_ctx {
+	struct coro_bus *bus;
+	/** The first channel. The others go right after it. */
+	int channel;
+	/** Messages each coroutine sends or receives. */
+	long msg_count;
+	/** Messages per send and recv in the batch scenario. */
+	unsigned batch_size;
+};
+
+static void *
+bench_send_f(void *arg)
+{
+	struct bench_ctx *ctx = (struct bench_ctx *)arg;
+	for (long i = 0; i < ctx->msg_count; ++i) {
+		int rc = coro_bus_send(ctx->bus, ctx->channel, (unsigned)i);
+		bench_check(rc == 0, "send");
+	}
+	return NULL;
+}
+
+static void *
+bench_recv_f(void *arg)
+{
+	struct bench_ctx *ctx = (struct bench_ctx *)arg;
+	unsigned data;
+	for (long i = 0; i < ctx->msg_count; ++i) {
+		int rc = coro_bus_recv(ctx->bus, ctx->channel, &data);
+		bench_check(rc == 0, "recv");
+	}
+	return NULL;
+}
+
+static void *
+bench_ping_f(void *arg)
+{
+	struct bench_ctx *ctx = (struct bench_ctx *)arg;
+	unsigned data;
+	for (long i = 0; i < ctx->msg_count; ++i) {
+		int rc = coro_bus_send(ctx->bus, ctx->channel, (unsigned)i);
+		bench_check(rc == 0, "ping send");
+		rc = coro_bus_recv(ctx->bus, ctx->channel + 1, &data);
+		bench_check(rc == 0 && data == (unsigned)i, "ping recv");
+	}
+	return NULL;
+}
+
+static void *
+bench_pong_f(void *arg)
+{
+	struct bench_ctx *ctx = (struct bench_ctx *)arg;
+	unsigned data;
+	for (long i = 0; i < ctx->msg_count; ++i) {
+		int rc = coro_bus_recv(ctx->bus, ctx->channel, &data);
+		bench_check(rc == 0, "pong recv");
+		rc = coro_bus_send(ctx->bus, ctx->channel + 1, data);
+		bench_check(rc == 0, "pong send");
+	}
+	return NULL;
+}
+
+static void *
+bench_broadcast_f(void *arg)
+{
+	struct bench_ctx *ctx = (struct bench_ctx *)arg;
+	for (long i = 0; i < ctx->msg_count; ++i) {
+		int rc = coro_bus_broadcast(ctx->bus, (unsigned)i);
+		bench_check(rc == 0, "broadcast");
+	}
+	return NULL;
+}
+
+static void *
+bench_send_v_f(void *arg)
+{
+	struct bench_ctx *ctx = (struct bench_ctx *)arg;
+	unsigned data[BENCH_BATCH_MAX] = {0};
+	long sent = 0;
+	while (sent < ctx->msg_count) {
+		long left = ctx->msg_count - sent;
+		unsigned count = left < ctx->batch_size ?
+			(unsigned)left : ctx->batch_size;
+		int rc = coro_bus_send_v(ctx->bus, ctx->channel, data, count);
+		bench_check(rc > 0, "send_v");
+		sent += rc;
+	}
+	return NULL;
+}
+
+static void *
+bench_recv_v_f(void *arg)
+{
+	struct bench_ctx *ctx = (struct bench_ctx *)arg;
+	unsigned data[BENCH_BATCH_MAX];
+	long received = 0;
+	while (received < ctx->msg_count) {
+		int rc = coro_bus_recv_v(ctx->bus, ctx->channel, data,
+			ctx->batch_size);
+		bench_check(rc > 0, "recv_v");
+		received += rc;
+	}
+	return NULL;
+}
+
+struct bench_scenario {
+	const char *name;
+	coro_f send_f;
+	coro_f recv_f;
+	int sender_count;
+	int receiver_count;
+	/** Each receiver has an own channel. */
+	bool is_channel_per_receiver;
+	/** The receivers use the next channel after the senders'. */
+	bool is_pair;
+	unsigned batch_size;
+};
+
+/** Run the scenario once, return the duration per message. */
+static double
+bench_run(const struct bench_scenario *s, long msg_count)
+{
+	struct coro_bus *bus = coro_bus_new();
+	int channel_count = s->is_channel_per_receiver ? s->receiver_count :
+		s->is_pair ? 2 : 1;
+	int first = -1;
+	for (int i = 0; i < channel_count; ++i) {
+		int channel = coro_bus_channel_open(bus, BENCH_CHANNEL_SIZE);
+		if (i == 0)
+			first = channel;
+		bench_check(channel == first + i, "channel open");
+	}
+	/* All the messages are split between the coroutines evenly. */
+	struct bench_ctx send_ctx;
+	send_ctx.bus = bus;
+	send_ctx.channel = first;
+	send_ctx.msg_count = msg_count / s->sender_count;
+	send_ctx.batch_size = s->batch_size;
+	struct bench_ctx recv_ctx[BENCH_CORO_MAX];
+	for (int i = 0; i < s->receiver_count; ++i) {
+		recv_ctx[i] = send_ctx;
+		if (s->is_channel_per_receiver) {
+			recv_ctx[i].channel = first + i;
+			recv_ctx[i].msg_count = send_ctx.msg_count;
+		} else {
+			recv_ctx[i].msg_count = msg_count / s->receiver_count;
+		}
+	}
+	struct coro *coros[BENCH_CORO_MAX * 2];
+	int coro_count = 0;
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < s->receiver_count; ++i)
+		coros[coro_count++] = coro_new(s->recv_f, &recv_ctx[i]);
+	for (int i = 0; i < s->sender_count; ++i)
+		coros[coro_count++] = coro_new(s->send_f, &send_ctx);
+	coro_sched_run();
+	uint64_t duration = bench_now_ns() - start;
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	coro_bus_delete(bus);
+	return (double)duration / msg_count;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r ? 1 : 0;
+}
+
+static void
+bench_scenario_run(const struct bench_scenario *s, long msg_count)
+{
+	double times[BENCH_RUN_COUNT];
+	for (int i = 0; i < BENCH_RUN_COUNT; ++i)
+		times[i] = bench_run(s, msg_count);
+	qsort(times, BENCH_RUN_COUNT, sizeof(times[0]), bench_cmp);
+	printf("%s\n", s->name);
+	printf("    min: %.2lf ns per message\n", times[0]);
+	printf("    med: %.2lf ns per message\n", times[BENCH_RUN_COUNT / 2]);
+	printf("    max: %.2lf ns per message\n", times[BENCH_RUN_COUNT - 1]);
+}
+
+int
+main(int argc, char **argv)
+{
+	/* Divisible by all the coroutine counts below. */
+	long msg_count = argc > 1 ? atol(argv[1]) : 960000;
+	bool is_run_next = argc > 2 && strcmp(argv[2], "run_next") == 0;
+	const struct bench_scenario scenarios[] = {
+		{"spsc", bench_send_f, bench_recv_f, 1, 1, false, false, 1},
+		{"pingpong", bench_ping_f, bench_pong_f, 1, 1, false, true, 1},
+		{"2:2", bench_send_f, bench_recv_f, 2, 2, false, false, 1},
+		{"4:4", bench_send_f, bench_recv_f, 4, 4, false, false, 1},
+		{"8:2", bench_send_f, bench_recv_f, 8, 2, false, false, 1},
+		{"broadcast to 4", bench_broadcast_f, bench_recv_f, 1, 4,
+			true, false, 1},
+		{"broadcast to 16", bench_broadcast_f, bench_recv_f, 1, 16,
+			true, false, 1},
+		{"batch 1", bench_send_v_f, bench_recv_v_f, 1, 1, false, false,
+			1},
+		{"batch 8", bench_send_v_f, bench_recv_v_f, 1, 1, false, false,
+			8},
+		{"batch 64", bench_send_v_f, bench_recv_v_f, 1, 1, false, false,
+			64},
+	};
+	coro_sched_init();
+	coro_sched_set_run_next(is_run_next);
+	for (const struct bench_scenario &s : scenarios)
+		bench_scenario_run(&s, msg_count);
+	coro_sched_destroy();
+	return 0;
+}
@@ -0,0 +1,143 @@
+/**
+ * Struct layout benchmark. The same operations as in the other
+ * benchmarks, but spread over many objects, so they don't stay in
+ * the cache, and each operation pays for the cache lines of the
+ * struct fields it touches. Like in the compact struct example of
+ * the lectures, the cost depends on how the hot fields are packed.
+ *
+ * - switch N: N coroutines yield in a loop. Each switch touches
+ *   another struct coro.
+ * - channels N: one coroutine sends a message into each of N
+ *   channels, then receives them back. Each send and recv touches
+ *   another channel.
+ *
+ * Usage: layout_bench [op_count]
+ */
+#include "corobus.h"
+#include "libcoro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+enum {
+	BENCH_RUN_COUNT = 9,
+};
+
+static const int bench_coro_counts[] = {16, 1024, 16384};
+static const int bench_channel_counts[] = {16, 1024, 16384, 131072};
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_check(bool ok, const char *what)
+{
+	if (ok)
+		return;
+	printf("Error: %s failed\n", what);
+	exit(-1);
+}
+
+static void *
+bench_yield_f(void *arg)
+{
+	long count = (long)arg;
+	for (long i = 0; i < count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+/** The best of the runs, ns per switch. */
+static double
+bench_switch(int coro_count, long op_count)
+{
+	long yield_count = op_count / coro_count;
+	struct coro **coros = new struct coro *[coro_count];
+	double best = 0;
+	for (int run = 0; run < BENCH_RUN_COUNT; ++run) {
+		for (int i = 0; i < coro_count; ++i)
+			coros[i] = coro_new(bench_yield_f, (void *)yield_count);
+		uint64_t start = bench_now_ns();
+		coro_sched_run();
+		uint64_t duration = bench_now_ns() - start;
+		coro_join_all(coros, coro_count, NULL);
+		double res = (double)duration / (yield_count * (coro_count + 1));
+		if (run == 0 || res < best)
+			best = res;
+	}
+	delete[] coros;
+	return best;
+}
+
+struct bench_channels_ctx {
+	struct coro_bus *bus;
+	int channel_count;
+	long round_count;
+	double best;
+};
+
+static void *
+bench_channels_f(void *arg)
+{
+	struct bench_channels_ctx *ctx = (struct bench_channels_ctx *)arg;
+	unsigned data;
+	for (int run = 0; run < BENCH_RUN_COUNT; ++run) {
+		uint64_t start = bench_now_ns();
+		for (long r = 0; r < ctx->round_count; ++r) {
+			for (int i = 0; i < ctx->channel_count; ++i) {
+				int rc = coro_bus_send(ctx->bus, i, (unsigned)r);
+				bench_check(rc == 0, "send");
+			}
+			for (int i = 0; i < ctx->channel_count; ++i) {
+				int rc = coro_bus_recv(ctx->bus, i, &data);
+				bench_check(rc == 0 && data == (unsigned)r, "recv");
+			}
+		}
+		uint64_t duration = bench_now_ns() - start;
+		double res = (double)duration /
+			(2 * ctx->round_count * ctx->channel_count);
+		if (run == 0 || res < ctx->best)
+			ctx->best = res;
+	}
+	return NULL;
+}
+
+/** The best of the runs, ns per send or recv. */
+static double
+bench_channels(int channel_count, long op_count)
+{
+	struct bench_channels_ctx ctx;
+	ctx.bus = coro_bus_new_ex(channel_count);
+	ctx.channel_count = channel_count;
+	ctx.round_count = op_count / channel_count / 2;
+	ctx.best = 0;
+	for (int i = 0; i < channel_count; ++i)
+		bench_check(coro_bus_channel_open(ctx.bus, 1) == i, "open");
+	struct coro *c = coro_new(bench_channels_f, &ctx);
+	coro_sched_run();
+	coro_join(c);
+	coro_bus_delete(ctx.bus);
+	return ctx.best;
+}
+
+int
+main(int argc, char **argv)
+{
+	long op_count = argc > 1 ? atol(argv[1]) : 4000000;
+	coro_sched_init();
+	for (int count : bench_coro_counts)
+		printf("switch %d: %.2lf ns\n", count, bench_switch(count, op_count));
+	for (int count : bench_channel_counts) {
+		printf("channels %d: %.2lf ns\n", count,
+			bench_channels(count, op_count));
+	}
+	coro_sched_destroy();
+	return 0;
+}
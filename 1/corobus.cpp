@@ -1,12 +1,16 @@
 #include "corobus.h"
 
 #include "libcoro.h"
+#include "probe.h"
 #include "rlist.h"
 
 #include <assert.h>
-#include <queue>
+#include <sched.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <time.h>
 #include <vector>
 
 /**
@@ -16,6 +20,22 @@
 struct wakeup_entry {
 	struct rlist base;
 	struct coro *coro;
+	/**
+	 * Where a parked receiver wants its message. A sender can
+	 * store it here directly, bypassing the queue. NULL if the
+	 * waiter can't take a handoff.
+	 */
+	unsigned *recv_slot;
+	/** Message of a parked sender which a receiver can take. */
+	const unsigned *send_value;
+	/** The operation was completed by the peer via the handoff. */
+	bool is_done;
+	/**
+	 * A receiver can proceed when the channel has that many
+	 * messages. Only the lingering batch receivers want more than
+	 * one.
+	 */
+	size_t min_count = 1;
 };
 
 /** A queue of suspended coros waiting to be woken up. */
@@ -23,25 +43,833 @@ struct wakeup_queue {
 	struct rlist coros;
 };
 
-struct coro_bus_channel {
-	/** Channel max capacity. */
-	size_t size_limit;
+/**
+ * Fixed-capacity ring of messages. The capacity is a power of 2,
+ * so the positions grow forever and are wrapped with a mask.
+ */
+struct data_ring {
+	unsigned *buf;
+	/** Capacity - 1. */
+	size_t mask;
+	/** Position of the oldest message. */
+	size_t head;
+	/** Position for the next message. */
+	size_t tail;
+};
+
+static void
+data_ring_create(struct data_ring *ring, size_t size_limit)
+{
+	size_t capacity = 1;
+	while (capacity < size_limit)
+		capacity <<= 1;
+	ring->buf = new unsigned[capacity];
+	ring->mask = capacity - 1;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+static void
+data_ring_destroy(struct data_ring *ring)
+{
+	delete[] ring->buf;
+}
+
+static inline size_t
+data_ring_size(const struct data_ring *ring)
+{
+	return ring->tail - ring->head;
+}
+
+static inline void
+data_ring_push(struct data_ring *ring, unsigned value)
+{
+	assert(data_ring_size(ring) <= ring->mask);
+	ring->buf[ring->tail++ & ring->mask] = value;
+}
+
+static inline unsigned
+data_ring_pop(struct data_ring *ring)
+{
+	assert(data_ring_size(ring) > 0);
+	return ring->buf[ring->head++ & ring->mask];
+}
+
+/** Append @a count values, the caller checks there is space. */
+static void
+data_ring_push_v(struct data_ring *ring, const unsigned *data, size_t count)
+{
+	assert(data_ring_size(ring) + count <= ring->mask + 1);
+	size_t pos = ring->tail & ring->mask;
+	size_t first = ring->mask + 1 - pos;
+	if (first > count)
+		first = count;
+	memcpy(ring->buf + pos, data, first * sizeof(*data));
+	memcpy(ring->buf, data + first, (count - first) * sizeof(*data));
+	ring->tail += count;
+}
+
+/**
+ * Contiguous free space at the tail, up to @a count values and the
+ * @a size_limit of the queue.
+ */
+static size_t
+data_ring_tail_span(const struct data_ring *ring, size_t size_limit,
+	size_t count, unsigned **data)
+{
+	size_t pos = ring->tail & ring->mask;
+	size_t res = size_limit - data_ring_size(ring);
+	if (res > ring->mask + 1 - pos)
+		res = ring->mask + 1 - pos;
+	if (res > count)
+		res = count;
+	*data = ring->buf + pos;
+	return res;
+}
+
+/** Contiguous oldest values, up to @a count. */
+static size_t
+data_ring_head_span(const struct data_ring *ring, size_t count,
+	unsigned **data)
+{
+	size_t pos = ring->head & ring->mask;
+	size_t res = data_ring_size(ring);
+	if (res > ring->mask + 1 - pos)
+		res = ring->mask + 1 - pos;
+	if (res > count)
+		res = count;
+	*data = ring->buf + pos;
+	return res;
+}
+
+/** Take @a count oldest values, the caller checks they exist. */
+static void
+data_ring_pop_v(struct data_ring *ring, unsigned *data, size_t count)
+{
+	assert(count <= data_ring_size(ring));
+	size_t pos = ring->head & ring->mask;
+	size_t first = ring->mask + 1 - pos;
+	if (first > count)
+		first = count;
+	memcpy(data, ring->buf + pos, first * sizeof(*data));
+	memcpy(data + first, ring->buf, (count - first) * sizeof(*data));
+	ring->head += count;
+}
+
+/**
+ * Ring of bytes for the variable-size messages. Each message is a
+ * 4 byte size header followed by the payload. Both can wrap around
+ * the end of the buffer.
+ */
+struct byte_ring {
+	uint8_t *buf;
+	/** Capacity - 1. */
+	size_t mask;
+	size_t head;
+	size_t tail;
+};
+
+static void
+byte_ring_create(struct byte_ring *ring, size_t size_limit)
+{
+	size_t capacity = 1;
+	while (capacity < size_limit)
+		capacity <<= 1;
+	ring->buf = new uint8_t[capacity];
+	ring->mask = capacity - 1;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+static void
+byte_ring_destroy(struct byte_ring *ring)
+{
+	delete[] ring->buf;
+}
+
+static inline size_t
+byte_ring_size(const struct byte_ring *ring)
+{
+	return ring->tail - ring->head;
+}
+
+/** Copy @a size bytes to the tail. */
+static void
+byte_ring_write(struct byte_ring *ring, const void *data, size_t size)
+{
+	assert(byte_ring_size(ring) + size <= ring->mask + 1);
+	size_t pos = ring->tail & ring->mask;
+	size_t first = ring->mask + 1 - pos;
+	if (first > size)
+		first = size;
+	memcpy(ring->buf + pos, data, first);
+	memcpy(ring->buf, (const uint8_t *)data + first, size - first);
+	ring->tail += size;
+}
+
+/** Copy @a size bytes starting @a offset bytes after the head. */
+static void
+byte_ring_peek(const struct byte_ring *ring, size_t offset, void *data,
+	size_t size)
+{
+	assert(offset + size <= byte_ring_size(ring));
+	size_t pos = (ring->head + offset) & ring->mask;
+	size_t first = ring->mask + 1 - pos;
+	if (first > size)
+		first = size;
+	memcpy(data, ring->buf + pos, first);
+	memcpy((uint8_t *)data + first, ring->buf, size - first);
+}
+
+enum {
+	DESC_BITMAP_LEVEL_COUNT = 3,
+};
+
+/**
+ * Set of free channel descriptors. It is a hierarchical bitmap: a
+ * bit of an upper level is set when the word below it has any bits
+ * set. The lowest free descriptor is found with one find-first-set
+ * per level. 3 levels make the top one a single word up to 256K
+ * descriptors.
+ */
+struct desc_bitmap {
+	std::vector<uint64_t> levels[DESC_BITMAP_LEVEL_COUNT];
+};
+
+/** Make the bitmap fit descriptors up to @a desc. */
+static void
+desc_bitmap_grow(struct desc_bitmap *map, size_t desc)
+{
+	for (int i = 0; i < DESC_BITMAP_LEVEL_COUNT; ++i) {
+		desc /= 64;
+		if (map->levels[i].size() <= desc)
+			map->levels[i].resize(desc + 1, 0);
+	}
+}
+
+static void
+desc_bitmap_set(struct desc_bitmap *map, size_t desc)
+{
+	desc_bitmap_grow(map, desc);
+	for (int i = 0; i < DESC_BITMAP_LEVEL_COUNT; ++i) {
+		uint64_t &word = map->levels[i][desc / 64];
+		bool was_empty = word == 0;
+		word |= (uint64_t)1 << (desc % 64);
+		if (!was_empty)
+			break;
+		desc /= 64;
+	}
+}
+
+static void
+desc_bitmap_clear(struct desc_bitmap *map, size_t desc)
+{
+	for (int i = 0; i < DESC_BITMAP_LEVEL_COUNT; ++i) {
+		uint64_t &word = map->levels[i][desc / 64];
+		word &= ~((uint64_t)1 << (desc % 64));
+		if (word != 0)
+			break;
+		desc /= 64;
+	}
+}
+
+/** Lowest set descriptor, or -1 if the set is empty. */
+static ssize_t
+desc_bitmap_first(const struct desc_bitmap *map)
+{
+	const std::vector<uint64_t> &top = map->levels[DESC_BITMAP_LEVEL_COUNT - 1];
+	size_t desc = 0;
+	while (desc < top.size() && top[desc] == 0)
+		++desc;
+	if (desc == top.size())
+		return -1;
+	for (int i = DESC_BITMAP_LEVEL_COUNT - 1; i >= 0; --i)
+		desc = desc * 64 + __builtin_ctzll(map->levels[i][desc]);
+	return desc;
+}
+
+/**
+ * Bounded lock-free ring for many producer threads and a single
+ * consumer thread (D. Vyukov's queue). Each cell has a sequence
+ * number telling whose turn it is: a producer can fill the cell
+ * at position pos when the sequence is pos, the consumer can take
+ * it when the sequence is pos + 1.
+ */
+struct port_cell {
+	size_t seq;
+	unsigned value;
+};
+
+struct coro_bus_port {
+	struct port_cell *cells;
+	/** Capacity - 1. */
+	size_t mask;
+	/** Next position to push, the producers race for it. */
+	alignas(64) size_t tail;
+	/** Next position to pop, only the consumer moves it. */
+	alignas(64) size_t head;
+	/**
+	 * The first receiver suspended on the channel. A producer
+	 * takes it under the lock to wake it up, so a receiver can't
+	 * leave and disappear while being woken.
+	 */
+	struct coro *parked;
+	int lock;
+#if NEED_STATS
+	/** Pushed messages, counted by the producers. */
+	uint64_t sent;
+#endif
+};
+
+static void
+port_create(struct coro_bus_port *port, size_t size_limit)
+{
+	/* The sequence numbers need at least 2 cells to be distinct. */
+	size_t capacity = 2;
+	while (capacity < size_limit)
+		capacity <<= 1;
+	port->cells = new port_cell[capacity];
+	for (size_t i = 0; i < capacity; ++i)
+		port->cells[i].seq = i;
+	port->mask = capacity - 1;
+	port->tail = 0;
+	port->head = 0;
+	port->parked = NULL;
+	port->lock = 0;
+#if NEED_STATS
+	port->sent = 0;
+#endif
+}
+
+static void
+port_destroy(struct coro_bus_port *port)
+{
+	delete[] port->cells;
+}
+
+static inline void
+port_lock(struct coro_bus_port *port)
+{
+	while (__atomic_exchange_n(&port->lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		while (__atomic_load_n(&port->lock, __ATOMIC_RELAXED) != 0)
+			sched_yield();
+	}
+}
+
+static inline void
+port_unlock(struct coro_bus_port *port)
+{
+	__atomic_store_n(&port->lock, 0, __ATOMIC_RELEASE);
+}
+
+/** Push a message from any thread. False if the ring is full. */
+static bool
+port_push(struct coro_bus_port *port, unsigned value)
+{
+	size_t pos = __atomic_load_n(&port->tail, __ATOMIC_RELAXED);
+	struct port_cell *cell;
+	while (true) {
+		cell = &port->cells[pos & port->mask];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&port->tail, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = __atomic_load_n(&port->tail, __ATOMIC_RELAXED);
+		}
+	}
+	cell->value = value;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static inline bool
+port_is_empty(const struct coro_bus_port *port)
+{
+	const struct port_cell *cell = &port->cells[port->head & port->mask];
+	return __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != port->head + 1;
+}
+
+/** Pop a message in the consumer thread. False if the ring is empty. */
+static bool
+port_pop(struct coro_bus_port *port, unsigned *value)
+{
+	if (port_is_empty(port))
+		return false;
+	struct port_cell *cell = &port->cells[port->head & port->mask];
+	*value = cell->value;
+	__atomic_store_n(&cell->seq, port->head + port->mask + 1,
+			 __ATOMIC_RELEASE);
+	++port->head;
+	return true;
+}
+
+/** Wake up the parked receiver after a push, from any thread. */
+static void
+port_notify(struct coro_bus_port *port)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&port->parked, __ATOMIC_RELAXED) == NULL)
+		return;
+	port_lock(port);
+	struct coro *c = port->parked;
+	port->parked = NULL;
+	if (c != NULL)
+		coro_wakeup(c);
+	port_unlock(port);
+}
+
+/**
+ * Subscribers of a topic channel. The messages are in the data
+ * ring of the channel, written once for all the subscribers. Its
+ * tail is the publish position, and its head is the gate: the
+ * slowest read position as of the last scan. The cursors only move
+ * forward, so the gate is never ahead of the real slowest one. The
+ * publishers rescan the cursors only when the ring looks full.
+ */
+struct coro_bus_topic {
+	/** Read positions by subscriber, TOPIC_CURSOR_FREE for holes. */
+	std::vector<size_t> cursors;
+	/** Descriptors of the holes in the cursors. */
+	std::vector<int> free_subs;
+	/**
+	 * Number of the subscribers at the gate. When the last of them
+	 * moves on, the gate can advance, and a publisher is woken up.
+	 */
+	size_t gate_count;
+};
+
+static const size_t TOPIC_CURSOR_FREE = SIZE_MAX;
+
+/** Kinds of channels, as a mask of what an operation accepts. */
+enum {
+	CHANNEL_KIND_DATA = 1 << 0,
+	CHANNEL_KIND_BUF = 1 << 1,
+	CHANNEL_KIND_PORT = 1 << 2,
+	CHANNEL_KIND_PRIO = 1 << 3,
+	CHANNEL_KIND_TOPIC = 1 << 4,
+};
+
+enum {
+	CORO_BUS_CACHE_LINE_SIZE = 64,
+};
+
+/**
+ * The fields of each send and receive go first, in two cache
+ * lines: the message queue with the wait queues, and what tells
+ * the kind of the channel. The busy bus has much more channels
+ * than the cache has lines, so the rest is paid for only by the
+ * operations which need it.
+ */
+struct alignas(CORO_BUS_CACHE_LINE_SIZE) coro_bus_channel {
+	/** Message queue, its capacity fits size_limit. */
+	struct data_ring data;
 	/** Coroutines waiting until the channel is not full. */
 	struct wakeup_queue send_queue;
 	/** Coroutines waiting until the channel is not empty. */
 	struct wakeup_queue recv_queue;
-	/** Message queue. */
-	std::queue<unsigned> data;
-	/** For safe exit when the channel is closed */
+	/**
+	 * Channel max capacity. In messages, or in bytes for the
+	 * channels of variable-size messages.
+	 */
+	size_t size_limit;
+	/**
+	 * Thread-safe message ring instead of the data one, for the
+	 * channels fed by other threads. NULL for the usual ones.
+	 */
+	struct coro_bus_port *port;
+	/**
+	 * Message queues of the priority levels instead of the data
+	 * one, the last is the highest. Each fits the whole size
+	 * limit. NULL for the channels without priorities.
+	 */
+	struct data_ring *levels;
+	/** Subscribers of a topic channel. NULL for the other ones. */
+	struct coro_bus_topic *topic;
+	/** The channel carries variable-size messages. */
+	bool is_buf;
+	/** The message queue is at its size_limit. */
+	bool is_full;
+	/**
+	 * The channel is closed and is not in the bus anymore. It
+	 * lives until the last waiter leaves.
+	 */
 	bool is_closed;
+	/** Number of coroutines suspended in the queues. */
+	unsigned waiter_count;
+#if NEED_STATS
+	struct coro_bus_channel_stats stats;
+#endif
+	/** Messages with their headers, when is_buf is set. */
+	struct byte_ring bytes;
+	unsigned level_count;
+	/** Total number of messages in all the levels. */
+	size_t level_size;
+	/** Link in the bus list of open unsigned-message channels. */
+	struct rlist live_link;
+	/** Link in the bus list of full channels, when is_full. */
+	struct rlist full_link;
+#ifdef LIBCORO_TRACE
+	/** Descriptor of the channel, the argument of its events. */
+	unsigned desc;
+#endif
 };
 
+static_assert(offsetof(struct coro_bus_channel, waiter_count) +
+	sizeof(unsigned) <= 2 * CORO_BUS_CACHE_LINE_SIZE,
+	"the send and recv fields must fit two cache lines");
+
 struct coro_bus {
 	/** vector stores channels and stores count itself */
 	std::vector<struct coro_bus_channel*> channels;
+	/** Indexes of the nullptr holes in the channels vector. */
+	struct desc_bitmap free_descs;
+	/**
+	 * Open channels of unsigned messages, the broadcast targets.
+	 * Closed channels and holes are not here.
+	 */
+	struct rlist live_channels;
+	/** Live channels which are full. Any of them blocks a broadcast. */
+	struct rlist full_channels;
+	size_t full_count;
+#if NEED_STATS
+	/** Sum of the counters of the closed channels. */
+	struct coro_bus_channel_stats closed_stats;
+#endif
 };
 
-static enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
+static __thread enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
+
+/**
+ * Keep the full-channel list of the bus in sync with the channel
+ * size. Must be called after each change of an unsigned-message
+ * queue.
+ */
+static void
+coro_bus_channel_update_full(struct coro_bus *bus, struct coro_bus_channel *ch)
+{
+	bool is_full = data_ring_size(&ch->data) >= ch->size_limit;
+	if (is_full == ch->is_full)
+		return;
+	ch->is_full = is_full;
+	if (is_full) {
+		rlist_add_tail(&bus->full_channels, &ch->full_link);
+		++bus->full_count;
+	} else {
+		rlist_del(&ch->full_link);
+		--bus->full_count;
+	}
+}
+
+static inline unsigned
+coro_bus_channel_kind(const struct coro_bus_channel *ch)
+{
+	if (ch->port != NULL)
+		return CHANNEL_KIND_PORT;
+	if (ch->levels != NULL)
+		return CHANNEL_KIND_PRIO;
+	if (ch->topic != NULL)
+		return CHANNEL_KIND_TOPIC;
+	return ch->is_buf ? CHANNEL_KIND_BUF : CHANNEL_KIND_DATA;
+}
+
+/**
+ * Find an open channel of one of the given kinds. Sets
+ * CORO_BUS_ERR_NO_CHANNEL if there is none.
+ */
+static struct coro_bus_channel *
+coro_bus_channel_get(struct coro_bus *bus, int channel, unsigned kinds)
+{
+	if (channel < 0 || (size_t)channel >= bus->channels.size() ||
+	    bus->channels[channel] == nullptr ||
+	    (coro_bus_channel_kind(bus->channels[channel]) & kinds) == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return nullptr;
+	}
+	return bus->channels[channel];
+}
+
+static inline bool
+coro_bus_channel_is_empty(const struct coro_bus_channel *ch)
+{
+	if (ch->port != NULL)
+		return port_is_empty(ch->port);
+	if (ch->levels != NULL)
+		return ch->level_size == 0;
+	return data_ring_size(&ch->data) == 0;
+}
+
+/** Size of the channel in the units of its size limit. */
+static inline size_t
+coro_bus_channel_depth(const struct coro_bus_channel *ch)
+{
+	if (ch->port != NULL) {
+		return __atomic_load_n(&ch->port->tail, __ATOMIC_RELAXED) -
+			ch->port->head;
+	}
+	if (ch->levels != NULL)
+		return ch->level_size;
+	if (ch->is_buf)
+		return byte_ring_size(&ch->bytes);
+	return data_ring_size(&ch->data);
+}
+
+/** Record an event of the channel into the trace of libcoro. */
+static inline void
+coro_bus_trace(const struct coro_bus_channel *ch, enum coro_trace_event event)
+{
+#ifdef LIBCORO_TRACE
+	coro_trace_add(event, ch->desc);
+#else
+	(void)ch;
+	(void)event;
+#endif
+}
+
+static inline void
+coro_bus_stat_sent(struct coro_bus_channel *ch, size_t count)
+{
+	coro_bus_trace(ch, CORO_TRACE_SEND);
+#if NEED_STATS
+	ch->stats.sent += count;
+	size_t depth = coro_bus_channel_depth(ch);
+	if (depth > ch->stats.peak_depth)
+		ch->stats.peak_depth = depth;
+#else
+	(void)ch;
+	(void)count;
+#endif
+}
+
+static inline void
+coro_bus_stat_received(struct coro_bus_channel *ch, size_t count)
+{
+	coro_bus_trace(ch, CORO_TRACE_RECV);
+#if NEED_STATS
+	ch->stats.received += count;
+	/* The port producers can't update the peak, so sample it here. */
+	if (ch->port != NULL) {
+		size_t depth = coro_bus_channel_depth(ch) + count;
+		if (depth > ch->stats.peak_depth)
+			ch->stats.peak_depth = depth;
+	}
+#else
+	(void)ch;
+	(void)count;
+#endif
+}
+
+static inline uint64_t
+coro_bus_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t
+coro_bus_stat_wait_begin(void)
+{
+#if NEED_STATS
+	return coro_bus_clock_ns();
+#else
+	return 0;
+#endif
+}
+
+static inline void
+coro_bus_stat_wait_end(struct coro_bus_channel *ch, bool is_send,
+	uint64_t start_ns)
+{
+#if NEED_STATS
+	if (is_send)
+		++ch->stats.send_blocked;
+	else
+		++ch->stats.recv_blocked;
+	ch->stats.suspended_ns += coro_bus_stat_wait_begin() - start_ns;
+#else
+	(void)ch;
+	(void)is_send;
+	(void)start_ns;
+#endif
+}
+
+#if NEED_STATS
+
+static void
+coro_bus_channel_stats_get(const struct coro_bus_channel *ch,
+	struct coro_bus_channel_stats *stats)
+{
+	*stats = ch->stats;
+	if (ch->port != NULL)
+		stats->sent = __atomic_load_n(&ch->port->sent, __ATOMIC_RELAXED);
+	stats->depth = coro_bus_channel_depth(ch);
+}
+
+static void
+coro_bus_stats_add(struct coro_bus_channel_stats *dst,
+	const struct coro_bus_channel_stats *src)
+{
+	dst->sent += src->sent;
+	dst->received += src->received;
+	dst->send_blocked += src->send_blocked;
+	dst->recv_blocked += src->recv_blocked;
+	dst->depth += src->depth;
+	if (src->peak_depth > dst->peak_depth)
+		dst->peak_depth = src->peak_depth;
+	dst->suspended_ns += src->suspended_ns;
+}
+
+#endif
+
+static void
+coro_bus_channel_delete(struct coro_bus_channel *ch)
+{
+	assert(ch->waiter_count == 0);
+	data_ring_destroy(&ch->data);
+	byte_ring_destroy(&ch->bytes);
+	if (ch->port != NULL) {
+		port_destroy(ch->port);
+		delete ch->port;
+	}
+	for (unsigned i = 0; i < ch->level_count; ++i)
+		data_ring_destroy(&ch->levels[i]);
+	delete[] ch->levels;
+	delete ch->topic;
+	delete ch;
+}
+
+/**
+ * Let the producers of a port channel know whom to wake up: the
+ * first receiver in the queue. Returns true when the ring has got
+ * messages already and the current coroutine is that receiver, so
+ * it must not suspend.
+ */
+static bool
+coro_bus_port_arm(struct coro_bus_channel *ch)
+{
+	struct coro_bus_port *port = ch->port;
+	struct coro *head = NULL;
+	if (!rlist_empty(&ch->recv_queue.coros))
+		head = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base)->coro;
+	port_lock(port);
+	port->parked = head;
+	port_unlock(port);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (head == NULL || port_is_empty(port))
+		return false;
+	/* A message came before the producer could see the receiver. */
+	port_lock(port);
+	struct coro *c = port->parked;
+	port->parked = NULL;
+	port_unlock(port);
+	if (c == NULL)
+		/* A producer has taken it and is waking it up already. */
+		return false;
+	if (c == coro_this())
+		return true;
+	coro_wakeup(c);
+	return false;
+}
+
+/**
+ * Suspend the current coroutine in the queue until a wakeup or the
+ * timeout. If the channel got closed meanwhile, the last waiter
+ * frees it.
+ * @retval 0 Woken up or timed out, the channel is still open.
+ * @retval -1 The channel is closed, CORO_BUS_ERR_NO_CHANNEL is set.
+ */
+static int
+coro_bus_channel_wait_entry_timeout(struct coro_bus_channel *ch,
+	struct wakeup_queue *queue, struct wakeup_entry *we, uint64_t timeout_ns)
+{
+	we->coro = coro_this();
+	we->is_done = false;
+	rlist_create(&we->base);
+	rlist_add_tail(&queue->coros, &we->base);
+	++ch->waiter_count;
+	uint64_t start_ns = coro_bus_stat_wait_begin();
+	if (ch->port == NULL || queue != &ch->recv_queue || !coro_bus_port_arm(ch)) {
+		coro_bus_trace(ch, CORO_TRACE_BLOCK);
+		PROBE2(corobus, block, ch, queue == &ch->send_queue);
+		if (timeout_ns == UINT64_MAX)
+			coro_suspend();
+		else
+			coro_suspend_timeout(timeout_ns);
+		PROBE2(corobus, unblock, ch, queue == &ch->send_queue);
+	}
+	coro_bus_stat_wait_end(ch, queue == &ch->send_queue, start_ns);
+	rlist_del(&we->base);
+	--ch->waiter_count;
+	if (!ch->is_closed) {
+		if (ch->port != NULL && queue == &ch->recv_queue)
+			coro_bus_port_arm(ch);
+		return 0;
+	}
+	if (ch->waiter_count == 0)
+		coro_bus_channel_delete(ch);
+	/* The handoff has happened before the close. */
+	if (we->is_done)
+		return 0;
+	coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	return -1;
+}
+
+static int
+coro_bus_channel_wait_entry(struct coro_bus_channel *ch,
+			    struct wakeup_queue *queue, struct wakeup_entry *we)
+{
+	return coro_bus_channel_wait_entry_timeout(ch, queue, we, UINT64_MAX);
+}
+
+static int
+coro_bus_channel_wait(struct coro_bus_channel *ch, struct wakeup_queue *queue)
+{
+	wakeup_entry we;
+	we.recv_slot = NULL;
+	we.send_value = NULL;
+	return coro_bus_channel_wait_entry(ch, queue, &we);
+}
+
+/**
+ * A wakeup could go to a receiver which didn't read, like a select
+ * on another channel or a batch receiver lingering for more. Pass
+ * it on to the next receiver which can proceed, so the messages
+ * aren't stuck.
+ */
+static void
+coro_bus_channel_pass_wakeup(struct coro_bus_channel *ch)
+{
+	if (coro_bus_channel_is_empty(ch))
+		return;
+	size_t depth = coro_bus_channel_depth(ch);
+	struct wakeup_entry *rec;
+	rlist_foreach_entry(rec, &ch->recv_queue.coros, base) {
+		if (rec->min_count <= depth) {
+			coro_wakeup(rec->coro);
+			return;
+		}
+	}
+}
+
+/**
+ * Complete the operation of the first waiter in the queue on its
+ * behalf and wake it up. The waiter leaves the queue right away,
+ * so nobody else can hand it a second message.
+ */
+static void
+coro_bus_handoff_finish(struct wakeup_entry *we)
+{
+	we->is_done = true;
+	rlist_del(&we->base);
+	coro_wakeup(we->coro);
+}
 
 enum coro_bus_error_code
 coro_bus_errno(void)
@@ -58,7 +886,20 @@ coro_bus_errno_set(enum coro_bus_error_code err)
 struct coro_bus *
 coro_bus_new(void)
 {
-	return new coro_bus();
+	return coro_bus_new_ex(0);
+}
+
+struct coro_bus *
+coro_bus_new_ex(size_t channel_count_hint)
+{
+	coro_bus *bus = new coro_bus();
+	bus->channels.reserve(channel_count_hint);
+	if (channel_count_hint > 0)
+		desc_bitmap_grow(&bus->free_descs, channel_count_hint - 1);
+	rlist_create(&bus->live_channels);
+	rlist_create(&bus->full_channels);
+	bus->full_count = 0;
+	return bus;
 }
 
 void
@@ -70,411 +911,1177 @@ coro_bus_delete(struct coro_bus *bus)
 	delete bus;
 }
 
-int
-coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
+static int
+coro_bus_channel_open_impl(struct coro_bus *bus, size_t size_limit, unsigned kind,
+	unsigned level_count)
 {
 	coro_bus_channel* channel = new coro_bus_channel();
 	channel->size_limit = size_limit;
+	channel->is_buf = kind == CHANNEL_KIND_BUF;
 	channel->is_closed = false;
+	if (kind == CHANNEL_KIND_BUF) {
+		byte_ring_create(&channel->bytes, size_limit);
+	} else if (kind == CHANNEL_KIND_PORT) {
+		channel->port = new coro_bus_port();
+		port_create(channel->port, size_limit);
+	} else if (kind == CHANNEL_KIND_PRIO) {
+		channel->levels = new data_ring[level_count];
+		channel->level_count = level_count;
+		for (unsigned i = 0; i < level_count; ++i)
+			data_ring_create(&channel->levels[i], size_limit);
+	} else if (kind == CHANNEL_KIND_TOPIC) {
+		channel->topic = new coro_bus_topic();
+		channel->topic->gate_count = 0;
+		data_ring_create(&channel->data, size_limit);
+	} else {
+		data_ring_create(&channel->data, size_limit);
+	}
+	channel->is_full = false;
+	rlist_create(&channel->live_link);
+	rlist_create(&channel->full_link);
+	/* The port channels would need locks to take part in broadcasts. */
+	if (kind == CHANNEL_KIND_DATA) {
+		rlist_add_tail(&bus->live_channels, &channel->live_link);
+		coro_bus_channel_update_full(bus, channel);
+	}
 	rlist_create(&channel->send_queue.coros);
 	rlist_create(&channel->recv_queue.coros);
 
-	/* searching for free channel */
-	for (size_t i = 0; i < bus->channels.size(); ++i) {
-		if (bus->channels[i] == nullptr) { 
-			bus->channels[i] = channel;
-			return (int)i;
-		}
+	/* the lowest free descriptor, like with file descriptors */
+	ssize_t desc = desc_bitmap_first(&bus->free_descs);
+	if (desc >= 0) {
+		assert(bus->channels[desc] == nullptr);
+		desc_bitmap_clear(&bus->free_descs, desc);
+		bus->channels[desc] = channel;
+	} else {
+		/* if can't find, creating new one */
+		desc = bus->channels.size();
+		bus->channels.push_back(channel);
 	}
-	/* if can't find, creating new one */
-	bus->channels.push_back(channel);
-	return (int)(bus->channels.size() - 1);
+#ifdef LIBCORO_TRACE
+	channel->desc = (unsigned)desc;
+#endif
+	return (int)desc;
 }
 
-void
-coro_bus_channel_close(struct coro_bus *bus, int channel)
+int
+coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
 {
-	if (channel < 0 || channel >= (int)bus->channels.size() || bus->channels[channel] == nullptr) {
-		return;
-	}
+	return coro_bus_channel_open_impl(bus, size_limit, CHANNEL_KIND_DATA, 0);
+}
 
-	coro_bus_channel* ch = bus->channels[channel];
-	ch->is_closed = true;
-	struct wakeup_entry *item, *tmp;
-    
-	/* 
-		Wake up all the waiting coroutines. 
-		The is_closed flag will be processed correctly, 
-		and they'll all exit with an error.
-	*/
-    rlist_foreach_entry_safe(item, &ch->send_queue.coros, base, tmp) {
-        coro_wakeup(item->coro);
-    }
-    
-    rlist_foreach_entry_safe(item, &ch->recv_queue.coros, base, tmp) {
-        coro_wakeup(item->coro);
-    }
+int
+coro_bus_channel_open_buf(struct coro_bus *bus, size_t size_limit)
+{
+	return coro_bus_channel_open_impl(bus, size_limit, CHANNEL_KIND_BUF, 0);
+}
+
+int
+coro_bus_channel_open_port(struct coro_bus *bus, size_t size_limit)
+{
+	return coro_bus_channel_open_impl(bus, size_limit, CHANNEL_KIND_PORT, 0);
+}
+
+int
+coro_bus_channel_open_prio(struct coro_bus *bus, size_t size_limit,
+	unsigned level_count)
+{
+	if (level_count == 0)
+		level_count = 1;
+	return coro_bus_channel_open_impl(bus, size_limit, CHANNEL_KIND_PRIO,
+		level_count);
+}
+
+int
+coro_bus_channel_open_topic(struct coro_bus *bus, size_t size_limit)
+{
+	return coro_bus_channel_open_impl(bus, size_limit, CHANNEL_KIND_TOPIC, 0);
+}
+
+struct coro_bus_port *
+coro_bus_channel_port(struct coro_bus *bus, int channel)
+{
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel, CHANNEL_KIND_PORT);
+	if (ch == nullptr)
+		return NULL;
+	return ch->port;
+}
+
+int
+coro_bus_port_try_send(struct coro_bus_port *port, unsigned data)
+{
+	if (!port_push(port, data)) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+#if NEED_STATS
+	__atomic_add_fetch(&port->sent, 1, __ATOMIC_RELAXED);
+#endif
+	port_notify(port);
+	return 0;
+}
+
+void
+coro_bus_channel_close(struct coro_bus *bus, int channel)
+{
+	if (channel < 0 || channel >= (int)bus->channels.size() || bus->channels[channel] == nullptr) {
+		return;
+	}
+
+	coro_bus_channel* ch = bus->channels[channel];
+	bus->channels[channel] = nullptr;
+	desc_bitmap_set(&bus->free_descs, channel);
+#if NEED_STATS
+	struct coro_bus_channel_stats stats;
+	coro_bus_channel_stats_get(ch, &stats);
+	stats.depth = 0;
+	coro_bus_stats_add(&bus->closed_stats, &stats);
+#endif
+	ch->is_closed = true;
+	rlist_del(&ch->live_link);
+	if (ch->is_full) {
+		rlist_del(&ch->full_link);
+		--bus->full_count;
+		ch->is_full = false;
+	}
+	if (ch->port != NULL) {
+		port_lock(ch->port);
+		ch->port->parked = NULL;
+		port_unlock(ch->port);
+	}
+	struct wakeup_entry *item, *tmp;
+    
 	/* 
-		coro_yield() puts the coroutine at the very end of the list in the scheduler.
-		When the scheduler returns to this code, 
-		all coroutines will have woken up and exited their send/recv functions, 
-		and the channel can be safely deleted.
+		Wake up all the waiting coroutines. 
+		The is_closed flag will be processed correctly, 
+		and they'll all exit with an error. The last of them
+		frees the channel.
 	*/
-	coro_yield();
-	delete ch;
-	bus->channels[channel] = nullptr;
+    rlist_foreach_entry_safe(item, &ch->send_queue.coros, base, tmp) {
+        coro_wakeup(item->coro);
+    }
+    
+    rlist_foreach_entry_safe(item, &ch->recv_queue.coros, base, tmp) {
+        coro_wakeup(item->coro);
+    }
+	if (ch->waiter_count == 0)
+		coro_bus_channel_delete(ch);
+}
+
+/**
+ * Put as many messages into a level of a priority channel as it
+ * fits. Levels above the top one mean the top one.
+ */
+static int
+coro_bus_prio_try_send_v(struct coro_bus_channel *ch, const unsigned *data,
+	unsigned count, unsigned level)
+{
+	if (ch->level_size == ch->size_limit) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	if (level >= ch->level_count)
+		level = ch->level_count - 1;
+	unsigned send_c = ch->size_limit - ch->level_size;
+	if (send_c > count)
+		send_c = count;
+	data_ring_push_v(&ch->levels[level], data, send_c);
+	ch->level_size += send_c;
+	coro_bus_stat_sent(ch, send_c);
+
+	if (!rlist_empty(&ch->recv_queue.coros)) {
+		wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
+		coro_wakeup(rec->coro);
+	}
+	return send_c;
+}
+
+/** Take messages from a priority channel, the highest levels first. */
+static int
+coro_bus_prio_try_recv_v(struct coro_bus_channel *ch, unsigned *data,
+	unsigned capacity)
+{
+	if (ch->level_size == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	unsigned recv_c = 0;
+	for (unsigned i = ch->level_count; i > 0 && recv_c < capacity; --i) {
+		struct data_ring *ring = &ch->levels[i - 1];
+		size_t count = data_ring_size(ring);
+		if (count > capacity - recv_c)
+			count = capacity - recv_c;
+		data_ring_pop_v(ring, data + recv_c, count);
+		recv_c += count;
+	}
+	ch->level_size -= recv_c;
+	coro_bus_stat_received(ch, recv_c);
+
+	if (!rlist_empty(&ch->send_queue.coros)) {
+		wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
+		coro_wakeup(sender->coro);
+	}
+	return recv_c;
 }
 
 int
 coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
 {
-	if (channel < 0 || channel >= (int)bus->channels.size() || bus->channels[channel] == nullptr) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel,
+		CHANNEL_KIND_DATA | CHANNEL_KIND_PORT | CHANNEL_KIND_PRIO);
+	if (ch == nullptr)
 		return -1;
+
+	while (true) {
+		int result = coro_bus_try_send(bus, channel, data);
+		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL) {
+			return -1;
+		}
+		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK) {
+			wakeup_entry we;
+			we.recv_slot = NULL;
+			we.send_value = &data;
+			if (coro_bus_channel_wait_entry(ch, &ch->send_queue, &we) != 0)
+				return -1;
+			if (we.is_done)
+				return 0;
+			continue;
+		}
+
+		if (result == 0) {
+			if (!rlist_empty(&ch->send_queue.coros) && coro_bus_channel_depth(ch) < ch->size_limit) {
+        		wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
+        		coro_wakeup(sender->coro);
+    		}
+			return 0;
+		}
 	}
+}
 
-	coro_bus_channel* ch = bus->channels[channel];
+int
+coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
+{
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel,
+		CHANNEL_KIND_DATA | CHANNEL_KIND_PORT | CHANNEL_KIND_PRIO);
+	if (ch == nullptr)
+		return -1;
+	if (ch->port != NULL)
+		return coro_bus_port_try_send(ch->port, data);
+	if (ch->levels != NULL)
+		return coro_bus_prio_try_send_v(ch, &data, 1, 0) > 0 ? 0 : -1;
+
+	if (ch->size_limit == data_ring_size(&ch->data)) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	/*
+		Direct handoff like in Go channels: the queue is empty, so
+		a parked receiver is the next one to get the message. Give
+		it right away instead of waking the receiver just to make
+		it race for the queue.
+	*/
+	if (data_ring_size(&ch->data) == 0 && !rlist_empty(&ch->recv_queue.coros)) {
+		wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
+		if (rec->recv_slot != NULL) {
+			*rec->recv_slot = data;
+			coro_bus_handoff_finish(rec);
+			coro_bus_stat_sent(ch, 1);
+			coro_bus_stat_received(ch, 1);
+			return 0;
+		}
+	}
+
+	data_ring_push(&ch->data, data);
+	coro_bus_channel_update_full(bus, ch);
+	coro_bus_stat_sent(ch, 1);
+
+    if (!rlist_empty(&ch->recv_queue.coros)) {
+        wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
+        coro_wakeup(rec->coro);
+    }
+
+	return 0;
+}
+
+int
+coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel,
+		CHANNEL_KIND_DATA | CHANNEL_KIND_PORT | CHANNEL_KIND_PRIO);
+	if (ch == nullptr)
+		return -1;
 
 	while (true) {
-		if (ch->is_closed) {
-			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		int result = coro_bus_try_recv(bus, channel, data);
+		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL) {
+			return -1;
+		}
+		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK) {
+			wakeup_entry we;
+			we.recv_slot = data;
+			we.send_value = NULL;
+			if (coro_bus_channel_wait_entry(ch, &ch->recv_queue, &we) != 0)
+				return -1;
+			if (we.is_done)
+				return 0;
+			continue;
+		}
+
+		if (result == 0) {
+			if (!rlist_empty(&ch->recv_queue.coros) && !coro_bus_channel_is_empty(ch)) {
+        		wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
+        		coro_wakeup(rec->coro);
+    		}
+			return 0;
+		}
+	}
+}
+
+int
+coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
+{
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel,
+		CHANNEL_KIND_DATA | CHANNEL_KIND_PORT | CHANNEL_KIND_PRIO);
+	if (ch == nullptr)
+		return -1;
+	if (ch->levels != NULL)
+		return coro_bus_prio_try_recv_v(ch, data, 1) > 0 ? 0 : -1;
+	if (ch->port != NULL) {
+		if (!port_pop(ch->port, data)) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
 			return -1;
 		}
+		coro_bus_stat_received(ch, 1);
+		/* Only the local senders can wait, the other threads don't. */
+		if (!rlist_empty(&ch->send_queue.coros)) {
+			wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
+			coro_wakeup(sender->coro);
+		}
+		return 0;
+	}
+
+	if (data_ring_size(&ch->data) == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+
+	*data = data_ring_pop(&ch->data);
+	coro_bus_stat_received(ch, 1);
+
+	if (!rlist_empty(&ch->send_queue.coros)) {
+        wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
+		/* The freed place goes straight to the parked sender. */
+		if (sender->send_value != NULL) {
+			data_ring_push(&ch->data, *sender->send_value);
+			coro_bus_handoff_finish(sender);
+			coro_bus_stat_sent(ch, 1);
+			return 0;
+		}
+        coro_wakeup(sender->coro);
+	}
+	coro_bus_channel_update_full(bus, ch);
+
+	return 0;
+}
+
+
+#if NEED_BROADCAST
+
+int
+coro_bus_broadcast(struct coro_bus *bus, unsigned data)
+{
+	while (true) {
+		int result = coro_bus_try_broadcast(bus, data);
+		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL) {
+			return -1;
+		}
+		/*
+			We are only wating in one coroutine, this is more efficient and easier. 
+			Regardless of how the coroutine is awakened — by channel deletion or the appearance of space,
+			it works identically: it attempts to write to all open channels
+		*/
+		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK) {
+			if (rlist_empty(&bus->full_channels)) return -1;
+			coro_bus_channel* blocking_ch = rlist_first_entry(
+				&bus->full_channels, coro_bus_channel, full_link);
+
+			/* A close of the channel is a reason to retry too. */
+			coro_bus_channel_wait(blocking_ch, &blocking_ch->send_queue);
+			continue;
+		}
+
+		if (result == 0) {
+			coro_bus_channel* ch;
+			rlist_foreach_entry(ch, &bus->live_channels, live_link) {
+				if (!rlist_empty(&ch->send_queue.coros) && !ch->is_full) {
+					wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
+					coro_wakeup(sender->coro);
+				}
+			}
+			return 0;
+		}
+	}
+}
+
+int
+coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
+{
+    if (rlist_empty(&bus->live_channels)) {
+        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+        return -1;
+    }
+
+    if (bus->full_count > 0) {
+        coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+        return -1;
+    }
+
+    coro_bus_channel* ch;
+    rlist_foreach_entry(ch, &bus->live_channels, live_link) {
+        data_ring_push(&ch->data, data);
+        coro_bus_channel_update_full(bus, ch);
+        coro_bus_stat_sent(ch, 1);
+        if (!rlist_empty(&ch->recv_queue.coros)) {
+            wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
+            coro_wakeup(rec->coro);
+        }
+    }
+    return 0;
+}
+
+#endif
+
+/**
+ * Vector send into a level of a priority channel, or into a usual
+ * channel when the level is 0. @a kinds are the accepted channels.
+ */
+static int
+coro_bus_try_send_v_level(struct coro_bus *bus, int channel, const unsigned *data,
+	unsigned count, unsigned level, unsigned kinds)
+{
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel, kinds);
+	if (ch == nullptr)
+		return -1;
+	if (ch->levels != NULL)
+		return coro_bus_prio_try_send_v(ch, data, count, level);
+	if (ch->size_limit == data_ring_size(&ch->data)) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+
+	unsigned send_c = ch->size_limit - data_ring_size(&ch->data);
+	if (send_c > count)
+		send_c = count;
+	data_ring_push_v(&ch->data, data, send_c);
+	coro_bus_stat_sent(ch, send_c);
+	coro_bus_channel_update_full(bus, ch);
+
+	if (!rlist_empty(&ch->recv_queue.coros)) {
+        wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
+        coro_wakeup(rec->coro);
+    }
+
+	return send_c;
+}
+
+static int
+coro_bus_send_v_level(struct coro_bus *bus, int channel, const unsigned *data,
+	unsigned count, unsigned level, unsigned kinds)
+{
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel, kinds);
+	if (ch == nullptr)
+		return -1;
+
+	while (true) {
+		int result = coro_bus_try_send_v_level(bus, channel, data, count,
+			level, kinds);
+		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL) {
+			return -1;
+		}
+		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK) {
+			if (coro_bus_channel_wait(ch, &ch->send_queue) != 0)
+				return -1;
+			continue;
+		}
+
+		if (result >= 0) {
+			if (!rlist_empty(&ch->send_queue.coros) && coro_bus_channel_depth(ch) < ch->size_limit) {
+        		wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
+        		coro_wakeup(sender->coro);
+    		}
+			return result;
+		}
+	}
+}
+
+#if NEED_BATCH
+
+int
+coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+{
+	return coro_bus_send_v_level(bus, channel, data, count, 0,
+		CHANNEL_KIND_DATA | CHANNEL_KIND_PRIO);
+}
+
+int
+coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+{
+	return coro_bus_try_send_v_level(bus, channel, data, count, 0,
+		CHANNEL_KIND_DATA | CHANNEL_KIND_PRIO);
+}
+
+int
+coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+{
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel,
+		CHANNEL_KIND_DATA | CHANNEL_KIND_PRIO);
+	if (ch == nullptr)
+		return -1;
+
+	while (true) {
+		int result = coro_bus_try_recv_v(bus, channel, data, capacity);
+		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL) {
+			return -1;
+		}
+		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK) {
+			if (coro_bus_channel_wait(ch, &ch->recv_queue) != 0)
+				return -1;
+			continue;
+		}
+
+		if (result >= 0) {
+			if (!rlist_empty(&ch->recv_queue.coros) && !coro_bus_channel_is_empty(ch)) {
+        		wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
+        		coro_wakeup(rec->coro);
+    		}
+			return result;
+		}
+	}
+}
+
+int
+coro_bus_recv_v_min(struct coro_bus *bus, int channel, unsigned *data,
+	unsigned capacity, unsigned min_count, uint64_t linger_ns)
+{
+	coro_bus_channel *ch = coro_bus_channel_get(bus, channel,
+		CHANNEL_KIND_DATA | CHANNEL_KIND_PRIO);
+	if (ch == nullptr)
+		return -1;
+	/* More can never be there, the senders would block forever. */
+	size_t need = min_count;
+	if (need > capacity)
+		need = capacity;
+	if (need > ch->size_limit)
+		need = ch->size_limit;
+	/* The linger starts with the first message seen. */
+	uint64_t deadline = 0;
+	while (true) {
+		size_t depth = coro_bus_channel_depth(ch);
+		if (depth >= need)
+			break;
+		uint64_t timeout_ns = UINT64_MAX;
+		wakeup_entry we;
+		we.recv_slot = NULL;
+		we.send_value = NULL;
+		if (depth == 0) {
+			deadline = 0;
+		} else {
+			uint64_t now = coro_bus_clock_ns();
+			if (deadline == 0)
+				deadline = now + linger_ns;
+			if (now >= deadline)
+				break;
+			timeout_ns = deadline - now;
+			we.min_count = need;
+			/* The wakeup could be meant for a receiver behind. */
+			coro_bus_channel_pass_wakeup(ch);
+		}
+		if (coro_bus_channel_wait_entry_timeout(ch, &ch->recv_queue, &we,
+							timeout_ns) != 0)
+			return -1;
+	}
+	int result = coro_bus_try_recv_v(bus, channel, data, capacity);
+	if (result > 0)
+		coro_bus_channel_pass_wakeup(ch);
+	return result;
+}
+
+int
+coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+{
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel,
+		CHANNEL_KIND_DATA | CHANNEL_KIND_PRIO);
+	if (ch == nullptr)
+		return -1;
+	if (ch->levels != NULL)
+		return coro_bus_prio_try_recv_v(ch, data, capacity);
+	if (data_ring_size(&ch->data) == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+
+	unsigned recv_c = data_ring_size(&ch->data);
+	if (recv_c > capacity)
+		recv_c = capacity;
+	data_ring_pop_v(&ch->data, data, recv_c);
+	coro_bus_stat_received(ch, recv_c);
+	coro_bus_channel_update_full(bus, ch);
+
+	if (!rlist_empty(&ch->send_queue.coros)) {
+        wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
+        coro_wakeup(sender->coro);
+    }
+
+	return recv_c;	
+}
+
+#endif
+
+int
+coro_bus_send_prio(struct coro_bus *bus, int channel, unsigned data, unsigned level)
+{
+	if (coro_bus_send_v_level(bus, channel, &data, 1, level, CHANNEL_KIND_PRIO) < 0)
+		return -1;
+	return 0;
+}
+
+int
+coro_bus_try_send_prio(struct coro_bus *bus, int channel, unsigned data, unsigned level)
+{
+	if (coro_bus_try_send_v_level(bus, channel, &data, 1, level, CHANNEL_KIND_PRIO) < 0)
+		return -1;
+	return 0;
+}
+
+int
+coro_bus_send_v_prio(struct coro_bus *bus, int channel, const unsigned *data,
+	unsigned count, unsigned level)
+{
+	return coro_bus_send_v_level(bus, channel, data, count, level,
+		CHANNEL_KIND_PRIO);
+}
+
+int
+coro_bus_try_send_v_prio(struct coro_bus *bus, int channel, const unsigned *data,
+	unsigned count, unsigned level)
+{
+	return coro_bus_try_send_v_level(bus, channel, data, count, level,
+		CHANNEL_KIND_PRIO);
+}
+
+/** Header of a variable-size message in the byte ring. */
+typedef uint32_t buf_header_t;
+
+int
+coro_bus_send_buf(struct coro_bus *bus, int channel, const void *data, size_t size)
+{
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel, CHANNEL_KIND_BUF);
+	if (ch == nullptr)
+		return -1;
 
-		int result = coro_bus_try_send(bus, channel, data);
-		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL) {
-			return -1;
-		}
+	while (true) {
+		int result = coro_bus_try_send_buf(bus, channel, data, size);
 		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK) {
-			wakeup_entry we;
-			we.coro = coro_this();
-			rlist_create(&we.base);
-			rlist_add_tail(&ch->send_queue.coros, &we.base);
-			coro_suspend();
-			rlist_del(&we.base);
+			if (coro_bus_channel_wait(ch, &ch->send_queue) != 0)
+				return -1;
 			continue;
 		}
+		if (result == -1)
+			return -1;
 
-		if (result == 0) {
-			if (!rlist_empty(&ch->send_queue.coros) && ch->data.size() < ch->size_limit) {
-        		wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
-        		coro_wakeup(sender->coro);
-    		}
-			return 0;
+		if (!rlist_empty(&ch->send_queue.coros) && byte_ring_size(&ch->bytes) < ch->size_limit) {
+			wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
+			coro_wakeup(sender->coro);
 		}
+		return 0;
 	}
 }
 
 int
-coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
+coro_bus_try_send_buf(struct coro_bus *bus, int channel, const void *data, size_t size)
 {
-	if (channel < 0 || (size_t)channel >= bus->channels.size() || bus->channels[channel] == nullptr) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel, CHANNEL_KIND_BUF);
+	if (ch == nullptr)
 		return -1;
-	}
-
-	coro_bus_channel* ch = bus->channels[channel];
 
-	if (ch->size_limit == ch->data.size()) {
+	size_t need = sizeof(buf_header_t) + size;
+	/* Would never fit, no sense to wait. */
+	if (size > INT32_MAX || need > ch->size_limit) {
+		coro_bus_errno_set(CORO_BUS_ERR_MSG_SIZE);
+		return -1;
+	}
+	if (byte_ring_size(&ch->bytes) + need > ch->size_limit) {
 		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
 		return -1;
 	}
 
-	ch->data.push(data);
-
-    if (!rlist_empty(&ch->recv_queue.coros)) {
-        wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
-        coro_wakeup(rec->coro);
-    }
+	buf_header_t header = (buf_header_t)size;
+	byte_ring_write(&ch->bytes, &header, sizeof(header));
+	byte_ring_write(&ch->bytes, data, size);
+	coro_bus_stat_sent(ch, 1);
 
+	if (!rlist_empty(&ch->recv_queue.coros)) {
+		wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
+		coro_wakeup(rec->coro);
+	}
 	return 0;
 }
 
 int
-coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
+coro_bus_recv_buf(struct coro_bus *bus, int channel, void *data, size_t capacity)
 {
-	if (channel < 0 || (size_t)channel >= bus->channels.size() || bus->channels[channel] == nullptr) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel, CHANNEL_KIND_BUF);
+	if (ch == nullptr)
 		return -1;
-	}
-
-	coro_bus_channel* ch = bus->channels[channel];
 
 	while (true) {
-		if (ch->is_closed) {
-			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-			return -1;
-		}
-
-		int result = coro_bus_try_recv(bus, channel, data);
-		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL) {
-			return -1;
-		}
+		int result = coro_bus_try_recv_buf(bus, channel, data, capacity);
 		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK) {
-			wakeup_entry we;
-			we.coro = coro_this();
-			rlist_create(&we.base);
-			rlist_add_tail(&ch->recv_queue.coros, &we.base);
-			coro_suspend();
-			rlist_del(&we.base);
+			if (coro_bus_channel_wait(ch, &ch->recv_queue) != 0)
+				return -1;
 			continue;
 		}
+		if (result == -1)
+			return -1;
 
-		if (result == 0) {
-			if (!rlist_empty(&ch->recv_queue.coros) && ch->data.size() > 0) {
-        		wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
-        		coro_wakeup(rec->coro);
-    		}
-			return 0;
+		if (!rlist_empty(&ch->recv_queue.coros) && byte_ring_size(&ch->bytes) > 0) {
+			wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
+			coro_wakeup(rec->coro);
 		}
+		return result;
 	}
 }
 
 int
-coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
+coro_bus_try_recv_buf(struct coro_bus *bus, int channel, void *data, size_t capacity)
 {
-	if (channel < 0 || (size_t)channel >= bus->channels.size() || bus->channels[channel] == nullptr) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel, CHANNEL_KIND_BUF);
+	if (ch == nullptr)
 		return -1;
-	}
 
-	coro_bus_channel* ch = bus->channels[channel];
-
-	if (ch->data.size() == 0) {
+	if (byte_ring_size(&ch->bytes) == 0) {
 		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
 		return -1;
 	}
-
-	*data = ch->data.front();
-	ch->data.pop();
+	buf_header_t size;
+	byte_ring_peek(&ch->bytes, 0, &size, sizeof(size));
+	/* The message stays in the channel for a bigger buffer. */
+	if (size > capacity) {
+		coro_bus_errno_set(CORO_BUS_ERR_MSG_SIZE);
+		return -1;
+	}
+	byte_ring_peek(&ch->bytes, sizeof(size), data, size);
+	ch->bytes.head += sizeof(size) + size;
+	coro_bus_stat_received(ch, 1);
 
 	if (!rlist_empty(&ch->send_queue.coros)) {
-        wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
-        coro_wakeup(sender->coro);
+		wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
+		coro_wakeup(sender->coro);
 	}
-
-	return 0;
+	return (int)size;
 }
 
-
-#if NEED_BROADCAST
-
 int
-coro_bus_broadcast(struct coro_bus *bus, unsigned data)
+coro_bus_reserve(struct coro_bus *bus, int channel, unsigned count, struct coro_bus_span *span)
 {
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel, CHANNEL_KIND_DATA);
+	if (ch == nullptr)
+		return -1;
+
 	while (true) {
-		int result = coro_bus_try_broadcast(bus, data);
-		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL) {
-			return -1;
-		}
-		/*
-			We are only wating in one coroutine, this is more efficient and easier. 
-			Regardless of how the coroutine is awakened — by channel deletion or the appearance of space,
-			it works identically: it attempts to write to all open channels
-		*/
+		int result = coro_bus_try_reserve(bus, channel, count, span);
 		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK) {
-			coro_bus_channel* blocking_ch = nullptr;
-			for (coro_bus_channel* ch : bus->channels) {
-				if (ch != nullptr && !ch->is_closed && ch->size_limit == ch->data.size()) {
-					blocking_ch = ch;
-					break;
-				}
-			}
-			if (blocking_ch == nullptr) return -1;
-
-			wakeup_entry we;
-			we.coro = coro_this();
-			rlist_create(&we.base);
-			rlist_add_tail(&blocking_ch->send_queue.coros, &we.base);
-			coro_suspend();
-			rlist_del(&we.base);
+			if (coro_bus_channel_wait(ch, &ch->send_queue) != 0)
+				return -1;
 			continue;
 		}
-
-		if (result == 0) {
-			for (coro_bus_channel* ch : bus->channels) {
-				if (ch != nullptr && !rlist_empty(&ch->send_queue.coros) && ch->data.size() < ch->size_limit) {
-					wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
-					coro_wakeup(sender->coro);
-				}
-			}
-			return 0;
-		}
+		return result;
 	}
 }
 
 int
-coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
+coro_bus_try_reserve(struct coro_bus *bus, int channel, unsigned count, struct coro_bus_span *span)
 {
-    bool has_alive_channels = false;
-    
-    for (coro_bus_channel* ch : bus->channels) {
-        if (ch == nullptr || ch->is_closed) continue;
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel, CHANNEL_KIND_DATA);
+	if (ch == nullptr)
+		return -1;
 
-        has_alive_channels = true;
+	if (ch->size_limit == data_ring_size(&ch->data) || count == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	span->count = data_ring_tail_span(&ch->data, ch->size_limit, count, &span->data);
+	return span->count;
+}
 
-        if (ch->data.size() >= ch->size_limit) {
-            coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
-            return -1;
-        }
-    }
+int
+coro_bus_commit(struct coro_bus *bus, int channel, unsigned count)
+{
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel, CHANNEL_KIND_DATA);
+	if (ch == nullptr)
+		return -1;
 
-    if (!has_alive_channels) {
-        coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-        return -1;
-    }
+	assert(data_ring_size(&ch->data) + count <= ch->size_limit);
+	ch->data.tail += count;
+	coro_bus_stat_sent(ch, count);
+	coro_bus_channel_update_full(bus, ch);
 
-    for (coro_bus_channel* ch : bus->channels) {
-        if (ch != nullptr && !ch->is_closed) {
-            ch->data.push(data);
-            if (!rlist_empty(&ch->recv_queue.coros)) {
-                wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
-                coro_wakeup(rec->coro);
-            }
-        }
-    }
-    return 0;
+	if (count > 0 && !rlist_empty(&ch->recv_queue.coros)) {
+		wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
+		coro_wakeup(rec->coro);
+	}
+	/* Let the next sender use the rest of the space. */
+	if (!rlist_empty(&ch->send_queue.coros) && data_ring_size(&ch->data) < ch->size_limit) {
+		wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
+		coro_wakeup(sender->coro);
+	}
+	return 0;
 }
 
-#endif
-
-#if NEED_BATCH
-
 int
-coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+coro_bus_peek(struct coro_bus *bus, int channel, unsigned count, struct coro_bus_span *span)
 {
-	if (channel < 0 || (size_t)channel >= bus->channels.size() || bus->channels[channel] == nullptr) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel, CHANNEL_KIND_DATA);
+	if (ch == nullptr)
 		return -1;
-	}
-
-	coro_bus_channel* ch = bus->channels[channel];
 
 	while (true) {
-		if (ch->is_closed) {
-			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-			return -1;
-		}
-
-		int result = coro_bus_try_send_v(bus, channel, data, count);
-		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL) {
-			return -1;
-		}
+		int result = coro_bus_try_peek(bus, channel, count, span);
 		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK) {
-			wakeup_entry we;
-			we.coro = coro_this();
-			rlist_create(&we.base);
-			rlist_add_tail(&ch->send_queue.coros, &we.base);
-			coro_suspend();
-			rlist_del(&we.base);
+			if (coro_bus_channel_wait(ch, &ch->recv_queue) != 0)
+				return -1;
 			continue;
 		}
-
-		if (result >= 0) {
-			if (!rlist_empty(&ch->send_queue.coros) && ch->data.size() < ch->size_limit) {
-        		wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
-        		coro_wakeup(sender->coro);
-    		}
-			return result;
-		}
+		return result;
 	}
 }
 
 int
-coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
+coro_bus_try_peek(struct coro_bus *bus, int channel, unsigned count, struct coro_bus_span *span)
 {
-	if (channel < 0 || (size_t)channel >= bus->channels.size() || bus->channels[channel] == nullptr) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel, CHANNEL_KIND_DATA);
+	if (ch == nullptr)
 		return -1;
-	}
 
-	coro_bus_channel* ch = bus->channels[channel];
-	if (ch->size_limit == ch->data.size()) {
+	if (data_ring_size(&ch->data) == 0 || count == 0) {
 		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
 		return -1;
 	}
+	span->count = data_ring_head_span(&ch->data, count, &span->data);
+	return span->count;
+}
 
-	unsigned send_c = 0;
-	while (send_c < count && ch->data.size() != ch->size_limit) {
-		ch->data.push(data[send_c]);
-		send_c++;
-	}
+int
+coro_bus_consume(struct coro_bus *bus, int channel, unsigned count)
+{
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel, CHANNEL_KIND_DATA);
+	if (ch == nullptr)
+		return -1;
 
-	if (!rlist_empty(&ch->recv_queue.coros)) {
-        wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
-        coro_wakeup(rec->coro);
-    }
+	assert(count <= data_ring_size(&ch->data));
+	ch->data.head += count;
+	coro_bus_stat_received(ch, count);
+	coro_bus_channel_update_full(bus, ch);
 
-	return send_c;
+	if (count > 0 && !rlist_empty(&ch->send_queue.coros)) {
+		wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
+		coro_wakeup(sender->coro);
+	}
+	/* Let the next receiver take the rest. */
+	if (!rlist_empty(&ch->recv_queue.coros) && data_ring_size(&ch->data) > 0) {
+		wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
+		coro_wakeup(rec->coro);
+	}
+	return 0;
 }
 
 int
-coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+coro_bus_try_select(struct coro_bus *bus, const int *channels, unsigned count,
+	unsigned *data)
 {
-	if (channel < 0 || (size_t)channel >= bus->channels.size() || bus->channels[channel] == nullptr) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
-		return -1;
+	for (unsigned i = 0; i < count; ++i) {
+		if (coro_bus_try_recv(bus, channels[i], data) == 0)
+			return channels[i];
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
+			return -1;
 	}
+	coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+	return -1;
+}
 
-	coro_bus_channel* ch = bus->channels[channel];
 
+int
+coro_bus_select(struct coro_bus *bus, const int *channels, unsigned count,
+	unsigned *data)
+{
+	/* Most of the selects are on a few channels. */
+	enum { SELECT_STATIC_COUNT = 8 };
+	wakeup_entry static_entries[SELECT_STATIC_COUNT];
+	coro_bus_channel *static_chs[SELECT_STATIC_COUNT];
+	std::vector<wakeup_entry> dyn_entries;
+	std::vector<coro_bus_channel *> dyn_chs;
+	wakeup_entry *entries = static_entries;
+	coro_bus_channel **chs = static_chs;
+	if (count > SELECT_STATIC_COUNT) {
+		dyn_entries.resize(count);
+		dyn_chs.resize(count);
+		entries = dyn_entries.data();
+		chs = dyn_chs.data();
+	}
 	while (true) {
-		if (ch->is_closed) {
-			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		int result = coro_bus_try_select(bus, channels, count, data);
+		if (result >= 0 || coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
+			return result;
+		if (count == 0)
 			return -1;
+		/* Park once on every channel. */
+		struct coro *self = coro_this();
+		for (unsigned i = 0; i < count; ++i) {
+			chs[i] = bus->channels[channels[i]];
+			wakeup_entry *we = &entries[i];
+			we->coro = self;
+			we->recv_slot = NULL;
+			we->send_value = NULL;
+			we->is_done = false;
+			rlist_create(&we->base);
+			rlist_add_tail(&chs[i]->recv_queue.coros, &we->base);
+			++chs[i]->waiter_count;
 		}
-
-		int result = coro_bus_try_recv_v(bus, channel, data, capacity);
-		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL) {
-			return -1;
+		bool is_ready = false;
+		for (unsigned i = 0; i < count; ++i) {
+			if (chs[i]->port != NULL && coro_bus_port_arm(chs[i]))
+				is_ready = true;
 		}
-		if (result == -1 && coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK) {
-			wakeup_entry we;
-			we.coro = coro_this();
-			rlist_create(&we.base);
-			rlist_add_tail(&ch->recv_queue.coros, &we.base);
+		uint64_t start_ns = coro_bus_stat_wait_begin();
+		if (!is_ready) {
+			for (unsigned i = 0; i < count; ++i)
+				coro_bus_trace(chs[i], CORO_TRACE_BLOCK);
+			PROBE1(corobus, select__block, count);
 			coro_suspend();
-			rlist_del(&we.base);
-			continue;
+			PROBE1(corobus, select__unblock, count);
+		}
+		bool is_closed = false;
+		for (unsigned i = 0; i < count; ++i) {
+			coro_bus_stat_wait_end(chs[i], false, start_ns);
+			rlist_del(&entries[i].base);
+			--chs[i]->waiter_count;
+		}
+		for (unsigned i = 0; i < count; ++i) {
+			coro_bus_channel *ch = chs[i];
+			if (ch == NULL)
+				continue;
+			if (!ch->is_closed) {
+				if (ch->port != NULL)
+					coro_bus_port_arm(ch);
+				coro_bus_channel_pass_wakeup(ch);
+				continue;
+			}
+			is_closed = true;
+			/* The same channel can be listed more than once. */
+			if (ch->waiter_count != 0)
+				continue;
+			for (unsigned j = i + 1; j < count; ++j) {
+				if (chs[j] == ch)
+					chs[j] = NULL;
+			}
+			coro_bus_channel_delete(ch);
+		}
+		if (is_closed) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
 		}
+	}
+}
 
-		if (result >= 0) {
-			if (!rlist_empty(&ch->recv_queue.coros) && ch->data.size() > 0) {
-        		wakeup_entry *rec = rlist_first_entry(&ch->recv_queue.coros, wakeup_entry, base);
-        		coro_wakeup(rec->coro);
-    		}
-			return result;
+/** Find a subscriber of an open topic channel. */
+static struct coro_bus_channel *
+coro_bus_topic_get(struct coro_bus *bus, int channel, int sub)
+{
+	coro_bus_channel *ch = coro_bus_channel_get(bus, channel, CHANNEL_KIND_TOPIC);
+	if (ch == nullptr)
+		return nullptr;
+	if (sub < 0 || (size_t)sub >= ch->topic->cursors.size() ||
+	    ch->topic->cursors[sub] == TOPIC_CURSOR_FREE) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return nullptr;
+	}
+	return ch;
+}
+
+/**
+ * A subscriber at the gate has moved on or left. When it was the
+ * last one there, the publishers can have space now.
+ */
+static void
+coro_bus_topic_leave_gate(struct coro_bus_channel *ch, size_t cursor)
+{
+	if (cursor != ch->data.head || --ch->topic->gate_count != 0)
+		return;
+	if (!rlist_empty(&ch->send_queue.coros)) {
+		wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
+		coro_wakeup(sender->coro);
+	}
+}
+
+/** Move the gate to the slowest subscriber. It is O(subscribers). */
+static void
+coro_bus_topic_scan(struct coro_bus_channel *ch)
+{
+	struct coro_bus_topic *topic = ch->topic;
+	size_t tail = ch->data.tail;
+	size_t gate = tail;
+	size_t gate_count = 0;
+	for (size_t cursor : topic->cursors) {
+		if (cursor == TOPIC_CURSOR_FREE)
+			continue;
+		/* Positions grow forever, compare the distances to the tail. */
+		if (tail - cursor > tail - gate) {
+			gate = cursor;
+			gate_count = 1;
+		} else if (cursor == gate) {
+			++gate_count;
 		}
 	}
+	ch->data.head = gate;
+	topic->gate_count = gate_count;
 }
 
 int
-coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
+coro_bus_topic_subscribe(struct coro_bus *bus, int channel)
 {
-	if (channel < 0 || (size_t)channel >= bus->channels.size() || bus->channels[channel] == nullptr) {
-		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_channel *ch = coro_bus_channel_get(bus, channel, CHANNEL_KIND_TOPIC);
+	if (ch == nullptr)
 		return -1;
+	struct coro_bus_topic *topic = ch->topic;
+	size_t cursor = ch->data.tail;
+	if (cursor == ch->data.head)
+		++topic->gate_count;
+	if (!topic->free_subs.empty()) {
+		int sub = topic->free_subs.back();
+		topic->free_subs.pop_back();
+		topic->cursors[sub] = cursor;
+		return sub;
 	}
+	topic->cursors.push_back(cursor);
+	return (int)(topic->cursors.size() - 1);
+}
 
-	coro_bus_channel* ch = bus->channels[channel];
-	if (ch->data.size() == 0) {
+int
+coro_bus_topic_unsubscribe(struct coro_bus *bus, int channel, int sub)
+{
+	coro_bus_channel *ch = coro_bus_topic_get(bus, channel, sub);
+	if (ch == nullptr)
+		return -1;
+	struct coro_bus_topic *topic = ch->topic;
+	size_t cursor = topic->cursors[sub];
+	topic->cursors[sub] = TOPIC_CURSOR_FREE;
+	topic->free_subs.push_back(sub);
+	coro_bus_topic_leave_gate(ch, cursor);
+	return 0;
+}
+
+int
+coro_bus_topic_try_publish(struct coro_bus *bus, int channel, unsigned data)
+{
+	coro_bus_channel *ch = coro_bus_channel_get(bus, channel, CHANNEL_KIND_TOPIC);
+	if (ch == nullptr)
+		return -1;
+	if (data_ring_size(&ch->data) >= ch->size_limit) {
+		coro_bus_topic_scan(ch);
+		if (data_ring_size(&ch->data) >= ch->size_limit) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+	}
+	data_ring_push(&ch->data, data);
+	coro_bus_stat_sent(ch, 1);
+	/* Each of the parked receivers has a new message now. */
+	struct wakeup_entry *item;
+	rlist_foreach_entry(item, &ch->recv_queue.coros, base)
+		coro_wakeup(item->coro);
+	return 0;
+}
+
+int
+coro_bus_topic_publish(struct coro_bus *bus, int channel, unsigned data)
+{
+	while (true) {
+		if (coro_bus_topic_try_publish(bus, channel, data) == 0)
+			break;
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
+			return -1;
+		coro_bus_channel *ch = bus->channels[channel];
+		if (coro_bus_channel_wait(ch, &ch->send_queue) != 0)
+			return -1;
+	}
+	coro_bus_channel *ch = bus->channels[channel];
+	if (!rlist_empty(&ch->send_queue.coros) &&
+	    data_ring_size(&ch->data) < ch->size_limit) {
+		wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
+		coro_wakeup(sender->coro);
+	}
+	return 0;
+}
+
+int
+coro_bus_topic_try_recv(struct coro_bus *bus, int channel, int sub,
+	unsigned *data)
+{
+	coro_bus_channel *ch = coro_bus_topic_get(bus, channel, sub);
+	if (ch == nullptr)
+		return -1;
+	size_t &cursor = ch->topic->cursors[sub];
+	if (cursor == ch->data.tail) {
 		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
 		return -1;
 	}
+	*data = ch->data.buf[cursor & ch->data.mask];
+	coro_bus_topic_leave_gate(ch, cursor++);
+	coro_bus_stat_received(ch, 1);
+	return 0;
+}
 
-	unsigned recv_c = 0;
-	while (recv_c < capacity && ch->data.size() != 0) {
-		data[recv_c] = ch->data.front();
-		ch->data.pop();
-		recv_c++;
+int
+coro_bus_topic_recv(struct coro_bus *bus, int channel, int sub,
+	unsigned *data)
+{
+	while (true) {
+		if (coro_bus_topic_try_recv(bus, channel, sub, data) == 0)
+			return 0;
+		if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
+			return -1;
+		coro_bus_channel *ch = bus->channels[channel];
+		if (coro_bus_channel_wait(ch, &ch->recv_queue) != 0)
+			return -1;
 	}
+}
 
-	if (!rlist_empty(&ch->send_queue.coros)) {
-        wakeup_entry *sender = rlist_first_entry(&ch->send_queue.coros, wakeup_entry, base);
-        coro_wakeup(sender->coro);
-    }
+#if NEED_STATS
 
-	return recv_c;	
+int
+coro_bus_channel_stats(struct coro_bus *bus, int channel,
+	struct coro_bus_channel_stats *stats)
+{
+	coro_bus_channel* ch = coro_bus_channel_get(bus, channel,
+		CHANNEL_KIND_DATA | CHANNEL_KIND_BUF | CHANNEL_KIND_PORT |
+		CHANNEL_KIND_PRIO | CHANNEL_KIND_TOPIC);
+	if (ch == nullptr)
+		return -1;
+	coro_bus_channel_stats_get(ch, stats);
+	return 0;
+}
+
+void
+coro_bus_stats(struct coro_bus *bus, struct coro_bus_channel_stats *stats)
+{
+	*stats = bus->closed_stats;
+	for (coro_bus_channel *ch : bus->channels) {
+		if (ch == nullptr)
+			continue;
+		struct coro_bus_channel_stats ch_stats;
+		coro_bus_channel_stats_get(ch, &ch_stats);
+		coro_bus_stats_add(stats, &ch_stats);
+	}
 }
 
 #endif
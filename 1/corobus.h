@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
 /**
  * Here you should specify which bonuses do you want via the
@@ -9,21 +10,25 @@
  */
 #define NEED_BROADCAST 1
 #define NEED_BATCH 1
+/** Channel counters. Cost a few increments per operation. */
+#define NEED_STATS 1
 
 enum coro_bus_error_code {
 	CORO_BUS_ERR_NONE = 0,
 	CORO_BUS_ERR_NO_CHANNEL,
 	CORO_BUS_ERR_WOULD_BLOCK,
 	CORO_BUS_ERR_NOT_IMPLEMENTED,
+	/** A variable-size message doesn't fit the channel or buffer. */
+	CORO_BUS_ERR_MSG_SIZE,
 };
 
 struct coro_bus;
 
-/** Get the latest error happened in coro_bus. */
+/** Get the latest error happened in coro_bus in this thread. */
 enum coro_bus_error_code
 coro_bus_errno(void);
 
-/** Set the global coro_bus error. */
+/** Set the coro_bus error of this thread. */
 void
 coro_bus_errno_set(enum coro_bus_error_code err);
 
@@ -31,6 +36,13 @@ coro_bus_errno_set(enum coro_bus_error_code err);
 struct coro_bus *
 coro_bus_new(void);
 
+/**
+ * Same as coro_bus_new(), but with memory preallocated for the
+ * given number of channels.
+ */
+struct coro_bus *
+coro_bus_new_ex(size_t channel_count_hint);
+
 /**
  * Destroy the bus and all its channels. The channels can not have
  * any suspended coroutines, but might have unconsumed data which
@@ -244,4 +256,485 @@ int
 coro_bus_try_recv_v(struct coro_bus *bus, int channel,
 	unsigned *data, unsigned capacity);
 
+/**
+ * Same as coro_bus_recv_v(), but waits for a bigger batch. After
+ * the first message is in the channel, the coroutine stays
+ * suspended until there are @a min_count of them, or until
+ * @a linger_ns has passed. Then it takes whatever there is. It
+ * bounds the extra latency, while the per-batch costs of the
+ * consumer are paid less often.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel to recv data from.
+ * @param data Array to save the received messages into.
+ * @param capacity Capacity of @a data.
+ * @param min_count Batch size to wait for. It is cut down to the
+ *     capacity and to the channel size limit.
+ * @param linger_ns Max time to wait for the batch to fill up.
+ *
+ * @retval >0 Success, how many messages were received.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_recv_v_min(struct coro_bus *bus, int channel, unsigned *data,
+	unsigned capacity, unsigned min_count, uint64_t linger_ns);
+
 #endif /* Bonus 2 */
+
+/**
+ * Create a channel for variable-size messages. They are stored
+ * inline in the channel memory, each one costs a copy on send and
+ * on receive, no allocations. The unsigned-message functions and
+ * broadcast don't see such channels.
+ * @param bus The bus to create the channel in.
+ * @param size_limit Maximum bytes a channel can hold in memory at
+ *     once. Each message takes 4 bytes more than its payload.
+ *
+ * @retval >=0 Descriptor of the channel.
+ */
+int
+coro_bus_channel_open_buf(struct coro_bus *bus, size_t size_limit);
+
+/**
+ * Send a variable-size message. If the channel doesn't have space
+ * for it, the coroutine is suspended until it has.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of a variable-size message channel.
+ * @param data Payload to copy into the channel.
+ * @param size Size of the payload in bytes.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_MSG_SIZE - the message is bigger than the
+ *       channel capacity.
+ */
+int
+coro_bus_send_buf(struct coro_bus *bus, int channel,
+	const void *data, size_t size);
+
+/**
+ * Same as coro_bus_send_buf(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_MSG_SIZE - the message is bigger than the
+ *       channel capacity.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - not enough space now.
+ */
+int
+coro_bus_try_send_buf(struct coro_bus *bus, int channel,
+	const void *data, size_t size);
+
+/**
+ * Receive a variable-size message. If the channel is empty, the
+ * coroutine is suspended until a message arrives.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of a variable-size message channel.
+ * @param data Buffer to copy the payload to.
+ * @param capacity Size of @a data.
+ *
+ * @retval >=0 Success, size of the received payload.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_MSG_SIZE - the next message is bigger than
+ *       @a capacity. It stays in the channel.
+ */
+int
+coro_bus_recv_buf(struct coro_bus *bus, int channel,
+	void *data, size_t capacity);
+
+/**
+ * Same as coro_bus_recv_buf(), but never suspends.
+ *
+ * @retval >=0 Success, size of the received payload.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_MSG_SIZE - the next message is bigger than
+ *       @a capacity. It stays in the channel.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ */
+int
+coro_bus_try_recv_buf(struct coro_bus *bus, int channel,
+	void *data, size_t capacity);
+
+/** A piece of channel memory for the zero-copy send and receive. */
+struct coro_bus_span {
+	unsigned *data;
+	unsigned count;
+};
+
+/**
+ * Reserve space for messages right in the channel memory. The
+ * caller writes them into @a span, and then publishes with
+ * coro_bus_commit(). If the channel is full, the coroutine is
+ * suspended until there is space. The span is contiguous, so it
+ * can be shorter than requested even when the channel has more
+ * space. The coroutine must not yield between reserve and commit.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel.
+ * @param count Max number of messages to reserve.
+ * @param span Output reserved memory.
+ *
+ * @retval >0 Success, how many messages are reserved.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_reserve(struct coro_bus *bus, int channel, unsigned count,
+	struct coro_bus_span *span);
+
+/**
+ * Same as coro_bus_reserve(), but never suspends.
+ *
+ * @retval >0 Success, how many messages are reserved.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int
+coro_bus_try_reserve(struct coro_bus *bus, int channel, unsigned count,
+	struct coro_bus_span *span);
+
+/**
+ * Publish the first @a count messages of the last reserved span.
+ * It is fine to commit less than reserved.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_commit(struct coro_bus *bus, int channel, unsigned count);
+
+/**
+ * Get the oldest messages right in the channel memory, without a
+ * copy. They stay in the channel until coro_bus_consume(). If the
+ * channel is empty, the coroutine is suspended until it is not.
+ * The span is contiguous, so it can have less messages than the
+ * channel. The coroutine must not yield between peek and consume.
+ * @param bus Bus where the channel is located.
+ * @param channel Descriptor of the channel.
+ * @param count Max number of messages to peek.
+ * @param span Output messages.
+ *
+ * @retval >0 Success, how many messages are in the span.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_peek(struct coro_bus *bus, int channel, unsigned count,
+	struct coro_bus_span *span);
+
+/**
+ * Same as coro_bus_peek(), but never suspends.
+ *
+ * @retval >0 Success, how many messages are in the span.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ */
+int
+coro_bus_try_peek(struct coro_bus *bus, int channel, unsigned count,
+	struct coro_bus_span *span);
+
+/**
+ * Remove the first @a count messages of the last peeked span from
+ * the channel.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_consume(struct coro_bus *bus, int channel, unsigned count);
+
+/**
+ * Receive a message from whichever of the channels has one first.
+ * The channels are checked in the given order. If all of them are
+ * empty, the coroutine is suspended on all of them at once until
+ * any gets a message.
+ * @param bus Bus where the channels are located.
+ * @param channels Descriptors of the channels.
+ * @param count Number of the channels.
+ * @param data Output message.
+ *
+ * @retval >=0 Success, descriptor of the channel the message is
+ *     from.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - one of the channels doesn't
+ *       exist or is closed during the wait.
+ */
+int
+coro_bus_select(struct coro_bus *bus, const int *channels, unsigned count,
+	unsigned *data);
+
+/**
+ * Same as coro_bus_select(), but never suspends.
+ *
+ * @retval >=0 Success, descriptor of the channel the message is
+ *     from.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - one of the channels doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - all the channels are empty.
+ */
+int
+coro_bus_try_select(struct coro_bus *bus, const int *channels, unsigned count,
+	unsigned *data);
+
+/** Thread-safe producer end of a port channel. */
+struct coro_bus_port;
+
+/**
+ * Open a channel which can be fed by threads outside of the
+ * coroutine scheduler. The messages go through a lock-free ring,
+ * and the receivers in the scheduler are woken up right from the
+ * sending thread. The size limit is rounded up to a power of 2,
+ * at least 2.
+ *
+ * The coroutines use the channel with coro_bus_send(),
+ * coro_bus_recv(), their try-versions and coro_bus_select(). The
+ * other threads send via coro_bus_channel_port(). While they can
+ * send anything, they should keep the scheduler running with
+ * coro_sched_hold(). The vector, zero-copy and broadcast sends
+ * don't work with such channels.
+ * @param bus Bus to open the channel in.
+ * @param size_limit Max number of messages in the channel.
+ *
+ * @retval >=0 Descriptor of the channel.
+ */
+int
+coro_bus_channel_open_port(struct coro_bus *bus, size_t size_limit);
+
+/**
+ * Get the producer end of a port channel. It can be used by any
+ * number of threads until the channel is closed. The channel must
+ * not be closed while anybody still sends.
+ *
+ * @retval Not NULL The port.
+ * @retval NULL Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist or is
+ *       not a port one.
+ */
+struct coro_bus_port *
+coro_bus_channel_port(struct coro_bus *bus, int channel);
+
+/**
+ * Send a message into a port channel from any thread. Never
+ * blocks. Wakes up a receiver suspended on the channel.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int
+coro_bus_port_try_send(struct coro_bus_port *port, unsigned data);
+
+/**
+ * Open a topic channel. Unlike coro_bus_broadcast(), a message
+ * published into a topic is stored once, in a ring shared by all
+ * the subscribers. Each subscriber has its own read position, and
+ * the slowest of them holds the publishers back when the ring is
+ * full. The size limit is how far behind the slowest subscriber
+ * can be. The usual send and receive functions don't work with
+ * topics.
+ * @param bus Bus to open the channel in.
+ * @param size_limit Max number of messages kept for the slowest
+ *     subscriber.
+ *
+ * @retval >=0 Descriptor of the channel.
+ */
+int
+coro_bus_channel_open_topic(struct coro_bus *bus, size_t size_limit);
+
+/**
+ * Subscribe to a topic. The subscriber gets only the messages
+ * published after that.
+ *
+ * @retval >=0 Descriptor of the subscriber, unique inside the
+ *     topic.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist or is
+ *       not a topic.
+ */
+int
+coro_bus_topic_subscribe(struct coro_bus *bus, int channel);
+
+/**
+ * Drop the subscriber. Its unread messages don't hold the
+ * publishers back anymore. Its descriptor can be reused. The
+ * subscriber must not be waited for.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel or the subscriber
+ *       doesn't exist.
+ */
+int
+coro_bus_topic_unsubscribe(struct coro_bus *bus, int channel, int sub);
+
+/**
+ * Publish a message to all the subscribers of the topic. If the
+ * slowest of them is size_limit messages behind, the coroutine is
+ * suspended until it reads.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_topic_publish(struct coro_bus *bus, int channel, unsigned data);
+
+/**
+ * Same as coro_bus_topic_publish(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the slowest subscriber is too
+ *       far behind.
+ */
+int
+coro_bus_topic_try_publish(struct coro_bus *bus, int channel, unsigned data);
+
+/**
+ * Receive the next message of the subscriber. If it has read all
+ * of them, the coroutine is suspended until a new one is
+ * published.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel or the subscriber
+ *       doesn't exist.
+ */
+int
+coro_bus_topic_recv(struct coro_bus *bus, int channel, int sub,
+	unsigned *data);
+
+/**
+ * Same as coro_bus_topic_recv(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel or the subscriber
+ *       doesn't exist.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - no new messages.
+ */
+int
+coro_bus_topic_try_recv(struct coro_bus *bus, int channel, int sub,
+	unsigned *data);
+
+#if NEED_STATS
+
+/** Counters of a channel, or summed over all channels of a bus. */
+struct coro_bus_channel_stats {
+	/** Messages put into the channel. */
+	uint64_t sent;
+	/** Messages taken from the channel. */
+	uint64_t received;
+	/** How many times a sender was suspended on a full channel. */
+	uint64_t send_blocked;
+	/** How many times a receiver was suspended on an empty one. */
+	uint64_t recv_blocked;
+	/**
+	 * Current size of the channel. In the same units as the size
+	 * limit: messages, or bytes for the variable-size messages.
+	 */
+	size_t depth;
+	/** The biggest depth the channel has ever had. */
+	size_t peak_depth;
+	/** Total time the senders and receivers were suspended, ns. */
+	uint64_t suspended_ns;
+};
+
+/**
+ * Get the counters of a channel. For the port channels the peak
+ * depth is sampled by the receivers.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_channel_stats(struct coro_bus *bus, int channel,
+	struct coro_bus_channel_stats *stats);
+
+/**
+ * Get the counters summed over all the channels of the bus,
+ * including the closed ones. The peak depth is the max of the
+ * channels' peaks.
+ */
+void
+coro_bus_stats(struct coro_bus *bus, struct coro_bus_channel_stats *stats);
+
+#endif /* NEED_STATS */
+
+/**
+ * Open a channel with @a level_count priority levels. The higher
+ * the level, the sooner its messages are received: any receive
+ * takes from the highest non-empty level. The order within a level
+ * is FIFO. coro_bus_send() and coro_bus_send_v() put messages into
+ * level 0. The size limit is shared by all the levels. Zero-copy
+ * and broadcast sends don't work with such channels.
+ * @param bus Bus to open the channel in.
+ * @param size_limit Max number of messages in all the levels.
+ * @param level_count Number of the levels. 0 means 1.
+ *
+ * @retval >=0 Descriptor of the channel.
+ */
+int
+coro_bus_channel_open_prio(struct coro_bus *bus, size_t size_limit,
+	unsigned level_count);
+
+/**
+ * Same as coro_bus_send(), but into the given level of a priority
+ * channel. Levels above the top one mean the top one.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist or has
+ *       no priorities.
+ */
+int
+coro_bus_send_prio(struct coro_bus *bus, int channel, unsigned data,
+	unsigned level);
+
+/**
+ * Same as coro_bus_send_prio(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist or has
+ *       no priorities.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int
+coro_bus_try_send_prio(struct coro_bus *bus, int channel, unsigned data,
+	unsigned level);
+
+/**
+ * Same as coro_bus_send_v(), but into the given level of a
+ * priority channel. The messages keep their order in the level.
+ *
+ * @retval >0 Success, how many messages were sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist or has
+ *       no priorities.
+ */
+int
+coro_bus_send_v_prio(struct coro_bus *bus, int channel,
+	const unsigned *data, unsigned count, unsigned level);
+
+/**
+ * Same as coro_bus_send_v_prio(), but never suspends.
+ *
+ * @retval >0 Success, how many messages were sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist or has
+ *       no priorities.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int
+coro_bus_try_send_v_prio(struct coro_bus *bus, int channel,
+	const unsigned *data, unsigned count, unsigned level);
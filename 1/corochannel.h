@@ -0,0 +1,516 @@
+#pragma once
+
+/**
+ * Typed channel for the coroutines of one scheduler thread. The
+ * semantics are the same as of the unsigned channels of coro_bus:
+ * a sender suspends while the channel is full, a receiver while it
+ * is empty, a parked receiver gets a message bypassing the queue,
+ * and a parked sender gets its message into the place freed by a
+ * receiver. Errors are reported via coro_bus_errno().
+ *
+ * The capacity is known at compile time, so the messages live right
+ * in the object, in a ring indexed with a mask. Trivially copyable
+ * messages are copied in batches with memcpy, the others are moved
+ * one by one.
+ */
+#include "corobus.h"
+#include "libcoro.h"
+#include "rlist.h"
+
+#include <assert.h>
+#include <new>
+#include <string.h>
+#include <type_traits>
+#include <utility>
+
+namespace libcoro {
+
+template<typename T, size_t Capacity>
+class channel
+{
+	static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+		"the capacity must be a power of 2");
+
+public:
+	channel()
+		: m_head(0)
+		, m_tail(0)
+		, m_waiter_count(0)
+		, m_is_closed(false)
+	{
+		rlist_create(&m_send_queue);
+		rlist_create(&m_recv_queue);
+	}
+
+	/**
+	 * The channel can't have suspended coroutines, even the ones
+	 * already woken up by close(). The unconsumed messages are
+	 * destroyed.
+	 */
+	~channel()
+	{
+		assert(m_waiter_count == 0);
+		drop();
+	}
+
+	channel(const channel &) = delete;
+	channel &operator=(const channel &) = delete;
+
+	/**
+	 * Wake up all the suspended coroutines with the
+	 * CORO_BUS_ERR_NO_CHANNEL error, drop the pending messages.
+	 * All the next operations fail with the same error.
+	 */
+	void
+	close()
+	{
+		m_is_closed = true;
+		drop();
+		wakeup_all(&m_send_queue);
+		wakeup_all(&m_recv_queue);
+	}
+
+	bool
+	is_closed() const
+	{
+		return m_is_closed;
+	}
+
+	size_t
+	size() const
+	{
+		return m_tail - m_head;
+	}
+
+	static constexpr size_t
+	capacity()
+	{
+		return Capacity;
+	}
+
+	/**
+	 * Send the message, suspend while the channel is full.
+	 * @retval 0 Success.
+	 * @retval -1 Error. CORO_BUS_ERR_NO_CHANNEL - the channel is
+	 *     closed.
+	 */
+	int
+	send(T value)
+	{
+		while (true) {
+			if (try_send(std::move(value)) == 0) {
+				pass_send_wakeup();
+				return 0;
+			}
+			if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
+				return -1;
+			struct waiter w;
+			w.send_value = &value;
+			if (wait(&m_send_queue, &w) != 0)
+				return -1;
+			if (w.is_done)
+				return 0;
+		}
+	}
+
+	/**
+	 * Same as send(), but fails with CORO_BUS_ERR_WOULD_BLOCK
+	 * instead of suspending. The value is moved only on success.
+	 */
+	int
+	try_send(T &&value)
+	{
+		if (m_is_closed) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+		if (size() == Capacity) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		if (size() == 0 && !rlist_empty(&m_recv_queue)) {
+			struct waiter *w = first_waiter(&m_recv_queue);
+			if (w->recv_slot != NULL) {
+				*w->recv_slot = std::move(value);
+				handoff_finish(w);
+				return 0;
+			}
+		}
+		new (slot(m_tail)) T(std::move(value));
+		++m_tail;
+		wakeup_first(&m_recv_queue);
+		return 0;
+	}
+
+	int
+	try_send(const T &value)
+	{
+		T copy(value);
+		return try_send(std::move(copy));
+	}
+
+	/**
+	 * Receive a message, suspend while the channel is empty.
+	 * @retval 0 Success, the message is moved into @a value.
+	 * @retval -1 Error. CORO_BUS_ERR_NO_CHANNEL - the channel is
+	 *     closed.
+	 */
+	int
+	recv(T *value)
+	{
+		while (true) {
+			if (try_recv(value) == 0) {
+				pass_recv_wakeup();
+				return 0;
+			}
+			if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
+				return -1;
+			struct waiter w;
+			w.recv_slot = value;
+			if (wait(&m_recv_queue, &w) != 0)
+				return -1;
+			if (w.is_done)
+				return 0;
+		}
+	}
+
+	/**
+	 * Same as recv(), but fails with CORO_BUS_ERR_WOULD_BLOCK
+	 * instead of suspending.
+	 */
+	int
+	try_recv(T *value)
+	{
+		if (m_is_closed) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+		if (size() == 0) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		T *src = slot(m_head);
+		*value = std::move(*src);
+		src->~T();
+		++m_head;
+		if (rlist_empty(&m_send_queue))
+			return 0;
+		struct waiter *w = first_waiter(&m_send_queue);
+		/* The freed place goes straight to the parked sender. */
+		if (w->send_value != NULL) {
+			new (slot(m_tail)) T(std::move(*w->send_value));
+			++m_tail;
+			handoff_finish(w);
+			return 0;
+		}
+		coro_wakeup(w->coro);
+		return 0;
+	}
+
+	/**
+	 * Send as many messages as fit, suspend while none do. The
+	 * sent messages are copied.
+	 * @retval >0 How many first messages of @a data were sent.
+	 * @retval -1 Error. CORO_BUS_ERR_NO_CHANNEL - the channel is
+	 *     closed.
+	 */
+	int
+	send_v(const T *data, size_t count)
+	{
+		return send_range(data, count);
+	}
+
+	/** Same as send_v(), but the sent messages are moved. */
+	int
+	send_v(T *data, size_t count)
+	{
+		return send_range(data, count);
+	}
+
+	/**
+	 * Same as send_v(), but fails with CORO_BUS_ERR_WOULD_BLOCK if
+	 * the channel is full.
+	 */
+	int
+	try_send_v(const T *data, size_t count)
+	{
+		return try_send_range(data, count);
+	}
+
+	int
+	try_send_v(T *data, size_t count)
+	{
+		return try_send_range(data, count);
+	}
+
+	/**
+	 * Receive as many messages as there are, up to @a capacity.
+	 * Suspend while the channel is empty.
+	 * @retval >0 How many messages were moved into @a data.
+	 * @retval -1 Error. CORO_BUS_ERR_NO_CHANNEL - the channel is
+	 *     closed.
+	 */
+	int
+	recv_v(T *data, size_t capacity)
+	{
+		while (true) {
+			int rc = try_recv_v(data, capacity);
+			if (rc > 0) {
+				pass_recv_wakeup();
+				return rc;
+			}
+			if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
+				return -1;
+			struct waiter w;
+			if (wait(&m_recv_queue, &w) != 0)
+				return -1;
+		}
+	}
+
+	/**
+	 * Same as recv_v(), but fails with CORO_BUS_ERR_WOULD_BLOCK if
+	 * the channel is empty.
+	 */
+	int
+	try_recv_v(T *data, size_t capacity)
+	{
+		if (m_is_closed) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+		size_t count = size();
+		if (count > capacity)
+			count = capacity;
+		if (count == 0) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		if constexpr (std::is_trivially_copyable<T>::value) {
+			size_t pos = m_head & (Capacity - 1);
+			size_t first = Capacity - pos;
+			if (first > count)
+				first = count;
+			memcpy((void *)data, slot(m_head), first * sizeof(T));
+			memcpy((void *)(data + first), slot(0),
+				(count - first) * sizeof(T));
+			m_head += count;
+		} else {
+			for (size_t i = 0; i < count; ++i, ++m_head) {
+				T *src = slot(m_head);
+				data[i] = std::move(*src);
+				src->~T();
+			}
+		}
+		/* Batch senders are woken, the single ones get handoffs. */
+		while (size() < Capacity && !rlist_empty(&m_send_queue)) {
+			struct waiter *w = first_waiter(&m_send_queue);
+			if (w->send_value == NULL) {
+				coro_wakeup(w->coro);
+				break;
+			}
+			new (slot(m_tail)) T(std::move(*w->send_value));
+			++m_tail;
+			handoff_finish(w);
+		}
+		return (int)count;
+	}
+
+private:
+	/** A coroutine suspended in one of the queues. */
+	struct waiter {
+		struct rlist link;
+		struct coro *coro;
+		/**
+		 * Where a parked receiver wants its message. NULL if it
+		 * can't take a handoff.
+		 */
+		T *recv_slot = NULL;
+		/** Message of a parked sender, to be moved by a receiver. */
+		T *send_value = NULL;
+		/** The operation was completed by the peer. */
+		bool is_done = false;
+	};
+
+	T *
+	slot(size_t pos)
+	{
+		return reinterpret_cast<T *>(m_buf) + (pos & (Capacity - 1));
+	}
+
+	void
+	drop()
+	{
+		if constexpr (!std::is_trivially_destructible<T>::value) {
+			for (; m_head != m_tail; ++m_head)
+				slot(m_head)->~T();
+		}
+		m_head = m_tail;
+	}
+
+	static struct waiter *
+	first_waiter(struct rlist *queue)
+	{
+		return rlist_first_entry(queue, struct waiter, link);
+	}
+
+	static void
+	wakeup_first(struct rlist *queue)
+	{
+		if (!rlist_empty(queue))
+			coro_wakeup(first_waiter(queue)->coro);
+	}
+
+	static void
+	wakeup_all(struct rlist *queue)
+	{
+		struct waiter *w;
+		rlist_foreach_entry(w, queue, link)
+			coro_wakeup(w->coro);
+	}
+
+	/**
+	 * A woken sender could take only a part of the freed space.
+	 * Let the next one use the rest.
+	 */
+	void
+	pass_send_wakeup()
+	{
+		if (size() < Capacity)
+			wakeup_first(&m_send_queue);
+	}
+
+	void
+	pass_recv_wakeup()
+	{
+		if (size() > 0)
+			wakeup_first(&m_recv_queue);
+	}
+
+	/**
+	 * Complete the operation of a waiter on its behalf. It leaves
+	 * the queue right away, so nobody can hand it a second message.
+	 */
+	static void
+	handoff_finish(struct waiter *w)
+	{
+		w->is_done = true;
+		rlist_del(&w->link);
+		coro_wakeup(w->coro);
+	}
+
+	/**
+	 * Suspend in the queue until a wakeup. It can be spurious, the
+	 * caller retries.
+	 * @retval 0 Woken up, the channel is still open or the
+	 *     operation is done.
+	 * @retval -1 The channel is closed, CORO_BUS_ERR_NO_CHANNEL is
+	 *     set.
+	 */
+	int
+	wait(struct rlist *queue, struct waiter *w)
+	{
+		w->coro = coro_this();
+		rlist_add_tail(queue, &w->link);
+		++m_waiter_count;
+		coro_suspend();
+		--m_waiter_count;
+		if (!w->is_done)
+			rlist_del(&w->link);
+		if (w->is_done || !m_is_closed)
+			return 0;
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+
+	/** Copy or move the message into the ring at the tail. */
+	template<typename P>
+	void
+	push_one(P *value)
+	{
+		if constexpr (std::is_const<P>::value)
+			new (slot(m_tail)) T(*value);
+		else
+			new (slot(m_tail)) T(std::move(*value));
+		++m_tail;
+	}
+
+	template<typename P>
+	int
+	try_send_range(P *data, size_t count)
+	{
+		if (m_is_closed) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+		size_t sent = 0;
+		/* Parked single receivers take the first messages. */
+		while (sent < count && size() == 0 && !rlist_empty(&m_recv_queue)) {
+			struct waiter *w = first_waiter(&m_recv_queue);
+			if (w->recv_slot == NULL)
+				break;
+			if constexpr (std::is_const<P>::value)
+				*w->recv_slot = data[sent];
+			else
+				*w->recv_slot = std::move(data[sent]);
+			handoff_finish(w);
+			++sent;
+		}
+		size_t free_count = Capacity - size();
+		if (free_count > count - sent)
+			free_count = count - sent;
+		if (sent == 0 && free_count == 0) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			return -1;
+		}
+		if constexpr (std::is_trivially_copyable<T>::value) {
+			size_t pos = m_tail & (Capacity - 1);
+			size_t first = Capacity - pos;
+			if (first > free_count)
+				first = free_count;
+			memcpy((void *)slot(m_tail), data + sent, first * sizeof(T));
+			memcpy((void *)slot(0), data + sent + first,
+				(free_count - first) * sizeof(T));
+			m_tail += free_count;
+		} else {
+			for (size_t i = 0; i < free_count; ++i)
+				push_one(&data[sent + i]);
+		}
+		sent += free_count;
+		if (size() > 0)
+			wakeup_first(&m_recv_queue);
+		return (int)sent;
+	}
+
+	template<typename P>
+	int
+	send_range(P *data, size_t count)
+	{
+		while (true) {
+			int rc = try_send_range(data, count);
+			if (rc > 0) {
+				pass_send_wakeup();
+				return rc;
+			}
+			if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK)
+				return -1;
+			struct waiter w;
+			if (wait(&m_send_queue, &w) != 0)
+				return -1;
+		}
+	}
+
+	/** Raw storage, the messages in [head, tail) are constructed. */
+	alignas(T) unsigned char m_buf[Capacity * sizeof(T)];
+	/** Position of the oldest message, grows forever. */
+	size_t m_head;
+	/** Position for the next message. */
+	size_t m_tail;
+	/** Coroutines waiting until the channel is not full. */
+	struct rlist m_send_queue;
+	/** Coroutines waiting until the channel is not empty. */
+	struct rlist m_recv_queue;
+	unsigned m_waiter_count;
+	bool m_is_closed;
+};
+
+} // namespace libcoro
@@ -1,5 +1,6 @@
 #include "libcoro.h"
 
+#include "probe.h"
 #include "rlist.h"
 
 #include <assert.h>
@@ -7,401 +8,3719 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <setjmp.h>
-#include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/** The I/O poller: epoll on Linux, kqueue on the BSDs and macOS. */
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define CORO_IO_EPOLL 1
+#else
+#include <sys/event.h>
+#define CORO_IO_EPOLL 0
+#endif
+
+/**
+ * Context switch backend. The default one is a hand-written
+ * register-only switch on the platforms where it is available:
+ * it saves only the callee-saved registers and the stack pointer,
+ * never touching the signal mask. All the other platforms, or the
+ * builds with LIBCORO_CTX_SIGJMP defined, use sigsetjmp/siglongjmp.
+ */
+#if !defined(LIBCORO_CTX_SIGJMP) && (defined(__x86_64__) || defined(__aarch64__))
+#define CORO_CTX_ASM 1
+#else
+#define CORO_CTX_ASM 0
+#endif
+
+#if defined(__APPLE__)
+#define CORO_ASM_SYM(name) "_" #name
+#else
+#define CORO_ASM_SYM(name) #name
+#endif
+
+#if CORO_CTX_ASM
+
+/** Saved context - just the stack pointer. Registers are on the stack. */
+struct coro_ctx {
+	void *sp;
+};
+
+extern "C" {
+/**
+ * Save the callee-saved registers on the current stack, store the
+ * stack pointer into @a from_sp, jump onto @a to_sp and restore the
+ * registers stored there.
+ */
+void
+coro_ctx_swap(void **from_sp, void *to_sp);
+/**
+ * The first code executed on a new stack. Takes the function and
+ * its argument from the registers filled by coro_ctx_make().
+ */
+void
+coro_ctx_trampoline(void);
+}
+
+#if defined(__x86_64__)
+
+asm(
+"	.text\n"
+"	.globl " CORO_ASM_SYM(coro_ctx_swap) "\n"
+#if !defined(__APPLE__)
+"	.type " CORO_ASM_SYM(coro_ctx_swap) ", @function\n"
+#endif
+"	.p2align 4\n"
+CORO_ASM_SYM(coro_ctx_swap) ":\n"
+"	pushq %rbp\n"
+"	pushq %rbx\n"
+"	pushq %r12\n"
+"	pushq %r13\n"
+"	pushq %r14\n"
+"	pushq %r15\n"
+"	movq %rsp, (%rdi)\n"
+"	movq %rsi, %rsp\n"
+"	popq %r15\n"
+"	popq %r14\n"
+"	popq %r13\n"
+"	popq %r12\n"
+"	popq %rbx\n"
+"	popq %rbp\n"
+"	ret\n"
+#if !defined(__APPLE__)
+"	.size " CORO_ASM_SYM(coro_ctx_swap) ", .-" CORO_ASM_SYM(coro_ctx_swap) "\n"
+#endif
+"	.globl " CORO_ASM_SYM(coro_ctx_trampoline) "\n"
+#if !defined(__APPLE__)
+"	.type " CORO_ASM_SYM(coro_ctx_trampoline) ", @function\n"
+#endif
+"	.p2align 4\n"
+CORO_ASM_SYM(coro_ctx_trampoline) ":\n"
+"	movq %r12, %rdi\n"
+"	callq *%r13\n"
+"	ud2\n"
+#if !defined(__APPLE__)
+"	.size " CORO_ASM_SYM(coro_ctx_trampoline) ", .-" CORO_ASM_SYM(coro_ctx_trampoline) "\n"
+#endif
+);
+
+enum {
+	/** r15, r14, r13, r12, rbx, rbp, return address. */
+	CORO_CTX_FRAME_WORDS = 7,
+	CORO_CTX_R12 = 3,
+	CORO_CTX_R13 = 2,
+};
+
+#elif defined(__aarch64__)
+
+asm(
+"	.text\n"
+"	.globl " CORO_ASM_SYM(coro_ctx_swap) "\n"
+#if !defined(__APPLE__)
+"	.type " CORO_ASM_SYM(coro_ctx_swap) ", %function\n"
+#endif
+"	.p2align 4\n"
+CORO_ASM_SYM(coro_ctx_swap) ":\n"
+"	sub sp, sp, #0xb0\n"
+"	stp x19, x20, [sp, #0x00]\n"
+"	stp x21, x22, [sp, #0x10]\n"
+"	stp x23, x24, [sp, #0x20]\n"
+"	stp x25, x26, [sp, #0x30]\n"
+"	stp x27, x28, [sp, #0x40]\n"
+"	stp x29, x30, [sp, #0x50]\n"
+"	stp d8, d9, [sp, #0x60]\n"
+"	stp d10, d11, [sp, #0x70]\n"
+"	stp d12, d13, [sp, #0x80]\n"
+"	stp d14, d15, [sp, #0x90]\n"
+"	mov x2, sp\n"
+"	str x2, [x0]\n"
+"	mov sp, x1\n"
+"	ldp x19, x20, [sp, #0x00]\n"
+"	ldp x21, x22, [sp, #0x10]\n"
+"	ldp x23, x24, [sp, #0x20]\n"
+"	ldp x25, x26, [sp, #0x30]\n"
+"	ldp x27, x28, [sp, #0x40]\n"
+"	ldp x29, x30, [sp, #0x50]\n"
+"	ldp d8, d9, [sp, #0x60]\n"
+"	ldp d10, d11, [sp, #0x70]\n"
+"	ldp d12, d13, [sp, #0x80]\n"
+"	ldp d14, d15, [sp, #0x90]\n"
+"	add sp, sp, #0xb0\n"
+"	ret\n"
+#if !defined(__APPLE__)
+"	.size " CORO_ASM_SYM(coro_ctx_swap) ", .-" CORO_ASM_SYM(coro_ctx_swap) "\n"
+#endif
+"	.globl " CORO_ASM_SYM(coro_ctx_trampoline) "\n"
+#if !defined(__APPLE__)
+"	.type " CORO_ASM_SYM(coro_ctx_trampoline) ", %function\n"
+#endif
+"	.p2align 4\n"
+CORO_ASM_SYM(coro_ctx_trampoline) ":\n"
+"	mov x0, x19\n"
+"	blr x20\n"
+"	brk #0\n"
+#if !defined(__APPLE__)
+"	.size " CORO_ASM_SYM(coro_ctx_trampoline) ", .-" CORO_ASM_SYM(coro_ctx_trampoline) "\n"
+#endif
+);
+
+enum {
+	/** x19-x30, d8-d15, padding to 16 bytes. */
+	CORO_CTX_FRAME_WORDS = 22,
+	CORO_CTX_X19 = 0,
+	CORO_CTX_X20 = 1,
+	CORO_CTX_X30 = 11,
+};
+
+#endif
+
+/**
+ * Prepare a context which on the first switch to it calls
+ * @a func(@a arg) on the given stack. The function must never
+ * return.
+ */
+static void
+coro_ctx_make(struct coro_ctx *ctx, uint8_t *stack, size_t stack_size,
+	void (*func)(void *), void *arg)
+{
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+#if defined(__x86_64__)
+	/*
+	 * After 6 pops and 'ret' the trampoline must see the stack
+	 * aligned by 16 to be able to 'call' the function. One more
+	 * zero word on top is a fake return address for debuggers.
+	 */
+	void **sp = (void **)(top - 8) - CORO_CTX_FRAME_WORDS - 1;
+	memset(sp, 0, (CORO_CTX_FRAME_WORDS + 2) * sizeof(void *));
+	sp[CORO_CTX_R12] = arg;
+	sp[CORO_CTX_R13] = (void *)func;
+	sp[CORO_CTX_FRAME_WORDS - 1] = (void *)coro_ctx_trampoline;
+#elif defined(__aarch64__)
+	void **sp = (void **)top - CORO_CTX_FRAME_WORDS;
+	memset(sp, 0, CORO_CTX_FRAME_WORDS * sizeof(void *));
+	sp[CORO_CTX_X19] = arg;
+	sp[CORO_CTX_X20] = (void *)func;
+	sp[CORO_CTX_X30] = (void *)coro_ctx_trampoline;
+#endif
+	ctx->sp = sp;
+}
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	coro_ctx_swap(&from->sp, to->sp);
+}
+
+#else /* !CORO_CTX_ASM */
+
+#include <ucontext.h>
+
+struct coro_ctx {
+	sigjmp_buf buf;
+};
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+	if (sigsetjmp(from->buf, 0) == 0)
+		siglongjmp(to->buf, 1);
+}
+
+#endif /* !CORO_CTX_ASM */
 
 #define handle_error() do {														\
 	printf("Error %s\n", strerror(errno));										\
 	exit(-1);																	\
 } while(0)
 
+enum {
+	/** Stack size of coroutines created by coro_new(). */
+	CORO_STACK_SIZE_DEFAULT = 1024 * 1024,
+	/** Smallest stack size, 16KB. Lesser sizes are rounded up. */
+	CORO_STACK_SIZE_MIN_LOG2 = 14,
+	/**
+	 * Stacks are rounded up to a power of 2 and are cached per
+	 * such size class. Each next class is twice bigger.
+	 */
+	CORO_STACK_CLASS_COUNT = 24,
+	/** Max number of joined coroutines cached per size class. */
+	CORO_STACK_CACHE_MAX = 1024,
+	/**
+	 * Pool of the coroutines of coro_new_shared(). They have no
+	 * own stacks, so it goes after all the size classes.
+	 */
+	CORO_POOL_SHARED = CORO_STACK_CLASS_COUNT,
+	CORO_POOL_COUNT = CORO_STACK_CLASS_COUNT + 1,
+	/** Size of the stack shared by the coroutines of an engine. */
+	CORO_SHARED_STACK_SIZE = CORO_STACK_SIZE_DEFAULT,
+	/**
+	 * Bytes below the stack pointer which can be in use: the
+	 * registers saved by the switch, the red zone, a leaf call.
+	 * They are copied out together with the used part of a shared
+	 * stack, and are not painted by the stack profiler.
+	 */
+	CORO_STACK_RED_ZONE = 256,
+	/** Stack of the context copying the shared stacks in and out. */
+	CORO_RELAY_STACK_SIZE = 1 << CORO_STACK_SIZE_MIN_LOG2,
+	/**
+	 * In the multi-threaded mode an engine takes at most that
+	 * many coroutines per iteration. The rest stay in the queue
+	 * and can be stolen by the idle engines.
+	 */
+	CORO_ENGINE_BATCH_MAX = 64,
+	/**
+	 * Coroutines run from the run-next slot per iteration of an
+	 * engine. Then the wakeups go to the next-queue, so a pair
+	 * waking each other up can't starve the rest.
+	 */
+	CORO_RUN_NEXT_MAX = 32,
+	/** Busy-wait iterations before giving the CPU away. */
+	CORO_SPIN_MAX = 128,
+	/** Timer wheel tick is 2^14 ns, about 16 microseconds. */
+	CORO_TIMER_TICK_LOG2 = 14,
+	/** Each level of the timer wheel has 64 slots. */
+	CORO_TIMER_SLOT_LOG2 = 6,
+	CORO_TIMER_SLOT_COUNT = 1 << CORO_TIMER_SLOT_LOG2,
+	/**
+	 * 4 levels cover 2^24 ticks, about 4.5 minutes. Farther
+	 * timers wait in the top level and are re-inserted.
+	 */
+	CORO_TIMER_LEVEL_COUNT = 4,
+	/** Max events taken from the poller per call. */
+	CORO_IO_EVENT_BATCH = 64,
+	/** Initial size of the table of the descriptors with waiters. */
+	CORO_IO_FD_CAP_MIN = 64,
+	CORO_CACHE_LINE_SIZE = 64,
+};
+
+#ifdef LIBCORO_STACK_PROFILE
+/** Unused stack words are filled with that. */
+static const uint64_t CORO_STACK_CANARY = 0xc0dec0dec0dec0deULL;
+#endif
+
 enum coro_state {
 	CORO_STATE_RUNNING,
 	CORO_STATE_SUSPENDED,
 	CORO_STATE_FINISHED,
 };
 
-/** Main coroutine structure, its context. */
-struct coro {
-	/** Coroutine state. */
-	enum coro_state state;
-	/** A value, returned by func. */
-	void *ret;
-	/** Stack, used by the coroutine. */
-	uint8_t *stack;
-	/** An argument for the function func. */
-	void *func_arg;
-	/** A function to call as a coroutine. */
-	coro_f func;
-	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
-	/**
-	 * Coroutine which is trying to join this one right now.
-	 */
-	struct coro *joiner;
-	/** Links in a coroutine list, used by the scheduler. */
-	struct rlist link;
-};
+/**
+ * Value of coro->joiner when the coroutine is finished and is not
+ * going to wake anybody up anymore.
+ */
+#define CORO_JOINER_DONE ((struct coro *)1)
+/** The coroutine is joined via its wait_group. */
+#define CORO_JOINER_GROUP ((struct coro *)2)
+/** Nobody joins the coroutine, it is released when finished. */
+#define CORO_JOINER_DETACHED ((struct coro *)3)
+
+/** Coroutines joined together by coro_join_all(). */
+struct coro_wait_group {
+	/** Not finished coroutines, plus one for the joiner. */
+	size_t remaining;
+	/** Who to wake up when all are finished. */
+	struct coro *waiter;
+};
+
+struct coro_engine;
+
+/** A coroutine in coro_io_wait(). */
+struct coro_io_waiter {
+	struct coro *coro;
+	/** CORO_IO_READ and/or CORO_IO_WRITE. */
+	int events;
+	/** The ready events it was woken up with. */
+	int revents;
+};
+
+/** Waiters of one descriptor. */
+struct coro_io_fd {
+	/** Waiter for CORO_IO_READ. */
+	struct coro_io_waiter *reader;
+	/** Waiter for CORO_IO_WRITE, can be the same as the reader. */
+	struct coro_io_waiter *writer;
+	/**
+	 * Events armed in the poller. They are one-shot, so an armed
+	 * event fires once and has to be armed again.
+	 */
+	int armed;
+	/** The descriptor was added to epoll, maybe gone by close(). */
+	bool is_added;
+};
+
+/** A deadline of a coroutine suspended with a timeout. */
+struct coro_timer {
+	/** Tick when the timer fires. */
+	uint64_t expires;
+	/** Coroutine to wake up. */
+	struct coro *coro;
+	/** Engine owning the wheel with this timer. */
+	struct coro_engine *engine;
+	/** The timer is removed from the wheel by the firing. */
+	bool is_fired;
+	/** Link in a wheel slot. */
+	struct rlist link;
+};
+
+/**
+ * Hierarchical timer wheel. Level 0 slots are single ticks, each
+ * next level slot is 64 slots of the previous level. When the time
+ * reaches a higher level slot, its timers are re-inserted into the
+ * lower levels. Adding and removal are O(1).
+ */
+struct coro_wheel {
+	/** The last processed tick. */
+	uint64_t now_tick;
+	/** Number of timers in the wheel. */
+	size_t count;
+	struct rlist slots[CORO_TIMER_LEVEL_COUNT][CORO_TIMER_SLOT_COUNT];
+};
+
+struct coro_mutex;
+
+/** A coroutine in a queue of a mutex, condition, or semaphore. */
+struct coro_waiter {
+	struct rlist link;
+	struct coro *coro;
+	/**
+	 * The mutex to take after a condition signal. NULL for the
+	 * other waits.
+	 */
+	struct coro_mutex *mutex;
+	/** Set by the waker: the waiter owns what it waited for. */
+	bool is_done;
+};
+
+/**
+ * A stack used by many coroutines of one engine. Only its owner
+ * has the frames on it, the others keep theirs copied out until
+ * they run again.
+ */
+struct coro_shared_stack {
+	uint8_t *stack;
+	size_t size;
+	/** Coroutine having its frames on the stack, or NULL. */
+	struct coro *owner;
+	/** The coroutines of the stack run only on this engine. */
+	struct coro_engine *engine;
+	/** The coroutines using it, plus one while the engine has it. */
+	size_t ref_count;
+};
+
+/**
+ * Main coroutine structure, its context. The fields touched by
+ * every switch go first and fit one cache line together with the
+ * beginning of the context. The scheduler walks many coroutines,
+ * so the rest of them rarely stays in the cache.
+ */
+struct alignas(CORO_CACHE_LINE_SIZE) coro {
+	/**
+	 * Coroutine state. Can be changed by the other threads, so
+	 * is accessed atomically.
+	 */
+	enum coro_state state;
+	/**
+	 * The coroutine is leaving its stack right now. Its context
+	 * is not saved yet and it can't be resumed until the flag is
+	 * dropped by the next coroutine on the same engine.
+	 */
+	bool is_switching;
+	/**
+	 * A wakeup came from another thread while the coroutine was
+	 * running. Its next suspension returns immediately.
+	 */
+	bool is_wakeup_pending;
+	/**
+	 * The context is not made yet. It is done on the shared stack
+	 * right before the run, when the stack is taken.
+	 */
+	bool is_ctx_pending;
+	/** Links in a coroutine list, used by the scheduler. */
+	struct rlist link;
+	/** Engine where the coroutine was running the last time. */
+	struct coro_engine *engine;
+	/**
+	 * Coroutine which is trying to join this one right now, or
+	 * CORO_JOINER_DONE when this one is finished.
+	 */
+	struct coro *joiner;
+	/**
+	 * Shared stack, or NULL if the coroutine has an own one. Then
+	 * the stack fields below are the shared stack's.
+	 */
+	struct coro_shared_stack *shared;
+	/** Where the saved part starts on the shared stack. */
+	uint8_t *save_sp;
+	/**
+	 * Last remembered coroutine context. The stack pointer of the
+	 * asm switch is in the first cache line, and so are the first
+	 * registers of a jump buffer.
+	 */
+	struct coro_ctx ctx;
+	/** A value, returned by func. */
+	void *ret;
+	/**
+	 * Stack, used by the coroutine. It is mmap()-ed lazily, a
+	 * guard page is right below it.
+	 */
+	uint8_t *stack;
+	/** Usable stack size, without the guard page. */
+	size_t stack_size;
+	/**
+	 * Size class of the stack, its pool index. CORO_POOL_SHARED
+	 * for a coroutine on a shared stack.
+	 */
+	int stack_class;
+	/**
+	 * The used part of the shared stack, saved while another
+	 * coroutine owns it. The buffer is sized by the last save.
+	 */
+	uint8_t *save_buf;
+	size_t save_size;
+	size_t save_cap;
+	/** An argument for the function func. */
+	void *func_arg;
+	/** A function to call as a coroutine. */
+	coro_f func;
+	/** Group of coro_join_all(), when joiner is CORO_JOINER_GROUP. */
+	struct coro_wait_group *wait_group;
+	/** Link in the list of all coroutines of the process. */
+	struct rlist all_link;
+	/** Values of the coroutine-local keys. */
+	void *locals[CORO_KEY_MAX];
+	/**
+	 * The objects of the waits, which the other coroutines and
+	 * threads access while this one is suspended. They are not on
+	 * the coroutine stack, because a shared one is copied out then.
+	 */
+	struct coro_timer timer;
+	struct coro_io_waiter io_waiter;
+	struct coro_wait_group join_group;
+	struct coro_waiter waiter;
+#ifdef LIBCORO_STACK_PROFILE
+	/** Function of the last run, reported at the join. */
+	coro_f profile_func;
+	/** The most stack bytes used by the last run. */
+	size_t stack_peak;
+#endif
+#ifdef LIBCORO_STATS
+	/** When the coroutine became runnable, 0 if it is not. */
+	uint64_t runnable_ns;
+	/** When the coroutine was switched to the last time. */
+	uint64_t run_start_ns;
+	/** Total running time. */
+	uint64_t cpu_ns;
+#endif
+};
+
+static_assert(offsetof(struct coro, ctx) + sizeof(void *) <=
+	CORO_CACHE_LINE_SIZE, "the switch fields must fit one cache line");
+
+struct coro_engine {
+	/**
+	 * Scheduler is the main coroutine - it represents the
+	 * context in which the scheduler itself runs.
+	 */
+	struct coro sched;
+	/** Which coroutine works at this moment. */
+	struct coro *this_coro;
+	/**
+	 * Coroutine which has just switched to the current one. Its
+	 * is_switching flag is dropped right after the switch.
+	 */
+	struct coro *switch_from;
+	/**
+	 * Detached coroutine which has just finished. It is released
+	 * by the next context, once it has left its stack.
+	 */
+	struct coro *detached_done;
+
+	/**
+	 * Coroutines to run in this iteration of the loop. The
+	 * list gets populated once at the start of the iteration.
+	 * Only the own thread touches it.
+	 */
+	struct rlist coros_running_now;
+	/** Spinlock protecting the next-queue. */
+	int next_lock;
+	/** Number of coroutines in the next-queue. */
+	size_t next_count;
+	/**
+	 * Coroutines to run in the next iteration of the loop.
+	 * The list gets populated by wakeups and yields and new
+	 * coros. Other threads push into it and steal from it.
+	 */
+	struct rlist coros_running_next;
+	/**
+	 * Joined coroutines to be reused, together with their
+	 * stacks. One list per stack size class.
+	 */
+	struct rlist coros_pool[CORO_POOL_COUNT];
+	/** Number of coroutines in each of the pools. */
+	size_t coros_pool_size[CORO_POOL_COUNT];
+	/** Stack for the new coroutines of coro_new_shared(), or NULL. */
+	struct coro_shared_stack *shared_stack;
+	/**
+	 * Context on an own small stack. It switches between two
+	 * coroutines of one shared stack, because they can't copy the
+	 * stack out and in while running on it.
+	 */
+	struct coro_ctx relay_ctx;
+	uint8_t *relay_stack;
+	/** Coroutine the relay switches to. */
+	struct coro *relay_to;
+	/**
+	 * Coroutine woken up by the current one, runs right after it
+	 * instead of the queue. Only the own thread touches it.
+	 */
+	struct coro *run_next;
+	/** Coroutines run from the slot in this iteration. */
+	int run_next_count;
+	/** Next engine to try to steal from. */
+	int steal_pos;
+	/** A host thread runs the engine, see coro_sched_host_run(). */
+	bool is_host_taken;
+	/**
+	 * Spinlock protecting the timers. A coroutine can cancel its
+	 * timer being on another thread already.
+	 */
+	int timer_lock;
+	/** Timers of the coroutines suspended on this engine. */
+	struct coro_wheel wheel;
+#ifdef LIBCORO_STATS
+	struct coro_sched_stats stats;
+#endif
+#ifdef LIBCORO_TRACE
+	/** Events of the engine, NULL until the first one. */
+	struct coro_trace_ring *trace;
+#endif
+	/** Index in the group of the engines. */
+	int id;
+#if !CORO_CTX_ASM
+	/**
+	 * Context of the coroutine constructor. A new coroutine
+	 * returns here after remembering its first context.
+	 */
+	ucontext_t start_point;
+#endif
+};
+
+/** State shared by all the engines of the process. */
+struct coro_group {
+	/** Protects the list of all coroutines and the idle state. */
+	pthread_mutex_t mutex;
+	/** Idle engines sleep on it. */
+	pthread_cond_t cond;
+	/** All coroutines having a stack, including the pools. */
+	struct rlist coros_all;
+	/** Total number of coroutines, including the pools. */
+	size_t coro_count;
+	/** Engines to steal from. The first one is the main engine. */
+	struct coro_engine **engines;
+	int engine_count;
+	/** True while coro_sched_run_mt() works. */
+	bool is_mt;
+	/** The wakeups of the same engine use the run-next slot. */
+	bool is_run_next;
+	/**
+	 * Number of coroutines in all the next-queues. Maintained in
+	 * the multi-threaded mode only.
+	 */
+	size_t runnable_count;
+	/** Number of timers in all the engines. */
+	size_t timer_count;
+	/** Number of engines sleeping on the condition. */
+	int idle_count;
+	/**
+	 * Number of coro_sched_hold() calls not released yet. While
+	 * not 0, idle engines wait for wakeups from other threads.
+	 */
+	size_t hold_count;
+	/** All engines are idle and nothing is runnable. */
+	bool is_done;
+	/**
+	 * epoll or kqueue descriptor. Created by the first
+	 * coro_io_wait(), -1 until then.
+	 */
+	int io_fd;
+	/** Written to wake up the engine blocked in the poller. */
+	int io_kick_pipe[2];
+	/** Spinlock protecting the descriptor table. */
+	int io_lock;
+	/** Waiters by descriptor. */
+	struct coro_io_fd *io_fds;
+	int io_fd_cap;
+	/** Number of the waiters in the table. */
+	size_t io_wait_count;
+	/** Taken by the engine which is polling now. One at a time. */
+	int io_poll_lock;
+	/** The polling engine is blocked in the poller. */
+	bool is_io_sleeping;
+	/**
+	 * Submits a host thread, when the engines are hosted by
+	 * another scheduler. NULL otherwise.
+	 */
+	coro_host_submit_f host_submit;
+	void *host_arg;
+	/**
+	 * Host threads submitted or running. Each takes an engine, so
+	 * there are at most as many as the hosted engines.
+	 */
+	int host_active;
+	/** Spinlock protecting the spawn requests. */
+	int host_lock;
+	/** Requests of coro_sched_host_spawn(), not made yet. */
+	size_t host_spawn_count;
+	struct rlist host_spawns;
+};
+
+/** A coroutine to make by the next host thread. */
+struct coro_host_spawn {
+	coro_f func;
+	void *func_arg;
+	struct rlist link;
+};
+
+/** Destructors of the coroutine-local keys, can be NULL. */
+static void (*coro_key_destructors[CORO_KEY_MAX])(void *);
+/** Number of the created keys. Can go above the max on failures. */
+static int coro_key_count = 0;
+
+#ifdef LIBCORO_STATS
+static coro_switch_hook_f coro_switch_hook = NULL;
+static void *coro_switch_hook_arg = NULL;
+#endif
+
+#ifdef LIBCORO_TRACE
+/** Trace of one engine. Only the thread running it writes there. */
+struct coro_trace_ring {
+	struct coro_trace_record *records;
+	/** Capacity minus 1, the capacity is a power of 2. */
+	size_t mask;
+	/** Records written since the start, can be above the capacity. */
+	uint64_t pos;
+	/** Next ring in the list of all of them. */
+	struct coro_trace_ring *next;
+};
+
+static bool coro_trace_is_on = false;
+/** Capacity of the new rings. */
+static size_t coro_trace_size = 0;
+/**
+ * All the rings of the trace. They outlive the engines of
+ * coro_sched_run_mt(), so can be dumped after it.
+ */
+static struct coro_trace_ring *coro_trace_rings = NULL;
+/** Protects the list, the engines add rings concurrently. */
+static int coro_trace_lock = 0;
+#endif
+
+#ifdef LIBCORO_STACK_PROFILE
+/** Peak stack usage per coroutine function. */
+static struct coro_stack_usage *coro_profile = NULL;
+static size_t coro_profile_count = 0;
+static size_t coro_profile_cap = 0;
+/** Joins on different threads report concurrently. */
+static int coro_profile_lock = 0;
+#endif
+
+static struct coro_group glob_group = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	{NULL, NULL},
+	0,
+	NULL,
+	0,
+	false,
+	false,
+	0,
+	0,
+	0,
+	0,
+	false,
+	-1,
+	{-1, -1},
+	0,
+	NULL,
+	0,
+	0,
+	0,
+	false,
+	NULL,
+	NULL,
+	0,
+	0,
+	0,
+	{NULL, NULL},
+};
+
+/** Engine of the current thread, if it has one. */
+static __thread struct coro_engine *this_engine = NULL;
+
+static inline void
+coro_cpu_relax(int *spin_count)
+{
+	if (++*spin_count < CORO_SPIN_MAX) {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__)
+		asm volatile("yield");
+#endif
+		return;
+	}
+	*spin_count = 0;
+	sched_yield();
+}
+
+static inline void
+coro_spin_lock(int *lock)
+{
+	int spin_count = 0;
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED) != 0)
+			coro_cpu_relax(&spin_count);
+	}
+}
+
+static inline void
+coro_spin_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static uint64_t
+coro_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef LIBCORO_TRACE
+
+static struct coro_trace_ring *
+coro_trace_ring_new(void)
+{
+	struct coro_trace_ring *ring = new coro_trace_ring();
+	ring->records = new coro_trace_record[coro_trace_size];
+	ring->mask = coro_trace_size - 1;
+	ring->pos = 0;
+	coro_spin_lock(&coro_trace_lock);
+	ring->next = coro_trace_rings;
+	coro_trace_rings = ring;
+	coro_spin_unlock(&coro_trace_lock);
+	return ring;
+}
+
+/**
+ * Record an event into the trace of the engine of the calling
+ * thread. The threads without an own engine don't record.
+ */
+static inline void
+coro_trace_event(enum coro_trace_event event, struct coro *c, uint32_t arg)
+{
+	if (!__atomic_load_n(&coro_trace_is_on, __ATOMIC_RELAXED))
+		return;
+	struct coro_engine *engine = this_engine;
+	if (engine == NULL)
+		return;
+	struct coro_trace_ring *ring = engine->trace;
+	if (ring == NULL) {
+		ring = coro_trace_ring_new();
+		engine->trace = ring;
+	}
+	struct coro_trace_record *r = &ring->records[ring->pos++ & ring->mask];
+	r->ns = coro_now_ns();
+	r->coro = c == &engine->sched ? NULL : c;
+	r->arg = arg;
+	r->event = (uint16_t)event;
+	r->engine = (uint16_t)engine->id;
+}
+
+/** Free the rings, the engines get new ones with the next events. */
+static void
+coro_trace_clear(void)
+{
+	struct coro_group *group = &glob_group;
+	for (int i = 0; i < group->engine_count; ++i)
+		group->engines[i]->trace = NULL;
+	struct coro_trace_ring *ring = coro_trace_rings;
+	while (ring != NULL) {
+		struct coro_trace_ring *next = ring->next;
+		delete[] ring->records;
+		delete ring;
+		ring = next;
+	}
+	coro_trace_rings = NULL;
+}
+
+#endif
+
+static void
+coro_wheel_create(struct coro_wheel *wheel)
+{
+	wheel->now_tick = coro_now_ns() >> CORO_TIMER_TICK_LOG2;
+	wheel->count = 0;
+	for (int i = 0; i < CORO_TIMER_LEVEL_COUNT; ++i) {
+		for (int j = 0; j < CORO_TIMER_SLOT_COUNT; ++j)
+			rlist_create(&wheel->slots[i][j]);
+	}
+}
+
+/** Put a timer into the level matching its distance from now. */
+static void
+coro_wheel_insert(struct coro_wheel *wheel, struct coro_timer *timer)
+{
+	assert(timer->expires >= wheel->now_tick);
+	uint64_t delta = timer->expires - wheel->now_tick;
+	int level = 0;
+	while (level < CORO_TIMER_LEVEL_COUNT - 1 &&
+	       delta >= (uint64_t)1 << ((level + 1) * CORO_TIMER_SLOT_LOG2))
+		++level;
+	int shift = level * CORO_TIMER_SLOT_LOG2;
+	uint64_t pos = timer->expires;
+	uint64_t max_delta = (uint64_t)(CORO_TIMER_SLOT_COUNT - 1) << shift;
+	if (delta > max_delta)
+		pos = wheel->now_tick + max_delta;
+	struct rlist *slot =
+		&wheel->slots[level][(pos >> shift) & (CORO_TIMER_SLOT_COUNT - 1)];
+	rlist_add_tail_entry(slot, timer, link);
+}
+
+/**
+ * The nearest tick when something happens in the wheel - either a
+ * timer fires, or a higher level slot is re-inserted.
+ */
+static uint64_t
+coro_wheel_next_tick(const struct coro_wheel *wheel)
+{
+	uint64_t res = UINT64_MAX;
+	for (int level = 0; level < CORO_TIMER_LEVEL_COUNT; ++level) {
+		int shift = level * CORO_TIMER_SLOT_LOG2;
+		uint64_t base = wheel->now_tick >> shift;
+		for (uint64_t i = 1; i <= CORO_TIMER_SLOT_COUNT; ++i) {
+			const struct rlist *slot = &wheel->slots[level][
+				(base + i) & (CORO_TIMER_SLOT_COUNT - 1)];
+			if (rlist_empty(slot))
+				continue;
+			if (((base + i) << shift) < res)
+				res = (base + i) << shift;
+			break;
+		}
+	}
+	return res;
+}
+
+static void
+coro_engine_create(struct coro_engine *engine)
+{
+	memset(engine, 0, sizeof(*engine));
+	rlist_create(&engine->sched.link);
+	engine->sched.engine = engine;
+	rlist_create(&engine->coros_running_now);
+	rlist_create(&engine->coros_running_next);
+	for (int i = 0; i < CORO_POOL_COUNT; ++i)
+		rlist_create(&engine->coros_pool[i]);
+	coro_wheel_create(&engine->wheel);
+}
+
+static size_t
+coro_page_size(void)
+{
+	static size_t page_size = 0;
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	return page_size;
+}
+
+/** Get the size class of a stack able to fit @a size bytes. */
+static int
+coro_stack_class(size_t size)
+{
+	int res = 0;
+	while (res < CORO_STACK_CLASS_COUNT - 1 &&
+	       ((size_t)1 << (res + CORO_STACK_SIZE_MIN_LOG2)) < size)
+		++res;
+	return res;
+}
+
+static size_t
+coro_stack_class_size(int stack_class)
+{
+	return (size_t)1 << (stack_class + CORO_STACK_SIZE_MIN_LOG2);
+}
+
+/**
+ * Reserve a stack. MAP_NORESERVE makes only the touched pages
+ * consume the memory. The lowest page is a guard - the stack grows
+ * down, and an overflow crashes on it instead of corrupting the
+ * neighbour memory.
+ */
+static uint8_t *
+coro_stack_new(size_t size)
+{
+	size_t guard = coro_page_size();
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#ifdef MAP_STACK
+	flags |= MAP_STACK;
+#endif
+	void *mem = mmap(NULL, size + guard, PROT_READ | PROT_WRITE, flags,
+		-1, 0);
+	if (mem == MAP_FAILED)
+		handle_error();
+	if (mprotect(mem, guard, PROT_NONE) != 0)
+		handle_error();
+	return (uint8_t *)mem + guard;
+}
+
+static void
+coro_stack_delete(uint8_t *stack, size_t size)
+{
+	size_t guard = coro_page_size();
+	if (munmap(stack - guard, size + guard) != 0)
+		handle_error();
+}
+
+/** Count stack bytes really backed by the physical memory. */
+static size_t
+coro_stack_committed(const uint8_t *stack, size_t size)
+{
+	size_t page_size = coro_page_size();
+	unsigned char vec[1024];
+	size_t res = 0;
+	size_t batch = sizeof(vec) * page_size;
+	for (size_t pos = 0; pos < size; pos += batch) {
+		size_t len = size - pos < batch ? size - pos : batch;
+		if (mincore((void *)(stack + pos), len, vec) != 0)
+			handle_error();
+		size_t page_count = (len + page_size - 1) / page_size;
+		for (size_t i = 0; i < page_count; ++i)
+			res += (vec[i] & 1) * page_size;
+	}
+	return res;
+}
+
+#ifdef LIBCORO_STACK_PROFILE
+
+/** Fill [begin, end) with the canary, all the whole words of it. */
+static void
+coro_stack_paint(uint8_t *begin, uint8_t *end)
+{
+	uint64_t *pos = (uint64_t *)(((uintptr_t)begin + 7) & ~(uintptr_t)7);
+	uint64_t *stop = (uint64_t *)((uintptr_t)end & ~(uintptr_t)7);
+	for (; pos < stop; ++pos)
+		*pos = CORO_STACK_CANARY;
+}
+
+/**
+ * Bytes used since the painting. The stack grows down, so it is
+ * everything above the lowest overwritten canary.
+ */
+static size_t
+coro_stack_peak(const uint8_t *stack, size_t size)
+{
+	const uint64_t *pos = (const uint64_t *)stack;
+	const uint64_t *end = (const uint64_t *)(stack + size);
+	while (pos < end && *pos == CORO_STACK_CANARY)
+		++pos;
+	return stack + size - (const uint8_t *)pos;
+}
+
+static void
+coro_stack_profile_add(coro_f func, size_t peak, size_t stack_size)
+{
+	coro_spin_lock(&coro_profile_lock);
+	struct coro_stack_usage *u = NULL;
+	for (size_t i = 0; i < coro_profile_count && u == NULL; ++i) {
+		if (coro_profile[i].func == func)
+			u = &coro_profile[i];
+	}
+	if (u == NULL) {
+		if (coro_profile_count == coro_profile_cap) {
+			size_t cap = coro_profile_cap == 0 ? 16 :
+				coro_profile_cap * 2;
+			struct coro_stack_usage *entries =
+				new struct coro_stack_usage[cap];
+			memcpy(entries, coro_profile,
+			       coro_profile_count * sizeof(entries[0]));
+			delete[] coro_profile;
+			coro_profile = entries;
+			coro_profile_cap = cap;
+		}
+		u = &coro_profile[coro_profile_count++];
+		memset(u, 0, sizeof(*u));
+		u->func = func;
+	}
+	++u->count;
+	u->peak_sum += peak;
+	if (peak > u->peak_max)
+		u->peak_max = peak;
+	if (stack_size > u->stack_size)
+		u->stack_size = stack_size;
+	coro_spin_unlock(&coro_profile_lock);
+}
+
+#endif
+
+static void
+coro_shared_stack_unref(struct coro_shared_stack *s)
+{
+	if (__atomic_sub_fetch(&s->ref_count, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	assert(s->owner == NULL);
+	coro_stack_delete(s->stack, s->size);
+	delete s;
+}
+
+static void
+coro_delete(struct coro *c)
+{
+	struct coro_group *group = &glob_group;
+	pthread_mutex_lock(&group->mutex);
+	rlist_del_entry(c, all_link);
+	assert(group->coro_count > 0);
+	--group->coro_count;
+	pthread_mutex_unlock(&group->mutex);
+	if (c->shared != NULL) {
+		delete[] c->save_buf;
+		coro_shared_stack_unref(c->shared);
+	} else {
+		coro_stack_delete(c->stack, c->stack_size);
+	}
+	delete c;
+}
+
+/** Wake up the engine blocked in the poller, if any. */
+static void
+coro_io_kick(struct coro_group *group)
+{
+	if (!__atomic_load_n(&group->is_io_sleeping, __ATOMIC_SEQ_CST))
+		return;
+	char c = 0;
+	/* A full pipe means the kick is pending anyway. */
+	ssize_t rc = write(group->io_kick_pipe[1], &c, 1);
+	(void)rc;
+}
+
+/**
+ * Count one more host thread, if not all the hosted engines are
+ * taken yet. The engine 0 is the main one, it is not hosted.
+ */
+static bool
+coro_host_try_activate(struct coro_group *group)
+{
+	int active = __atomic_load_n(&group->host_active, __ATOMIC_SEQ_CST);
+	while (active < group->engine_count - 1) {
+		if (__atomic_compare_exchange_n(&group->host_active, &active,
+						active + 1, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_SEQ_CST))
+			return true;
+	}
+	return false;
+}
+
+/** Submit a host thread for the new work, if there is a free engine. */
+static void
+coro_host_kick(struct coro_group *group)
+{
+	if (!coro_host_try_activate(group))
+		return;
+	if (group->host_submit(group->host_arg) != 0)
+		__atomic_sub_fetch(&group->host_active, 1, __ATOMIC_SEQ_CST);
+}
+
+/** Wake one of the idle engines, if any, to pick up new work. */
+static void
+coro_group_notify(struct coro_group *group, size_t count)
+{
+	__atomic_add_fetch(&group->runnable_count, count, __ATOMIC_SEQ_CST);
+	if (group->host_submit != NULL) {
+		coro_host_kick(group);
+		return;
+	}
+	coro_io_kick(group);
+	if (__atomic_load_n(&group->idle_count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	pthread_mutex_lock(&group->mutex);
+	pthread_cond_signal(&group->cond);
+	pthread_mutex_unlock(&group->mutex);
+}
+
+/** Wake up the engine if it is idle waiting for other threads. */
+static void
+coro_group_kick(struct coro_group *group)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	coro_io_kick(group);
+	if (__atomic_load_n(&group->idle_count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	pthread_mutex_lock(&group->mutex);
+	pthread_cond_broadcast(&group->cond);
+	pthread_mutex_unlock(&group->mutex);
+}
+
+/** Make a coroutine runnable on the next iteration of the engine. */
+static void
+coro_engine_push(struct coro_engine *engine, struct coro *c)
+{
+	/* The frames are at the addresses of the engine's stack. */
+	if (c->shared != NULL)
+		engine = c->shared->engine;
+	coro_spin_lock(&engine->next_lock);
+#ifdef LIBCORO_STATS
+	c->runnable_ns = coro_now_ns();
+#endif
+	rlist_add_tail_entry(&engine->coros_running_next, c, link);
+	++engine->next_count;
+	coro_spin_unlock(&engine->next_lock);
+	if (glob_group.is_mt) {
+		coro_group_notify(&glob_group, 1);
+		/* Nobody else can take it, so that engine must wake up. */
+		if (c->shared != NULL && this_engine != engine)
+			coro_group_kick(&glob_group);
+	} else if (this_engine != engine) {
+		coro_group_kick(&glob_group);
+	}
+}
+
+/** Make many coroutines runnable with one lock of the next-queue. */
+static void
+coro_engine_push_many(struct coro_engine *engine, struct coro **coros,
+	size_t count)
+{
+	coro_spin_lock(&engine->next_lock);
+	for (size_t i = 0; i < count; ++i) {
+#ifdef LIBCORO_STATS
+		coros[i]->runnable_ns = coro_now_ns();
+#endif
+		rlist_add_tail_entry(&engine->coros_running_next, coros[i],
+			link);
+	}
+	engine->next_count += count;
+	coro_spin_unlock(&engine->next_lock);
+	if (glob_group.is_mt)
+		coro_group_notify(&glob_group, count);
+	else if (this_engine != engine)
+		coro_group_kick(&glob_group);
+}
+
+/**
+ * Finish a switch on the new stack. The previous coroutine has its
+ * context saved now, and can be resumed by anybody.
+ */
+static void *
+coro_engine_release(struct coro_engine *engine, struct coro *coro);
+
+static inline void
+coro_engine_switch_done(void)
+{
+	struct coro_engine *engine = this_engine;
+	struct coro *from = engine->switch_from;
+	engine->switch_from = NULL;
+	__atomic_store_n(&from->is_switching, false, __ATOMIC_RELEASE);
+	if (engine->detached_done != NULL) {
+		engine->detached_done = NULL;
+		coro_engine_release(engine, from);
+	}
+}
+
+#ifdef LIBCORO_STATS
+
+static void
+coro_engine_stats_switch(struct coro_engine *engine, struct coro *from,
+	struct coro *to)
+{
+	uint64_t now = coro_now_ns();
+	struct coro_sched_stats *stats = &engine->stats;
+	++stats->switch_count;
+	if (from->run_start_ns != 0)
+		from->cpu_ns += now - from->run_start_ns;
+	to->run_start_ns = now;
+	if (to->runnable_ns != 0) {
+		uint64_t latency = now - to->runnable_ns;
+		int bucket = latency == 0 ? 0 : 63 - __builtin_clzll(latency);
+		if (bucket >= CORO_LATENCY_BUCKET_COUNT)
+			bucket = CORO_LATENCY_BUCKET_COUNT - 1;
+		++stats->latency_hist[bucket];
+		to->runnable_ns = 0;
+	}
+	coro_switch_hook_f hook = coro_switch_hook;
+	if (hook != NULL) {
+		hook(from == &engine->sched ? NULL : from,
+		     to == &engine->sched ? NULL : to, coro_switch_hook_arg);
+	}
+}
+
+#endif
+
+static void
+coro_engine_prepare_ctx(struct coro_engine *engine, struct coro *c,
+	size_t stack_size);
+
+/** Roughly the stack pointer of the caller, a bit below it. */
+static __attribute__((noinline)) uint8_t *
+coro_stack_pointer(void)
+{
+	return (uint8_t *)__builtin_frame_address(0);
+}
+
+/**
+ * Put the frames of the coroutine onto its shared stack, with the
+ * frames of the current owner copied out first. Must not be called
+ * on that stack.
+ */
+static void
+coro_shared_stack_enter(struct coro_engine *engine, struct coro *c)
+{
+	struct coro_shared_stack *s = c->shared;
+	struct coro *owner = s->owner;
+	if (owner != NULL) {
+		size_t size = s->stack + s->size - owner->save_sp;
+		/* Right-sized, so the idle coroutines keep only what they use. */
+		if (size > owner->save_cap || size < owner->save_cap / 4) {
+			delete[] owner->save_buf;
+			owner->save_buf = new uint8_t[size];
+			owner->save_cap = size;
+		}
+		memcpy(owner->save_buf, owner->save_sp, size);
+		owner->save_size = size;
+	}
+	s->owner = c;
+	if (c->is_ctx_pending) {
+		c->is_ctx_pending = false;
+		coro_engine_prepare_ctx(engine, c, s->size);
+		return;
+	}
+	memcpy(c->save_sp, c->save_buf, c->save_size);
+}
+
+/**
+ * Loop of the relay context. Each time it is switched to, the
+ * coroutine leaving the shared stack is saved already, so the
+ * stack can be given to the next one.
+ */
+static void
+coro_relay_loop(struct coro_engine *engine)
+{
+	while (true) {
+		struct coro *to = engine->relay_to;
+		engine->relay_to = NULL;
+		coro_shared_stack_enter(engine, to);
+		coro_ctx_switch(&engine->relay_ctx, &to->ctx);
+	}
+}
+
+static void
+coro_engine_resume_next(struct coro_engine *engine)
+{
+	struct coro *to = engine->run_next;
+	if (to != NULL) {
+		engine->run_next = NULL;
+		++engine->run_next_count;
+	} else {
+		assert(!rlist_empty(&engine->coros_running_now));
+		to = rlist_shift_entry(&engine->coros_running_now,
+			struct coro, link);
+	}
+	struct coro *from = engine->this_coro;
+	assert(from != NULL);
+	/*
+	 * The target could be pushed into the queue by another
+	 * thread while it was still leaving its stack there.
+	 */
+	int spin_count = 0;
+	while (__atomic_load_n(&to->is_switching, __ATOMIC_ACQUIRE))
+		coro_cpu_relax(&spin_count);
+
+	/*
+	 * The target is installed before the switch. Then a freshly
+	 * started coroutine can find itself, and the one coming back
+	 * into this frame is already current.
+	 */
+	to->engine = engine;
+	engine->this_coro = to;
+	engine->switch_from = from;
+#ifdef LIBCORO_STATS
+	coro_engine_stats_switch(engine, from, to);
+#endif
+#ifdef LIBCORO_TRACE
+	coro_trace_event(CORO_TRACE_SWITCH, to, 0);
+#endif
+	PROBE3(libcoro, switch, from, to, engine->id);
+	if (from->shared != NULL) {
+		from->save_sp = coro_stack_pointer() -
+			CORO_STACK_RED_ZONE;
+	}
+	if (to->shared == NULL || to->shared->owner == to) {
+		coro_ctx_switch(&from->ctx, &to->ctx);
+	} else if (to->shared != from->shared) {
+		coro_shared_stack_enter(engine, to);
+		coro_ctx_switch(&from->ctx, &to->ctx);
+	} else {
+		/* Both are on the same stack, the switch goes via the relay. */
+		engine->relay_to = to;
+		coro_ctx_switch(&from->ctx, &engine->relay_ctx);
+	}
+	/* Could be resumed by a different thread. */
+	coro_engine_switch_done();
+	assert(rlist_empty(&from->link));
+	assert(this_engine->this_coro == from);
+}
+
+/**
+ * Mark the current coroutine suspended without leaving it yet. A
+ * wakeup from another thread can come at any moment after that,
+ * so the coroutine must either leave or cancel the suspension.
+ */
+static inline void
+coro_prepare_suspend(struct coro *c)
+{
+	assert(rlist_empty(&c->link));
+	assert(c->state == CORO_STATE_RUNNING);
+	__atomic_store_n(&c->is_switching, true, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->state, CORO_STATE_SUSPENDED, __ATOMIC_SEQ_CST);
+}
+
+static void
+coro_engine_cancel_suspend(struct coro_engine *engine, struct coro *c)
+{
+	enum coro_state state = CORO_STATE_SUSPENDED;
+	if (__atomic_compare_exchange_n(&c->state, &state, CORO_STATE_RUNNING,
+					false, __ATOMIC_SEQ_CST,
+					__ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&c->is_switching, false, __ATOMIC_RELAXED);
+		return;
+	}
+	/* Woken up and queued already - has to go through the queue. */
+	coro_engine_resume_next(engine);
+}
+
+static void
+coro_engine_suspend(struct coro_engine *engine)
+{
+	struct coro *this_coro = engine->this_coro;
+	if (this_coro == NULL) {
+		printf("Error: deadlock - suspension with no active "
+			"coroutines\n");
+		exit(-1);
+	}
+#ifdef LIBCORO_TRACE
+	coro_trace_event(CORO_TRACE_SUSPEND, this_coro, 0);
+#endif
+	coro_prepare_suspend(this_coro);
+	if (__atomic_load_n(&this_coro->is_wakeup_pending, __ATOMIC_SEQ_CST) &&
+	    __atomic_exchange_n(&this_coro->is_wakeup_pending, false,
+				__ATOMIC_SEQ_CST)) {
+		coro_engine_cancel_suspend(engine, this_coro);
+		return;
+	}
+	coro_engine_resume_next(engine);
+}
+
+static void
+coro_engine_yield(struct coro_engine *engine)
+{
+	struct coro *this_coro = engine->this_coro;
+	assert(rlist_empty(&this_coro->link));
+	assert(this_coro->state == CORO_STATE_RUNNING);
+	__atomic_store_n(&this_coro->is_switching, true, __ATOMIC_RELAXED);
+	coro_engine_push(engine, this_coro);
+	coro_engine_resume_next(engine);
+}
+
+/**
+ * Put a woken up coroutine into the run-next slot, when the current
+ * coroutine of the engine wakes it up. The previous one from the
+ * slot still runs in this iteration, before the scheduler. Returns
+ * false when the coroutine has to go to the next-queue.
+ */
+static bool
+coro_engine_try_run_next(struct coro_engine *engine, struct coro *c)
+{
+	if (!__atomic_load_n(&glob_group.is_run_next, __ATOMIC_RELAXED) ||
+	    engine != this_engine)
+		return false;
+	if (engine->this_coro == NULL || engine->this_coro == &engine->sched)
+		return false;
+	if (engine->run_next_count >= CORO_RUN_NEXT_MAX)
+		return false;
+	if (c->shared != NULL && c->shared->engine != engine)
+		return false;
+	/* The scheduler waits at the tail of the list of this iteration. */
+	assert(!rlist_empty(&engine->sched.link));
+	struct coro *old = engine->run_next;
+	if (old != NULL)
+		rlist_add_tail_entry(&engine->sched.link, old, link);
+#ifdef LIBCORO_STATS
+	c->runnable_ns = coro_now_ns();
+#endif
+	engine->run_next = c;
+	return true;
+}
+
+static void
+coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+{
+	while (true) {
+		enum coro_state state = CORO_STATE_SUSPENDED;
+		if (__atomic_compare_exchange_n(&coro->state, &state,
+						CORO_STATE_RUNNING, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_SEQ_CST)) {
+			assert(rlist_empty(&coro->link));
+#ifdef LIBCORO_TRACE
+			coro_trace_event(CORO_TRACE_WAKEUP, coro, 0);
+#endif
+			if (!coro_engine_try_run_next(engine, coro))
+				coro_engine_push(engine, coro);
+			return;
+		}
+		if (state == CORO_STATE_FINISHED)
+			return;
+		/*
+		 * In the single-threaded mode only a thread without an
+		 * engine can see a coroutine running elsewhere.
+		 */
+		if (!glob_group.is_mt && this_engine != NULL)
+			return;
+		if (this_engine != NULL && this_engine->this_coro == coro)
+			return;
+		/*
+		 * Might be running on another thread right before a
+		 * suspension. Leave a permit to cancel it, and retry if
+		 * the coroutine has managed to suspend meanwhile.
+		 */
+		__atomic_store_n(&coro->is_wakeup_pending, true,
+				 __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&coro->state, __ATOMIC_SEQ_CST) !=
+		    CORO_STATE_SUSPENDED)
+			return;
+	}
+}
+
+static void
+coro_engine_add_timer(struct coro_engine *engine, struct coro_timer *timer,
+	uint64_t deadline_ns)
+{
+	timer->coro = engine->this_coro;
+	timer->engine = engine;
+	timer->is_fired = false;
+	/* Rounded up, so it never fires before the deadline. */
+	uint64_t expires = (deadline_ns + (1 << CORO_TIMER_TICK_LOG2) - 1) >>
+		CORO_TIMER_TICK_LOG2;
+	struct coro_wheel *wheel = &engine->wheel;
+	coro_spin_lock(&engine->timer_lock);
+	/* An empty wheel is not advanced, can be far behind. */
+	if (wheel->count == 0) {
+		uint64_t now_tick = coro_now_ns() >> CORO_TIMER_TICK_LOG2;
+		if (now_tick > wheel->now_tick)
+			wheel->now_tick = now_tick;
+	}
+	/* The current tick is processed already. */
+	if (expires <= wheel->now_tick)
+		expires = wheel->now_tick + 1;
+	timer->expires = expires;
+	coro_wheel_insert(wheel, timer);
+	__atomic_add_fetch(&wheel->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&glob_group.timer_count, 1, __ATOMIC_SEQ_CST);
+	coro_spin_unlock(&engine->timer_lock);
+}
+
+/** Remove the timer unless it is fired already. */
+static void
+coro_timer_cancel(struct coro_timer *timer)
+{
+	struct coro_engine *engine = timer->engine;
+	coro_spin_lock(&engine->timer_lock);
+	if (!timer->is_fired) {
+		rlist_del_entry(timer, link);
+		__atomic_sub_fetch(&engine->wheel.count, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&glob_group.timer_count, 1,
+				   __ATOMIC_SEQ_CST);
+	}
+	coro_spin_unlock(&engine->timer_lock);
+}
+
+/** Advance the wheel to the current time and fire the expired timers. */
+static void
+coro_engine_process_timers(struct coro_engine *engine)
+{
+	struct coro_wheel *wheel = &engine->wheel;
+	if (__atomic_load_n(&wheel->count, __ATOMIC_RELAXED) == 0)
+		return;
+	uint64_t now_tick = coro_now_ns() >> CORO_TIMER_TICK_LOG2;
+	coro_spin_lock(&engine->timer_lock);
+	while (wheel->now_tick < now_tick) {
+		if (wheel->count == 0) {
+			wheel->now_tick = now_tick;
+			break;
+		}
+		uint64_t tick = ++wheel->now_tick;
+		for (int level = CORO_TIMER_LEVEL_COUNT - 1; level > 0; --level) {
+			int shift = level * CORO_TIMER_SLOT_LOG2;
+			if ((tick & (((uint64_t)1 << shift) - 1)) != 0)
+				continue;
+			struct rlist *slot = &wheel->slots[level][
+				(tick >> shift) & (CORO_TIMER_SLOT_COUNT - 1)];
+			struct rlist timers;
+			rlist_create(&timers);
+			rlist_splice(&timers, slot);
+			while (!rlist_empty(&timers)) {
+				struct coro_timer *timer = rlist_shift_entry(
+					&timers, struct coro_timer, link);
+				coro_wheel_insert(wheel, timer);
+			}
+		}
+		struct rlist *slot =
+			&wheel->slots[0][tick & (CORO_TIMER_SLOT_COUNT - 1)];
+		while (!rlist_empty(slot)) {
+			struct coro_timer *timer = rlist_shift_entry(slot,
+				struct coro_timer, link);
+			assert(timer->expires == tick);
+			timer->is_fired = true;
+			__atomic_sub_fetch(&wheel->count, 1, __ATOMIC_RELAXED);
+			__atomic_sub_fetch(&glob_group.timer_count, 1,
+					   __ATOMIC_SEQ_CST);
+			/* The timer is in the coroutine. Not touched after. */
+			coro_engine_wakeup(engine, timer->coro);
+		}
+	}
+	coro_spin_unlock(&engine->timer_lock);
+}
+
+/** Deadline of the nearest wheel event in ns, UINT64_MAX if none. */
+static uint64_t
+coro_engine_next_deadline(struct coro_engine *engine)
+{
+	uint64_t res = UINT64_MAX;
+	coro_spin_lock(&engine->timer_lock);
+	if (engine->wheel.count > 0) {
+		res = coro_wheel_next_tick(&engine->wheel) <<
+			CORO_TIMER_TICK_LOG2;
+	}
+	coro_spin_unlock(&engine->timer_lock);
+	return res;
+}
+
+static void
+coro_deadline_to_timespec(uint64_t deadline_ns, struct timespec *ts)
+{
+	ts->tv_sec = deadline_ns / 1000000000;
+	ts->tv_nsec = deadline_ns % 1000000000;
+}
+
+/**
+ * Block the thread until the nearest timer. Returns false if there
+ * are no timers to wait for.
+ */
+static bool
+coro_engine_sleep(struct coro_engine *engine)
+{
+	uint64_t deadline = coro_engine_next_deadline(engine);
+	if (deadline == UINT64_MAX)
+		return false;
+	struct timespec ts;
+	coro_deadline_to_timespec(deadline, &ts);
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	return true;
+}
+
+static bool
+coro_engine_suspend_timeout(struct coro_engine *engine, uint64_t timeout_ns)
+{
+	if (engine->this_coro == NULL) {
+		printf("Error: deadlock - suspension with no active "
+			"coroutines\n");
+		exit(-1);
+	}
+	struct coro_timer *timer = &engine->this_coro->timer;
+	coro_engine_add_timer(engine, timer, coro_now_ns() + timeout_ns);
+	coro_engine_suspend(engine);
+	coro_timer_cancel(timer);
+	return !timer->is_fired;
+}
+
+/**
+ * Create the poller and the kick pipe. The pipe is level-triggered
+ * in the poller and is drained by each poll which sees it.
+ */
+static int
+coro_io_open(struct coro_group *group)
+{
+	int rc = -1;
+	pthread_mutex_lock(&group->mutex);
+	if (group->io_fd >= 0) {
+		pthread_mutex_unlock(&group->mutex);
+		return 0;
+	}
+#if CORO_IO_EPOLL
+	int fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+	int fd = kqueue();
+#endif
+	if (fd < 0)
+		goto out;
+	if (pipe(group->io_kick_pipe) != 0)
+		goto error_poller;
+	for (int i = 0; i < 2; ++i) {
+		int flags = fcntl(group->io_kick_pipe[i], F_GETFL, 0);
+		if (flags < 0 || fcntl(group->io_kick_pipe[i], F_SETFL,
+				       flags | O_NONBLOCK) != 0)
+			goto error_pipe;
+	}
+	{
+#if CORO_IO_EPOLL
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = group->io_kick_pipe[0];
+		if (epoll_ctl(fd, EPOLL_CTL_ADD, group->io_kick_pipe[0], &ev) != 0)
+			goto error_pipe;
+#else
+		struct kevent ev;
+		EV_SET(&ev, group->io_kick_pipe[0], EVFILT_READ, EV_ADD, 0, 0,
+		       NULL);
+		if (kevent(fd, &ev, 1, NULL, 0, NULL) != 0)
+			goto error_pipe;
+#endif
+	}
+	__atomic_store_n(&group->io_fd, fd, __ATOMIC_RELEASE);
+	rc = 0;
+	goto out;
+
+error_pipe:
+	close(group->io_kick_pipe[0]);
+	close(group->io_kick_pipe[1]);
+	group->io_kick_pipe[0] = -1;
+	group->io_kick_pipe[1] = -1;
+error_poller:
+	close(fd);
+out:
+	pthread_mutex_unlock(&group->mutex);
+	return rc;
+}
+
+static void
+coro_io_close(struct coro_group *group)
+{
+	assert(group->io_wait_count == 0);
+	if (group->io_fd >= 0) {
+		close(group->io_fd);
+		close(group->io_kick_pipe[0]);
+		close(group->io_kick_pipe[1]);
+		group->io_fd = -1;
+		group->io_kick_pipe[0] = -1;
+		group->io_kick_pipe[1] = -1;
+	}
+	delete[] group->io_fds;
+	group->io_fds = NULL;
+	group->io_fd_cap = 0;
+}
+
+/** Make the descriptor table fit the descriptor. Under io_lock. */
+static void
+coro_io_reserve(struct coro_group *group, int fd)
+{
+	if (fd < group->io_fd_cap)
+		return;
+	int cap = group->io_fd_cap == 0 ? CORO_IO_FD_CAP_MIN :
+		group->io_fd_cap;
+	while (cap <= fd)
+		cap *= 2;
+	struct coro_io_fd *fds = new struct coro_io_fd[cap];
+	memset(fds, 0, cap * sizeof(fds[0]));
+	if (group->io_fd_cap > 0) {
+		memcpy(fds, group->io_fds,
+		       group->io_fd_cap * sizeof(fds[0]));
+	}
+	delete[] group->io_fds;
+	group->io_fds = fds;
+	group->io_fd_cap = cap;
+}
+
+/**
+ * Arm the given events of the descriptor in the poller. epoll has
+ * one mask per descriptor, so all the wanted events are armed with
+ * it. Under io_lock.
+ */
+static int
+coro_io_arm(struct coro_group *group, int fd, struct coro_io_fd *f,
+	int events)
+{
+	if (events == 0)
+		return 0;
+#if CORO_IO_EPOLL
+	int wanted = (f->reader != NULL ? CORO_IO_READ : 0) |
+		(f->writer != NULL ? CORO_IO_WRITE : 0);
+	struct epoll_event ev;
+	ev.events = EPOLLONESHOT;
+	if ((wanted & CORO_IO_READ) != 0)
+		ev.events |= EPOLLIN;
+	if ((wanted & CORO_IO_WRITE) != 0)
+		ev.events |= EPOLLOUT;
+	ev.data.fd = fd;
+	int rc = epoll_ctl(group->io_fd, f->is_added ? EPOLL_CTL_MOD :
+			   EPOLL_CTL_ADD, fd, &ev);
+	/*
+	 * A closed descriptor leaves epoll silently, and its number can
+	 * be reused. Or the other way around, it is a dup of a known one.
+	 */
+	if (rc != 0 && errno == ENOENT)
+		rc = epoll_ctl(group->io_fd, EPOLL_CTL_ADD, fd, &ev);
+	else if (rc != 0 && errno == EEXIST)
+		rc = epoll_ctl(group->io_fd, EPOLL_CTL_MOD, fd, &ev);
+	if (rc != 0)
+		return -1;
+	f->is_added = true;
+	f->armed = wanted;
+#else
+	struct kevent changes[2];
+	int count = 0;
+	if ((events & CORO_IO_READ) != 0) {
+		EV_SET(&changes[count++], fd, EVFILT_READ, EV_ADD | EV_ONESHOT,
+		       0, 0, NULL);
+	}
+	if ((events & CORO_IO_WRITE) != 0) {
+		EV_SET(&changes[count++], fd, EVFILT_WRITE, EV_ADD | EV_ONESHOT,
+		       0, 0, NULL);
+	}
+	if (kevent(group->io_fd, changes, count, NULL, 0, NULL) != 0)
+		return -1;
+	f->armed |= events;
+#endif
+	return 0;
+}
+
+/** Take the waiter out of the table and wake it up. Under io_lock. */
+static void
+coro_io_fire(struct coro_group *group, struct coro_engine *engine,
+	struct coro_io_fd *f, struct coro_io_waiter *w, int ready)
+{
+	if (f->reader == w)
+		f->reader = NULL;
+	if (f->writer == w)
+		f->writer = NULL;
+	w->revents = ready & w->events;
+	__atomic_sub_fetch(&group->io_wait_count, 1, __ATOMIC_SEQ_CST);
+	/* The waiter is in the coroutine. Not touched after. */
+	coro_engine_wakeup(engine, w->coro);
+}
+
+static void
+coro_io_drain_kick(struct coro_group *group)
+{
+	char buf[64];
+	while (read(group->io_kick_pipe[0], buf, sizeof(buf)) > 0)
+		;
+}
+
+/**
+ * Wait for the ready descriptors and wake their waiters up. The
+ * timeout is in nanoseconds, negative means infinite. epoll takes
+ * milliseconds, so the timeout is rounded up to them there.
+ */
+static void
+coro_io_poll(struct coro_group *group, struct coro_engine *engine,
+	int64_t timeout_ns)
+{
+#if CORO_IO_EPOLL
+	struct epoll_event events[CORO_IO_EVENT_BATCH];
+	int timeout_ms = -1;
+	if (timeout_ns >= 0) {
+		int64_t ms = (timeout_ns + 999999) / 1000000;
+		timeout_ms = ms > INT32_MAX ? INT32_MAX : (int)ms;
+	}
+	int count = epoll_wait(group->io_fd, events, CORO_IO_EVENT_BATCH,
+			       timeout_ms);
+#else
+	struct kevent events[CORO_IO_EVENT_BATCH];
+	struct timespec ts;
+	struct timespec *tsp = NULL;
+	if (timeout_ns >= 0) {
+		ts.tv_sec = timeout_ns / 1000000000;
+		ts.tv_nsec = timeout_ns % 1000000000;
+		tsp = &ts;
+	}
+	int count = kevent(group->io_fd, NULL, 0, events, CORO_IO_EVENT_BATCH,
+			   tsp);
+#endif
+	if (count <= 0)
+		return;
+	coro_spin_lock(&group->io_lock);
+	for (int i = 0; i < count; ++i) {
+#if CORO_IO_EPOLL
+		int fd = events[i].data.fd;
+		int ready = 0;
+		if ((events[i].events & EPOLLIN) != 0)
+			ready |= CORO_IO_READ;
+		if ((events[i].events & EPOLLOUT) != 0)
+			ready |= CORO_IO_WRITE;
+		/* The next I/O call reports the error, to any of them. */
+		if ((events[i].events & (EPOLLERR | EPOLLHUP)) != 0)
+			ready = CORO_IO_READ | CORO_IO_WRITE;
+		int fired = CORO_IO_READ | CORO_IO_WRITE;
+#else
+		int fd = (int)events[i].ident;
+		int fired = events[i].filter == EVFILT_READ ? CORO_IO_READ :
+			CORO_IO_WRITE;
+		int ready = fired;
+#endif
+		if (fd == group->io_kick_pipe[0]) {
+			coro_io_drain_kick(group);
+			continue;
+		}
+		assert(fd < group->io_fd_cap);
+		struct coro_io_fd *f = &group->io_fds[fd];
+		f->armed &= ~fired;
+		if (f->reader != NULL && (ready & CORO_IO_READ) != 0)
+			coro_io_fire(group, engine, f, f->reader, ready);
+		if (f->writer != NULL && (ready & CORO_IO_WRITE) != 0)
+			coro_io_fire(group, engine, f, f->writer, ready);
+		/* The one left, like a writer when only the reader is ready. */
+		int left = (f->reader != NULL ? CORO_IO_READ : 0) |
+			(f->writer != NULL ? CORO_IO_WRITE : 0);
+		if (coro_io_arm(group, fd, f, left & ~f->armed) != 0) {
+			/* Let them find the error in their I/O calls. */
+			if (f->reader != NULL)
+				coro_io_fire(group, engine, f, f->reader, left);
+			if (f->writer != NULL)
+				coro_io_fire(group, engine, f, f->writer, left);
+		}
+	}
+	coro_spin_unlock(&group->io_lock);
+}
+
+/** Poll the descriptors without blocking, if anybody waits for them. */
+static void
+coro_engine_process_io(struct coro_engine *engine)
+{
+	struct coro_group *group = &glob_group;
+	if (__atomic_load_n(&group->io_wait_count, __ATOMIC_SEQ_CST) == 0 ||
+	    __atomic_exchange_n(&group->io_poll_lock, 1, __ATOMIC_ACQUIRE) != 0)
+		return;
+	coro_io_poll(group, engine, 0);
+	__atomic_store_n(&group->io_poll_lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Block in the poller until a descriptor is ready, the nearest
+ * timer of the engine, or a kick about new runnable coroutines.
+ * Returns false if another engine is polling already.
+ */
+static bool
+coro_engine_io_sleep(struct coro_engine *engine)
+{
+	struct coro_group *group = &glob_group;
+	if (__atomic_exchange_n(&group->io_poll_lock, 1, __ATOMIC_ACQUIRE) != 0)
+		return false;
+	uint64_t deadline = coro_engine_next_deadline(engine);
+	/* Set before the check, so the kicks after it are not missed. */
+	__atomic_store_n(&group->is_io_sleeping, true, __ATOMIC_SEQ_CST);
+	bool has_work;
+	if (group->is_mt) {
+		has_work = __atomic_load_n(&group->runnable_count,
+					   __ATOMIC_SEQ_CST) > 0;
+	} else {
+		has_work = __atomic_load_n(&engine->next_count,
+					   __ATOMIC_SEQ_CST) > 0;
+	}
+	int64_t timeout_ns = -1;
+	if (has_work) {
+		timeout_ns = 0;
+	} else if (deadline != UINT64_MAX) {
+		uint64_t now = coro_now_ns();
+		timeout_ns = deadline > now ? (int64_t)(deadline - now) : 0;
+	}
+	coro_io_poll(group, engine, timeout_ns);
+	__atomic_store_n(&group->is_io_sleeping, false, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&group->io_poll_lock, 0, __ATOMIC_RELEASE);
+	return true;
+}
+
+static int
+coro_engine_io_wait(struct coro_engine *engine, int fd, int events,
+	uint64_t timeout_ns)
+{
+	struct coro_group *group = &glob_group;
+	struct coro *this_coro = engine->this_coro;
+	if (this_coro == NULL) {
+		printf("Error: deadlock - I/O wait with no active "
+			"coroutines\n");
+		exit(-1);
+	}
+	if (fd < 0 || events == 0 ||
+	    (events & ~(CORO_IO_READ | CORO_IO_WRITE)) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (__atomic_load_n(&group->io_fd, __ATOMIC_ACQUIRE) < 0 &&
+	    coro_io_open(group) != 0)
+		return -1;
+	struct coro_io_waiter *w = &this_coro->io_waiter;
+	w->coro = this_coro;
+	w->events = events;
+	w->revents = 0;
+	coro_spin_lock(&group->io_lock);
+	coro_io_reserve(group, fd);
+	struct coro_io_fd *f = &group->io_fds[fd];
+	if (((events & CORO_IO_READ) != 0 && f->reader != NULL) ||
+	    ((events & CORO_IO_WRITE) != 0 && f->writer != NULL)) {
+		coro_spin_unlock(&group->io_lock);
+		errno = EBUSY;
+		return -1;
+	}
+	if ((events & CORO_IO_READ) != 0)
+		f->reader = w;
+	if ((events & CORO_IO_WRITE) != 0)
+		f->writer = w;
+	/*
+	 * Armed always, even if it looks armed already. The descriptor
+	 * could be closed and its number reused since then.
+	 */
+	if (coro_io_arm(group, fd, f, events) != 0) {
+		int err = errno;
+		if (f->reader == w)
+			f->reader = NULL;
+		if (f->writer == w)
+			f->writer = NULL;
+		coro_spin_unlock(&group->io_lock);
+		errno = err;
+		return -1;
+	}
+	__atomic_add_fetch(&group->io_wait_count, 1, __ATOMIC_SEQ_CST);
+	coro_spin_unlock(&group->io_lock);
+
+	if (timeout_ns == UINT64_MAX)
+		coro_engine_suspend(engine);
+	else
+		coro_engine_suspend_timeout(engine, timeout_ns);
+
+	/* Woken up by a timeout or coro_wakeup(), still in the table. */
+	coro_spin_lock(&group->io_lock);
+	f = &group->io_fds[fd];
+	if (f->reader == w || f->writer == w) {
+		if (f->reader == w)
+			f->reader = NULL;
+		if (f->writer == w)
+			f->writer = NULL;
+		__atomic_sub_fetch(&group->io_wait_count, 1, __ATOMIC_SEQ_CST);
+	}
+	coro_spin_unlock(&group->io_lock);
+	return w->revents;
+}
+
+/**
+ * Run one iteration of the scheduler on up to @a limit coroutines
+ * from the next-queue. Returns false if there was nothing to run.
+ */
+static bool
+coro_engine_run_once(struct coro_engine *engine, size_t limit)
+{
+	assert(rlist_empty(&engine->coros_running_now));
+	coro_engine_process_timers(engine);
+	coro_engine_process_io(engine);
+	size_t count;
+	coro_spin_lock(&engine->next_lock);
+	if (engine->next_count <= limit) {
+		count = engine->next_count;
+		rlist_splice_tail(&engine->coros_running_now,
+			&engine->coros_running_next);
+	} else {
+		count = limit;
+		for (size_t i = 0; i < count; ++i) {
+			struct coro *c = rlist_shift_entry(
+				&engine->coros_running_next, struct coro, link);
+			rlist_add_tail_entry(&engine->coros_running_now, c,
+				link);
+		}
+	}
+	engine->next_count -= count;
+	coro_spin_unlock(&engine->next_lock);
+	if (count == 0)
+		return false;
+	engine->run_next_count = 0;
+	if (glob_group.is_mt) {
+		__atomic_sub_fetch(&glob_group.runnable_count, count,
+				   __ATOMIC_SEQ_CST);
+	}
+#ifdef LIBCORO_STATS
+	++engine->stats.iteration_count;
+	engine->stats.run_count += count;
+	if (count > engine->stats.run_max)
+		engine->stats.run_max = count;
+#endif
+
+	assert(engine->this_coro == NULL);
+	engine->this_coro = &engine->sched;
+	assert(rlist_empty(&engine->sched.link));
+	/*
+	 * Add the scheduler to the tail so the control comes back in
+	 * the end of this iteration of the loop.
+	 */
+	rlist_add_tail_entry(&engine->coros_running_now, &engine->sched, link);
+	coro_engine_resume_next(engine);
+	assert(rlist_empty(&engine->coros_running_now));
+	assert(engine->this_coro == &engine->sched);
+	engine->this_coro = NULL;
+	return true;
+}
+
+/**
+ * Wait for a wakeup from another thread, or the nearest timer, or
+ * the last coro_sched_release(). Single-threaded mode only.
+ */
+static void
+coro_engine_wait(struct coro_engine *engine)
+{
+	struct coro_group *group = &glob_group;
+	uint64_t deadline = coro_engine_next_deadline(engine);
+	struct timespec ts;
+	coro_deadline_to_timespec(deadline, &ts);
+	pthread_mutex_lock(&group->mutex);
+	__atomic_add_fetch(&group->idle_count, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&engine->next_count, __ATOMIC_SEQ_CST) == 0 &&
+	       __atomic_load_n(&group->hold_count, __ATOMIC_SEQ_CST) > 0) {
+		if (deadline == UINT64_MAX) {
+			pthread_cond_wait(&group->cond, &group->mutex);
+		} else if (pthread_cond_timedwait(&group->cond, &group->mutex,
+						  &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+	__atomic_sub_fetch(&group->idle_count, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&group->mutex);
+}
+
+static void
+coro_engine_run(struct coro_engine *engine)
+{
+	while (true) {
+		if (coro_engine_run_once(engine, SIZE_MAX))
+			continue;
+		if (__atomic_load_n(&glob_group.io_wait_count,
+				    __ATOMIC_SEQ_CST) > 0) {
+			coro_engine_io_sleep(engine);
+			continue;
+		}
+		if (__atomic_load_n(&glob_group.hold_count, __ATOMIC_SEQ_CST) > 0) {
+			coro_engine_wait(engine);
+			continue;
+		}
+		if (!coro_engine_sleep(engine))
+			break;
+	}
+}
+
+/**
+ * Take a half of the next-queue of some other engine. The stolen
+ * coroutines are taken from the tail, which is going to be run the
+ * latest by the victim anyway.
+ */
+static bool
+coro_engine_steal(struct coro_engine *engine)
+{
+	struct coro_group *group = &glob_group;
+	struct rlist stolen;
+	rlist_create(&stolen);
+	for (int i = 0; i < group->engine_count; ++i) {
+		struct coro_engine *victim =
+			group->engines[engine->steal_pos];
+		engine->steal_pos = (engine->steal_pos + 1) %
+			group->engine_count;
+		if (victim == engine ||
+		    __atomic_load_n(&victim->next_count, __ATOMIC_RELAXED) == 0)
+			continue;
+		coro_spin_lock(&victim->next_lock);
+		size_t want = (victim->next_count + 1) / 2;
+		size_t count = 0;
+		struct coro *c, *tmp;
+		rlist_foreach_entry_safe_reverse(c, &victim->coros_running_next,
+						 link, tmp) {
+			if (count == want)
+				break;
+			/* Can run only on the engine of its shared stack. */
+			if (c->shared != NULL)
+				continue;
+			rlist_move_entry(&stolen, c, link);
+			++count;
+		}
+		victim->next_count -= count;
+		coro_spin_unlock(&victim->next_lock);
+		if (count == 0)
+			continue;
+
+		coro_spin_lock(&engine->next_lock);
+		rlist_splice_tail(&engine->coros_running_next, &stolen);
+		engine->next_count += count;
+		coro_spin_unlock(&engine->next_lock);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Sleep until there is something runnable, or the nearest timer of
+ * the engine. While there are I/O waiters, one of the engines
+ * sleeps in the poller instead. Returns false when all the engines
+ * are idle with no timers and no I/O waiters, and the run is over.
+ */
+static bool
+coro_group_wait(struct coro_group *group, struct coro_engine *engine)
+{
+	if (__atomic_load_n(&group->io_wait_count, __ATOMIC_SEQ_CST) > 0 &&
+	    coro_engine_io_sleep(engine))
+		return true;
+	bool res;
+	uint64_t deadline = coro_engine_next_deadline(engine);
+	struct timespec ts;
+	coro_deadline_to_timespec(deadline, &ts);
+	pthread_mutex_lock(&group->mutex);
+	__atomic_add_fetch(&group->idle_count, 1, __ATOMIC_SEQ_CST);
+	while (true) {
+		if (group->is_done) {
+			res = false;
+			break;
+		}
+		if (__atomic_load_n(&group->runnable_count,
+				    __ATOMIC_SEQ_CST) > 0) {
+			res = true;
+			break;
+		}
+		if (group->idle_count == group->engine_count &&
+		    __atomic_load_n(&group->timer_count, __ATOMIC_SEQ_CST) == 0 &&
+		    __atomic_load_n(&group->io_wait_count, __ATOMIC_SEQ_CST) == 0 &&
+		    __atomic_load_n(&group->hold_count, __ATOMIC_SEQ_CST) == 0) {
+			group->is_done = true;
+			pthread_cond_broadcast(&group->cond);
+			res = false;
+			break;
+		}
+		if (deadline == UINT64_MAX) {
+			pthread_cond_wait(&group->cond, &group->mutex);
+		} else if (pthread_cond_timedwait(&group->cond, &group->mutex,
+						  &ts) == ETIMEDOUT) {
+			res = true;
+			break;
+		}
+	}
+	__atomic_sub_fetch(&group->idle_count, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&group->mutex);
+	return res;
+}
+
+static void
+coro_engine_run_mt(struct coro_engine *engine)
+{
+	while (true) {
+		if (coro_engine_run_once(engine, CORO_ENGINE_BATCH_MAX))
+			continue;
+		if (coro_engine_steal(engine))
+			continue;
+		if (!coro_group_wait(&glob_group, engine))
+			break;
+	}
+}
+
+#ifdef LIBCORO_STATS
+
+static void
+coro_sched_stats_add(struct coro_sched_stats *dst,
+	const struct coro_sched_stats *src)
+{
+	dst->switch_count += src->switch_count;
+	dst->iteration_count += src->iteration_count;
+	dst->run_count += src->run_count;
+	if (src->run_max > dst->run_max)
+		dst->run_max = src->run_max;
+	for (int i = 0; i < CORO_LATENCY_BUCKET_COUNT; ++i)
+		dst->latency_hist[i] += src->latency_hist[i];
+}
+
+#endif
+
+/** Move the cached coroutines of one engine into another. */
+static void
+coro_engine_move_pools(struct coro_engine *dst, struct coro_engine *src)
+{
+	for (int i = 0; i < CORO_POOL_COUNT; ++i) {
+		struct rlist *pool = &src->coros_pool[i];
+		while (!rlist_empty(pool)) {
+			struct coro *c = rlist_shift_entry(pool,
+				struct coro, link);
+			if (dst->coros_pool_size[i] >= CORO_STACK_CACHE_MAX) {
+				coro_delete(c);
+				continue;
+			}
+			rlist_add_entry(&dst->coros_pool[i], c, link);
+			++dst->coros_pool_size[i];
+		}
+		src->coros_pool_size[i] = 0;
+	}
+}
+
+static void
+coro_engine_destroy(struct coro_engine *engine)
+{
+	assert(engine->this_coro == NULL);
+	assert(rlist_empty(&engine->coros_running_now));
+	assert(rlist_empty(&engine->coros_running_next));
+	for (int i = 0; i < CORO_POOL_COUNT; ++i) {
+		struct rlist *pool = &engine->coros_pool[i];
+		while (!rlist_empty(pool)) {
+			struct coro *c = rlist_shift_entry(pool,
+				struct coro, link);
+			coro_delete(c);
+		}
+		engine->coros_pool_size[i] = 0;
+	}
+	if (engine->shared_stack != NULL)
+		coro_shared_stack_unref(engine->shared_stack);
+	if (engine->relay_stack != NULL)
+		coro_stack_delete(engine->relay_stack, CORO_RELAY_STACK_SIZE);
+	memset(engine, '#', sizeof(*engine));
+}
+
+/**
+ * Main loop of each coroutine. Runs the function, finishes, and
+ * waits to be reused from the pool for a next function.
+ */
+/**
+ * Drop the coroutine-local values, calling their destructors. The
+ * coroutine is clean for the reuse after that.
+ */
+static void
+coro_locals_destroy(struct coro *c)
+{
+	int count = __atomic_load_n(&coro_key_count, __ATOMIC_ACQUIRE);
+	if (count > CORO_KEY_MAX)
+		count = CORO_KEY_MAX;
+	for (int i = 0; i < count; ++i) {
+		void *value = c->locals[i];
+		if (value == NULL)
+			continue;
+		c->locals[i] = NULL;
+		void (*destructor)(void *) = __atomic_load_n(
+			&coro_key_destructors[i], __ATOMIC_ACQUIRE);
+		if (destructor != NULL)
+			destructor(value);
+	}
+}
+
+static void
+coro_body_loop(struct coro *c)
+{
+	while (true) {
+		c->ret = c->func(c->func_arg);
+		coro_locals_destroy(c);
+#ifdef LIBCORO_STACK_PROFILE
+		if (c->shared == NULL) {
+			c->profile_func = c->func;
+			c->stack_peak = coro_stack_peak(c->stack, c->stack_size);
+			/* Only the dirty part, below the frames in use now. */
+			coro_stack_paint(c->stack + c->stack_size - c->stack_peak,
+				coro_stack_pointer() - CORO_STACK_RED_ZONE);
+		}
+#endif
+		c->func = NULL;
+		assert(c->state == CORO_STATE_RUNNING);
+		struct coro_engine *engine = this_engine;
+		if (c->shared != NULL) {
+			/*
+			 * Nothing to save anymore. The next run makes a new
+			 * context, and this frame is dropped.
+			 */
+			c->shared->owner = NULL;
+			c->is_ctx_pending = true;
+		}
+		__atomic_store_n(&c->is_switching, true, __ATOMIC_RELAXED);
+		struct coro *joiner = __atomic_exchange_n(&c->joiner,
+			CORO_JOINER_DONE, __ATOMIC_SEQ_CST);
+		if (joiner == CORO_JOINER_GROUP) {
+			/* The group is alive until it is 0. */
+			struct coro_wait_group *wg = c->wait_group;
+			struct coro *waiter = wg->waiter;
+			if (__atomic_sub_fetch(&wg->remaining, 1,
+					       __ATOMIC_SEQ_CST) == 0)
+				coro_engine_wakeup(engine, waiter);
+		} else if (joiner == CORO_JOINER_DETACHED) {
+			/* Can't be released on its own stack. */
+			engine->detached_done = c;
+		} else if (joiner != NULL) {
+			coro_engine_wakeup(engine, joiner);
+		}
+		/*
+		 * The joiner waits for this state to be sure the
+		 * wakeup above doesn't touch it anymore.
+		 */
+		__atomic_store_n(&c->state, CORO_STATE_FINISHED,
+				 __ATOMIC_RELEASE);
+		coro_engine_resume_next(engine);
+		/*
+		 * Here it is restarted already, must have its
+		 * state restored.
+		 */
+		assert(c->state == CORO_STATE_RUNNING);
+		assert(c->func != NULL);
+	}
+}
+
+#if CORO_CTX_ASM
+
+/**
+ * Entry point of a new coroutine. The context is built directly
+ * on the new stack, so no signals are involved. The scheduler
+ * installs the coroutine as current before switching here.
+ */
+static void
+coro_body(void *arg)
+{
+	struct coro *c = (struct coro *)arg;
+	coro_engine_switch_done();
+	assert(this_engine->this_coro == c);
+	coro_body_loop(c);
+}
+
+static void
+coro_engine_prepare_ctx(struct coro_engine *engine, struct coro *c,
+	size_t stack_size)
+{
+	(void)engine;
+	coro_ctx_make(&c->ctx, c->stack, stack_size, coro_body, c);
+}
+
+static void
+coro_relay_body(void *arg)
+{
+	coro_relay_loop((struct coro_engine *)arg);
+}
+
+static void
+coro_engine_prepare_relay(struct coro_engine *engine)
+{
+	coro_ctx_make(&engine->relay_ctx, engine->relay_stack,
+		CORO_RELAY_STACK_SIZE, coro_relay_body, engine);
+}
+
+#else /* !CORO_CTX_ASM */
+
+static __thread struct coro_engine *new_coro_engine = NULL;
+
+/**
+ * The first function executed on a new coroutine stack. It
+ * remembers its context in a form suitable for the fast switch
+ * and returns into the constructor. Later the coroutine continues
+ * from here.
+ */
+static void
+coro_body(void)
+{
+	struct coro_engine *my_engine = new_coro_engine;
+	new_coro_engine = NULL;
+
+	struct coro *c = my_engine->this_coro;
+	/*
+	 * On invocation jump back to the constructor right after
+	 * remembering the context.
+	 */
+	if (sigsetjmp(c->ctx.buf, 0) == 0)
+		setcontext(&my_engine->start_point);
+	/*
+	 * If the execution is here, then the coroutine should
+	 * finally start work. Not necessarily in the thread which
+	 * has created it.
+	 */
+	coro_engine_switch_done();
+	assert(this_engine->this_coro == c);
+	coro_body_loop(c);
+}
+
+/**
+ * Run @a func on the stack until it remembers its context and
+ * returns into engine->start_point.
+ */
+static void
+coro_engine_enter_stack(struct coro_engine *engine, uint8_t *stack,
+	size_t stack_size, void (*func)(void))
+{
+	/*
+	 * No signals and no sigaltstack - the initial frame is built
+	 * by makecontext() right on the new stack. It is entered only
+	 * once, to turn it into a sigjmp context. The function gets
+	 * no arguments because makecontext() can only pass ints.
+	 */
+	ucontext_t uc;
+	if (getcontext(&uc) != 0)
+		handle_error();
+	uc.uc_stack.ss_sp = stack;
+	uc.uc_stack.ss_size = stack_size;
+	uc.uc_link = NULL;
+	makecontext(&uc, func, 0);
+
+	assert(new_coro_engine == NULL);
+	new_coro_engine = engine;
+	if (swapcontext(&engine->start_point, &uc) != 0)
+		handle_error();
+	assert(new_coro_engine == NULL);
+}
+
+static void
+coro_engine_prepare_ctx(struct coro_engine *engine, struct coro *c,
+	size_t stack_size)
+{
+	struct coro *old_this = engine->this_coro;
+	engine->this_coro = c;
+	coro_engine_enter_stack(engine, c->stack, stack_size, coro_body);
+	engine->this_coro = old_this;
+}
+
+static void
+coro_relay_body(void)
+{
+	struct coro_engine *my_engine = new_coro_engine;
+	new_coro_engine = NULL;
+	if (sigsetjmp(my_engine->relay_ctx.buf, 0) == 0)
+		setcontext(&my_engine->start_point);
+	coro_relay_loop(my_engine);
+}
+
+static void
+coro_engine_prepare_relay(struct coro_engine *engine)
+{
+	coro_engine_enter_stack(engine, engine->relay_stack,
+		CORO_RELAY_STACK_SIZE, coro_relay_body);
+}
+
+#endif /* !CORO_CTX_ASM */
+
+/** The relay is needed by an engine running shared stacks. */
+static void
+coro_engine_open_relay(struct coro_engine *engine)
+{
+	if (engine->relay_stack != NULL)
+		return;
+	engine->relay_stack = coro_stack_new(CORO_RELAY_STACK_SIZE);
+	coro_engine_prepare_relay(engine);
+}
+
+static struct coro_shared_stack *
+coro_engine_shared_stack(struct coro_engine *engine)
+{
+	if (engine->shared_stack != NULL)
+		return engine->shared_stack;
+	struct coro_shared_stack *s = new coro_shared_stack();
+	s->stack = coro_stack_new(CORO_SHARED_STACK_SIZE);
+	s->size = CORO_SHARED_STACK_SIZE;
+	s->owner = NULL;
+	s->engine = engine;
+	s->ref_count = 1;
+	engine->shared_stack = s;
+	coro_engine_open_relay(engine);
+	return s;
+}
+
+/**
+ * Give the shared stack of a finished engine to another one,
+ * together with the coroutines still using it.
+ */
+static void
+coro_engine_move_shared_stack(struct coro_engine *dst,
+	struct coro_engine *src)
+{
+	struct coro_shared_stack *s = src->shared_stack;
+	if (s == NULL)
+		return;
+	s->engine = dst;
+	if (s->ref_count > 1)
+		coro_engine_open_relay(dst);
+}
+
+static struct coro *
+coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg,
+	int stack_class)
+{
+	struct coro *c = new coro();
+	c->state = CORO_STATE_RUNNING;
+	c->is_switching = false;
+	c->is_wakeup_pending = false;
+	c->ret = NULL;
+	c->stack_class = stack_class;
+	c->func = func;
+	c->func_arg = func_arg;
+	c->engine = engine;
+	c->joiner = NULL;
+	rlist_create(&c->link);
+	if (stack_class == CORO_POOL_SHARED) {
+		struct coro_shared_stack *s = coro_engine_shared_stack(engine);
+		__atomic_add_fetch(&s->ref_count, 1, __ATOMIC_RELAXED);
+		c->shared = s;
+		c->stack = s->stack;
+		c->stack_size = s->size;
+		c->is_ctx_pending = true;
+	} else {
+		size_t stack_size = coro_stack_class_size(stack_class);
+		c->stack = coro_stack_new(stack_size);
+		c->stack_size = stack_size;
+#ifdef LIBCORO_STACK_PROFILE
+		/* Commits the whole stack, so it is for debug builds only. */
+		coro_stack_paint(c->stack, c->stack + stack_size);
+#endif
+		coro_engine_prepare_ctx(engine, c, stack_size);
+	}
+
+	/* Now scheduler can work with that coroutine. */
+	struct coro_group *group = &glob_group;
+	pthread_mutex_lock(&group->mutex);
+	rlist_add_tail_entry(&group->coros_all, c, all_link);
+	++group->coro_count;
+	pthread_mutex_unlock(&group->mutex);
+	assert(rlist_empty(&c->link));
+	return c;
+}
+
+/**
+ * Make a coroutine, from the pool when possible. It is not
+ * runnable until pushed into a run queue.
+ */
+static struct coro *
+coro_engine_make(struct coro_engine *engine, coro_f func, void *func_arg,
+	int stack_class)
+{
+	struct rlist *pool = &engine->coros_pool[stack_class];
+	if (rlist_empty(pool)) {
+		struct coro *c = coro_engine_spawn_new(engine, func, func_arg,
+			stack_class);
+#ifdef LIBCORO_TRACE
+		coro_trace_event(CORO_TRACE_SPAWN, c, 0);
+#endif
+		return c;
+	}
+
+	struct coro *c = rlist_shift_entry(pool, struct coro, link);
+	assert(engine->coros_pool_size[stack_class] > 0);
+	--engine->coros_pool_size[stack_class];
+	c->func = func;
+	c->func_arg = func_arg;
+	c->joiner = NULL;
+	c->is_wakeup_pending = false;
+#ifdef LIBCORO_STATS
+	c->run_start_ns = 0;
+	c->cpu_ns = 0;
+#endif
+	c->state = CORO_STATE_RUNNING;
+	assert(rlist_empty(&c->link));
+#ifdef LIBCORO_TRACE
+	coro_trace_event(CORO_TRACE_SPAWN, c, 0);
+#endif
+	return c;
+}
+
+static struct coro *
+coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg,
+	int stack_class)
+{
+	struct coro *c = coro_engine_make(engine, func, func_arg, stack_class);
+	coro_engine_push(engine, c);
+	return c;
+}
+
+/**
+ * Free a finished coroutine, or put it into the pool for reuse.
+ * Returns its result.
+ */
+static void *
+coro_engine_release(struct coro_engine *engine, struct coro *coro)
+{
+	/* The finishing coroutine is about to leave the wakeup. */
+	int spin_count = 0;
+	while (__atomic_load_n(&coro->state, __ATOMIC_ACQUIRE) !=
+	       CORO_STATE_FINISHED)
+		coro_cpu_relax(&spin_count);
+	void *ret = coro->ret;
+	coro->ret = NULL;
+	assert(rlist_empty(&coro->link));
+#ifdef LIBCORO_STACK_PROFILE
+	if (coro->shared == NULL) {
+		coro_stack_profile_add(coro->profile_func, coro->stack_peak,
+			coro->stack_size);
+	}
+#endif
+	int stack_class = coro->stack_class;
+	if (engine->coros_pool_size[stack_class] >= CORO_STACK_CACHE_MAX) {
+		/* Let it leave the stack before unmapping. */
+		while (__atomic_load_n(&coro->is_switching, __ATOMIC_ACQUIRE))
+			coro_cpu_relax(&spin_count);
+		coro_delete(coro);
+		return ret;
+	}
+	rlist_add_entry(&engine->coros_pool[stack_class], coro, link);
+	++engine->coros_pool_size[stack_class];
+	return ret;
+}
+
+static void *
+coro_engine_join(struct coro_engine *engine, struct coro *coro)
+{
+	struct coro *this_coro = engine->this_coro;
+	bool is_registered = false;
+	if (this_coro == NULL &&
+	    __atomic_load_n(&coro->joiner, __ATOMIC_SEQ_CST) != CORO_JOINER_DONE) {
+		printf("Error: deadlock - join of a running coroutine with "
+			"no active coroutines\n");
+		exit(-1);
+	}
+	while (this_coro != NULL) {
+		/*
+		 * The state is changed before the checks, so the
+		 * finishing coroutine can't miss the joiner.
+		 */
+		coro_prepare_suspend(this_coro);
+		if (!is_registered) {
+			struct coro *expected = NULL;
+			is_registered = __atomic_compare_exchange_n(
+				&coro->joiner, &expected, this_coro, false,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			assert(is_registered || expected == CORO_JOINER_DONE);
+		}
+		if (__atomic_load_n(&coro->joiner, __ATOMIC_SEQ_CST) ==
+		    CORO_JOINER_DONE) {
+			coro_engine_cancel_suspend(engine, this_coro);
+			break;
+		}
+		coro_engine_resume_next(engine);
+		engine = this_engine;
+	}
+	if (this_coro != NULL)
+		engine = this_engine;
+	assert(engine->this_coro == this_coro);
+	return coro_engine_release(engine, coro);
+}
+
+/**
+ * Join many coroutines with one suspension: each finishing one
+ * decrements the counter, and the last one wakes the joiner up.
+ */
+static void
+coro_engine_join_all(struct coro_engine *engine, struct coro **coros,
+	size_t count, void **results)
+{
+	struct coro *this_coro = engine->this_coro;
+	struct coro_wait_group local_wg;
+	struct coro_wait_group *wg = this_coro != NULL ?
+		&this_coro->join_group : &local_wg;
+	/* The own reference keeps the joiner from early wakeups. */
+	wg->remaining = count + 1;
+	wg->waiter = this_coro;
+	for (size_t i = 0; i < count; ++i) {
+		struct coro *c = coros[i];
+		c->wait_group = wg;
+		struct coro *expected = NULL;
+		if (!__atomic_compare_exchange_n(&c->joiner, &expected,
+						 CORO_JOINER_GROUP, false,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_SEQ_CST)) {
+			assert(expected == CORO_JOINER_DONE);
+			__atomic_sub_fetch(&wg->remaining, 1, __ATOMIC_SEQ_CST);
+		}
+	}
+	if (__atomic_sub_fetch(&wg->remaining, 1, __ATOMIC_SEQ_CST) != 0 &&
+	    this_coro == NULL) {
+		printf("Error: deadlock - join of a running coroutine with "
+			"no active coroutines\n");
+		exit(-1);
+	}
+	while (this_coro != NULL) {
+		coro_prepare_suspend(this_coro);
+		if (__atomic_load_n(&wg->remaining, __ATOMIC_SEQ_CST) == 0) {
+			coro_engine_cancel_suspend(engine, this_coro);
+			break;
+		}
+		coro_engine_resume_next(engine);
+		engine = this_engine;
+	}
+	if (this_coro != NULL)
+		engine = this_engine;
+	for (size_t i = 0; i < count; ++i) {
+		void *ret = coro_engine_release(engine, coros[i]);
+		if (results != NULL)
+			results[i] = ret;
+	}
+}
+
+static void *
+coro_worker_f(void *arg)
+{
+	struct coro_engine *engine = (struct coro_engine *)arg;
+	this_engine = engine;
+	coro_engine_run_mt(engine);
+	this_engine = NULL;
+	return NULL;
+}
+
+//////////////////////////////////////////////////////////////////
+
+static struct coro_engine glob_engine;
+
+void
+coro_sched_init(void)
+{
+	coro_engine_create(&glob_engine);
+	struct coro_group *group = &glob_group;
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&group->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	rlist_create(&group->coros_all);
+	group->coro_count = 0;
+	group->engines = new struct coro_engine *[1];
+	group->engines[0] = &glob_engine;
+	group->engine_count = 1;
+	this_engine = &glob_engine;
+}
+
+void
+coro_sched_run(void)
+{
+	coro_engine_run(&glob_engine);
+}
+
+void
+coro_sched_run_mt(int thread_count)
+{
+	if (thread_count <= 1) {
+		coro_sched_run();
+		return;
+	}
+	struct coro_group *group = &glob_group;
+	assert(!group->is_mt);
+	assert(this_engine == &glob_engine);
+	assert(glob_engine.this_coro == NULL);
+	delete[] group->engines;
+	group->engines = new struct coro_engine *[thread_count];
+	group->engines[0] = &glob_engine;
+	for (int i = 1; i < thread_count; ++i) {
+		group->engines[i] = new coro_engine();
+		coro_engine_create(group->engines[i]);
+		group->engines[i]->steal_pos = i;
+		group->engines[i]->id = i;
+	}
+	group->engine_count = thread_count;
+	group->runnable_count = glob_engine.next_count;
+	group->idle_count = 0;
+	group->is_done = false;
+	group->is_mt = true;
+
+	pthread_t *threads = new pthread_t[thread_count - 1];
+	for (int i = 1; i < thread_count; ++i) {
+		int rc = pthread_create(&threads[i - 1], NULL, coro_worker_f,
+			group->engines[i]);
+		if (rc != 0) {
+			errno = rc;
+			handle_error();
+		}
+	}
+	coro_engine_run_mt(&glob_engine);
+	for (int i = 1; i < thread_count; ++i)
+		pthread_join(threads[i - 1], NULL);
+	delete[] threads;
+
+	group->is_mt = false;
+	for (int i = 1; i < thread_count; ++i) {
+		struct coro_engine *engine = group->engines[i];
+		coro_engine_move_pools(&glob_engine, engine);
+		coro_engine_move_shared_stack(&glob_engine, engine);
+#ifdef LIBCORO_STATS
+		coro_sched_stats_add(&glob_engine.stats, &engine->stats);
+#endif
+		coro_engine_destroy(engine);
+		delete engine;
+	}
+	group->engine_count = 1;
+}
+
+void
+coro_sched_set_run_next(bool is_enabled)
+{
+	__atomic_store_n(&glob_group.is_run_next, is_enabled, __ATOMIC_RELAXED);
+}
+
+void
+coro_sched_hold(void)
+{
+	__atomic_add_fetch(&glob_group.hold_count, 1, __ATOMIC_SEQ_CST);
+}
+
+void
+coro_sched_release(void)
+{
+	struct coro_group *group = &glob_group;
+	size_t old = __atomic_fetch_sub(&group->hold_count, 1,
+					__ATOMIC_SEQ_CST);
+	assert(old > 0);
+	(void)old;
+	if (old > 1)
+		return;
+	pthread_mutex_lock(&group->mutex);
+	pthread_cond_broadcast(&group->cond);
+	pthread_mutex_unlock(&group->mutex);
+}
+
+void
+coro_sched_host_start(int engine_count, coro_host_submit_f submit,
+	void *arg)
+{
+	struct coro_group *group = &glob_group;
+	assert(!group->is_mt);
+	assert(engine_count > 0);
+	assert(this_engine == &glob_engine);
+	assert(glob_engine.this_coro == NULL);
+	delete[] group->engines;
+	group->engines = new struct coro_engine *[engine_count + 1];
+	group->engines[0] = &glob_engine;
+	for (int i = 1; i <= engine_count; ++i) {
+		group->engines[i] = new coro_engine();
+		coro_engine_create(group->engines[i]);
+		group->engines[i]->steal_pos = i;
+		group->engines[i]->id = i;
+	}
+	group->engine_count = engine_count + 1;
+	group->runnable_count = glob_engine.next_count;
+	group->idle_count = 0;
+	group->is_done = false;
+	group->host_active = 0;
+	group->host_spawn_count = 0;
+	rlist_create(&group->host_spawns);
+	group->host_arg = arg;
+	group->host_submit = submit;
+	group->is_mt = true;
+	/* The main engine's coroutines are stolen by the hosts. */
+	if (group->runnable_count > 0)
+		coro_host_kick(group);
+}
+
+/**
+ * Take a free hosted engine, the ones with runnable coroutines
+ * first. The caller is counted in host_active, so there is a free
+ * one, maybe being released right now.
+ */
+static struct coro_engine *
+coro_host_take_engine(struct coro_group *group)
+{
+	while (true) {
+		for (int pass = 0; pass < 2; ++pass) {
+			for (int i = 1; i < group->engine_count; ++i) {
+				struct coro_engine *e = group->engines[i];
+				if (pass == 0 &&
+				    __atomic_load_n(&e->next_count,
+						    __ATOMIC_SEQ_CST) == 0)
+					continue;
+				bool expected = false;
+				if (__atomic_compare_exchange_n(
+					&e->is_host_taken, &expected, true,
+					false, __ATOMIC_ACQUIRE,
+					__ATOMIC_RELAXED))
+					return e;
+			}
+		}
+		sched_yield();
+	}
+}
+
+/** Make the coroutines requested by the threads without engines. */
+static void
+coro_host_take_spawns(struct coro_group *group, struct coro_engine *engine)
+{
+	if (__atomic_load_n(&group->host_spawn_count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	struct rlist spawns;
+	rlist_create(&spawns);
+	coro_spin_lock(&group->host_lock);
+	rlist_splice_tail(&spawns, &group->host_spawns);
+	size_t count = __atomic_exchange_n(&group->host_spawn_count, 0,
+					   __ATOMIC_SEQ_CST);
+	coro_spin_unlock(&group->host_lock);
+	int stack_class = coro_stack_class(CORO_STACK_SIZE_DEFAULT);
+	struct coro_host_spawn *s, *tmp;
+	rlist_foreach_entry_safe(s, &spawns, link, tmp) {
+		struct coro *c = coro_engine_make(engine, s->func,
+			s->func_arg, stack_class);
+		c->joiner = CORO_JOINER_DETACHED;
+		coro_engine_push(engine, c);
+		delete s;
+	}
+	/* Now they are counted by the pushes. */
+	__atomic_sub_fetch(&group->runnable_count, count, __ATOMIC_SEQ_CST);
+}
+
+void
+coro_sched_host_run(void)
+{
+	struct coro_group *group = &glob_group;
+	assert(group->host_submit != NULL);
+	struct coro_engine *old_engine = this_engine;
+	bool is_first = true;
+	while (true) {
+		struct coro_engine *engine = coro_host_take_engine(group);
+		this_engine = engine;
+		bool has_run = false;
+		while (true) {
+			coro_host_take_spawns(group, engine);
+			if (!coro_engine_run_once(engine,
+						  CORO_ENGINE_BATCH_MAX) &&
+			    !coro_engine_steal(engine))
+				break;
+			has_run = true;
+		}
+		this_engine = old_engine;
+		__atomic_store_n(&engine->is_host_taken, false,
+				 __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&group->host_active, 1, __ATOMIC_SEQ_CST);
+		/*
+		 * Work which came while all the engines were taken has
+		 * nobody submitted for it. Take it, unless it belongs to
+		 * an engine which is taken: then its host does it.
+		 */
+		if (!is_first && !has_run)
+			break;
+		is_first = false;
+		if (__atomic_load_n(&group->runnable_count,
+				    __ATOMIC_SEQ_CST) == 0 ||
+		    !coro_host_try_activate(group))
+			break;
+	}
+}
+
+void
+coro_sched_host_spawn(coro_f func, void *func_arg)
+{
+	struct coro_group *group = &glob_group;
+	assert(group->host_submit != NULL);
+	struct coro_engine *engine = this_engine;
+	if (engine != NULL && engine != &glob_engine) {
+		struct coro *c = coro_engine_make(engine, func, func_arg,
+			coro_stack_class(CORO_STACK_SIZE_DEFAULT));
+		c->joiner = CORO_JOINER_DETACHED;
+		coro_engine_push(engine, c);
+		return;
+	}
+	struct coro_host_spawn *s = new coro_host_spawn();
+	s->func = func;
+	s->func_arg = func_arg;
+	/* Counted before it is visible, so the count never goes below. */
+	__atomic_add_fetch(&group->runnable_count, 1, __ATOMIC_SEQ_CST);
+	coro_spin_lock(&group->host_lock);
+	rlist_add_tail_entry(&group->host_spawns, s, link);
+	__atomic_add_fetch(&group->host_spawn_count, 1, __ATOMIC_SEQ_CST);
+	coro_spin_unlock(&group->host_lock);
+	coro_host_kick(group);
+}
+
+void
+coro_sched_host_stop(void)
+{
+	struct coro_group *group = &glob_group;
+	assert(group->host_submit != NULL);
+	assert(this_engine == &glob_engine);
+	while (__atomic_load_n(&group->host_active, __ATOMIC_SEQ_CST) > 0)
+		sched_yield();
+	assert(group->host_spawn_count == 0);
+	group->is_mt = false;
+	group->host_submit = NULL;
+	group->host_arg = NULL;
+	for (int i = 1; i < group->engine_count; ++i) {
+		struct coro_engine *engine = group->engines[i];
+		coro_engine_move_pools(&glob_engine, engine);
+		coro_engine_move_shared_stack(&glob_engine, engine);
+#ifdef LIBCORO_STATS
+		coro_sched_stats_add(&glob_engine.stats, &engine->stats);
+#endif
+		coro_engine_destroy(engine);
+		delete engine;
+	}
+	group->engine_count = 1;
+}
+
+void
+coro_sched_destroy(void)
+{
+	coro_engine_destroy(&glob_engine);
+	struct coro_group *group = &glob_group;
+	assert(rlist_empty(&group->coros_all));
+	assert(group->coro_count == 0);
+	assert(group->timer_count == 0);
+	assert(group->hold_count == 0);
+	coro_io_close(group);
+#ifdef LIBCORO_STACK_PROFILE
+	delete[] coro_profile;
+	coro_profile = NULL;
+	coro_profile_count = 0;
+	coro_profile_cap = 0;
+#endif
+#ifdef LIBCORO_TRACE
+	coro_trace_is_on = false;
+	coro_trace_clear();
+#endif
+	pthread_cond_destroy(&group->cond);
+	delete[] group->engines;
+	group->engines = NULL;
+	group->engine_count = 0;
+	this_engine = NULL;
+}
+
+/**
+ * Engine of the calling thread. Threads without an own engine work
+ * with the main one.
+ */
+static inline struct coro_engine *
+coro_engine_this(void)
+{
+	return this_engine != NULL ? this_engine : &glob_engine;
+}
+
+struct coro *
+coro_this(void)
+{
+	return this_engine != NULL ? this_engine->this_coro : NULL;
+}
+
+int
+coro_key_create(void (*destructor)(void *))
+{
+	int key = __atomic_fetch_add(&coro_key_count, 1, __ATOMIC_ACQ_REL);
+	if (key >= CORO_KEY_MAX)
+		return -1;
+	__atomic_store_n(&coro_key_destructors[key], destructor,
+			 __ATOMIC_RELEASE);
+	return key;
+}
+
+void *
+coro_getspecific(int key)
+{
+	struct coro *c = coro_this();
+	if (c == NULL || key < 0 || key >= CORO_KEY_MAX)
+		return NULL;
+	return c->locals[key];
+}
+
+int
+coro_setspecific(int key, void *value)
+{
+	struct coro *c = coro_this();
+	if (c == NULL || key < 0 || key >= CORO_KEY_MAX)
+		return -1;
+	c->locals[key] = value;
+	return 0;
+}
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_engine_spawn(coro_engine_this(), func, func_arg,
+		coro_stack_class(CORO_STACK_SIZE_DEFAULT));
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size)
+{
+	return coro_engine_spawn(coro_engine_this(), func, func_arg,
+		coro_stack_class(stack_size));
+}
+
+struct coro *
+coro_new_shared(coro_f func, void *func_arg)
+{
+	return coro_engine_spawn(coro_engine_this(), func, func_arg,
+		CORO_POOL_SHARED);
+}
+
+void
+coro_new_many(coro_f func, void **func_args, size_t count,
+	struct coro **coros)
+{
+	struct coro_engine *engine = coro_engine_this();
+	int stack_class = coro_stack_class(CORO_STACK_SIZE_DEFAULT);
+	for (size_t i = 0; i < count; ++i) {
+		coros[i] = coro_engine_make(engine, func,
+			func_args != NULL ? func_args[i] : NULL, stack_class);
+	}
+	coro_engine_push_many(engine, coros, count);
+}
+
+void
+coro_join_all(struct coro **coros, size_t count, void **results)
+{
+	coro_engine_join_all(coro_engine_this(), coros, count, results);
+}
+
+void
+coro_stack_stats(struct coro_stack_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	struct coro_group *group = &glob_group;
+	pthread_mutex_lock(&group->mutex);
+	struct coro *c;
+	rlist_foreach_entry(c, &group->coros_all, all_link) {
+		/* The shared stacks themselves are counted by the engines. */
+		if (c->shared != NULL) {
+			stats->reserved += c->save_cap;
+			stats->committed += c->save_cap;
+			++stats->count;
+			continue;
+		}
+		stats->reserved += c->stack_size + coro_page_size();
+		stats->committed += coro_stack_committed(c->stack,
+			c->stack_size);
+		++stats->count;
+	}
+	pthread_mutex_unlock(&group->mutex);
+	for (int i = 0; i < group->engine_count; ++i) {
+		struct coro_engine *engine = group->engines[i];
+		struct coro_shared_stack *s = engine->shared_stack;
+		if (s != NULL) {
+			stats->reserved += s->size + coro_page_size();
+			stats->committed += coro_stack_committed(s->stack,
+				s->size);
+		}
+		for (int j = 0; j < CORO_POOL_COUNT; ++j)
+			stats->cached_count += engine->coros_pool_size[j];
+	}
+#ifdef LIBCORO_STACK_PROFILE
+	coro_spin_lock(&coro_profile_lock);
+	for (size_t i = 0; i < coro_profile_count; ++i) {
+		if (coro_profile[i].peak_max > stats->peak_max)
+			stats->peak_max = coro_profile[i].peak_max;
+	}
+	coro_spin_unlock(&coro_profile_lock);
+#endif
+}
+
+size_t
+coro_stack_usage(struct coro_stack_usage *usage, size_t cap)
+{
+#ifdef LIBCORO_STACK_PROFILE
+	coro_spin_lock(&coro_profile_lock);
+	size_t count = coro_profile_count;
+	memcpy(usage, coro_profile,
+	       (count < cap ? count : cap) * sizeof(usage[0]));
+	coro_spin_unlock(&coro_profile_lock);
+	return count;
+#else
+	(void)usage;
+	(void)cap;
+	return 0;
+#endif
+}
+
+void
+coro_sched_stats(struct coro_sched_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+#ifdef LIBCORO_STATS
+	struct coro_group *group = &glob_group;
+	for (int i = 0; i < group->engine_count; ++i)
+		coro_sched_stats_add(stats, &group->engines[i]->stats);
+#endif
+}
+
+uint64_t
+coro_cpu_time(struct coro *coro)
+{
+#ifdef LIBCORO_STATS
+	uint64_t res = coro->cpu_ns;
+	/* The current coroutine is charged on the next switch only. */
+	if (coro == coro_this())
+		res += coro_now_ns() - coro->run_start_ns;
+	return res;
+#else
+	(void)coro;
+	return 0;
+#endif
+}
+
+void
+coro_set_switch_hook(coro_switch_hook_f hook, void *arg)
+{
+#ifdef LIBCORO_STATS
+	coro_switch_hook_arg = arg;
+	coro_switch_hook = hook;
+#else
+	(void)hook;
+	(void)arg;
+#endif
+}
+
+void
+coro_trace_start(size_t record_count)
+{
+#ifdef LIBCORO_TRACE
+	coro_trace_clear();
+	size_t size = 1;
+	while (size < record_count)
+		size *= 2;
+	coro_trace_size = size;
+	__atomic_store_n(&coro_trace_is_on, true, __ATOMIC_RELAXED);
+#else
+	(void)record_count;
+#endif
+}
+
+void
+coro_trace_stop(void)
+{
+#ifdef LIBCORO_TRACE
+	__atomic_store_n(&coro_trace_is_on, false, __ATOMIC_RELAXED);
+#endif
+}
+
+void
+coro_trace_add(enum coro_trace_event event, uint32_t arg)
+{
+#ifdef LIBCORO_TRACE
+	struct coro_engine *engine = this_engine;
+	if (engine == NULL || engine->this_coro == NULL)
+		return;
+	coro_trace_event(event, engine->this_coro, arg);
+#else
+	(void)event;
+	(void)arg;
+#endif
+}
 
-struct coro_engine {
-	/**
-	 * Scheduler is the main coroutine - it represents the
-	 * context in which the scheduler itself runs.
-	 */
-	struct coro sched;
-	/** Which coroutine works at this moment. */
-	struct coro *this_coro;
+size_t
+coro_trace_copy(struct coro_trace_record *records, size_t cap)
+{
+#ifdef LIBCORO_TRACE
+	size_t count = 0;
+	for (struct coro_trace_ring *ring = coro_trace_rings; ring != NULL;
+	     ring = ring->next) {
+		uint64_t begin = 0;
+		if (ring->pos > ring->mask + 1)
+			begin = ring->pos - ring->mask - 1;
+		for (uint64_t i = begin; i < ring->pos; ++i, ++count) {
+			if (count < cap)
+				records[count] = ring->records[i & ring->mask];
+		}
+	}
+	return count;
+#else
+	(void)records;
+	(void)cap;
+	return 0;
+#endif
+}
 
-	/**
-	 * Coroutines to run in this iteration of the loop. The
-	 * list gets populated once at the start of the iteration.
-	 */
-	struct rlist coros_running_now;
-	/**
-	 * Coroutines to run in the next iteration of the loop.
-	 * The list gets populated by wakeups and yields and new
-	 * coros.
-	 */
-	struct rlist coros_running_next;
-	/** Joined coroutines to be reused. */
-	struct rlist coros_pool;
-	/** Total number of coroutines, including the pool. */
-	size_t coro_count;
-	/**
-	 * Buffer, used by the coroutine constructor to escape
-	 * from the signal handler back into the constructor to
-	 * rollback sigaltstack etc.
-	 */
-	sigjmp_buf start_point;
+#ifdef LIBCORO_TRACE
+
+static const char *const coro_trace_event_names[CORO_TRACE_EVENT_COUNT] = {
+	"spawn",
+	"switch",
+	"suspend",
+	"wakeup",
+	"send",
+	"recv",
+	"block",
 };
 
+/** Separate the next event of the JSON from the previous one. */
 static void
-coro_engine_create(struct coro_engine *engine)
+coro_trace_dump_sep(FILE *f, bool *is_first)
 {
-	memset(engine, 0, sizeof(*engine));
-	rlist_create(&engine->sched.link);
-	rlist_create(&engine->coros_running_now);
-	rlist_create(&engine->coros_running_next);
-	rlist_create(&engine->coros_pool);
+	if (!*is_first)
+		fputs(",\n", f);
+	*is_first = false;
 }
 
-static void
-coro_engine_resume_next(struct coro_engine *engine)
+#endif
+
+int
+coro_trace_dump(const char *path)
 {
-	assert(!rlist_empty(&engine->coros_running_now));
-	struct coro *to = rlist_shift_entry(&engine->coros_running_now,
-		struct coro, link);
-	struct coro *from = engine->this_coro;
-	assert(from != NULL);
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	fputs("{\"traceEvents\":[\n", f);
+#ifdef LIBCORO_TRACE
+	size_t count = coro_trace_copy(NULL, 0);
+	struct coro_trace_record *records = new coro_trace_record[count];
+	coro_trace_copy(records, count);
+	/* Perfetto shows the time from the first event. */
+	uint64_t base_ns = UINT64_MAX;
+	for (size_t i = 0; i < count; ++i) {
+		if (records[i].ns < base_ns)
+			base_ns = records[i].ns;
+	}
+	bool is_first = true;
+	/*
+	 * The records of one engine go in a row. A switch ends the
+	 * slice of the previous coroutine of the engine, the last
+	 * slice ends with the last record.
+	 */
+	for (size_t i = 0; i < count; ++i) {
+		const struct coro_trace_record *r = &records[i];
+		if (i == 0 || records[i - 1].engine != r->engine) {
+			coro_trace_dump_sep(f, &is_first);
+			fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\","
+				"\"pid\":1,\"tid\":%d,\"args\":{\"name\":"
+				"\"engine %d\"}}", (int)r->engine,
+				(int)r->engine);
+		}
+		if (r->event == CORO_TRACE_SWITCH) {
+			size_t end = i + 1;
+			while (end < count && records[end].engine == r->engine &&
+			       records[end].event != CORO_TRACE_SWITCH)
+				++end;
+			if (end == count || records[end].engine != r->engine)
+				--end;
+			coro_trace_dump_sep(f, &is_first);
+			if (r->coro == NULL)
+				fputs("{\"name\":\"sched\"", f);
+			else
+				fprintf(f, "{\"name\":\"coro %p\"", (void *)r->coro);
+			fprintf(f, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+				"\"ts\":%.3f,\"dur\":%.3f}", (int)r->engine,
+				(r->ns - base_ns) / 1000.0,
+				(records[end].ns - r->ns) / 1000.0);
+			continue;
+		}
+		coro_trace_dump_sep(f, &is_first);
+		fprintf(f, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+			"\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{"
+			"\"coro\":\"%p\",\"arg\":%u}}",
+			coro_trace_event_names[r->event], (int)r->engine,
+			(r->ns - base_ns) / 1000.0, (void *)r->coro,
+			(unsigned)r->arg);
+	}
+	delete[] records;
+#endif
+	fputs("\n]}\n", f);
+	if (fclose(f) != 0)
+		return -1;
+	return 0;
+}
 
-	engine->this_coro = NULL;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	assert(rlist_empty(&from->link));
-	assert(engine->this_coro == NULL);
-	engine->this_coro = from;
+void *
+coro_join(struct coro *coro)
+{
+	return coro_engine_join(coro_engine_this(), coro);
 }
 
-static void
-coro_engine_suspend(struct coro_engine *engine)
+void
+coro_suspend(void)
 {
-	struct coro *this_coro = engine->this_coro;
-	if (this_coro == NULL) {
-		printf("Error: deadlock - suspension with no active "
-			"coroutines\n");
-		exit(-1);
+	coro_engine_suspend(coro_engine_this());
+}
+
+void
+coro_sleep(uint64_t ns)
+{
+	struct coro_engine *engine = coro_engine_this();
+	uint64_t deadline = coro_now_ns() + ns;
+	uint64_t now;
+	while ((now = coro_now_ns()) < deadline) {
+		coro_engine_suspend_timeout(engine, deadline - now);
+		engine = coro_engine_this();
 	}
-	assert(rlist_empty(&this_coro->link));
-	assert(this_coro->state == CORO_STATE_RUNNING);
-	this_coro->state = CORO_STATE_SUSPENDED;
-	coro_engine_resume_next(engine);
 }
 
-static void
-coro_engine_yield(struct coro_engine *engine)
+bool
+coro_suspend_timeout(uint64_t ns)
 {
-	struct coro *this_coro = engine->this_coro;
-	assert(rlist_empty(&this_coro->link));
-	assert(this_coro->state == CORO_STATE_RUNNING);
-	rlist_add_tail_entry(&engine->coros_running_next, this_coro, link);
-	coro_engine_resume_next(engine);
+	return coro_engine_suspend_timeout(coro_engine_this(), ns);
 }
 
-static void
-coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+int
+coro_io_wait(int fd, int events)
 {
-	if (coro->state == CORO_STATE_RUNNING)
-		return;
-	if (coro->state == CORO_STATE_FINISHED)
-		return;
-	assert(coro->state == CORO_STATE_SUSPENDED);
-	assert(rlist_empty(&coro->link));
-	coro->state = CORO_STATE_RUNNING;
-	rlist_add_tail_entry(&engine->coros_running_next, coro, link);
+	return coro_engine_io_wait(coro_engine_this(), fd, events, UINT64_MAX);
 }
 
-static void
-coro_engine_run(struct coro_engine *engine)
+int
+coro_io_wait_timeout(int fd, int events, uint64_t ns)
 {
-	while (true) {
-		assert(rlist_empty(&engine->coros_running_now));
-		rlist_splice_tail(&engine->coros_running_now,
-			&engine->coros_running_next);
-		if (rlist_empty(&engine->coros_running_now))
-			break;
+	return coro_engine_io_wait(coro_engine_this(), fd, events, ns);
+}
 
-		assert(engine->this_coro == NULL);
-		engine->this_coro = &engine->sched;
-		assert(rlist_empty(&engine->sched.link));
-		/*
-		 * Add the scheduler to the tail so the control
-		 * comes back in the end of this iteration of the
-		 * loop.
-		 */
-		rlist_add_tail_entry(&engine->coros_running_now,
-			&engine->sched, link);
-		coro_engine_resume_next(engine);
-		assert(rlist_empty(&engine->coros_running_now));
-		assert(engine->this_coro == &engine->sched);
-		engine->this_coro = NULL;
-	}
+void
+coro_yield(void)
+{
+	coro_engine_yield(coro_engine_this());
 }
 
-static void
-coro_engine_destroy(struct coro_engine *engine)
+void
+coro_wakeup(struct coro *coro)
 {
-	assert(engine->this_coro == NULL);
-	assert(rlist_empty(&engine->coros_running_now));
-	assert(rlist_empty(&engine->coros_running_next));
-	while (!rlist_empty(&engine->coros_pool)) {
-		struct coro *c = rlist_shift_entry(&engine->coros_pool,
-			struct coro, link);
-		delete[] c->stack;
-		delete c;
-		assert(engine->coro_count > 0);
-		--engine->coro_count;
-	}
-	assert(engine->coro_count == 0);
-	memset(engine, '#', sizeof(*engine));
+	/*
+	 * A thread without an engine wakes the coroutine up where it
+	 * was running the last time.
+	 */
+	struct coro_engine *engine = this_engine;
+	if (engine == NULL)
+		engine = coro->engine;
+	coro_engine_wakeup(engine, coro);
 }
 
-static __thread struct coro_engine *new_coro_engine = NULL;
+//////////////////////////////////////////////////////////////////
+
+/** FIFO of the waiters, protected by a spinlock. */
+struct coro_wait_list {
+	int lock;
+	struct rlist waiters;
+};
 
 /**
- * The core part of the coroutines creation - this signal handler
- * runs on a separate stack using sigaltstack. At invocation it
- * remembers its current context and jumps back to the coroutine
- * constructor. Later the coroutine continues from here.
+ * The counter is the number of the holders plus the waiters. So
+ * it is 0 when free, 1 when locked, and the rest are waiting.
  */
+struct coro_mutex {
+	long count;
+	struct coro_wait_list list;
+};
+
+struct coro_cond {
+	struct coro_wait_list list;
+};
+
+/** The units left when >= 0, or minus the number of the waiters. */
+struct coro_sem {
+	long count;
+	struct coro_wait_list list;
+};
+
 static void
-coro_body(int signum)
+coro_wait_list_create(struct coro_wait_list *list)
 {
-	(void)signum;
-	struct coro_engine *my_engine = new_coro_engine;
-	new_coro_engine = NULL;
+	list->lock = 0;
+	rlist_create(&list->waiters);
+}
 
-	struct coro *c = my_engine->this_coro;
-	my_engine->this_coro = NULL;
-	/*
-	 * On invocation jump back to the constructor right after
-	 * remembering the context.
-	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(my_engine->start_point, 1);
-	/*
-	 * If the execution is here, then the coroutine should
-	 * finally start work.
-	 */
-	my_engine->this_coro = c;
-	while (true) {
-		c->ret = c->func(c->func_arg);
-		c->func = NULL;
-		assert(c->state == CORO_STATE_RUNNING);
-		c->state = CORO_STATE_FINISHED;
-		if (c->joiner != NULL)
-			coro_engine_wakeup(my_engine, c->joiner);
-		coro_engine_resume_next(my_engine);
-		/*
-		 * Here it is restarted already, must have its
-		 * state restored.
-		 */
-		assert(c->state == CORO_STATE_RUNNING);
-		assert(c->func != NULL);
+/** The waiter of the current coroutine. */
+static struct coro_waiter *
+coro_waiter_this(struct coro_mutex *mutex)
+{
+	struct coro *c = coro_this();
+	if (c == NULL) {
+		printf("Error: deadlock - wait with no active coroutines\n");
+		exit(-1);
 	}
+	struct coro_waiter *w = &c->waiter;
+	w->coro = c;
+	w->mutex = mutex;
+	w->is_done = false;
+	return w;
 }
 
-static struct coro *
-coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
+/**
+ * Wait until a waker marks the waiter done. The waiter is queued
+ * under the list lock before that, so it can't miss the waker. And
+ * the flag, not the wakeup, ends the wait.
+ */
+static void
+coro_wait_list_park(struct coro_wait_list *list, struct coro_waiter *w)
 {
-	struct coro *c = new coro();
-	c->state = CORO_STATE_RUNNING;
-	c->ret = NULL;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = new uint8_t[stack_size];
-	c->func = func;
-	c->func_arg = func_arg;
-	c->joiner = NULL;
-	rlist_create(&c->link);
-	/*
-	 * SIGUSR2 is used. First of all, block new signals to be
-	 * able to set a new handler.
-	 */
-	sigset_t news, olds, suss;
-	sigemptyset(&news);
-	sigaddset(&news, SIGUSR2);
-	if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
-		handle_error();
-	/*
-	 * New handler should jump onto a new stack and remember
-	 * that position. Afterwards the stack is disabled and
-	 * becomes dedicated to that single coroutine.
-	 */
-	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
-	newsa.sa_flags = SA_ONSTACK;
-	sigemptyset(&newsa.sa_mask);
-	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
-		handle_error();
-	/* Create that new stack. */
-	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
-	newst.ss_size = stack_size;
-	newst.ss_flags = 0;
-	if (sigaltstack(&newst, &oldst) != 0)
-		handle_error();
+	rlist_create(&w->link);
+	coro_spin_lock(&list->lock);
+	rlist_add_tail_entry(&list->waiters, w, link);
+	coro_spin_unlock(&list->lock);
+	while (!__atomic_load_n(&w->is_done, __ATOMIC_ACQUIRE))
+		coro_suspend();
+}
 
-	/* Jump onto the stack and remember its position. */
-	assert(new_coro_engine == NULL);
-	new_coro_engine = engine;
-	struct coro *old_this = engine->this_coro;
-	engine->this_coro = c;
-	sigemptyset(&suss);
-	if (sigsetjmp(engine->start_point, 1) == 0) {
-		raise(SIGUSR2);
-		while (engine->this_coro != NULL)
-			sigsuspend(&suss);
-	}
-	assert(new_coro_engine == NULL);
-	engine->this_coro = old_this;
+static void
+coro_waiter_finish(struct coro_waiter *w)
+{
+	/* The waiter can be gone right after the flag is set. */
+	struct coro *coro = w->coro;
+	__atomic_store_n(&w->is_done, true, __ATOMIC_RELEASE);
+	coro_wakeup(coro);
+}
 
-	/*
-	 * Return the old stack, unblock SIGUSR2. In other words,
-	 * rollback all global changes. The newly created stack
-	 * now is remembered only by the new coroutine, and can be
-	 * used by it only.
-	 */
-	if (sigaltstack(NULL, &newst) != 0)
-		handle_error();
-	newst.ss_flags = SS_DISABLE;
-	if (sigaltstack(&newst, NULL) != 0)
-		handle_error();
-	if ((oldst.ss_flags & SS_DISABLE) == 0 &&
-	    sigaltstack(&oldst, NULL) != 0)
-		handle_error();
-	if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
-		handle_error();
-	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
-		handle_error();
+/**
+ * Take the first waiter, which is counted already. It can be on
+ * the way into the list yet, on another thread.
+ */
+static struct coro_waiter *
+coro_wait_list_shift(struct coro_wait_list *list)
+{
+	int spin_count = 0;
+	while (true) {
+		coro_spin_lock(&list->lock);
+		if (!rlist_empty(&list->waiters))
+			break;
+		coro_spin_unlock(&list->lock);
+		coro_cpu_relax(&spin_count);
+	}
+	struct coro_waiter *w = rlist_shift_entry(&list->waiters,
+		struct coro_waiter, link);
+	coro_spin_unlock(&list->lock);
+	return w;
+}
 
-	/* Now scheduler can work with that coroutine. */
-	++engine->coro_count;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
+struct coro_mutex *
+coro_mutex_new(void)
+{
+	struct coro_mutex *mutex = new coro_mutex();
+	mutex->count = 0;
+	coro_wait_list_create(&mutex->list);
+	return mutex;
 }
 
-static struct coro *
-coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg)
+void
+coro_mutex_delete(struct coro_mutex *mutex)
 {
-	if (rlist_empty(&engine->coros_pool))
-		return coro_engine_spawn_new(engine, func, func_arg);
+	assert(mutex->count == 0);
+	assert(rlist_empty(&mutex->list.waiters));
+	delete mutex;
+}
 
-	struct coro *c = rlist_shift_entry(&engine->coros_pool,
-		struct coro, link);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->state = CORO_STATE_RUNNING;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
+void
+coro_mutex_lock(struct coro_mutex *mutex)
+{
+	if (__atomic_fetch_add(&mutex->count, 1, __ATOMIC_ACQUIRE) == 0)
+		return;
+	coro_wait_list_park(&mutex->list, coro_waiter_this(NULL));
 }
 
-static void *
-coro_engine_join(struct coro_engine *engine, struct coro *coro)
+bool
+coro_mutex_trylock(struct coro_mutex *mutex)
 {
-	assert(coro->joiner == NULL);
-	coro->joiner = engine->this_coro;
-	while (coro->state == CORO_STATE_RUNNING ||
-		coro->state == CORO_STATE_SUSPENDED)
-		coro_engine_suspend(engine);
-	assert(coro->state == CORO_STATE_FINISHED);
-	assert(coro->joiner == engine->this_coro);
-	coro->joiner = NULL;
-	void *ret = coro->ret;
-	coro->ret = NULL;
-	assert(rlist_empty(&coro->link));
-	rlist_add_entry(&engine->coros_pool, coro, link);
-	return ret;
+	long expected = 0;
+	return __atomic_compare_exchange_n(&mutex->count, &expected, 1, false,
+					   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
 }
 
-//////////////////////////////////////////////////////////////////
+void
+coro_mutex_unlock(struct coro_mutex *mutex)
+{
+	if (__atomic_fetch_sub(&mutex->count, 1, __ATOMIC_RELEASE) == 1)
+		return;
+	/* Not unlocked actually, the first waiter is the owner now. */
+	coro_waiter_finish(coro_wait_list_shift(&mutex->list));
+}
 
-static struct coro_engine glob_engine;
+struct coro_cond *
+coro_cond_new(void)
+{
+	struct coro_cond *cond = new coro_cond();
+	coro_wait_list_create(&cond->list);
+	return cond;
+}
 
 void
-coro_sched_init(void)
+coro_cond_delete(struct coro_cond *cond)
 {
-	coro_engine_create(&glob_engine);
+	assert(rlist_empty(&cond->list.waiters));
+	delete cond;
 }
 
 void
-coro_sched_run(void)
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex)
 {
-	coro_engine_run(&glob_engine);
+	struct coro_waiter *w = coro_waiter_this(mutex);
+	/* Queued before the unlock, so no signal after it is missed. */
+	coro_spin_lock(&cond->list.lock);
+	rlist_add_tail_entry(&cond->list.waiters, w, link);
+	coro_spin_unlock(&cond->list.lock);
+	coro_mutex_unlock(mutex);
+	while (!__atomic_load_n(&w->is_done, __ATOMIC_ACQUIRE))
+		coro_suspend();
 }
 
-void
-coro_sched_destroy(void)
+/**
+ * Give the signaled waiter the mutex if it is free. Otherwise queue
+ * it to the mutex, the unlock hands the mutex over to it later.
+ */
+static void
+coro_cond_transfer(struct coro_waiter *w)
 {
-	coro_engine_destroy(&glob_engine);
+	struct coro_mutex *mutex = w->mutex;
+	if (__atomic_fetch_add(&mutex->count, 1, __ATOMIC_ACQUIRE) == 0) {
+		coro_waiter_finish(w);
+		return;
+	}
+	coro_spin_lock(&mutex->list.lock);
+	rlist_add_tail_entry(&mutex->list.waiters, w, link);
+	coro_spin_unlock(&mutex->list.lock);
 }
 
-struct coro *
-coro_this(void)
+void
+coro_cond_signal(struct coro_cond *cond)
 {
-	return glob_engine.this_coro;
+	coro_spin_lock(&cond->list.lock);
+	if (rlist_empty(&cond->list.waiters)) {
+		coro_spin_unlock(&cond->list.lock);
+		return;
+	}
+	struct coro_waiter *w = rlist_shift_entry(&cond->list.waiters,
+		struct coro_waiter, link);
+	coro_spin_unlock(&cond->list.lock);
+	coro_cond_transfer(w);
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+void
+coro_cond_broadcast(struct coro_cond *cond)
 {
-	return coro_engine_spawn(&glob_engine, func, func_arg);
+	struct rlist waiters;
+	rlist_create(&waiters);
+	coro_spin_lock(&cond->list.lock);
+	rlist_splice(&waiters, &cond->list.waiters);
+	coro_spin_unlock(&cond->list.lock);
+	while (!rlist_empty(&waiters)) {
+		struct coro_waiter *w = rlist_shift_entry(&waiters,
+			struct coro_waiter, link);
+		coro_cond_transfer(w);
+	}
 }
 
-void *
-coro_join(struct coro *coro)
+struct coro_sem *
+coro_sem_new(unsigned count)
 {
-	return coro_engine_join(&glob_engine, coro);
+	struct coro_sem *sem = new coro_sem();
+	sem->count = count;
+	coro_wait_list_create(&sem->list);
+	return sem;
 }
 
 void
-coro_suspend(void)
+coro_sem_delete(struct coro_sem *sem)
 {
-	coro_engine_suspend(&glob_engine);
+	assert(sem->count >= 0);
+	assert(rlist_empty(&sem->list.waiters));
+	delete sem;
 }
 
 void
-coro_yield(void)
+coro_sem_wait(struct coro_sem *sem)
+{
+	if (__atomic_fetch_sub(&sem->count, 1, __ATOMIC_ACQUIRE) > 0)
+		return;
+	coro_wait_list_park(&sem->list, coro_waiter_this(NULL));
+}
+
+bool
+coro_sem_trywait(struct coro_sem *sem)
 {
-	coro_engine_yield(&glob_engine);
+	long count = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+	while (count > 0) {
+		if (__atomic_compare_exchange_n(&sem->count, &count, count - 1,
+						true, __ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
 }
 
 void
-coro_wakeup(struct coro *coro)
+coro_sem_post(struct coro_sem *sem)
 {
-	coro_engine_wakeup(&glob_engine, coro);
+	if (__atomic_fetch_add(&sem->count, 1, __ATOMIC_RELEASE) >= 0)
+		return;
+	coro_waiter_finish(coro_wait_list_shift(&sem->list));
 }
@@ -1,10 +1,25 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 struct coro;
 typedef void *(*coro_f)(void *);
 
+enum {
+	/** Max number of the coroutine-local keys. */
+	CORO_KEY_MAX = 16,
+	/** Buckets of the wakeup-to-run latency histogram. */
+	CORO_LATENCY_BUCKET_COUNT = 32,
+};
+
+/** Events of coro_io_wait(). */
+enum {
+	CORO_IO_READ = 1,
+	CORO_IO_WRITE = 2,
+};
+
 /** Initialize the coroutines engine. */
 void
 coro_sched_init(void);
@@ -16,6 +31,98 @@ coro_sched_init(void);
 void
 coro_sched_run(void);
 
+/**
+ * Same as coro_sched_run(), but the coroutines are run by
+ * @a thread_count threads, including the calling one. Each thread
+ * has an own engine and run queue. Idle threads steal runnable
+ * coroutines from the busy ones. Returns when none of the threads
+ * has anything runnable. Must be called outside of coroutines.
+ *
+ * A coroutine can continue on another thread after any yield,
+ * suspension, or join. Wakeups are thread-safe, but in this mode
+ * coro_suspend() can sometimes return without a wakeup, so it
+ * should be called in a loop checking the awaited condition.
+ */
+void
+coro_sched_run_mt(int thread_count);
+
+/**
+ * Let a coroutine woken up by another one of the same engine run
+ * right after the waker leaves, instead of after all the runnable
+ * ones. Like with a request and a response over a channel. Each
+ * wakeup replaces the previous one in the run-next slot, which then
+ * runs later in the same iteration. The slot is used at most
+ * a few dozen times per iteration, so the other coroutines still
+ * run. Off by default. Can be called at any time.
+ */
+void
+coro_sched_set_run_next(bool is_enabled);
+
+/**
+ * Tell the scheduler that some thread outside of it is going to
+ * wake coroutines up. Until each hold is released, the scheduler
+ * doesn't return when nothing is runnable, and instead waits for
+ * such wakeups. Can be called from any thread.
+ */
+void
+coro_sched_hold(void);
+
+/** Release one coro_sched_hold(). Can be called from any thread. */
+void
+coro_sched_release(void);
+
+/**
+ * Called when a hosted coroutine becomes runnable and not all the
+ * hosted engines are taken. It should make some thread call
+ * coro_sched_host_run() soon, like by pushing a task into a pool.
+ * Can be called on any thread, including inside the coroutines.
+ * Returns 0 when submitted. On a failure the work waits for the
+ * next submission.
+ */
+typedef int (*coro_host_submit_f)(void *arg);
+
+/**
+ * Host the coroutines on threads of another scheduler, like a
+ * thread pool, instead of coro_sched_run(). @a engine_count
+ * engines are made, and any thread can run any of them for a
+ * while. A coroutine suspended or blocked in a wait doesn't hold a
+ * thread, and the threads run other work meanwhile. Then all works
+ * as in coro_sched_run_mt(): wakeups are thread-safe, and the
+ * coroutines move between the threads.
+ *
+ * Timers and I/O waits are checked only while some thread runs
+ * the coroutines, so they are not for the hosted mode. Must be
+ * called outside of coroutines, by the thread which called
+ * coro_sched_init().
+ */
+void
+coro_sched_host_start(int engine_count, coro_host_submit_f submit,
+	void *arg);
+
+/**
+ * Take a free hosted engine and run its coroutines on the calling
+ * thread, stealing from the other engines too. Returns when there
+ * is nothing runnable for it. Called once per successful submit.
+ */
+void
+coro_sched_host_run(void);
+
+/**
+ * Create a detached coroutine in the hosted mode. Nobody joins it,
+ * it is released when finished, and the result is dropped. Can be
+ * called on any thread. A hosted coroutine creates it right away,
+ * the other threads leave a request for the next host thread.
+ */
+void
+coro_sched_host_spawn(coro_f func, void *func_arg);
+
+/**
+ * Stop hosting. All the hosted coroutines must be finished by now.
+ * Waits for the last host threads to leave the engines.
+ */
+void
+coro_sched_host_stop(void);
+
 /**
  * Destroy the coroutines engine. All coros must be finished by
  * now.
@@ -27,6 +134,34 @@ coro_sched_destroy(void);
 struct coro *
 coro_this(void);
 
+/**
+ * Create a key for coroutine-local values. Each coroutine has an
+ * own value for it, NULL at start. When a coroutine finishes, the
+ * destructor is called for its non-NULL value.
+ * @param destructor Called with the value, can be NULL.
+ *
+ * @retval >=0 The key.
+ * @retval -1 All CORO_KEY_MAX keys are taken.
+ */
+int
+coro_key_create(void (*destructor)(void *));
+
+/**
+ * Get the value of the key in the current coroutine. NULL when
+ * not set, or when called outside of coroutines.
+ */
+void *
+coro_getspecific(int key);
+
+/**
+ * Set the value of the key in the current coroutine.
+ *
+ * @retval 0 Success.
+ * @retval -1 Bad key, or called outside of coroutines.
+ */
+int
+coro_setspecific(int key, void *value);
+
 /**
  * Create a new coroutine. The function won't yield. The coroutine
  * will start execution automatically on the next iteration of the
@@ -38,6 +173,34 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but with a custom stack size. The stack is
+ * mapped lazily - only the touched pages consume memory. Below
+ * the stack there is a guard page, so an overflow crashes instead
+ * of corrupting other memory. The size is rounded up to a power of
+ * 2, at least 16KB.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, size_t stack_size);
+
+/**
+ * Same as coro_new(), but the coroutine runs on a stack shared with
+ * the other such coroutines of the thread. When it is suspended and
+ * another one takes the stack, only the used part of the stack is
+ * copied out into a buffer of that size, and back before the next
+ * run. So each switch costs a copy, but an idle coroutine keeps
+ * only the bytes it really used, not the touched pages.
+ *
+ * The copy is at different addresses while the coroutine is not
+ * running. So others must not access its stack variables while it
+ * is suspended, for example via corobus or a pointer given to
+ * another coroutine. The waits of libcoro itself are fine. In
+ * coro_sched_run_mt() such a coroutine always runs on the thread
+ * which has created it.
+ */
+struct coro *
+coro_new_shared(coro_f func, void *func_arg);
+
 /**
  * Join a coroutine. When joined, its resources are freed, and the
  * result of its callback function is returned. Each coroutine
@@ -46,6 +209,25 @@ coro_new(coro_f func, void *func_arg);
 void *
 coro_join(struct coro *coro);
 
+/**
+ * Create many coroutines with the default stack size, pushing them
+ * all into the run queue at once. Coroutine i gets func_args[i] as
+ * its argument, or NULL when func_args is NULL. The coroutines are
+ * saved into coros.
+ */
+void
+coro_new_many(coro_f func, void **func_args, size_t count,
+	struct coro **coros);
+
+/**
+ * Join many coroutines at once. The caller is suspended only until
+ * the last of them is finished, rather than once per coroutine. The
+ * result of coroutine i is saved into results[i], if results is not
+ * NULL.
+ */
+void
+coro_join_all(struct coro **coros, size_t count, void **results);
+
 /**
  * Pause the current coroutine until its explicitly woken up with
  * coro_wakeup(). Can be used to wait for some event, which will
@@ -54,6 +236,51 @@ coro_join(struct coro *coro);
 void
 coro_suspend(void);
 
+/**
+ * Same as coro_suspend(), but with a timeout in nanoseconds.
+ * Returns true if the coroutine was woken up, false if the timeout
+ * has expired.
+ */
+bool
+coro_suspend_timeout(uint64_t ns);
+
+/**
+ * Pause the current coroutine for at least the given number of
+ * nanoseconds. Wakeups don't interrupt the sleep. When nothing is
+ * runnable, the scheduler blocks until the nearest deadline.
+ */
+void
+coro_sleep(uint64_t ns);
+
+/**
+ * Pause the current coroutine until the descriptor is ready for
+ * any of the events - CORO_IO_READ, CORO_IO_WRITE, or both. An
+ * error or a hangup counts as ready for both, the next I/O call
+ * reports it. While some coroutines wait for I/O, the scheduler
+ * blocks in epoll or kqueue when nothing is runnable, instead of
+ * returning. Then wakeups from other threads, timers, and the
+ * descriptors all wake it up.
+ *
+ * One coroutine at a time can wait for each event of a descriptor.
+ * The descriptor must not be closed while it is waited for.
+ *
+ * @retval >0 The ready events.
+ * @retval 0 Woken up by coro_wakeup(). In coro_sched_run_mt() it
+ *         can happen without a wakeup too, like with coro_suspend().
+ * @retval -1 Error, errno is set. EBUSY means another coroutine
+ *         waits for the same event. EPERM means the descriptor can't
+ *         be polled, like a regular file on Linux.
+ */
+int
+coro_io_wait(int fd, int events);
+
+/**
+ * Same as coro_io_wait(), but with a timeout in nanoseconds. 0 is
+ * returned when it expires.
+ */
+int
+coro_io_wait_timeout(int fd, int events, uint64_t ns);
+
 /**
  * Pause the current coroutine until the next iteration of the
  * scheduler. Can be used to let the other coroutines work for a
@@ -69,3 +296,252 @@ coro_yield(void);
  */
 void
 coro_wakeup(struct coro *coro);
+
+struct coro_stack_stats {
+	/** Virtual memory reserved for stacks, with guard pages. */
+	size_t reserved;
+	/** Stack memory really backed by physical pages. */
+	size_t committed;
+	/** Number of stacks, including the cached ones. */
+	size_t count;
+	/** Number of stacks cached in joined coroutines for reuse. */
+	size_t cached_count;
+	/**
+	 * The most stack bytes used by a joined coroutine. Only with
+	 * LIBCORO_STACK_PROFILE, 0 otherwise.
+	 */
+	size_t peak_max;
+};
+
+/**
+ * Collect the stack memory statistics. Committed bytes are
+ * counted page by page, so it is not for hot paths.
+ */
+void
+coro_stack_stats(struct coro_stack_stats *stats);
+
+/** Stack usage of the joined coroutines of one function. */
+struct coro_stack_usage {
+	coro_f func;
+	/** Number of the joined coroutines. */
+	uint64_t count;
+	/** The most bytes used by one of them. */
+	size_t peak_max;
+	/** Sum of the peaks, for the average. */
+	uint64_t peak_sum;
+	/** The biggest stack they had. */
+	size_t stack_size;
+};
+
+/**
+ * Peak stack usage per coroutine function, to choose the sizes for
+ * coro_new_ex(). Collected only in the builds with
+ * LIBCORO_STACK_PROFILE: each new stack is painted with a canary,
+ * and coro_join() reports how much of it was overwritten. Painting
+ * commits all the stack pages, so it is for debugging. Shared-stack
+ * coroutines are not profiled.
+ *
+ * Saves at most @a cap entries in no particular order. Returns the
+ * number of the functions seen, always 0 without the profiling.
+ */
+size_t
+coro_stack_usage(struct coro_stack_usage *usage, size_t cap);
+
+/**
+ * Scheduler counters. They are collected only in the builds with
+ * LIBCORO_STATS defined, otherwise they are all zeros and cost
+ * nothing.
+ */
+struct coro_sched_stats {
+	/** Context switches, including to and from the scheduler. */
+	uint64_t switch_count;
+	/** Iterations of the scheduler loop which ran something. */
+	uint64_t iteration_count;
+	/** Coroutines run by all the iterations. */
+	uint64_t run_count;
+	/** The most coroutines run in one iteration. */
+	uint64_t run_max;
+	/**
+	 * Time from a wakeup, yield, or creation of a coroutine until
+	 * it runs. Bucket i counts the latencies of [2^i, 2^(i+1)) ns,
+	 * the last one counts everything longer.
+	 */
+	uint64_t latency_hist[CORO_LATENCY_BUCKET_COUNT];
+};
+
+/** Collect the scheduler counters, summed over all the engines. */
+void
+coro_sched_stats(struct coro_sched_stats *stats);
+
+/**
+ * Time the coroutine has spent running, in nanoseconds. Always 0
+ * without LIBCORO_STATS.
+ */
+uint64_t
+coro_cpu_time(struct coro *coro);
+
+/**
+ * Profiler hook, called on each switch with LIBCORO_STATS. NULL
+ * coroutine means the scheduler itself.
+ */
+typedef void (*coro_switch_hook_f)(struct coro *from, struct coro *to,
+	void *arg);
+
+/**
+ * Install the switch hook, or remove it with NULL. It is called on
+ * the thread doing the switch, so has to be thread-safe for
+ * coro_sched_run_mt().
+ */
+void
+coro_set_switch_hook(coro_switch_hook_f hook, void *arg);
+
+/** Events of the trace. */
+enum coro_trace_event {
+	/** A coroutine is created. */
+	CORO_TRACE_SPAWN,
+	/** Switch to a coroutine, NULL one is the scheduler. */
+	CORO_TRACE_SWITCH,
+	/** The coroutine is going to suspend. */
+	CORO_TRACE_SUSPEND,
+	/** A suspended coroutine is made runnable. */
+	CORO_TRACE_WAKEUP,
+	/** Messages sent into a channel, the arg is the channel. */
+	CORO_TRACE_SEND,
+	/** Messages received from a channel, the arg is the channel. */
+	CORO_TRACE_RECV,
+	/** The coroutine waits for a channel, the arg is the channel. */
+	CORO_TRACE_BLOCK,
+	CORO_TRACE_EVENT_COUNT,
+};
+
+struct coro_trace_record {
+	/** CLOCK_MONOTONIC time of the event. */
+	uint64_t ns;
+	/** The coroutine of the event, see enum coro_trace_event. */
+	struct coro *coro;
+	/** Event-specific argument. */
+	uint32_t arg;
+	/** enum coro_trace_event. */
+	uint16_t event;
+	/** Engine which has recorded it. */
+	uint16_t engine;
+};
+
+/**
+ * Start tracing the scheduler. Each engine keeps its last
+ * @a record_count events in an own ring, rounded up to a power of
+ * 2. Previous records are dropped. The trace is collected only in
+ * the builds with LIBCORO_TRACE, otherwise it is a nop.
+ *
+ * Start, stop, copy and dump must not race with the other threads
+ * running the coroutines, so they are for the single-threaded mode,
+ * or between the runs.
+ */
+void
+coro_trace_start(size_t record_count);
+
+/** Stop tracing. The records are kept until the next start. */
+void
+coro_trace_stop(void);
+
+/**
+ * Add an event of the current coroutine, for the libraries built on
+ * top, like corobus. A nop outside of the coroutines, on the
+ * threads without an engine, or when not tracing.
+ */
+void
+coro_trace_add(enum coro_trace_event event, uint32_t arg);
+
+/**
+ * Copy the trace, engine by engine, the oldest records of each
+ * first. Saves at most @a cap records. Returns the number of the
+ * kept ones, always 0 without LIBCORO_TRACE.
+ */
+size_t
+coro_trace_copy(struct coro_trace_record *records, size_t cap);
+
+/**
+ * Write the trace in the Chrome trace event JSON format, which
+ * Perfetto and chrome://tracing open. Each engine is a thread, the
+ * coroutines are slices between the switches, the other events are
+ * instants. Without LIBCORO_TRACE the trace is empty.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+coro_trace_dump(const char *path);
+
+/**
+ * Synchronization of coroutines. Waiting suspends the coroutine,
+ * not the thread. The uncontended lock, unlock, wait and post are
+ * a single atomic operation without any scheduler calls. When
+ * there are waiters, the released mutex or the posted semaphore
+ * unit is handed to the first one directly - it wakes up as the
+ * owner, and the newcomers can't take it over meanwhile. All of
+ * them work in coro_sched_run_mt() too.
+ */
+struct coro_mutex;
+struct coro_cond;
+struct coro_sem;
+
+struct coro_mutex *
+coro_mutex_new(void);
+
+/** The mutex must be unlocked and have no waiters. */
+void
+coro_mutex_delete(struct coro_mutex *mutex);
+
+void
+coro_mutex_lock(struct coro_mutex *mutex);
+
+/** Returns false if the mutex is locked already. */
+bool
+coro_mutex_trylock(struct coro_mutex *mutex);
+
+void
+coro_mutex_unlock(struct coro_mutex *mutex);
+
+struct coro_cond *
+coro_cond_new(void);
+
+/** The condition must have no waiters. */
+void
+coro_cond_delete(struct coro_cond *cond);
+
+/**
+ * Unlock the mutex, wait for a signal, and lock the mutex back. A
+ * signaled waiter is moved to the mutex queue if the mutex is
+ * locked, so doesn't wake up only to find it taken. Can return
+ * without a signal in coro_sched_run_mt(), like coro_suspend(), so
+ * the condition should be checked in a loop.
+ */
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex);
+
+/** Wake up the first waiter, if any. */
+void
+coro_cond_signal(struct coro_cond *cond);
+
+/** Wake up all the waiters. */
+void
+coro_cond_broadcast(struct coro_cond *cond);
+
+struct coro_sem *
+coro_sem_new(unsigned count);
+
+/** The semaphore must have no waiters. */
+void
+coro_sem_delete(struct coro_sem *sem);
+
+/** Take a unit, wait for it if there are none. */
+void
+coro_sem_wait(struct coro_sem *sem);
+
+/** Returns false if there are no units. */
+bool
+coro_sem_trywait(struct coro_sem *sem);
+
+/** Give a unit back, to the first waiter if there is one. */
+void
+coro_sem_post(struct coro_sem *sem);
@@ -2,6 +2,15 @@
 
 #include "unit.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
@@ -162,6 +171,1418 @@ test_wakeup_of_finished(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+enum {
+	TEST_STACK_USAGE_SIZE = 256 * 1024,
+};
+
+static void *
+test_stack_small_f(void *arg)
+{
+	volatile char buf[1024];
+	buf[0] = 1;
+	coro_yield();
+	(void)buf;
+	return arg;
+}
+
+static void *
+test_stack_big_f(void *arg)
+{
+	volatile char buf[64 * 1024];
+	for (size_t i = 0; i < sizeof(buf); i += 1024)
+		buf[i] = 1;
+	coro_yield();
+	return arg;
+}
+
+static void
+test_stack_ex(void)
+{
+	unit_test_start();
+
+	struct coro_stack_stats st1, st2;
+	coro_stack_stats(&st1);
+	struct coro *small = coro_new_ex(test_stack_small_f, NULL, 16 * 1024);
+	struct coro *big = coro_new_ex(test_stack_big_f, NULL,
+		8 * 1024 * 1024);
+	coro_yield();
+	coro_stack_stats(&st2);
+	unit_check(st2.count >= st1.count, "stacks are counted");
+	unit_check(st2.reserved - st1.reserved >= 8 * 1024 * 1024,
+		"big stack is reserved");
+	unit_check(st2.committed < st2.reserved, "not all is committed");
+	unit_check(st2.committed - st1.committed >= 64 * 1024,
+		"touched pages are committed");
+	unit_check(coro_join(small) == NULL, "small stack coro");
+	unit_check(coro_join(big) == NULL, "big stack coro");
+	coro_stack_stats(&st1);
+	unit_check(st1.cached_count >= 2, "stacks are cached for reuse");
+
+	unit_test_finish();
+}
+
+static const struct coro_stack_usage *
+test_stack_usage_find(const struct coro_stack_usage *usage, size_t count,
+	coro_f func)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (usage[i].func == func)
+			return &usage[i];
+	}
+	return NULL;
+}
+
+static void
+test_stack_usage(void)
+{
+	unit_test_start();
+
+	/* The second one reuses the stack of the first one. */
+	struct coro *big = coro_new_ex(test_stack_big_f, NULL,
+		TEST_STACK_USAGE_SIZE);
+	coro_join(big);
+	struct coro *small = coro_new_ex(test_stack_small_f, NULL,
+		TEST_STACK_USAGE_SIZE);
+	coro_join(small);
+	struct coro_stack_usage usage[16];
+	size_t count = coro_stack_usage(usage, 16);
+	struct coro_stack_stats st;
+	coro_stack_stats(&st);
+#ifdef LIBCORO_STACK_PROFILE
+	unit_check(count >= 2 && count <= 16, "functions are counted");
+	const struct coro_stack_usage *u =
+		test_stack_usage_find(usage, count, test_stack_big_f);
+	unit_check(u != NULL && u->count >= 1 && u->peak_max >= 64 * 1024 &&
+		u->peak_max < TEST_STACK_USAGE_SIZE &&
+		u->stack_size >= TEST_STACK_USAGE_SIZE, "big stack peak");
+	u = test_stack_usage_find(usage, count, test_stack_small_f);
+	unit_check(u != NULL && u->peak_max >= 1024 &&
+		u->peak_max < 16 * 1024, "repainted stack gives a new peak");
+	unit_check(u != NULL && u->peak_sum >= u->peak_max, "peaks are summed");
+	unit_check(st.peak_max >= 64 * 1024, "peak is in the stack stats");
+#else
+	(void)test_stack_usage_find;
+	unit_check(count == 0 && st.peak_max == 0, "nothing is collected");
+#endif
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t
+test_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+test_sleep_f(void *arg)
+{
+	uint64_t ns = *(uint64_t *)arg;
+	coro_sleep(ns);
+	return arg;
+}
+
+static void *
+test_timeout_waker_f(void *arg)
+{
+	coro_wakeup((struct coro *)arg);
+	return NULL;
+}
+
+static void
+test_sleep(void)
+{
+	unit_test_start();
+
+	uint64_t start = test_now_ns();
+	coro_sleep(2 * 1000 * 1000);
+	unit_check(test_now_ns() - start >= 2 * 1000 * 1000, "slept enough");
+
+	start = test_now_ns();
+	unit_check(!coro_suspend_timeout(1000 * 1000), "timeout expired");
+	unit_check(test_now_ns() - start >= 1000 * 1000, "waited enough");
+
+	struct coro *waker = coro_new(test_timeout_waker_f, coro_this());
+	unit_check(coro_suspend_timeout(1000 * 1000 * 1000), "woken up");
+	unit_check(test_now_ns() - start < 1000 * 1000 * 1000,
+		"did not wait for the timeout");
+	coro_join(waker);
+
+	/* Sleepers wake up by their deadlines, not in creation order. */
+	uint64_t long_ns = 20 * 1000 * 1000;
+	uint64_t short_ns = 1000 * 1000;
+	start = test_now_ns();
+	clock_t cpu_start = clock();
+	struct coro *c1 = coro_new(test_sleep_f, &long_ns);
+	struct coro *c2 = coro_new(test_sleep_f, &short_ns);
+	coro_join(c2);
+	uint64_t short_end = test_now_ns();
+	coro_join(c1);
+	uint64_t end = test_now_ns();
+	unit_check(short_end - start < long_ns, "short sleep ends first");
+	unit_check(end - start >= long_ns, "long sleep is complete");
+	unit_check((uint64_t)(clock() - cpu_start) * (1000000000 /
+		CLOCKS_PER_SEC) < (end - start) / 2,
+		"scheduler blocks instead of spinning");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_io {
+	int fd;
+	int events;
+	int rc;
+};
+
+static void *
+test_io_wait_f(void *arg)
+{
+	struct test_io *t = (struct test_io *)arg;
+	t->rc = coro_io_wait(t->fd, t->events);
+	return arg;
+}
+
+static void *
+test_io_late_writer_f(void *arg)
+{
+	int fd = *(int *)arg;
+	usleep(20 * 1000);
+	char c = 'x';
+	unit_assert(write(fd, &c, 1) == 1);
+	return NULL;
+}
+
+static void
+test_io(void)
+{
+	unit_test_start();
+
+	int fds[2];
+	unit_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+	for (int i = 0; i < 2; ++i)
+		unit_assert(fcntl(fds[i], F_SETFL, O_NONBLOCK) == 0);
+
+	struct test_io t;
+	t.fd = fds[0];
+	t.events = CORO_IO_READ;
+	t.rc = -2;
+	struct coro *c = coro_new(test_io_wait_f, &t);
+	coro_yield();
+	coro_yield();
+	unit_check(t.rc == -2, "reader waits for data");
+	char c1 = 'a';
+	unit_assert(write(fds[1], &c1, 1) == 1);
+	coro_join(c);
+	unit_check(t.rc == CORO_IO_READ, "reader is woken up by data");
+	unit_assert(read(fds[0], &c1, 1) == 1);
+
+	/* Nothing is runnable, the scheduler must wait in the poller. */
+	t.rc = -2;
+	c = coro_new(test_io_wait_f, &t);
+	pthread_t thread;
+	unit_assert(pthread_create(&thread, NULL, test_io_late_writer_f,
+		&fds[1]) == 0);
+	coro_join(c);
+	pthread_join(thread, NULL);
+	unit_check(t.rc == CORO_IO_READ, "data from another thread");
+	unit_assert(read(fds[0], &c1, 1) == 1);
+
+	/* Fill the socket buffer, then wait for the room in it. */
+	char buf[4096];
+	memset(buf, 0, sizeof(buf));
+	while (write(fds[1], buf, sizeof(buf)) > 0)
+		;
+	unit_assert(errno == EAGAIN || errno == EWOULDBLOCK);
+	t.fd = fds[1];
+	t.events = CORO_IO_WRITE;
+	t.rc = -2;
+	c = coro_new(test_io_wait_f, &t);
+	coro_yield();
+	unit_check(t.rc == -2, "writer waits for room");
+	while (read(fds[0], buf, sizeof(buf)) > 0)
+		coro_yield();
+	coro_join(c);
+	unit_check(t.rc == CORO_IO_WRITE, "writer is woken up by room");
+
+	uint64_t start = test_now_ns();
+	unit_check(coro_io_wait_timeout(fds[0], CORO_IO_READ,
+		5 * 1000 * 1000) == 0, "timeout expired");
+	unit_check(test_now_ns() - start >= 5 * 1000 * 1000, "waited enough");
+
+	t.fd = fds[0];
+	t.events = CORO_IO_READ;
+	t.rc = -2;
+	c = coro_new(test_io_wait_f, &t);
+	coro_yield();
+	unit_check(coro_io_wait(fds[0], CORO_IO_READ | CORO_IO_WRITE) == -1 &&
+		errno == EBUSY, "one reader per descriptor");
+	unit_check(coro_io_wait_timeout(fds[0], CORO_IO_WRITE, 0) ==
+		CORO_IO_WRITE, "writer and reader of one descriptor");
+	coro_wakeup(c);
+	coro_join(c);
+	unit_check(t.rc == 0, "reader is interrupted by a wakeup");
+
+	unit_check(coro_io_wait(fds[0], CORO_IO_READ | CORO_IO_WRITE) ==
+		CORO_IO_WRITE, "only ready events are returned");
+	close(fds[1]);
+	unit_check(coro_io_wait(fds[0], CORO_IO_READ) == CORO_IO_READ,
+		"hangup wakes up the reader");
+	close(fds[0]);
+
+	unit_check(coro_io_wait(-1, CORO_IO_READ) == -1 && errno == EINVAL,
+		"bad descriptor");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_SYNC_CORO_COUNT = 5,
+	TEST_SYNC_ROUND_COUNT = 100,
+};
+
+struct test_sync {
+	struct coro_mutex *mutex;
+	struct coro_cond *cond;
+	struct coro_sem *sem;
+	int inside;
+	int max_inside;
+	int order[TEST_SYNC_CORO_COUNT];
+	int order_count;
+	int total;
+	int ready;
+};
+
+struct test_sync_arg {
+	struct test_sync *s;
+	int id;
+};
+
+static void *
+test_mutex_order_f(void *arg)
+{
+	struct test_sync_arg *a = (struct test_sync_arg *)arg;
+	coro_mutex_lock(a->s->mutex);
+	a->s->order[a->s->order_count++] = a->id;
+	coro_mutex_unlock(a->s->mutex);
+	return NULL;
+}
+
+static void *
+test_mutex_counter_f(void *arg)
+{
+	struct test_sync *s = (struct test_sync *)arg;
+	for (int i = 0; i < TEST_SYNC_ROUND_COUNT; ++i) {
+		coro_mutex_lock(s->mutex);
+		int v = ++s->inside;
+		if (v > s->max_inside)
+			s->max_inside = v;
+		coro_yield();
+		++s->total;
+		--s->inside;
+		coro_mutex_unlock(s->mutex);
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void
+test_mutex(void)
+{
+	unit_test_start();
+
+	struct test_sync s;
+	memset(&s, 0, sizeof(s));
+	s.mutex = coro_mutex_new();
+	unit_check(coro_mutex_trylock(s.mutex), "trylock of a free mutex");
+	unit_check(!coro_mutex_trylock(s.mutex), "trylock of a locked mutex");
+
+	struct test_sync_arg args[TEST_SYNC_CORO_COUNT];
+	struct coro *coros[TEST_SYNC_CORO_COUNT];
+	for (int i = 0; i < TEST_SYNC_CORO_COUNT; ++i) {
+		args[i].s = &s;
+		args[i].id = i;
+		coros[i] = coro_new(test_mutex_order_f, &args[i]);
+	}
+	coro_yield();
+	unit_check(s.order_count == 0, "all wait for the mutex");
+	coro_mutex_unlock(s.mutex);
+	unit_check(!coro_mutex_trylock(s.mutex),
+		"unlock hands the mutex over to a waiter");
+	coro_join_all(coros, TEST_SYNC_CORO_COUNT, NULL);
+	bool ok = s.order_count == TEST_SYNC_CORO_COUNT;
+	for (int i = 0; i < s.order_count; ++i)
+		ok = ok && s.order[i] == i;
+	unit_check(ok, "waiters get the mutex in FIFO order");
+
+	for (int i = 0; i < TEST_SYNC_CORO_COUNT; ++i)
+		coros[i] = coro_new(test_mutex_counter_f, &s);
+	coro_join_all(coros, TEST_SYNC_CORO_COUNT, NULL);
+	unit_check(s.max_inside == 1, "one owner at a time");
+	unit_check(s.total == TEST_SYNC_CORO_COUNT * TEST_SYNC_ROUND_COUNT,
+		"all the increments are done");
+	coro_mutex_delete(s.mutex);
+
+	unit_test_finish();
+}
+
+static void *
+test_cond_waiter_f(void *arg)
+{
+	struct test_sync *s = (struct test_sync *)arg;
+	coro_mutex_lock(s->mutex);
+	++s->inside;
+	while (s->ready == 0)
+		coro_cond_wait(s->cond, s->mutex);
+	--s->ready;
+	++s->total;
+	coro_mutex_unlock(s->mutex);
+	return NULL;
+}
+
+static void
+test_cond(void)
+{
+	unit_test_start();
+
+	struct test_sync s;
+	memset(&s, 0, sizeof(s));
+	s.mutex = coro_mutex_new();
+	s.cond = coro_cond_new();
+	struct coro *coros[TEST_SYNC_CORO_COUNT];
+	for (int i = 0; i < TEST_SYNC_CORO_COUNT; ++i)
+		coros[i] = coro_new(test_cond_waiter_f, &s);
+	coro_yield();
+	unit_check(s.inside == TEST_SYNC_CORO_COUNT, "all wait");
+
+	coro_mutex_lock(s.mutex);
+	s.ready = 1;
+	coro_cond_signal(s.cond);
+	coro_yield();
+	coro_yield();
+	unit_check(s.total == 0, "signaled waiter waits for the mutex");
+	coro_mutex_unlock(s.mutex);
+	coro_yield();
+	coro_yield();
+	unit_check(s.total == 1, "signaled waiter is done");
+
+	coro_mutex_lock(s.mutex);
+	s.ready = TEST_SYNC_CORO_COUNT - 1;
+	coro_cond_broadcast(s.cond);
+	coro_mutex_unlock(s.mutex);
+	coro_join_all(coros, TEST_SYNC_CORO_COUNT, NULL);
+	unit_check(s.total == TEST_SYNC_CORO_COUNT, "broadcast wakes all");
+
+	coro_cond_signal(s.cond);
+	coro_cond_broadcast(s.cond);
+	unit_msg("signals without waiters");
+	coro_cond_delete(s.cond);
+	coro_mutex_delete(s.mutex);
+
+	unit_test_finish();
+}
+
+static void *
+test_sem_f(void *arg)
+{
+	struct test_sync *s = (struct test_sync *)arg;
+	for (int i = 0; i < TEST_SYNC_ROUND_COUNT; ++i) {
+		coro_sem_wait(s->sem);
+		int v = ++s->inside;
+		if (v > s->max_inside)
+			s->max_inside = v;
+		coro_yield();
+		--s->inside;
+		++s->total;
+		coro_sem_post(s->sem);
+	}
+	return NULL;
+}
+
+static void
+test_sem(void)
+{
+	unit_test_start();
+
+	struct test_sync s;
+	memset(&s, 0, sizeof(s));
+	s.sem = coro_sem_new(2);
+	unit_check(coro_sem_trywait(s.sem) && coro_sem_trywait(s.sem),
+		"take all the units");
+	unit_check(!coro_sem_trywait(s.sem), "no units left");
+	coro_sem_post(s.sem);
+	coro_sem_post(s.sem);
+
+	struct coro *coros[TEST_SYNC_CORO_COUNT];
+	for (int i = 0; i < TEST_SYNC_CORO_COUNT; ++i)
+		coros[i] = coro_new(test_sem_f, &s);
+	coro_join_all(coros, TEST_SYNC_CORO_COUNT, NULL);
+	unit_check(s.max_inside == 2, "at most 2 owners");
+	unit_check(s.total == TEST_SYNC_CORO_COUNT * TEST_SYNC_ROUND_COUNT,
+		"all the rounds are done");
+	unit_check(coro_sem_trywait(s.sem) && coro_sem_trywait(s.sem) &&
+		!coro_sem_trywait(s.sem), "all the units are back");
+	coro_sem_post(s.sem);
+	coro_sem_post(s.sem);
+	coro_sem_delete(s.sem);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_SHARED_CORO_COUNT = 200,
+	TEST_SHARED_ROUND_COUNT = 20,
+	TEST_SHARED_BUF_SIZE = 512,
+	TEST_SHARED_DEEP_SIZE = 32 * 1024,
+};
+
+struct test_shared {
+	struct coro_mutex *mutex;
+	int total;
+	int bad_count;
+	int parked_count;
+};
+
+/** Touch a lot of the stack once, the way a parser or a logger can. */
+static int __attribute__((noinline))
+test_shared_deep(int seed)
+{
+	volatile char buf[TEST_SHARED_DEEP_SIZE];
+	for (int i = 0; i < TEST_SHARED_DEEP_SIZE; i += 64)
+		buf[i] = (char)(seed + i);
+	return buf[seed % 64 * 64];
+}
+
+static void *
+test_shared_child_f(void *arg)
+{
+	coro_yield();
+	return arg;
+}
+
+static void *
+test_shared_f(void *arg)
+{
+	struct test_shared *t = (struct test_shared *)arg;
+	int id = __atomic_fetch_add(&t->total, 1, __ATOMIC_RELAXED);
+	test_shared_deep(id);
+	char buf[TEST_SHARED_BUF_SIZE];
+	for (int i = 0; i < TEST_SHARED_BUF_SIZE; ++i)
+		buf[i] = (char)(id + i);
+	/* All are suspended, and keep only the shallow frames. */
+	__atomic_add_fetch(&t->parked_count, 1, __ATOMIC_RELAXED);
+	coro_suspend();
+	for (int r = 0; r < TEST_SHARED_ROUND_COUNT; ++r) {
+		switch (r % 4) {
+		case 0:
+			coro_yield();
+			break;
+		case 1:
+			coro_sleep(1000);
+			break;
+		case 2:
+			coro_mutex_lock(t->mutex);
+			coro_yield();
+			coro_mutex_unlock(t->mutex);
+			break;
+		case 3: {
+			struct coro *child = coro_new_shared(test_shared_child_f,
+				buf);
+			struct coro *c = coro_new(test_shared_child_f, buf);
+			struct coro *coros[] = {child, c};
+			void *res[2];
+			coro_join_all(coros, 2, res);
+			if (res[0] != buf || res[1] != buf)
+				__atomic_add_fetch(&t->bad_count, 1,
+						   __ATOMIC_RELAXED);
+			break;
+		}
+		}
+		for (int i = 0; i < TEST_SHARED_BUF_SIZE; ++i) {
+			if (buf[i] != (char)(id + i)) {
+				__atomic_add_fetch(&t->bad_count, 1,
+						   __ATOMIC_RELAXED);
+				break;
+			}
+		}
+	}
+	return (void *)(intptr_t)id;
+}
+
+static void
+test_shared_stack(void)
+{
+	unit_test_start();
+
+	struct test_shared t;
+	memset(&t, 0, sizeof(t));
+	t.mutex = coro_mutex_new();
+	struct coro_stack_stats st1, st2;
+	coro_stack_stats(&st1);
+	struct coro *coros[TEST_SHARED_CORO_COUNT];
+	for (int i = 0; i < TEST_SHARED_CORO_COUNT; ++i)
+		coros[i] = coro_new_shared(test_shared_f, &t);
+	while (t.parked_count < TEST_SHARED_CORO_COUNT)
+		coro_yield();
+	coro_stack_stats(&st2);
+	unit_check(st2.count - st1.count == TEST_SHARED_CORO_COUNT,
+		"coroutines are counted");
+	/* With own stacks it would be the deep part times the count. */
+	unit_check(st2.committed - st1.committed <
+		(size_t)TEST_SHARED_CORO_COUNT * 4096,
+		"idle ones keep only the used part");
+
+	for (int i = 0; i < TEST_SHARED_CORO_COUNT; ++i)
+		coro_wakeup(coros[i]);
+	bool ok = true;
+	for (int i = 0; i < TEST_SHARED_CORO_COUNT; ++i)
+		ok = ok && (intptr_t)coro_join(coros[i]) < TEST_SHARED_CORO_COUNT;
+	unit_check(ok, "all are finished");
+	unit_check(t.bad_count == 0, "the stack data survived the switches");
+
+	/* The pool keeps them for reuse, and they start from scratch. */
+	struct coro *c = coro_new_shared(test_shared_child_f, &t);
+	unit_check(coro_join(c) == &t, "reused shared coroutine");
+	coro_mutex_delete(t.mutex);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int test_locals_key = -1;
+static int test_locals_destroyed = 0;
+
+static void
+test_locals_destructor(void *value)
+{
+	(void)value;
+	++test_locals_destroyed;
+}
+
+static void *
+test_locals_f(void *arg)
+{
+	if (coro_getspecific(test_locals_key) != NULL)
+		return NULL;
+	coro_setspecific(test_locals_key, arg);
+	coro_yield();
+	return coro_getspecific(test_locals_key);
+}
+
+static void
+test_locals(void)
+{
+	unit_test_start();
+
+	test_locals_key = coro_key_create(test_locals_destructor);
+	unit_check(test_locals_key >= 0, "key is created");
+	void *main_value = &test_locals_key;
+	unit_check(coro_setspecific(test_locals_key, main_value) == 0,
+		"set a value");
+	int a, b;
+	struct coro *c1 = coro_new(test_locals_f, &a);
+	struct coro *c2 = coro_new(test_locals_f, &b);
+	unit_check(coro_join(c1) == &a && coro_join(c2) == &b,
+		"each coroutine has an own value");
+	unit_check(coro_getspecific(test_locals_key) == main_value,
+		"the value is not changed by others");
+	unit_check(test_locals_destroyed == 2, "destructors are called");
+	/* The finished coroutines are reused from the pool. */
+	struct coro *c3 = coro_new(test_locals_f, &a);
+	unit_check(coro_join(c3) == &a, "a reused coroutine starts clean");
+	coro_setspecific(test_locals_key, NULL);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t test_hook_count = 0;
+
+static void
+test_switch_hook(struct coro *from, struct coro *to, void *arg)
+{
+	(void)from;
+	(void)to;
+	++*(uint64_t *)arg;
+}
+
+static void *
+test_sched_stats_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	volatile uint64_t sum = 0;
+	for (int i = 0; i < 100000; ++i)
+		sum = sum + i;
+	return (void *)(uintptr_t)coro_cpu_time(coro_this());
+}
+
+static void
+test_sched_stats(void)
+{
+	unit_test_start();
+
+	coro_set_switch_hook(test_switch_hook, &test_hook_count);
+	struct coro_sched_stats before;
+	coro_sched_stats(&before);
+	struct coro *c = coro_new(test_sched_stats_f, NULL);
+	uint64_t cpu_ns = (uint64_t)(uintptr_t)coro_join(c);
+	coro_set_switch_hook(NULL, NULL);
+	struct coro_sched_stats after;
+	coro_sched_stats(&after);
+	uint64_t latency_count = 0;
+	for (int i = 0; i < CORO_LATENCY_BUCKET_COUNT; ++i)
+		latency_count += after.latency_hist[i] - before.latency_hist[i];
+#ifdef LIBCORO_STATS
+	unit_check(after.switch_count - before.switch_count >= 20,
+		"switches are counted");
+	unit_check(test_hook_count == after.switch_count -
+		before.switch_count, "the hook sees each switch");
+	unit_check(after.run_count - before.run_count >= 10 &&
+		after.iteration_count > before.iteration_count,
+		"iterations are counted");
+	unit_check(latency_count >= 10, "latencies are counted");
+	unit_check(cpu_ns > 0, "CPU time is counted");
+#else
+	unit_check(after.switch_count == 0 && latency_count == 0 &&
+		test_hook_count == 0 && cpu_ns == 0, "nothing is collected");
+#endif
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_trace_f(void *arg)
+{
+	(void)arg;
+	coro_trace_add(CORO_TRACE_SEND, 7);
+	coro_suspend();
+	return NULL;
+}
+
+#ifdef LIBCORO_TRACE
+
+static bool
+test_trace_has(const struct coro_trace_record *records, size_t count,
+	enum coro_trace_event event, struct coro *coro)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (records[i].event == event && records[i].coro == coro)
+			return true;
+	}
+	return false;
+}
+
+#endif
+
+static void
+test_trace(void)
+{
+	unit_test_start();
+
+	coro_trace_start(1000);
+	struct coro *c = coro_new(test_trace_f, NULL);
+	coro_yield();
+	coro_wakeup(c);
+	coro_join(c);
+	coro_trace_stop();
+	coro_yield();
+	struct coro_trace_record records[1024];
+	size_t count = coro_trace_copy(records, 1024);
+	const char *path = "libcoro_test_trace.json";
+	unit_check(coro_trace_dump(path) == 0, "dump");
+	char buf[32];
+	FILE *f = fopen(path, "r");
+	unit_assert(f != NULL);
+	size_t size = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	unlink(path);
+	buf[size] = 0;
+	unit_check(strncmp(buf, "{\"traceEvents\":[", 15) == 0,
+		"Chrome trace format");
+#ifdef LIBCORO_TRACE
+	unit_check(count > 0 && count < 1024, "events are recorded");
+	unit_check(test_trace_has(records, count, CORO_TRACE_SPAWN, c) &&
+		test_trace_has(records, count, CORO_TRACE_SWITCH, c) &&
+		test_trace_has(records, count, CORO_TRACE_SUSPEND, c) &&
+		test_trace_has(records, count, CORO_TRACE_WAKEUP, c),
+		"scheduler events");
+	bool is_ok = false;
+	for (size_t i = 0; i < count; ++i) {
+		if (records[i].event == CORO_TRACE_SEND)
+			is_ok = records[i].coro == c && records[i].arg == 7;
+	}
+	unit_check(is_ok, "added events");
+	is_ok = true;
+	for (size_t i = 1; i < count; ++i)
+		is_ok = is_ok && records[i - 1].ns <= records[i].ns;
+	unit_check(is_ok, "in order");
+	unit_check(coro_trace_copy(records, 1024) == count,
+		"nothing after the stop");
+
+	coro_trace_start(4);
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	coro_trace_stop();
+	unit_check(coro_trace_copy(records, 1024) == 4 &&
+		records[3].event == CORO_TRACE_SWITCH, "the ring keeps the last");
+#else
+	unit_check(count == 0, "nothing is recorded");
+#endif
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_RUN_NEXT_PING_COUNT = 1000,
+};
+
+struct test_run_next {
+	int order[4];
+	int order_count;
+	struct coro *peer;
+	int ping_count;
+	int yield_count;
+	bool is_done;
+};
+
+static void *
+test_run_next_waiter_f(void *arg)
+{
+	struct test_run_next *ctx = (struct test_run_next *)arg;
+	coro_suspend();
+	ctx->order[ctx->order_count++] = 0;
+	return NULL;
+}
+
+static void *
+test_run_next_runnable_f(void *arg)
+{
+	struct test_run_next *ctx = (struct test_run_next *)arg;
+	ctx->order[ctx->order_count++] = 1;
+	return NULL;
+}
+
+static void *
+test_run_next_ping_f(void *arg)
+{
+	struct test_run_next *ctx = (struct test_run_next *)arg;
+	while (ctx->ping_count < TEST_RUN_NEXT_PING_COUNT) {
+		++ctx->ping_count;
+		struct coro *peer = ctx->peer;
+		ctx->peer = coro_this();
+		coro_wakeup(peer);
+		coro_suspend();
+	}
+	coro_wakeup(ctx->peer);
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void *
+test_run_next_yield_f(void *arg)
+{
+	struct test_run_next *ctx = (struct test_run_next *)arg;
+	while (!ctx->is_done) {
+		++ctx->yield_count;
+		coro_yield();
+	}
+	return NULL;
+}
+
+static void
+test_run_next(void)
+{
+	unit_test_start();
+
+	coro_sched_set_run_next(true);
+	struct test_run_next ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	struct coro *waiter = coro_new(test_run_next_waiter_f, &ctx);
+	coro_yield();
+	struct coro *coros[3];
+	for (int i = 0; i < 3; ++i)
+		coros[i] = coro_new(test_run_next_runnable_f, &ctx);
+	coro_wakeup(waiter);
+	coro_join(waiter);
+	for (int i = 0; i < 3; ++i)
+		coro_join(coros[i]);
+	unit_check(ctx.order_count == 4 && ctx.order[0] == 0,
+		"the woken up one runs first");
+
+	struct coro *yielder = coro_new(test_run_next_yield_f, &ctx);
+	struct coro *pong = coro_new(test_run_next_ping_f, &ctx);
+	ctx.peer = pong;
+	struct coro *ping = coro_new(test_run_next_ping_f, &ctx);
+	coro_join(ping);
+	coro_join(pong);
+	coro_join(yielder);
+	unit_check(ctx.ping_count == TEST_RUN_NEXT_PING_COUNT,
+		"ping-pong is done");
+	unit_check(ctx.yield_count > TEST_RUN_NEXT_PING_COUNT / 64,
+		"the others run meanwhile");
+
+	coro_sched_set_run_next(false);
+	ctx.order_count = 0;
+	waiter = coro_new(test_run_next_waiter_f, &ctx);
+	coro_yield();
+	for (int i = 0; i < 3; ++i)
+		coros[i] = coro_new(test_run_next_runnable_f, &ctx);
+	coro_wakeup(waiter);
+	coro_join(waiter);
+	for (int i = 0; i < 3; ++i)
+		coro_join(coros[i]);
+	unit_check(ctx.order_count == 4 && ctx.order[3] == 0,
+		"off by default - the woken up one queues");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_FOREIGN_WAKEUP_COUNT = 10000,
+};
+
+struct test_foreign {
+	struct coro *coro;
+	int counter;
+};
+
+static void *
+test_foreign_thread_f(void *arg)
+{
+	struct test_foreign *f = (struct test_foreign *)arg;
+	for (int i = 0; i < TEST_FOREIGN_WAKEUP_COUNT; ++i) {
+		__atomic_add_fetch(&f->counter, 1, __ATOMIC_SEQ_CST);
+		coro_wakeup(f->coro);
+	}
+	coro_sched_release();
+	return NULL;
+}
+
+static void
+test_foreign_wakeup(void)
+{
+	unit_test_start();
+
+	struct test_foreign f;
+	f.coro = coro_this();
+	f.counter = 0;
+	coro_sched_hold();
+	pthread_t thread;
+	unit_assert(pthread_create(&thread, NULL, test_foreign_thread_f,
+		&f) == 0);
+	int seen = 0;
+	while (seen < TEST_FOREIGN_WAKEUP_COUNT) {
+		/* A wakeup can come right before the suspension. */
+		while (__atomic_load_n(&f.counter, __ATOMIC_SEQ_CST) == seen)
+			coro_suspend();
+		seen = __atomic_load_n(&f.counter, __ATOMIC_SEQ_CST);
+	}
+	pthread_join(thread, NULL);
+	unit_check(seen == TEST_FOREIGN_WAKEUP_COUNT, "all wakeups are seen");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_MT_THREAD_COUNT = 4,
+	TEST_MT_CORO_COUNT = 100,
+	TEST_MT_YIELD_COUNT = 1000,
+	TEST_MT_PINGPONG_COUNT = 10000,
+};
+
+struct test_mt_pingpong {
+	int turn;
+	struct coro *coros[2];
+};
+
+static long test_mt_total = 0;
+
+static void *
+test_mt_yield_f(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < TEST_MT_YIELD_COUNT; ++i) {
+		__atomic_add_fetch(&test_mt_total, 1, __ATOMIC_RELAXED);
+		coro_yield();
+	}
+	return arg;
+}
+
+static void *
+test_mt_pingpong_f(void *arg)
+{
+	struct test_mt_pingpong *pp = (struct test_mt_pingpong *)arg;
+	struct coro *self = coro_this();
+	/* Can start on another thread before the creator saves it. */
+	struct coro *first;
+	while ((first = __atomic_load_n(&pp->coros[0],
+					__ATOMIC_ACQUIRE)) == NULL)
+		coro_yield();
+	int me = first == self ? 0 : 1;
+	struct coro *other;
+	while ((other = __atomic_load_n(&pp->coros[1 - me],
+					__ATOMIC_ACQUIRE)) == NULL)
+		coro_yield();
+	for (int i = 0; i < TEST_MT_PINGPONG_COUNT; ++i) {
+		/* Suspension can return spuriously in the MT mode. */
+		while (__atomic_load_n(&pp->turn, __ATOMIC_ACQUIRE) != me)
+			coro_suspend();
+		__atomic_store_n(&pp->turn, 1 - me, __ATOMIC_RELEASE);
+		coro_wakeup(other);
+	}
+	return NULL;
+}
+
+static void *
+test_mt_main_f(void *arg)
+{
+	(void)arg;
+	struct coro *coros[TEST_MT_CORO_COUNT];
+	for (int i = 0; i < TEST_MT_CORO_COUNT; ++i)
+		coros[i] = coro_new(test_mt_yield_f, &coros[i]);
+
+	struct test_mt_pingpong pp;
+	pp.turn = 0;
+	pp.coros[0] = NULL;
+	pp.coros[1] = NULL;
+	struct coro *c0 = coro_new(test_mt_pingpong_f, &pp);
+	__atomic_store_n(&pp.coros[0], c0, __ATOMIC_RELEASE);
+	struct coro *c1 = coro_new(test_mt_pingpong_f, &pp);
+	__atomic_store_n(&pp.coros[1], c1, __ATOMIC_RELEASE);
+	/* Idle threads must not end the run while a timer is pending. */
+	coro_sleep(1000 * 1000);
+
+	long bad_count = 0;
+	for (int i = 0; i < TEST_MT_CORO_COUNT; ++i) {
+		if (coro_join(coros[i]) != &coros[i])
+			++bad_count;
+	}
+	coro_join(c0);
+	coro_join(c1);
+	return (void *)bad_count;
+}
+
+static void
+test_mt(void)
+{
+	unit_test_start();
+
+	struct coro *c = coro_new(test_mt_main_f, NULL);
+	coro_sched_run_mt(TEST_MT_THREAD_COUNT);
+	unit_check(coro_join(c) == NULL, "all the joins got right results");
+	unit_check(test_mt_total == (long)TEST_MT_CORO_COUNT *
+		TEST_MT_YIELD_COUNT, "all the yields are done");
+	/* Single-threaded mode still works after the MT one. */
+	c = coro_new(test_mt_yield_f, NULL);
+	coro_sched_run();
+	unit_check(coro_join(c) == NULL, "single-threaded run after MT");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_IO_MT_PAIR_COUNT = 20,
+	TEST_IO_MT_ROUND_COUNT = 200,
+};
+
+/** Sends a number, waits for it + 1, and so on. */
+static void *
+test_io_mt_f(void *arg)
+{
+	int fd = *(int *)arg;
+	bool is_first = ((int *)arg)[1] != 0;
+	int value = 0;
+	if (is_first)
+		unit_assert(write(fd, &value, sizeof(value)) == sizeof(value));
+	for (int i = 0; i < TEST_IO_MT_ROUND_COUNT; ++i) {
+		ssize_t rc;
+		while ((rc = read(fd, &value, sizeof(value))) < 0) {
+			unit_assert(errno == EAGAIN || errno == EWOULDBLOCK);
+			/* Can return without an event in the MT mode. */
+			unit_assert(coro_io_wait(fd, CORO_IO_READ) >= 0);
+		}
+		unit_assert(rc == sizeof(value));
+		++value;
+		if (!is_first || i < TEST_IO_MT_ROUND_COUNT - 1) {
+			unit_assert(write(fd, &value, sizeof(value)) ==
+				sizeof(value));
+		}
+	}
+	return (void *)(intptr_t)value;
+}
+
+static void
+test_io_mt(void)
+{
+	unit_test_start();
+
+	int args[TEST_IO_MT_PAIR_COUNT][2][2];
+	struct coro *coros[TEST_IO_MT_PAIR_COUNT][2];
+	for (int i = 0; i < TEST_IO_MT_PAIR_COUNT; ++i) {
+		int fds[2];
+		unit_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+		for (int j = 0; j < 2; ++j) {
+			unit_assert(fcntl(fds[j], F_SETFL, O_NONBLOCK) == 0);
+			args[i][j][0] = fds[j];
+			args[i][j][1] = j == 0;
+			coros[i][j] = coro_new(test_io_mt_f, args[i][j]);
+		}
+	}
+	coro_sched_run_mt(TEST_MT_THREAD_COUNT);
+	bool ok = true;
+	for (int i = 0; i < TEST_IO_MT_PAIR_COUNT; ++i) {
+		int v0 = (int)(intptr_t)coro_join(coros[i][0]);
+		int v1 = (int)(intptr_t)coro_join(coros[i][1]);
+		ok = ok && v0 == 2 * TEST_IO_MT_ROUND_COUNT &&
+			v1 == 2 * TEST_IO_MT_ROUND_COUNT - 1;
+		close(args[i][0][0]);
+		close(args[i][1][0]);
+	}
+	unit_check(ok, "all the ping-pongs are complete");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_SYNC_MT_CORO_COUNT = 50,
+};
+
+static void *
+test_sync_mt_f(void *arg)
+{
+	struct test_sync *s = (struct test_sync *)arg;
+	for (int i = 0; i < TEST_SYNC_ROUND_COUNT; ++i) {
+		coro_mutex_lock(s->mutex);
+		int v = __atomic_add_fetch(&s->inside, 1, __ATOMIC_RELAXED);
+		if (v > s->max_inside)
+			s->max_inside = v;
+		++s->total;
+		if (i % 2 == 0)
+			coro_yield();
+		__atomic_sub_fetch(&s->inside, 1, __ATOMIC_RELAXED);
+		coro_mutex_unlock(s->mutex);
+
+		coro_sem_wait(s->sem);
+		coro_yield();
+		coro_sem_post(s->sem);
+	}
+	coro_mutex_lock(s->mutex);
+	++s->ready;
+	coro_cond_broadcast(s->cond);
+	while (s->ready < TEST_SYNC_MT_CORO_COUNT)
+		coro_cond_wait(s->cond, s->mutex);
+	coro_mutex_unlock(s->mutex);
+	return NULL;
+}
+
+static void
+test_sync_mt(void)
+{
+	unit_test_start();
+
+	struct test_sync s;
+	memset(&s, 0, sizeof(s));
+	s.mutex = coro_mutex_new();
+	s.cond = coro_cond_new();
+	s.sem = coro_sem_new(3);
+	struct coro *coros[TEST_SYNC_MT_CORO_COUNT];
+	for (int i = 0; i < TEST_SYNC_MT_CORO_COUNT; ++i)
+		coros[i] = coro_new(test_sync_mt_f, &s);
+	coro_sched_run_mt(TEST_MT_THREAD_COUNT);
+	for (int i = 0; i < TEST_SYNC_MT_CORO_COUNT; ++i)
+		coro_join(coros[i]);
+	unit_check(s.max_inside == 1, "one mutex owner at a time");
+	unit_check(s.total == TEST_SYNC_MT_CORO_COUNT * TEST_SYNC_ROUND_COUNT,
+		"all the increments are done");
+	unit_check(s.ready == TEST_SYNC_MT_CORO_COUNT, "all met at the barrier");
+	coro_sem_delete(s.sem);
+	coro_cond_delete(s.cond);
+	coro_mutex_delete(s.mutex);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_SHARED_MT_SPAWNER_COUNT = 8,
+	TEST_SHARED_MT_CHILD_COUNT = 10,
+};
+
+/** Spawns shared coroutines on whatever thread it is on now. */
+static void *
+test_shared_mt_spawner_f(void *arg)
+{
+	struct test_shared *t = (struct test_shared *)arg;
+	struct coro *coros[TEST_SHARED_MT_CHILD_COUNT];
+	for (int i = 0; i < TEST_SHARED_MT_CHILD_COUNT; ++i) {
+		coros[i] = coro_new_shared(test_shared_f, t);
+		coro_yield();
+	}
+	int spin = 0;
+	while (__atomic_load_n(&t->parked_count, __ATOMIC_RELAXED) <
+	       TEST_SHARED_MT_SPAWNER_COUNT * TEST_SHARED_MT_CHILD_COUNT) {
+		if (++spin % 100 == 0)
+			coro_sleep(1000);
+		coro_yield();
+	}
+	for (int i = 0; i < TEST_SHARED_MT_CHILD_COUNT - 1; ++i)
+		coro_wakeup(coros[i]);
+	for (int i = 0; i < TEST_SHARED_MT_CHILD_COUNT - 1; ++i)
+		coro_join(coros[i]);
+	/* The last one is woken only after the MT run. */
+	return coros[TEST_SHARED_MT_CHILD_COUNT - 1];
+}
+
+static void
+test_shared_mt(void)
+{
+	unit_test_start();
+
+	struct test_shared t;
+	memset(&t, 0, sizeof(t));
+	t.mutex = coro_mutex_new();
+	struct coro *spawners[TEST_SHARED_MT_SPAWNER_COUNT];
+	for (int i = 0; i < TEST_SHARED_MT_SPAWNER_COUNT; ++i)
+		spawners[i] = coro_new(test_shared_mt_spawner_f, &t);
+	coro_sched_run_mt(TEST_MT_THREAD_COUNT);
+	struct coro *parked[TEST_SHARED_MT_SPAWNER_COUNT];
+	for (int i = 0; i < TEST_SHARED_MT_SPAWNER_COUNT; ++i)
+		parked[i] = (struct coro *)coro_join(spawners[i]);
+	unit_check(t.bad_count == 0, "the stack data survived the MT run");
+
+	/* The stacks of the finished threads are kept for them. */
+	for (int i = 0; i < TEST_SHARED_MT_SPAWNER_COUNT; ++i)
+		coro_wakeup(parked[i]);
+	coro_sched_run();
+	for (int i = 0; i < TEST_SHARED_MT_SPAWNER_COUNT; ++i)
+		coro_join(parked[i]);
+	unit_check(t.bad_count == 0, "parked ones finished after the MT run");
+	unit_check(t.total == TEST_SHARED_MT_SPAWNER_COUNT *
+		TEST_SHARED_MT_CHILD_COUNT, "all have run");
+	coro_mutex_delete(t.mutex);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_HOST_ENGINE_COUNT = 3,
+	TEST_HOST_CORO_COUNT = 50,
+	TEST_HOST_CHILD_COUNT = 20,
+	TEST_HOST_YIELD_COUNT = 100,
+	TEST_HOST_PINGPONG_COUNT = 2000,
+};
+
+struct test_host {
+	/** Coroutines running at the same moment, and the max of it. */
+	int running;
+	int running_max;
+	int submit_count;
+	int done_count;
+	int turn;
+	struct coro *players[2];
+};
+
+static struct test_host test_host_ctx;
+
+static void *
+test_host_thread_f(void *arg)
+{
+	(void)arg;
+	coro_sched_host_run();
+	return NULL;
+}
+
+/** The simplest host: a new thread for each submission. */
+static int
+test_host_submit(void *arg)
+{
+	struct test_host *t = (struct test_host *)arg;
+	__atomic_add_fetch(&t->submit_count, 1, __ATOMIC_RELAXED);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, test_host_thread_f, NULL) != 0)
+		return -1;
+	pthread_detach(thread);
+	return 0;
+}
+
+static void *
+test_host_yield_f(void *arg)
+{
+	struct test_host *t = (struct test_host *)arg;
+	for (int i = 0; i < TEST_HOST_YIELD_COUNT; ++i) {
+		int running = __atomic_add_fetch(&t->running, 1,
+			__ATOMIC_SEQ_CST);
+		int max = __atomic_load_n(&t->running_max, __ATOMIC_RELAXED);
+		while (running > max &&
+		       !__atomic_compare_exchange_n(&t->running_max, &max,
+						    running, false,
+						    __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED))
+			;
+		for (int j = 0; j < 100; ++j)
+			sched_yield();
+		__atomic_sub_fetch(&t->running, 1, __ATOMIC_SEQ_CST);
+		coro_yield();
+	}
+	__atomic_add_fetch(&t->done_count, 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+/** Makes detached children right on its engine. */
+static void *
+test_host_parent_f(void *arg)
+{
+	for (int i = 0; i < TEST_HOST_CHILD_COUNT; ++i)
+		coro_sched_host_spawn(test_host_yield_f, arg);
+	return test_host_yield_f(arg);
+}
+
+static void *
+test_host_player_f(void *arg)
+{
+	struct test_host *t = (struct test_host *)arg;
+	struct coro *self = coro_this();
+	struct coro *expected = NULL;
+	int me = __atomic_compare_exchange_n(&t->players[0], &expected, self,
+		false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ? 0 : 1;
+	if (me == 1)
+		__atomic_store_n(&t->players[1], self, __ATOMIC_SEQ_CST);
+	struct coro *other;
+	while ((other = __atomic_load_n(&t->players[1 - me],
+					__ATOMIC_SEQ_CST)) == NULL)
+		coro_yield();
+	for (int i = 0; i < TEST_HOST_PINGPONG_COUNT; ++i) {
+		/* The hosts are free while both are suspended. */
+		while (__atomic_load_n(&t->turn, __ATOMIC_ACQUIRE) != me)
+			coro_suspend();
+		__atomic_store_n(&t->turn, 1 - me, __ATOMIC_RELEASE);
+		coro_wakeup(other);
+	}
+	__atomic_add_fetch(&t->done_count, 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+static void *
+test_host_foreign_f(void *arg)
+{
+	for (int i = 0; i < TEST_HOST_CORO_COUNT; ++i)
+		coro_sched_host_spawn(test_host_yield_f, arg);
+	return NULL;
+}
+
+static void
+test_host(void)
+{
+	unit_test_start();
+
+	struct test_host *t = &test_host_ctx;
+	memset(t, 0, sizeof(*t));
+	coro_sched_host_start(TEST_HOST_ENGINE_COUNT, test_host_submit, t);
+	for (int i = 0; i < TEST_HOST_CORO_COUNT; ++i)
+		coro_sched_host_spawn(test_host_yield_f, t);
+	coro_sched_host_spawn(test_host_parent_f, t);
+	coro_sched_host_spawn(test_host_player_f, t);
+	coro_sched_host_spawn(test_host_player_f, t);
+	pthread_t thread;
+	unit_assert(pthread_create(&thread, NULL, test_host_foreign_f, t) == 0);
+	pthread_join(thread, NULL);
+	int total = 2 * TEST_HOST_CORO_COUNT + 1 + TEST_HOST_CHILD_COUNT + 2;
+	while (__atomic_load_n(&t->done_count, __ATOMIC_SEQ_CST) < total)
+		usleep(1000);
+	coro_sched_host_stop();
+	unit_check(true, "all the coroutines have finished");
+	unit_check(t->running_max <= TEST_HOST_ENGINE_COUNT,
+		"not more running at once than the engines");
+	unit_msg("submitted host threads: %d", t->submit_count);
+
+	struct coro_stack_stats stats;
+	coro_stack_stats(&stats);
+	unit_check(stats.count == stats.cached_count,
+		"the detached ones are released");
+	/* The usual scheduler works after the hosting. */
+	struct coro *c = coro_new(test_mt_yield_f, NULL);
+	coro_sched_run();
+	unit_check(coro_join(c) == NULL, "single-threaded run after hosting");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_JOIN_ALL_COUNT = 50,
+};
+
+static void *
+test_join_all_f(void *arg)
+{
+	int *value = (int *)arg;
+	/* Some finish before the join, some finish after. */
+	for (int i = 0; i < *value % 4; ++i)
+		coro_yield();
+	*value *= 2;
+	return value;
+}
+
+static void
+test_join_all(void)
+{
+	unit_test_start();
+
+	int values[TEST_JOIN_ALL_COUNT];
+	void *args[TEST_JOIN_ALL_COUNT];
+	for (int i = 0; i < TEST_JOIN_ALL_COUNT; ++i) {
+		values[i] = i;
+		args[i] = &values[i];
+	}
+	struct coro *coros[TEST_JOIN_ALL_COUNT];
+	coro_new_many(test_join_all_f, args, TEST_JOIN_ALL_COUNT, coros);
+	coro_yield();
+	coro_yield();
+	void *results[TEST_JOIN_ALL_COUNT];
+	coro_join_all(coros, TEST_JOIN_ALL_COUNT, results);
+	bool ok = true;
+	for (int i = 0; i < TEST_JOIN_ALL_COUNT; ++i)
+		ok = ok && results[i] == &values[i] && values[i] == i * 2;
+	unit_check(ok, "all results");
+
+	coro_new_many(test_join_all_f, NULL, 0, coros);
+	coro_join_all(coros, 0, NULL);
+	unit_msg("empty batch");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -171,6 +1592,20 @@ coro_main_f(void *arg)
 	test_wakup_self();
 	test_join_of_join();
 	test_wakeup_of_finished();
+	test_stack_ex();
+	test_stack_usage();
+	test_sleep();
+	test_io();
+	test_mutex();
+	test_cond();
+	test_sem();
+	test_shared_stack();
+	test_locals();
+	test_sched_stats();
+	test_trace();
+	test_run_next();
+	test_foreign_wakeup();
+	test_join_all();
 	return NULL;
 }
 
@@ -182,6 +1617,11 @@ main(void)
 	coro_sched_run();
 	void *rc = coro_join(main_coro);
 	unit_check(rc == NULL, "main coro rc");
+	test_mt();
+	test_io_mt();
+	test_sync_mt();
+	test_shared_mt();
+	test_host();
 	coro_sched_destroy();
 	return 0;
 }
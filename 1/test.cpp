@@ -2,8 +2,12 @@
 
 #include "unit.h"
 #include "corobus.h"
+#include "corochannel.h"
 
+#include <pthread.h>
+#include <sched.h>
 #include <string.h>
+#include <string>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -255,6 +259,33 @@ test_multiple_channels(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_channel_descriptors(void)
+{
+	unit_test_start();
+	const int count = 10000;
+	struct coro_bus *bus = coro_bus_new_ex(count);
+
+	unit_msg("descriptors go in order");
+	for (int i = 0; i < count; ++i)
+		unit_assert(coro_bus_channel_open(bus, 1) == i);
+
+	unit_msg("the lowest free descriptor is reused first");
+	const int holes[] = {9999, 4096, 17, 64, 4095, 0, 262};
+	const int sorted[] = {0, 17, 64, 262, 4095, 4096, 9999};
+	const int hole_count = sizeof(holes) / sizeof(holes[0]);
+	for (int i = 0; i < hole_count; ++i)
+		coro_bus_channel_close(bus, holes[i]);
+	for (int i = 0; i < hole_count; ++i)
+		unit_assert(coro_bus_channel_open(bus, 1) == sorted[i]);
+	unit_assert(coro_bus_channel_open(bus, 1) == count);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void
 test_send_basic(void)
 {
@@ -546,6 +577,163 @@ test_recv_blocking_send_many(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_direct_handoff(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+
+	unit_msg("parked receivers get messages bypassing the queue");
+	unsigned data1 = 0, data2 = 0;
+	struct ctx_recv recv_ctx1, recv_ctx2;
+	recv_start(&recv_ctx1, bus, c1, &data1);
+	recv_start(&recv_ctx2, bus, c1, &data2);
+	coro_yield();
+	unit_assert(!recv_ctx1.is_done && !recv_ctx2.is_done);
+	unit_assert(coro_bus_try_send(bus, c1, 10) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 20) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 30) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 40) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(recv_join(&recv_ctx1) == 0);
+	unit_assert(recv_join(&recv_ctx2) == 0);
+	unit_assert(data1 == 10 && data2 == 20);
+
+	unit_msg("parked senders get their messages into the freed places");
+	struct ctx_send send_ctx1, send_ctx2;
+	send_start(&send_ctx1, bus, c1, 40);
+	send_start(&send_ctx2, bus, c1, 50);
+	coro_yield();
+	unit_assert(!send_ctx1.is_done && !send_ctx2.is_done);
+	unsigned data = 0;
+	for (unsigned expected = 30; expected <= 50; expected += 10) {
+		unit_assert(coro_bus_try_recv(bus, c1, &data) == 0);
+		unit_assert(data == expected);
+	}
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(send_join(&send_ctx1) == 0);
+	unit_assert(send_join(&send_ctx2) == 0);
+
+	unit_msg("a handed message survives the close");
+	recv_start(&recv_ctx1, bus, c1, &data1);
+	coro_yield();
+	unit_assert(coro_bus_try_send(bus, c1, 60) == 0);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(recv_join(&recv_ctx1) == 0);
+	unit_assert(data1 == 60);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_select {
+	struct coro_bus *bus;
+	const int *channels;
+	unsigned count;
+	unsigned data;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+select_f(void *arg)
+{
+	struct ctx_select *ctx = (decltype(ctx))arg;
+	ctx->rc = coro_bus_select(ctx->bus, ctx->channels, ctx->count, &ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+select_start(struct ctx_select *ctx, struct coro_bus *bus, const int *channels,
+	unsigned count)
+{
+	ctx->bus = bus;
+	ctx->channels = channels;
+	ctx->count = count;
+	ctx->data = 0;
+	ctx->rc = -1;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_done = false;
+	ctx->worker = coro_new(select_f, ctx);
+}
+
+static int
+select_join(struct ctx_select *ctx)
+{
+	unit_assert(coro_join(ctx->worker) == NULL);
+	unit_assert(ctx->is_done);
+	coro_bus_errno_set(ctx->err);
+	return ctx->rc;
+}
+
+static void
+test_select(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int channels[3];
+	for (int i = 0; i < 3; ++i) {
+		channels[i] = coro_bus_channel_open(bus, 2);
+		unit_assert(channels[i] >= 0);
+	}
+	unsigned data = 0;
+
+	unit_msg("try_select on empty channels");
+	unit_assert(coro_bus_try_select(bus, channels, 3, &data) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("the first channel with a message wins");
+	unit_assert(coro_bus_send(bus, channels[2], 5) == 0);
+	unit_assert(coro_bus_send(bus, channels[1], 6) == 0);
+	unit_assert(coro_bus_try_select(bus, channels, 3, &data) == channels[1]);
+	unit_assert(data == 6);
+	unit_assert(coro_bus_select(bus, channels, 3, &data) == channels[2]);
+	unit_assert(data == 5);
+
+	unit_msg("a parked select is woken by any of the channels");
+	struct ctx_select ctx;
+	select_start(&ctx, bus, channels, 3);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_send(bus, channels[2], 7) == 0);
+	unit_assert(select_join(&ctx) == channels[2]);
+	unit_assert(ctx.data == 7);
+
+	unit_msg("the wakeup is passed on to a plain receiver");
+	select_start(&ctx, bus, channels, 2);
+	unsigned data1 = 0;
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, channels[1], &data1);
+	coro_yield();
+	unit_assert(coro_bus_try_send(bus, channels[1], 8) == 0);
+	unit_assert(coro_bus_try_send(bus, channels[0], 9) == 0);
+	unit_assert(select_join(&ctx) == channels[0]);
+	unit_assert(ctx.data == 9);
+	unit_assert(recv_join(&recv_ctx) == 0);
+	unit_assert(data1 == 8);
+
+	unit_msg("close of a channel fails the select");
+	select_start(&ctx, bus, channels, 3);
+	coro_yield();
+	coro_bus_channel_close(bus, channels[1]);
+	unit_assert(select_join(&ctx) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 struct ctx_stress_send {
 	struct coro_bus *bus;
 	int channel;
@@ -743,6 +931,47 @@ test_wakeup_on_close(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_close_with_waiters_reopen(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	unit_msg("receivers wait on an empty channel");
+	int c1 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0);
+	unsigned data1 = 0;
+	struct ctx_recv recv_ctx1;
+	recv_start(&recv_ctx1, bus, c1, &data1);
+	unsigned data2 = 0;
+	struct ctx_recv recv_ctx2;
+	recv_start(&recv_ctx2, bus, c1, &data2);
+	coro_yield();
+	unit_assert(!recv_ctx1.is_done && !recv_ctx2.is_done);
+
+	unit_msg("close does not wait for them, the descriptor is free at once");
+	coro_bus_channel_close(bus, c1);
+	unit_assert(!recv_ctx1.is_done && !recv_ctx2.is_done);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(c2 == c1);
+	unit_assert(coro_bus_send(bus, c2, 123) == 0);
+
+	unit_msg("old waiters fail, the new channel is intact");
+	unit_assert(recv_join(&recv_ctx1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(recv_join(&recv_ctx2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(data1 == 0 && data2 == 0);
+	unsigned data = 0;
+	unit_assert(coro_bus_try_recv(bus, c2, &data) == 0);
+	unit_assert(data == 123);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void
 test_close_non_empty_bus(void)
 {
@@ -1016,6 +1245,51 @@ test_broadcast_blocking_drop_channel_during_wait(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_broadcast_full_tracking(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	const int count = 5;
+	int channels[count];
+	for (int i = 0; i < count; ++i)
+		channels[i] = coro_bus_channel_open(bus, 1);
+
+	unit_msg("holes and byte channels are skipped");
+	coro_bus_channel_close(bus, channels[1]);
+	int cb = coro_bus_channel_open_buf(bus, 16);
+	unit_assert(cb == channels[1]);
+	unit_assert(coro_bus_try_broadcast(bus, 1) == 0);
+	unit_assert(coro_bus_try_broadcast(bus, 2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("every way of freeing space is tracked");
+	unsigned data;
+	struct coro_bus_span span;
+	unit_assert(coro_bus_try_recv(bus, channels[0], &data) == 0);
+	unit_assert(coro_bus_try_recv_v(bus, channels[2], &data, 1) == 1);
+	unit_assert(coro_bus_try_peek(bus, channels[3], 1, &span) == 1);
+	unit_assert(coro_bus_consume(bus, channels[3], 1) == 0);
+	unit_assert(coro_bus_try_broadcast(bus, 2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("closing the last full channel unblocks");
+	coro_bus_channel_close(bus, channels[4]);
+	unit_assert(coro_bus_try_broadcast(bus, 2) == 0);
+	unit_assert(coro_bus_try_recv(bus, channels[0], &data) == 0 && data == 2);
+
+	coro_bus_channel_close(bus, channels[0]);
+	coro_bus_channel_close(bus, channels[2]);
+	coro_bus_channel_close(bus, channels[3]);
+	unit_assert(coro_bus_try_broadcast(bus, 3) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_channel_close(bus, cb);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void
 test_send_vector_basic(void)
 {
@@ -1424,6 +1698,9 @@ struct ctx_recv_v {
 	int channel;
 	unsigned *data;
 	unsigned count;
+	/** Use coro_bus_recv_v_min() when not 0. */
+	unsigned min_count;
+	uint64_t linger_ns;
 	int rc;
 	enum coro_bus_error_code err;
 	bool is_started;
@@ -1436,21 +1713,28 @@ recv_v_f(void *arg)
 {
 	struct ctx_recv_v *ctx = (decltype(ctx))arg;
 	ctx->is_started = true;
-	ctx->rc = coro_bus_recv_v(ctx->bus, ctx->channel, ctx->data,
-		ctx->count);
+	if (ctx->min_count != 0) {
+		ctx->rc = coro_bus_recv_v_min(ctx->bus, ctx->channel, ctx->data,
+			ctx->count, ctx->min_count, ctx->linger_ns);
+	} else {
+		ctx->rc = coro_bus_recv_v(ctx->bus, ctx->channel, ctx->data,
+			ctx->count);
+	}
 	ctx->err = coro_bus_errno();
 	ctx->is_done = true;
 	return NULL;
 }
 
 static void
-recv_v_start(struct ctx_recv_v *ctx, struct coro_bus *bus, int channel,
-	unsigned *data, unsigned count)
+recv_v_min_start(struct ctx_recv_v *ctx, struct coro_bus *bus, int channel,
+	unsigned *data, unsigned count, unsigned min_count, uint64_t linger_ns)
 {
 	ctx->bus = bus;
 	ctx->channel = channel;
 	ctx->data = data;
 	ctx->count = count;
+	ctx->min_count = min_count;
+	ctx->linger_ns = linger_ns;
 	ctx->rc = -1;
 	ctx->err = CORO_BUS_ERR_NONE;
 	ctx->is_started = false;
@@ -1458,6 +1742,13 @@ recv_v_start(struct ctx_recv_v *ctx, struct coro_bus *bus, int channel,
 	ctx->worker = coro_new(recv_v_f, ctx);
 }
 
+static void
+recv_v_start(struct ctx_recv_v *ctx, struct coro_bus *bus, int channel,
+	unsigned *data, unsigned count)
+{
+	recv_v_min_start(ctx, bus, channel, data, count, 0, 0);
+}
+
 static int
 recv_v_join(struct ctx_recv_v *ctx)
 {
@@ -1606,6 +1897,694 @@ test_recv_vector_blocking_recv_many(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void
+test_recv_vector_min(void)
+{
+#if NEED_BATCH
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 10);
+	unit_assert(c1 >= 0);
+
+	unit_msg("the receiver waits for the whole batch");
+	unsigned data[8] = {0};
+	struct ctx_recv_v ctx;
+	recv_v_min_start(&ctx, bus, c1, data, 8, 3, UINT64_MAX / 2);
+	for (unsigned i = 0; i < 2; ++i) {
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+		coro_yield();
+		unit_assert(!ctx.is_done);
+	}
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(recv_v_join(&ctx) == 3);
+	unit_assert(data[0] == 0 && data[1] == 1 && data[2] == 2);
+
+	unit_msg("the linger timeout gives a smaller batch");
+	const uint64_t linger_ns = 10 * 1000 * 1000;
+	recv_v_min_start(&ctx, bus, c1, data, 8, 5, linger_ns);
+	coro_yield();
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t start_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	unit_assert(recv_v_join(&ctx) == 1);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t end_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	unit_assert(data[0] == 3);
+	unit_assert(end_ns - start_ns >= linger_ns);
+
+	unit_msg("a lingering receiver doesn't hold the others back");
+	recv_v_min_start(&ctx, bus, c1, data, 8, 5, UINT64_MAX / 2);
+	coro_yield();
+	unsigned data1 = 0;
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c1, &data1);
+	coro_yield();
+	unit_assert(coro_bus_send(bus, c1, 4) == 0);
+	unit_assert(recv_join(&recv_ctx) == 0);
+	unit_assert(data1 == 4 && !ctx.is_done);
+
+	unit_msg("the batch is cut down to the capacity and size limit");
+	unsigned many[10];
+	for (unsigned i = 0; i < 10; ++i)
+		many[i] = i;
+	unit_assert(coro_bus_send_v(bus, c1, many, 10) == 10);
+	unit_assert(recv_v_join(&ctx) == 8);
+	unit_assert(coro_bus_send_v(bus, c1, many, 8) == 8);
+	unit_assert(coro_bus_recv_v_min(bus, c1, data, 8, 100, UINT64_MAX / 2) == 8);
+	unit_assert(data[0] == 8 && data[1] == 9 && data[2] == 0);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_buf_basic(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_buf(bus, 64);
+	unit_assert(c1 >= 0);
+	char buf[64];
+
+	unit_msg("the other kind of messages is not allowed");
+	unsigned data = 0;
+	unit_assert(coro_bus_try_send(bus, c1, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	int c2 = coro_bus_channel_open(bus, 1);
+	unit_assert(coro_bus_try_send_buf(bus, c2, "a", 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_channel_close(bus, c2);
+
+	unit_msg("empty channel");
+	unit_assert(coro_bus_try_recv_buf(bus, c1, buf, sizeof(buf)) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("messages of different sizes");
+	unit_assert(coro_bus_send_buf(bus, c1, "hello", 5) == 0);
+	unit_assert(coro_bus_send_buf(bus, c1, "", 0) == 0);
+	unit_assert(coro_bus_try_recv_buf(bus, c1, buf, 2) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_MSG_SIZE);
+	unit_assert(coro_bus_recv_buf(bus, c1, buf, sizeof(buf)) == 5);
+	unit_assert(memcmp(buf, "hello", 5) == 0);
+	unit_assert(coro_bus_recv_buf(bus, c1, buf, sizeof(buf)) == 0);
+
+	unit_msg("message bigger than the channel");
+	memset(buf, 'x', sizeof(buf));
+	unit_assert(coro_bus_send_buf(bus, c1, buf, 61) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_MSG_SIZE);
+	unit_assert(coro_bus_try_send_buf(bus, c1, buf, 60) == 0);
+	unit_assert(coro_bus_try_send_buf(bus, c1, buf, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv_buf(bus, c1, buf, sizeof(buf)) == 60);
+
+	unit_msg("wrap around the buffer end");
+	for (int i = 0; i < 100; ++i) {
+		char msg[13];
+		memset(msg, 'a' + i % 26, sizeof(msg));
+		unit_assert(coro_bus_try_send_buf(bus, c1, msg, sizeof(msg)) == 0);
+		unit_assert(coro_bus_try_send_buf(bus, c1, msg, i % 7) == 0);
+		unit_assert(coro_bus_try_recv_buf(bus, c1, buf, sizeof(buf)) == 13);
+		unit_assert(memcmp(buf, msg, sizeof(msg)) == 0);
+		unit_assert(coro_bus_try_recv_buf(bus, c1, buf, sizeof(buf)) == i % 7);
+		unit_assert(memcmp(buf, msg, i % 7) == 0);
+	}
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+struct ctx_send_buf {
+	struct coro_bus *bus;
+	int channel;
+	const char *data;
+	int rc;
+	bool is_done;
+};
+
+static void *
+send_buf_f(void *arg)
+{
+	struct ctx_send_buf *ctx = (decltype(ctx))arg;
+	ctx->rc = coro_bus_send_buf(ctx->bus, ctx->channel, ctx->data,
+		strlen(ctx->data));
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+test_buf_blocking(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_buf(bus, 16);
+	unit_assert(c1 >= 0);
+	char buf[16];
+
+	unit_msg("fill the channel");
+	unit_assert(coro_bus_send_buf(bus, c1, "123456789012", 12) == 0);
+
+	unit_msg("start a blocking send");
+	struct ctx_send_buf ctx = {bus, c1, "abcdefgh", -1, false};
+	struct coro *worker = coro_new(send_buf_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+
+	unit_msg("free the space");
+	unit_assert(coro_bus_recv_buf(bus, c1, buf, sizeof(buf)) == 12);
+	unit_assert(coro_join(worker) == NULL);
+	unit_assert(ctx.is_done && ctx.rc == 0);
+	unit_assert(coro_bus_recv_buf(bus, c1, buf, sizeof(buf)) == 8);
+	unit_assert(memcmp(buf, "abcdefgh", 8) == 0);
+
+	unit_msg("blocked sender gets an error on close");
+	unit_assert(coro_bus_send_buf(bus, c1, "123456789012", 12) == 0);
+	ctx.is_done = false;
+	worker = coro_new(send_buf_f, &ctx);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_join(worker) == NULL);
+	unit_assert(ctx.is_done && ctx.rc != 0);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_reserve_commit(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 6);
+	unit_assert(c1 >= 0);
+	struct coro_bus_span span;
+
+	unit_msg("nothing to peek");
+	unit_assert(coro_bus_try_peek(bus, c1, 10, &span) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("write right into the channel");
+	unit_assert(coro_bus_reserve(bus, c1, 4, &span) == 4);
+	for (unsigned i = 0; i < span.count; ++i)
+		span.data[i] = i;
+	unit_assert(coro_bus_commit(bus, c1, 3) == 0);
+
+	unit_msg("commit is visible to the usual recv");
+	unsigned data = 123;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 0);
+
+	unit_msg("read right from the channel");
+	unit_assert(coro_bus_peek(bus, c1, 10, &span) == 2);
+	unit_assert(span.data[0] == 1 && span.data[1] == 2);
+	unit_assert(coro_bus_consume(bus, c1, 2) == 0);
+
+	unit_msg("the span stops at the wrap");
+	unit_assert(coro_bus_try_reserve(bus, c1, 10, &span) == 5);
+	for (unsigned i = 0; i < span.count; ++i)
+		span.data[i] = 10 + i;
+	unit_assert(coro_bus_commit(bus, c1, span.count) == 0);
+	unit_assert(coro_bus_try_reserve(bus, c1, 10, &span) == 1);
+	span.data[0] = 15;
+	unit_assert(coro_bus_commit(bus, c1, 1) == 0);
+	unit_assert(coro_bus_try_reserve(bus, c1, 10, &span) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unsigned out[6];
+	unit_assert(coro_bus_recv_v(bus, c1, out, 6) == 6);
+	for (unsigned i = 0; i < 6; ++i)
+		unit_assert(out[i] == 10 + i);
+
+	coro_bus_channel_close(bus, c1);
+	unit_assert(coro_bus_try_reserve(bus, c1, 1, &span) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_PORT_THREAD_COUNT = 4,
+	TEST_PORT_MSG_COUNT = 20000,
+};
+
+struct ctx_port_thread {
+	struct coro_bus_port *port;
+	unsigned id;
+};
+
+static void *
+port_thread_f(void *arg)
+{
+	struct ctx_port_thread *ctx = (decltype(ctx))arg;
+	for (unsigned i = 0; i < TEST_PORT_MSG_COUNT; ++i) {
+		unsigned data = (ctx->id << 24) | i;
+		while (coro_bus_port_try_send(ctx->port, data) != 0)
+			sched_yield();
+	}
+	coro_sched_release();
+	return NULL;
+}
+
+static void
+test_port(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_port(bus, 16);
+	unit_assert(c1 >= 0);
+	struct coro_bus_port *port = coro_bus_channel_port(bus, c1);
+	unit_assert(port != NULL);
+
+	unit_msg("only the port channels have ports");
+	int c2 = coro_bus_channel_open(bus, 16);
+	unit_assert(coro_bus_channel_port(bus, c2) == NULL);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unsigned data = 5;
+	unit_assert(coro_bus_try_send_v(bus, c1, &data, 1) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("coroutines use it as a usual channel");
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_send(bus, c1, 7) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(data == 7);
+
+	unit_msg("many threads send, the coroutine receives");
+	struct ctx_port_thread ctx[TEST_PORT_THREAD_COUNT];
+	pthread_t threads[TEST_PORT_THREAD_COUNT];
+	for (unsigned i = 0; i < TEST_PORT_THREAD_COUNT; ++i) {
+		ctx[i].port = port;
+		ctx[i].id = i;
+		coro_sched_hold();
+		unit_assert(pthread_create(&threads[i], NULL, port_thread_f,
+			&ctx[i]) == 0);
+	}
+	unsigned next[TEST_PORT_THREAD_COUNT] = {0};
+	bool is_ordered = true;
+	for (unsigned i = 0; i < TEST_PORT_THREAD_COUNT * TEST_PORT_MSG_COUNT; ++i) {
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+		unsigned id = data >> 24;
+		unit_assert(id < TEST_PORT_THREAD_COUNT);
+		if ((data & 0xffffff) != next[id]++)
+			is_ordered = false;
+	}
+	unit_check(is_ordered, "each thread's messages are in order");
+	for (unsigned i = 0; i < TEST_PORT_THREAD_COUNT; ++i)
+		pthread_join(threads[i], NULL);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == -1);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_prio(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_prio(bus, 6, 3);
+	unit_assert(c1 >= 0);
+
+	unit_msg("only the priority channels take levels");
+	int c2 = coro_bus_channel_open(bus, 6);
+	unit_assert(coro_bus_try_send_prio(bus, c2, 1, 1) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("the higher levels are received first");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send_prio(bus, c1, 2, 0) == 0);
+	unsigned ctl[] = {30, 31};
+	unit_assert(coro_bus_send_v_prio(bus, c1, ctl, 2, 2) == 2);
+	unit_assert(coro_bus_send_prio(bus, c1, 20, 1) == 0);
+	unit_assert(coro_bus_try_send_prio(bus, c1, 40, 100) == 0);
+	unit_assert(coro_bus_try_send_prio(bus, c1, 3, 0) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unsigned data;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(data == 30);
+	const unsigned expected[] = {31, 40, 20, 1, 2};
+	for (unsigned i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i) {
+		unit_assert(coro_bus_try_recv(bus, c1, &data) == 0);
+		unit_assert(data == expected[i]);
+	}
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == -1);
+
+	unit_msg("a blocked receiver gets the message");
+	unsigned data1 = 0;
+	struct ctx_recv recv_ctx;
+	recv_start(&recv_ctx, bus, c1, &data1);
+	coro_yield();
+	unit_assert(coro_bus_send_prio(bus, c1, 7, 1) == 0);
+	unit_assert(recv_join(&recv_ctx) == 0);
+	unit_assert(data1 == 7);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_topic {
+	struct coro_bus *bus;
+	int channel;
+	int sub;
+	unsigned data;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+topic_publish_f(void *arg)
+{
+	struct ctx_topic *ctx = (decltype(ctx))arg;
+	ctx->rc = coro_bus_topic_publish(ctx->bus, ctx->channel, ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void *
+topic_recv_f(void *arg)
+{
+	struct ctx_topic *ctx = (decltype(ctx))arg;
+	ctx->rc = coro_bus_topic_recv(ctx->bus, ctx->channel, ctx->sub, &ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+topic_start(struct ctx_topic *ctx, struct coro_bus *bus, int channel, int sub,
+	unsigned data, coro_f func)
+{
+	ctx->bus = bus;
+	ctx->channel = channel;
+	ctx->sub = sub;
+	ctx->data = data;
+	ctx->rc = -1;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_done = false;
+	ctx->worker = coro_new(func, ctx);
+}
+
+static int
+topic_join(struct ctx_topic *ctx)
+{
+	unit_assert(coro_join(ctx->worker) == NULL);
+	unit_assert(ctx->is_done);
+	coro_bus_errno_set(ctx->err);
+	return ctx->rc;
+}
+
+static void
+test_topic(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_topic(bus, 2);
+	unit_assert(c1 >= 0);
+
+	unit_msg("only the topics take subscribers");
+	int c2 = coro_bus_channel_open(bus, 2);
+	unit_assert(coro_bus_topic_subscribe(bus, c2) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_send(bus, c1, 1) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("each subscriber gets every message");
+	int s1 = coro_bus_topic_subscribe(bus, c1);
+	int s2 = coro_bus_topic_subscribe(bus, c1);
+	unit_assert(s1 >= 0 && s2 >= 0 && s1 != s2);
+	unit_assert(coro_bus_topic_publish(bus, c1, 10) == 0);
+	unit_assert(coro_bus_topic_publish(bus, c1, 20) == 0);
+	unsigned data = 0;
+	for (unsigned expected = 10; expected <= 20; expected += 10) {
+		unit_assert(coro_bus_topic_try_recv(bus, c1, s1, &data) == 0);
+		unit_assert(data == expected);
+	}
+	unit_assert(coro_bus_topic_try_recv(bus, c1, s1, &data) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("the slowest subscriber holds the publishers back");
+	unit_assert(coro_bus_topic_try_publish(bus, c1, 30) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	struct ctx_topic pub_ctx;
+	topic_start(&pub_ctx, bus, c1, -1, 30, topic_publish_f);
+	coro_yield();
+	unit_assert(!pub_ctx.is_done);
+	unit_assert(coro_bus_topic_recv(bus, c1, s2, &data) == 0);
+	unit_assert(data == 10);
+	unit_assert(topic_join(&pub_ctx) == 0);
+
+	unit_msg("a new subscriber sees only the new messages");
+	int s3 = coro_bus_topic_subscribe(bus, c1);
+	struct ctx_topic recv_ctx;
+	topic_start(&recv_ctx, bus, c1, s3, 0, topic_recv_f);
+	coro_yield();
+	unit_assert(!recv_ctx.is_done);
+	unit_assert(coro_bus_topic_try_publish(bus, c1, 40) == -1);
+
+	unit_msg("a subscriber leaving the gate lets the publishers go");
+	topic_start(&pub_ctx, bus, c1, -1, 40, topic_publish_f);
+	coro_yield();
+	unit_assert(!pub_ctx.is_done);
+	unit_assert(coro_bus_topic_unsubscribe(bus, c1, s2) == 0);
+	unit_assert(topic_join(&pub_ctx) == 0);
+	unit_assert(topic_join(&recv_ctx) == 0);
+	unit_assert(recv_ctx.data == 40);
+	unit_assert(coro_bus_topic_try_recv(bus, c1, s2, &data) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	for (unsigned expected = 30; expected <= 40; expected += 10) {
+		unit_assert(coro_bus_topic_try_recv(bus, c1, s1, &data) == 0);
+		unit_assert(data == expected);
+	}
+
+	unit_msg("many subscribers of one ring");
+	enum { TEST_TOPIC_SUB_COUNT = 1000 };
+	int c3 = coro_bus_channel_open_topic(bus, 4);
+	int subs[TEST_TOPIC_SUB_COUNT];
+	for (int i = 0; i < TEST_TOPIC_SUB_COUNT; ++i)
+		subs[i] = coro_bus_topic_subscribe(bus, c3);
+	for (unsigned i = 0; i < 4; ++i)
+		unit_assert(coro_bus_topic_try_publish(bus, c3, i) == 0);
+	unit_assert(coro_bus_topic_try_publish(bus, c3, 4) == -1);
+	for (int i = 0; i < TEST_TOPIC_SUB_COUNT; ++i) {
+		unit_assert(coro_bus_topic_try_recv(bus, c3, subs[i], &data) == 0);
+		unit_assert(data == 0);
+	}
+	unit_assert(coro_bus_topic_try_publish(bus, c3, 4) == 0);
+
+	unit_msg("close wakes up the subscribers");
+	topic_start(&recv_ctx, bus, c1, s1, 0, topic_recv_f);
+	coro_yield();
+	coro_bus_channel_close(bus, c1);
+	unit_assert(topic_join(&recv_ctx) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+#if NEED_STATS
+static void
+test_stats(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(c1 >= 0);
+	struct coro_bus_channel_stats stats;
+
+	unit_msg("fill and block a sender");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	struct ctx_send send_ctx;
+	send_start(&send_ctx, bus, c1, 3);
+	coro_yield();
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.sent == 2 && stats.received == 0);
+	unit_assert(stats.depth == 2 && stats.peak_depth == 2);
+
+	unit_msg("drain the channel");
+	unsigned data;
+	for (unsigned i = 1; i <= 3; ++i) {
+		unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+		unit_assert(data == i);
+	}
+	unit_assert(send_join(&send_ctx) == 0);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.sent == 3 && stats.received == 3);
+	unit_assert(stats.send_blocked == 1 && stats.recv_blocked == 0);
+	unit_assert(stats.depth == 0 && stats.peak_depth == 2);
+	unit_assert(stats.suspended_ns > 0);
+
+	unit_msg("the bus keeps the counters of the closed channels");
+	int c2 = coro_bus_channel_open(bus, 5);
+	unit_assert(coro_bus_send(bus, c2, 4) == 0);
+	coro_bus_channel_close(bus, c2);
+	unit_assert(coro_bus_channel_stats(bus, c2, &stats) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_stats(bus, &stats);
+	unit_assert(stats.sent == 4 && stats.received == 3);
+	unit_assert(stats.depth == 0 && stats.peak_depth == 2);
+
+	unit_msg("a priority channel");
+	int c3 = coro_bus_channel_open_prio(bus, 4, 2);
+	unit_assert(c3 >= 0);
+	unit_assert(coro_bus_send_prio(bus, c3, 5, 0) == 0);
+	unit_assert(coro_bus_send_prio(bus, c3, 6, 1) == 0);
+	unit_assert(coro_bus_send(bus, c3, 7) == 0);
+	unit_assert(coro_bus_recv(bus, c3, &data) == 0 && data == 6);
+	unit_assert(coro_bus_channel_stats(bus, c3, &stats) == 0);
+	unit_assert(stats.sent == 3 && stats.received == 1);
+	unit_assert(stats.depth == 2 && stats.peak_depth == 3);
+	coro_bus_stats(bus, &stats);
+	unit_assert(stats.sent == 7 && stats.received == 4);
+	unit_assert(stats.depth == 2 && stats.peak_depth == 3);
+
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+typedef libcoro::channel<std::string, 2> test_str_channel;
+
+struct ctx_str {
+	test_str_channel *ch;
+	std::string data;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+	struct coro *worker;
+};
+
+static void *
+str_send_f(void *arg)
+{
+	struct ctx_str *ctx = (decltype(ctx))arg;
+	ctx->rc = ctx->ch->send(std::move(ctx->data));
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void *
+str_recv_f(void *arg)
+{
+	struct ctx_str *ctx = (decltype(ctx))arg;
+	ctx->rc = ctx->ch->recv(&ctx->data);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+str_start(struct ctx_str *ctx, test_str_channel *ch, coro_f func,
+	const char *data)
+{
+	ctx->ch = ch;
+	ctx->data = data;
+	ctx->rc = -1;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_done = false;
+	ctx->worker = coro_new(func, ctx);
+}
+
+static int
+str_join(struct ctx_str *ctx)
+{
+	unit_assert(coro_join(ctx->worker) == NULL);
+	unit_assert(ctx->is_done);
+	coro_bus_errno_set(ctx->err);
+	return ctx->rc;
+}
+
+static void
+test_channel_template(void)
+{
+	unit_test_start();
+
+	unit_msg("trivial messages wrap around the ring in batches");
+	libcoro::channel<unsigned, 4> uch;
+	unit_assert(uch.capacity() == 4 && uch.size() == 0);
+	unsigned in[6] = {1, 2, 3, 4, 5, 6};
+	unsigned out[6] = {0};
+	unit_assert(uch.try_send_v(in, 3) == 3);
+	unit_assert(uch.try_recv_v(out, 2) == 2);
+	unit_assert(out[0] == 1 && out[1] == 2);
+	unit_assert(uch.try_send_v(in + 3, 3) == 3);
+	unit_assert(uch.try_send(7u) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(uch.try_recv_v(out, 6) == 4);
+	for (unsigned i = 0; i < 4; ++i)
+		unit_assert(out[i] == i + 3);
+	unit_assert(uch.try_recv(out) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("parked receivers get moved strings bypassing the ring");
+	test_str_channel sch;
+	struct ctx_str recv1, recv2;
+	str_start(&recv1, &sch, str_recv_f, "");
+	str_start(&recv2, &sch, str_recv_f, "");
+	coro_yield();
+	unit_assert(!recv1.is_done && !recv2.is_done);
+	std::string first(100, 'a');
+	unit_assert(sch.try_send(std::move(first)) == 0);
+	unit_assert(first.empty());
+	unit_assert(sch.send("b") == 0);
+	unit_assert(sch.size() == 0);
+	unit_assert(str_join(&recv1) == 0 && str_join(&recv2) == 0);
+	unit_assert(recv1.data == std::string(100, 'a') && recv2.data == "b");
+
+	unit_msg("parked senders move their strings into the freed places");
+	std::string batch[3] = {"c", "d", "e"};
+	unit_assert(sch.try_send_v(batch, 3) == 2);
+	unit_assert(batch[0].empty() && batch[2] == "e");
+	struct ctx_str send1;
+	str_start(&send1, &sch, str_send_f, "f");
+	coro_yield();
+	unit_assert(!send1.is_done);
+	std::string got[4];
+	unit_assert(sch.try_recv_v(got, 4) == 2);
+	unit_assert(got[0] == "c" && got[1] == "d");
+	unit_assert(str_join(&send1) == 0);
+	unit_assert(sch.try_recv(&got[0]) == 0 && got[0] == "f");
+
+	unit_msg("close wakes up the waiters and drops the messages");
+	unit_assert(sch.send("g") == 0);
+	unit_assert(sch.send("h") == 0);
+	str_start(&send1, &sch, str_send_f, "i");
+	coro_yield();
+	sch.close();
+	unit_assert(str_join(&send1) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(sch.is_closed() && sch.size() == 0);
+	unit_assert(sch.try_recv(&got[0]) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -1613,6 +2592,7 @@ coro_main_f(void *arg)
 	test_basic();
 	test_channel_reopen();
 	test_multiple_channels();
+	test_channel_descriptors();
 
 	test_send_basic();
 	test_send_blocking();
@@ -1621,15 +2601,19 @@ coro_main_f(void *arg)
 	test_recv_basic();
 	test_recv_blocking();
 	test_recv_blocking_send_many();
+	test_direct_handoff();
+	test_select();
 
 	test_stress_send_recv_concurrent();
 	test_send_recv_very_many();
 	test_wakeup_on_close();
+	test_close_with_waiters_reopen();
 	test_close_non_empty_bus();
 
 	test_broadcast_basic();
 	test_broadcast_blocking_basic();
 	test_broadcast_blocking_drop_channel_during_wait();
+	test_broadcast_full_tracking();
 
 	test_send_vector_basic();
 	test_send_vector_blocking();
@@ -1638,6 +2622,19 @@ coro_main_f(void *arg)
 	test_recv_vector_basic();
 	test_recv_vector_blocking();
 	test_recv_vector_blocking_recv_many();
+	test_recv_vector_min();
+
+	test_buf_basic();
+	test_buf_blocking();
+
+	test_reserve_commit();
+	test_port();
+	test_prio();
+	test_topic();
+#if NEED_STATS
+	test_stats();
+#endif
+	test_channel_template();
 	return NULL;
 }
 
@@ -0,0 +1,333 @@
+/**
+ * Parser throughput benchmark and fuzzer. A script of many lines is
+ * fed into the parser in one chunk, and all the lines are popped
+ * out. Each scenario is run several times, and the min, median and
+ * max throughput are printed in MB/s.
+ *
+ * The same source is built once more with heap_help, see
+ * CMakeLists.txt. That build prints allocations per line instead,
+ * both for command_line and for arena parsing. The backtraces of
+ * heap_help would ruin the throughput, so it isn't measured there.
+ *
+ * Before the benchmarks random scripts are parsed in random pieces
+ * with parser_pop_next(), and in one piece with parser_pop_next_into().
+ * Both must give the same lines and errors.
+ */
+#include "parser.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef BENCH_ALLOC_COUNT
+#include "heap_help.h"
+#endif
+
+enum {
+	BENCH_RUN_COUNT = 7,
+	BENCH_FUZZ_SCRIPT_COUNT = 200,
+	BENCH_FUZZ_TOKEN_COUNT = 300,
+};
+
+static uint32_t bench_seed = 1;
+
+static uint32_t
+bench_rand(void)
+{
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return bench_seed >> 16;
+}
+
+static void
+bench_fail(const char *what)
+{
+	printf("Error: %s\n", what);
+	exit(-1);
+}
+
+/** Long base64-like arguments, mostly plain chars. */
+static std::string
+bench_script_long_args(int line_count)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		"abcdefghijklmnopqrstuvwxyz0123456789+/=";
+	std::string script;
+	for (int i = 0; i < line_count; ++i) {
+		script += "decode ";
+		for (int j = 0; j < 1024; ++j)
+			script += alphabet[bench_rand() % (sizeof(alphabet) - 1)];
+		script += " > out.bin\n";
+	}
+	return script;
+}
+
+/** Short commands with quotes and pipes. */
+static std::string
+bench_script_short_cmds(int line_count)
+{
+	std::string script;
+	for (int i = 0; i < line_count; ++i) {
+		script += "echo \"line " + std::to_string(i) + "\" 'a b' | "
+			"grep -v x | wc -l >> log.txt\n";
+	}
+	return script;
+}
+
+/** Nested quotes and escapes in every argument. */
+static std::string
+bench_script_quoting(int line_count)
+{
+	std::string script;
+	for (int i = 0; i < line_count; ++i) {
+		script += "printf \"a \\\"b\\\" \\\\c $i\" 'single \" quoted' "
+			"\\'escaped\\' \"x\"'y'z \"new\\nline\" '' \"\"\n";
+	}
+	return script;
+}
+
+/** Pipes of many commands. */
+static std::string
+bench_script_long_pipes(int line_count)
+{
+	std::string script;
+	for (int i = 0; i < line_count; ++i) {
+		script += "cat file";
+		for (int j = 0; j < 30; ++j)
+			script += " | grep -v " + std::to_string(j);
+		script += " && echo ok || echo fail &\n";
+	}
+	return script;
+}
+
+/** Comments, empty lines and line continuations. */
+static std::string
+bench_script_comments(int line_count)
+{
+	std::string script;
+	for (int i = 0; i < line_count; ++i) {
+		script += "# a comment line with 'quotes' and | pipes\n\n";
+		script += "ls -la \\\n    /tmp \\\n    /var # trailing comment\n";
+	}
+	return script;
+}
+
+/** Text of the line, to compare the results of the two parsing APIs. */
+static std::string
+bench_line_dump(const struct command_line *line)
+{
+	std::string res;
+	for (const expr &e : line->exprs) {
+		res += std::to_string(e.type) + ":";
+		if (e.type != EXPR_TYPE_COMMAND)
+			continue;
+		res += e.cmd->exe + "\x01";
+		for (const std::string &arg : e.cmd->args)
+			res += arg + "\x01";
+		if (e.cmd->here_string)
+			res += "<<<" + *e.cmd->here_string + "\x01";
+		for (uint32_t idx : e.cmd->subst_args)
+			res += "<(" + std::to_string(idx + 1) + "\x01";
+	}
+	res += "|" + std::to_string(line->out_type) + line->out_file +
+		(line->is_background ? "&" : "");
+	return res;
+}
+
+static std::string
+bench_arena_dump(const struct command_arena *arena)
+{
+	std::string res;
+	for (const struct arena_expr &e : arena->exprs) {
+		res += std::to_string(e.type) + ":";
+		if (e.type != EXPR_TYPE_COMMAND)
+			continue;
+		for (uint32_t i = 0; i < e.argc; ++i)
+			res += std::string(arena->argv[e.argv_begin + i]) + "\x01";
+		if (arena->argv[e.argv_begin + e.argc] != NULL)
+			bench_fail("argv is not terminated");
+		if (e.here_string != NULL)
+			res += std::string("<<<") + e.here_string + "\x01";
+		for (uint32_t i = 0; i < e.subst_count; ++i) {
+			res += "<(" + std::to_string(arena->substs[e.subst_begin + i]) +
+				"\x01";
+		}
+	}
+	res += "|" + std::to_string(arena->out_type) +
+		(arena->out_type != OUTPUT_TYPE_STDOUT ? arena->out_file : "") +
+		(arena->is_background ? "&" : "");
+	return res;
+}
+
+static std::string
+bench_script_fuzz(void)
+{
+	static const char *tokens[] = {
+		"a", "bc", "'", "\"", "\\", "\\\n", "\n", " ", "\t", "|", "||",
+		"&", "&&", ">", ">>", "#", "'x y'", "\"z\\\"w\"", "echo",
+		"<", "<<<", "<(", "(", ")",
+	};
+	const size_t token_count = sizeof(tokens) / sizeof(tokens[0]);
+	std::string script;
+	for (int i = 0; i < BENCH_FUZZ_TOKEN_COUNT; ++i)
+		script += tokens[bench_rand() % token_count];
+	return script + "\n";
+}
+
+static void
+bench_fuzz(void)
+{
+	for (int i = 0; i < BENCH_FUZZ_SCRIPT_COUNT; ++i) {
+		std::string script = bench_script_fuzz();
+		std::vector<std::string> expected;
+		struct parser *p = parser_new();
+		for (size_t pos = 0; pos < script.size();) {
+			size_t len = 1 + bench_rand() % 16;
+			if (len > script.size() - pos)
+				len = script.size() - pos;
+			parser_feed(p, script.data() + pos, len);
+			pos += len;
+			while (true) {
+				struct command_line *line = NULL;
+				enum parser_error err = parser_pop_next(p, &line);
+				if (err != PARSER_ERR_NONE) {
+					expected.push_back("E" + std::to_string(err));
+					continue;
+				}
+				if (line == NULL)
+					break;
+				expected.push_back(bench_line_dump(line));
+				delete line;
+			}
+		}
+		parser_delete(p);
+
+		p = parser_new();
+		struct command_arena arena;
+		parser_feed(p, script.data(), script.size());
+		size_t got = 0;
+		while (true) {
+			bool is_done;
+			enum parser_error err =
+				parser_pop_next_into(p, &arena, &is_done);
+			std::string res;
+			if (err != PARSER_ERR_NONE)
+				res = "E" + std::to_string(err);
+			else if (is_done)
+				res = bench_arena_dump(&arena);
+			else
+				break;
+			if (got >= expected.size() || expected[got] != res)
+				bench_fail("fuzz results mismatch");
+			++got;
+		}
+		parser_delete(p);
+		if (got != expected.size())
+			bench_fail("fuzz line count mismatch");
+	}
+	printf("fuzz: %d scripts are parsed the same way\n",
+		BENCH_FUZZ_SCRIPT_COUNT);
+}
+
+/** Parse the script, return the number of lines. */
+static int
+bench_parse(const std::string &script, bool is_arena)
+{
+	struct parser *p = parser_new();
+	struct command_arena arena;
+	parser_feed(p, script.data(), script.size());
+	int count = 0;
+	while (true) {
+		enum parser_error err;
+		bool is_done;
+		if (is_arena) {
+			err = parser_pop_next_into(p, &arena, &is_done);
+		} else {
+			struct command_line *line = NULL;
+			err = parser_pop_next(p, &line);
+			is_done = line != NULL;
+			delete line;
+		}
+		if (err != PARSER_ERR_NONE)
+			bench_fail("parse failed");
+		if (!is_done)
+			break;
+		++count;
+	}
+	parser_delete(p);
+	return count;
+}
+
+#ifndef BENCH_ALLOC_COUNT
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r ? 1 : 0;
+}
+
+#endif
+
+static void
+bench_scenario_run(const char *name, const std::string &script,
+	int line_count)
+{
+	printf("%s\n", name);
+#ifdef BENCH_ALLOC_COUNT
+	for (int is_arena = 0; is_arena < 2; ++is_arena) {
+		uint64_t start = heaph_get_total_alloc_count();
+		if (bench_parse(script, is_arena) != line_count)
+			bench_fail("wrong line count");
+		uint64_t count = heaph_get_total_alloc_count() - start;
+		printf("    %s: %.2lf allocations per line\n",
+			is_arena ? "arena" : "command_line",
+			(double)count / line_count);
+	}
+#else
+	for (int is_arena = 0; is_arena < 2; ++is_arena) {
+		double results[BENCH_RUN_COUNT];
+		for (int i = 0; i < BENCH_RUN_COUNT; ++i) {
+			uint64_t start = bench_now_ns();
+			if (bench_parse(script, is_arena) != line_count)
+				bench_fail("wrong line count");
+			uint64_t duration = bench_now_ns() - start;
+			/* Bytes per ns to MB per second. */
+			results[i] = (double)script.size() * 1000 / duration;
+		}
+		qsort(results, BENCH_RUN_COUNT, sizeof(results[0]), bench_cmp);
+		printf("  %s\n", is_arena ? "arena" : "command_line");
+		printf("    min: %.2lf MB/s\n", results[0]);
+		printf("    med: %.2lf MB/s\n", results[BENCH_RUN_COUNT / 2]);
+		printf("    max: %.2lf MB/s\n", results[BENCH_RUN_COUNT - 1]);
+	}
+#endif
+}
+
+int
+main(int argc, char **argv)
+{
+	int line_count = argc > 1 ? atoi(argv[1]) : 10000;
+	bench_fuzz();
+	bench_scenario_run("long arguments",
+		bench_script_long_args(line_count), line_count);
+	bench_scenario_run("short commands",
+		bench_script_short_cmds(line_count), line_count);
+	bench_scenario_run("quoting",
+		bench_script_quoting(line_count), line_count);
+	bench_scenario_run("long pipes",
+		bench_script_long_pipes(line_count), line_count);
+	bench_scenario_run("comments and continuations",
+		bench_script_comments(line_count), line_count);
+	return 0;
+}
@@ -0,0 +1,147 @@
+/**
+ * Pipe buffer benchmark. The shell runs a long pipeline of external
+ * cats over a big file, with several SHELL_PIPE_SZ values. Each run is
+ * repeated, and the min, median and max throughput are printed in
+ * MB/s, and the median context switches per MB. The switches come from
+ * wait4() of the shell, it includes the commands it waited for.
+ *
+ * Usage: pipe_bench <shell> [size_mb] [stage_count]
+ */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+
+enum {
+	BENCH_RUN_COUNT = 5,
+};
+
+/** 0 is the default size. More than 1 MB needs privileges. */
+static const int bench_pipe_sizes[] = {0, 256 * 1024, 1024 * 1024};
+
+static void
+bench_fail(const char *what)
+{
+	perror(what);
+	exit(-1);
+}
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r ? 1 : 0;
+}
+
+static void
+bench_make_file(const char *path, int size_mb)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		bench_fail("open");
+	char *buf = (char *)malloc(1024 * 1024);
+	for (int i = 0; i < 1024 * 1024; ++i)
+		buf[i] = 'a' + i % 26;
+	for (int i = 0; i < size_mb; ++i) {
+		if (write(fd, buf, 1024 * 1024) != 1024 * 1024)
+			bench_fail("write");
+	}
+	free(buf);
+	close(fd);
+}
+
+/** Run the script in the shell, return ns, and the context switches. */
+static uint64_t
+bench_run_shell(const char *shell, const char *script, int pipe_size, long *csw)
+{
+	int fds[2];
+	if (pipe(fds) != 0)
+		bench_fail("pipe");
+	uint64_t start = bench_now_ns();
+	pid_t pid = fork();
+	if (pid < 0)
+		bench_fail("fork");
+	if (pid == 0) {
+		char size[32];
+		snprintf(size, sizeof(size), "%d", pipe_size);
+		if (pipe_size > 0)
+			setenv("SHELL_PIPE_SZ", size, 1);
+		dup2(fds[0], STDIN_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execl(shell, shell, (char *)NULL);
+		_exit(127);
+	}
+	close(fds[0]);
+	size_t len = strlen(script);
+	if (write(fds[1], script, len) != (ssize_t)len)
+		bench_fail("write");
+	close(fds[1]);
+	int status;
+	struct rusage ru;
+	if (wait4(pid, &status, 0, &ru) != pid || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0)
+		bench_fail("shell");
+	*csw = ru.ru_nvcsw + ru.ru_nivcsw;
+	return bench_now_ns() - start;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		printf("Usage: pipe_bench <shell> [size_mb] [stage_count]\n");
+		return -1;
+	}
+	const char *shell = argv[1];
+	int size_mb = argc > 2 ? atoi(argv[2]) : 256;
+	int stage_count = argc > 3 ? atoi(argv[3]) : 4;
+	char path[] = "/tmp/pipe_bench.XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		bench_fail("mkstemp");
+	close(fd);
+	bench_make_file(path, size_mb);
+
+	/* Not the cat builtin, it would splice in the shell. */
+	std::string script = std::string("/bin/cat ") + path;
+	for (int i = 1; i < stage_count; ++i)
+		script += " | /bin/cat";
+	script += " > /dev/null\n";
+	printf("%s\n", script.c_str());
+
+	for (int pipe_size : bench_pipe_sizes) {
+		double mbs[BENCH_RUN_COUNT];
+		double csws[BENCH_RUN_COUNT];
+		for (int i = 0; i < BENCH_RUN_COUNT; ++i) {
+			long csw;
+			uint64_t ns = bench_run_shell(shell, script.c_str(), pipe_size, &csw);
+			mbs[i] = size_mb * 1e9 / ns;
+			csws[i] = (double)csw / size_mb;
+		}
+		qsort(mbs, BENCH_RUN_COUNT, sizeof(mbs[0]), bench_cmp);
+		qsort(csws, BENCH_RUN_COUNT, sizeof(csws[0]), bench_cmp);
+		printf("SHELL_PIPE_SZ %d\n", pipe_size);
+		printf("    MB/s: min %.0lf, med %.0lf, max %.0lf\n", mbs[0],
+			mbs[BENCH_RUN_COUNT / 2], mbs[BENCH_RUN_COUNT - 1]);
+		printf("    switches/MB: med %.1lf\n", csws[BENCH_RUN_COUNT / 2]);
+	}
+	unlink(path);
+	return 0;
+}
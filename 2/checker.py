@@ -49,11 +49,11 @@ for section in all_sections:
         continue
     test_sections.append(section)
 
-def open_new_shell():
+def open_new_shell(env=None):
     return subprocess.Popen([exe_path], shell=False, stdin=subprocess.PIPE,
                             stdout=subprocess.PIPE,
                             stderr=subprocess.STDOUT, bufsize=0,
-                            cwd=test_dir)
+                            cwd=test_dir, env=env)
 
 def cleanup():
     shutil.rmtree(test_dir, ignore_errors=True)
@@ -159,6 +159,10 @@ tests.append(([cmd], code))
 if args.with_logic:
     tests.append((["exit 123 && echo test"], 123))
     tests.append((["exit 123 || echo test"], 123))
+if args.with_background:
+    tests.append((["sh -c 'exit 3' &", "sleep 0.1 &", "wait"], 0))
+    tests.append((["false", "true &", "wait"], 0))
+    tests.append((["sleep 0.1 &", "wait", "ls /404"], code))
 
 for test in tests:
     p = open_new_shell()
@@ -261,5 +265,42 @@ if is_error:
     sys.exit(-1)
 
 print('✅ Passed')
+
+##########################################################################################
+# Test the limit of parallel background jobs. With SHELL_JOBS=1 the second job
+# starts only after the first one ends, so the order of their output is fixed.
+# Without the limit the fast one is done first.
+if args.with_background:
+    print('⏳ Test SHELL_JOBS limit of background jobs')
+    command = '''python3 -c "import time; time.sleep(0.3); print('slow')" >> order.txt &
+echo 'fast' >> order.txt &
+echo 'foreground work'
+wait
+cat order.txt
+rm order.txt
+'''
+    tests = [
+    ('1', 'foreground work\nslow\nfast\n'),
+    (None, 'foreground work\nfast\nslow\n'),
+    ]
+    recreate_dir()
+    for test in tests:
+        env = dict(os.environ)
+        env.pop('SHELL_JOBS', None)
+        if test[0] is not None:
+            env['SHELL_JOBS'] = test[0]
+        p = open_new_shell(env)
+        try:
+            output = p.communicate(command.encode(), small_timeout)[0].decode()
+        except subprocess.TimeoutExpired:
+            print('Too long no output with SHELL_JOBS={}'.format(test[0]))
+            sys.exit(-1)
+        if output != test[1]:
+            print('Bad jobs order with SHELL_JOBS={}'.format(test[0]))
+            if args.verbose:
+                print_diff(test[1], output)
+            sys.exit(-1)
+    print('✅ Passed')
+
 print('⏫ Points: {}'.format(points))
 cleanup()
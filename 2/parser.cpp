@@ -4,9 +4,38 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+enum {
+	/**
+	 * Consumed bytes are dropped from the buffer only when there
+	 * are at least that many of them, and they are at least half
+	 * of the buffer. So each byte is moved O(1) times on average.
+	 */
+	PARSER_COMPACT_MIN = 4096,
+};
 
 struct parser {
 	std::string buffer;
+	/** Offset of the first not consumed byte in the buffer. */
+	size_t pos = 0;
+	/**
+	 * The line being parsed. An incomplete line stays here between
+	 * pops, to continue parsing from instead of the line start.
+	 */
+	struct command_arena arena;
+	/** The arena has an incomplete line from the previous pop. */
+	bool has_line = false;
+	/** Offset where the parsing of the incomplete line stopped. */
+	size_t line_pos = 0;
+	/** Size of the arena strings at that offset. */
+	size_t line_strings_size = 0;
 };
 
 enum token_type {
@@ -19,20 +48,36 @@ enum token_type {
 	TOKEN_TYPE_OUT_NEW,
 	TOKEN_TYPE_OUT_APPEND,
 	TOKEN_TYPE_BACKGROUND,
+	TOKEN_TYPE_HERE_STRING,
+	/** The string is the text inside '<(...)'. */
+	TOKEN_TYPE_PROC_SUBST,
 };
 
+/**
+ * The token string is stored right in the arena strings, so it is
+ * not copied anywhere after parsing.
+ */
 struct token {
 	enum token_type type = TOKEN_TYPE_NONE;
-	std::string data;
+	/** Offset of the string start in the arena strings. */
+	uint32_t begin = 0;
+	std::vector<char> *strings = NULL;
 };
 
 static void
-token_reset(struct token *t)
+token_reset(struct token *t, std::vector<char> *strings)
 {
-	t->data.clear();
+	t->strings = strings;
+	t->begin = strings->size();
 	t->type = TOKEN_TYPE_NONE;
 }
 
+static bool
+token_is_empty(const struct token *t)
+{
+	return t->strings->size() == t->begin;
+}
+
 struct parser *
 parser_new(void)
 {
@@ -42,20 +87,150 @@ parser_new(void)
 void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
+	if (p->pos == p->buffer.size()) {
+		p->buffer.clear();
+		p->line_pos = 0;
+		p->pos = 0;
+	} else if (p->pos >= PARSER_COMPACT_MIN &&
+		   p->pos * 2 >= p->buffer.size()) {
+		p->buffer.erase(0, p->pos);
+		assert(p->line_pos >= p->pos);
+		p->line_pos -= p->pos;
+		p->pos = 0;
+	}
 	p->buffer.append(str, len);
 }
 
 static void
 parser_consume(struct parser *p, uint32_t size)
 {
-	assert(p->buffer.size() >= size);
-	p->buffer.erase(0, size);
+	assert(p->buffer.size() - p->pos >= size);
+	p->pos += size;
+}
+
+/**
+ * Chars which parse_token_impl() handles specially at least in
+ * some state. All the others are just appended to the token.
+ */
+static bool
+parse_char_is_special(char c)
+{
+	switch (c) {
+	case '\'':
+	case '"':
+	case '\\':
+	case '&':
+	case '|':
+	case '>':
+	case '<':
+	case '#':
+	case ' ':
+	case '\t':
+	case '\r':
+	case '\n':
+		return true;
+	default:
+		return false;
+	}
+}
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+/** Same chars as in parse_char_is_special(). */
+static const char parse_specials[] = "'\"\\&|><# \t\r\n";
+
+enum {
+	PARSE_SPECIAL_COUNT = sizeof(parse_specials) - 1,
+};
+#endif
+
+/** Find the first special char in the given range, or its end. */
+static const char *
+parse_scan_plain(const char *pos, const char *end)
+{
+#if defined(__SSE2__)
+	__m128i sets[PARSE_SPECIAL_COUNT];
+	for (size_t i = 0; i < PARSE_SPECIAL_COUNT; ++i)
+		sets[i] = _mm_set1_epi8(parse_specials[i]);
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		__m128i m = _mm_cmpeq_epi8(v, sets[0]);
+		for (size_t i = 1; i < PARSE_SPECIAL_COUNT; ++i)
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(v, sets[i]));
+		int mask = _mm_movemask_epi8(m);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 16;
+	}
+#elif defined(__ARM_NEON)
+	uint8x16_t sets[PARSE_SPECIAL_COUNT];
+	for (size_t i = 0; i < PARSE_SPECIAL_COUNT; ++i)
+		sets[i] = vdupq_n_u8((uint8_t)parse_specials[i]);
+	while (end - pos >= 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)pos);
+		uint8x16_t m = vceqq_u8(v, sets[0]);
+		for (size_t i = 1; i < PARSE_SPECIAL_COUNT; ++i)
+			m = vorrq_u8(m, vceqq_u8(v, sets[i]));
+		/* Narrow each byte of the mask to 4 bits. */
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+			vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+		if (mask != 0)
+			return pos + (__builtin_ctzll(mask) >> 2);
+		pos += 16;
+	}
+#endif
+	while (pos < end && !parse_char_is_special(*pos))
+		++pos;
+	return pos;
 }
 
+/**
+ * Save the text of '<(...)' as is, it is parsed again when executed.
+ * Nested parentheses and quotes are respected to find the end.
+ */
 static uint32_t
-parse_token(const char *pos, const char *end, struct token *out)
+parse_proc_subst(const char *begin, const char *pos, const char *end,
+	struct token *out)
+{
+	const char *text = pos;
+	int depth = 1;
+	char quote = 0;
+	for (; pos < end; ++pos) {
+		char c = *pos;
+		if (quote != 0) {
+			if (c == quote)
+				quote = 0;
+			else if (c == '\\' && quote == '"' && ++pos == end)
+				return 0;
+			continue;
+		}
+		switch (c) {
+		case '\'':
+		case '"':
+			quote = c;
+			continue;
+		case '\\':
+			if (++pos == end)
+				return 0;
+			continue;
+		case '(':
+			++depth;
+			continue;
+		case ')':
+			if (--depth > 0)
+				continue;
+			out->strings->insert(out->strings->end(), text, pos);
+			out->type = TOKEN_TYPE_PROC_SUBST;
+			return pos + 1 - begin;
+		default:
+			continue;
+		}
+	}
+	return 0;
+}
+
+static uint32_t
+parse_token_impl(const char *pos, const char *end, struct token *out)
 {
-	token_reset(out);
 	const char *begin = pos;
 	while (pos < end) {
 		if (!isspace(*pos))
@@ -103,7 +278,7 @@ parse_token(const char *pos, const char *end, struct token *out)
 				default:
 					break;
 				}
-				out->data += '\\';
+				out->strings->push_back('\\');
 				goto append_and_next;
 			}
 			assert(quote == 0);
@@ -121,7 +296,7 @@ parse_token(const char *pos, const char *end, struct token *out)
 		case '>':
 			if (quote != 0)
 				goto append_and_next;
-			if (!out->data.empty()) {
+			if (!token_is_empty(out)) {
 				out->type = TOKEN_TYPE_STR;
 				return pos - begin;
 			}
@@ -161,24 +336,56 @@ parse_token(const char *pos, const char *end, struct token *out)
 				}
 			}
 			return pos - begin;
+		case '<':
+			/* A single '<' is a plain char, only '<<<' and '<(' are not. */
+			if (quote != 0)
+				goto append_and_next;
+			if (end - pos < 2)
+				return 0;
+			if (pos[1] == '(') {
+				if (!token_is_empty(out)) {
+					out->type = TOKEN_TYPE_STR;
+					return pos - begin;
+				}
+				return parse_proc_subst(begin, pos + 2, end, out);
+			}
+			if (pos[1] != '<')
+				goto append_and_next;
+			if (end - pos < 3)
+				return 0;
+			if (pos[2] != '<')
+				goto append_and_next;
+			if (!token_is_empty(out)) {
+				out->type = TOKEN_TYPE_STR;
+				return pos - begin;
+			}
+			out->type = TOKEN_TYPE_HERE_STRING;
+			return pos + 3 - begin;
 		case ' ':
 		case '\t':
 		case '\r':
 			if (quote != 0)
 				goto append_and_next;
-			assert(!out->data.empty());
+			/* Spaces after a line continuation. No token yet. */
+			if (token_is_empty(out)) {
+				++pos;
+				continue;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos + 1 - begin;
 		case '\n':
 			if (quote != 0)
 				goto append_and_next;
-			assert(!out->data.empty());
+			if (token_is_empty(out)) {
+				out->type = TOKEN_TYPE_NEW_LINE;
+				return pos + 1 - begin;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos - begin;
 		case '#':
 			if (quote != 0)
 				goto append_and_next;
-			if (!out->data.empty()) {
+			if (!token_is_empty(out)) {
 				out->type = TOKEN_TYPE_STR;
 				return pos - begin;
 			}
@@ -191,43 +398,173 @@ parse_token(const char *pos, const char *end, struct token *out)
 				++pos;
 			}
 			return 0;
-		default:
-			goto append_and_next;
+		default: {
+			/* Append the whole run of plain chars at once. */
+			const char *run_end = parse_scan_plain(pos + 1, end);
+			out->strings->insert(out->strings->end(), pos, run_end);
+			pos = run_end;
+			continue;
+		}
 		}
 	append_and_next:
-		out->data += c;
+		out->strings->push_back(c);
 		++pos;
 	}
 	return 0;
 }
 
-enum parser_error
-parser_pop_next(struct parser *p, struct command_line **out)
+static uint32_t
+parse_token(const char *pos, const char *end, struct token *out,
+	std::vector<char> *strings)
 {
-	struct command_line *line = new command_line();
-	char *pos = p->buffer.data();
-	const char *begin = pos;
-	char *end = pos + p->buffer.size();
+	token_reset(out, strings);
+	uint32_t used = parse_token_impl(pos, end, out);
+	if (used == 0) {
+		/* The token will be parsed again when more data is fed. */
+		strings->resize(out->begin);
+		return 0;
+	}
+	if (out->type == TOKEN_TYPE_STR || out->type == TOKEN_TYPE_PROC_SUBST)
+		strings->push_back(0);
+	return used;
+}
+
+void
+command_arena_reset(struct command_arena *arena)
+{
+	arena->exprs.clear();
+	arena->argv.clear();
+	arena->offsets.clear();
+	arena->substs.clear();
+	arena->strings.clear();
+	arena->out_type = OUTPUT_TYPE_STDOUT;
+	arena->out_file = NULL;
+	arena->out_file_offset = 0;
+	arena->is_background = false;
+}
+
+static void
+command_arena_add_arg(struct command_arena *arena, const struct token *t)
+{
+	struct arena_expr &e = arena->exprs.back();
+	assert(e.type == EXPR_TYPE_COMMAND);
+	assert(e.argv_begin + e.argc == arena->offsets.size());
+	arena->offsets.push_back(t->begin);
+	++e.argc;
+}
+
+static void
+command_arena_add_expr(struct command_arena *arena, enum expr_type type)
+{
+	struct arena_expr e;
+	e.type = type;
+	e.argv_begin = arena->offsets.size();
+	e.argc = 0;
+	e.here_string = NULL;
+	e.here_string_offset = UINT32_MAX;
+	e.subst_begin = arena->substs.size();
+	e.subst_count = 0;
+	arena->exprs.push_back(e);
+}
+
+/**
+ * Turn the string offsets into pointers, now when the strings won't
+ * grow anymore.
+ */
+static void
+command_arena_finish(struct command_arena *arena)
+{
+	const char *strings = arena->strings.data();
+	arena->argv.clear();
+	for (struct arena_expr &e : arena->exprs) {
+		if (e.type != EXPR_TYPE_COMMAND)
+			continue;
+		uint32_t begin = e.argv_begin;
+		e.argv_begin = arena->argv.size();
+		for (uint32_t i = 0; i < e.argc; ++i)
+			arena->argv.push_back(strings + arena->offsets[begin + i]);
+		arena->argv.push_back(NULL);
+		if (e.here_string_offset != UINT32_MAX)
+			e.here_string = strings + e.here_string_offset;
+	}
+	if (arena->out_type != OUTPUT_TYPE_STDOUT)
+		arena->out_file = strings + arena->out_file_offset;
+}
+
+/**
+ * Parse the next line into the parser's arena. On success and when
+ * the line is complete, is_done is set to true.
+ */
+static enum parser_error
+parser_parse_next(struct parser *p, bool *is_done)
+{
+	struct command_arena *line = &p->arena;
+	std::vector<char> *strings = &line->strings;
+	char *pos;
+	*is_done = false;
+	if (p->has_line) {
+		p->has_line = false;
+		pos = p->buffer.data() + p->line_pos;
+		/* The line end is parsed again from its first token. */
+		strings->resize(p->line_strings_size);
+		line->out_type = OUTPUT_TYPE_STDOUT;
+		line->is_background = false;
+	} else {
+		command_arena_reset(line);
+		pos = p->buffer.data() + p->pos;
+	}
+	const char *begin = p->buffer.data() + p->pos;
+	char *end = p->buffer.data() + p->buffer.size();
+	/* All the tokens before it are already in the line. */
+	const char *resume = pos;
+	size_t resume_strings_size = strings->size();
 	struct token token;
 	enum parser_error res = PARSER_ERR_NONE;
 
 	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
+		resume = pos;
+		resume_strings_size = strings->size();
+		uint32_t used = parse_token(pos, end, &token, strings);
 		if (used == 0)
-			goto return_no_line;
+			goto return_incomplete;
 		pos += used;
-		expr e;
 		switch(token.type) {
 		case TOKEN_TYPE_STR:
-			if (!line->exprs.empty() && line->exprs.back().type == EXPR_TYPE_COMMAND) {
-				line->exprs.back().cmd->args.emplace_back(std::move(token.data));
+			if (line->exprs.empty() ||
+			    line->exprs.back().type != EXPR_TYPE_COMMAND)
+				command_arena_add_expr(line, EXPR_TYPE_COMMAND);
+			command_arena_add_arg(line, &token);
+			continue;
+		case TOKEN_TYPE_HERE_STRING:
+		case TOKEN_TYPE_PROC_SUBST: {
+			if (line->exprs.empty() ||
+			    line->exprs.back().type != EXPR_TYPE_COMMAND) {
+				res = PARSER_ERR_INPUT_WITH_NO_COMMAND;
+				goto return_error;
+			}
+			struct arena_expr &e = line->exprs.back();
+			if (token.type == TOKEN_TYPE_PROC_SUBST) {
+				line->substs.push_back(e.argc);
+				++e.subst_count;
+				command_arena_add_arg(line, &token);
 				continue;
 			}
-			e.type = EXPR_TYPE_COMMAND;
-			e.cmd.emplace();
-			e.cmd->exe = std::move(token.data);
-			line->exprs.emplace_back(std::move(e));
+			used = parse_token(pos, end, &token, strings);
+			if (used == 0)
+				goto return_incomplete;
+			pos += used;
+			if (token.type != TOKEN_TYPE_STR) {
+				res = PARSER_ERR_INPUT_REDIRECT_BAD_ARG;
+				/* Don't skip the next line. */
+				if (token.type == TOKEN_TYPE_NEW_LINE) {
+					parser_consume(p, pos - begin);
+					return res;
+				}
+				goto return_error;
+			}
+			e.here_string_offset = token.begin;
 			continue;
+		}
 		case TOKEN_TYPE_NEW_LINE:
 			/* Skip new lines. */
 			if (line->exprs.empty())
@@ -242,8 +579,7 @@ parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e.type = EXPR_TYPE_PIPE;
-			line->exprs.emplace_back(std::move(e));
+			command_arena_add_expr(line, EXPR_TYPE_PIPE);
 			continue;
 		case TOKEN_TYPE_AND:
 			if (line->exprs.empty()) {
@@ -254,8 +590,7 @@ parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e.type = EXPR_TYPE_AND;
-			line->exprs.emplace_back(std::move(e));
+			command_arena_add_expr(line, EXPR_TYPE_AND);
 			continue;
 		case TOKEN_TYPE_OR:
 			if (line->exprs.empty()) {
@@ -266,8 +601,7 @@ parser_pop_next(struct parser *p, struct command_line **out)
 				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
 				goto return_error;
 			}
-			e.type = EXPR_TYPE_OR;
-			line->exprs.emplace_back(std::move(e));
+			command_arena_add_expr(line, EXPR_TYPE_OR);
 			continue;
 		case TOKEN_TYPE_OUT_NEW:
 		case TOKEN_TYPE_OUT_APPEND:
@@ -277,7 +611,9 @@ parser_pop_next(struct parser *p, struct command_line **out)
 			assert(false);
 		}
 	}
-	goto return_no_line;
+	resume = pos;
+	resume_strings_size = strings->size();
+	goto return_incomplete;
 
 close_and_return:
 	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
@@ -286,35 +622,34 @@ close_and_return:
 			line->out_type = OUTPUT_TYPE_FILE_NEW;
 		else
 			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
+		uint32_t used = parse_token(pos, end, &token, strings);
 		if (used == 0)
-			goto return_no_line;
+			goto return_incomplete;
 		pos += used;
 		if (token.type != TOKEN_TYPE_STR) {
 			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
 			goto return_error;
 		}
-		line->out_file = std::move(token.data);
-		used = parse_token(pos, end, &token);
+		line->out_file_offset = token.begin;
+		used = parse_token(pos, end, &token, strings);
 		if (used == 0)
-			goto return_no_line;
+			goto return_incomplete;
 		pos += used;
 	}
 	if (token.type == TOKEN_TYPE_BACKGROUND) {
 		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
+		uint32_t used = parse_token(pos, end, &token, strings);
 		if (used == 0)
-			goto return_no_line;
+			goto return_incomplete;
 		pos += used;
 	}
 	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(!line->exprs.empty());
 		parser_consume(p, pos - begin);
-		if (line->exprs.back().type != EXPR_TYPE_COMMAND) {
-			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
-			goto return_no_line;
-		}
-		*out = line;
+		/* Like '&' or '> file' without a command. */
+		if (line->exprs.empty() ||
+		    line->exprs.back().type != EXPR_TYPE_COMMAND)
+			return PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+		*is_done = true;
 		return PARSER_ERR_NONE;
 	}
 	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
@@ -326,22 +661,73 @@ return_error:
 	 * just crash here because of that.
 	 */
 	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
+		uint32_t used = parse_token(pos, end, &token, strings);
 		if (used == 0)
 			break;
 		pos += used;
 		if (token.type == TOKEN_TYPE_NEW_LINE) {
 			parser_consume(p, pos - begin);
-			goto return_no_line;
+			return res;
 		}
 	}
-	res = PARSER_ERR_NONE;
-	goto return_no_line;
+	return PARSER_ERR_NONE;
 
-return_no_line:
-	delete line;
+return_incomplete:
+	p->has_line = true;
+	p->line_pos = resume - p->buffer.data();
+	p->line_strings_size = resume_strings_size;
+	return PARSER_ERR_NONE;
+}
+
+enum parser_error
+parser_pop_next(struct parser *p, struct command_line **out)
+{
+	bool is_done;
 	*out = NULL;
-	return res;
+	enum parser_error res = parser_parse_next(p, &is_done);
+	if (!is_done)
+		return res;
+	const struct command_arena *arena = &p->arena;
+	const char *strings = arena->strings.data();
+	struct command_line *line = new command_line();
+	for (const struct arena_expr &ae : arena->exprs) {
+		expr e;
+		e.type = ae.type;
+		if (ae.type == EXPR_TYPE_COMMAND) {
+			const uint32_t *offsets = &arena->offsets[ae.argv_begin];
+			e.cmd.emplace();
+			e.cmd->exe = strings + offsets[0];
+			for (uint32_t i = 1; i < ae.argc; ++i)
+				e.cmd->args.emplace_back(strings + offsets[i]);
+			if (ae.here_string_offset != UINT32_MAX)
+				e.cmd->here_string = strings + ae.here_string_offset;
+			for (uint32_t i = 0; i < ae.subst_count; ++i) {
+				e.cmd->subst_args.push_back(
+					arena->substs[ae.subst_begin + i] - 1);
+			}
+		}
+		line->exprs.emplace_back(std::move(e));
+	}
+	line->out_type = arena->out_type;
+	if (arena->out_type != OUTPUT_TYPE_STDOUT)
+		line->out_file = strings + arena->out_file_offset;
+	line->is_background = arena->is_background;
+	*out = line;
+	return PARSER_ERR_NONE;
+}
+
+enum parser_error
+parser_pop_next_into(struct parser *p, struct command_arena *arena,
+	bool *is_done)
+{
+	enum parser_error res = parser_parse_next(p, is_done);
+	if (!*is_done)
+		return res;
+	command_arena_finish(&p->arena);
+	/* Both keep their buffers, so no allocations on the next lines. */
+	std::swap(p->arena, *arena);
+	command_arena_reset(&p->arena);
+	return PARSER_ERR_NONE;
 }
 
 void
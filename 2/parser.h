@@ -20,11 +20,21 @@ enum parser_error {
 	PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG,
 	PARSER_ERR_TOO_LATE_ARGUMENTS,
 	PARSER_ERR_ENDS_NOT_WITH_A_COMMAND,
+	PARSER_ERR_INPUT_REDIRECT_BAD_ARG,
+	PARSER_ERR_INPUT_WITH_NO_COMMAND,
 };
 
 struct command {
 	std::string exe;
 	std::vector<std::string> args;
+	/** Text for the command stdin, from '<<< word'. */
+	std::optional<std::string> here_string;
+	/**
+	 * Indexes of the args which are process substitutions '<(...)'.
+	 * Such an arg is the text of a command line. Its output has to be
+	 * passed to the command as a file path instead.
+	 */
+	std::vector<uint32_t> subst_args;
 };
 
 enum expr_type {
@@ -54,6 +64,59 @@ struct command_line {
 	bool is_background = false;
 };
 
+struct arena_expr {
+	enum expr_type type;
+	/**
+	 * Valid if the type is COMMAND. Index of the exe in the arena
+	 * argv. Its arguments go right after it.
+	 */
+	uint32_t argv_begin;
+	/** Number of the exe and its arguments. */
+	uint32_t argc;
+	/** Valid if the type is COMMAND. Text from '<<<', or NULL. */
+	const char *here_string;
+	/** Offset of the here-string in the strings, used during parsing. */
+	uint32_t here_string_offset;
+	/** Range of the command process substitutions in the arena substs. */
+	uint32_t subst_begin;
+	uint32_t subst_count;
+};
+
+/**
+ * Flat representation of a command line. All the strings of the
+ * line are stored in one buffer. Once the arena is big enough, it
+ * can be reused for new lines without any allocations.
+ */
+struct command_arena {
+	std::vector<arena_expr> exprs;
+	/**
+	 * Exe and arguments of all the commands. Those of each command
+	 * are terminated with NULL, so they can be passed to execvp().
+	 */
+	std::vector<const char *> argv;
+	/**
+	 * Positions in the command argv of the args which are process
+	 * substitutions.
+	 */
+	std::vector<uint32_t> substs;
+	enum output_type out_type = OUTPUT_TYPE_STDOUT;
+	/** Valid if the out type is FILE. */
+	const char *out_file = NULL;
+	bool is_background = false;
+
+	/** Offsets of argv strings, used during parsing. */
+	std::vector<uint32_t> offsets;
+	uint32_t out_file_offset = 0;
+	/**
+	 * Zero-terminated strings the argv and out_file point at. Not a
+	 * std::string, so the pointers survive a swap of the arenas.
+	 */
+	std::vector<char> strings;
+};
+
+void
+command_arena_reset(struct command_arena *arena);
+
 struct parser *
 parser_new(void);
 
@@ -63,5 +126,14 @@ parser_feed(struct parser *p, const char *str, uint32_t len);
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out);
 
+/**
+ * Same as parser_pop_next(), but saves the line into the given
+ * arena. The old content of the arena is lost, and its buffers are
+ * reused. When a complete line is found, is_done is set to true.
+ */
+enum parser_error
+parser_pop_next_into(struct parser *p, struct command_arena *arena,
+	bool *is_done);
+
 void
 parser_delete(struct parser *p);
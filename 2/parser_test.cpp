@@ -2,6 +2,7 @@
 
 #include "unit.h"
 
+#include <algorithm>
 #include <string.h>
 
 static void
@@ -374,6 +375,28 @@ test_escape_outside_of_string(void)
 	unit_assert(++e == line->exprs.end());
 	delete line;
 
+	/*
+	 * ls -la \
+	 *     /tmp \
+	 *
+	 */
+	str = "ls -la \\\n    /tmp \\\n";
+	len = strlen(str);
+	for (uint32_t i = 0; i < len; ++i) {
+		parser_feed(p, &str[i], 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(p, "\n", 1);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_assert(line->exprs.size() == 1);
+	e = line->exprs.begin();
+	unit_check(e->cmd->exe == "ls", "exe");
+	unit_check(e->cmd->args.size() == 2, "arg count");
+	unit_check(e->cmd->args[0] == "-la", "arg[0]");
+	unit_check(e->cmd->args[1] == "/tmp", "arg[1]");
+	delete line;
+
 	parser_delete(p);
 	unit_test_finish();
 }
@@ -833,6 +856,67 @@ test_background(void)
 	unit_test_finish();
 }
 
+static void
+test_input(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "diff <(sort 'a )' | uniq) <(ls (x)) <<< \"some text\" | "
+		"grep a<b";
+	uint32_t len = strlen(str);
+	for (uint32_t i = 0; i < len; ++i) {
+		parser_feed(p, &str[i], 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(p, "\n", 1);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_assert(line->exprs.size() == 3);
+	auto e = line->exprs.begin();
+	unit_assert(e->cmd);
+	unit_check(e->cmd->exe == "diff", "exe");
+	unit_assert(e->cmd->args.size() == 2);
+	unit_check(e->cmd->args[0] == "sort 'a )' | uniq", "arg[0]");
+	unit_check(e->cmd->args[1] == "ls (x)", "arg[1]");
+	unit_assert(e->cmd->subst_args.size() == 2);
+	unit_check(e->cmd->subst_args[0] == 0, "subst[0]");
+	unit_check(e->cmd->subst_args[1] == 1, "subst[1]");
+	unit_assert(e->cmd->here_string);
+	unit_check(*e->cmd->here_string == "some text", "here-string");
+
+	++e;
+	unit_assert(++e != line->exprs.end());
+	unit_assert(e->cmd);
+	unit_check(e->cmd->exe == "grep", "exe");
+	unit_check(e->cmd->args.size() == 1, "arg count");
+	unit_check(e->cmd->args[0] == "a<b", "single < is a char");
+	unit_check(!e->cmd->here_string, "no here-string");
+	unit_check(e->cmd->subst_args.empty(), "no substs");
+	delete line;
+
+	unit_msg("Arena");
+	struct command_arena arena;
+	bool is_done;
+	str = "cat <<< x <(echo)\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next_into(p, &arena, &is_done) ==
+		   PARSER_ERR_NONE && is_done, "parse");
+	unit_assert(arena.exprs.size() == 1);
+	const struct arena_expr *ae = &arena.exprs[0];
+	unit_check(ae->argc == 2, "argc");
+	unit_check(strcmp(arena.argv[ae->argv_begin + 1], "echo") == 0,
+		   "subst text");
+	unit_assert(ae->subst_count == 1);
+	unit_check(arena.substs[ae->subst_begin] == 1, "subst position");
+	unit_check(ae->here_string != NULL &&
+		   strcmp(ae->here_string, "x") == 0, "here-string");
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 static void
 test_error_one(struct parser *p, const char *expr, enum parser_error err)
 {
@@ -868,6 +952,12 @@ test_errors(void)
 	test_error_one(p, "exe |", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe &&", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe ||", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "&", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, " > test.txt", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "cat <<<", PARSER_ERR_INPUT_REDIRECT_BAD_ARG);
+	test_error_one(p, "cat <<< |", PARSER_ERR_INPUT_REDIRECT_BAD_ARG);
+	test_error_one(p, "<<< text cat", PARSER_ERR_INPUT_WITH_NO_COMMAND);
+	test_error_one(p, "<(ls) cat", PARSER_ERR_INPUT_WITH_NO_COMMAND);
 
 	parser_feed(p, "echo\n", 5);
 	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
@@ -882,6 +972,106 @@ test_errors(void)
 	unit_test_finish();
 }
 
+static void
+test_many_lines(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const int count = 10000;
+	std::string script;
+	for (int i = 0; i < count; ++i)
+		script += "echo " + std::to_string(i) + " | grep 1 > out.txt\n";
+	parser_feed(p, script.data(), script.size());
+	bool ok = true;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_assert(line != NULL);
+		ok = ok && line->exprs.size() == 3 &&
+			line->exprs.front().cmd->args[0] == std::to_string(i) &&
+			line->out_file == "out.txt";
+		delete line;
+	}
+	unit_check(ok, "all lines in one feed");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "no more lines");
+
+	unit_msg("Feed in pieces crossing the lines");
+	const uint32_t piece = 7;
+	int line_count = 0;
+	ok = true;
+	for (size_t i = 0; i < script.size(); i += piece) {
+		uint32_t len = std::min<size_t>(piece, script.size() - i);
+		parser_feed(p, script.data() + i, len);
+		while (true) {
+			unit_fail_if(parser_pop_next(p, &line) !=
+				     PARSER_ERR_NONE);
+			if (line == NULL)
+				break;
+			ok = ok && line->exprs.back().cmd->exe == "grep" &&
+				line->exprs.front().cmd->args[0] ==
+				std::to_string(line_count);
+			++line_count;
+			delete line;
+		}
+	}
+	unit_check(ok, "all lines in pieces");
+	unit_check(line_count == count, "line count");
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_arena(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_arena arena;
+	bool is_done;
+
+	const char *str = "echo 'a b' \"c\" | grep a >> out.txt &\nls\n";
+	uint32_t len = strlen(str);
+	for (uint32_t i = 0; i < len; ++i) {
+		parser_feed(p, &str[i], 1);
+		unit_fail_if(parser_pop_next_into(p, &arena, &is_done) !=
+			     PARSER_ERR_NONE);
+		if (is_done)
+			break;
+	}
+	unit_assert(is_done);
+	unit_check(arena.exprs.size() == 3, "expr count");
+	const struct arena_expr *e = &arena.exprs[0];
+	unit_check(e->type == EXPR_TYPE_COMMAND && e->argc == 3, "echo");
+	const char **argv = &arena.argv[e->argv_begin];
+	unit_check(strcmp(argv[0], "echo") == 0, "argv[0]");
+	unit_check(strcmp(argv[1], "a b") == 0, "argv[1]");
+	unit_check(strcmp(argv[2], "c") == 0, "argv[2]");
+	unit_check(argv[3] == NULL, "argv end");
+	unit_check(arena.exprs[1].type == EXPR_TYPE_PIPE, "pipe");
+	e = &arena.exprs[2];
+	argv = &arena.argv[e->argv_begin];
+	unit_check(e->argc == 2 && strcmp(argv[1], "a") == 0, "grep");
+	unit_check(arena.out_type == OUTPUT_TYPE_FILE_APPEND, "out type");
+	unit_check(strcmp(arena.out_file, "out.txt") == 0, "out file");
+	unit_check(arena.is_background, "is background");
+
+	parser_feed(p, &str[len - 3], 3);
+	unit_check(parser_pop_next_into(p, &arena, &is_done) ==
+		   PARSER_ERR_NONE && is_done, "parse");
+	unit_check(arena.exprs.size() == 1, "expr count");
+	unit_check(strcmp(arena.argv[0], "ls") == 0, "exe");
+	unit_check(arena.out_type == OUTPUT_TYPE_STDOUT, "out type");
+	unit_check(!arena.is_background, "is background");
+
+	unit_check(parser_pop_next_into(p, &arena, &is_done) ==
+		   PARSER_ERR_NONE && !is_done, "no more lines");
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -896,6 +1086,9 @@ main(void)
 	test_multiline_string();
 	test_logical_operators();
 	test_background();
+	test_input();
 	test_errors();
+	test_many_lines();
+	test_arena();
 	return 0;
 }
@@ -0,0 +1,283 @@
+#include "script_cache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char script_cache_magic[8] = {'M', 'Y', 'B', 'S', 'H', 'C', '2', 0};
+
+struct script_cache_header {
+	char magic[8];
+	uint64_t hash;
+	uint64_t size;
+	uint64_t offset;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t records_size;
+};
+
+enum script_record_type {
+	SCRIPT_RECORD_LINE,
+	SCRIPT_RECORD_ERROR,
+};
+
+uint64_t
+script_hash(const char *data, size_t size)
+{
+	/* FNV-1a, 8 bytes at a time. It is much cheaper than parsing. */
+	uint64_t h = 14695981039346656037ull;
+	const uint64_t prime = 1099511628211ull;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t v;
+		memcpy(&v, data + i, sizeof(v));
+		h = (h ^ v) * prime;
+	}
+	for (; i < size; ++i)
+		h = (h ^ (uint8_t)data[i]) * prime;
+	return h;
+}
+
+static void
+record_put_u32(std::string *out, uint32_t v)
+{
+	out->append((const char *)&v, sizeof(v));
+}
+
+static void
+record_put_str(std::string *out, const std::string &s)
+{
+	record_put_u32(out, s.size());
+	out->append(s);
+}
+
+void
+script_cache_build(const char *data, size_t size, std::string *records)
+{
+	struct parser *p = parser_new();
+	parser_feed(p, data, size);
+	while (true) {
+		struct command_line *line = NULL;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err != PARSER_ERR_NONE) {
+			record_put_u32(records, SCRIPT_RECORD_ERROR);
+			record_put_u32(records, err);
+			continue;
+		}
+		if (line == NULL)
+			break;
+		record_put_u32(records, SCRIPT_RECORD_LINE);
+		record_put_u32(records, line->out_type);
+		record_put_u32(records, line->is_background);
+		record_put_str(records, line->out_file);
+		record_put_u32(records, line->exprs.size());
+		for (const expr &e : line->exprs) {
+			record_put_u32(records, e.type);
+			if (e.type != EXPR_TYPE_COMMAND)
+				continue;
+			record_put_u32(records, e.cmd->args.size() + 1);
+			record_put_str(records, e.cmd->exe);
+			for (const std::string &arg : e.cmd->args)
+				record_put_str(records, arg);
+			record_put_u32(records, e.cmd->here_string.has_value());
+			if (e.cmd->here_string)
+				record_put_str(records, *e.cmd->here_string);
+			record_put_u32(records, e.cmd->subst_args.size());
+			for (uint32_t idx : e.cmd->subst_args)
+				record_put_u32(records, idx);
+		}
+		delete line;
+	}
+	parser_delete(p);
+}
+
+static std::string
+script_cache_path(const char *dir, const struct script_key *key)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.cache",
+		(unsigned long long)key->hash);
+	return std::string(dir) + name;
+}
+
+static void
+script_cache_header_fill(struct script_cache_header *h,
+	const struct script_key *key, uint64_t records_size)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, script_cache_magic, sizeof(h->magic));
+	h->hash = key->hash;
+	h->size = key->size;
+	h->offset = key->offset;
+	h->mtime_sec = key->mtime.tv_sec;
+	h->mtime_nsec = key->mtime.tv_nsec;
+	h->records_size = records_size;
+}
+
+bool
+script_cache_map(const char *dir, const struct script_key *key,
+	const char **begin, const char **end)
+{
+	std::string path = script_cache_path(dir, key);
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+	    (size_t)st.st_size < sizeof(struct script_cache_header)) {
+		close(fd);
+		return false;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+	struct script_cache_header h;
+	script_cache_header_fill(&h, key, st.st_size - sizeof(h));
+	if (memcmp(map, &h, sizeof(h)) != 0) {
+		munmap(map, st.st_size);
+		return false;
+	}
+	*begin = (const char *)map + sizeof(h);
+	*end = (const char *)map + st.st_size;
+	return true;
+}
+
+void
+script_cache_unmap(const char *begin, const char *end)
+{
+	const char *map = begin - sizeof(struct script_cache_header);
+	munmap((void *)map, end - map);
+}
+
+bool
+script_cache_save(const char *dir, const struct script_key *key,
+	const std::string &records)
+{
+	/* mkdir -p: the default dir is deep in HOME. */
+	std::string dir_path = dir;
+	for (size_t i = 1; i <= dir_path.size(); ++i) {
+		if (i == dir_path.size() || dir_path[i] == '/')
+			mkdir(dir_path.substr(0, i).c_str(), 0755);
+	}
+	std::string path = script_cache_path(dir, key);
+	std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+	int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		0644);
+	if (fd < 0)
+		return false;
+	struct script_cache_header h;
+	script_cache_header_fill(&h, key, records.size());
+	std::string data((const char *)&h, sizeof(h));
+	data += records;
+	const char *pos = data.data();
+	size_t left = data.size();
+	while (left > 0) {
+		ssize_t rc = write(fd, pos, left);
+		if (rc <= 0) {
+			close(fd);
+			unlink(tmp_path.c_str());
+			return false;
+		}
+		pos += rc;
+		left -= rc;
+	}
+	close(fd);
+	if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+static bool
+record_get_u32(const char **pos, const char *end, uint32_t *v)
+{
+	if (end - *pos < (ptrdiff_t)sizeof(*v))
+		return false;
+	memcpy(v, *pos, sizeof(*v));
+	*pos += sizeof(*v);
+	return true;
+}
+
+static bool
+record_get_str(const char **pos, const char *end, std::string *s)
+{
+	uint32_t len;
+	if (!record_get_u32(pos, end, &len) || (size_t)(end - *pos) < len)
+		return false;
+	s->assign(*pos, len);
+	*pos += len;
+	return true;
+}
+
+int
+script_cache_next(const char **pos, const char *end,
+	struct command_line **out, enum parser_error *err)
+{
+	uint32_t type, v;
+	if (!record_get_u32(pos, end, &type))
+		return -1;
+	if (type == SCRIPT_RECORD_ERROR) {
+		if (!record_get_u32(pos, end, &v))
+			return -1;
+		*err = (enum parser_error)v;
+		return 0;
+	}
+	if (type != SCRIPT_RECORD_LINE)
+		return -1;
+	struct command_line *line = new command_line();
+	uint32_t expr_count;
+	if (!record_get_u32(pos, end, &v))
+		goto error;
+	line->out_type = (enum output_type)v;
+	if (!record_get_u32(pos, end, &v))
+		goto error;
+	line->is_background = v != 0;
+	if (!record_get_str(pos, end, &line->out_file) ||
+	    !record_get_u32(pos, end, &expr_count))
+		goto error;
+	for (uint32_t i = 0; i < expr_count; ++i) {
+		expr e;
+		if (!record_get_u32(pos, end, &v))
+			goto error;
+		e.type = (enum expr_type)v;
+		if (e.type == EXPR_TYPE_COMMAND) {
+			uint32_t argc;
+			e.cmd.emplace();
+			if (!record_get_u32(pos, end, &argc) || argc == 0 ||
+			    !record_get_str(pos, end, &e.cmd->exe))
+				goto error;
+			e.cmd->args.resize(argc - 1);
+			for (uint32_t j = 1; j < argc; ++j) {
+				if (!record_get_str(pos, end, &e.cmd->args[j - 1]))
+					goto error;
+			}
+			if (!record_get_u32(pos, end, &v))
+				goto error;
+			if (v != 0) {
+				e.cmd->here_string.emplace();
+				if (!record_get_str(pos, end, &*e.cmd->here_string))
+					goto error;
+			}
+			uint32_t subst_count;
+			if (!record_get_u32(pos, end, &subst_count))
+				goto error;
+			for (uint32_t j = 0; j < subst_count; ++j) {
+				if (!record_get_u32(pos, end, &v) || v >= argc - 1)
+					goto error;
+				e.cmd->subst_args.push_back(v);
+			}
+		}
+		line->exprs.emplace_back(std::move(e));
+	}
+	*out = line;
+	return 1;
+
+error:
+	delete line;
+	return -1;
+}
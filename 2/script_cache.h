@@ -0,0 +1,62 @@
+#pragma once
+
+#include "parser.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <time.h>
+
+/**
+ * Cache of parsed scripts. A script is parsed once into a compact
+ * binary list of records, one per command line or parser error.
+ * The list is saved into a file named by the script hash, and later
+ * runs of the same script map it and skip tokenizing.
+ */
+
+/** What identifies a script version. */
+struct script_key {
+	uint64_t hash;
+	uint64_t size;
+	/** Offset in the file where the script text starts. */
+	uint64_t offset;
+	struct timespec mtime;
+};
+
+uint64_t
+script_hash(const char *data, size_t size);
+
+/** Parse the whole script text into records. */
+void
+script_cache_build(const char *data, size_t size, std::string *records);
+
+/**
+ * Map the cache of the script, if it exists and matches the key.
+ * @retval true Success. The records are in [*begin, *end). The map
+ *     must be released with script_cache_unmap().
+ * @retval false No valid cache.
+ */
+bool
+script_cache_map(const char *dir, const struct script_key *key,
+	const char **begin, const char **end);
+
+void
+script_cache_unmap(const char *begin, const char *end);
+
+/**
+ * Save the records into the cache dir. The file is written under a
+ * temporary name and renamed, so readers never see a partial one.
+ */
+bool
+script_cache_save(const char *dir, const struct script_key *key,
+	const std::string &records);
+
+/**
+ * Decode the next record and advance the position.
+ * @retval 1 A command line is returned into out.
+ * @retval 0 A parser error is returned into err.
+ * @retval -1 No more records, or they are corrupted.
+ */
+int
+script_cache_next(const char **pos, const char *end,
+	struct command_line **out, enum parser_error *err);
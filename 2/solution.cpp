@@ -1,21 +1,1363 @@
 #include "parser.h"
+#include "script_cache.h"
 
+#include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <time.h>
 
+#include <algorithm>
+#include <list>
+#include <map>
 #include <string>
 #include <vector>
 
 
-void
-cleanup_zombies() {
+/* printf() в строку: builtins копят вывод, а не пишут его сразу */
+static void
+out_printf(std::string& out, const char* fmt, ...) {
+    char buf[512];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+    if ((size_t)len < sizeof(buf)) {
+        out.append(buf, len);
+        return;
+    }
+    size_t old_size = out.size();
+    out.resize(old_size + len + 1);
+    va_start(ap, fmt);
+    vsnprintf(&out[old_size], len + 1, fmt, ap);
+    va_end(ap);
+    out.resize(old_size + len);
+}
+
+/*
+ * Трассировка запуска команд: SHELL_TRACE=1 печатает события текстом,
+ * SHELL_TRACE=json - по JSON объекту на строку. Вывод идет в stderr
+ * или в файл SHELL_TRACE_FILE. По событиям видно, сколько времени
+ * ушло на сам шелл, а сколько на команды.
+ */
+enum trace_format {
+    TRACE_OFF,
+    TRACE_TEXT,
+    TRACE_JSON,
+};
+
+static trace_format trace_fmt = TRACE_OFF;
+static int trace_fd = -1;
+
+/* Одна команда конвейера */
+struct trace_cmd {
+    std::string exe;
+    /* spawn, zygote, fork, builtin или subst */
+    const char* how;
+    pid_t pid;
+    /* Начало всего конвейера */
+    uint64_t pipeline_ns;
+    uint64_t start_ns;
+    /* Возврат из запуска. posix_spawn возвращается уже после exec */
+    uint64_t launched_ns;
+    /* Для builtin в шелле конец известен сразу, иначе 0 */
+    uint64_t end_ns;
+};
+
+static uint64_t
+trace_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+trace_init() {
+    const char* mode = getenv("SHELL_TRACE");
+    if (mode == NULL || *mode == 0 || strcmp(mode, "0") == 0) return;
+    trace_fmt = strcmp(mode, "json") == 0 ? TRACE_JSON : TRACE_TEXT;
+    trace_fd = STDERR_FILENO;
+    const char* path = getenv("SHELL_TRACE_FILE");
+    if (path == NULL) return;
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        perror("SHELL_TRACE_FILE");
+        trace_fmt = TRACE_OFF;
+    }
+}
+
+static void
+trace_destroy() {
+    if (trace_fd > STDERR_FILENO) close(trace_fd);
+}
+
+/* Без буфера stdio: шелл может выйти через _exit() */
+static void
+trace_write(const std::string& s) {
+    const char* pos = s.data();
+    size_t left = s.size();
+    while (left > 0) {
+        ssize_t rc = write(trace_fd, pos, left);
+        if (rc <= 0) return;
+        pos += rc;
+        left -= rc;
+    }
+}
+
+static void
+trace_json_str(std::string& out, const std::string& s) {
+    out += '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if (c < 0x20) out_printf(out, "\\u%04x", c);
+        else out += c;
+    }
+    out += '"';
+}
+
+static unsigned long long
+trace_us(uint64_t from_ns, uint64_t to_ns) {
+    return (to_ns - from_ns) / 1000;
+}
+
+static unsigned long long
+trace_tv_us(const struct timeval& tv) {
+    return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Команда завершилась. rusage есть только у процессов */
+static void
+trace_command(const trace_cmd& t, const struct rusage* ru, int code) {
+    uint64_t end_ns = t.end_ns != 0 ? t.end_ns : trace_now_ns();
+    std::string out;
+    if (trace_fmt == TRACE_JSON) {
+        out += "{\"event\":\"command\",\"cmd\":";
+        trace_json_str(out, t.exe);
+        out_printf(out, ",\"pid\":%d,\"via\":\"%s\",\"spawn_us\":%llu", (int)t.pid, t.how,
+            trace_us(t.start_ns, t.launched_ns));
+        if (strcmp(t.how, "spawn") == 0 && t.pid > 0)
+            out_printf(out, ",\"exec_us\":%llu", trace_us(t.pipeline_ns, t.launched_ns));
+        out_printf(out, ",\"wall_us\":%llu", trace_us(t.start_ns, end_ns));
+        if (ru != NULL) {
+            out_printf(out, ",\"user_us\":%llu,\"sys_us\":%llu,\"maxrss_kb\":%ld",
+                trace_tv_us(ru->ru_utime), trace_tv_us(ru->ru_stime), ru->ru_maxrss);
+        }
+        out_printf(out, ",\"code\":%d}\n", code);
+    }
+    else {
+        out_printf(out, "trace: %s pid=%d via=%s spawn=%lluus", t.exe.c_str(), (int)t.pid, t.how,
+            trace_us(t.start_ns, t.launched_ns));
+        if (strcmp(t.how, "spawn") == 0 && t.pid > 0)
+            out_printf(out, " exec=%lluus", trace_us(t.pipeline_ns, t.launched_ns));
+        out_printf(out, " wall=%lluus", trace_us(t.start_ns, end_ns));
+        if (ru != NULL) {
+            out_printf(out, " user=%lluus sys=%lluus maxrss=%ldkB",
+                trace_tv_us(ru->ru_utime), trace_tv_us(ru->ru_stime), ru->ru_maxrss);
+        }
+        out_printf(out, " code=%d\n", code);
+    }
+    trace_write(out);
+}
+
+/*
+ * Конвейер целиком: launch - время шелла на запуск всех команд,
+ * total - от начала до сбора последней команды. Для фонового
+ * конвейера total заканчивается на запуске.
+ */
+static void
+trace_pipeline(const std::vector<trace_cmd>& traces, uint64_t start_ns, bool is_background) {
+    uint64_t launch_ns = 0;
+    for (const trace_cmd& t : traces) launch_ns += t.launched_ns - t.start_ns;
+    unsigned long long total_us = trace_us(start_ns, trace_now_ns());
+    std::string out;
+    if (trace_fmt == TRACE_JSON) {
+        out_printf(out, "{\"event\":\"pipeline\",\"cmds\":%zu,\"launch_us\":%llu,"
+            "\"total_us\":%llu,\"background\":%s}\n", traces.size(), launch_ns / 1000,
+            total_us, is_background ? "true" : "false");
+    }
+    else {
+        out_printf(out, "trace: pipeline cmds=%zu launch=%lluus total=%lluus%s\n",
+            traces.size(), (unsigned long long)launch_ns / 1000, total_us,
+            is_background ? " background" : "");
+    }
+    trace_write(out);
+}
+
+/*
+ * Таблица фоновых задач. Каждая задача - один конвейер. SIGCHLD
+ * заблокирован и читается через signalfd, поэтому завершения детей
+ * видны в главном цикле сразу, без опроса waitpid() на каждую команду.
+ */
+struct job {
+    int id;
+    /* 0 - процесс уже собран */
+    std::vector<pid_t> pids;
+    size_t running;
     int status;
+    std::string text;
+    /* Пусто, если трассировка выключена */
+    std::vector<trace_cmd> trace;
+};
+
+static std::vector<job> jobs;
+static int jobs_next_id = 1;
+static int jobs_signal_fd = -1;
+/* Сколько задач еще не завершилось */
+static size_t jobs_running_count = 0;
+
+/*
+ * Фоновые строки, ждущие свободного места. Их число ограничено
+ * SHELL_JOBS, без нее строки запускаются сразу.
+ */
+struct pending_line {
+    struct command_line *line;
+    /* Статус на момент, когда строка встретилась в скрипте */
+    int status;
+};
+
+static std::list<pending_line> jobs_pending;
+static size_t jobs_limit = 0;
+/* Маска сигналов до блокировки SIGCHLD, ее получают дети */
+static sigset_t jobs_child_sigmask;
+
+static int
+status_to_code(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 0;
+}
+
+static void
+jobs_init() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &jobs_child_sigmask);
+    jobs_signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (jobs_signal_fd == -1) perror("signalfd");
+    const char* limit = getenv("SHELL_JOBS");
+    if (limit != NULL) jobs_limit = strtoul(limit, NULL, 10);
+}
+
+static void
+jobs_destroy() {
+    if (jobs_signal_fd != -1) close(jobs_signal_fd);
+    std::vector<job>().swap(jobs);
+    for (pending_line& pl : jobs_pending) delete pl.line;
+    std::list<pending_line>().swap(jobs_pending);
+}
+
+static void
+job_reap(job& j, bool is_blocking) {
+    for (size_t i = 0; i < j.pids.size(); ++i) {
+        if (j.pids[i] == 0) continue;
+        int status;
+        struct rusage ru;
+        if (wait4(j.pids[i], &status, is_blocking ? 0 : WNOHANG, &ru) <= 0) continue;
+        if (!j.trace.empty()) trace_command(j.trace[i], &ru, status_to_code(status));
+        j.pids[i] = 0;
+        if (--j.running == 0) --jobs_running_count;
+        /* Статус конвейера - статус последней команды */
+        if (i + 1 == j.pids.size()) j.status = status_to_code(status);
+    }
+}
+
+/*
+ * Собрать завершившиеся фоновые процессы. Сигналы склеиваются, так что
+ * на любой SIGCHLD проверяются все задачи, но только они: передние
+ * процессы ждет execute_pipeline().
+ */
+static void
+jobs_poll() {
+    struct signalfd_siginfo info;
+    bool has_signal = false;
+    while (jobs_signal_fd != -1 && read(jobs_signal_fd, &info, sizeof(info)) == (ssize_t)sizeof(info))
+        has_signal = true;
+    if (!has_signal) return;
+    for (job& j : jobs) {
+        if (j.running > 0) job_reap(j, false);
+    }
+}
+
+static void
+jobs_add(
+    const std::vector<pid_t>& pids,
+    const std::vector<int>& codes,
+    std::string text,
+    std::vector<trace_cmd> trace
+) {
+    job j;
+    j.id = jobs_next_id++;
+    j.running = 0;
+    j.status = 0;
+    for (pid_t pid : pids) {
+        /* Builtins и незапущенные команды считаются уже собранными */
+        j.pids.push_back(pid > 0 ? pid : 0);
+        if (pid > 0) ++j.running;
+    }
+    if (!pids.empty() && pids.back() <= 0) j.status = codes.back();
+    if (j.running > 0) ++jobs_running_count;
+    j.text = std::move(text);
+    j.trace = std::move(trace);
+    jobs.push_back(std::move(j));
+}
+
+/* Builtin jobs: напечатать задачи и забыть завершенные */
+static int
+execute_jobs(std::string& out) {
+    jobs_poll();
+    for (const job& j : jobs) {
+        if (j.running > 0) out_printf(out, "[%d] Running\t%s\n", j.id, j.text.c_str());
+        else if (j.status == 0) out_printf(out, "[%d] Done\t%s\n", j.id, j.text.c_str());
+        else out_printf(out, "[%d] Exit %d\t%s\n", j.id, j.status, j.text.c_str());
+    }
+    std::vector<job> running;
+    for (job& j : jobs) {
+        if (j.running > 0) running.push_back(std::move(j));
+    }
+    jobs.swap(running);
+    if (jobs.empty()) jobs_next_id = 1;
+    return 0;
+}
+
+static int
+execute_command_line(const struct command_line *line, int current_status);
+
+static bool
+jobs_has_slot() {
+    return jobs_limit == 0 || jobs_running_count < jobs_limit;
+}
+
+/* Поставить фоновую строку в очередь, если места нет. Иначе false */
+static bool
+jobs_defer(struct command_line *line, int status) {
+    if (!line->is_background || (jobs_pending.empty() && jobs_has_slot())) return false;
+    jobs_pending.push_back({line, status});
+    return true;
+}
+
+/* Запустить отложенные строки, пока есть место */
+static void
+jobs_launch_pending() {
+    while (!jobs_pending.empty() && jobs_has_slot()) {
+        pending_line pl = jobs_pending.front();
+        jobs_pending.pop_front();
+        execute_command_line(pl.line, pl.status);
+        delete pl.line;
+    }
+}
+
+/* Дождаться любого завершения ребенка */
+static void
+jobs_wait_signal() {
+    struct pollfd pfd;
+    pfd.fd = jobs_signal_fd;
+    pfd.events = POLLIN;
+    poll(&pfd, 1, -1);
+    jobs_poll();
+}
+
+/* Запустить всю очередь. Шелл ждет места, но не самих задач */
+static void
+jobs_flush_pending() {
+    while (!jobs_pending.empty()) {
+        jobs_launch_pending();
+        if (jobs_pending.empty()) break;
+        jobs_wait_signal();
+    }
+}
+
+/*
+ * Builtin wait: дождаться всех фоновых задач, блокируясь в waitpid().
+ * Как в bash, без аргументов статус всегда 0.
+ */
+static int
+execute_wait() {
+    jobs_flush_pending();
+    for (job& j : jobs) {
+        while (j.running > 0) job_reap(j, true);
+    }
+    jobs.clear();
+    jobs_next_id = 1;
+    return 0;
+}
+
+
+extern char **environ;
+
+/*
+ * Снимок окружения для запуска команд. Делается при старте, после
+ * меняется только в export: строки лежат в одной арене, envp указывает
+ * в нее. Свой environ шелл не трогает.
+ */
+static std::vector<char> exec_env_arena;
+static std::vector<char*> exec_env;
+
+static void
+exec_env_build(char* const* vars) {
+    size_t size = 0;
+    for (char* const* env = vars; *env != NULL; ++env) size += strlen(*env) + 1;
+    std::vector<char> arena(size);
+    std::vector<char*> env_ptrs;
+    char* pos = arena.data();
+    for (char* const* env = vars; *env != NULL; ++env) {
+        size_t len = strlen(*env) + 1;
+        memcpy(pos, *env, len);
+        env_ptrs.push_back(pos);
+        pos += len;
+    }
+    env_ptrs.push_back(nullptr);
+    exec_env_arena.swap(arena);
+    exec_env.swap(env_ptrs);
+}
+
+static void
+exec_env_init() {
+    exec_env_build(environ);
+}
+
+/* Значение переменной из снимка, или NULL */
+static const char*
+exec_env_get(const char* name) {
+    size_t len = strlen(name);
+    for (size_t i = 0; i + 1 < exec_env.size(); ++i) {
+        if (strncmp(exec_env[i], name, len) == 0 && exec_env[i][len] == '=')
+            return exec_env[i] + len + 1;
+    }
+    return NULL;
+}
+
+/* Поменять или добавить переменную "ИМЯ=значение" */
+static void
+exec_env_put(const std::string& var) {
+    size_t name_len = var.find('=') + 1;
+    std::vector<char*> vars;
+    for (size_t i = 0; i + 1 < exec_env.size(); ++i) {
+        if (strncmp(exec_env[i], var.c_str(), name_len) != 0) vars.push_back(exec_env[i]);
+    }
+    vars.push_back(const_cast<char*>(var.c_str()));
+    vars.push_back(nullptr);
+    /* Строки копируются из старой арены, она освобождается после */
+    exec_env_build(vars.data());
+}
+
+static void
+exec_env_destroy() {
+    std::vector<char*>().swap(exec_env);
+    std::vector<char>().swap(exec_env_arena);
+}
+
+/*
+ * Кэш поиска команд в PATH, как hash в bash. Без него каждый запуск
+ * заново обходит PATH и делает по execve() на каждую папку.
+ */
+struct path_cache_entry {
+    std::string path;
+    unsigned hits = 0;
+};
+
+static std::map<std::string, path_cache_entry> path_cache;
+/* Значение PATH, по которому заполнен кэш */
+static std::string path_cache_env;
+
+static void
+path_cache_check_env() {
+    const char* env = exec_env_get("PATH");
+    std::string value = env != NULL ? env : "";
+    if (value == path_cache_env) return;
+    path_cache.clear();
+    path_cache_env = value;
+}
+
+/*
+ * Вернуть путь к исполняемому файлу команды, или пустую строку, если
+ * его нет. Имена со слэшем не ищутся в PATH.
+ */
+static std::string
+path_cache_resolve(const std::string& name, bool count_hit) {
+    if (name.find('/') != std::string::npos) return name;
+    path_cache_check_env();
+    auto it = path_cache.find(name);
+    if (it != path_cache.end()) {
+        if (count_hit) ++it->second.hits;
+        return it->second.path;
+    }
+    const std::string& env = path_cache_env;
+    size_t begin = 0;
+    while (begin <= env.size()) {
+        size_t end = env.find(':', begin);
+        if (end == std::string::npos) end = env.size();
+        std::string dir = env.substr(begin, end - begin);
+        begin = end + 1;
+        if (dir.empty()) dir = ".";
+        std::string path = dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) ||
+            access(path.c_str(), X_OK) != 0) continue;
+        /* Относительные пути меняются после cd, их не кэшируем */
+        if (dir[0] == '/') {
+            path_cache_entry& e = path_cache[name];
+            e.path = path;
+            e.hits = count_hit ? 1 : 0;
+        }
+        return path;
+    }
+    return "";
+}
+
+static void
+path_cache_forget(const std::string& name) {
+    path_cache.erase(name);
+}
+
+static void
+path_cache_destroy() {
+    /* Освобождаем память, иначе проверка утечек ее найдет */
+    std::map<std::string, path_cache_entry>().swap(path_cache);
+    std::string().swap(path_cache_env);
+}
+
+/*
+ * Путь и argv внешней команды. Готовятся в родителе до fork() или
+ * posix_spawn, все строки в одной арене. Ребенку после fork() остаются
+ * только dup2() и execve(): ни выделения памяти, ни поиска в PATH.
+ */
+struct exec_args {
+    std::vector<char> arena;
+    std::vector<char*> argv;
+    /* NULL, если команда не найдена */
+    const char* path = NULL;
+};
+
+static char*
+exec_args_put(char*& pos, const std::string& s) {
+    char* res = pos;
+    memcpy(pos, s.c_str(), s.size() + 1);
+    pos += s.size() + 1;
+    return res;
+}
+
+static void
+exec_args_build(exec_args& a, const command& cmd, const std::string& path) {
+    size_t size = path.size() + 1 + cmd.exe.size() + 1;
+    for (const auto& s : cmd.args) size += s.size() + 1;
+    a.arena.resize(size);
+    a.argv.clear();
+    a.argv.reserve(cmd.args.size() + 2);
+    char* pos = a.arena.data();
+    char* p = exec_args_put(pos, path);
+    a.path = path.empty() ? NULL : p;
+    a.argv.push_back(exec_args_put(pos, cmd.exe));
+    for (const auto& s : cmd.args) a.argv.push_back(exec_args_put(pos, s));
+    a.argv.push_back(nullptr);
+}
+
+/* Builtin hash: hash, hash -r, hash имя... */
+static int
+execute_hash(const command& cmd, std::string& out) {
+    if (cmd.args.empty()) {
+        path_cache_check_env();
+        if (path_cache.empty()) {
+            out += "hash: hash table empty\n";
+            return 0;
+        }
+        out += "hits\tcommand\n";
+        for (const auto& it : path_cache) out_printf(out, "%4u\t%s\n", it.second.hits, it.second.path.c_str());
+        return 0;
+    }
+    int rc = 0;
+    for (const auto& arg : cmd.args) {
+        if (arg == "-r") {
+            path_cache.clear();
+            continue;
+        }
+        if (path_cache_resolve(arg, false).empty()) {
+            fprintf(stderr, "hash: %s: not found\n", arg.c_str());
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+/* Builtin export ИМЯ=значение...: окружение для следующих команд */
+static int
+execute_export(const command& cmd) {
+    for (const auto& arg : cmd.args) {
+        size_t eq = arg.find('=');
+        /* Без значения переменная уже экспортирована или пуста */
+        if (eq == std::string::npos || eq == 0) continue;
+        exec_env_put(arg);
+    }
+    return 0;
+}
+
+/*
+ * Builtins исполняются в самом шелле, в том числе внутри конвейеров.
+ * Они не читают stdin, а вывод копят в строку, которую потом пишет
+ * execute_pipeline(). Команды, меняющие состояние шелла (exit, cd,
+ * wait, export), делают это только если стоят одни, иначе как в
+ * подоболочке лишь возвращают статус.
+ */
+typedef int (*builtin_f)(const command& cmd, int current_status, std::string& out);
+
+struct builtin {
+    const char* name;
+    builtin_f func;
+};
+
+static int
+builtin_echo(const command& cmd, int, std::string& out) {
+    size_t first = 0;
+    bool has_newline = true;
+    if (!cmd.args.empty() && cmd.args[0] == "-n") {
+        has_newline = false;
+        first = 1;
+    }
+    for (size_t i = first; i < cmd.args.size(); ++i) {
+        if (i != first) out += ' ';
+        out += cmd.args[i];
+    }
+    if (has_newline) out += '\n';
+    return 0;
+}
+
+static int
+builtin_true(const command&, int, std::string&) {
+    return 0;
+}
+
+static int
+builtin_false(const command&, int, std::string&) {
+    return 1;
+}
+
+static int
+builtin_pwd(const command&, int, std::string& out) {
+    char buf[4096];
+    if (getcwd(buf, sizeof(buf)) == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    out += buf;
+    out += '\n';
+    return 0;
+}
+
+static int
+builtin_exit(const command& cmd, int current_status, std::string&) {
+    return cmd.args.empty() ? current_status : std::stoi(cmd.args[0]);
+}
+
+static int
+builtin_hash(const command& cmd, int, std::string& out) {
+    return execute_hash(cmd, out);
+}
+
+static int
+builtin_jobs(const command&, int, std::string& out) {
+    return execute_jobs(out);
+}
+
+/* cd, wait и export в конвейере ничего не меняют */
+static int
+builtin_nop(const command&, int, std::string&) {
+    return 0;
+}
+
+static const builtin builtins[] = {
+    {"echo", builtin_echo},
+    {"true", builtin_true},
+    {"false", builtin_false},
+    {"pwd", builtin_pwd},
+    {"exit", builtin_exit},
+    {"cd", builtin_nop},
+    {"wait", builtin_nop},
+    {"export", builtin_nop},
+    {"hash", builtin_hash},
+    {"jobs", builtin_jobs},
+};
+
+static const builtin*
+builtin_find(const std::string& exe) {
+    for (const builtin& b : builtins) {
+        if (exe == b.name) return &b;
+    }
+    return NULL;
+}
+
+/*
+ * Записать вывод builtin. SIGPIPE на это время заблокирован, чтобы
+ * закрытый читатель не убил шелл, а пришедший сигнал потом снимается.
+ */
+static void
+builtin_write(int fd, const std::string& out) {
+    sigset_t pipe_mask, old_mask;
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_mask, &old_mask);
+    size_t done = 0;
+    bool is_broken = false;
+    while (done < out.size()) {
+        ssize_t rc = write(fd, out.data() + done, out.size() - done);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            is_broken = (errno == EPIPE);
+            break;
+        }
+        done += rc;
+    }
+    if (is_broken) {
+        struct timespec zero = {0, 0};
+        sigtimedwait(&pipe_mask, NULL, &zero);
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+/*
+ * Потоковые builtins cat и tee. Данные перекладываются между fd ядром
+ * через splice(), tee() и copy_file_range(), минуя память процесса.
+ * В отличие от builtins выше они работают одновременно с соседями по
+ * конвейеру. Поэтому в самом шелле исполняется только последняя
+ * команда переднего конвейера, к моменту запуска которой все
+ * остальные уже работают. В других местах ребенок после fork()
+ * делает то же самое без exec().
+ */
+typedef int (*stream_builtin_f)(const command& cmd, int in_fd, int out_fd);
+
+enum {
+    STREAM_CHUNK = 1 << 20,
+    STREAM_BUF_SIZE = 64 * 1024,
+};
+
+static bool
+fd_is_pipe(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+static bool
+fd_is_regular(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static bool
+write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t rc = write(fd, data, size);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += rc;
+        size -= rc;
+    }
+    return true;
+}
+
+/* Ошибки, после которых копирование продолжается обычным read/write */
+static bool
+stream_is_unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EBADF || err == EOPNOTSUPP;
+}
+
+/* Переложить все данные из in_fd в out_fd до конца ввода */
+static bool
+stream_copy(int in_fd, int out_fd) {
+    bool in_pipe = fd_is_pipe(in_fd);
+    bool out_pipe = fd_is_pipe(out_fd);
+    if (!in_pipe && !out_pipe && fd_is_regular(in_fd) && fd_is_regular(out_fd)) {
+        while (true) {
+            ssize_t rc = copy_file_range(in_fd, NULL, out_fd, NULL, STREAM_CHUNK, 0);
+            if (rc == 0) return true;
+            if (rc > 0) continue;
+            if (errno == EINTR) continue;
+            if (stream_is_unsupported(errno)) break;
+            return false;
+        }
+    }
+    else if (in_pipe || out_pipe) {
+        while (true) {
+            ssize_t rc = splice(in_fd, NULL, out_fd, NULL, STREAM_CHUNK, SPLICE_F_MOVE);
+            if (rc == 0) return true;
+            if (rc > 0) continue;
+            if (errno == EINTR) continue;
+            if (stream_is_unsupported(errno)) break;
+            return false;
+        }
+    }
+    char buf[STREAM_BUF_SIZE];
+    while (true) {
+        ssize_t rc = read(in_fd, buf, sizeof(buf));
+        if (rc == 0) return true;
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (!write_all(out_fd, buf, rc)) return false;
+    }
+}
+
+/* cat файл...: без файлов cat читал бы ввод самого шелла */
+static int
+stream_cat(const command& cmd, int, int out_fd) {
+    int code = 0;
+    for (const auto& name : cmd.args) {
+        int fd = open(name.c_str(), O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "cat: %s: %s\n", name.c_str(), strerror(errno));
+            code = 1;
+            continue;
+        }
+        if (!stream_copy(fd, out_fd)) {
+            if (errno == EPIPE) {
+                close(fd);
+                return 1;
+            }
+            fprintf(stderr, "cat: %s: %s\n", name.c_str(), strerror(errno));
+            code = 1;
+        }
+        close(fd);
+    }
+    return code;
+}
+
+/*
+ * tee [-a] файл...: если и ввод, и вывод - pipes, а файл один, то данные
+ * дублируются в вывод через tee(2) и уходят в файл через splice().
+ */
+static int
+stream_tee(const command& cmd, int in_fd, int out_fd) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    std::vector<int> files;
+    int code = 0;
+    for (const auto& name : cmd.args) {
+        if (name == "-a") {
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+            continue;
+        }
+        int fd = open(name.c_str(), flags, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "tee: %s: %s\n", name.c_str(), strerror(errno));
+            code = 1;
+            continue;
+        }
+        files.push_back(fd);
+    }
+    char buf[STREAM_BUF_SIZE];
+    if (files.size() == 1 && fd_is_pipe(in_fd) && fd_is_pipe(out_fd)) {
+        while (true) {
+            ssize_t n = tee(in_fd, out_fd, STREAM_CHUNK, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0) goto close_and_return;
+            if (n < 0) break;
+            /* tee() не забирает данные из ввода, это делает splice() */
+            while (n > 0) {
+                ssize_t rc = splice(in_fd, NULL, files[0], NULL, n, SPLICE_F_MOVE);
+                if (rc < 0 && errno == EINTR) continue;
+                if (rc <= 0) {
+                    rc = read(in_fd, buf, std::min<ssize_t>(n, sizeof(buf)));
+                    if (rc <= 0 || !write_all(files[0], buf, rc)) {
+                        code = 1;
+                        goto close_and_return;
+                    }
+                }
+                n -= rc;
+            }
+        }
+    }
+    while (true) {
+        ssize_t rc = read(in_fd, buf, sizeof(buf));
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) break;
+        /* Закрытый читатель не мешает писать в файлы */
+        write_all(out_fd, buf, rc);
+        for (int fd : files) write_all(fd, buf, rc);
+    }
+close_and_return:
+    for (int fd : files) close(fd);
+    return code;
+}
+
+/*
+ * Найти потоковый builtin. Команды с опциями, которых он не знает, и
+ * те, что читали бы ввод шелла, остаются внешним программам.
+ */
+static stream_builtin_f
+stream_builtin_find(const command& cmd, int in_fd) {
+    if (cmd.exe == "cat") {
+        if (cmd.args.empty()) return NULL;
+        for (const auto& arg : cmd.args) {
+            if (!arg.empty() && arg[0] == '-') return NULL;
+        }
+        return stream_cat;
+    }
+    if (cmd.exe == "tee") {
+        if (in_fd == STDIN_FILENO) return NULL;
+        for (const auto& arg : cmd.args) {
+            if (!arg.empty() && arg[0] == '-' && arg != "-a") return NULL;
+        }
+        return stream_tee;
+    }
+    return NULL;
+}
+
+/* Запуск в самом шелле: закрытый читатель не должен его убить */
+static int
+stream_builtin_run(stream_builtin_f sb, const command& cmd, int in_fd, int out_fd) {
+    sigset_t pipe_mask, old_mask;
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_mask, &old_mask);
+    int code = sb(cmd, in_fd, out_fd);
+    struct timespec zero = {0, 0};
+    while (sigtimedwait(&pipe_mask, NULL, &zero) > 0) {}
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return code;
+}
+
+/*
+ * Зигота: SHELL_ZYGOTE=N держит N заранее созданных процессов для
+ * запуска внешних команд. Зигота fork()-ается при старте, пока шелл
+ * маленький, и копирует себя через clone(CLONE_PARENT): ее дети - дети
+ * шелла, их ждет тот же wait4(). Запрос идет по SOCK_SEQPACKET
+ * socketpair, его читает один из свободных процессов, fds передаются
+ * через SCM_RIGHTS, как в lecture_examples/7_ipc/13_socketpair.c. Запуск
+ * тогда - это сообщение и exec, без клонирования шелла. У каждого
+ * процесса есть pipe к зиготе с CLOEXEC концом: он закрывается при exec,
+ * и только тогда зигота делает замену. Иначе ее clone() на том же CPU
+ * вытеснял бы запуск. Все свободные процессы просыпаются на каждый
+ * запрос, так что их нужно немного.
+ */
+enum {
+    ZYGOTE_MSG_MAX = 64 * 1024,
+    /* stdin, stdout, stderr, текущий каталог, pipe статуса */
+    ZYGOTE_FD_COUNT = 5,
+};
+
+static int zygote_sock = -1;
+static pid_t zygote_pid = -1;
+
+/* Заголовок запроса, за ним строки: путь, файл вывода, argv, environ */
+struct zygote_request {
+    uint32_t argc;
+    uint32_t envc;
+    /* Флаги open() файла вывода, -1 - без файла */
+    int32_t out_flags;
+};
+
+/* Исполнить запрос в процессе зиготы. При успехе не возвращается */
+static void
+zygote_exec(const char* msg, size_t size, const int* fds) {
+    int status_fd = fds[4];
+    pid_t pid = getpid();
+    write(status_fd, &pid, sizeof(pid));
+    int err = EINVAL;
+    zygote_request req;
+    memcpy(&req, msg, sizeof(req));
+    std::vector<char*> strs;
+    for (size_t pos = sizeof(req); pos < size; pos += strlen(msg + pos) + 1)
+        strs.push_back(const_cast<char*>(msg + pos));
+    if (strs.size() == 2 + req.argc + req.envc) {
+        err = 0;
+        if (fchdir(fds[3]) != 0) err = errno;
+        for (int i = 0; i < 3; ++i) dup2(fds[i], i);
+        for (int i = 0; i < 4; ++i) {
+            if (fds[i] > STDERR_FILENO) close(fds[i]);
+        }
+        if (err == 0 && req.out_flags != -1) {
+            int out_fd = open(strs[1], req.out_flags, 0644);
+            if (out_fd < 0 || dup2(out_fd, STDOUT_FILENO) < 0) err = errno;
+            else close(out_fd);
+        }
+        if (err == 0) {
+            std::vector<char*> argv(strs.begin() + 2, strs.begin() + 2 + req.argc);
+            argv.push_back(nullptr);
+            std::vector<char*> envp(strs.begin() + 2 + req.argc, strs.end());
+            envp.push_back(nullptr);
+            sigprocmask(SIG_SETMASK, &jobs_child_sigmask, NULL);
+            execve(strs[0], argv.data(), envp.data());
+            err = errno;
+        }
+    }
+    /* Ошибку напишет шелл, как после posix_spawn */
+    write(status_fd, &err, sizeof(err));
+    _exit(127);
+}
+
+/* Процесс зиготы: ждет запрос, а потом становится командой */
+static void
+zygote_member_run(int sock) {
+    std::vector<char> msg(ZYGOTE_MSG_MAX);
+    struct iovec iov = {msg.data(), msg.size()};
+    char control[CMSG_SPACE(sizeof(int) * ZYGOTE_FD_COUNT)];
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    ssize_t size = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    /* Шелл вышел */
+    if (size <= 0) _exit(0);
+    close(sock);
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+    if (cm == NULL || cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(sizeof(int) * ZYGOTE_FD_COUNT) ||
+        (size_t)size < sizeof(zygote_request))
+        _exit(127);
+    int fds[ZYGOTE_FD_COUNT];
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    zygote_exec(msg.data(), size, fds);
+}
+
+/* Новый процесс зиготы, ребенок шелла. Возвращает конец его pipe */
+static int
+zygote_member_start(int sock) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) return -1;
+    pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+    if (pid == 0) zygote_member_run(sock);
+    /* Следующие процессы не должны держать этот pipe */
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    return fds[0];
+}
+
+static void
+zygote_init() {
+    const char* count_str = getenv("SHELL_ZYGOTE");
+    int count = count_str != NULL ? atoi(count_str) : 0;
+    if (count <= 0) return;
+    int socks[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) != 0) {
+        perror("zygote socketpair");
+        return;
+    }
+    pid_t shell_pid = getpid();
+    zygote_pid = fork();
+    if (zygote_pid == -1) {
+        perror("zygote fork");
+        close(socks[0]);
+        close(socks[1]);
+        return;
+    }
+    if (zygote_pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        /* Шелл мог выйти раньше prctl() */
+        if (getppid() != shell_pid) _exit(0);
+        close(socks[0]);
+        if (jobs_signal_fd != -1) close(jobs_signal_fd);
+        if (trace_fd > STDERR_FILENO) close(trace_fd);
+        /* Иначе свободные процессы держали бы открытым вывод шелла */
+        int null_fd = open("/dev/null", O_RDWR);
+        for (int i = 0; i < 3 && null_fd >= 0; ++i) dup2(null_fd, i);
+        if (null_fd > STDERR_FILENO) close(null_fd);
+        std::vector<struct pollfd> members(count);
+        for (struct pollfd& m : members) {
+            m.fd = zygote_member_start(socks[1]);
+            m.events = POLLIN;
+            if (m.fd < 0) _exit(1);
+        }
+        /* Каждый процесс после exec заменяется новым */
+        while (true) {
+            if (poll(members.data(), members.size(), -1) < 0) {
+                if (errno == EINTR) continue;
+                _exit(1);
+            }
+            for (struct pollfd& m : members) {
+                if (m.revents == 0) continue;
+                close(m.fd);
+                m.fd = zygote_member_start(socks[1]);
+                if (m.fd < 0) _exit(1);
+            }
+        }
+    }
+    close(socks[1]);
+    zygote_sock = socks[0];
+}
+
+/* Для детей шелла после fork(): процессы зиготы им не дети */
+static void
+zygote_forget() {
+    if (zygote_sock != -1) close(zygote_sock);
+    zygote_sock = -1;
+    zygote_pid = -1;
+}
+
+static void
+zygote_destroy() {
+    if (zygote_pid == -1) return;
+    /* Сначала зигота, иначе она заменяла бы выходящие процессы */
+    kill(zygote_pid, SIGKILL);
+    waitpid(zygote_pid, NULL, 0);
+    /* Свободные процессы видят закрытие сокета и выходят */
+    close(zygote_sock);
+    zygote_sock = -1;
+    zygote_pid = -1;
+}
+
+/*
+ * Запустить команду через зиготу. Возвращает 0 или errno, как
+ * posix_spawn, или -1, если зигота не может ее запустить.
+ */
+static int
+zygote_spawn(
+    pid_t* pid,
+    const exec_args& a,
+    int in_fd,
+    int out_fd,
+    const std::string& out_file,
+    int out_type
+) {
+    if (zygote_sock == -1) return -1;
+    std::string msg(sizeof(zygote_request), 0);
+    zygote_request req;
+    req.argc = a.argv.size() - 1;
+    req.out_flags = -1;
+    if (out_fd == -1 && out_type != OUTPUT_TYPE_STDOUT)
+        req.out_flags = O_WRONLY | O_CREAT | (out_type == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND);
+    msg.append(a.path, strlen(a.path) + 1);
+    msg.append(out_file.c_str(), out_file.size() + 1);
+    for (size_t i = 0; i + 1 < a.argv.size(); ++i) msg.append(a.argv[i], strlen(a.argv[i]) + 1);
+    msg.append(exec_env_arena.data(), exec_env_arena.size());
+    req.envc = exec_env.size() - 1;
+    if (msg.size() > ZYGOTE_MSG_MAX) return -1;
+    memcpy(&msg[0], &req, sizeof(req));
+
+    int status_fds[2];
+    if (pipe2(status_fds, O_CLOEXEC) != 0) return -1;
+    int cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd_fd < 0) {
+        close(status_fds[0]);
+        close(status_fds[1]);
+        return -1;
+    }
+    int fds[ZYGOTE_FD_COUNT] = {
+        in_fd, out_fd != -1 ? out_fd : STDOUT_FILENO, STDERR_FILENO, cwd_fd, status_fds[1],
+    };
+    struct iovec iov = {&msg[0], msg.size()};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    ssize_t rc = sendmsg(zygote_sock, &mh, MSG_NOSIGNAL);
+    close(cwd_fd);
+    close(status_fds[1]);
+    /* Процесс пишет pid, потом ошибку exec. Конец файла - exec прошел */
+    int err = 0;
+    if (rc < 0 || read(status_fds[0], pid, sizeof(*pid)) != (ssize_t)sizeof(*pid)) {
+        /* Зигота умерла, дальше без нее */
+        close(status_fds[0]);
+        zygote_destroy();
+        return -1;
+    }
+    if (read(status_fds[0], &err, sizeof(err)) == (ssize_t)sizeof(err)) {
+        /* Процесс уже вышел, его надо собрать */
+        waitpid(*pid, NULL, 0);
+    }
+    close(status_fds[0]);
+    return err;
+}
+
+/*
+ * Запуск внешней команды через posix_spawn. В отличие от fork() он не
+ * копирует таблицы страниц родителя (glibc делает clone(CLONE_VM |
+ * CLONE_VFORK)), поэтому запуск не дорожает с ростом памяти шелла.
+ * Перенаправления выполняются через file actions в дочернем процессе.
+ * С зиготой команда запускается ее процессом, кроме команд с
+ * подстановками: их /dev/fd/N есть только у шелла.
+ */
+static pid_t
+spawn_command(
+    const command& cmd,
+    int in_fd,
+    const int pipe_fds[2],
+    const std::string& out_file,
+    int out_type,
+    bool* is_zygote
+) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&actions, in_fd);
+    }
+    if (pipe_fds[1] != -1) {
+        posix_spawn_file_actions_addclose(&actions, pipe_fds[0]);
+        posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+        posix_spawn_file_actions_addclose(&actions, pipe_fds[1]);
+    }
+    else if (out_type != OUTPUT_TYPE_STDOUT) {
+        int flags = O_WRONLY | O_CREAT | (out_type == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, out_file.c_str(), flags, 0644);
+    }
+
+    /* Дети не должны наследовать заблокированный SIGCHLD */
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &jobs_child_sigmask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
     pid_t pid;
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {}
+    exec_args a;
+    exec_args_build(a, cmd, path_cache_resolve(cmd.exe, true));
+    int rc = ENOENT;
+    *is_zygote = false;
+    for (int attempt = 0; attempt < 2 && a.path != NULL; ++attempt) {
+        rc = -1;
+        if (cmd.subst_args.empty())
+            rc = zygote_spawn(&pid, a, in_fd, pipe_fds[1], out_file, out_type);
+        *is_zygote = rc != -1;
+        if (rc == -1)
+            rc = posix_spawn(&pid, a.path, &actions, &attr, a.argv.data(), exec_env.data());
+        if (rc == 0) break;
+        /* Файл мог пропасть или смениться, ищем заново */
+        path_cache_forget(cmd.exe);
+        exec_args_build(a, cmd, path_cache_resolve(cmd.exe, true));
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", cmd.exe.c_str(), strerror(rc));
+        return -1;
+    }
+    return pid;
+}
+
+/*
+ * Here-string '<<< word' - stdin команды. Текст кладется в memfd, а не
+ * в pipe: большой текст не влез бы в pipe до запуска команды.
+ */
+static int
+here_string_open(const std::string& text) {
+    int fd = memfd_create("here-string", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    /* Как в bash, в конце добавляется перевод строки */
+    if (!write_all(fd, text.data(), text.size()) || !write_all(fd, "\n", 1) ||
+        lseek(fd, 0, SEEK_SET) != 0) {
+        perror("here-string");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Исполнить текст как скрипт, вернуть статус последней строки */
+static int
+execute_text(const std::string& text) {
+    struct parser *p = parser_new();
+    parser_feed(p, text.data(), text.size());
+    parser_feed(p, "\n", 1);
+    int status = 0;
+    struct command_line *line = NULL;
+    while (true) {
+        enum parser_error err = parser_pop_next(p, &line);
+        if (err == PARSER_ERR_NONE && line == NULL) break;
+        if (err != PARSER_ERR_NONE) {
+            fprintf(stderr, "Error: %d\n", (int)err);
+            status = 1;
+            continue;
+        }
+        status = execute_command_line(line, status);
+        delete line;
+    }
+    parser_delete(p);
+    return status;
 }
 
+/*
+ * Подстановка процесса '<(...)': текст исполняется в дочернем шелле с
+ * выводом в pipe, а команда получает путь /dev/fd/N к концу pipe для
+ * чтения. Этот конец без CLOEXEC, чтобы команда его унаследовала.
+ * Ребенок закрывает чужие fds, иначе писатели не увидят закрытия
+ * читателей.
+ */
+static pid_t
+subst_start(const std::string& text, const std::vector<int>& fds_to_close, int* read_fd) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        zygote_forget();
+        for (int fd : fds_to_close) close(fd);
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        /* Фоновые задачи родителя этому шеллу не принадлежат */
+        jobs.clear();
+        jobs_running_count = 0;
+        _exit(execute_text(text));
+    }
+    close(fds[1]);
+    *read_fd = fds[0];
+    return pid;
+}
+
+/*
+ * Pipes конвейера создаются с CLOEXEC: другие запускаемые процессы их
+ * не наследуют, а команде концы передаются через dup2(). Размер буфера
+ * задает SHELL_PIPE_SZ в байтах. Большой буфер реже будит писателя и
+ * читателя на потоке данных. Размер выше /proc/sys/fs/pipe-max-size
+ * не дается без привилегий, тогда pipe остается обычным.
+ */
+static int pipe_size = 0;
+
+static void
+pipe_init() {
+    const char* size = getenv("SHELL_PIPE_SZ");
+    if (size != NULL) pipe_size = atoi(size);
+}
+
+static int
+pipeline_pipe(int fds[2]) {
+    if (pipe2(fds, O_CLOEXEC) != 0) return -1;
+    if (pipe_size > 0) fcntl(fds[1], F_SETPIPE_SZ, pipe_size);
+    return 0;
+}
 
 static int
 execute_pipeline (
@@ -28,22 +1370,34 @@ execute_pipeline (
     if (exprs.empty()) return current_status;
 
     int prev_read_fd = STDIN_FILENO;
+    /* 0 - builtin, -1 - не удалось запустить, статус тогда в codes */
     std::vector<pid_t> pids;
+    std::vector<int> codes;
+    bool is_tracing = trace_fmt != TRACE_OFF;
+    uint64_t pipeline_ns = is_tracing ? trace_now_ns() : 0;
+    std::vector<trace_cmd> traces;
+    /* Процессы подстановок, их ждут вместе с конвейером */
+    std::vector<pid_t> subst_pids;
+    std::vector<trace_cmd> subst_traces;
+    /* Аргументы команды для fork(), арена общая на весь конвейер */
+    exec_args args;
 
     for (size_t i = 0; i < exprs.size(); ++i) {
         if (exprs[i]->type != EXPR_TYPE_COMMAND) continue;
 
-        const command& cmd = exprs[i]->cmd.value();
+        const command& orig_cmd = exprs[i]->cmd.value();
         bool has_next_pipe = (i + 1 < exprs.size() && exprs[i + 1]->type == EXPR_TYPE_PIPE);
 
         if (exprs.size() == 1) {
-            if (cmd.exe == "exit") {
-                int code = cmd.args.empty() ? current_status : std::stoi(cmd.args[0]);
+            if (orig_cmd.exe == "exit") {
+                int code = orig_cmd.args.empty() ? current_status : std::stoi(orig_cmd.args[0]);
                 _exit(code);
             }
-            if (cmd.exe == "cd") {
-                if (cmd.args.empty()) return 0;
-                const char* path = cmd.args[0].c_str();
+            if (orig_cmd.exe == "wait") return execute_wait();
+            if (orig_cmd.exe == "export") return execute_export(orig_cmd);
+            if (orig_cmd.exe == "cd") {
+                if (orig_cmd.args.empty()) return 0;
+                const char* path = orig_cmd.args[0].c_str();
                 if (chdir(path) != 0) {
                     perror("cd");
                     return 1;
@@ -52,19 +1406,118 @@ execute_pipeline (
             }
         }
 
+        /*
+         * Подстановки запускаются до pipe() этой команды, чтобы их
+         * процессы не держали его открытым.
+         */
+        command expanded_cmd;
+        std::vector<int> subst_fds;
+        if (!orig_cmd.subst_args.empty()) {
+            expanded_cmd = orig_cmd;
+            std::vector<int> fds_to_close;
+            if (prev_read_fd != STDIN_FILENO) fds_to_close.push_back(prev_read_fd);
+            for (uint32_t idx : orig_cmd.subst_args) {
+                std::string& arg = expanded_cmd.args[idx];
+                uint64_t start_ns = is_tracing ? trace_now_ns() : 0;
+                int fd;
+                pid_t pid = subst_start(arg, fds_to_close, &fd);
+                if (pid == -1) {
+                    arg = "/dev/null";
+                    continue;
+                }
+                if (is_tracing) {
+                    trace_cmd t;
+                    t.exe = arg;
+                    t.how = "subst";
+                    t.pid = pid;
+                    t.pipeline_ns = pipeline_ns;
+                    t.start_ns = start_ns;
+                    t.launched_ns = trace_now_ns();
+                    t.end_ns = 0;
+                    subst_traces.push_back(std::move(t));
+                }
+                subst_pids.push_back(pid);
+                subst_fds.push_back(fd);
+                fds_to_close.push_back(fd);
+                arg = "/dev/fd/" + std::to_string(fd);
+            }
+        }
+        const command& cmd = orig_cmd.subst_args.empty() ? orig_cmd : expanded_cmd;
+
         int pipe_fds[2] = {-1, -1};
         if (has_next_pipe) {
-            if (pipe(pipe_fds) == -1) { 
+            if (pipeline_pipe(pipe_fds) == -1) { 
                 perror("pipe"); 
                 break; 
             }
         }
 
-        pid_t pid = fork();
-        if (pid == 0) {
-            if (prev_read_fd != STDIN_FILENO) {
-                dup2(prev_read_fd, STDIN_FILENO);
-                close(prev_read_fd);
+        /*
+         * Для вывода в FIFO нужен fork(): open() ждет читателя, а шелл
+         * при этом не должен блокироваться, в том числе внутри
+         * posix_spawn.
+         */
+        bool is_fifo_out = false;
+        if (!has_next_pipe && out_type != OUTPUT_TYPE_STDOUT) {
+            struct stat st;
+            if (stat(out_file.c_str(), &st) == 0 && S_ISFIFO(st.st_mode)) is_fifo_out = true;
+        }
+
+        pid_t pid;
+        int code = 0;
+        bool is_zygote = false;
+        uint64_t start_ns = is_tracing ? trace_now_ns() : 0;
+        /* Here-string заменяет stdin, в том числе из pipe */
+        int here_fd = cmd.here_string ? here_string_open(*cmd.here_string) : -1;
+        int in_fd = here_fd != -1 ? here_fd : prev_read_fd;
+        const builtin* b = builtin_find(cmd.exe);
+        stream_builtin_f sb = b == NULL ? stream_builtin_find(cmd, in_fd) : NULL;
+        std::string out;
+        bool use_fork = is_fifo_out;
+        if (sb != NULL && (has_next_pipe || is_background)) use_fork = true;
+        if (b != NULL) {
+            code = b->func(cmd, current_status, out);
+            /* Вывод больше pipe не влезет, пока читатель не запущен */
+            if (has_next_pipe && (long)out.size() > fcntl(pipe_fds[1], F_GETPIPE_SZ)) use_fork = true;
+        }
+
+        if ((b != NULL || sb != NULL) && !use_fork) {
+            pid = 0;
+            int out_fd = STDOUT_FILENO;
+            if (has_next_pipe) {
+                out_fd = pipe_fds[1];
+            }
+            else if (out_type != OUTPUT_TYPE_STDOUT) {
+                int flags = O_WRONLY | O_CREAT | (out_type == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND);
+                out_fd = open(out_file.c_str(), flags, 0644);
+                if (out_fd < 0) {
+                    perror("open");
+                    code = 1;
+                }
+            }
+            else {
+                fflush(stdout);
+            }
+            if (out_fd >= 0 && b != NULL) builtin_write(out_fd, out);
+            if (out_fd >= 0 && sb != NULL) code = stream_builtin_run(sb, cmd, in_fd, out_fd);
+            if (out_fd >= 0 && out_fd != STDOUT_FILENO && !has_next_pipe) close(out_fd);
+        }
+        else if (!use_fork) {
+            pid = spawn_command(cmd, in_fd, pipe_fds, out_file, out_type, &is_zygote);
+            /* Команда, которую не удалось запустить, завершается с кодом 1 */
+            if (pid == -1) code = 1;
+        }
+        else {
+            if (b == NULL && sb == NULL) exec_args_build(args, cmd, path_cache_resolve(cmd.exe, true));
+            pid = fork();
+            if (pid == -1) code = 1;
+        }
+        if (use_fork && pid == 0) {
+            zygote_forget();
+            sigprocmask(SIG_SETMASK, &jobs_child_sigmask, NULL);
+            if (in_fd != STDIN_FILENO) {
+                dup2(in_fd, STDIN_FILENO);
+                close(in_fd);
             }
 
             if (has_next_pipe) {
@@ -79,27 +1532,36 @@ execute_pipeline (
                 close(out_fd);
             }
 
-            if (cmd.exe == "exit") {
-                int code = cmd.args.empty() ? current_status : std::stoi(cmd.args[0]);
+            /* Вывод builtin уже готов, осталось его записать */
+            if (b != NULL) {
+                builtin_write(STDOUT_FILENO, out);
                 _exit(code);
             }
-            if (cmd.exe == "cd") _exit(0);
-
-            std::vector<char*> c_args;
-            c_args.push_back(const_cast<char*>(cmd.exe.c_str()));
-            for (const auto& s : cmd.args) c_args.push_back(const_cast<char*>(s.c_str()));
-            c_args.push_back(nullptr);
+            if (sb != NULL) _exit(sb(cmd, STDIN_FILENO, STDOUT_FILENO));
 
-            execvp(c_args[0], c_args.data());
-            
-            perror("execvp");
+            errno = ENOENT;
+            if (args.path != NULL) execve(args.path, args.argv.data(), exec_env.data());
+            perror(args.argv[0]);
             _exit(1);
         }
 
-        if (pid != 0) {
-            pids.push_back(pid);
+        pids.push_back(pid);
+        codes.push_back(code);
+        if (is_tracing) {
+            trace_cmd t;
+            t.exe = cmd.exe;
+            t.how = use_fork ? "fork" : (b != NULL || sb != NULL) ? "builtin" :
+                is_zygote ? "zygote" : "spawn";
+            t.pid = pid;
+            t.pipeline_ns = pipeline_ns;
+            t.start_ns = start_ns;
+            t.launched_ns = trace_now_ns();
+            t.end_ns = pid <= 0 ? t.launched_ns : 0;
+            traces.push_back(std::move(t));
         }
 
+        if (here_fd != -1) close(here_fd);
+        for (int fd : subst_fds) close(fd);
         if (prev_read_fd != STDIN_FILENO) close(prev_read_fd);
         if (has_next_pipe) {
             prev_read_fd = pipe_fds[0];
@@ -107,18 +1569,47 @@ execute_pipeline (
         }
     }
 
+    /* Статус конвейера - статус последней команды, подстановки идут первыми */
+    pids.insert(pids.begin(), subst_pids.begin(), subst_pids.end());
+    codes.insert(codes.begin(), subst_pids.size(), 0);
+    traces.insert(traces.begin(), subst_traces.begin(), subst_traces.end());
+
     int pipeline_status = current_status;
     
     if (!is_background) {
-        for (pid_t p : pids) {
+        for (size_t i = 0; i < pids.size(); ++i) {
+            pid_t p = pids[i];
+            if (p <= 0) {
+                pipeline_status = codes[i];
+                if (is_tracing) trace_command(traces[i], NULL, codes[i]);
+                continue;
+            }
             int status;
-            waitpid(p, &status, 0);
-
-            if (WIFEXITED(status)) pipeline_status = WEXITSTATUS(status);
-            else if (WIFSIGNALED(status)) pipeline_status = 128 + WTERMSIG(status);
+            struct rusage ru;
+            wait4(p, &status, 0, &ru);
+            pipeline_status = status_to_code(status);
+            if (is_tracing) trace_command(traces[i], &ru, pipeline_status);
         }
+        if (is_tracing) trace_pipeline(traces, pipeline_ns, false);
     } 
     else {
+        std::string text;
+        for (const expr* e : exprs) {
+            if (!text.empty()) text += ' ';
+            if (e->type == EXPR_TYPE_PIPE) {
+                text += '|';
+                continue;
+            }
+            text += e->cmd->exe;
+            for (const auto& arg : e->cmd->args) text += ' ' + arg;
+        }
+        if (is_tracing) {
+            for (size_t i = 0; i < pids.size(); ++i) {
+                if (pids[i] <= 0) trace_command(traces[i], NULL, codes[i]);
+            }
+            trace_pipeline(traces, pipeline_ns, true);
+        }
+        jobs_add(pids, codes, std::move(text), std::move(traces));
         /* Для процесса в фоне статус 0 */
         pipeline_status = 0;
     }
@@ -131,8 +1622,8 @@ static int
 execute_command_line(const struct command_line *line, int current_status) {
     if (line->exprs.empty()) return current_status;
 
-    /* Ленивая очистка зомби процессов при каждой новой команде */
-    cleanup_zombies();
+    /* Завершения, пришедшие во время разбора этого же куска ввода */
+    jobs_poll();
 
     std::vector<const expr*> current_pipeline;
     int pipeline_status = current_status;
@@ -178,32 +1669,191 @@ execute_command_line(const struct command_line *line, int current_status) {
 }
 
 
+/* Исполнить строку и забрать ее себе */
+static void
+execute_line(struct command_line *line, int *last_status) {
+    if (jobs_defer(line, *last_status)) {
+        /* Фоновая строка сразу дает статус 0 */
+        *last_status = 0;
+        return;
+    }
+    *last_status = execute_command_line(line, *last_status);
+    delete line;
+    jobs_launch_pending();
+}
+
+/* Разобрать и исполнить все полные строки, что есть после этого куска */
+static void
+execute_chunk(struct parser *p, const char *data, size_t size, int *last_status) {
+    parser_feed(p, data, size);
+    struct command_line *line = NULL;
+    while (true) {
+        enum parser_error err = parser_pop_next(p, &line);
+        if (err == PARSER_ERR_NONE && line == NULL)
+            break;
+        if (err != PARSER_ERR_NONE) {
+            printf("Error: %d\n", (int)err);
+            continue;
+        }
+        execute_line(line, last_status);
+    }
+}
+
+/* Папка кэша разобранных скриптов, NULL - кэш выключен */
+static const char *script_cache_dir = NULL;
+static std::string script_cache_dir_buf;
+
+static void
+script_cache_init(bool is_enabled) {
+    if (!is_enabled) return;
+    const char *dir = getenv("SHELL_SCRIPT_CACHE_DIR");
+    if (dir != NULL) {
+        script_cache_dir_buf = dir;
+    }
+    else {
+        const char *home = getenv("HOME");
+        if (home == NULL) return;
+        script_cache_dir_buf = std::string(home) + "/.cache/mybash";
+    }
+    script_cache_dir = script_cache_dir_buf.c_str();
+}
+
+/* Исполнить строки из кэша, без разбора */
+static void
+execute_records(const char *pos, const char *end, int *last_status) {
+    while (true) {
+        struct command_line *line = NULL;
+        enum parser_error err;
+        int rc = script_cache_next(&pos, end, &line, &err);
+        if (rc < 0) break;
+        if (rc == 0) {
+            printf("Error: %d\n", (int)err);
+            continue;
+        }
+        execute_line(line, last_status);
+    }
+}
+
+/*
+ * Скрипт с кэшем: строки разбираются за один проход по всему тексту
+ * или берутся из кэша готовыми. Позиция stdin сразу ставится в конец,
+ * как будто весь скрипт прочитан.
+ */
+static void
+execute_cached_script(const char *data, const struct stat *st, off_t start, int *last_status) {
+    struct script_key key;
+    key.size = st->st_size;
+    key.offset = start;
+    key.mtime = st->st_mtim;
+    key.hash = script_hash(data + start, st->st_size - start);
+    lseek(STDIN_FILENO, st->st_size, SEEK_SET);
+    const char *begin, *end;
+    if (script_cache_map(script_cache_dir, &key, &begin, &end)) {
+        execute_records(begin, end, last_status);
+        script_cache_unmap(begin, end);
+        return;
+    }
+    std::string records;
+    script_cache_build(data + start, st->st_size - start, &records);
+    script_cache_save(script_cache_dir, &key, records);
+    execute_records(records.data(), records.data() + records.size(), last_status);
+}
+
+/*
+ * Скрипт в обычном файле читается через mmap кусками, без read(). Перед
+ * исполнением куска позиция stdin ставится за него, как если бы он был
+ * прочитан, - ее видят дети, читающие stdin.
+ */
+static bool
+execute_mapped_script(struct parser *p, int *last_status) {
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    off_t start = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    if (start < 0 || start >= st.st_size) return false;
+    size_t size = st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+    if (map == MAP_FAILED) return false;
+    madvise(map, size, MADV_SEQUENTIAL);
+    const char *data = (const char *)map;
+    if (script_cache_dir != NULL) {
+        execute_cached_script(data, &st, start, last_status);
+        munmap(map, size);
+        return true;
+    }
+    const size_t slice_size = 1 << 20;
+    for (size_t pos = start; pos < size; pos += slice_size) {
+        size_t len = std::min(slice_size, size - pos);
+        lseek(STDIN_FILENO, pos + len, SEEK_SET);
+        jobs_poll();
+        execute_chunk(p, data + pos, len, last_status);
+    }
+    munmap(map, size);
+    return true;
+}
+
 int
-main(void)
+main(int argc, char **argv)
 {
-    const size_t buf_size = 1024;
-    char buf[buf_size];
+    bool is_script_cache_enabled = true;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--no-script-cache") == 0) is_script_cache_enabled = false;
+    }
+    script_cache_init(is_script_cache_enabled);
+    trace_init();
+    /*
+     * В интерактивном режиме команда исполняется, как только введена.
+     * Из файла или pipe скрипт читается большими кусками.
+     */
+    bool is_interactive = isatty(STDIN_FILENO);
+    const size_t buf_size = is_interactive ? 1024 : 64 * 1024;
+    std::vector<char> buf(buf_size);
     int rc;
     int last_status = 0;
 
+    jobs_init();
+    pipe_init();
+    exec_env_init();
+    /* До разбора скриптов, пока память шелла мала */
+    zygote_init();
     struct parser *p = parser_new();
-    while ((rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
-        parser_feed(p, buf, rc);
-        struct command_line *line = NULL;
-        while (true) {
-            enum parser_error err = parser_pop_next(p, &line);
-            if (err == PARSER_ERR_NONE && line == NULL)
-                break;
-            if (err != PARSER_ERR_NONE) {
-                printf("Error: %d\n", (int)err);
-                continue;
-            }
-            
-            last_status = execute_command_line(line, last_status);
-            delete line;
+    if (!is_interactive && execute_mapped_script(p, &last_status)) {
+        jobs_flush_pending();
+        parser_delete(p);
+        path_cache_destroy();
+        exec_env_destroy();
+        zygote_destroy();
+        jobs_destroy();
+        trace_destroy();
+        std::string().swap(script_cache_dir_buf);
+        return last_status;
+    }
+    struct pollfd fds[2];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = jobs_signal_fd;
+    fds[1].events = POLLIN;
+    while (true) {
+        /* Фоновые процессы собираются, пока шелл ждет ввода */
+        if (poll(fds, jobs_signal_fd != -1 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            jobs_poll();
+            jobs_launch_pending();
         }
+        if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) == 0) continue;
+        if ((rc = read(STDIN_FILENO, buf.data(), buf_size)) <= 0) break;
+        execute_chunk(p, buf.data(), rc, &last_status);
     }
+    jobs_flush_pending();
     parser_delete(p);
+    path_cache_destroy();
+    exec_env_destroy();
+    zygote_destroy();
+    jobs_destroy();
+    trace_destroy();
+    std::string().swap(script_cache_dir_buf);
     
     return last_status;
 }
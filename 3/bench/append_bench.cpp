@@ -0,0 +1,114 @@
+/**
+ * Append throughput benchmark. A file is grown by records of a fixed
+ * size until it reaches the max size, either via a descriptor with
+ * UFS_APPEND, or via a plain one, or via ufs_pwrite() at the file size
+ * taken from ufs_fstat(). Each scenario is run several times, and the
+ * min, median and max throughput are printed in MB/s.
+ */
+#include "userfs.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum {
+	BENCH_RUN_COUNT = 7,
+	BENCH_FILE_SIZE = 64 * 1024 * 1024,
+};
+
+enum bench_mode {
+	BENCH_MODE_APPEND,
+	BENCH_MODE_WRITE,
+	BENCH_MODE_PWRITE,
+};
+
+static const char *bench_mode_names[] = {
+	"append", "write", "pwrite at fstat size",
+};
+
+static void
+bench_fail(const char *what)
+{
+	printf("Error: %s, code %d\n", what, ufs_errno());
+	exit(-1);
+}
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r ? 1 : 0;
+}
+
+/** Fill a new file, return the bytes per ns. */
+static double
+bench_append(enum bench_mode mode, const char *record, size_t record_size)
+{
+	int flags = UFS_CREATE | (mode == BENCH_MODE_APPEND ? UFS_APPEND : 0);
+	int fd = ufs_open("log", flags);
+	if (fd < 0)
+		bench_fail("open");
+	size_t count = BENCH_FILE_SIZE / record_size;
+	uint64_t start = bench_now_ns();
+	for (size_t i = 0; i < count; ++i) {
+		ssize_t rc;
+		if (mode == BENCH_MODE_PWRITE) {
+			struct ufs_stat st;
+			if (ufs_fstat(fd, &st) != 0)
+				bench_fail("fstat");
+			rc = ufs_pwrite(fd, record, record_size, st.size);
+		} else {
+			rc = ufs_write(fd, record, record_size);
+		}
+		if (rc != (ssize_t)record_size)
+			bench_fail("write");
+	}
+	uint64_t duration = bench_now_ns() - start;
+	if (ufs_close(fd) != 0 || ufs_delete("log") != 0)
+		bench_fail("close");
+	return (double)(count * record_size) / duration;
+}
+
+static void
+bench_scenario_run(size_t record_size)
+{
+	char *record = (char *)malloc(record_size);
+	memset(record, 'x', record_size);
+	printf("records of %zu bytes\n", record_size);
+	for (int mode = 0; mode <= BENCH_MODE_PWRITE; ++mode) {
+		double results[BENCH_RUN_COUNT];
+		for (int i = 0; i < BENCH_RUN_COUNT; ++i) {
+			/* Bytes per ns to MB per second. */
+			results[i] = bench_append((enum bench_mode)mode, record,
+				record_size) * 1000;
+		}
+		qsort(results, BENCH_RUN_COUNT, sizeof(results[0]), bench_cmp);
+		printf("  %s\n", bench_mode_names[mode]);
+		printf("    min: %.2lf MB/s\n", results[0]);
+		printf("    med: %.2lf MB/s\n", results[BENCH_RUN_COUNT / 2]);
+		printf("    max: %.2lf MB/s\n", results[BENCH_RUN_COUNT - 1]);
+	}
+	free(record);
+}
+
+int
+main(void)
+{
+	bench_scenario_run(16);
+	bench_scenario_run(100);
+	bench_scenario_run(4096);
+	bench_scenario_run(64 * 1024);
+	ufs_destroy();
+	return 0;
+}
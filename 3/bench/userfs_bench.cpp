@@ -0,0 +1,360 @@
+/**
+ * userfs micro benchmarks: sequential writes and reads by chunks of
+ * several sizes, random preads, one by one and batched in a
+ * submission ring, overwrites of disjoint regions of one file by
+ * several threads, open and close churn, deletion of the opened files
+ * and of the big ones, resize up and down. Each scenario is run several
+ * times, and the min, median and max rates are printed in ops/s, and
+ * in GB/s for the data transfers.
+ */
+#include "userfs.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <thread>
+#include <vector>
+
+enum {
+	BENCH_RUN_COUNT = 5,
+	BENCH_FILE_SIZE = 64 * 1024 * 1024,
+	BENCH_RANDOM_READ_COUNT = 200000,
+	BENCH_OPEN_COUNT = 100000,
+	BENCH_DELETE_COUNT = 20000,
+	BENCH_DELETE_BIG_COUNT = 10,
+	BENCH_RESIZE_COUNT = 20000,
+	BENCH_OVERWRITE_CHUNK = 64 * 1024,
+};
+
+static uint32_t bench_seed = 1;
+
+static uint32_t
+bench_rand(void)
+{
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return bench_seed >> 16;
+}
+
+static void
+bench_fail(const char *what)
+{
+	printf("Error: %s, code %d\n", what, ufs_errno());
+	exit(-1);
+}
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r ? 1 : 0;
+}
+
+/** Result of one run: how many operations and bytes, how long. */
+struct bench_result {
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t duration;
+};
+
+typedef struct bench_result (*bench_f)(size_t arg);
+
+static char *bench_buf;
+
+static int
+bench_open_filled(const char *name, size_t size)
+{
+	int fd = ufs_open(name, UFS_CREATE);
+	if (fd < 0)
+		bench_fail("open");
+	for (size_t pos = 0; pos < size; pos += 1024 * 1024) {
+		if (ufs_write(fd, bench_buf, 1024 * 1024) != 1024 * 1024)
+			bench_fail("write");
+	}
+	return fd;
+}
+
+static void
+bench_close_deleted(int fd, const char *name)
+{
+	if (ufs_close(fd) != 0 || ufs_delete(name) != 0)
+		bench_fail("close");
+}
+
+static struct bench_result
+bench_seq_write(size_t chunk)
+{
+	int fd = ufs_open("file", UFS_CREATE);
+	if (fd < 0)
+		bench_fail("open");
+	struct bench_result res = {BENCH_FILE_SIZE / chunk, BENCH_FILE_SIZE, 0};
+	uint64_t start = bench_now_ns();
+	for (uint64_t i = 0; i < res.ops; ++i) {
+		if (ufs_write(fd, bench_buf, chunk) != (ssize_t)chunk)
+			bench_fail("write");
+	}
+	res.duration = bench_now_ns() - start;
+	bench_close_deleted(fd, "file");
+	return res;
+}
+
+static struct bench_result
+bench_seq_read(size_t chunk)
+{
+	int fd = bench_open_filled("file", BENCH_FILE_SIZE);
+	int rfd = ufs_open("file", 0);
+	struct bench_result res = {BENCH_FILE_SIZE / chunk, BENCH_FILE_SIZE, 0};
+	uint64_t start = bench_now_ns();
+	for (uint64_t i = 0; i < res.ops; ++i) {
+		if (ufs_read(rfd, bench_buf, chunk) != (ssize_t)chunk)
+			bench_fail("read");
+	}
+	res.duration = bench_now_ns() - start;
+	ufs_close(rfd);
+	bench_close_deleted(fd, "file");
+	return res;
+}
+
+static struct bench_result
+bench_random_pread(size_t chunk)
+{
+	int fd = bench_open_filled("file", BENCH_FILE_SIZE);
+	struct bench_result res = {BENCH_RANDOM_READ_COUNT,
+		BENCH_RANDOM_READ_COUNT * chunk, 0};
+	size_t *offsets = (size_t *)malloc(res.ops * sizeof(*offsets));
+	for (uint64_t i = 0; i < res.ops; ++i) {
+		offsets[i] = (((size_t)bench_rand() << 16) ^ bench_rand()) %
+			(BENCH_FILE_SIZE - chunk);
+	}
+	uint64_t start = bench_now_ns();
+	for (uint64_t i = 0; i < res.ops; ++i) {
+		if (ufs_pread(fd, bench_buf, chunk, offsets[i]) != (ssize_t)chunk)
+			bench_fail("pread");
+	}
+	res.duration = bench_now_ns() - start;
+	free(offsets);
+	bench_close_deleted(fd, "file");
+	return res;
+}
+
+/** Random preads of 64 bytes, submitted by batches of the given size. */
+static struct bench_result
+bench_ring_pread(size_t batch)
+{
+	const size_t chunk = 64;
+	int fd = bench_open_filled("file", BENCH_FILE_SIZE);
+	struct ufs_ring *ring = ufs_ring_new(batch);
+	struct ufs_cqe *cqes = (struct ufs_cqe *)malloc(batch * sizeof(*cqes));
+	struct bench_result res = {BENCH_RANDOM_READ_COUNT,
+		BENCH_RANDOM_READ_COUNT * chunk, 0};
+	size_t *offsets = (size_t *)malloc(res.ops * sizeof(*offsets));
+	for (uint64_t i = 0; i < res.ops; ++i) {
+		offsets[i] = (((size_t)bench_rand() << 16) ^ bench_rand()) %
+			(BENCH_FILE_SIZE - chunk);
+	}
+	uint64_t start = bench_now_ns();
+	for (uint64_t i = 0; i < res.ops; i += batch) {
+		uint64_t end = i + batch < res.ops ? i + batch : res.ops;
+		for (uint64_t j = i; j < end; ++j) {
+			struct ufs_sqe *sqe = ufs_ring_get_sqe(ring);
+			*sqe = {UFS_OP_PREAD, fd, bench_buf + (j - i) * chunk,
+				chunk, offsets[j], j};
+		}
+		int count = ufs_ring_submit(ring);
+		if (ufs_ring_reap(ring, cqes, count) != count)
+			bench_fail("reap");
+		for (int j = 0; j < count; ++j) {
+			if (cqes[j].res != (ssize_t)chunk)
+				bench_fail("ring pread");
+		}
+	}
+	res.duration = bench_now_ns() - start;
+	free(offsets);
+	free(cqes);
+	ufs_ring_delete(ring);
+	bench_close_deleted(fd, "file");
+	return res;
+}
+
+/** Each thread overwrites its own region of the file by the chunks. */
+static struct bench_result
+bench_parallel_pwrite(size_t thread_count)
+{
+	int fd = bench_open_filled("file", BENCH_FILE_SIZE);
+	size_t region = BENCH_FILE_SIZE / thread_count;
+	struct bench_result res = {BENCH_FILE_SIZE / BENCH_OVERWRITE_CHUNK,
+		BENCH_FILE_SIZE, 0};
+	std::vector<std::thread> threads;
+	uint64_t start = bench_now_ns();
+	for (size_t t = 0; t < thread_count; ++t) {
+		threads.emplace_back([t, region]() {
+			int wfd = ufs_open("file", 0);
+			if (wfd < 0)
+				bench_fail("open");
+			for (size_t pos = 0; pos + BENCH_OVERWRITE_CHUNK <= region;
+			     pos += BENCH_OVERWRITE_CHUNK) {
+				if (ufs_pwrite(wfd, bench_buf, BENCH_OVERWRITE_CHUNK,
+					       t * region + pos) != BENCH_OVERWRITE_CHUNK)
+					bench_fail("pwrite");
+			}
+			if (ufs_close(wfd) != 0)
+				bench_fail("close");
+		});
+	}
+	for (std::thread &t : threads)
+		t.join();
+	res.duration = bench_now_ns() - start;
+	bench_close_deleted(fd, "file");
+	return res;
+}
+
+static struct bench_result
+bench_open_close(size_t file_count)
+{
+	char name[32];
+	for (size_t i = 0; i < file_count; ++i) {
+		snprintf(name, sizeof(name), "file%zu", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0 || ufs_close(fd) != 0)
+			bench_fail("create");
+	}
+	struct bench_result res = {BENCH_OPEN_COUNT, 0, 0};
+	uint64_t start = bench_now_ns();
+	for (uint64_t i = 0; i < res.ops; ++i) {
+		snprintf(name, sizeof(name), "file%zu", (size_t)i % file_count);
+		int fd = ufs_open(name, 0);
+		if (fd < 0 || ufs_close(fd) != 0)
+			bench_fail("open");
+	}
+	res.duration = bench_now_ns() - start;
+	for (size_t i = 0; i < file_count; ++i) {
+		snprintf(name, sizeof(name), "file%zu", i);
+		ufs_delete(name);
+	}
+	return res;
+}
+
+static struct bench_result
+bench_delete_opened(size_t file_size)
+{
+	char name[32];
+	int *fds = (int *)malloc(BENCH_DELETE_COUNT * sizeof(*fds));
+	for (int i = 0; i < BENCH_DELETE_COUNT; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		fds[i] = ufs_open(name, UFS_CREATE);
+		if (fds[i] < 0 || ufs_write(fds[i], bench_buf, file_size) !=
+		    (ssize_t)file_size)
+			bench_fail("create");
+	}
+	struct bench_result res = {BENCH_DELETE_COUNT, 0, 0};
+	uint64_t start = bench_now_ns();
+	for (int i = 0; i < BENCH_DELETE_COUNT; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		if (ufs_delete(name) != 0)
+			bench_fail("delete");
+	}
+	/* The memory is freed on the last close, so it is measured too. */
+	for (int i = 0; i < BENCH_DELETE_COUNT; ++i) {
+		if (ufs_close(fds[i]) != 0)
+			bench_fail("close");
+	}
+	res.duration = bench_now_ns() - start;
+	free(fds);
+	return res;
+}
+
+/** Only the delete is measured, the latency the caller sees. */
+static struct bench_result
+bench_delete_big(size_t file_size)
+{
+	struct bench_result res = {BENCH_DELETE_BIG_COUNT, 0, 0};
+	for (int i = 0; i < BENCH_DELETE_BIG_COUNT; ++i) {
+		int fd = bench_open_filled("file", file_size);
+		uint64_t start = bench_now_ns();
+		bench_close_deleted(fd, "file");
+		res.duration += bench_now_ns() - start;
+	}
+	return res;
+}
+
+static struct bench_result
+bench_resize(size_t max_size)
+{
+	int fd = ufs_open("file", UFS_CREATE);
+	if (fd < 0)
+		bench_fail("open");
+	struct bench_result res = {BENCH_RESIZE_COUNT, 0, 0};
+	uint64_t start = bench_now_ns();
+	for (uint64_t i = 0; i < res.ops; ++i) {
+		size_t size = i % 2 == 0 ? max_size : bench_rand() % max_size;
+		if (ufs_resize(fd, size) != 0)
+			bench_fail("resize");
+		/* Make the extents allocated, like a real file would have. */
+		if (ufs_pwrite(fd, "x", 1, size / 2) != 1)
+			bench_fail("pwrite");
+	}
+	res.duration = bench_now_ns() - start;
+	bench_close_deleted(fd, "file");
+	return res;
+}
+
+static void
+bench_run(const char *name, bench_f f, size_t arg)
+{
+	double ops[BENCH_RUN_COUNT];
+	double bytes[BENCH_RUN_COUNT];
+	for (int i = 0; i < BENCH_RUN_COUNT; ++i) {
+		struct bench_result res = f(arg);
+		/* Per ns to per second. */
+		ops[i] = (double)res.ops * 1000000000 / res.duration;
+		bytes[i] = (double)res.bytes / res.duration;
+	}
+	qsort(ops, BENCH_RUN_COUNT, sizeof(ops[0]), bench_cmp);
+	qsort(bytes, BENCH_RUN_COUNT, sizeof(bytes[0]), bench_cmp);
+	printf("%s, %zu\n", name, arg);
+	printf("    ops/s: min %.0lf, med %.0lf, max %.0lf\n", ops[0],
+		ops[BENCH_RUN_COUNT / 2], ops[BENCH_RUN_COUNT - 1]);
+	if (bytes[BENCH_RUN_COUNT - 1] == 0)
+		return;
+	printf("    GB/s: min %.2lf, med %.2lf, max %.2lf\n", bytes[0],
+		bytes[BENCH_RUN_COUNT / 2], bytes[BENCH_RUN_COUNT - 1]);
+}
+
+int
+main(void)
+{
+	bench_buf = (char *)malloc(1024 * 1024);
+	memset(bench_buf, 'x', 1024 * 1024);
+	static const size_t chunks[] = {64, 4096, 64 * 1024, 1024 * 1024};
+	for (size_t chunk : chunks)
+		bench_run("sequential write", bench_seq_write, chunk);
+	for (size_t chunk : chunks)
+		bench_run("sequential read", bench_seq_read, chunk);
+	bench_run("random pread", bench_random_pread, 64);
+	bench_run("random pread", bench_random_pread, 4096);
+	bench_run("random pread of 64 in a ring, batch", bench_ring_pread, 1);
+	bench_run("random pread of 64 in a ring, batch", bench_ring_pread, 64);
+	bench_run("parallel overwrite of 64 KB, threads", bench_parallel_pwrite, 1);
+	bench_run("parallel overwrite of 64 KB, threads", bench_parallel_pwrite, 4);
+	bench_run("open and close, files", bench_open_close, 1);
+	bench_run("open and close, files", bench_open_close, 10000);
+	bench_run("delete opened files, bytes", bench_delete_opened, 100);
+	bench_run("delete opened files, bytes", bench_delete_opened, 64 * 1024);
+	bench_run("delete big file, bytes", bench_delete_big, 100 * 1024 * 1024);
+	bench_run("resize up and down, max size", bench_resize, 64 * 1024);
+	bench_run("resize up and down, max size", bench_resize, 16 * 1024 * 1024);
+	free(bench_buf);
+	ufs_destroy();
+	return 0;
+}
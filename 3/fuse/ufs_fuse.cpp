@@ -0,0 +1,662 @@
+/**
+ * FUSE frontend of userfs: mounts it, so the usual tools can use it.
+ * There is no libfuse, the daemon speaks the kernel protocol over
+ * /dev/fuse itself, and mounts with mount(2), so it must be run as
+ * root. Several workers read the requests from the device at once,
+ * userfs is thread-safe. The writes come in up to 1 MB. The reads are
+ * answered with writev() of the ufs_map() views, right from the file
+ * memory, without copying through a buffer.
+ *
+ * Usage: ufs_fuse <mountpoint> [-t thread_count] [-m mem_limit_mb]
+ *
+ * Works until SIGINT or SIGTERM, or until unmounted. The throughput
+ * can be checked with fio, for example:
+ *     fio --name=seq --directory=<mountpoint> --rw=write --bs=1M --size=1G
+ */
+#include "userfs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fuse.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+enum {
+	FUSE_MAX_IO = 1024 * 1024,
+	/** The biggest write, and its headers. */
+	FUSE_BUF_SIZE = FUSE_MAX_IO + 4096,
+	/**
+	 * A range of a file is a few extents: they grow twice each, from
+	 * 512 bytes to 8 MB.
+	 */
+	FUSE_MAP_IOV_MAX = 64,
+	FUSE_ROOT_ID_ = 1,
+	FUSE_THREAD_COUNT_DEFAULT = 4,
+};
+
+/**
+ * A file or directory the kernel knows. The node address is the FUSE
+ * node id. It lives until the kernel forgets all the lookups.
+ */
+struct fuse_node {
+	/** Empty for the root. */
+	std::string path;
+	bool is_dir;
+	uint64_t lookup_count;
+	uint64_t generation;
+	/** Userfs descriptor of a file, shared by all its FUSE handles. */
+	int fd;
+	/**
+	 * The reads take it shared, as they send the file memory right
+	 * from the map views, the writes and resizes take it exclusively.
+	 */
+	std::shared_mutex lock;
+};
+
+static int fuse_dev = -1;
+static const char *fuse_mountpoint;
+static fuse_node fuse_root;
+
+/** The nodes by the path, to give one node to all the lookups. */
+static std::unordered_map<std::string, fuse_node *> fuse_nodes;
+static std::mutex fuse_nodes_mutex;
+static uint64_t fuse_generation = 0;
+
+static fuse_node *
+fuse_node_get(uint64_t nodeid)
+{
+	return nodeid == (uint64_t)FUSE_ROOT_ID_ ? &fuse_root : (fuse_node *)nodeid;
+}
+
+static uint64_t
+fuse_node_id(fuse_node *node)
+{
+	return node == &fuse_root ? (uint64_t)FUSE_ROOT_ID_ : (uint64_t)node;
+}
+
+static std::string
+fuse_child_path(const fuse_node *parent, const char *name)
+{
+	return parent->path.empty() ? std::string(name) : parent->path + "/" + name;
+}
+
+static int
+fuse_errno(void)
+{
+	switch (ufs_errno()) {
+	case UFS_ERR_NO_FILE:
+		return ENOENT;
+	case UFS_ERR_NO_MEM:
+		return ENOSPC;
+	case UFS_ERR_NO_PERMISSION:
+		return EACCES;
+	case UFS_ERR_INVALID_ARG:
+		return EINVAL;
+	case UFS_ERR_NOT_IMPLEMENTED:
+		return ENOSYS;
+	default:
+		return EIO;
+	}
+}
+
+static void
+fuse_reply_iov(uint64_t unique, int error, struct iovec *iov, int iovcnt)
+{
+	struct fuse_out_header out;
+	out.len = sizeof(out);
+	for (int i = 1; i < iovcnt; ++i)
+		out.len += iov[i].iov_len;
+	out.error = -error;
+	out.unique = unique;
+	iov[0].iov_base = &out;
+	iov[0].iov_len = sizeof(out);
+	/* ENOENT is a request interrupted meanwhile. */
+	if (writev(fuse_dev, iov, iovcnt) < 0 && errno != ENOENT)
+		perror("reply");
+}
+
+static void
+fuse_reply(uint64_t unique, int error, const void *data, size_t size)
+{
+	struct iovec iov[2];
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = size;
+	fuse_reply_iov(unique, error, iov, error == 0 && size > 0 ? 2 : 1);
+}
+
+static int
+fuse_attr_fill(fuse_node *node, struct fuse_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->ino = fuse_node_id(node);
+	attr->nlink = 1;
+	attr->uid = getuid();
+	attr->gid = getgid();
+	attr->blksize = 4096;
+	if (node->is_dir) {
+		attr->mode = S_IFDIR | 0755;
+		attr->nlink = 2;
+		return 0;
+	}
+	struct ufs_stat st;
+	if (ufs_fstat(node->fd, &st) != 0)
+		return fuse_errno();
+	attr->mode = S_IFREG | 0644;
+	attr->size = st.size;
+	attr->blocks = (st.allocated + 511) / 512;
+	return 0;
+}
+
+/**
+ * Node of the path with one more lookup, or nullptr with the error
+ * code. A new node opens the file.
+ */
+static fuse_node *
+fuse_node_lookup(const std::string &path, int *error)
+{
+	std::lock_guard<std::mutex> guard(fuse_nodes_mutex);
+	auto it = fuse_nodes.find(path);
+	if (it != fuse_nodes.end()) {
+		++it->second->lookup_count;
+		return it->second;
+	}
+	size_t cursor = 0;
+	struct ufs_dirent ent;
+	bool is_dir = ufs_readdir(path.c_str(), &cursor, &ent) >= 0;
+	int fd = -1;
+	if (!is_dir) {
+		fd = ufs_open(path.c_str(), 0);
+		if (fd < 0) {
+			*error = fuse_errno();
+			return nullptr;
+		}
+	}
+	fuse_node *node = new fuse_node();
+	node->path = path;
+	node->is_dir = is_dir;
+	node->lookup_count = 1;
+	node->generation = ++fuse_generation;
+	node->fd = fd;
+	fuse_nodes.emplace(path, node);
+	return node;
+}
+
+static void
+fuse_node_forget(fuse_node *node, uint64_t count)
+{
+	if (node == &fuse_root)
+		return;
+	{
+		std::lock_guard<std::mutex> guard(fuse_nodes_mutex);
+		node->lookup_count -= std::min(count, node->lookup_count);
+		if (node->lookup_count > 0)
+			return;
+		auto it = fuse_nodes.find(node->path);
+		if (it != fuse_nodes.end() && it->second == node)
+			fuse_nodes.erase(it);
+	}
+	if (node->fd >= 0)
+		ufs_close(node->fd);
+	delete node;
+}
+
+/** The path is gone from userfs, the node lives while the kernel has it. */
+static void
+fuse_node_unlink(const std::string &path)
+{
+	std::lock_guard<std::mutex> guard(fuse_nodes_mutex);
+	fuse_nodes.erase(path);
+}
+
+static void
+fuse_reply_entry(uint64_t unique, fuse_node *node, const struct fuse_open_out *open)
+{
+	struct fuse_entry_out entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.nodeid = fuse_node_id(node);
+	entry.generation = node->generation;
+	entry.entry_valid = 1;
+	entry.attr_valid = 1;
+	int error = fuse_attr_fill(node, &entry.attr);
+	if (error != 0) {
+		fuse_reply(unique, error, nullptr, 0);
+		return;
+	}
+	if (open == nullptr) {
+		fuse_reply(unique, 0, &entry, sizeof(entry));
+		return;
+	}
+	struct iovec iov[3];
+	iov[1].iov_base = &entry;
+	iov[1].iov_len = sizeof(entry);
+	iov[2].iov_base = (void *)open;
+	iov[2].iov_len = sizeof(*open);
+	fuse_reply_iov(unique, 0, iov, 3);
+}
+
+static void
+fuse_do_init(const struct fuse_in_header *h, const struct fuse_init_in *in)
+{
+	struct fuse_init_out out;
+	memset(&out, 0, sizeof(out));
+	out.major = FUSE_KERNEL_VERSION;
+	out.minor = std::min(in->minor, (uint32_t)FUSE_KERNEL_MINOR_VERSION);
+	if (in->major != FUSE_KERNEL_VERSION) {
+		/* The kernel retries with our major. */
+		fuse_reply(h->unique, 0, &out, FUSE_COMPAT_INIT_OUT_SIZE);
+		return;
+	}
+	out.max_readahead = in->max_readahead;
+	out.flags = in->flags & (FUSE_ASYNC_READ | FUSE_BIG_WRITES |
+				 FUSE_ATOMIC_O_TRUNC | FUSE_MAX_PAGES);
+	out.max_background = 64;
+	out.congestion_threshold = 48;
+	out.max_write = FUSE_MAX_IO;
+	out.time_gran = 1;
+	out.max_pages = FUSE_MAX_IO / 4096;
+	fuse_reply(h->unique, 0, &out, sizeof(out));
+}
+
+static void
+fuse_do_setattr(const struct fuse_in_header *h, fuse_node *node,
+		const struct fuse_setattr_in *in)
+{
+	if ((in->valid & FATTR_SIZE) != 0) {
+		if (node->is_dir) {
+			fuse_reply(h->unique, EISDIR, nullptr, 0);
+			return;
+		}
+		std::unique_lock<std::shared_mutex> guard(node->lock);
+		if (ufs_resize(node->fd, in->size) != 0) {
+			fuse_reply(h->unique, fuse_errno(), nullptr, 0);
+			return;
+		}
+	}
+	/* The modes, owners and times are fixed. */
+	struct fuse_attr_out out;
+	memset(&out, 0, sizeof(out));
+	out.attr_valid = 1;
+	int error = fuse_attr_fill(node, &out.attr);
+	fuse_reply(h->unique, error, &out, sizeof(out));
+}
+
+static void
+fuse_do_create(const struct fuse_in_header *h, fuse_node *parent,
+	       const struct fuse_create_in *in, const char *name)
+{
+	std::string path = fuse_child_path(parent, name);
+	int fd = ufs_open(path.c_str(), 0);
+	if (fd >= 0) {
+		ufs_close(fd);
+		if ((in->flags & O_EXCL) != 0) {
+			fuse_reply(h->unique, EEXIST, nullptr, 0);
+			return;
+		}
+	} else {
+		fd = ufs_open(path.c_str(), UFS_CREATE);
+		if (fd < 0) {
+			fuse_reply(h->unique, fuse_errno(), nullptr, 0);
+			return;
+		}
+		ufs_close(fd);
+	}
+	int error = 0;
+	fuse_node *node = fuse_node_lookup(path, &error);
+	if (node == nullptr) {
+		fuse_reply(h->unique, error, nullptr, 0);
+		return;
+	}
+	if ((in->flags & O_TRUNC) != 0) {
+		std::unique_lock<std::shared_mutex> guard(node->lock);
+		ufs_resize(node->fd, 0);
+	}
+	struct fuse_open_out open;
+	memset(&open, 0, sizeof(open));
+	fuse_reply_entry(h->unique, node, &open);
+}
+
+static void
+fuse_do_open(const struct fuse_in_header *h, fuse_node *node,
+	     const struct fuse_open_in *in)
+{
+	if ((in->flags & O_TRUNC) != 0 && !node->is_dir) {
+		std::unique_lock<std::shared_mutex> guard(node->lock);
+		if (ufs_resize(node->fd, 0) != 0) {
+			fuse_reply(h->unique, fuse_errno(), nullptr, 0);
+			return;
+		}
+	}
+	/* The node descriptor serves all the handles. */
+	struct fuse_open_out out;
+	memset(&out, 0, sizeof(out));
+	fuse_reply(h->unique, 0, &out, sizeof(out));
+}
+
+static void
+fuse_do_read(const struct fuse_in_header *h, fuse_node *node,
+	     const struct fuse_read_in *in)
+{
+	struct iovec iov[FUSE_MAP_IOV_MAX + 1];
+	int iovcnt = FUSE_MAP_IOV_MAX;
+	std::shared_lock<std::shared_mutex> guard(node->lock);
+	ssize_t rc = ufs_map(node->fd, in->offset, std::min(in->size, (uint32_t)FUSE_MAX_IO),
+			     iov + 1, &iovcnt);
+	if (rc < 0) {
+		fuse_reply(h->unique, fuse_errno(), nullptr, 0);
+		return;
+	}
+	/* The views are valid under the node lock. */
+	fuse_reply_iov(h->unique, 0, iov, iovcnt + 1);
+}
+
+static void
+fuse_do_write(const struct fuse_in_header *h, fuse_node *node,
+	      const struct fuse_write_in *in, const char *data)
+{
+	std::unique_lock<std::shared_mutex> guard(node->lock);
+	ssize_t rc = ufs_pwrite(node->fd, data, in->size, in->offset);
+	guard.unlock();
+	if (rc < 0) {
+		fuse_reply(h->unique, fuse_errno(), nullptr, 0);
+		return;
+	}
+	struct fuse_write_out out;
+	memset(&out, 0, sizeof(out));
+	out.size = rc;
+	fuse_reply(h->unique, 0, &out, sizeof(out));
+}
+
+static void
+fuse_do_readdir(const struct fuse_in_header *h, fuse_node *node,
+		const struct fuse_read_in *in)
+{
+	std::vector<char> buf(std::min(in->size, (uint32_t)FUSE_MAX_IO));
+	size_t used = 0;
+	size_t cursor = in->offset;
+	while (true) {
+		struct ufs_dirent ent;
+		size_t next = cursor;
+		int rc = ufs_readdir(node->path.c_str(), &next, &ent);
+		if (rc < 0) {
+			fuse_reply(h->unique, fuse_errno(), nullptr, 0);
+			return;
+		}
+		if (rc == 0)
+			break;
+		size_t namelen = strlen(ent.name);
+		size_t size = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+		if (used + size > buf.size())
+			break;
+		struct fuse_dirent *d = (struct fuse_dirent *)&buf[used];
+		memset(d, 0, size);
+		/* Not a node id, the kernel looks the entries up anyway. */
+		d->ino = std::hash<std::string>()(fuse_child_path(node, ent.name)) | 2;
+		d->off = next;
+		d->namelen = namelen;
+		d->type = ent.is_dir ? DT_DIR : DT_REG;
+		memcpy(d->name, ent.name, namelen);
+		used += size;
+		cursor = next;
+	}
+	fuse_reply(h->unique, 0, buf.data(), used);
+}
+
+static void
+fuse_do_rmdir(const struct fuse_in_header *h, fuse_node *parent, const char *name)
+{
+	std::string path = fuse_child_path(parent, name);
+	size_t cursor = 0;
+	struct ufs_dirent ent;
+	int rc = ufs_readdir(path.c_str(), &cursor, &ent);
+	/* ufs_rmdir() deletes the subtree, rmdir(2) only empty ones. */
+	if (rc != 0) {
+		fuse_reply(h->unique, rc > 0 ? ENOTEMPTY : ENOTDIR, nullptr, 0);
+		return;
+	}
+	if (ufs_rmdir(path.c_str()) != 0) {
+		fuse_reply(h->unique, fuse_errno(), nullptr, 0);
+		return;
+	}
+	fuse_node_unlink(path);
+	fuse_reply(h->unique, 0, nullptr, 0);
+}
+
+static void
+fuse_do_statfs(const struct fuse_in_header *h)
+{
+	struct ufs_memstats ms;
+	ufs_memstats(&ms);
+	struct fuse_statfs_out out;
+	memset(&out, 0, sizeof(out));
+	out.st.bsize = 4096;
+	out.st.frsize = 4096;
+	out.st.namelen = UFS_NAME_MAX;
+	/* Without a limit, the RAM is the limit. */
+	size_t limit = ms.limit != 0 ? ms.limit :
+		(size_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	size_t used = std::min(limit, ms.data + ms.meta);
+	out.st.blocks = limit / 4096;
+	out.st.bfree = (limit - used) / 4096;
+	out.st.bavail = out.st.bfree;
+	fuse_reply(h->unique, 0, &out, sizeof(out));
+}
+
+static void
+fuse_handle(char *buf, size_t size)
+{
+	const struct fuse_in_header *h = (const struct fuse_in_header *)buf;
+	if (size < sizeof(*h) || h->len != size)
+		return;
+	char *arg = buf + sizeof(*h);
+	fuse_node *node = fuse_node_get(h->nodeid);
+	int error = 0;
+	switch (h->opcode) {
+	case FUSE_INIT:
+		fuse_do_init(h, (const struct fuse_init_in *)arg);
+		return;
+	case FUSE_DESTROY:
+		fuse_reply(h->unique, 0, nullptr, 0);
+		return;
+	case FUSE_LOOKUP: {
+		fuse_node *child = fuse_node_lookup(fuse_child_path(node, arg), &error);
+		if (child == nullptr)
+			fuse_reply(h->unique, error, nullptr, 0);
+		else
+			fuse_reply_entry(h->unique, child, nullptr);
+		return;
+	}
+	case FUSE_FORGET:
+		fuse_node_forget(node, ((const struct fuse_forget_in *)arg)->nlookup);
+		return;
+	case FUSE_BATCH_FORGET: {
+		const struct fuse_batch_forget_in *in = (const struct fuse_batch_forget_in *)arg;
+		const struct fuse_forget_one *one = (const struct fuse_forget_one *)(in + 1);
+		for (uint32_t i = 0; i < in->count; ++i)
+			fuse_node_forget(fuse_node_get(one[i].nodeid), one[i].nlookup);
+		return;
+	}
+	case FUSE_GETATTR: {
+		struct fuse_attr_out out;
+		memset(&out, 0, sizeof(out));
+		out.attr_valid = 1;
+		error = fuse_attr_fill(node, &out.attr);
+		fuse_reply(h->unique, error, &out, sizeof(out));
+		return;
+	}
+	case FUSE_SETATTR:
+		fuse_do_setattr(h, node, (const struct fuse_setattr_in *)arg);
+		return;
+	case FUSE_CREATE:
+		fuse_do_create(h, node, (const struct fuse_create_in *)arg,
+			       arg + sizeof(struct fuse_create_in));
+		return;
+	case FUSE_OPEN:
+		fuse_do_open(h, node, (const struct fuse_open_in *)arg);
+		return;
+	case FUSE_OPENDIR: {
+		struct fuse_open_out out;
+		memset(&out, 0, sizeof(out));
+		fuse_reply(h->unique, 0, &out, sizeof(out));
+		return;
+	}
+	case FUSE_READ:
+		fuse_do_read(h, node, (const struct fuse_read_in *)arg);
+		return;
+	case FUSE_WRITE:
+		fuse_do_write(h, node, (const struct fuse_write_in *)arg,
+			      arg + sizeof(struct fuse_write_in));
+		return;
+	case FUSE_READDIR:
+		fuse_do_readdir(h, node, (const struct fuse_read_in *)arg);
+		return;
+	case FUSE_MKDIR: {
+		std::string path = fuse_child_path(node, arg + sizeof(struct fuse_mkdir_in));
+		if (ufs_mkdir(path.c_str()) != 0) {
+			fuse_reply(h->unique, ufs_errno() == UFS_ERR_INVALID_ARG ?
+				   EEXIST : fuse_errno(), nullptr, 0);
+			return;
+		}
+		fuse_node *child = fuse_node_lookup(path, &error);
+		if (child == nullptr)
+			fuse_reply(h->unique, error, nullptr, 0);
+		else
+			fuse_reply_entry(h->unique, child, nullptr);
+		return;
+	}
+	case FUSE_UNLINK: {
+		std::string path = fuse_child_path(node, arg);
+		if (ufs_delete(path.c_str()) != 0) {
+			fuse_reply(h->unique, fuse_errno(), nullptr, 0);
+			return;
+		}
+		fuse_node_unlink(path);
+		fuse_reply(h->unique, 0, nullptr, 0);
+		return;
+	}
+	case FUSE_RMDIR:
+		fuse_do_rmdir(h, node, arg);
+		return;
+	case FUSE_STATFS:
+		fuse_do_statfs(h);
+		return;
+	case FUSE_RELEASE:
+	case FUSE_RELEASEDIR:
+	case FUSE_FLUSH:
+	case FUSE_FSYNC:
+	case FUSE_FSYNCDIR:
+		fuse_reply(h->unique, 0, nullptr, 0);
+		return;
+	case FUSE_INTERRUPT:
+		/* The requests are short, they are finished anyway. */
+		return;
+	default:
+		/* Rename, links, xattrs, locks. */
+		fuse_reply(h->unique, ENOSYS, nullptr, 0);
+		return;
+	}
+}
+
+static void
+fuse_worker_f(void)
+{
+	char *buf = new char[FUSE_BUF_SIZE];
+	while (true) {
+		ssize_t rc = read(fuse_dev, buf, FUSE_BUF_SIZE);
+		if (rc < 0) {
+			/* ENOENT is a request interrupted before read. */
+			if (errno == EINTR || errno == EAGAIN || errno == ENOENT)
+				continue;
+			/* ENODEV is the unmount. */
+			if (errno != ENODEV)
+				perror("read");
+			break;
+		}
+		fuse_handle(buf, rc);
+	}
+	delete[] buf;
+}
+
+static void
+fuse_stop_f(int signo)
+{
+	(void)signo;
+	/* The workers get ENODEV. */
+	umount2(fuse_mountpoint, MNT_DETACH);
+}
+
+int
+main(int argc, char **argv)
+{
+	int thread_count = FUSE_THREAD_COUNT_DEFAULT;
+	size_t mem_limit_mb = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:m:")) != -1) {
+		switch (opt) {
+		case 't':
+			thread_count = std::max(1, atoi(optarg));
+			break;
+		case 'm':
+			mem_limit_mb = atol(optarg);
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if (optind != argc - 1) {
+		printf("Usage: ufs_fuse <mountpoint> [-t thread_count] [-m mem_limit_mb]\n");
+		return -1;
+	}
+	fuse_mountpoint = argv[optind];
+	ufs_set_mem_limit(mem_limit_mb * 1024 * 1024);
+	fuse_root.is_dir = true;
+	fuse_root.fd = -1;
+
+	fuse_dev = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (fuse_dev < 0) {
+		perror("open /dev/fuse");
+		return -1;
+	}
+	char opts[256];
+	snprintf(opts, sizeof(opts), "fd=%d,rootmode=40000,user_id=%u,group_id=%u,"
+		 "default_permissions,allow_other,max_read=%d", fuse_dev,
+		 (unsigned)getuid(), (unsigned)getgid(), (int)FUSE_MAX_IO);
+	if (mount("ufs", fuse_mountpoint, "fuse.ufs", MS_NOSUID | MS_NODEV, opts) != 0) {
+		perror("mount");
+		close(fuse_dev);
+		return -1;
+	}
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = fuse_stop_f;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	std::vector<std::thread> workers;
+	for (int i = 0; i < thread_count; ++i)
+		workers.emplace_back(fuse_worker_f);
+	for (std::thread &t : workers)
+		t.join();
+
+	close(fuse_dev);
+	for (auto &[path, node] : fuse_nodes)
+		delete node;
+	ufs_destroy();
+	return 0;
+}
@@ -1,8 +1,14 @@
 #include "userfs.h"
 #include "unit.h"
 #include <assert.h>
+#include <dirent.h>
 #include <limits.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
 
 static void
 test_open(void)
@@ -469,6 +475,1070 @@ test_resize(void)
 #endif
 }
 
+static void
+test_block_size(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_set_block_size(1000) == -1, "not a power of 2");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_set_block_size(256) == -1, "too small");
+	unit_check(ufs_set_block_size(4 * 1024 * 1024) == -1, "too big");
+
+	unit_fail_if(ufs_set_block_size(64 * 1024) != 0);
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	/* The default block size doesn't affect the existing files. */
+	unit_fail_if(ufs_set_block_size(512) != 0);
+	int buf_size = 200 * 1024 + 123;
+	char *buf = new char[buf_size];
+	for (int i = 0; i < buf_size; ++i)
+		buf[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, buf, 100) != 100);
+	unit_fail_if(ufs_write(fd, buf + 100, buf_size - 100) !=
+		     buf_size - 100);
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	char *buf2 = new char[buf_size];
+	unit_check(ufs_read(fd2, buf2, buf_size) == buf_size &&
+		   memcmp(buf, buf2, buf_size) == 0, "read many blocks");
+	unit_fail_if(ufs_close(fd2) != 0);
+
+#if NEED_RESIZE
+	/* The blocks are reused, but the new part must be zeros anyway. */
+	unit_fail_if(ufs_resize(fd, 10) != 0);
+	unit_fail_if(ufs_resize(fd, buf_size) != 0);
+	fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	unit_fail_if(ufs_read(fd2, buf2, buf_size) != buf_size);
+	bool is_ok = memcmp(buf, buf2, 10) == 0;
+	for (int i = 10; i < buf_size && is_ok; ++i)
+		is_ok = buf2[i] == 0;
+	unit_check(is_ok, "resize adds zeros");
+	unit_fail_if(ufs_close(fd2) != 0);
+#endif
+	delete[] buf2;
+	delete[] buf;
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_set_block_size(4096) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_positional_and_vectored(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pwrite(fd, "world", 5, 6) == 5, "pwrite after the end");
+	unit_check(ufs_pwrite(fd, "hello", 5, 0) == 5, "pwrite at the start");
+	char buf[32];
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == 11, "pread");
+	unit_check(memcmp(buf, "hello\0world", 11) == 0, "the gap is zeros");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 11) == 0, "pread at EOF");
+	unit_check(ufs_read(fd, buf, 3) == 3 && memcmp(buf, "hel", 3) == 0,
+		   "the position is not changed by pread and pwrite");
+
+	char a[4], b[6];
+	struct iovec iov[2] = {{a, sizeof(a)}, {b, sizeof(b)}};
+	unit_check(ufs_readv(fd, iov, 2) == 8, "readv till the end");
+	unit_check(memcmp(a, "lo\0w", 4) == 0 && memcmp(b, "orld", 4) == 0,
+		   "readv data");
+	unit_check(ufs_readv(fd, iov, 2) == 0, "readv at EOF");
+
+	char x[] = "1234", y[] = "56";
+	struct iovec wiov[2] = {{x, 4}, {y, 2}};
+	unit_check(ufs_writev(fd, wiov, 2) == 6, "writev");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 9) == 8 &&
+		   memcmp(buf, "ld123456", 8) == 0, "writev data");
+	unit_check(ufs_pwrite(fd, "a", 1, 100 * 1024 * 1024) == -1,
+		   "pwrite over the max file size");
+	unit_check(ufs_errno() == UFS_ERR_NO_MEM, "errno is set");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	unit_check(ufs_pread(fd, buf, 1, 0) == -1, "pread of a closed fd");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_map(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_map_check(fd) == -1, "no map yet");
+	unit_check(ufs_errno() == UFS_ERR_MAP_EXPIRED, "errno is set");
+	int buf_size = 100 * 1024;
+	char *buf = new char[buf_size];
+	for (int i = 0; i < buf_size; ++i)
+		buf[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, buf, buf_size) != buf_size);
+
+	struct iovec iov[32];
+	int iovcnt = 32;
+	ssize_t rc = ufs_map(fd, 10, buf_size, iov, &iovcnt);
+	unit_check(rc == buf_size - 10, "map till the end");
+	unit_check(iovcnt > 1, "several extents");
+	size_t pos = 10;
+	bool is_ok = true;
+	for (int i = 0; i < iovcnt; ++i) {
+		is_ok = is_ok && memcmp(iov[i].iov_base, buf + pos,
+					iov[i].iov_len) == 0;
+		pos += iov[i].iov_len;
+	}
+	unit_check(is_ok && pos == (size_t)buf_size, "map data");
+	unit_check(ufs_map_check(fd) == 0, "the map is valid");
+
+	int small_cnt = 1;
+	rc = ufs_map(fd, 0, buf_size, iov, &small_cnt);
+	unit_check(small_cnt == 1 && rc > 0 && rc < buf_size,
+		   "only the start fits");
+	iovcnt = 32;
+	unit_check(ufs_map(fd, buf_size, 10, iov, &iovcnt) == 0 &&
+		   iovcnt == 0, "map at EOF");
+
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	unit_fail_if(ufs_pwrite(fd2, "x", 1, 0) != 1);
+	unit_check(ufs_map_check(fd) == -1, "a write expires the map");
+	unit_fail_if(ufs_close(fd2) != 0);
+
+	delete[] buf;
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_sparse(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	struct ufs_stat st;
+	const size_t big = 100 * 1024 * 1024;
+	unit_fail_if(ufs_resize(fd, big) != 0);
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	unit_check(st.size == big && st.allocated == 0, "growth is a hole");
+
+	char buf[100];
+	memset(buf, 'x', sizeof(buf));
+	unit_fail_if(ufs_pread(fd, buf, sizeof(buf), big / 2) != sizeof(buf));
+	bool is_zero = true;
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		is_zero = is_zero && buf[i] == 0;
+	unit_check(is_zero, "hole reads as zeros");
+
+	struct iovec iov[4];
+	int iovcnt = 4;
+	unit_check(ufs_map(fd, big / 2, 10, iov, &iovcnt) == 10 &&
+		   iovcnt == 1 && memcmp(iov[0].iov_base, buf, 10) == 0,
+		   "hole maps as zeros");
+
+	unit_fail_if(ufs_pwrite(fd, "abc", 3, big / 2 + 1) != 3);
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	unit_check(st.allocated > 0 && st.allocated <= 8 * 1024 * 1024,
+		   "a write allocates one extent");
+	unit_fail_if(ufs_pread(fd, buf, 5, big / 2) != 5);
+	unit_check(memcmp(buf, "\0abc\0", 5) == 0, "write into a hole");
+
+	unit_fail_if(ufs_resize(fd, 0) != 0);
+	unit_fail_if(ufs_pwrite(fd, "d", 1, 5000) != 1);
+	char *data = new char[6000];
+	unit_fail_if(ufs_pread(fd, data, 6000, 0) != 5001);
+	is_zero = true;
+	for (int i = 0; i < 5000; ++i)
+		is_zero = is_zero && data[i] == 0;
+	unit_check(is_zero && data[5000] == 'd',
+		   "write beyond the end leaves zeros");
+	delete[] data;
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	/* 4KB hole, then the 8KB extent with the byte. */
+	unit_check(st.size == 5001 && st.allocated == 8192,
+		   "only the written extent is allocated");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_inline(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "small", 5) != 5);
+	struct ufs_stat st;
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	struct ufs_memstats ms;
+	ufs_memstats(&ms);
+	unit_check(st.size == 5 && st.allocated == 256 && ms.data == 0,
+		   "small file is inline");
+	unit_fail_if(ufs_clone("file", "copy") != 0);
+
+	unit_fail_if(ufs_pwrite(fd, "!", 1, 255) != 1);
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	ufs_memstats(&ms);
+	unit_check(st.allocated == 256 && ms.data == 0, "inline up to 256 bytes");
+	unit_fail_if(ufs_pwrite(fd, "?", 1, 1000) != 1);
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	ufs_memstats(&ms);
+	unit_check(st.allocated == 4096 && ms.data == 4096, "growth moves to a block");
+	char buf[1001];
+	unit_fail_if(ufs_pread(fd, buf, sizeof(buf), 0) != 1001);
+	bool is_zero = true;
+	for (int i = 5; i < 1000; ++i)
+		is_zero = is_zero && buf[i] == (i == 255 ? '!' : 0);
+	unit_check(memcmp(buf, "small", 5) == 0 && is_zero && buf[1000] == '?',
+		   "the data is moved");
+
+	int fd2 = ufs_open("copy", 0);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_pread(fd2, buf, sizeof(buf), 0) == 5 &&
+		   memcmp(buf, "small", 5) == 0, "clone copies the inline data");
+	unit_fail_if(ufs_resize(fd2, 300) != 0);
+	unit_check(ufs_pread(fd2, buf, sizeof(buf), 0) == 300 &&
+		   memcmp(buf, "small", 5) == 0 && buf[299] == 0,
+		   "resize moves to a block");
+	unit_fail_if(ufs_resize(fd2, 0) != 0);
+	unit_fail_if(ufs_fstat(fd2, &st) != 0);
+	unit_check(st.allocated == 0, "truncate frees");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+	ufs_memstats(&ms);
+	unit_check(ms.data == 0 && ms.meta == 0, "everything is freed");
+
+	unit_test_finish();
+}
+
+static void
+test_image(void)
+{
+	unit_test_start();
+
+	const char *path = "ufs_test.img";
+	const int count = 10;
+	char name[16];
+	char *data = new char[100 * 1024];
+	for (int i = 0; i < 100 * 1024; ++i)
+		data[i] = 'a' + i % 26;
+	for (int i = 0; i < count; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, data, i * 10 * 1024) != i * 10 * 1024);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	int fd = ufs_open("sparse", UFS_CREATE);
+	unit_fail_if(ufs_resize(fd, 50 * 1024 * 1024) != 0);
+	unit_fail_if(ufs_pwrite(fd, "end", 3, 50 * 1024 * 1024 - 3) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+
+	unit_check(ufs_save(path) == 0, "save");
+	unit_check(ufs_load(path) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "load into used FS");
+	struct stat st;
+	unit_check(stat(path, &st) == 0 && st.st_blocks * 512 < 20 * 1024 * 1024,
+		   "holes are not stored");
+	for (int i = 0; i < count; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_fail_if(ufs_delete("sparse") != 0);
+	unit_check(ufs_save("/no/such/dir/img") == -1 &&
+		   ufs_errno() == UFS_ERR_IO, "save to a bad path");
+	unit_check(ufs_load("/no/such/img") == -1 &&
+		   ufs_errno() == UFS_ERR_IO, "load a bad path");
+
+	char *buf = new char[100 * 1024];
+	for (int round = 0; round < 2; ++round) {
+		unit_check(ufs_load(path) == 0, "load");
+		bool is_ok = true;
+		for (int i = 0; i < count; ++i) {
+			snprintf(name, sizeof(name), "file%d", i);
+			fd = ufs_open(name, 0);
+			is_ok = is_ok && fd != -1 &&
+				ufs_read(fd, buf, 100 * 1024) == i * 10 * 1024 &&
+				memcmp(buf, data, i * 10 * 1024) == 0;
+			/* Copy on write, the image is intact for the next round. */
+			is_ok = is_ok && ufs_pwrite(fd, "x", 1, 0) == 1;
+			unit_fail_if(ufs_close(fd) != 0);
+			unit_fail_if(ufs_delete(name) != 0);
+		}
+		unit_check(is_ok, "files are restored");
+		fd = ufs_open("sparse", 0);
+		struct ufs_stat ust;
+		unit_fail_if(ufs_fstat(fd, &ust) != 0);
+		unit_check(ust.size == 50 * 1024 * 1024 &&
+			   ufs_pread(fd, buf, 5, ust.size - 5) == 5 &&
+			   memcmp(buf, "\0\0end", 5) == 0, "sparse file is restored");
+		unit_check(ufs_pread(fd, buf, 5, 1000) == 5 &&
+			   memcmp(buf, "\0\0\0\0\0", 5) == 0, "holes read as zeros");
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete("sparse") != 0);
+	}
+	delete[] buf;
+	delete[] data;
+	unlink(path);
+
+	unit_test_finish();
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	const int size = 1024 * 1024;
+	char *data = new char[size];
+	char *buf = new char[size];
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	int fd = ufs_open("src", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, size) != size);
+
+	unit_check(ufs_clone("none", "dst") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "no source");
+	unit_check(ufs_clone("src", "dst") == 0, "clone");
+	unit_check(ufs_clone("src", "dst") == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "destination exists");
+	unit_check(ufs_clone("dst", "dst2") == 0, "clone of a clone");
+
+	int fd2 = ufs_open("dst", 0);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_read(fd2, buf, size) == size &&
+		   memcmp(buf, data, size) == 0, "clone has the data");
+	unit_fail_if(ufs_pwrite(fd2, "xyz", 3, 100) != 3);
+	unit_fail_if(ufs_pwrite(fd, "123", 3, size - 3) != 3);
+	unit_check(ufs_pread(fd2, buf, size, 0) == size &&
+		   memcmp(buf + 100, "xyz", 3) == 0 &&
+		   memcmp(buf + size - 3, data + size - 3, 3) == 0,
+		   "clone sees own writes only");
+	unit_check(ufs_pread(fd, buf, size, 0) == size &&
+		   memcmp(buf, data, size - 3) == 0 &&
+		   memcmp(buf + size - 3, "123", 3) == 0,
+		   "source sees own writes only");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("src") != 0);
+	unit_fail_if(ufs_resize(fd2, 10) != 0);
+	unit_fail_if(ufs_resize(fd2, size) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("dst") != 0);
+
+	fd = ufs_open("dst2", 0);
+	unit_check(ufs_read(fd, buf, size) == size &&
+		   memcmp(buf, data, size) == 0, "other clones are intact");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("dst2") != 0);
+	delete[] buf;
+	delete[] data;
+
+	unit_test_finish();
+}
+
+static void
+test_append(void)
+{
+	unit_test_start();
+
+	int fd1 = ufs_open("file", UFS_CREATE | UFS_APPEND);
+	int fd2 = ufs_open("file", UFS_APPEND | UFS_READ_WRITE);
+	unit_fail_if(fd1 == -1 || fd2 == -1);
+	for (int i = 0; i < 100; ++i)
+		unit_fail_if(ufs_write(i % 2 == 0 ? fd1 : fd2, "ab", 2) != 2);
+	char buf[256];
+	unit_check(ufs_read(fd2, buf, sizeof(buf)) == 0, "position is at the end");
+	unit_check(ufs_pread(fd1, buf, sizeof(buf), 0) == 200, "nothing is overwritten");
+	unit_fail_if(ufs_pwrite(fd2, "xy", 2, 0) != 2);
+	unit_check(ufs_pread(fd1, buf, 4, 0) == 4 && memcmp(buf, "xyab", 4) == 0,
+		   "pwrite is not appended");
+	unit_fail_if(ufs_resize(fd1, 10) != 0);
+	unit_fail_if(ufs_write(fd2, "cd", 2) != 2);
+	unit_check(ufs_pread(fd1, buf, sizeof(buf), 0) == 12 &&
+		   memcmp(buf + 10, "cd", 2) == 0, "append after a resize");
+
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_mem_limit(void)
+{
+	unit_test_start();
+
+	struct ufs_memstats ms;
+	ufs_memstats(&ms);
+	unit_check(ms.data == 0 && ms.meta == 0 && ms.limit == 0,
+		   "nothing is used");
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	ufs_memstats(&ms);
+	unit_check(ms.data == 0 && ms.meta > 0, "metadata is counted");
+
+	ufs_set_mem_limit(ms.meta + 64 * 1024);
+	char *buf = new char[1024 * 1024];
+	memset(buf, 'a', 1024 * 1024);
+	unit_check(ufs_write(fd, buf, 32 * 1024) == 32 * 1024, "write within the limit");
+	ufs_memstats(&ms);
+	unit_check(ms.data >= 32 * 1024 && ms.data + ms.meta <= ms.limit,
+		   "data is counted");
+	unit_check(ufs_write(fd, buf, 1024 * 1024) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_MEM, "write beyond the limit");
+	unit_check(ufs_resize(fd, 1024 * 1024) == 0, "holes are free");
+	unit_check(ufs_pwrite(fd, "x", 1, 1000 * 1000) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_MEM, "but not the writes into them");
+	unit_fail_if(ufs_resize(fd, 32 * 1024) != 0);
+	unit_check(ufs_pread(fd, buf, 1024 * 1024, 0) == 32 * 1024,
+		   "failed writes change nothing");
+
+	size_t data = ms.data;
+	unit_fail_if(ufs_clone("file", "copy") != 0);
+	ufs_memstats(&ms);
+	unit_check(ms.data == data, "clone shares the data");
+	int fd2 = ufs_open("copy", 0);
+	unit_fail_if(fd2 == -1);
+	ufs_set_mem_limit(0);
+	unit_fail_if(ufs_pwrite(fd2, "x", 1, 0) != 1);
+	ufs_memstats(&ms);
+	unit_check(ms.data > data, "write into a clone copies");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+	ufs_memstats(&ms);
+	unit_check(ms.data == 0 && ms.meta == 0, "everything is freed");
+	delete[] buf;
+
+	unit_test_finish();
+}
+
+/** Number of the files in a real directory. */
+static int
+test_dir_file_count(const char *path)
+{
+	DIR *d = opendir(path);
+	if (d == NULL)
+		return -1;
+	int count = 0;
+	struct dirent *ent;
+	while ((ent = readdir(d)) != NULL) {
+		if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+			++count;
+	}
+	closedir(d);
+	return count;
+}
+
+static void
+test_backing_dir(void)
+{
+	unit_test_start();
+
+	char path[] = "/tmp/ufs_spill_XXXXXX";
+	unit_fail_if(mkdtemp(path) == NULL);
+	unit_check(ufs_set_backing_dir("/no/such/dir") == -1 &&
+		   ufs_errno() == UFS_ERR_IO, "bad backing dir");
+	unit_check(ufs_set_backing_dir(path) == 0, "set backing dir");
+
+	const int size = 40 * 1024;
+	char *data = new char[size];
+	char *buf = new char[size];
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	int fd1 = ufs_open("file1", UFS_CREATE);
+	int fd2 = ufs_open("file2", UFS_CREATE);
+	unit_fail_if(fd1 == -1 || fd2 == -1);
+	struct ufs_memstats ms;
+	ufs_memstats(&ms);
+	/* Only one of the files fits. */
+	ufs_set_mem_limit(ms.meta + 96 * 1024);
+	unit_fail_if(ufs_write(fd1, data, size) != size);
+	struct iovec iov;
+	int iovcnt = 1;
+	unit_fail_if(ufs_map(fd1, 0, size, &iov, &iovcnt) <= 0);
+	unit_check(ufs_write(fd2, data, size) == size,
+		   "write beyond the limit spills another file");
+	ufs_memstats(&ms);
+	unit_check(ms.spilled > 0 && ms.data + ms.meta <= ms.limit,
+		   "memory is freed");
+	unit_check(test_dir_file_count(path) == 1, "backing file is created");
+	unit_check(ufs_map_check(fd1) == -1 &&
+		   ufs_errno() == UFS_ERR_MAP_EXPIRED, "spill expires the views");
+	struct ufs_stat st;
+	unit_check(ufs_fstat(fd1, &st) == 0 && st.size == (size_t)size &&
+		   st.allocated >= (size_t)size, "spilled data is not a hole");
+	unit_check(ufs_pread(fd1, buf, size, 0) == size &&
+		   memcmp(buf, data, size) == 0, "read faults the data in");
+	unit_check(ufs_pread(fd2, buf, size, 0) == size &&
+		   memcmp(buf, data, size) == 0, "and the other file too");
+	unit_check(ufs_pwrite(fd1, "x", 1, 0) == 1 &&
+		   ufs_pread(fd1, buf, 2, 0) == 2 && memcmp(buf, "xb", 2) == 0,
+		   "write faults the data in");
+	ufs_set_mem_limit(0);
+
+	ufs_set_idle_time(10);
+	bool is_spilled = false;
+	for (int i = 0; i < 500 && !is_spilled; ++i) {
+		usleep(10 * 1000);
+		ufs_memstats(&ms);
+		is_spilled = ms.data == 0;
+	}
+	unit_check(is_spilled, "idle files are spilled in background");
+	unit_check(ufs_pread(fd2, buf, size, 0) == size &&
+		   memcmp(buf, data, size) == 0, "read after the background spill");
+
+	ufs_set_idle_time(0);
+	unit_check(ufs_set_backing_dir(NULL) == 0, "stop spilling");
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("file1") != 0);
+	unit_fail_if(ufs_delete("file2") != 0);
+	ufs_memstats(&ms);
+	unit_check(ms.data == 0 && ms.meta == 0 && ms.spilled == 0,
+		   "everything is freed");
+	unit_check(test_dir_file_count(path) == 0, "backing files are deleted");
+	rmdir(path);
+	delete[] buf;
+	delete[] data;
+
+	unit_test_finish();
+}
+
+static void
+test_compress(void)
+{
+	unit_test_start();
+
+	/* Log lines, compressing well. */
+	const int size = 1024 * 1024;
+	char *data = new char[size];
+	for (int i = 0, line = 0; i < size; ++line) {
+		char tmp[64];
+		int len = snprintf(tmp, sizeof(tmp),
+				   "2026-10-14 12:00:%02d INFO request %d done\n",
+				   line % 60, line);
+		len = std::min(len, size - i);
+		memcpy(data + i, tmp, len);
+		i += len;
+	}
+	char *buf = new char[size];
+	int fd1 = ufs_open("log1", UFS_CREATE | UFS_COMPRESS);
+	int fd2 = ufs_open("log2", UFS_CREATE);
+	unit_fail_if(fd1 == -1 || fd2 == -1);
+	unit_fail_if(ufs_write(fd1, data, size) != size);
+	struct ufs_memstats ms;
+	ufs_memstats(&ms);
+	size_t data_before = ms.data;
+	/* No backing dir, not enough memory for the second file. */
+	ufs_set_mem_limit(ms.data + ms.meta + 256 * 1024);
+	unit_check(ufs_write(fd2, data, size) == size,
+		   "write beyond the limit compresses another file");
+	ufs_memstats(&ms);
+	unit_check(ms.packed > 0 && ms.unpacked >= 4 * ms.packed &&
+		   ms.data + ms.meta <= ms.limit, "data is compressed");
+
+	bool is_ok = true;
+	for (int offset = 0; offset < size; offset += 7777) {
+		int len = std::min(70000, size - offset);
+		is_ok = is_ok && ufs_pread(fd1, buf, len, offset) == len &&
+			memcmp(buf, data + offset, len) == 0;
+	}
+	unit_check(is_ok, "reads decompress");
+	ufs_memstats(&ms);
+	unit_check(ms.packed > 0, "and leave the data compressed");
+	struct ufs_stat st;
+	unit_check(ufs_fstat(fd1, &st) == 0 && st.allocated >= (size_t)size,
+		   "compressed data is not a hole");
+	ufs_set_mem_limit(0);
+
+	unit_check(ufs_pwrite(fd1, "x", 1, size / 2) == 1, "write");
+	ufs_memstats(&ms);
+	unit_check(ms.packed == 0, "decompresses");
+	data[size / 2] = 'x';
+	unit_check(ufs_pread(fd1, buf, size, 0) == size &&
+		   memcmp(buf, data, size) == 0, "content is intact");
+
+	ufs_set_idle_time(10);
+	bool is_packed = false;
+	for (int i = 0; i < 500 && !is_packed; ++i) {
+		usleep(10 * 1000);
+		ufs_memstats(&ms);
+		is_packed = ms.packed > 0;
+	}
+	ufs_set_idle_time(0);
+	unit_check(is_packed && ms.data < data_before + data_before / 4,
+		   "idle files are compressed in background");
+	unit_check(ufs_pread(fd1, buf, size, 0) == size &&
+		   memcmp(buf, data, size) == 0, "read after the background compression");
+	struct iovec iov[16];
+	int iovcnt = 16;
+	unit_check(ufs_map(fd1, 0, size, iov, &iovcnt) > 0 &&
+		   memcmp(iov[0].iov_base, data, iov[0].iov_len) == 0,
+		   "map decompresses");
+
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("log1") != 0);
+	unit_fail_if(ufs_delete("log2") != 0);
+	ufs_memstats(&ms);
+	unit_check(ms.data == 0 && ms.meta == 0 && ms.packed == 0 &&
+		   ms.unpacked == 0, "everything is freed");
+	delete[] buf;
+	delete[] data;
+
+	unit_test_finish();
+}
+
+static void
+test_dedup(void)
+{
+	unit_test_start();
+
+	/* Extents of 4, 8, 16, 32 and 64 KB, all full. */
+	const int size = 124 * 1024;
+	char *data = new char[size];
+	char *buf = new char[size];
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	ufs_set_dedup(true);
+	int fd1 = ufs_open("tenant1", UFS_CREATE);
+	int fd2 = ufs_open("tenant2", UFS_CREATE);
+	unit_fail_if(fd1 == -1 || fd2 == -1);
+	unit_fail_if(ufs_write(fd1, data, size) != size);
+	struct ufs_memstats ms;
+	ufs_memstats(&ms);
+	size_t data_one = ms.data;
+	unit_check(ms.deduped == 0, "nothing to share yet");
+	/* In pieces, an extent is hashed when it is filled up. */
+	for (int i = 0; i < size; i += 1000)
+		unit_fail_if(ufs_write(fd2, data + i, std::min(1000, size - i)) <= 0);
+	ufs_memstats(&ms);
+	unit_check(ms.data == data_one && ms.deduped == data_one,
+		   "equal file shares the blocks");
+
+	unit_fail_if(ufs_pwrite(fd2, "x", 1, 0) != 1);
+	ufs_memstats(&ms);
+	unit_check(ms.data == data_one + 4096 && ms.deduped == data_one - 4096,
+		   "write copies the block");
+	unit_check(ufs_pread(fd1, buf, size, 0) == size &&
+		   memcmp(buf, data, size) == 0, "other file is intact");
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_delete("tenant1") != 0);
+	ufs_memstats(&ms);
+	unit_check(ms.deduped == 0 && ms.data == data_one, "delete unshares");
+	data[0] = 'x';
+	unit_check(ufs_pread(fd2, buf, size, 0) == size &&
+		   memcmp(buf, data, size) == 0, "shared file is intact");
+
+	int fd3 = ufs_open("tenant3", UFS_CREATE);
+	unit_fail_if(ufs_write(fd3, data, size) != size);
+	ufs_memstats(&ms);
+	/* The copied block was not filled up, so it is not indexed. */
+	unit_check(ms.data == data_one + 4096 && ms.deduped == data_one - 4096,
+		   "written blocks are indexed too");
+	unit_fail_if(ufs_clone("tenant3", "copy") != 0);
+	ufs_memstats(&ms);
+	unit_check(ms.deduped == 2 * data_one - 4096, "clone of a deduped file");
+	unit_fail_if(ufs_delete("copy") != 0);
+
+	ufs_set_dedup(false);
+	int fd4 = ufs_open("tenant4", UFS_CREATE);
+	unit_fail_if(ufs_write(fd4, data, size) != size);
+	ufs_memstats(&ms);
+	unit_check(ms.data == 2 * data_one + 4096, "dedup is off");
+
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd3) != 0);
+	unit_fail_if(ufs_close(fd4) != 0);
+	unit_fail_if(ufs_delete("tenant2") != 0);
+	unit_fail_if(ufs_delete("tenant3") != 0);
+	unit_fail_if(ufs_delete("tenant4") != 0);
+	ufs_memstats(&ms);
+	unit_check(ms.data == 0 && ms.meta == 0 && ms.deduped == 0,
+		   "everything is freed");
+	delete[] buf;
+	delete[] data;
+
+	unit_test_finish();
+}
+
+static void
+test_dirs(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_open("a/file", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "no parent directory");
+	unit_check(ufs_mkdir("a/b") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "no parent for mkdir");
+	unit_check(ufs_mkdir("a") == 0 && ufs_mkdir("a/b") == 0, "mkdir");
+	unit_check(ufs_mkdir("a") == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "mkdir of existing");
+	unit_check(ufs_open("a", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "file over a directory");
+	unit_check(ufs_open("a//c", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "empty name");
+
+	const int count = 1000;
+	char name[64];
+	for (int i = 0; i < count; ++i) {
+		snprintf(name, sizeof(name), "a/b/f%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1 || ufs_close(fd) != 0);
+	}
+	int fd = ufs_open("a/kept", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "data", 4) != 4);
+	unit_check(ufs_mkdir("a/kept") == -1 &&
+		   ufs_errno() == UFS_ERR_INVALID_ARG, "directory over a file");
+	unit_fail_if(ufs_delete("a/b/f0") != 0);
+
+	struct ufs_dirent ent;
+	size_t cursor = 0;
+	int files = 0;
+	int rc;
+	while ((rc = ufs_readdir("a/b", &cursor, &ent)) == 1)
+		files += !ent.is_dir && ent.name[0] == 'f';
+	unit_check(rc == 0 && files == count - 1, "readdir lists all the files");
+	cursor = 0;
+	int dirs = 0;
+	files = 0;
+	while (ufs_readdir("a", &cursor, &ent) == 1) {
+		dirs += ent.is_dir && strcmp(ent.name, "b") == 0;
+		files += !ent.is_dir && strcmp(ent.name, "kept") == 0;
+	}
+	unit_check(dirs == 1 && files == 1, "readdir of the parent");
+	unit_check(ufs_readdir("none", &cursor, &ent) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "readdir of no directory");
+
+	int fd2 = ufs_open("a/b/f1", 0);
+	unit_fail_if(fd2 == -1);
+	unit_fail_if(ufs_write(fd2, "x", 1) != 1);
+	unit_check(ufs_rmdir("a/b") == 0, "rmdir");
+	unit_check(ufs_open("a/b/f2", 0) == -1, "files are deleted");
+	unit_check(ufs_open("a/b/f2", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "directory is deleted");
+	char buf[8];
+	unit_check(ufs_pread(fd2, buf, sizeof(buf), 0) == 1,
+		   "opened file lives on");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == 4, "other files are intact");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	unit_fail_if(ufs_mkdir("a/c") != 0);
+	unit_fail_if(ufs_clone("a/kept", "a/c/copy") != 0);
+	const char *path = "ufs_dirs.img";
+	unit_fail_if(ufs_save(path) != 0);
+	unit_fail_if(ufs_rmdir("a") != 0);
+	cursor = 0;
+	unit_check(ufs_readdir("", &cursor, &ent) == 0, "root is empty");
+	unit_check(ufs_load(path) == 0, "load");
+	fd = ufs_open("a/c/copy", 0);
+	unit_check(fd != -1 && ufs_read(fd, buf, sizeof(buf)) == 4 &&
+		   memcmp(buf, "data", 4) == 0, "directories are restored");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_rmdir("a") != 0);
+	unlink(path);
+
+	unit_test_finish();
+}
+
+static void
+test_many_fds(void)
+{
+	unit_test_start();
+
+	const int count = 20000;
+	std::vector<int> fds(count);
+	unit_msg("open %d descriptors of 2 files", count);
+	for (int i = 0; i < count; ++i) {
+		fds[i] = ufs_open(i % 2 == 0 ? "even" : "odd", UFS_CREATE);
+		unit_fail_if(fds[i] == -1);
+	}
+	char buf[100] = {0};
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(ufs_pwrite(fds[i], buf, sizeof(buf), 0) != sizeof(buf));
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(ufs_read(fds[i], buf, 10) != 10);
+	unit_fail_if(ufs_resize(fds[0], 5) != 0);
+	unit_check(ufs_read(fds[2], buf, 10) == 0, "position is clamped");
+	unit_check(ufs_read(fds[1], buf, 10) == 10, "other file is intact");
+
+	int fd = fds[count / 2];
+	unit_fail_if(ufs_close(fd) != 0);
+	fds[count / 2] = ufs_open("even", 0);
+	unit_check(fds[count / 2] == fd, "closed slot is reused");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(ufs_close(fds[i]) != 0);
+	unit_fail_if(ufs_delete("even") != 0);
+	unit_fail_if(ufs_delete("odd") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_ring(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_ring_new(0) == NULL, "no empty ring");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is 'invalid_arg'");
+	struct ufs_ring *ring = ufs_ring_new(8);
+	unit_fail_if(ring == NULL);
+	int fd1 = ufs_open("file1", UFS_CREATE);
+	int fd2 = ufs_open("file2", UFS_CREATE);
+	int ro = ufs_open("file2", UFS_READ_ONLY);
+	unit_fail_if(fd1 == -1 || fd2 == -1 || ro == -1);
+
+	/* Interleaved files, each keeps its own order. */
+	char a[] = "aaaa", b[] = "bb", c[] = "cc";
+	struct ufs_sqe *sqe = ufs_ring_get_sqe(ring);
+	*sqe = {UFS_OP_WRITE, fd1, a, 4, 0, 1};
+	sqe = ufs_ring_get_sqe(ring);
+	*sqe = {UFS_OP_WRITE, fd2, b, 2, 0, 2};
+	sqe = ufs_ring_get_sqe(ring);
+	*sqe = {UFS_OP_PWRITE, fd1, c, 2, 1, 3};
+	sqe = ufs_ring_get_sqe(ring);
+	*sqe = {UFS_OP_RESIZE, fd2, NULL, 1, 0, 4};
+	char buf1[8] = {0}, buf2[8] = {0};
+	sqe = ufs_ring_get_sqe(ring);
+	*sqe = {UFS_OP_PREAD, fd1, buf1, sizeof(buf1), 0, 5};
+	sqe = ufs_ring_get_sqe(ring);
+	*sqe = {UFS_OP_READ, ro, buf2, sizeof(buf2), 0, 6};
+	sqe = ufs_ring_get_sqe(ring);
+	*sqe = {UFS_OP_WRITE, ro, a, 4, 0, 7};
+	sqe = ufs_ring_get_sqe(ring);
+	*sqe = {UFS_OP_READ, 100500, buf2, 1, 0, 8};
+	unit_check(ufs_ring_get_sqe(ring) == NULL, "the ring is full");
+	unit_check(ufs_ring_submit(ring) == 8, "submit");
+	unit_check(ufs_ring_get_sqe(ring) == NULL, "full until reaped");
+
+	struct ufs_cqe cqes[8];
+	unit_check(ufs_ring_reap(ring, cqes, 3) == 3, "reap a part");
+	unit_check(ufs_ring_reap(ring, cqes + 3, 8) == 5, "reap the rest");
+	bool is_ordered = true;
+	for (int i = 0; i < 8; ++i)
+		is_ordered = is_ordered && cqes[i].user_data == (uint64_t)i + 1;
+	unit_check(is_ordered, "completions in the submission order");
+	unit_check(cqes[0].res == 4 && cqes[1].res == 2 && cqes[2].res == 2 &&
+		cqes[3].res == 0, "writes and resize");
+	unit_check(cqes[4].res == 4 && memcmp(buf1, "acca", 4) == 0,
+		"pread sees the writes before it");
+	unit_check(cqes[5].res == 1 && buf2[0] == 'b', "read after the resize");
+	unit_check(cqes[6].res == -1 && cqes[6].error == UFS_ERR_NO_PERMISSION,
+		"permission error");
+	unit_check(cqes[7].res == -1 && cqes[7].error == UFS_ERR_NO_FILE,
+		"bad descriptor");
+	unit_check(ufs_ring_reap(ring, cqes, 8) == 0, "nothing more");
+
+	/* The position moves over the batches like with the calls. */
+	for (int round = 0; round < 3; ++round) {
+		for (int i = 0; i < 8; ++i) {
+			sqe = ufs_ring_get_sqe(ring);
+			*sqe = {UFS_OP_WRITE, fd2, c, 2, 0, (uint64_t)i};
+		}
+		unit_fail_if(ufs_ring_submit(ring) != 8);
+		unit_fail_if(ufs_ring_reap(ring, cqes, 8) != 8);
+	}
+	struct ufs_stat st;
+	unit_fail_if(ufs_fstat(fd2, &st) != 0);
+	unit_check(st.size == 1 + 3 * 8 * 2, "batches go on from the position");
+	unit_check(ufs_ring_submit(ring) == 0, "empty submit");
+
+	ufs_ring_delete(ring);
+	unit_fail_if(ufs_close(fd1) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(ro) != 0);
+	unit_fail_if(ufs_delete("file1") != 0);
+	unit_fail_if(ufs_delete("file2") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_range_writes(void)
+{
+	unit_test_start();
+
+	enum {
+		WRITER_COUNT = 4,
+		READER_COUNT = 2,
+		ROUND_COUNT = 300,
+		REGION_SIZE = 64 * 1024,
+	};
+	/*
+	 * The writers overwrite their own regions of one file, so they
+	 * don't wait for each other. The readers read all the regions at
+	 * once, and each must be consisting of one letter only.
+	 */
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char *buf = new char[REGION_SIZE * WRITER_COUNT];
+	memset(buf, 'a', REGION_SIZE * WRITER_COUNT);
+	unit_fail_if(ufs_write(fd, buf, REGION_SIZE * WRITER_COUNT) !=
+		     REGION_SIZE * WRITER_COUNT);
+
+	bool is_ok[WRITER_COUNT + READER_COUNT];
+	std::vector<std::thread> threads;
+	for (int t = 0; t < WRITER_COUNT + READER_COUNT; ++t) {
+		threads.emplace_back([t, &is_ok]() {
+			is_ok[t] = true;
+			int fd = ufs_open("file", 0);
+			size_t size = t < WRITER_COUNT ? REGION_SIZE :
+				REGION_SIZE * WRITER_COUNT;
+			char *data = new char[size];
+			for (int i = 0; i < ROUND_COUNT && is_ok[t]; ++i) {
+				if (t < WRITER_COUNT) {
+					memset(data, 'a' + (t + i) % 26, size);
+					is_ok[t] = ufs_pwrite(fd, data, size,
+						t * REGION_SIZE) == (ssize_t)size;
+					continue;
+				}
+				is_ok[t] = ufs_pread(fd, data, size, 0) == (ssize_t)size;
+				for (size_t j = 1; j < size && is_ok[t]; ++j) {
+					is_ok[t] = j % REGION_SIZE == 0 ||
+						data[j] == data[j - 1];
+				}
+			}
+			delete[] data;
+			is_ok[t] = is_ok[t] && ufs_close(fd) == 0;
+		});
+	}
+	bool is_all_ok = true;
+	for (int t = 0; t < WRITER_COUNT + READER_COUNT; ++t) {
+		threads[t].join();
+		is_all_ok = is_all_ok && is_ok[t];
+	}
+	unit_check(is_all_ok, "parallel writes of disjoint regions");
+	unit_fail_if(ufs_pread(fd, buf, REGION_SIZE * WRITER_COUNT, 0) !=
+		     REGION_SIZE * WRITER_COUNT);
+	for (int t = 0; t < WRITER_COUNT && is_all_ok; ++t) {
+		char c = 'a' + (t + ROUND_COUNT - 1) % 26;
+		for (int j = 0; j < REGION_SIZE && is_all_ok; ++j)
+			is_all_ok = buf[t * REGION_SIZE + j] == c;
+	}
+	unit_check(is_all_ok, "the last writes are kept");
+
+	struct iovec iov[8];
+	int iovcnt = 8;
+	unit_fail_if(ufs_map(fd, 0, 100, iov, &iovcnt) != 100);
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_write(fd2, "0123456789", 10) == 10 &&
+		   ufs_write(fd2, "abcdefghij", 10) == 10, "overwrites");
+	unit_check(ufs_map_check(fd) == -1, "an overwrite expires the map");
+	unit_check(ufs_pwrite(fd2, "end", 3, REGION_SIZE * WRITER_COUNT - 1) == 3,
+		   "a write beyond the end");
+	struct ufs_stat st;
+	unit_fail_if(ufs_fstat(fd, &st) != 0);
+	unit_check(st.size == REGION_SIZE * WRITER_COUNT + 2, "the size grows");
+	char got[20];
+	unit_check(ufs_pread(fd, got, sizeof(got), 0) == sizeof(got) &&
+		   memcmp(got, "0123456789abcdefghij", sizeof(got)) == 0,
+		   "the position is moved");
+	unit_check(ufs_pread(fd, got, 3, REGION_SIZE * WRITER_COUNT - 1) == 3 &&
+		   memcmp(got, "end", 3) == 0, "the end is written");
+
+	delete[] buf;
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	enum {
+		THREAD_COUNT = 8,
+		ROUND_COUNT = 200,
+		CHUNK_SIZE = 3000,
+	};
+	/*
+	 * Each thread rewrites its own file and reads the common one.
+	 * Common file chunks are written whole, so a reader must see
+	 * each chunk consisting of one letter only.
+	 */
+	int fd = ufs_open("common", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char init[CHUNK_SIZE];
+	memset(init, 'a', sizeof(init));
+	unit_fail_if(ufs_write(fd, init, sizeof(init)) != sizeof(init));
+
+	bool is_ok[THREAD_COUNT];
+	std::vector<std::thread> threads;
+	for (int t = 0; t < THREAD_COUNT; ++t) {
+		threads.emplace_back([t, &is_ok]() {
+			is_ok[t] = true;
+			char name[32];
+			snprintf(name, sizeof(name), "file%d", t);
+			char buf[CHUNK_SIZE];
+			char got[CHUNK_SIZE];
+			int common = ufs_open("common", 0);
+			for (int i = 0; i < ROUND_COUNT && is_ok[t]; ++i) {
+				int own = ufs_open(name, UFS_CREATE);
+				memset(buf, 'a' + (t + i) % 26, sizeof(buf));
+				is_ok[t] = own != -1 &&
+					ufs_write(own, buf, sizeof(buf)) == sizeof(buf) &&
+					ufs_pread(own, got, sizeof(got), 0) == sizeof(got) &&
+					memcmp(buf, got, sizeof(buf)) == 0 &&
+					ufs_close(own) == 0 && ufs_delete(name) == 0;
+				if (t % 2 == 0) {
+					is_ok[t] = is_ok[t] && ufs_pwrite(common, buf,
+						sizeof(buf), 0) == sizeof(buf);
+					continue;
+				}
+				is_ok[t] = is_ok[t] && ufs_pread(common, got,
+					sizeof(got), 0) == sizeof(got);
+				for (int j = 1; j < CHUNK_SIZE && is_ok[t]; ++j)
+					is_ok[t] = got[j] == got[0];
+			}
+			is_ok[t] = is_ok[t] && ufs_close(common) == 0;
+		});
+	}
+	bool is_all_ok = true;
+	for (int t = 0; t < THREAD_COUNT; ++t) {
+		threads[t].join();
+		is_all_ok = is_all_ok && is_ok[t];
+	}
+	unit_check(is_all_ok, "concurrent reads and writes");
+
+	unit_check(ufs_open("file0", 0) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "errno is per thread");
+	std::thread([]() {
+		unit_check(ufs_errno() == UFS_ERR_NO_ERR, "not seen elsewhere");
+	}).join();
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("common") != 0);
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -493,6 +1563,23 @@ main(int argc, char **argv)
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_block_size();
+	test_positional_and_vectored();
+	test_map();
+	test_sparse();
+	test_inline();
+	test_image();
+	test_clone();
+	test_append();
+	test_mem_limit();
+	test_backing_dir();
+	test_compress();
+	test_dedup();
+	test_dirs();
+	test_many_fds();
+	test_ring();
+	test_range_writes();
+	test_threads();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
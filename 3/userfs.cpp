@@ -1,64 +1,1138 @@
 #include "userfs.h"
+#include "probe.h"
+#include "rlist.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <utility>
 #include <vector>
 #include <unordered_map>
 #include <cstring>
 #include <algorithm>
+#include <memory>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * All the functions can be called from any threads, except for
+ * ufs_destroy() and ufs_load(). Only the tree lock, a file lock and the
+ * spill mutex are ever held while taking another lock, in this order:
+ * - the tree lock guards the set of the directories. Creating and
+ *   deleting files take it shared, mkdir and rmdir exclusively;
+ * - a directory mutex guards its entries;
+ * - a name shard mutex guards its part of the names, the file refs
+ *   and is_deleted flag;
+ * - the descriptor table lock guards the table itself;
+ * - a file RW lock guards the file content and its descriptors'
+ *   positions. Readers of one file take it shared, so they don't
+ *   block each other;
+ * - a file range mutex guards the byte ranges locked by the readers
+ *   and the in place writers under the shared file lock, see
+ *   file_ranges. Nothing is taken under it;
+ * - a block pool mutex guards the pool;
+ * - the spill mutex guards the LRU of the files and the backing
+ *   directory settings. A file lock is only tried, not waited for,
+ *   while another one is held;
+ * - the reclaim mutex guards the slabs queued for freeing. It is taken
+ *   under a block pool mutex, and nothing is taken under it.
+ * One descriptor is not supposed to be used by several threads at
+ * once, like FILE * in the standard library.
+ */
 
 enum {
-    BLOCK_SIZE = 512,
     MAX_FILE_SIZE = 1024 * 1024 * 100,
+    BLOCK_SHIFT_MIN = 9,
+    BLOCK_SHIFT_MAX = 20,
+    BLOCK_SHIFT_DEFAULT = 12,
+    /** Each next extent is twice bigger, but not more than that. */
+    EXTENT_SHIFT_MAX = 23,
+    BLOCK_CLASS_COUNT = EXTENT_SHIFT_MAX - BLOCK_SHIFT_MIN + 1,
+    /** Blocks are cut from slabs of this size, or of one block if bigger. */
+    SLAB_SIZE = 1024 * 1024,
+    NAME_SHARD_COUNT = 16,
+    /**
+     * The spill thread ticks this many times per the idle time. A file
+     * is cold when it wasn't touched for more ticks than that.
+     */
+    SPILL_IDLE_EPOCHS = 4,
+    /** A compressed extent is split into groups read separately. */
+    PACK_GROUP_SIZE = 64 * 1024,
+    PACK_HASH_BITS = 12,
+    PACK_MIN_MATCH = 4,
+    /** Decompressed groups kept for the reads. */
+    PACK_CACHE_SIZE = 8,
+    /**
+     * Files up to this size keep the data in the file object, not in
+     * a block. Less than the smallest block.
+     */
+    FILE_INLINE_SIZE = 256,
 };
 
-/** Global error code. Set from any function on any error. */
-static ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+/** Error code of the thread. Set from any function on any error. */
+static thread_local ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+
+/**
+ * Blocks of one size class. They are cut from big slabs, and the freed
+ * ones are reused, so a file of N blocks costs about N / blocks per
+ * slab heap allocations. The block memory is not zeroed: the bytes
+ * beyond the file size are never read, and resize zeroes what it adds.
+ */
+struct block_pool {
+    std::mutex mutex;
+    std::vector<char*> slabs;
+    /** Never used part of the last slab. */
+    char *slab_pos = nullptr;
+    char *slab_end = nullptr;
+    std::vector<char*> free_blocks;
+    /** Blocks given to the files. */
+    size_t used = 0;
+};
+
+static block_pool block_pools[BLOCK_CLASS_COUNT];
+
+/** Block size of the new files. */
+static std::atomic<int> block_shift(BLOCK_SHIFT_DEFAULT);
+
+/**
+ * Memory usage. The data is the pool blocks given to the files, the
+ * metadata is the file and descriptor objects with their vectors.
+ * Only the data allocations are refused when the limit is reached,
+ * 0 means no limit.
+ */
+static std::atomic<size_t> mem_data(0);
+static std::atomic<size_t> mem_meta(0);
+static std::atomic<size_t> mem_limit(0);
+/** The data moved out to the backing files. */
+static std::atomic<size_t> mem_spilled(0);
+/**
+ * The compressed extents, counted in the data too, and the memory they
+ * would take uncompressed.
+ */
+static std::atomic<size_t> mem_packed(0);
+static std::atomic<size_t> mem_unpacked(0);
+
+static bool mem_data_charge(size_t size) {
+    size_t used = mem_data.load();
+    do {
+        size_t limit = mem_limit.load();
+        if (limit != 0 && used + mem_meta.load() + size > limit)
+            return false;
+    } while (!mem_data.compare_exchange_weak(used, used + size));
+    return true;
+}
+
+/**
+ * Freeing the slabs unmaps their memory, which takes milliseconds for a
+ * max size file. The reclaim thread does it, so the deletes and the
+ * truncates don't wait, and the pool mutex is not held meanwhile. It is
+ * started on the first use, and is stopped by ufs_destroy() or at exit.
+ */
+static std::mutex reclaim_mutex;
+static std::vector<char*> reclaim_slabs;
+static std::thread reclaim_thread;
+static std::condition_variable reclaim_cond;
+static bool reclaim_is_stopped = false;
+
+static void reclaim_thread_f(void) {
+    /* Linux nice is per thread. Don't preempt the callers. */
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    std::unique_lock<std::mutex> guard(reclaim_mutex);
+    while (true) {
+        reclaim_cond.wait(guard, [] {
+            return reclaim_is_stopped || !reclaim_slabs.empty();
+        });
+        std::vector<char*> slabs;
+        slabs.swap(reclaim_slabs);
+        guard.unlock();
+        for (char *slab : slabs)
+            delete[] slab;
+        guard.lock();
+        if (reclaim_is_stopped && reclaim_slabs.empty())
+            return;
+    }
+}
+
+/** Free the queued slabs and stop the thread. */
+static void reclaim_thread_stop(void) {
+    {
+        std::lock_guard<std::mutex> guard(reclaim_mutex);
+        if (!reclaim_thread.joinable())
+            return;
+        reclaim_is_stopped = true;
+    }
+    reclaim_cond.notify_one();
+    reclaim_thread.join();
+    reclaim_is_stopped = false;
+}
+
+static void reclaim_slabs_push(std::vector<char*> *slabs) {
+    {
+        std::lock_guard<std::mutex> guard(reclaim_mutex);
+        if (!reclaim_thread.joinable()) {
+            static bool is_atexit_set = false;
+            if (!is_atexit_set)
+                is_atexit_set = atexit(reclaim_thread_stop) == 0;
+            reclaim_thread = std::thread(reclaim_thread_f);
+        }
+        if (reclaim_slabs.empty())
+            reclaim_slabs.swap(*slabs);
+        else
+            reclaim_slabs.insert(reclaim_slabs.end(), slabs->begin(), slabs->end());
+    }
+    reclaim_cond.notify_one();
+}
+
+static void block_pool_clear(block_pool *pool) {
+    reclaim_slabs_push(&pool->slabs);
+    std::vector<char*>().swap(pool->slabs);
+    std::vector<char*>().swap(pool->free_blocks);
+    pool->slab_pos = nullptr;
+    pool->slab_end = nullptr;
+}
+
+/** A block, or nullptr when the memory limit doesn't allow it. */
+static char *block_new(int shift) {
+    block_pool *pool = &block_pools[shift - BLOCK_SHIFT_MIN];
+    size_t size = (size_t)1 << shift;
+    if (!mem_data_charge(size))
+        return nullptr;
+    std::lock_guard<std::mutex> guard(pool->mutex);
+    char *b;
+    if (!pool->free_blocks.empty()) {
+        b = pool->free_blocks.back();
+        pool->free_blocks.pop_back();
+    } else {
+        if (pool->slab_pos == pool->slab_end) {
+            size_t slab_size = std::max((size_t)SLAB_SIZE, size);
+            /* No value-initialization, the memory is not zeroed. */
+            pool->slab_pos = new char[slab_size];
+            pool->slab_end = pool->slab_pos + slab_size;
+            pool->slabs.push_back(pool->slab_pos);
+        }
+        b = pool->slab_pos;
+        pool->slab_pos += size;
+    }
+    ++pool->used;
+    return b;
+}
+
+static void block_delete(int shift, char *b) {
+    block_pool *pool = &block_pools[shift - BLOCK_SHIFT_MIN];
+    mem_data -= (size_t)1 << shift;
+    std::lock_guard<std::mutex> guard(pool->mutex);
+    pool->free_blocks.push_back(b);
+    /* The slabs can't be freed one by one, but all at once can. */
+    if (--pool->used == 0)
+        block_pool_clear(pool);
+}
+
+struct file;
+
+/**
+ * Spill another file to free memory for this one, which must be locked
+ * exclusively. False if nothing could be freed.
+ */
+static bool spill_reclaim(file *self);
+
+/**
+ * Zeros to map the holes. Never written, so the untouched pages cost
+ * nothing, and the touched ones are the shared zero page.
+ */
+static char zero_extent[(size_t)1 << EXTENT_SHIFT_MAX];
+
+/** Owner count of an extent memory shared by the file clones. */
+struct extent_ref {
+    std::atomic<int> count;
+    /**
+     * The memory is in the dedup index, so the files not owning it can
+     * find it and take a reference. Then the count only goes down under
+     * the dedup mutex.
+     */
+    bool is_indexed = false;
+    int shift = 0;
+    uint64_t hash = 0;
+    char *memory = nullptr;
+};
+
+/**
+ * Dedup: the full extents written with the dedup on are hashed by the
+ * content, and an extent equal to an indexed one of the same size
+ * shares its memory instead, the same way as the clones do: copy on
+ * write. The index only has the extents nobody else can change, the
+ * last owner of an indexed extent drops it from the index before
+ * writing into it.
+ */
+static std::atomic<bool> dedup_is_on(false);
+static std::mutex dedup_mutex;
+static std::unordered_multimap<uint64_t, extent_ref *> dedup_index;
+/** Memory saved by sharing the indexed extents. */
+static std::atomic<size_t> mem_deduped(0);
+
+/** Word at a time, the extents are never shorter than 512 bytes. */
+static uint64_t dedup_hash(const char *data, size_t size, int shift) {
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ (uint64_t)shift;
+    for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ull;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+/** Drop the ref from the index. The dedup mutex must be held. */
+static void dedup_index_remove(extent_ref *ref) {
+    auto range = dedup_index.equal_range(ref->hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == ref) {
+            dedup_index.erase(it);
+            break;
+        }
+    }
+}
+
+/**
+ * Drop one owner of the ref, true if it was the last one, then the ref
+ * must be freed by the caller.
+ */
+static bool extent_ref_unref(extent_ref *ref) {
+    if (!ref->is_indexed)
+        return --ref->count == 0;
+    std::lock_guard<std::mutex> guard(dedup_mutex);
+    if (--ref->count > 0) {
+        mem_deduped -= (size_t)1 << ref->shift;
+        return false;
+    }
+    dedup_index_remove(ref);
+    return true;
+}
+
+/**
+ * True if the caller is the only owner of the ref, and so can take the
+ * memory writable and free the ref.
+ */
+static bool extent_ref_is_last(extent_ref *ref) {
+    if (!ref->is_indexed)
+        return ref->count == 1;
+    std::lock_guard<std::mutex> guard(dedup_mutex);
+    if (ref->count != 1)
+        return false;
+    dedup_index_remove(ref);
+    return true;
+}
+
+/** Contiguous run of the file memory, one block from a pool. */
+struct extent {
+    /** Offset of the extent in the file. */
+    size_t begin;
+    int shift;
+    /** nullptr for a hole, which reads as zeros. */
+    char *memory;
+    /** The memory is a private mapping of an image, not from a pool. */
+    bool is_image;
+    /** The memory is file::inline_data, not from a pool. */
+    bool is_inline;
+    /**
+     * The memory is nullptr, but it is not a hole: the data is in the
+     * backing file of the file, at the same offset.
+     */
+    bool is_spilled;
+    /**
+     * Not nullptr when the memory is nullptr, but the data is
+     * compressed here, see extent_pack().
+     */
+    char *packed;
+    /**
+     * Not nullptr when the memory might be shared with clones. Then it
+     * is read-only, and is copied on write.
+     */
+    extent_ref *ref;
+};
+
+/** Free the extent memory, unless other files still use it. */
+static void extent_release(const extent &e) {
+    if (e.ref != nullptr) {
+        if (!extent_ref_unref(e.ref))
+            return;
+        delete e.ref;
+        mem_meta -= sizeof(extent_ref);
+    }
+    if (!e.is_image)
+        block_delete(e.shift, e.memory);
+}
+
+/**
+ * The compression is LZ4 style, a block is a run of sequences: a token,
+ * literals, and a match. The token is 4 bits of the literal count and
+ * 4 bits of the match length minus PACK_MIN_MATCH, 15 meaning the
+ * count goes on in the next bytes, 255 each while it is more. The match
+ * is a 2 byte offset back in the output. The last sequence has only the
+ * literals. The matches are found by a hash table of 4 byte sequences,
+ * one candidate each, so it is fast rather than tight. A group is at
+ * most 64 KB, so any offset fits.
+ */
+static bool pack_put_len(char **out, char *end, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (*out == end)
+            return false;
+        *(*out)++ = (char)255;
+    }
+    if (*out == end)
+        return false;
+    *(*out)++ = (char)len;
+    return true;
+}
+
+static bool pack_get_len(const uint8_t **in, const uint8_t *end, size_t *len) {
+    uint8_t b;
+    do {
+        if (*in == end)
+            return false;
+        b = *(*in)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+/** A sequence, the match length is 0 for the last one. False if no room. */
+static bool pack_put_seq(char **out, char *end, const char *lit, size_t lit_len,
+                         size_t offset, size_t match_len) {
+    if (*out == end)
+        return false;
+    char *token = (*out)++;
+    size_t lit_code = std::min(lit_len, (size_t)15);
+    size_t match_code = match_len == 0 ? 0 :
+        std::min(match_len - PACK_MIN_MATCH, (size_t)15);
+    *token = (char)(lit_code << 4 | match_code);
+    if (lit_code == 15 && !pack_put_len(out, end, lit_len - 15))
+        return false;
+    if ((size_t)(end - *out) < lit_len)
+        return false;
+    memcpy(*out, lit, lit_len);
+    *out += lit_len;
+    if (match_len == 0)
+        return true;
+    if (end - *out < 2)
+        return false;
+    (*out)[0] = (char)(offset & 0xff);
+    (*out)[1] = (char)(offset >> 8);
+    *out += 2;
+    return match_code < 15 ||
+        pack_put_len(out, end, match_len - PACK_MIN_MATCH - 15);
+}
+
+/** Compressed size, or 0 if it doesn't fit into the capacity. */
+static size_t pack_compress(const char *src, size_t size, char *dst, size_t cap) {
+    /* Position + 1 of the last sequence with the hash, 0 for none. */
+    uint32_t table[1 << PACK_HASH_BITS] = {};
+    char *out = dst;
+    char *end = dst + cap;
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + PACK_MIN_MATCH <= size) {
+        uint32_t seq;
+        memcpy(&seq, src + pos, sizeof(seq));
+        uint32_t hash = (seq * 2654435761u) >> (32 - PACK_HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = pos + 1;
+        if (candidate == 0 || memcmp(src + candidate - 1, src + pos, PACK_MIN_MATCH) != 0) {
+            ++pos;
+            continue;
+        }
+        --candidate;
+        size_t len = PACK_MIN_MATCH;
+        while (pos + len < size && src[candidate + len] == src[pos + len])
+            ++len;
+        if (!pack_put_seq(&out, end, src + anchor, pos - anchor, pos - candidate, len))
+            return 0;
+        pos += len;
+        anchor = pos;
+    }
+    if (!pack_put_seq(&out, end, src + anchor, size - anchor, 0, 0))
+        return 0;
+    return out - dst;
+}
+
+/** Decompress exactly the size, false if the input is broken. */
+static bool pack_decompress(const char *src, size_t src_size, char *dst, size_t size) {
+    const uint8_t *in = (const uint8_t *)src;
+    const uint8_t *in_end = in + src_size;
+    char *out = dst;
+    char *out_end = dst + size;
+    while (in < in_end) {
+        unsigned token = *in++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !pack_get_len(&in, in_end, &lit_len))
+            return false;
+        if ((size_t)(in_end - in) < lit_len || (size_t)(out_end - out) < lit_len)
+            return false;
+        memcpy(out, in, lit_len);
+        in += lit_len;
+        out += lit_len;
+        if (in == in_end)
+            break;
+        if (in_end - in < 2)
+            return false;
+        size_t offset = in[0] | (size_t)in[1] << 8;
+        in += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !pack_get_len(&in, in_end, &match_len))
+            return false;
+        match_len += PACK_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(out - dst) ||
+            (size_t)(out_end - out) < match_len)
+            return false;
+        const char *from = out - offset;
+        /* Overlapped is a repeat of the last offset bytes. */
+        if (offset >= match_len) {
+            memcpy(out, from, match_len);
+        } else {
+            for (size_t i = 0; i < match_len; ++i)
+                out[i] = from[i];
+        }
+        out += match_len;
+    }
+    return out == out_end;
+}
+
+/**
+ * Compressed extent layout: the group count, the end offset of each
+ * group after the header, the groups. A group which doesn't compress is
+ * stored as is, it has the same size then.
+ */
+static uint32_t pack_header_get(const char *packed, size_t i) {
+    uint32_t v;
+    memcpy(&v, packed + i * sizeof(v), sizeof(v));
+    return v;
+}
+
+static size_t pack_header_size(const char *packed) {
+    return (pack_header_get(packed, 0) + 1) * sizeof(uint32_t);
+}
+
+static size_t pack_size(const char *packed) {
+    uint32_t count = pack_header_get(packed, 0);
+    return pack_header_size(packed) + (count == 0 ? 0 : pack_header_get(packed, count));
+}
+
+/**
+ * Compressed data part of an extent, or nullptr if it saves less than
+ * 1/8, then the reads had better stay memcpy().
+ */
+static char *extent_pack(const char *memory, size_t len, size_t extent_size,
+                         size_t *packed_size) {
+    uint32_t count = (len + PACK_GROUP_SIZE - 1) / PACK_GROUP_SIZE;
+    size_t header = (count + 1) * sizeof(uint32_t);
+    size_t cap = extent_size - extent_size / 8;
+    if (header >= cap)
+        return nullptr;
+    char *buf = new char[cap];
+    memcpy(buf, &count, sizeof(count));
+    size_t used = header;
+    for (uint32_t i = 0; i < count; ++i) {
+        const char *src = memory + (size_t)i * PACK_GROUP_SIZE;
+        size_t raw = std::min((size_t)PACK_GROUP_SIZE, len - (size_t)i * PACK_GROUP_SIZE);
+        /* Smaller than raw, so the raw groups are told by the size. */
+        size_t n = pack_compress(src, raw, buf + used, std::min(raw - 1, cap - used));
+        if (n == 0) {
+            if (cap - used < raw) {
+                delete[] buf;
+                return nullptr;
+            }
+            memcpy(buf + used, src, raw);
+            n = raw;
+        }
+        used += n;
+        uint32_t group_end = used - header;
+        memcpy(buf + (i + 1) * sizeof(uint32_t), &group_end, sizeof(group_end));
+    }
+    char *packed = new char[used];
+    memcpy(packed, buf, used);
+    delete[] buf;
+    *packed_size = used;
+    return packed;
+}
+
+/** Decompress a group of the extent having this data size. */
+static bool pack_group_read(const char *packed, size_t group, size_t len, char *dst) {
+    size_t header = pack_header_size(packed);
+    size_t begin = group == 0 ? 0 : pack_header_get(packed, group);
+    size_t end = pack_header_get(packed, group + 1);
+    size_t raw = std::min((size_t)PACK_GROUP_SIZE, len - group * PACK_GROUP_SIZE);
+    if (end - begin == raw) {
+        memcpy(dst, packed + header + begin, raw);
+        return true;
+    }
+    return pack_decompress(packed + header + begin, end - begin, dst, raw);
+}
+
+/**
+ * The last decompressed groups, so the small reads of a compressed file
+ * don't decompress a group each. Shared by all the files, the key is
+ * the compressed memory.
+ */
+struct pack_cache_slot {
+    const char *packed;
+    size_t group;
+    char *data;
+};
+
+static pack_cache_slot pack_cache[PACK_CACHE_SIZE];
+static size_t pack_cache_next = 0;
+static std::mutex pack_cache_mutex;
+
+/** Copy a piece of a compressed extent having this data size. */
+static bool pack_read(const char *packed, size_t len, size_t offset, char *buf, size_t size) {
+    std::lock_guard<std::mutex> guard(pack_cache_mutex);
+    while (size > 0) {
+        size_t group = offset / PACK_GROUP_SIZE;
+        size_t in_group = offset % PACK_GROUP_SIZE;
+        size_t n = std::min(size, (size_t)PACK_GROUP_SIZE - in_group);
+        pack_cache_slot *slot = nullptr;
+        for (pack_cache_slot &s : pack_cache) {
+            if (s.packed == packed && s.group == group) {
+                slot = &s;
+                break;
+            }
+        }
+        if (slot == nullptr) {
+            slot = &pack_cache[pack_cache_next++ % PACK_CACHE_SIZE];
+            if (slot->data == nullptr)
+                slot->data = new char[PACK_GROUP_SIZE];
+            slot->packed = nullptr;
+            if (!pack_group_read(packed, group, len, slot->data))
+                return false;
+            slot->packed = packed;
+            slot->group = group;
+        }
+        memcpy(buf, slot->data + in_group, n);
+        buf += n;
+        offset += n;
+        size -= n;
+    }
+    return true;
+}
+
+/** Decompress the whole data part of an extent. */
+static bool pack_unpack(const char *packed, size_t len, char *memory) {
+    uint32_t count = pack_header_get(packed, 0);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!pack_group_read(packed, i, len, memory + (size_t)i * PACK_GROUP_SIZE))
+            return false;
+    }
+    return true;
+}
+
+/** Free the compressed memory of the extent, and its cached groups. */
+static void extent_unpacked(extent *e) {
+    {
+        std::lock_guard<std::mutex> guard(pack_cache_mutex);
+        for (pack_cache_slot &s : pack_cache) {
+            if (s.packed == e->packed)
+                s.packed = nullptr;
+        }
+    }
+    size_t size = pack_size(e->packed);
+    mem_data -= size;
+    mem_packed -= size;
+    mem_unpacked -= (size_t)1 << e->shift;
+    delete[] e->packed;
+    e->packed = nullptr;
+}
+
+struct filedesc;
+
+/**
+ * Byte ranges of a file locked under its shared lock, like fcntl()
+ * record locks: the writers of disjoint ranges go in parallel, the
+ * overlapping ones wait, the readers only wait for the writers. Only
+ * the writes within the size over the blocks the file owns take a
+ * range, the rest change the extents and take the exclusive file lock
+ * as before.
+ */
+struct file_ranges {
+    struct range {
+        size_t begin;
+        size_t end;
+        bool is_write;
+    };
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<range> held;
+
+    bool is_free(size_t begin, size_t end, bool is_write) const {
+        for (const range &r : held) {
+            if (r.begin < end && begin < r.end && (is_write || r.is_write))
+                return false;
+        }
+        return true;
+    }
+
+    void lock(size_t begin, size_t end, bool is_write) {
+        std::unique_lock<std::mutex> guard(mutex);
+        cond.wait(guard, [&]() { return is_free(begin, end, is_write); });
+        held.push_back({begin, end, is_write});
+    }
+
+    void unlock(size_t begin, size_t end, bool is_write) {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            for (range &r : held) {
+                if (r.begin == begin && r.end == end && r.is_write == is_write) {
+                    r = held.back();
+                    held.pop_back();
+                    break;
+                }
+            }
+        }
+        cond.notify_all();
+    }
+};
+
+/** Lock of a range for the scope, no-op for a file without ranges. */
+struct file_range_guard {
+    file_ranges *ranges;
+    size_t begin;
+    size_t end;
+    bool is_write;
+
+    file_range_guard(file_ranges *ranges, size_t begin, size_t end, bool is_write)
+        : ranges(begin < end ? ranges : nullptr), begin(begin), end(end), is_write(is_write) {
+        if (this->ranges != nullptr)
+            this->ranges->lock(begin, end, is_write);
+    }
 
-struct block {
-	/** Block memory. */
-    char memory[BLOCK_SIZE];
+    ~file_range_guard() {
+        if (ranges != nullptr)
+            ranges->unlock(begin, end, is_write);
+    }
 
-    block() { 
-		std::memset(memory, 0, BLOCK_SIZE); 
-	}
+    file_range_guard(const file_range_guard &) = delete;
+    file_range_guard &operator=(const file_range_guard &) = delete;
 };
 
 struct file {
+    /** The name index keys point here, not to own copies. */
     std::string name;
+    size_t name_hash = 0;
     size_t size = 0;
+    /** Guarded by the name shard. */
     int refs = 0;
     bool is_deleted = false;
+    std::shared_mutex lock;
+    /**
+     * Opened descriptors, to move their positions on resize. Intrusive,
+     * so open and close don't allocate nor search in it.
+     */
+    struct rlist descs;
+    /**
+     * Incremented on each change, to expire the ufs_map() views. Atomic
+     * for the in place writers under the shared lock.
+     */
+    std::atomic<uint64_t> version{0};
+    /**
+     * Created by the first overwrite, set under the exclusive lock.
+     * Then the next overwrites within the owned blocks go under the
+     * shared lock, and so the readers take the ranges too. The append
+     * only files never pay for that.
+     */
+    std::unique_ptr<file_ranges> ranges;
+    /** Log2 of the first extent size, fixed when the file is created. */
+    int block_shift = BLOCK_SHIFT_DEFAULT;
     
-    /** 
-	* Better performance compared to rlist in struct block.
-	* More allocations and memory consumption though.
-	*/
-    std::vector<block*> blocks;
+    /**
+     * The extents grow geometrically, so even a max size file has a
+     * couple dozens of them, and big reads and writes are a few
+     * memcpy() calls.
+     */
+    std::vector<extent> extents;
+    /** Sum of the extent sizes. */
+    size_t capacity = 0;
+    /**
+     * Sum of the sizes of the extents which are not holes. The inline
+     * data counts as FILE_INLINE_SIZE.
+     */
+    size_t allocated = 0;
+    /** The metadata size accounted in mem_meta. */
+    size_t meta_charged = 0;
+    /** Some extents are spilled, see file_spill(). */
+    bool is_spilled = false;
+    /** Compress the data when cold, see UFS_COMPRESS. */
+    bool is_compressed = false;
+    /** Some extents are compressed, see file_pack(). */
+    bool is_packed = false;
+    /** The backing file, empty until the first spill. */
+    std::string spill_path;
+    /** Spill epoch of the last access, 0 when not in the LRU. */
+    std::atomic<uint64_t> lru_epoch{0};
+    /** Link in the LRU, guarded by the spill mutex. */
+    struct rlist in_lru;
+    /**
+     * Data of a small file. The first extent memory points here until
+     * the file grows beyond it, saving the block and a pointer hop on
+     * each read.
+     */
+    char inline_data[FILE_INLINE_SIZE];
+
+    /** Account the metadata size change. */
+    void meta_update() {
+        size_t meta = sizeof(file) + name.capacity() +
+            spill_path.capacity() + extents.capacity() * sizeof(extent) +
+            (ranges != nullptr ? sizeof(file_ranges) : 0);
+        mem_meta += meta - meta_charged;
+        meta_charged = meta;
+    }
+
+    /** Add extents up to the capacity, as holes. */
+    void reserve(size_t new_capacity) {
+        while (capacity < new_capacity) {
+            extent e;
+            e.begin = capacity;
+            e.shift = extents.empty() ? block_shift :
+                std::min(extents.back().shift + 1, (int)EXTENT_SHIFT_MAX);
+            e.memory = nullptr;
+            e.is_image = false;
+            e.is_inline = false;
+            e.is_spilled = false;
+            e.packed = nullptr;
+            e.ref = nullptr;
+            extents.push_back(e);
+            capacity += (size_t)1 << e.shift;
+        }
+        meta_update();
+    }
+
+    /** Drop the extents which are fully beyond the new size. */
+    void shrink(size_t new_size) {
+        while (!extents.empty() && extents.back().begin >= new_size) {
+            extent &e = extents.back();
+            if (e.is_inline) {
+                allocated -= FILE_INLINE_SIZE;
+            } else if (e.memory != nullptr) {
+                extent_release(e);
+                allocated -= (size_t)1 << e.shift;
+            } else if (e.is_spilled) {
+                allocated -= (size_t)1 << e.shift;
+                mem_spilled -= (size_t)1 << e.shift;
+            } else if (e.packed != nullptr) {
+                allocated -= (size_t)1 << e.shift;
+                extent_unpacked(&e);
+            }
+            capacity = e.begin;
+            extents.pop_back();
+        }
+    }
+
+    /** Iterator of the extent containing the position. */
+    std::vector<extent>::iterator extent_of(size_t pos) {
+        /* Appends and sequential writes mostly hit the last one. */
+        if (pos >= extents.back().begin)
+            return extents.end() - 1;
+        return std::upper_bound(extents.begin(), extents.end(), pos,
+            [](size_t p, const extent &e) { return p < e.begin; }) - 1;
+    }
+
+    /** A block, spilling other files when the memory limit is reached. */
+    char *block_alloc(int shift) {
+        char *b;
+        while ((b = block_new(shift)) == nullptr) {
+            if (!spill_reclaim(this))
+                return nullptr;
+        }
+        return b;
+    }
+
+    /**
+     * Make the range writable: copy the extents shared with clones, and
+     * give memory to the holes if asked. The data part of a new block
+     * is filled, the rest is not: the bytes beyond the size are never
+     * read. The inline data moves to a block when the range goes beyond
+     * it, so the range is also readable up to its end. On the memory
+     * limit the range is partially done, but the content is the same
+     * anyway.
+     */
+    bool materialize(size_t pos, size_t len, bool is_hole_filled) {
+        if (len == 0)
+            return true;
+        size_t end = pos + len;
+        for (auto it = extent_of(pos); it != extents.end() &&
+             it->begin < end; ++it) {
+            size_t extent_size = (size_t)1 << it->shift;
+            size_t data_size = size > it->begin ?
+                std::min(size - it->begin, extent_size) : 0;
+            if (it->is_inline) {
+                if (end <= FILE_INLINE_SIZE)
+                    continue;
+                char *memory = block_alloc(it->shift);
+                if (memory == nullptr)
+                    return false;
+                std::memcpy(memory, inline_data, data_size);
+                it->memory = memory;
+                it->is_inline = false;
+                allocated += extent_size - FILE_INLINE_SIZE;
+            } else if (it->memory == nullptr) {
+                if (!is_hole_filled)
+                    continue;
+                if (it->begin == 0 && std::max(end, size) <= FILE_INLINE_SIZE) {
+                    it->memory = inline_data;
+                    it->is_inline = true;
+                    allocated += FILE_INLINE_SIZE;
+                    std::memset(it->memory, 0, data_size);
+                    continue;
+                }
+                it->memory = block_alloc(it->shift);
+                if (it->memory == nullptr)
+                    return false;
+                allocated += extent_size;
+                std::memset(it->memory, 0, data_size);
+            } else if (it->ref != nullptr) {
+                /* The last owner, nobody else can see it. */
+                if (extent_ref_is_last(it->ref)) {
+                    delete it->ref;
+                    mem_meta -= sizeof(extent_ref);
+                    it->ref = nullptr;
+                    continue;
+                }
+                char *memory = block_alloc(it->shift);
+                if (memory == nullptr)
+                    return false;
+                std::memcpy(memory, it->memory, data_size);
+                extent_release(*it);
+                it->memory = memory;
+                it->is_image = false;
+                it->ref = nullptr;
+            }
+        }
+        return true;
+    }
 
-    ~file() {
-        for (block* b : blocks) {
-            delete b;
+    /**
+     * Call func(extent, offset, size) for each piece of the range, in
+     * order. The offset is in the extent. The range must be within the
+     * capacity.
+     */
+    template<typename F>
+    void for_each_piece(size_t pos, size_t size, F &&func) {
+        if (size == 0)
+            return;
+        for (auto it = extent_of(pos); size > 0; ++it) {
+            size_t offset = pos - it->begin;
+            size_t len = std::min(size, ((size_t)1 << it->shift) - offset);
+            func(*it, offset, len);
+            pos += len;
+            size -= len;
         }
     }
+
+    /**
+     * Call func(memory, size) for each piece of the range in the file
+     * memory, in order. The memory is nullptr for the holes. The range
+     * must be within the capacity, and not spilled nor compressed.
+     */
+    template<typename F>
+    void for_each(size_t pos, size_t size, F &&func) {
+        for_each_piece(pos, size, [&](const extent &e, size_t offset, size_t len) {
+            func(e.memory != nullptr ? e.memory + offset : nullptr, len);
+        });
+    }
+
+    /** Size of the extent part within the file size. */
+    size_t data_size(const extent &e) const {
+        size_t extent_size = (size_t)1 << e.shift;
+        return size > e.begin ? std::min(size - e.begin, extent_size) : 0;
+    }
+
+    file() {
+        rlist_create(&descs);
+        rlist_create(&in_lru);
+    }
+
+    ~file();
 };
 
 struct filedesc {
     file *atfile;
     size_t pos = 0;
     int flags = 0;
+    /** File version of the last ufs_map(). */
+    uint64_t map_version = 0;
+    bool has_map = false;
+    /** Link in file::descs. */
+    struct rlist in_file = {nullptr, nullptr};
+};
+
+/**
+ * Key of the name index. The hash is computed once per call and is
+ * used both for the shard and for the bucket. A lookup only views the
+ * caller's string, so it doesn't allocate.
+ */
+struct name_key {
+    /**
+     * Mutable to repoint a just inserted key from the caller's string
+     * to file::name. The bytes are the same, so the map is intact.
+     */
+    mutable std::string_view name;
+    size_t hash;
+
+    name_key(std::string_view n) : name(n), hash(std::hash<std::string_view>()(n)) {}
+
+    bool operator==(const name_key &other) const {
+        return name == other.name;
+    }
+};
+
+struct name_key_hash {
+    size_t operator()(const name_key &key) const {
+        return key.hash;
+    }
 };
 
 /** 
 * O(1) search by a name, compared to O(N) with rlist,
 * more allocations and memory consumption though.
+* Split into shards, so the threads working with different
+* files don't wait for each other most of the time.
 */
-static std::unordered_map<std::string, file*> all_files;
+struct name_shard {
+    std::mutex mutex;
+    std::unordered_map<name_key, file*, name_key_hash> files;
+};
 
-static std::vector<filedesc*> file_descriptors;
+static name_shard name_shards[NAME_SHARD_COUNT];
 
-static bool is_invalid_fd(int fd) {
-    return fd <= 0 || fd >= (int)file_descriptors.size() || file_descriptors[fd] == nullptr;
+static name_shard *name_shard_of(size_t hash) {
+    return &name_shards[hash % NAME_SHARD_COUNT];
+}
+
+struct dir_entry {
+    /** Points to the key in dir::index. */
+    const std::string *name;
+    bool is_dir;
+};
+
+/**
+ * The files are found by the full path in the name shards, the
+ * directories only keep the lists of their entries, to read and delete
+ * a subtree without scanning all the names.
+ */
+struct dir {
+    std::mutex mutex;
+    /** Full path, empty for the root. */
+    std::string path;
+    /** Dense, so a readdir cursor is just an index. */
+    std::vector<dir_entry> entries;
+    std::unordered_map<std::string, size_t> index;
+
+    void add(std::string_view name, bool is_dir) {
+        auto it = index.emplace(std::string(name), entries.size()).first;
+        entries.push_back({&it->first, is_dir});
+    }
+
+    /** Swap with the last entry and pop. */
+    void remove(std::string_view name) {
+        auto it = index.find(std::string(name));
+        size_t pos = it->second;
+        entries[pos] = entries.back();
+        index[*entries[pos].name] = pos;
+        entries.pop_back();
+        index.erase(it);
+    }
+};
+
+static dir root_dir;
+/** All the directories but the root, by the full path. */
+static std::unordered_map<name_key, dir*, name_key_hash> dirs;
+static std::shared_mutex tree_lock;
+
+/** Directory by the full path. The tree lock must be held. */
+static dir *dir_find(std::string_view path) {
+    if (path.empty())
+        return &root_dir;
+    auto it = dirs.find(name_key(path));
+    return it == dirs.end() ? nullptr : it->second;
+}
+
+static std::string dir_child_path(const dir *d, std::string_view name) {
+    std::string res = d->path;
+    if (!res.empty())
+        res += '/';
+    res += name;
+    return res;
+}
+
+/**
+ * Split a path into the parent directory path and the last name. The
+ * names must be not empty and not longer than UFS_NAME_MAX.
+ */
+static bool path_split(std::string_view path, std::string_view *parent, std::string_view *name) {
+    size_t begin = 0;
+    while (true) {
+        size_t end = path.find('/', begin);
+        if (end == std::string_view::npos)
+            end = path.size();
+        if (end == begin || end - begin > UFS_NAME_MAX)
+            return false;
+        if (end == path.size()) {
+            *parent = path.substr(0, begin == 0 ? 0 : begin - 1);
+            *name = path.substr(begin);
+            return true;
+        }
+        begin = end + 1;
+    }
+}
+
+/**
+ * Directory for a new entry of the path, or nullptr with the error code
+ * set. The tree lock must be held.
+ */
+static dir *dir_for_new(std::string_view path, std::string_view *name) {
+    std::string_view parent;
+    if (!path_split(path, &parent, name)) {
+        ufs_error_code = UFS_ERR_INVALID_ARG;
+        return nullptr;
+    }
+    dir *d = dir_find(parent);
+    if (d == nullptr) {
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return nullptr;
+    }
+    if (dir_find(path) != nullptr) {
+        ufs_error_code = UFS_ERR_INVALID_ARG;
+        return nullptr;
+    }
+    return d;
+}
+
+static void dir_add(dir *d, std::string_view name, bool is_dir) {
+    std::lock_guard<std::mutex> guard(d->mutex);
+    d->add(name, is_dir);
+}
+
+static std::vector<filedesc*> file_descriptors;
+/** Free slots of file_descriptors, to find one in O(1). */
+static std::vector<int> free_fds;
+static std::shared_mutex file_descriptors_lock;
+
+/** Descriptor by the number, or nullptr with the error code set. */
+static filedesc *filedesc_get(int fd) {
+    std::shared_lock<std::shared_mutex> guard(file_descriptors_lock);
+    if (fd <= 0 || fd >= (int)file_descriptors.size() || file_descriptors[fd] == nullptr) {
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return nullptr;
+    }
+    return file_descriptors[fd];
 }
 
 enum ufs_error_code ufs_errno() {
@@ -73,37 +1147,71 @@ int ufs_open(const char *filename, int flags) {
     }
 
     file *target = nullptr;
-    auto it = all_files.find(filename);
-
-    if (it == all_files.end()) {
-        if (!(flags & UFS_CREATE)) {
-            ufs_error_code = UFS_ERR_NO_FILE;
+    name_key key(filename);
+    name_shard *shard = name_shard_of(key.hash);
+    /* Only a creation touches the tree. */
+    std::shared_lock<std::shared_mutex> tree_guard(tree_lock, std::defer_lock);
+    dir *parent = nullptr;
+    std::string_view base;
+    bool is_new = false;
+    if (flags & UFS_CREATE) {
+        tree_guard.lock();
+        parent = dir_for_new(key.name, &base);
+        if (parent == nullptr)
             return -1;
+    }
+    {
+        std::lock_guard<std::mutex> guard(shard->mutex);
+        if (!(flags & UFS_CREATE)) {
+            auto it = shard->files.find(key);
+            if (it == shard->files.end()) {
+                ufs_error_code = UFS_ERR_NO_FILE;
+                return -1;
+            }
+            target = it->second;
+        } else {
+            /* One probe to either find or insert. */
+            auto it_new = shard->files.try_emplace(key, nullptr);
+            auto it = it_new.first;
+            is_new = it_new.second;
+            if (is_new) {
+                it->second = new file();
+                it->second->name = key.name;
+                it->second->name_hash = key.hash;
+                it->second->block_shift = block_shift;
+                it->second->meta_update();
+                it->first.name = it->second->name;
+            }
+            target = it->second;
         }
-        target = new file();
-        target->name = filename;
-        all_files[filename] = target;
-    } else {
-        target = it->second;
+        /* Now the file can't be freed by ufs_delete(). */
+        target->refs++;
     }
+    if (is_new)
+        dir_add(parent, base, false);
+    if (tree_guard.owns_lock())
+        tree_guard.unlock();
 
     filedesc *desc = new filedesc{target, 0, flags};
-    target->refs++;
+    mem_meta += sizeof(filedesc);
+    {
+        std::unique_lock<std::shared_mutex> guard(target->lock);
+        rlist_add_tail(&target->descs, &desc->in_file);
+        if (flags & UFS_COMPRESS)
+            target->is_compressed = true;
+    }
 
-    int fd = -1;
+    int fd;
+    std::unique_lock<std::shared_mutex> guard(file_descriptors_lock);
 
     /** FD 0 reserved */
     if (file_descriptors.empty()) file_descriptors.push_back(nullptr);
 
-    for (size_t i = 1; i < file_descriptors.size(); ++i) {
-        if (file_descriptors[i] == nullptr) {
-            file_descriptors[i] = desc;
-            fd = i;
-            break;
-        }
-    }
-
-    if (fd == -1) {
+    if (!free_fds.empty()) {
+        fd = free_fds.back();
+        free_fds.pop_back();
+        file_descriptors[fd] = desc;
+    } else {
         file_descriptors.push_back(desc);
         fd = file_descriptors.size() - 1;
     }
@@ -113,129 +1221,1317 @@ int ufs_open(const char *filename, int flags) {
 }
 
 
-ssize_t ufs_write(int fd, const char *buf, size_t size) {
-    if (is_invalid_fd(fd)) {
-        ufs_error_code = UFS_ERR_NO_FILE;
-        return -1;
+/** Check the descriptor can write, or set the error code. */
+static bool filedesc_can_write(const filedesc *desc) {
+    if ((desc->flags & UFS_READ_ONLY) && !(desc->flags & UFS_WRITE_ONLY)) {
+        ufs_error_code = UFS_ERR_NO_PERMISSION;
+        return false;
     }
+    return true;
+}
 
-    filedesc *desc = file_descriptors[fd];
-    if ((desc->flags & UFS_READ_ONLY) && !(desc->flags & UFS_WRITE_ONLY)) {
+static bool filedesc_can_read(const filedesc *desc) {
+    if ((desc->flags & UFS_WRITE_ONLY) && !(desc->flags & UFS_READ_ONLY)) {
         ufs_error_code = UFS_ERR_NO_PERMISSION;
-        return -1;
+        return false;
     }
+    return true;
+}
 
-    if (desc->pos + size > MAX_FILE_SIZE) {
-        ufs_error_code = UFS_ERR_NO_MEM;
-        return -1;
+/** Descriptor allowed to write, or nullptr with the error code set. */
+static filedesc *filedesc_for_write(int fd) {
+    filedesc *desc = filedesc_get(fd);
+    if (desc == nullptr || !filedesc_can_write(desc))
+        return nullptr;
+    return desc;
+}
+
+static filedesc *filedesc_for_read(int fd) {
+    filedesc *desc = filedesc_get(fd);
+    if (desc == nullptr || !filedesc_can_read(desc))
+        return nullptr;
+    return desc;
+}
+
+static void file_unref(file *f);
+
+/**
+ * Tiered storage. The cold files with UFS_COMPRESS get their extents
+ * compressed. Then, with a backing directory set, the rest of their
+ * data is spilled: written into a backing file with pwrite(), and the
+ * blocks are freed. The next access faults the spilled data back in.
+ * The reads of the compressed extents decompress them piece by piece,
+ * the writes back into the blocks. The extents shared with the clones
+ * and the image ones stay, they aren't owned by one file or don't take
+ * the memory.
+ *
+ * The files are in an LRU by the last access. The access time is an
+ * epoch ticked by the spill thread, and a file is moved in the LRU only
+ * once per epoch, so most of the accesses only load an atomic. The
+ * thread handles the files not touched for the idle time, and a block
+ * allocation failing on the memory limit handles the coldest files
+ * right away.
+ */
+static std::mutex spill_mutex;
+static struct rlist spill_lru = RLIST_HEAD_INITIALIZER(spill_lru);
+static size_t spill_lru_size = 0;
+/** Empty when the spilling is off. */
+static std::string spill_dir;
+/** Epoch of the accesses. Never 0, which marks the files not in the LRU. */
+static std::atomic<uint64_t> spill_epoch(1);
+/** Backing file names. */
+static uint64_t spill_file_count = 0;
+static uint64_t spill_tick_ns = 0;
+static std::thread spill_thread;
+static std::condition_variable spill_cond;
+static bool spill_is_stopped = false;
+
+file::~file() {
+    {
+        std::lock_guard<std::mutex> guard(spill_mutex);
+        if (!rlist_empty(&in_lru)) {
+            rlist_del(&in_lru);
+            --spill_lru_size;
+        }
     }
+    if (!spill_path.empty())
+        unlink(spill_path.c_str());
+    shrink(0);
+    mem_meta -= meta_charged;
+}
 
-    file *f = desc->atfile;
+/** Move the file to the LRU tail, once per epoch. */
+static void file_touch(file *f) {
+    uint64_t epoch = spill_epoch.load(std::memory_order_relaxed);
+    if (f->lru_epoch.load(std::memory_order_relaxed) == epoch)
+        return;
+    std::lock_guard<std::mutex> guard(spill_mutex);
+    epoch = spill_epoch;
+    if (rlist_empty(&f->in_lru))
+        ++spill_lru_size;
+    rlist_move_tail(&spill_lru, &f->in_lru);
+    f->lru_epoch = epoch;
+}
+
+/**
+ * Take the file out of the LRU and pin it. The spill mutex must be
+ * held. False if the file is being freed.
+ */
+static bool spill_pick(file *f) {
+    rlist_del(&f->in_lru);
+    --spill_lru_size;
+    f->lru_epoch = 0;
+    std::lock_guard<std::mutex> guard(name_shard_of(f->name_hash)->mutex);
+    if (f->is_deleted && f->refs == 0)
+        return false;
+    ++f->refs;
+    return true;
+}
+
+/** The extent memory is owned by the file alone, and is from a pool. */
+static bool extent_is_owned(const extent &e) {
+    return e.memory != nullptr && !e.is_image && !e.is_inline && e.ref == nullptr;
+}
 
-    size_t needed_blocks = (desc->pos + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    while (f->blocks.size() < needed_blocks) {
-        f->blocks.push_back(new block());
+/** Write all the data at the offset, or fail. */
+static bool spill_pwrite(int fd, const char *data, size_t size, size_t offset) {
+    while (size > 0) {
+        ssize_t rc = pwrite(fd, data, size, offset);
+        if (rc <= 0)
+            return false;
+        data += rc;
+        size -= rc;
+        offset += rc;
     }
+    return true;
+}
 
-    size_t written = 0;
-    while (written < size) {
-        size_t block_idx = desc->pos / BLOCK_SIZE;
-        size_t offset = desc->pos % BLOCK_SIZE;
-        size_t to_write = std::min(size - written, (size_t)BLOCK_SIZE - offset);
+/** Read all the data from the offset, or fail. */
+static bool spill_pread(int fd, char *data, size_t size, size_t offset) {
+    while (size > 0) {
+        ssize_t rc = pread(fd, data, size, offset);
+        if (rc <= 0)
+            return false;
+        data += rc;
+        size -= rc;
+        offset += rc;
+    }
+    return true;
+}
 
-        std::memcpy(f->blocks[block_idx]->memory + offset, buf + written, to_write);
+/**
+ * Write the owned extents into the backing file at their offsets, and
+ * free the blocks. The file must be locked exclusively. Returns how
+ * much memory is freed, 0 on an error, then nothing is changed. The
+ * views of ufs_map() expire.
+ */
+static size_t file_spill(file *f) {
+    size_t freed = 0;
+    for (const extent &e : f->extents) {
+        if (extent_is_owned(e))
+            freed += (size_t)1 << e.shift;
+    }
+    if (freed == 0)
+        return 0;
+    /* A partially faulted in file keeps its backing file. */
+    if (f->spill_path.empty()) {
+        std::lock_guard<std::mutex> guard(spill_mutex);
+        if (spill_dir.empty())
+            return 0;
+        f->spill_path = spill_dir + "/ufs." + std::to_string(getpid()) +
+            "." + std::to_string(++spill_file_count);
+    }
+    int fd = open(f->spill_path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    bool is_ok = fd >= 0;
+    for (const extent &e : f->extents) {
+        if (!is_ok)
+            break;
+        if (!extent_is_owned(e))
+            continue;
+        is_ok = spill_pwrite(fd, e.memory, f->data_size(e), e.begin);
+    }
+    if (fd >= 0 && close(fd) != 0)
+        is_ok = false;
+    if (!is_ok) {
+        if (!f->is_spilled) {
+            unlink(f->spill_path.c_str());
+            f->spill_path.clear();
+        }
+        f->meta_update();
+        return 0;
+    }
+    for (extent &e : f->extents) {
+        if (!extent_is_owned(e))
+            continue;
+        block_delete(e.shift, e.memory);
+        e.memory = nullptr;
+        e.is_spilled = true;
+    }
+    mem_spilled += freed;
+    f->is_spilled = true;
+    f->meta_update();
+    ++f->version;
+    return freed;
+}
 
-        desc->pos += to_write;
-        written += to_write;
-        f->size = std::max(f->size, desc->pos);
+/**
+ * Read the spilled extents back. The file must be locked exclusively.
+ * On an error the rest stays spilled, the content is the same anyway.
+ */
+static bool file_fault_in(file *f) {
+    int fd = open(f->spill_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ufs_error_code = UFS_ERR_IO;
+        return false;
+    }
+    for (extent &e : f->extents) {
+        if (!e.is_spilled)
+            continue;
+        char *memory = f->block_alloc(e.shift);
+        if (memory == nullptr) {
+            close(fd);
+            ufs_error_code = UFS_ERR_NO_MEM;
+            return false;
+        }
+        if (!spill_pread(fd, memory, f->data_size(e), e.begin)) {
+            block_delete(e.shift, memory);
+            close(fd);
+            ufs_error_code = UFS_ERR_IO;
+            return false;
+        }
+        e.memory = memory;
+        e.is_spilled = false;
+        mem_spilled -= (size_t)1 << e.shift;
     }
+    close(fd);
+    unlink(f->spill_path.c_str());
+    std::string().swap(f->spill_path);
+    f->meta_update();
+    f->is_spilled = false;
+    return true;
+}
 
-    ufs_error_code = UFS_ERR_NO_ERR;
-    return written;
+/**
+ * Compress the owned extents. The file must be locked exclusively.
+ * Returns how much memory is freed. The views of ufs_map() expire.
+ */
+static size_t file_pack(file *f) {
+    size_t freed = 0;
+    for (extent &e : f->extents) {
+        if (!extent_is_owned(e))
+            continue;
+        size_t extent_size = (size_t)1 << e.shift;
+        size_t packed_size;
+        char *packed = extent_pack(e.memory, f->data_size(e), extent_size, &packed_size);
+        if (packed == nullptr)
+            continue;
+        /* Not charged, it replaces a bigger block. */
+        mem_data += packed_size;
+        mem_packed += packed_size;
+        mem_unpacked += extent_size;
+        block_delete(e.shift, e.memory);
+        e.memory = nullptr;
+        e.packed = packed;
+        freed += extent_size - packed_size;
+        f->is_packed = true;
+    }
+    if (freed > 0)
+        ++f->version;
+    return freed;
 }
 
+/**
+ * Decompress the extents back into the blocks. The file must be locked
+ * exclusively. On an error the rest stays compressed.
+ */
+static bool file_unpack(file *f) {
+    for (extent &e : f->extents) {
+        if (e.packed == nullptr)
+            continue;
+        char *memory = f->block_alloc(e.shift);
+        if (memory == nullptr) {
+            ufs_error_code = UFS_ERR_NO_MEM;
+            return false;
+        }
+        if (!pack_unpack(e.packed, f->data_size(e), memory)) {
+            block_delete(e.shift, memory);
+            ufs_error_code = UFS_ERR_IO;
+            return false;
+        }
+        extent_unpacked(&e);
+        e.memory = memory;
+    }
+    f->is_packed = false;
+    return true;
+}
 
-ssize_t ufs_read(int fd, char *buf, size_t size) {
-    if (is_invalid_fd(fd)) {
-        ufs_error_code = UFS_ERR_NO_FILE;
+/** Compress the file if it is to be, and spill the rest. */
+static size_t file_cool(file *f) {
+    size_t freed = f->is_compressed ? file_pack(f) : 0;
+    return freed + file_spill(f);
+}
+
+/**
+ * Touch the file and bring all its data into the blocks, or fail with
+ * the error code set. The file must be locked exclusively.
+ */
+static bool file_resident(file *f) {
+    file_touch(f);
+    return (!f->is_spilled || file_fault_in(f)) &&
+        (!f->is_packed || file_unpack(f));
+}
+
+/**
+ * Lock the file shared with all its data in memory, or fail with the
+ * error code set. The compressed extents stay such if allowed. A file
+ * which isn't ready is fixed under the exclusive lock first.
+ */
+static bool file_lock_read(file *f, std::shared_lock<std::shared_mutex> *guard,
+                           bool can_be_packed) {
+    guard->lock();
+    file_touch(f);
+    while (f->is_spilled || (f->is_packed && !can_be_packed)) {
+        guard->unlock();
+        {
+            std::unique_lock<std::shared_mutex> write_guard(f->lock);
+            if (!file_resident(f))
+                return false;
+        }
+        guard->lock();
+    }
+    return true;
+}
+
+static bool spill_reclaim(file *self) {
+    std::unique_lock<std::mutex> guard(spill_mutex);
+    for (size_t tries = spill_lru_size; tries > 0 && !rlist_empty(&spill_lru); --tries) {
+        file *f = rlist_first_entry(&spill_lru, file, in_lru);
+        if (f == self) {
+            rlist_move_tail(&spill_lru, &f->in_lru);
+            continue;
+        }
+        if (!spill_pick(f))
+            continue;
+        guard.unlock();
+        size_t freed = 0;
+        {
+            /* Only tried, two files are never waited for at once. */
+            std::unique_lock<std::shared_mutex> file_guard(f->lock, std::try_to_lock);
+            if (file_guard.owns_lock())
+                freed = file_cool(f);
+        }
+        file_unref(f);
+        if (freed > 0)
+            return true;
+        guard.lock();
+    }
+    return false;
+}
+
+/** Each tick cool down the files not touched for the idle time. */
+static void spill_thread_f(void) {
+    std::unique_lock<std::mutex> guard(spill_mutex);
+    while (true) {
+        spill_cond.wait_for(guard, std::chrono::nanoseconds(spill_tick_ns),
+            [] { return spill_is_stopped; });
+        if (spill_is_stopped)
+            return;
+        uint64_t epoch = spill_epoch + 1;
+        spill_epoch = epoch;
+        /* The LRU is ordered by the epochs. */
+        while (!spill_is_stopped && !rlist_empty(&spill_lru)) {
+            file *f = rlist_first_entry(&spill_lru, file, in_lru);
+            if (epoch - f->lru_epoch <= SPILL_IDLE_EPOCHS)
+                break;
+            if (!spill_pick(f))
+                continue;
+            guard.unlock();
+            {
+                std::unique_lock<std::shared_mutex> file_guard(f->lock);
+                /* Not touched since picked. */
+                if (f->lru_epoch == 0)
+                    file_cool(f);
+            }
+            file_unref(f);
+            guard.lock();
+        }
+    }
+}
+
+static void spill_thread_stop(void) {
+    if (!spill_thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> guard(spill_mutex);
+        spill_is_stopped = true;
+    }
+    spill_cond.notify_one();
+    spill_thread.join();
+    spill_is_stopped = false;
+}
+
+/**
+ * Share the owned extents the range completed, if equal to the indexed
+ * ones, or index them. The file must be locked exclusively.
+ */
+static void file_dedup(file *f, size_t pos, size_t end) {
+    for (auto it = f->extent_of(pos); it != f->extents.end() && it->begin < end; ++it) {
+        size_t extent_size = (size_t)1 << it->shift;
+        size_t last = it->begin + extent_size - 1;
+        if (last < pos || last >= end || f->data_size(*it) != extent_size ||
+            !extent_is_owned(*it))
+            continue;
+        uint64_t hash = dedup_hash(it->memory, extent_size, it->shift);
+        extent_ref *ref = nullptr;
+        {
+            std::lock_guard<std::mutex> guard(dedup_mutex);
+            auto range = dedup_index.equal_range(hash);
+            for (auto i = range.first; i != range.second; ++i) {
+                if (i->second->shift == it->shift &&
+                    memcmp(i->second->memory, it->memory, extent_size) == 0) {
+                    ref = i->second;
+                    break;
+                }
+            }
+            if (ref != nullptr) {
+                ++ref->count;
+                mem_deduped += extent_size;
+            } else {
+                ref = new extent_ref{1};
+                ref->is_indexed = true;
+                ref->shift = it->shift;
+                ref->hash = hash;
+                ref->memory = it->memory;
+                dedup_index.emplace(hash, ref);
+                mem_meta += sizeof(extent_ref);
+                it->ref = ref;
+                continue;
+            }
+        }
+        block_delete(it->shift, it->memory);
+        it->memory = ref->memory;
+        it->ref = ref;
+    }
+}
+
+/** Copy the buffers one by one to the offset, the range is writable. */
+static void file_copy_in(file *f, size_t pos, const struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; ++i) {
+        const char *buf = (const char *)iov[i].iov_base;
+        f->for_each(pos, iov[i].iov_len, [&](char *memory, size_t len) {
+            std::memcpy(memory, buf, len);
+            buf += len;
+        });
+        pos += iov[i].iov_len;
+    }
+}
+
+/**
+ * Write the buffers one by one from the offset, all or nothing. The
+ * file must be locked exclusively.
+ */
+static ssize_t file_writev(file *f, size_t pos, const struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        total += iov[i].iov_len;
+    if (pos > MAX_FILE_SIZE || total > MAX_FILE_SIZE - pos) {
+        ufs_error_code = UFS_ERR_NO_MEM;
+        return -1;
+    }
+    if (!file_resident(f))
         return -1;
+    if (f->ranges == nullptr && total > 0 && pos + total <= f->size) {
+        f->ranges.reset(new file_ranges());
+        f->meta_update();
     }
 
-    filedesc *desc = file_descriptors[fd];
-    if ((desc->flags & UFS_WRITE_ONLY) && !(desc->flags & UFS_READ_ONLY)) {
-        ufs_error_code = UFS_ERR_NO_PERMISSION;
+    f->reserve(pos + total);
+    if (!f->materialize(pos, total, true) ||
+        (pos > f->size && !f->materialize(f->size, pos - f->size, false))) {
+        ufs_error_code = UFS_ERR_NO_MEM;
         return -1;
     }
+    /*
+     * A gap after the file end. Its holes are zeros anyway, but the
+     * allocated blocks are not zeroed.
+     */
+    if (pos > f->size) {
+        f->for_each(f->size, pos - f->size, [](char *memory, size_t len) {
+            if (memory != nullptr)
+                std::memset(memory, 0, len);
+        });
+    }
+    file_copy_in(f, pos, iov, iovcnt);
+    size_t end = pos + total;
+    f->size = std::max(f->size, end);
+    ++f->version;
+    PROBE4(userfs, write, f, pos, total, false);
+    if (dedup_is_on.load(std::memory_order_relaxed))
+        file_dedup(f, pos, end);
 
-    file *f = desc->atfile;
-    if (desc->pos >= f->size || size == 0) return 0;
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return total;
+}
+
+/**
+ * Overwrite in place, if the file has the ranges, and the range is
+ * within the size and all in the owned blocks: then the extents stay
+ * the same, and the write takes only the shared lock and the range.
+ * The position is moved under the lock. False if the write doesn't
+ * qualify, then nothing is done, and it must go the exclusive way.
+ */
+static bool file_writev_shared(file *f, size_t *pos, const struct iovec *iov,
+                               int iovcnt, ssize_t *rc) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        total += iov[i].iov_len;
+    std::shared_lock<std::shared_mutex> guard(f->lock);
+    if (f->ranges == nullptr || f->is_spilled || f->is_packed || total == 0 ||
+        *pos > f->size || total > f->size - *pos ||
+        dedup_is_on.load(std::memory_order_relaxed))
+        return false;
+    bool is_owned = true;
+    f->for_each_piece(*pos, total, [&](const extent &e, size_t, size_t) {
+        is_owned = is_owned && e.memory != nullptr && !e.is_inline && e.ref == nullptr;
+    });
+    if (!is_owned)
+        return false;
+    file_touch(f);
+    {
+        file_range_guard range(f->ranges.get(), *pos, *pos + total, true);
+        file_copy_in(f, *pos, iov, iovcnt);
+    }
+    ++f->version;
+    PROBE4(userfs, write, f, *pos, total, true);
+    *pos += total;
+    *rc = total;
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return true;
+}
 
-    size_t to_read_total = std::min(size, f->size - desc->pos);
+/**
+ * Fill the buffers one by one from the offset, until the file end.
+ * The file must be locked at least shared, and not spilled.
+ */
+static ssize_t file_readv(file *f, size_t pos, const struct iovec *iov, int iovcnt) {
     size_t read_bytes = 0;
+    bool is_ok = true;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        total += iov[i].iov_len;
+    size_t end = pos < f->size ? pos + std::min(total, f->size - pos) : pos;
+    file_range_guard range(f->ranges.get(), pos, end, false);
+    for (int i = 0; i < iovcnt && pos < f->size; ++i) {
+        size_t len = std::min(iov[i].iov_len, f->size - pos);
+        char *buf = (char *)iov[i].iov_base;
+        f->for_each_piece(pos, len, [&](const extent &e, size_t offset, size_t n) {
+            if (e.memory != nullptr)
+                std::memcpy(buf, e.memory + offset, n);
+            else if (e.packed != nullptr)
+                is_ok = is_ok && pack_read(e.packed, f->data_size(e), offset, buf, n);
+            else
+                std::memset(buf, 0, n);
+            buf += n;
+        });
+        pos += len;
+        read_bytes += len;
+    }
+    if (!is_ok) {
+        ufs_error_code = UFS_ERR_IO;
+        return -1;
+    }
+
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return read_bytes;
+}
+
+
+ssize_t ufs_write(int fd, const char *buf, size_t size) {
+    struct iovec iov = {(void *)buf, size};
+    return ufs_writev(fd, &iov, 1);
+}
+
+
+ssize_t ufs_writev(int fd, const struct iovec *iov, int iovcnt) {
+    filedesc *desc = filedesc_for_write(fd);
+    if (desc == nullptr)
+        return -1;
+    ssize_t rc;
+    if ((desc->flags & UFS_APPEND) == 0 &&
+        file_writev_shared(desc->atfile, &desc->pos, iov, iovcnt, &rc))
+        return rc;
+    std::unique_lock<std::shared_mutex> guard(desc->atfile->lock);
+    if (desc->flags & UFS_APPEND)
+        desc->pos = desc->atfile->size;
+    rc = file_writev(desc->atfile, desc->pos, iov, iovcnt);
+    if (rc > 0)
+        desc->pos += rc;
+    return rc;
+}
+
 
-    while (read_bytes < to_read_total) {
-        size_t block_idx = desc->pos / BLOCK_SIZE;
-        size_t offset = desc->pos % BLOCK_SIZE;
-        size_t to_read = std::min(to_read_total - read_bytes, (size_t)BLOCK_SIZE - offset);
+ssize_t ufs_pwrite(int fd, const char *buf, size_t size, size_t offset) {
+    filedesc *desc = filedesc_for_write(fd);
+    if (desc == nullptr)
+        return -1;
+    struct iovec iov = {(void *)buf, size};
+    ssize_t rc;
+    if (file_writev_shared(desc->atfile, &offset, &iov, 1, &rc))
+        return rc;
+    std::unique_lock<std::shared_mutex> guard(desc->atfile->lock);
+    return file_writev(desc->atfile, offset, &iov, 1);
+}
+
+
+ssize_t ufs_read(int fd, char *buf, size_t size) {
+    struct iovec iov = {buf, size};
+    return ufs_readv(fd, &iov, 1);
+}
+
+
+ssize_t ufs_readv(int fd, const struct iovec *iov, int iovcnt) {
+    filedesc *desc = filedesc_for_read(fd);
+    if (desc == nullptr)
+        return -1;
+    std::shared_lock<std::shared_mutex> guard(desc->atfile->lock, std::defer_lock);
+    if (!file_lock_read(desc->atfile, &guard, true))
+        return -1;
+    ssize_t rc = file_readv(desc->atfile, desc->pos, iov, iovcnt);
+    if (rc > 0)
+        desc->pos += rc;
+    return rc;
+}
+
+
+ssize_t ufs_pread(int fd, char *buf, size_t size, size_t offset) {
+    filedesc *desc = filedesc_for_read(fd);
+    if (desc == nullptr)
+        return -1;
+    struct iovec iov = {buf, size};
+    std::shared_lock<std::shared_mutex> guard(desc->atfile->lock, std::defer_lock);
+    if (!file_lock_read(desc->atfile, &guard, true))
+        return -1;
+    return file_readv(desc->atfile, offset, &iov, 1);
+}
 
-        std::memcpy(buf + read_bytes, f->blocks[block_idx]->memory + offset, to_read);
 
-        desc->pos += to_read;
-        read_bytes += to_read;
+ssize_t ufs_map(int fd, size_t offset, size_t len, struct iovec *iov, int *iovcnt) {
+    filedesc *desc = filedesc_for_read(fd);
+    if (desc == nullptr)
+        return -1;
+    file *f = desc->atfile;
+    std::shared_lock<std::shared_mutex> guard(f->lock, std::defer_lock);
+    if (!file_lock_read(f, &guard, false))
+        return -1;
+    int count = 0;
+    size_t mapped = 0;
+    if (offset < f->size) {
+        len = std::min(len, f->size - offset);
+        f->for_each(offset, len, [&](char *memory, size_t n) {
+            if (count == *iovcnt)
+                return;
+            iov[count].iov_base = memory != nullptr ? memory : zero_extent;
+            iov[count].iov_len = n;
+            ++count;
+            mapped += n;
+        });
     }
+    *iovcnt = count;
+    desc->map_version = f->version;
+    desc->has_map = true;
 
     ufs_error_code = UFS_ERR_NO_ERR;
-    return read_bytes;
+    return mapped;
 }
 
 
-int ufs_close(int fd) {
-    if (is_invalid_fd(fd)) {
-        ufs_error_code = UFS_ERR_NO_FILE;
+int ufs_fstat(int fd, struct ufs_stat *st) {
+    filedesc *desc = filedesc_get(fd);
+    if (desc == nullptr)
+        return -1;
+    std::shared_lock<std::shared_mutex> guard(desc->atfile->lock);
+    st->size = desc->atfile->size;
+    st->allocated = desc->atfile->allocated;
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return 0;
+}
+
+
+int ufs_map_check(int fd) {
+    filedesc *desc = filedesc_get(fd);
+    if (desc == nullptr)
+        return -1;
+    std::shared_lock<std::shared_mutex> guard(desc->atfile->lock);
+    if (!desc->has_map || desc->map_version != desc->atfile->version) {
+        ufs_error_code = UFS_ERR_MAP_EXPIRED;
         return -1;
     }
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return 0;
+}
 
-    filedesc *desc = file_descriptors[fd];
-    file *f = desc->atfile;
 
-    f->refs--;
-    if (f->refs == 0 && f->is_deleted) {
+/** Drop a reference, free the file if it was the last one of a deleted file. */
+static void file_unref(file *f) {
+    bool is_free;
+    {
+        std::lock_guard<std::mutex> guard(name_shard_of(f->name_hash)->mutex);
+        is_free = --f->refs == 0 && f->is_deleted;
+    }
+    if (is_free)
         delete f;
+}
+
+
+int ufs_close(int fd) {
+    filedesc *desc;
+    {
+        std::unique_lock<std::shared_mutex> guard(file_descriptors_lock);
+        if (fd <= 0 || fd >= (int)file_descriptors.size() || file_descriptors[fd] == nullptr) {
+            ufs_error_code = UFS_ERR_NO_FILE;
+            return -1;
+        }
+        desc = file_descriptors[fd];
+        file_descriptors[fd] = nullptr;
+        free_fds.push_back(fd);
+    }
+
+    file *f = desc->atfile;
+    {
+        std::unique_lock<std::shared_mutex> guard(f->lock);
+        rlist_del(&desc->in_file);
     }
+    file_unref(f);
 
     delete desc;
-    file_descriptors[fd] = nullptr;
+    mem_meta -= sizeof(filedesc);
     return 0;
 }
 
 
+/**
+ * Drop the name from the index. Returns the file if it has to be
+ * freed by the caller.
+ */
+static file *name_remove(const name_key &key, bool *is_found) {
+    name_shard *shard = name_shard_of(key.hash);
+    std::lock_guard<std::mutex> guard(shard->mutex);
+    auto it = shard->files.find(key);
+    if (it == shard->files.end()) {
+        *is_found = false;
+        return nullptr;
+    }
+    *is_found = true;
+    file *f = it->second;
+    shard->files.erase(it);
+    f->is_deleted = true;
+    return f->refs == 0 ? f : nullptr;
+}
+
+
 int ufs_delete(const char *filename) {
-    auto it = all_files.find(filename);
-    if (it == all_files.end()) {
+    name_key key(filename);
+    std::string_view parent, base;
+    bool is_found = false;
+    file *f = nullptr;
+    if (path_split(key.name, &parent, &base)) {
+        std::shared_lock<std::shared_mutex> tree_guard(tree_lock);
+        f = name_remove(key, &is_found);
+        if (is_found) {
+            dir *d = dir_find(parent);
+            std::lock_guard<std::mutex> guard(d->mutex);
+            d->remove(base);
+        }
+    }
+    if (!is_found) {
         ufs_error_code = UFS_ERR_NO_FILE;
         return -1;
     }
+    delete f;
+    return 0;
+}
 
-    file *f = it->second;
-    all_files.erase(it);
-    f->is_deleted = true;
 
-    if (f->refs == 0) {
+int ufs_mkdir(const char *path) {
+    std::lock_guard<std::shared_mutex> tree_guard(tree_lock);
+    std::string_view name;
+    dir *parent = dir_for_new(path, &name);
+    if (parent == nullptr)
+        return -1;
+    name_key key(path);
+    {
+        name_shard *shard = name_shard_of(key.hash);
+        std::lock_guard<std::mutex> guard(shard->mutex);
+        if (shard->files.count(key) != 0) {
+            ufs_error_code = UFS_ERR_INVALID_ARG;
+            return -1;
+        }
+    }
+    dir *d = new dir();
+    d->path = path;
+    dirs.emplace(name_key(d->path), d);
+    parent->add(name, true);
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return 0;
+}
+
+
+/** Delete all in the directory and itself. The tree lock must be exclusive. */
+static void dir_delete(dir *d, std::vector<file *> *to_free) {
+    for (const dir_entry &e : d->entries) {
+        std::string path = dir_child_path(d, *e.name);
+        if (e.is_dir) {
+            dir_delete(dir_find(path), to_free);
+            continue;
+        }
+        bool is_found;
+        file *f = name_remove(name_key(path), &is_found);
+        if (f != nullptr)
+            to_free->push_back(f);
+    }
+    dirs.erase(name_key(d->path));
+    delete d;
+}
+
+
+int ufs_rmdir(const char *path) {
+    std::vector<file *> to_free;
+    {
+        std::lock_guard<std::shared_mutex> tree_guard(tree_lock);
+        std::string_view parent, name;
+        dir *d = path_split(path, &parent, &name) ? dir_find(path) : nullptr;
+        if (d == nullptr) {
+            ufs_error_code = UFS_ERR_NO_FILE;
+            return -1;
+        }
+        dir_find(parent)->remove(name);
+        dir_delete(d, &to_free);
+    }
+    for (file *f : to_free)
         delete f;
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return 0;
+}
+
+
+int ufs_readdir(const char *path, size_t *cursor, struct ufs_dirent *ent) {
+    std::shared_lock<std::shared_mutex> tree_guard(tree_lock);
+    dir *d = dir_find(path);
+    if (d == nullptr) {
+        ufs_error_code = UFS_ERR_NO_FILE;
+        return -1;
+    }
+    std::lock_guard<std::mutex> guard(d->mutex);
+    ufs_error_code = UFS_ERR_NO_ERR;
+    if (*cursor >= d->entries.size())
+        return 0;
+    const dir_entry &e = d->entries[(*cursor)++];
+    memcpy(ent->name, e.name->c_str(), e.name->size() + 1);
+    ent->is_dir = e.is_dir;
+    return 1;
+}
+
+
+int ufs_clone(const char *src, const char *dst) {
+    name_key src_key(src);
+    name_shard *shard = name_shard_of(src_key.hash);
+    file *from;
+    {
+        std::lock_guard<std::mutex> guard(shard->mutex);
+        auto it = shard->files.find(src_key);
+        if (it == shard->files.end()) {
+            ufs_error_code = UFS_ERR_NO_FILE;
+            return -1;
+        }
+        from = it->second;
+        ++from->refs;
+    }
+
+    std::shared_lock<std::shared_mutex> tree_guard(tree_lock);
+    std::string_view base;
+    dir *parent = dir_for_new(dst, &base);
+    if (parent == nullptr) {
+        file_unref(from);
+        return -1;
+    }
+    file *to = new file();
+    to->name = dst;
+    to->name_hash = name_key(to->name).hash;
+    {
+        /* Exclusive, because the source extents get the refs. */
+        std::unique_lock<std::shared_mutex> guard(from->lock);
+        if (!file_resident(from)) {
+            guard.unlock();
+            delete to;
+            file_unref(from);
+            return -1;
+        }
+        to->block_shift = from->block_shift;
+        to->is_compressed = from->is_compressed;
+        to->size = from->size;
+        to->capacity = from->capacity;
+        to->allocated = from->allocated;
+        to->extents = from->extents;
+        for (size_t i = 0; i < to->extents.size(); ++i) {
+            extent &e = from->extents[i];
+            if (e.memory == nullptr)
+                continue;
+            if (e.is_inline) {
+                std::memcpy(to->inline_data, from->inline_data, FILE_INLINE_SIZE);
+                to->extents[i].memory = to->inline_data;
+                continue;
+            }
+            if (e.ref == nullptr) {
+                e.ref = new extent_ref{1};
+                mem_meta += sizeof(extent_ref);
+            }
+            if (e.ref->is_indexed)
+                mem_deduped += (size_t)1 << e.shift;
+            ++e.ref->count;
+            to->extents[i].ref = e.ref;
+        }
+        to->meta_update();
     }
+    file_unref(from);
+
+    shard = name_shard_of(to->name_hash);
+    bool is_new = false;
+    {
+        std::lock_guard<std::mutex> guard(shard->mutex);
+        if (shard->files.try_emplace(name_key(to->name), to).second)
+            is_new = true;
+    }
+    if (is_new) {
+        dir_add(parent, base, false);
+        ufs_error_code = UFS_ERR_NO_ERR;
+        return 0;
+    }
+    delete to;
+    ufs_error_code = UFS_ERR_INVALID_ARG;
+    return -1;
+}
+
+
+int ufs_set_block_size(size_t size) {
+    for (int shift = BLOCK_SHIFT_MIN; shift <= BLOCK_SHIFT_MAX; ++shift) {
+        if (size == (size_t)1 << shift) {
+            block_shift = shift;
+            ufs_error_code = UFS_ERR_NO_ERR;
+            return 0;
+        }
+    }
+    ufs_error_code = UFS_ERR_INVALID_ARG;
+    return -1;
+}
 
+
+void ufs_set_mem_limit(size_t size) {
+    mem_limit = size;
+}
+
+
+void ufs_memstats(struct ufs_memstats *st) {
+    st->data = mem_data;
+    st->meta = mem_meta;
+    st->limit = mem_limit;
+    st->spilled = mem_spilled;
+    st->packed = mem_packed;
+    st->unpacked = mem_unpacked;
+    st->deduped = mem_deduped;
+}
+
+
+void ufs_set_dedup(bool is_on) {
+    dedup_is_on = is_on;
+}
+
+
+int ufs_set_backing_dir(const char *path) {
+    struct stat st;
+    if (path != nullptr && (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))) {
+        ufs_error_code = UFS_ERR_IO;
+        return -1;
+    }
+    std::lock_guard<std::mutex> guard(spill_mutex);
+    if (path == nullptr)
+        std::string().swap(spill_dir);
+    else
+        spill_dir = path;
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return 0;
+}
+
+
+void ufs_set_idle_time(uint64_t idle_ms) {
+    spill_thread_stop();
+    if (idle_ms == 0)
+        return;
+    std::lock_guard<std::mutex> guard(spill_mutex);
+    spill_tick_ns = idle_ms * 1000000 / SPILL_IDLE_EPOCHS;
+    spill_thread = std::thread(spill_thread_f);
+}
+
+
+/** Free all the names, files and directories. Not thread-safe. */
+static void names_clear(void) {
+    for (name_shard &shard : name_shards) {
+        for (auto& [name, f] : shard.files) {
+            delete f;
+        }
+        std::unordered_map<name_key, file*, name_key_hash> mtmp;
+        std::swap(mtmp, shard.files);
+    }
+    for (auto& [path, d] : dirs) {
+        delete d;
+    }
+    std::unordered_map<name_key, dir*, name_key_hash> dtmp;
+    std::swap(dtmp, dirs);
+    std::vector<dir_entry> etmp;
+    std::swap(etmp, root_dir.entries);
+    std::unordered_map<std::string, size_t> itmp;
+    std::swap(itmp, root_dir.index);
+}
+
+
+/** Add the loaded file and its missing parent directories. */
+static bool image_add_file(file *f) {
+    std::string_view parent, name;
+    if (!path_split(f->name, &parent, &name) || dir_find(f->name) != nullptr) {
+        delete f;
+        return false;
+    }
+    dir *d = &root_dir;
+    /* mkdir -p */
+    for (size_t end = 0; end < parent.size(); ++end) {
+        end = parent.find('/', end);
+        if (end == std::string_view::npos)
+            end = parent.size();
+        std::string_view path = parent.substr(0, end);
+        dir *next = dir_find(path);
+        if (next == nullptr) {
+            name_key key(path);
+            if (name_shard_of(key.hash)->files.count(key) != 0) {
+                delete f;
+                return false;
+            }
+            next = new dir();
+            next->path = path;
+            dirs.emplace(name_key(next->path), next);
+            d->add(path.substr(d->path.empty() ? 0 : d->path.size() + 1), true);
+        }
+        d = next;
+    }
+    name_shard *shard = name_shard_of(f->name_hash);
+    if (!shard->files.try_emplace(name_key(f->name), f).second) {
+        delete f;
+        return false;
+    }
+    d->add(name, false);
+    return true;
+}
+
+
+/**
+ * Image layout: the header, then the records of the files one by one.
+ * A record is the header, the extent flags, the name, and the
+ * allocated extents. Each of them takes its full size, but only the
+ * data part is written, the rest is a hole in the image file. The
+ * extents and the record headers are aligned to 8 bytes.
+ */
+static const char image_magic[8] = {'U', 'F', 'S', 'I', 'M', 'G', '1', 0};
+
+struct image_header {
+    char magic[8];
+    uint64_t file_count;
+};
+
+struct image_file {
+    uint64_t size;
+    uint32_t name_len;
+    uint32_t block_shift;
+    /** Followed by a byte per extent, 1 if it is allocated. */
+    uint32_t extent_count;
+    uint32_t padding;
+};
+
+static size_t image_align(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+/** Mappings of the loaded images, they live until ufs_destroy(). */
+struct image_map {
+    void *memory;
+    size_t size;
+};
+
+static std::vector<image_map> image_maps;
+static std::mutex image_maps_lock;
+
+/** Write all the data, or fail. */
+static bool image_write(int fd, const void *data, size_t size) {
+    const char *pos = (const char *)data;
+    while (size > 0) {
+        ssize_t rc = write(fd, pos, size);
+        if (rc <= 0)
+            return false;
+        pos += rc;
+        size -= rc;
+    }
+    return true;
+}
+
+/** Write a record of the file. It must be locked at least shared. */
+static bool image_write_file(int fd, file *f, size_t *offset) {
+    image_file h;
+    memset(&h, 0, sizeof(h));
+    h.size = f->size;
+    h.name_len = f->name.size();
+    h.block_shift = f->block_shift;
+    h.extent_count = f->extents.size();
+    std::string meta((const char *)&h, sizeof(h));
+    for (const extent &e : f->extents)
+        meta += (char)(e.memory != nullptr);
+    meta += f->name;
+    meta.resize(image_align(meta.size()), 0);
+    if (!image_write(fd, meta.data(), meta.size()))
+        return false;
+    *offset += meta.size();
+
+    for (const extent &e : f->extents) {
+        if (e.memory == nullptr)
+            continue;
+        size_t extent_size = (size_t)1 << e.shift;
+        size_t len = f->size > e.begin ? std::min(f->size - e.begin, extent_size) : 0;
+        if (!image_write(fd, e.memory, len))
+            return false;
+        *offset += extent_size;
+        if (lseek(fd, *offset, SEEK_SET) < 0)
+            return false;
+    }
+    return true;
+}
+
+
+int ufs_save(const char *path) {
+    /* Pin the files, so a concurrent delete doesn't free them. */
+    std::vector<file *> files;
+    for (name_shard &shard : name_shards) {
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        for (auto &[key, f] : shard.files) {
+            ++f->refs;
+            files.push_back(f);
+        }
+    }
+
+    std::string tmp_path = std::string(path) + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool is_ok = fd >= 0;
+    image_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, image_magic, sizeof(h.magic));
+    h.file_count = files.size();
+    size_t offset = sizeof(h);
+    is_ok = is_ok && image_write(fd, &h, sizeof(h));
+    for (file *f : files) {
+        if (is_ok) {
+            std::shared_lock<std::shared_mutex> guard(f->lock, std::defer_lock);
+            is_ok = file_lock_read(f, &guard, false);
+            file_range_guard range(f->ranges.get(), 0, is_ok ? f->size : 0, false);
+            is_ok = is_ok && image_write_file(fd, f, &offset);
+        }
+        file_unref(f);
+    }
+    /* The last extent may end with a hole, which write() didn't make. */
+    is_ok = is_ok && ftruncate(fd, offset) == 0;
+    if (fd >= 0 && close(fd) != 0)
+        is_ok = false;
+    if (is_ok && rename(tmp_path.c_str(), path) != 0)
+        is_ok = false;
+    if (!is_ok) {
+        unlink(tmp_path.c_str());
+        ufs_error_code = UFS_ERR_IO;
+        return -1;
+    }
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return 0;
+}
+
+
+/** Build a file from the record at the offset, or nullptr if it is broken. */
+static file *image_read_file(char *image, size_t image_size, size_t *offset) {
+    image_file h;
+    if (image_size - *offset < sizeof(h))
+        return nullptr;
+    memcpy(&h, image + *offset, sizeof(h));
+    *offset += sizeof(h);
+    if (h.block_shift < BLOCK_SHIFT_MIN || h.block_shift > BLOCK_SHIFT_MAX ||
+        h.size > MAX_FILE_SIZE || image_size - *offset < (size_t)h.extent_count + h.name_len)
+        return nullptr;
+    const char *flags = image + *offset;
+    file *f = new file();
+    f->block_shift = h.block_shift;
+    f->name.assign(flags + h.extent_count, h.name_len);
+    f->name_hash = name_key(f->name).hash;
+    f->size = h.size;
+    /* The extent sizes only depend on the block size and the number. */
+    while (f->extents.size() < h.extent_count && f->capacity < MAX_FILE_SIZE)
+        f->reserve(f->capacity + 1);
+    *offset += image_align(sizeof(h) + h.extent_count + h.name_len) - sizeof(h);
+    if (f->extents.size() != h.extent_count || f->capacity < f->size ||
+        *offset > image_size) {
+        delete f;
+        return nullptr;
+    }
+    for (size_t i = 0; i < f->extents.size(); ++i) {
+        if (flags[i] == 0)
+            continue;
+        extent &e = f->extents[i];
+        size_t extent_size = (size_t)1 << e.shift;
+        if (image_size - *offset < extent_size) {
+            delete f;
+            return nullptr;
+        }
+        e.memory = image + *offset;
+        e.is_image = true;
+        e.ref = nullptr;
+        f->allocated += extent_size;
+        *offset += extent_size;
+    }
+    return f;
+}
+
+
+int ufs_load(const char *path) {
+    if (!root_dir.entries.empty()) {
+        ufs_error_code = UFS_ERR_INVALID_ARG;
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ufs_error_code = UFS_ERR_IO;
+        return -1;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(image_header)) {
+        /* Private and writable: the writes copy the pages, not touch the image. */
+        map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    image_header h;
+    if (map == MAP_FAILED ||
+        memcmp(map, image_magic, sizeof(image_magic)) != 0) {
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+        ufs_error_code = UFS_ERR_IO;
+        return -1;
+    }
+    memcpy(&h, map, sizeof(h));
+
+    /* Only the metadata is read, the data pages are not touched. */
+    std::vector<file *> files;
+    size_t offset = sizeof(h);
+    for (uint64_t i = 0; i < h.file_count; ++i) {
+        file *f = image_read_file((char *)map, st.st_size, &offset);
+        if (f == nullptr) {
+            for (file *loaded : files)
+                delete loaded;
+            munmap(map, st.st_size);
+            ufs_error_code = UFS_ERR_IO;
+            return -1;
+        }
+        files.push_back(f);
+    }
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!image_add_file(files[i])) {
+            for (++i; i < files.size(); ++i)
+                delete files[i];
+            names_clear();
+            munmap(map, st.st_size);
+            ufs_error_code = UFS_ERR_IO;
+            return -1;
+        }
+    }
+    std::lock_guard<std::mutex> guard(image_maps_lock);
+    image_maps.push_back({map, (size_t)st.st_size});
+    ufs_error_code = UFS_ERR_NO_ERR;
     return 0;
 }
 
 
 #if NEED_RESIZE
-int ufs_resize(int fd, size_t new_size) {
-    if (is_invalid_fd(fd)) {
-        ufs_error_code = UFS_ERR_NO_FILE;
+/** Resize the file, it must be locked exclusively. */
+static int file_resize(file *f, size_t new_size) {
+    if (!file_resident(f))
         return -1;
+    if (new_size > f->size) {
+        /* The new extents are holes, only the allocated tail is zeroed. */
+        f->reserve(new_size);
+        if (!f->materialize(f->size, new_size - f->size, false)) {
+            ufs_error_code = UFS_ERR_NO_MEM;
+            return -1;
+        }
+        f->for_each(f->size, new_size - f->size, [](char *memory, size_t len) {
+            if (memory != nullptr)
+                std::memset(memory, 0, len);
+        });
+    } else {
+        f->shrink(new_size);
     }
+    f->size = new_size;
+    ++f->version;
+
+    filedesc *d;
+    rlist_foreach_entry(d, &f->descs, in_file)
+        d->pos = std::min(d->pos, f->size);
+
+    return 0;
+}
 
-    filedesc *desc = file_descriptors[fd];
+int ufs_resize(int fd, size_t new_size) {
+    filedesc *desc = filedesc_get(fd);
+    if (desc == nullptr)
+        return -1;
     file *f = desc->atfile;
 
     if (new_size > MAX_FILE_SIZE) {
@@ -243,45 +2539,230 @@ int ufs_resize(int fd, size_t new_size) {
         return -1;
     }
 
-    size_t needed_blocks = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    if (new_size == 0) needed_blocks = 0;
+    std::unique_lock<std::shared_mutex> guard(f->lock);
+    return file_resize(f, new_size);
+}
+#endif
+
+struct ufs_ring {
+    /** Entries in flight, queued and completed. */
+    unsigned entries = 0;
+    std::vector<ufs_sqe> sq;
+    /** Queued operations, at the start of sq. */
+    unsigned sq_count = 0;
+    std::vector<ufs_cqe> cq;
+    /** The oldest completion and the number of them. */
+    unsigned cq_head = 0;
+    unsigned cq_count = 0;
+    /** Descriptors of the submitted operations, nullptr if bad. */
+    std::vector<filedesc *> descs;
+    /** Indexes of the submitted operations, by file. */
+    std::vector<unsigned> order;
+    /** Completions of the submitted operations, by index. */
+    std::vector<ufs_cqe> results;
+};
 
-    while (f->blocks.size() < needed_blocks) {
-        f->blocks.push_back(new block());
+struct ufs_ring *ufs_ring_new(unsigned entries) {
+    if (entries == 0) {
+        ufs_error_code = UFS_ERR_INVALID_ARG;
+        return nullptr;
     }
-    while (f->blocks.size() > needed_blocks) {
-        delete f->blocks.back();
-        f->blocks.pop_back();
+    ufs_ring *ring = new ufs_ring();
+    ring->entries = entries;
+    ring->sq.resize(entries);
+    ring->cq.resize(entries);
+    ring->descs.resize(entries);
+    ring->order.resize(entries);
+    ring->results.resize(entries);
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return ring;
+}
+
+void ufs_ring_delete(struct ufs_ring *ring) {
+    delete ring;
+}
+
+struct ufs_sqe *ufs_ring_get_sqe(struct ufs_ring *ring) {
+    if (ring->sq_count + ring->cq_count >= ring->entries)
+        return nullptr;
+    ufs_sqe *sqe = &ring->sq[ring->sq_count++];
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static bool ufs_op_is_write(enum ufs_op op) {
+    return op != UFS_OP_READ && op != UFS_OP_PREAD;
+}
+
+/** Do one operation, its file is locked and resident. */
+static ssize_t ring_op_run(filedesc *desc, const ufs_sqe *sqe) {
+    file *f = desc->atfile;
+    struct iovec iov = {sqe->buf, sqe->size};
+    ssize_t rc;
+    switch (sqe->op) {
+    case UFS_OP_READ:
+        if (!filedesc_can_read(desc))
+            return -1;
+        rc = file_readv(f, desc->pos, &iov, 1);
+        if (rc > 0)
+            desc->pos += rc;
+        return rc;
+    case UFS_OP_WRITE:
+        if (!filedesc_can_write(desc))
+            return -1;
+        if (desc->flags & UFS_APPEND)
+            desc->pos = f->size;
+        rc = file_writev(f, desc->pos, &iov, 1);
+        if (rc > 0)
+            desc->pos += rc;
+        return rc;
+    case UFS_OP_PREAD:
+        if (!filedesc_can_read(desc))
+            return -1;
+        return file_readv(f, sqe->offset, &iov, 1);
+    case UFS_OP_PWRITE:
+        if (!filedesc_can_write(desc))
+            return -1;
+        return file_writev(f, sqe->offset, &iov, 1);
+#if NEED_RESIZE
+    case UFS_OP_RESIZE:
+        if (sqe->size > MAX_FILE_SIZE) {
+            ufs_error_code = UFS_ERR_NO_MEM;
+            return -1;
+        }
+        return file_resize(f, sqe->size);
+#endif
     }
+    ufs_error_code = UFS_ERR_INVALID_ARG;
+    return -1;
+}
 
-    f->size = new_size;
+/**
+ * Do the operations of one file, order[begin, end), under one lock.
+ * It is exclusive if any of them changes the file.
+ */
+static void ring_file_run(ufs_ring *ring, unsigned begin, unsigned end) {
+    file *f = ring->descs[ring->order[begin]]->atfile;
+    bool is_write = false;
+    for (unsigned i = begin; i < end && !is_write; ++i)
+        is_write = ufs_op_is_write(ring->sq[ring->order[i]].op);
+    std::unique_lock<std::shared_mutex> write_guard(f->lock, std::defer_lock);
+    std::shared_lock<std::shared_mutex> read_guard(f->lock, std::defer_lock);
+    bool is_ok;
+    if (is_write) {
+        write_guard.lock();
+        is_ok = file_resident(f);
+    } else {
+        is_ok = file_lock_read(f, &read_guard, true);
+    }
+    for (unsigned i = begin; i < end; ++i) {
+        unsigned idx = ring->order[i];
+        ufs_cqe *cqe = &ring->results[idx];
+        cqe->res = is_ok ? ring_op_run(ring->descs[idx], &ring->sq[idx]) : -1;
+        cqe->error = cqe->res < 0 ? ufs_error_code : UFS_ERR_NO_ERR;
+    }
+}
 
-    for (filedesc *d : file_descriptors) {
-        if (d && d->atfile == f) {
-            d->pos = std::min(d->pos, f->size);
+int ufs_ring_submit(struct ufs_ring *ring) {
+    unsigned count = ring->sq_count;
+    ufs_cqe *cqes = ring->results.data();
+    {
+        std::shared_lock<std::shared_mutex> guard(file_descriptors_lock);
+        for (unsigned i = 0; i < count; ++i) {
+            int fd = ring->sq[i].fd;
+            filedesc *desc = nullptr;
+            if (fd > 0 && fd < (int)file_descriptors.size())
+                desc = file_descriptors[fd];
+            ring->descs[i] = desc;
+            ring->order[i] = i;
         }
     }
+    /*
+     * The bad descriptors go first, then each file in a row, its
+     * operations in the submission order.
+     */
+    std::sort(ring->order.begin(), ring->order.begin() + count,
+              [ring](unsigned a, unsigned b) {
+        filedesc *da = ring->descs[a];
+        filedesc *db = ring->descs[b];
+        file *fa = da == nullptr ? nullptr : da->atfile;
+        file *fb = db == nullptr ? nullptr : db->atfile;
+        if (fa != fb)
+            return std::less<file *>()(fa, fb);
+        return a < b;
+    });
+    unsigned begin = 0;
+    while (begin < count) {
+        unsigned idx = ring->order[begin];
+        if (ring->descs[idx] == nullptr) {
+            cqes[idx].res = -1;
+            cqes[idx].error = UFS_ERR_NO_FILE;
+            ++begin;
+            continue;
+        }
+        file *f = ring->descs[idx]->atfile;
+        unsigned end = begin + 1;
+        while (end < count && ring->descs[ring->order[end]]->atfile == f)
+            ++end;
+        ring_file_run(ring, begin, end);
+        begin = end;
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        cqes[i].user_data = ring->sq[i].user_data;
+        unsigned pos = (ring->cq_head + ring->cq_count) % ring->entries;
+        ring->cq[pos] = cqes[i];
+        ++ring->cq_count;
+    }
+    ring->sq_count = 0;
+    ufs_error_code = UFS_ERR_NO_ERR;
+    return count;
+}
 
-    return 0;
+int ufs_ring_reap(struct ufs_ring *ring, struct ufs_cqe *cqes, int count) {
+    int res = 0;
+    while (res < count && ring->cq_count > 0) {
+        cqes[res++] = ring->cq[ring->cq_head];
+        ring->cq_head = (ring->cq_head + 1) % ring->entries;
+        --ring->cq_count;
+    }
+    return res;
 }
-#endif
 
 
 void ufs_destroy(void) {
+    spill_thread_stop();
     for (filedesc *desc : file_descriptors) {
         if (desc) {
-            desc->atfile->refs--;
+            file *f = desc->atfile;
+            /* Deleted, but still opened files are not in the names. */
+            if (--f->refs == 0 && f->is_deleted)
+                delete f;
             delete desc;
+            mem_meta -= sizeof(filedesc);
         }
     }
 
 	std::vector<filedesc*> tmp;
 	std::swap(tmp, file_descriptors);
-
-    for (auto& [name, f] : all_files) {
-        delete f;
+    std::vector<int> ftmp;
+    std::swap(ftmp, free_fds);
+
+    names_clear();
+
+    for (const image_map &m : image_maps)
+        munmap(m.memory, m.size);
+    std::vector<image_map> itmp;
+    std::swap(itmp, image_maps);
+
+    /* The files took their backing files and the LRU links with them. */
+    std::string().swap(spill_dir);
+    std::unordered_multimap<uint64_t, extent_ref *> dtmp;
+    std::swap(dtmp, dedup_index);
+    for (pack_cache_slot &s : pack_cache) {
+        delete[] s.data;
+        s.data = nullptr;
+        s.packed = nullptr;
     }
-
-    std::unordered_map<std::string, file*> mtmp;
-    std::swap(mtmp, all_files);
+    /* All the blocks are freed, and so are the slabs. */
+    reclaim_thread_stop();
 }
@@ -1,12 +1,22 @@
 #pragma once
 
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
- * Each file lies in the memory as an array of blocks. A file
- * has an unique file name, and there are no directories, so the
- * FS is a monolithic flat contiguous folder.
+ * Each file lies in the memory as a list of extents. A file
+ * has an unique path: the directory names and the file name, split by
+ * '/'. A name without '/' is in the root directory.
+ *
+ * The functions can be called from multiple threads. Reads of a
+ * file run in parallel, writes and resizes of it are exclusive, except
+ * for the overwrites of the already written data: they lock only their
+ * byte range, so the ones of disjoint ranges run in parallel too.
+ * Different files don't block each other. One descriptor should be
+ * used by one thread at a time though, since its position is not
+ * protected from the concurrent reads and writes through it.
  */
 
 /**
@@ -51,7 +61,26 @@ enum open_flags {
 	 * into the file.
 	 */
 	UFS_READ_WRITE = UFS_READ_ONLY | UFS_WRITE_ONLY,
+	/**
+	 * Each ufs_write() and ufs_writev() first moves the position to
+	 * the file end. It is atomic, so several appending descriptors
+	 * never overwrite each other. The positional writes are not
+	 * affected.
+	 */
+	UFS_APPEND = 0b1000,
 #endif
+	/**
+	 * Compress the file data when it gets cold, see
+	 * ufs_set_idle_time(). The file keeps the mode after the
+	 * descriptor is closed. For the data like text logs, which
+	 * compresses well.
+	 */
+	UFS_COMPRESS = 0b10000,
+};
+
+enum {
+	/** Max length of a file or directory name, without the parents. */
+	UFS_NAME_MAX = 255,
 };
 
 /** Possible errors from all functions. */
@@ -64,9 +93,12 @@ enum ufs_error_code {
 #if NEED_OPEN_FLAGS
 	UFS_ERR_NO_PERMISSION,
 #endif
+	UFS_ERR_INVALID_ARG,
+	UFS_ERR_MAP_EXPIRED,
+	UFS_ERR_IO,
 };
 
-/** Get code of the last error. */
+/** Get code of the last error in the current thread. */
 ufs_error_code
 ufs_errno();
 
@@ -78,7 +110,9 @@ ufs_errno();
  * @retval > 0 File descriptor.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified. Or no parent directory to create it in.
+ *     - UFS_ERR_INVALID_ARG - a new file path is a directory, or has
+ *       an empty or a too long name.
  */
 int
 ufs_open(const char *filename, int flags);
@@ -111,6 +145,128 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write the buffers one after another, like ufs_write() of each.
+ * Either all of them are written, or none.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write.
+ * @param iovcnt Number of the buffers.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Fill the buffers one after another, like ufs_read() of each.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to read into.
+ * @param iovcnt Number of the buffers.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Write data at the offset. The descriptor position is not used
+ * and is not changed. If the offset is beyond the file end, the
+ * gap is filled with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Offset in the file.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the offset. The descriptor position is not used
+ * and is not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Offset in the file.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Get the file memory in the range without copying. The views point
+ * right into the file blocks, or into a shared zero area for the
+ * holes, and must not be written to. They stay
+ * valid until the file is changed by any descriptor, or until this
+ * one is closed. ufs_map_check() tells if that happened.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset in the file.
+ * @param len Maximum bytes to map.
+ * @param iov Array to save the views into.
+ * @param[in,out] iovcnt Size of the array. On return - the number of
+ *     the used views. When the array is too small, only the range
+ *     start is mapped.
+ *
+ * @retval > 0 How many bytes were mapped.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_map(int fd, size_t offset, size_t len, struct iovec *iov, int *iovcnt);
+
+/** Sizes of a file. */
+struct ufs_stat {
+	/** Logical size, what reads see. */
+	size_t size;
+	/**
+	 * Bytes of memory taken by the data. Holes left by ufs_resize()
+	 * growth and by writes beyond the end read as zeros and take no
+	 * memory until something is written into them. The spilled and
+	 * the compressed data counts in full.
+	 */
+	size_t allocated;
+};
+
+/**
+ * Get the file sizes.
+ * @param fd File descriptor from ufs_open().
+ * @param[out] st The sizes.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+int
+ufs_fstat(int fd, struct ufs_stat *st);
+
+/**
+ * Check the views from the last ufs_map() on the descriptor are
+ * still valid.
+ * @param fd File descriptor from ufs_open().
+ * @retval 0 The views are valid.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_MAP_EXPIRED - the file was changed, or there was no
+ *       ufs_map() on this descriptor.
+ */
+int
+ufs_map_check(int fd);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -136,6 +292,199 @@ ufs_close(int fd);
 int
 ufs_delete(const char *filename);
 
+/**
+ * Create a copy of a file without copying the data. The files share
+ * the extents until one of them writes into an extent, then it gets
+ * its own copy of that extent only. ufs_fstat() counts the shared
+ * extents in each of the files.
+ *
+ * @param src Name of the file to copy.
+ * @param dst Name of the new file.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file @a src, or no parent directory of
+ *       @a dst.
+ *     - UFS_ERR_INVALID_ARG - @a dst exists already, or is not a valid
+ *       path.
+ */
+int
+ufs_clone(const char *src, const char *dst);
+
+/**
+ * Create a directory. Its parent must exist.
+ *
+ * @param path Path of the directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no parent directory.
+ *     - UFS_ERR_INVALID_ARG - the path exists, or has an empty or a too
+ *       long name.
+ */
+int
+ufs_mkdir(const char *path);
+
+/**
+ * Delete a directory with all its content. The files are deleted as by
+ * ufs_delete(), the opened ones live until closed. Only the subtree is
+ * visited, not all the files.
+ *
+ * @param path Path of the directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ */
+int
+ufs_rmdir(const char *path);
+
+/** Directory entry from ufs_readdir(). */
+struct ufs_dirent {
+	/** Name without the parent path. */
+	char name[UFS_NAME_MAX + 1];
+	bool is_dir;
+};
+
+/**
+ * Read the next directory entry. The entries created or deleted during
+ * the reading might be skipped, or an entry might be reported twice.
+ *
+ * @param path Path of the directory, empty for the root.
+ * @param[in,out] cursor Position in the directory, 0 to start.
+ * @param[out] ent The entry.
+ *
+ * @retval 1 The entry is read.
+ * @retval 0 No more entries.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ */
+int
+ufs_readdir(const char *path, size_t *cursor, struct ufs_dirent *ent);
+
+/**
+ * Set the block size of the files created after the call. It is the
+ * size of the first extent of a file, each next one is twice bigger,
+ * up to 8 MB. Bigger blocks mean less allocations for big files, but
+ * more memory wasted on small ones. The default is 4 KB.
+ *
+ * @param size Power of 2 from 512 bytes to 1 MB.
+ * @retval 0 Success.
+ * @retval -1 Error occurred.
+ *     - UFS_ERR_INVALID_ARG - the size is not supported.
+ */
+int
+ufs_set_block_size(size_t size);
+
+/** Memory used by the FS. */
+struct ufs_memstats {
+	/** Blocks of the file data. Shared clone extents count once. */
+	size_t data;
+	/** Files and descriptors with their extent lists. */
+	size_t meta;
+	/** The limit from ufs_set_mem_limit(), 0 if there is none. */
+	size_t limit;
+	/** Data moved out to the backing files, not counted in @a data. */
+	size_t spilled;
+	/** Compressed data, counted in @a data. */
+	size_t packed;
+	/** What the compressed data would take uncompressed. */
+	size_t unpacked;
+	/**
+	 * Memory saved by the dedup, not counted in @a data. The dedup
+	 * ratio is (data + deduped) / data.
+	 */
+	size_t deduped;
+};
+
+/**
+ * Set the limit of the memory used by the FS. When it is reached,
+ * writes and resizes needing new blocks fail with UFS_ERR_NO_MEM. The
+ * metadata counts towards the limit, but is never refused. The data of
+ * the loaded images is not counted until written to.
+ *
+ * @param size Limit in bytes, 0 to remove it.
+ */
+void
+ufs_set_mem_limit(size_t size);
+
+/** Get the memory usage. */
+void
+ufs_memstats(struct ufs_memstats *st);
+
+/**
+ * Turn the dedup of the written data on or off. With it on, each write
+ * hashes the extents it fills up to the end, and an extent equal to
+ * one written before shares the memory with it, copied on the next
+ * write, like after ufs_clone(). The extents are compared whole, so
+ * only the ones of the same size can be equal, and the size depends on
+ * the file block size and the offset. Turning it off doesn't split the
+ * shared extents.
+ *
+ * @param is_on True to dedup the writes after the call.
+ */
+void
+ufs_set_dedup(bool is_on);
+
+/**
+ * Set a directory to spill the cold file data into. The data is written
+ * out, and the memory is freed. The next access to a spilled file reads
+ * it back, and then it can fail with UFS_ERR_NO_MEM or UFS_ERR_IO. The
+ * extents shared with clones and the ones of the loaded images are
+ * never spilled. The backing files are deleted with their files.
+ *
+ * @param path Directory, NULL to stop spilling. The already spilled
+ *     files stay where they are until accessed.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - the path is not an accessible directory.
+ */
+int
+ufs_set_backing_dir(const char *path);
+
+/**
+ * Start a background thread making the files not accessed for
+ * @a idle_ms cold: the UFS_COMPRESS ones are compressed, and then the
+ * rest is spilled if there is a backing directory. The reads of a
+ * compressed file decompress only the read part, through a small cache,
+ * the writes decompress the file back. Regardless of the thread, an
+ * allocation failing on the memory limit makes the least recently used
+ * files cold right away, so the writes degrade instead of failing with
+ * UFS_ERR_NO_MEM while anything can be freed. Both expire the ufs_map()
+ * views.
+ *
+ * @param idle_ms Idle time of a cold file, 0 to stop the thread.
+ */
+void
+ufs_set_idle_time(uint64_t idle_ms);
+
+/**
+ * Save all the files into an image. Each file is saved as it was at
+ * some moment, but not all of them at the same one if they are
+ * changed concurrently. Holes and the unused extent tails become holes
+ * in the image file. The image is replaced atomically.
+ *
+ * @param path Path of the image file.
+ * @retval 0 Success.
+ * @retval -1 Error occurred.
+ *     - UFS_ERR_IO - the image couldn't be written.
+ */
+int
+ufs_save(const char *path);
+
+/**
+ * Load the files from an image made by ufs_save(), with their
+ * directories. The empty directories are not saved. Only the metadata is
+ * read, the data stays in the image mapping until it is read, and is
+ * copied on write, so the image file itself is never changed. The
+ * mapping lives until ufs_destroy(). Not thread-safe.
+ *
+ * @param path Path of the image file.
+ * @retval 0 Success.
+ * @retval -1 Error occurred.
+ *     - UFS_ERR_INVALID_ARG - the FS is not empty.
+ *     - UFS_ERR_IO - the image couldn't be read, or it is broken.
+ */
+int
+ufs_load(const char *path);
+
 #if NEED_RESIZE
 
 /**
@@ -161,10 +510,99 @@ ufs_resize(int fd, size_t new_size);
 
 #endif
 
+/** Operations of a submission ring. */
+enum ufs_op {
+	/** ufs_read() of @a size bytes into @a buf. */
+	UFS_OP_READ,
+	/** ufs_write() of @a size bytes from @a buf. */
+	UFS_OP_WRITE,
+	/** ufs_pread() at @a offset. */
+	UFS_OP_PREAD,
+	/** ufs_pwrite() at @a offset. */
+	UFS_OP_PWRITE,
+#if NEED_RESIZE
+	/** ufs_resize() to @a size. */
+	UFS_OP_RESIZE,
+#endif
+};
+
+/** Submission queue entry, one operation. */
+struct ufs_sqe {
+	enum ufs_op op;
+	int fd;
+	void *buf;
+	size_t size;
+	size_t offset;
+	/** Copied into the completion as is. */
+	uint64_t user_data;
+};
+
+/** Completion queue entry, the result of one operation. */
+struct ufs_cqe {
+	uint64_t user_data;
+	/** What the function of the operation would return. */
+	ssize_t res;
+	/** The error code when @a res is -1. */
+	enum ufs_error_code error;
+};
+
+/**
+ * A ring of operations submitted together, like io_uring. Many small
+ * ones are done with one lookup of the descriptors, and one lock of
+ * each file for all its operations, instead of both per call. The
+ * operations of one file are done in the submission order, the files
+ * in any. The completions come in the submission order. A ring should
+ * be used by one thread at a time.
+ */
+struct ufs_ring;
+
+/**
+ * Create a ring for @a entries operations in flight: queued and not
+ * reaped.
+ *
+ * @retval Not NULL The ring.
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - @a entries is 0.
+ */
+struct ufs_ring *
+ufs_ring_new(unsigned entries);
+
+/** Delete the ring, the queued operations are dropped. */
+void
+ufs_ring_delete(struct ufs_ring *ring);
+
+/**
+ * Get an entry to queue an operation. It is zeroed, and it is done on
+ * the next submit.
+ *
+ * @retval Not NULL The entry.
+ * @retval NULL All the entries are taken: reap the completions.
+ */
+struct ufs_sqe *
+ufs_ring_get_sqe(struct ufs_ring *ring);
+
+/**
+ * Do all the queued operations. The errors of each one are in its
+ * completion.
+ *
+ * @retval >= 0 How many operations were done.
+ */
+int
+ufs_ring_submit(struct ufs_ring *ring);
+
+/**
+ * Take up to @a count completions, the oldest first.
+ *
+ * @retval >= 0 How many were saved into @a cqes.
+ */
+int
+ufs_ring_reap(struct ufs_ring *ring, struct ufs_cqe *cqes, int count);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to
  * be used. Purpose of the destruction is to reclaim all the dynamic memory.
+ * Not thread-safe: no other ufs calls are allowed while it works.
  */
 void
 ufs_destroy(void);
@@ -0,0 +1,425 @@
+/**
+ * Thread pool benchmarks: throughput of empty tasks pushed by 1 to N
+ * threads, latency of a fan-out and fan-in round, deep recursive
+ * spawning with joins inside the tasks, and the latency of short tasks
+ * mixed with long ones, short tasks polled by the submitters for the
+ * finish. Each scenario prints min, median, p99 and max of its
+ * samples: the rates of the runs for the throughput, and the single
+ * operations for the latencies.
+ *
+ * The polling one also prints the cache misses per task, counted by
+ * perf events in all the threads, when the kernel allows it. They grow
+ * with the false sharing between the workers and the pollers. For the
+ * HITM loads themselves run it under perf c2c record.
+ *
+ * Usage: tpool_bench [thread_count]
+ */
+#include "thread_pool.h"
+
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	BENCH_RUN_COUNT = 10,
+	BENCH_TASK_COUNT = 10000,
+	BENCH_MAX_SUBMITTERS = 8,
+	BENCH_FAN_OUT = 64,
+	BENCH_FAN_ROUND_COUNT = 2000,
+	BENCH_FIB_DEPTH = 18,
+	BENCH_MIX_LONG_COUNT = 50,
+	BENCH_MIX_SHORT_COUNT = 20000,
+	BENCH_MIX_LONG_NS = 1000000,
+	BENCH_POLL_SUBMITTERS = 4,
+	BENCH_POLL_BATCH = 16,
+};
+
+static int bench_thread_count = 4;
+
+static void
+bench_fail(const char *what, int rc)
+{
+	printf("Error: %s, code %d\n", what, rc);
+	exit(-1);
+}
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r ? 1 : 0;
+}
+
+static void
+bench_report(const char *name, const char *unit, double *samples, int count)
+{
+	qsort(samples, count, sizeof(samples[0]), bench_cmp);
+	int p99 = count * 99 / 100;
+	printf("%s\n", name);
+	printf("    %s: min %.2lf, med %.2lf, p99 %.2lf, max %.2lf\n", unit,
+	       samples[0], samples[count / 2], samples[p99 < count ? p99 :
+	       count - 1], samples[count - 1]);
+}
+
+static struct thread_pool *
+bench_pool_new(void)
+{
+	struct thread_pool *pool;
+	int rc = thread_pool_new(bench_thread_count, &pool);
+	if (rc != 0)
+		bench_fail("pool new", rc);
+	return pool;
+}
+
+static void
+bench_pool_delete(struct thread_pool *pool)
+{
+	int rc = thread_pool_delete(pool);
+	if (rc != 0)
+		bench_fail("pool delete", rc);
+}
+
+struct bench_submitter {
+	struct thread_pool *pool;
+	pthread_barrier_t *barrier;
+	struct thread_task *tasks[BENCH_TASK_COUNT];
+};
+
+static void *
+bench_submitter_f(void *arg)
+{
+	struct bench_submitter *s = (struct bench_submitter *)arg;
+	for (int i = 0; i < BENCH_TASK_COUNT; ++i)
+		thread_task_new(&s->tasks[i], []() {});
+	pthread_barrier_wait(s->barrier);
+	for (int i = 0; i < BENCH_TASK_COUNT; ++i) {
+		int rc = thread_pool_push_task(s->pool, s->tasks[i]);
+		if (rc != 0)
+			bench_fail("push", rc);
+	}
+	for (int i = 0; i < BENCH_TASK_COUNT; ++i)
+		thread_task_join(s->tasks[i]);
+	pthread_barrier_wait(s->barrier);
+	for (int i = 0; i < BENCH_TASK_COUNT; ++i)
+		thread_task_delete(s->tasks[i]);
+	return NULL;
+}
+
+/** Empty tasks pushed and joined by the submitters, in tasks/s. */
+static void
+bench_empty_throughput(int submitter_count)
+{
+	struct thread_pool *pool = bench_pool_new();
+	struct bench_submitter *submitters =
+		new bench_submitter[submitter_count];
+	pthread_t threads[BENCH_MAX_SUBMITTERS];
+	double rates[BENCH_RUN_COUNT];
+	for (int run = 0; run < BENCH_RUN_COUNT; ++run) {
+		pthread_barrier_t barrier;
+		pthread_barrier_init(&barrier, NULL, submitter_count + 1);
+		for (int i = 0; i < submitter_count; ++i) {
+			submitters[i].pool = pool;
+			submitters[i].barrier = &barrier;
+			pthread_create(&threads[i], NULL, bench_submitter_f,
+				       &submitters[i]);
+		}
+		pthread_barrier_wait(&barrier);
+		uint64_t start = bench_now_ns();
+		pthread_barrier_wait(&barrier);
+		uint64_t duration = bench_now_ns() - start;
+		for (int i = 0; i < submitter_count; ++i)
+			pthread_join(threads[i], NULL);
+		pthread_barrier_destroy(&barrier);
+		rates[run] = (double)submitter_count * BENCH_TASK_COUNT *
+			     1000000000 / duration;
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "empty tasks, submitters %d",
+		 submitter_count);
+	bench_report(name, "tasks/s", rates, BENCH_RUN_COUNT);
+	delete[] submitters;
+	bench_pool_delete(pool);
+}
+
+/** Push a batch of empty tasks in a group and join it, in us. */
+static void
+bench_fan_out_in(void)
+{
+	struct thread_pool *pool = bench_pool_new();
+	struct thread_task_group *group;
+	thread_task_group_new(&group);
+	struct thread_task *tasks[BENCH_FAN_OUT];
+	for (int i = 0; i < BENCH_FAN_OUT; ++i) {
+		thread_task_new(&tasks[i], []() {});
+		thread_task_set_group(tasks[i], group);
+	}
+	double *latencies = new double[BENCH_FAN_ROUND_COUNT];
+	for (int round = 0; round < BENCH_FAN_ROUND_COUNT; ++round) {
+		uint64_t start = bench_now_ns();
+		int rc = thread_pool_push_tasks(pool, tasks, BENCH_FAN_OUT);
+		if (rc != 0)
+			bench_fail("push", rc);
+		thread_task_group_join(group);
+		latencies[round] = (double)(bench_now_ns() - start) / 1000;
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "fan-out and fan-in, tasks %d",
+		 BENCH_FAN_OUT);
+	bench_report(name, "us", latencies, BENCH_FAN_ROUND_COUNT);
+	delete[] latencies;
+	for (int i = 0; i < BENCH_FAN_OUT; ++i)
+		thread_task_delete(tasks[i]);
+	thread_task_group_delete(group);
+	bench_pool_delete(pool);
+}
+
+/**
+ * Each task pushes 2 subtasks of the depth less by 1 and joins them.
+ * The leaves count as 1.
+ */
+static int
+bench_fib(struct thread_pool *pool, int depth)
+{
+	if (depth <= 1)
+		return 1;
+	int left = 0;
+	struct thread_task *t;
+	thread_task_new(&t, [pool, depth, &left]() {
+		left = bench_fib(pool, depth - 1);
+	});
+	int rc = thread_pool_push_task(pool, t);
+	if (rc != 0)
+		bench_fail("push", rc);
+	int right = bench_fib(pool, depth - 2);
+	thread_task_join(t);
+	thread_task_delete(t);
+	return left + right;
+}
+
+/** Recursive spawning, in tasks/s. */
+static void
+bench_recursive(void)
+{
+	struct thread_pool *pool = bench_pool_new();
+	double rates[BENCH_RUN_COUNT];
+	for (int run = 0; run < BENCH_RUN_COUNT; ++run) {
+		struct thread_task *root;
+		int leaf_count = 0;
+		thread_task_new(&root, [pool, &leaf_count]() {
+			leaf_count = bench_fib(pool, BENCH_FIB_DEPTH);
+		});
+		uint64_t start = bench_now_ns();
+		int rc = thread_pool_push_task(pool, root);
+		if (rc != 0)
+			bench_fail("push", rc);
+		thread_task_join(root);
+		uint64_t duration = bench_now_ns() - start;
+		thread_task_delete(root);
+		/* Each inner node of the tree is one task. */
+		rates[run] = (double)leaf_count * 1000000000 / duration;
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "recursive spawn, depth %d",
+		 BENCH_FIB_DEPTH);
+	bench_report(name, "tasks/s", rates, BENCH_RUN_COUNT);
+	bench_pool_delete(pool);
+}
+
+static void
+bench_spin(uint64_t duration)
+{
+	uint64_t end = bench_now_ns() + duration;
+	while (bench_now_ns() < end)
+		;
+}
+
+/**
+ * Long tasks are mixed into a stream of short ones. The short ones
+ * are measured from the push to the end, in us.
+ */
+static void
+bench_mix(void)
+{
+	struct thread_pool *pool = bench_pool_new();
+	const int count = BENCH_MIX_LONG_COUNT + BENCH_MIX_SHORT_COUNT;
+	const int long_period = count / BENCH_MIX_LONG_COUNT;
+	struct thread_task **tasks = new thread_task *[count];
+	uint64_t *push_times = new uint64_t[count];
+	uint64_t *end_times = new uint64_t[count];
+	for (int i = 0; i < count; ++i) {
+		if (i % long_period == 0) {
+			thread_task_new(&tasks[i], []() {
+				bench_spin(BENCH_MIX_LONG_NS);
+			});
+			continue;
+		}
+		thread_task_new(&tasks[i], [end_times, i]() {
+			end_times[i] = bench_now_ns();
+		});
+	}
+	for (int i = 0; i < count; ++i) {
+		push_times[i] = bench_now_ns();
+		int rc = thread_pool_push_task(pool, tasks[i]);
+		if (rc != 0)
+			bench_fail("push", rc);
+	}
+	double *latencies = new double[BENCH_MIX_SHORT_COUNT];
+	int latency_count = 0;
+	for (int i = 0; i < count; ++i) {
+		thread_task_join(tasks[i]);
+		thread_task_delete(tasks[i]);
+		if (i % long_period != 0) {
+			latencies[latency_count++] =
+				(double)(end_times[i] - push_times[i]) / 1000;
+		}
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "short tasks with %d long ones of %d us",
+		 BENCH_MIX_LONG_COUNT, BENCH_MIX_LONG_NS / 1000);
+	bench_report(name, "us", latencies, latency_count);
+	delete[] latencies;
+	delete[] end_times;
+	delete[] push_times;
+	delete[] tasks;
+	bench_pool_delete(pool);
+}
+
+/**
+ * A counter of the cache misses of this thread and of the threads it
+ * creates after. -1 if perf events are not available.
+ */
+static int
+bench_counter_open(void)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t
+bench_counter_read(int fd)
+{
+	uint64_t value = 0;
+	if (read(fd, &value, sizeof(value)) != sizeof(value))
+		return 0;
+	return value;
+}
+
+struct bench_poller {
+	struct thread_pool *pool;
+	pthread_barrier_t *barrier;
+};
+
+static void *
+bench_poller_f(void *arg)
+{
+	struct bench_poller *p = (struct bench_poller *)arg;
+	struct thread_task *tasks[BENCH_POLL_BATCH];
+	for (int i = 0; i < BENCH_POLL_BATCH; ++i)
+		thread_task_new(&tasks[i], []() {});
+	pthread_barrier_wait(p->barrier);
+	for (int n = 0; n < BENCH_TASK_COUNT; n += BENCH_POLL_BATCH) {
+		int rc = thread_pool_push_tasks(p->pool, tasks,
+						BENCH_POLL_BATCH);
+		if (rc != 0)
+			bench_fail("push", rc);
+		for (int i = 0; i < BENCH_POLL_BATCH; ++i) {
+			while (!thread_task_is_finished(tasks[i]))
+				;
+			thread_task_join(tasks[i]);
+		}
+	}
+	pthread_barrier_wait(p->barrier);
+	for (int i = 0; i < BENCH_POLL_BATCH; ++i)
+		thread_task_delete(tasks[i]);
+	return NULL;
+}
+
+/**
+ * Batches of empty tasks, each submitter spins on the finish of its
+ * tasks, so their states are read while the workers write them. In
+ * tasks/s, and cache misses per task.
+ */
+static void
+bench_poll(void)
+{
+	int counter = bench_counter_open();
+	struct thread_pool *pool = bench_pool_new();
+	struct bench_poller pollers[BENCH_POLL_SUBMITTERS];
+	pthread_t threads[BENCH_POLL_SUBMITTERS];
+	double rates[BENCH_RUN_COUNT];
+	double misses[BENCH_RUN_COUNT];
+	for (int run = 0; run < BENCH_RUN_COUNT; ++run) {
+		pthread_barrier_t barrier;
+		pthread_barrier_init(&barrier, NULL,
+				     BENCH_POLL_SUBMITTERS + 1);
+		for (int i = 0; i < BENCH_POLL_SUBMITTERS; ++i) {
+			pollers[i].pool = pool;
+			pollers[i].barrier = &barrier;
+			pthread_create(&threads[i], NULL, bench_poller_f,
+				       &pollers[i]);
+		}
+		pthread_barrier_wait(&barrier);
+		uint64_t start_misses = counter >= 0 ?
+					bench_counter_read(counter) : 0;
+		uint64_t start = bench_now_ns();
+		pthread_barrier_wait(&barrier);
+		uint64_t duration = bench_now_ns() - start;
+		uint64_t end_misses = counter >= 0 ?
+				      bench_counter_read(counter) : 0;
+		for (int i = 0; i < BENCH_POLL_SUBMITTERS; ++i)
+			pthread_join(threads[i], NULL);
+		pthread_barrier_destroy(&barrier);
+		const double task_count = (double)BENCH_POLL_SUBMITTERS *
+					  BENCH_TASK_COUNT;
+		rates[run] = task_count * 1000000000 / duration;
+		misses[run] = (end_misses - start_misses) / task_count;
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "polled tasks, submitters %d",
+		 BENCH_POLL_SUBMITTERS);
+	bench_report(name, "tasks/s", rates, BENCH_RUN_COUNT);
+	if (counter >= 0) {
+		bench_report("polled tasks, cache misses", "per task", misses,
+			     BENCH_RUN_COUNT);
+		close(counter);
+	} else {
+		printf("polled tasks, cache misses: no perf events\n");
+	}
+	bench_pool_delete(pool);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 1)
+		bench_thread_count = atoi(argv[1]);
+	printf("threads %d\n", bench_thread_count);
+	for (int count = 1; count <= BENCH_MAX_SUBMITTERS; count *= 2)
+		bench_empty_throughput(count);
+	bench_fan_out_in();
+	bench_recursive();
+	bench_mix();
+	bench_poll();
+	return 0;
+}
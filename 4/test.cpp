@@ -1,8 +1,16 @@
 #include "thread_pool.h"
+#include "thread_pool_coro.h"
+#include "corobus.h"
 #include "unit.h"
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <string.h>
 
 static void
 test_new(void)
@@ -233,6 +241,649 @@ test_thread_pool_max_tasks(void)
 	unit_test_finish();
 }
 
+struct multi_producer_ctx {
+	struct thread_pool *pool;
+	int *arg;
+	bool is_failed;
+};
+
+static void *
+multi_producer_f(void *arg)
+{
+	struct multi_producer_ctx *ctx = (struct multi_producer_ctx *)arg;
+	enum { BATCH_SIZE = 100, BATCH_COUNT = 100 };
+	struct thread_task *tasks[BATCH_SIZE];
+	for (int i = 0; i < BATCH_SIZE; ++i) {
+		if (thread_task_new(&tasks[i], task_make_inc(ctx->arg)) != 0)
+			ctx->is_failed = true;
+	}
+	for (int j = 0; j < BATCH_COUNT; ++j) {
+		for (int i = 0; i < BATCH_SIZE; ++i) {
+			if (thread_pool_push_task(ctx->pool, tasks[i]) != 0)
+				ctx->is_failed = true;
+		}
+		for (int i = 0; i < BATCH_SIZE; ++i) {
+			if (thread_task_join(tasks[i]) != 0 ||
+			    !thread_task_is_finished(tasks[i]))
+				ctx->is_failed = true;
+		}
+	}
+	for (int i = 0; i < BATCH_SIZE; ++i) {
+		if (thread_task_delete(tasks[i]) != 0)
+			ctx->is_failed = true;
+	}
+	return NULL;
+}
+
+static void
+test_multi_producer(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	/*
+	 * Several threads push and join their own tasks in the same pool.
+	 * Each task must be executed exactly once per push.
+	 */
+	enum { PRODUCER_COUNT = 4 };
+	int arg = 0;
+	pthread_t threads[PRODUCER_COUNT];
+	struct multi_producer_ctx ctxs[PRODUCER_COUNT];
+	for (int i = 0; i < PRODUCER_COUNT; ++i) {
+		ctxs[i] = {p, &arg, false};
+		unit_fail_if(pthread_create(&threads[i], NULL, multi_producer_f,
+			&ctxs[i]) != 0);
+	}
+	bool is_failed = false;
+	for (int i = 0; i < PRODUCER_COUNT; ++i) {
+		pthread_join(threads[i], NULL);
+		is_failed = is_failed || ctxs[i].is_failed;
+	}
+	unit_check(!is_failed, "pushed and joined from many threads");
+	unit_check(arg == PRODUCER_COUNT * 100 * 100, "all tasks are done");
+	unit_check(thread_pool_delete(p) == 0, "delete");
+
+	unit_test_finish();
+}
+
+struct sort_ctx {
+	struct thread_pool *pool;
+	int *data;
+	int *tmp;
+	int size;
+	bool is_failed;
+};
+
+static void
+sort_f(struct sort_ctx *ctx)
+{
+	if (ctx->size <= 64) {
+		std::sort(ctx->data, ctx->data + ctx->size);
+		return;
+	}
+	/*
+	 * Both halves are sorted by subtasks, pushed from inside a task and
+	 * joined there.
+	 */
+	int half = ctx->size / 2;
+	struct sort_ctx subs[2] = {
+		{ctx->pool, ctx->data, ctx->tmp, half, false},
+		{ctx->pool, ctx->data + half, ctx->tmp + half, ctx->size - half,
+		 false},
+	};
+	struct thread_task *tasks[2];
+	for (int i = 0; i < 2; ++i) {
+		struct sort_ctx *sub = &subs[i];
+		if (thread_task_new(&tasks[i], [sub]() { sort_f(sub); }) != 0 ||
+		    thread_pool_push_task(ctx->pool, tasks[i]) != 0)
+			ctx->is_failed = true;
+	}
+	for (int i = 0; i < 2; ++i) {
+		if (thread_task_join(tasks[i]) != 0 ||
+		    thread_task_delete(tasks[i]) != 0)
+			ctx->is_failed = true;
+		ctx->is_failed = ctx->is_failed || subs[i].is_failed;
+	}
+	std::merge(ctx->data, ctx->data + half, ctx->data + half,
+		   ctx->data + ctx->size, ctx->tmp);
+	std::copy(ctx->tmp, ctx->tmp + ctx->size, ctx->data);
+}
+
+static void
+test_recursive_tasks(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	/*
+	 * Recursive tasks wait for their subtasks. It must not hang even
+	 * when there are way more waiting tasks than threads.
+	 */
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	const int size = 100000;
+	int *data = new int[size];
+	int *tmp = new int[size];
+	for (int i = 0; i < size; ++i)
+		data[i] = (i * 7919) % size;
+	struct sort_ctx ctx = {p, data, tmp, size, false};
+	unit_fail_if(thread_task_new(&t, [&ctx]() { sort_f(&ctx); }) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_check(!ctx.is_failed, "subtasks are pushed and joined");
+	unit_check(std::is_sorted(data, data + size), "parallel sort");
+	delete[] data;
+	delete[] tmp;
+	unit_check(thread_pool_delete(p) == 0, "delete");
+
+	unit_test_finish();
+}
+
+static void
+test_elastic_threads(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	struct thread_pool_opts opts;
+	opts.max_thread_count = 0;
+	opts.idle_timeout = 0.05;
+	unit_check(thread_pool_new_opts(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "0 thread count is forbidden");
+	opts.max_thread_count = 1;
+	opts.idle_timeout = -1;
+	unit_check(thread_pool_new_opts(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative timeout is forbidden");
+	/*
+	 * The cap is a parameter, not limited by TPOOL_MAX_THREADS.
+	 */
+	opts.max_thread_count = TPOOL_MAX_THREADS * 2;
+	opts.idle_timeout = 0.05;
+	unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+	unit_check(thread_pool_thread_count(p) == 0, "no threads at start");
+	int arg = 0;
+	unit_fail_if(thread_task_new(&t, task_make_inc(&arg)) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(thread_pool_thread_count(p) == 1, "started on demand");
+	/*
+	 * Idle threads exit, and are started again for new tasks.
+	 */
+	for (int i = 0; i < 100 && thread_pool_thread_count(p) != 0; ++i)
+		usleep(10000);
+	unit_check(thread_pool_thread_count(p) == 0, "idle thread exited");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(arg == 2, "a task is done after the exit");
+	unit_fail_if(thread_task_delete(t) != 0);
+	/*
+	 * All the threads are started when all are busy.
+	 */
+	arg = 0;
+	const int count = TPOOL_MAX_THREADS * 2;
+	struct thread_task *tasks[count];
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i],
+			task_make_wait_for(&arg)) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	for (int i = 0; i < 100 && thread_pool_thread_count(p) != count; ++i)
+		usleep(10000);
+	unit_check(thread_pool_thread_count(p) == count, "max threads");
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(thread_pool_delete(p) == 0, "delete");
+
+	unit_test_finish();
+}
+
+static void
+test_task_callables(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	/*
+	 * Too big for the inline storage.
+	 */
+	int arg = 0;
+	char big[200];
+	memset(big, 1, sizeof(big));
+	thread_task_f f = [big, &arg]() {
+		for (char c : big)
+			__atomic_add_fetch(&arg, c, __ATOMIC_RELAXED);
+	};
+	unit_fail_if(thread_task_new(&t, f) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(arg == 200, "a big callable is copied");
+	unit_fail_if(thread_task_delete(t) != 0);
+	f();
+	unit_check(arg == 400, "the original is kept");
+	/*
+	 * Move-only.
+	 */
+	std::unique_ptr<int> ptr(new int(0));
+	int *value = ptr.get();
+	unit_fail_if(thread_task_new(&t, [ptr = std::move(ptr)]() {
+		++*ptr;
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_check(*value == 1, "a move-only callable is moved");
+	unit_fail_if(thread_task_delete(t) != 0);
+	/*
+	 * Deleted tasks are reused.
+	 */
+	struct thread_task *old = t;
+	unit_fail_if(thread_task_new(&t, task_make_inc(&arg)) != 0);
+	unit_check(t == old, "a deleted task is reused");
+	unit_check(!thread_task_is_finished(t) && !thread_task_is_running(t),
+		   "the reused task is new");
+	unit_check(thread_task_join(t) == TPOOL_ERR_TASK_NOT_PUSHED,
+		   "the reused task is not pushed");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_batch(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task_group *g;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	unit_fail_if(thread_task_group_new(&g) != 0);
+	const int count = 10000;
+	struct thread_task **tasks = new thread_task*[count];
+	int arg = 0;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_make_inc(&arg)) != 0);
+		unit_fail_if(thread_task_set_group(tasks[i], g) != 0);
+	}
+	/*
+	 * All or nothing.
+	 */
+	struct thread_task **many = new thread_task*[TPOOL_MAX_TASKS + 1];
+	for (int i = 0; i < TPOOL_MAX_TASKS + 1; ++i)
+		many[i] = tasks[0];
+	unit_check(thread_pool_push_tasks(p, many, TPOOL_MAX_TASKS + 1) ==
+		   TPOOL_ERR_TOO_MANY_TASKS, "too many tasks in a batch");
+	delete[] many;
+	unit_check(thread_task_group_delete(g) == 0, "nothing is pushed");
+	unit_fail_if(thread_task_group_new(&g) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_set_group(tasks[i], g) != 0);
+	/*
+	 * Push and join all at once, twice.
+	 */
+	for (int j = 1; j <= 2; ++j) {
+		unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+		unit_check(thread_task_join(tasks[0]) ==
+			   TPOOL_ERR_INVALID_ARGUMENT, "no join of a group task");
+		unit_fail_if(thread_task_group_join(g) != 0);
+		unit_check(arg == count * j, "all the tasks are done");
+		bool is_finished = true;
+		for (int i = 0; i < count; ++i)
+			is_finished = is_finished && thread_task_is_finished(tasks[i]);
+		unit_check(is_finished, "all the tasks are finished");
+	}
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_check(thread_task_group_delete(g) == 0, "group delete");
+	unit_check(thread_pool_push_tasks(p, tasks, 0) == 0, "empty batch");
+	delete[] tasks;
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_affinity(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_opts opts;
+	opts.max_thread_count = 4;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	opts.cpu_set = &set;
+	unit_check(thread_pool_new_opts(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "empty CPU set is forbidden");
+	/*
+	 * All the workers run on the given CPU, also with NUMA placement.
+	 */
+	int cpu = sched_getcpu();
+	unit_fail_if(cpu < 0);
+	CPU_SET(cpu, &set);
+	for (int is_numa_aware = 0; is_numa_aware < 2; ++is_numa_aware) {
+		opts.is_numa_aware = is_numa_aware;
+		unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+		const int count = 100;
+		struct thread_task *tasks[count];
+		int bad_cpu_count = 0;
+		for (int i = 0; i < count; ++i) {
+			unit_fail_if(thread_task_new(&tasks[i], [&bad_cpu_count, cpu]() {
+				if (sched_getcpu() != cpu) {
+					__atomic_add_fetch(&bad_cpu_count, 1,
+							   __ATOMIC_RELAXED);
+				}
+			}) != 0);
+			unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+		}
+		for (int i = 0; i < count; ++i) {
+			unit_fail_if(thread_task_join(tasks[i]) != 0);
+			unit_fail_if(thread_task_delete(tasks[i]) != 0);
+		}
+		unit_check(bad_cpu_count == 0, "tasks run on the allowed CPU");
+		unit_fail_if(thread_pool_delete(p) != 0);
+	}
+	/*
+	 * NUMA placement over all the CPUs of the process.
+	 */
+	opts.cpu_set = NULL;
+	opts.is_numa_aware = true;
+	unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+	int arg = 0;
+	struct thread_task *t;
+	unit_fail_if(thread_task_new(&t, task_make_inc(&arg)) != 0);
+	for (int i = 0; i < 10; ++i) {
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+		unit_fail_if(thread_task_join(t) != 0);
+	}
+	unit_check(arg == 10, "NUMA aware pool runs the tasks");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_priorities(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_task *t;
+	struct thread_task_opts opts;
+	opts.priority = TPOOL_PRIORITY_COUNT;
+	unit_check(thread_task_new_ex(&t, [](){}, &opts) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "unknown priority");
+	opts.priority = TPOOL_PRIORITY_HIGH;
+	opts.deadline = -1;
+	unit_check(thread_task_new_ex(&t, [](){}, &opts) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative deadline");
+	/*
+	 * One thread is busy while the tasks are pushed, then it takes them
+	 * by the deadlines and the priorities.
+	 */
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	int go = 0;
+	struct thread_task *gate;
+	unit_fail_if(thread_task_new(&gate, task_make_wait_for(&go)) != 0);
+	unit_fail_if(thread_pool_push_task(p, gate) != 0);
+	const int count = 102;
+	struct thread_task *tasks[count];
+	int order[count];
+	int done = 0;
+	for (int i = 0; i < count; ++i) {
+		if (i == 0) {
+			opts.priority = TPOOL_PRIORITY_LOW;
+			opts.deadline = 0;
+		} else if (i == 1) {
+			opts.priority = TPOOL_PRIORITY_NORMAL;
+		} else if (i < count - 2) {
+			opts.priority = TPOOL_PRIORITY_HIGH;
+		} else {
+			/* The earliest deadline is the last. */
+			opts.deadline = count - i;
+		}
+		unit_fail_if(thread_task_new_ex(&tasks[i], [i, &order, &done]() {
+			order[done++] = i;
+		}, &opts) != 0);
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, count) != 0);
+	__atomic_store_n(&go, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+	unit_fail_if(thread_task_join(gate) != 0);
+	unit_check(done == count, "all the tasks are done");
+	int low_pos = std::find(order, order + count, 0) - order;
+	unit_check(low_pos <= 16, "low priority is not starved");
+	std::remove(order, order + count, 0);
+	unit_check(order[0] == count - 1 && order[1] == count - 2,
+		   "deadlines first, the earliest first");
+	bool is_high_first = true;
+	for (int i = 2; i < count - 2; ++i)
+		is_high_first = is_high_first && order[i] == i;
+	unit_check(is_high_first, "high priority before normal, in order");
+	unit_check(order[count - 2] == 1, "normal priority after high");
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_task_delete(gate) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_dependencies(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	/*
+	 * A long chain runs in order, the tasks are joined before they are
+	 * even pushed.
+	 */
+	const int count = 1000;
+	struct thread_task **chain = new thread_task*[count];
+	int arg = 0;
+	int bad_order_count = 0;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&chain[i], [i, &arg, &bad_order_count]() {
+			if (arg++ != i)
+				++bad_order_count;
+		}) != 0);
+		if (i > 0)
+			unit_fail_if(thread_task_then(chain[i - 1], chain[i]) != 0);
+	}
+	unit_check(thread_task_then(chain[0], chain[0]) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no self dependency");
+	unit_check(thread_task_delete(chain[1]) == TPOOL_ERR_TASK_IN_POOL,
+		   "no delete of a pending task");
+	unit_fail_if(thread_pool_push_task(p, chain[0]) != 0);
+	for (int i = count - 1; i >= 0; --i)
+		unit_fail_if(thread_task_join(chain[i]) != 0);
+	unit_check(arg == count && bad_order_count == 0, "chain is done in order");
+	/*
+	 * A diamond: the last task waits for both in the middle.
+	 */
+	struct thread_task *a, *b, *c, *d;
+	int b_done = 0, c_done = 0, d_saw = 0;
+	unit_fail_if(thread_task_new(&a, [](){}) != 0);
+	unit_fail_if(thread_task_new(&b, [&b_done]() {
+		usleep(10000);
+		__atomic_store_n(&b_done, 1, __ATOMIC_RELAXED);
+	}) != 0);
+	unit_fail_if(thread_task_new(&c, [&c_done]() {
+		__atomic_store_n(&c_done, 1, __ATOMIC_RELAXED);
+	}) != 0);
+	unit_fail_if(thread_task_new(&d, [&b_done, &c_done, &d_saw]() {
+		d_saw = __atomic_load_n(&b_done, __ATOMIC_RELAXED) +
+			__atomic_load_n(&c_done, __ATOMIC_RELAXED);
+	}) != 0);
+	unit_fail_if(thread_task_then(a, b) != 0);
+	unit_fail_if(thread_task_then(a, c) != 0);
+	unit_fail_if(thread_task_then(b, d) != 0);
+	unit_fail_if(thread_task_then(c, d) != 0);
+	unit_fail_if(thread_pool_push_task(p, a) != 0);
+	unit_check(thread_task_then(a, d) == TPOOL_ERR_TASK_IN_POOL,
+		   "no dependency on a pushed task");
+	unit_fail_if(thread_task_join(d) != 0);
+	unit_check(d_saw == 2, "diamond is done in order");
+	unit_fail_if(thread_task_join(a) != 0);
+	unit_fail_if(thread_task_join(b) != 0);
+	unit_fail_if(thread_task_join(c) != 0);
+	/*
+	 * A deleted predecessor releases the successor.
+	 */
+	struct thread_task *e;
+	unit_fail_if(thread_task_new(&e, [](){}) != 0);
+	unit_fail_if(thread_task_then(a, e) != 0);
+	unit_fail_if(thread_task_delete(a) != 0);
+	unit_check(thread_task_delete(e) == 0, "released by the deleted one");
+	unit_fail_if(thread_task_delete(b) != 0);
+	unit_fail_if(thread_task_delete(c) != 0);
+	unit_fail_if(thread_task_delete(d) != 0);
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(thread_task_delete(chain[i]) != 0);
+	delete[] chain;
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_stats stats;
+	struct thread_worker_stats wstats;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	unit_fail_if(thread_pool_stats(p, &stats) != 0);
+	unit_check(stats.queued_count == 0 && stats.running_count == 0 &&
+		   stats.finished_count == 0, "empty pool stats");
+	unit_check(thread_pool_worker_stats(p, 1, &wstats) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no such worker");
+	/*
+	 * One task blocks the only thread, the others wait in the queue.
+	 */
+	int go = 0;
+	struct thread_task *gate;
+	unit_fail_if(thread_task_new(&gate, task_make_wait_for(&go)) != 0);
+	unit_fail_if(thread_pool_push_task(p, gate) != 0);
+	while (!thread_task_is_running(gate))
+		usleep(100);
+	const int count = 10;
+	struct thread_task *tasks[count];
+	int arg = 0;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_make_inc(&arg)) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	unit_fail_if(thread_pool_stats(p, &stats) != 0);
+	unit_check(stats.running_count == 1, "running count");
+	unit_check(stats.queued_count == count, "queued count");
+	unit_check(stats.thread_count == 1, "thread count");
+	usleep(10000);
+	__atomic_store_n(&go, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_fail_if(thread_task_join(gate) != 0);
+	unit_fail_if(thread_task_delete(gate) != 0);
+	unit_fail_if(thread_pool_stats(p, &stats) != 0);
+	unit_check(stats.queued_count == 0 && stats.running_count == 0 &&
+		   stats.finished_count == count + 1, "all finished");
+	uint64_t wait_count = 0, run_count = 0, long_wait_count = 0;
+	for (int i = 0; i < TPOOL_HISTOGRAM_SIZE; ++i) {
+		wait_count += stats.wait_histogram[i];
+		run_count += stats.run_histogram[i];
+		/* Waited for the gate at least 10 ms. */
+		if (i >= 23)
+			long_wait_count += stats.wait_histogram[i];
+	}
+	unit_check(wait_count == count + 1 && run_count == count + 1,
+		   "histograms count all the tasks");
+	unit_check(long_wait_count == count, "wait time is measured");
+	unit_check(stats.run_histogram[TPOOL_HISTOGRAM_SIZE - 1] == 0 &&
+		   stats.steal_count == 0, "nothing else");
+	unit_fail_if(thread_pool_worker_stats(p, 0, &wstats) != 0);
+	unit_check(wstats.finished_count == count + 1, "worker finished count");
+	unit_check(wstats.busy_ratio > 0 && wstats.busy_ratio <= 1,
+		   "worker was busy");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_parallel_for(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	unit_check(thread_pool_parallel_for(p, 0, 10, -1, [](int64_t) {}) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "negative grain");
+	int call_count = 0;
+	unit_check(thread_pool_parallel_for(p, 10, 10, 1, [&](int64_t) {
+		++call_count;
+	}) == 0 && call_count == 0, "empty range");
+	/*
+	 * Each index is visited once, with any grain.
+	 */
+	const int count = 1000000;
+	int *visits = new int[count]();
+	const int64_t grains[] = {0, 1, 1000, count * 2};
+	for (int64_t grain : grains) {
+		unit_fail_if(thread_pool_parallel_for(p, 0, count, grain,
+			[visits](int64_t i) { ++visits[i]; }) != 0);
+	}
+	bool is_ok = true;
+	for (int i = 0; i < count; ++i)
+		is_ok = is_ok && visits[i] == 4;
+	unit_check(is_ok, "each index is visited once");
+	delete[] visits;
+	int64_t sum = 0;
+	unit_fail_if(thread_pool_parallel_reduce(p, 0, count, 0, (int64_t)0,
+		[](int64_t i) { return i; },
+		[](int64_t a, int64_t b) { return a + b; }, &sum) != 0);
+	unit_check(sum == (int64_t)count * (count - 1) / 2, "reduce");
+	/*
+	 * Nested loops inside the tasks of the same pool.
+	 */
+	const int task_count = 8;
+	struct thread_task *tasks[task_count];
+	int64_t sums[task_count];
+	for (int i = 0; i < task_count; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], [p, &sums, i]() {
+			thread_pool_parallel_reduce(p, 0, 10000, 10, (int64_t)0,
+				[](int64_t j) { return j; },
+				[](int64_t a, int64_t b) { return a + b; },
+				&sums[i]);
+		}) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	is_ok = true;
+	for (int i = 0; i < task_count; ++i) {
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+		is_ok = is_ok && sums[i] == 10000 * 9999 / 2;
+	}
+	unit_check(is_ok, "nested loops");
+	while (thread_pool_delete(p) != 0)
+		usleep(100);
+
+	unit_test_finish();
+}
 
 static void
 test_timed_join(void)
@@ -341,6 +992,309 @@ test_detach_long(void)
 #endif
 }
 
+enum {
+	TEST_CORO_SENDER_COUNT = 10,
+	TEST_CORO_MESSAGE_COUNT = 1000,
+};
+
+struct test_coro_ctx {
+	struct coro_bus *bus;
+	int channel;
+	struct thread_pool *pool;
+	unsigned sum;
+};
+
+static void *
+test_coro_sender_f(void *arg)
+{
+	struct test_coro_ctx *ctx = (struct test_coro_ctx *)arg;
+	for (unsigned i = 0; i < TEST_CORO_MESSAGE_COUNT; ++i)
+		unit_fail_if(coro_bus_send(ctx->bus, ctx->channel, i) != 0);
+	return NULL;
+}
+
+static void *
+test_coro_receiver_f(void *arg)
+{
+	struct test_coro_ctx *ctx = (struct test_coro_ctx *)arg;
+	unsigned data;
+	for (int i = 0; i < TEST_CORO_SENDER_COUNT *
+	     TEST_CORO_MESSAGE_COUNT; ++i) {
+		unit_fail_if(coro_bus_recv(ctx->bus, ctx->channel, &data) != 0);
+		ctx->sum += data;
+	}
+	return NULL;
+}
+
+static void
+test_coro(void)
+{
+	unit_test_start();
+
+	coro_sched_init();
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	unit_check(thread_pool_spawn_coro(p, test_coro_sender_f, NULL) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "spawn before the start");
+	unit_check(thread_pool_coro_start(p, 0) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "0 engines");
+	unit_fail_if(thread_pool_coro_start(p, 1) != 0);
+	unit_check(thread_pool_coro_start(p, 1) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "one pool at a time");
+
+	struct test_coro_ctx ctx;
+	ctx.bus = coro_bus_new();
+	ctx.channel = coro_bus_channel_open(ctx.bus, 1);
+	ctx.pool = p;
+	ctx.sum = 0;
+	unit_fail_if(thread_pool_spawn_coro(p, test_coro_receiver_f,
+					    &ctx) != 0);
+	/* The only worker is free while the receiver waits. */
+	int arg = 0;
+	struct thread_task *task;
+	unit_fail_if(thread_task_new(&task, task_make_inc(&arg)) != 0);
+	unit_fail_if(thread_pool_push_task(p, task) != 0);
+	unit_fail_if(thread_task_join(task) != 0);
+	unit_check(arg == 1, "a task runs while a coroutine waits");
+	unit_fail_if(thread_task_delete(task) != 0);
+
+	/* The tasks spawn the senders. */
+	unit_fail_if(thread_task_new(&task, [&ctx]() {
+		for (int i = 0; i < TEST_CORO_SENDER_COUNT; ++i) {
+			unit_fail_if(thread_pool_spawn_coro(ctx.pool,
+				test_coro_sender_f, &ctx) != 0);
+		}
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, task) != 0);
+	unit_fail_if(thread_task_join(task) != 0);
+	unit_fail_if(thread_task_delete(task) != 0);
+	unit_fail_if(thread_pool_coro_stop(p) != 0);
+	unit_check(ctx.sum == (unsigned)TEST_CORO_SENDER_COUNT *
+		   TEST_CORO_MESSAGE_COUNT * (TEST_CORO_MESSAGE_COUNT - 1) / 2,
+		   "all the messages are received");
+	unit_check(thread_pool_coro_stop(p) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "stop twice");
+
+	coro_bus_delete(ctx.bus);
+	coro_sched_destroy();
+	/* The last hosting tasks can be still leaving. */
+	while (thread_pool_delete(p) != 0)
+		usleep(100);
+
+	unit_test_finish();
+}
+
+static void
+test_completion(void)
+{
+	unit_test_start();
+
+	enum { TEST_COMPLETION_COUNT = 100 };
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	int fd = thread_pool_completion_fd(p);
+	unit_fail_if(fd < 0);
+	unit_check(thread_pool_completion_fd(p) == fd, "the same fd");
+	struct pollfd pfd = {fd, POLLIN, 0};
+	unit_check(poll(&pfd, 1, 0) == 0, "not readable when none finished");
+
+	struct thread_task *group_task;
+	struct thread_task_group *group;
+	unit_fail_if(thread_task_new(&group_task, []() {}) != 0);
+	unit_fail_if(thread_task_group_new(&group) != 0);
+	unit_fail_if(thread_task_set_group(group_task, group) != 0);
+	unit_check(thread_task_set_notify(group_task, true) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no notify in a group");
+	unit_fail_if(thread_task_delete(group_task) != 0);
+	unit_fail_if(thread_task_group_delete(group) != 0);
+
+	int arg = 0;
+	struct thread_task *tasks[TEST_COMPLETION_COUNT];
+	for (int i = 0; i < TEST_COMPLETION_COUNT; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i],
+					     task_make_inc(&arg)) != 0);
+		unit_fail_if(thread_task_set_notify(tasks[i], true) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	unit_check(thread_task_join(tasks[0]) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "notify task can't be joined");
+	unit_check(thread_task_detach(tasks[0]) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "notify task can't be detached");
+
+	/* An event loop: wait for the fd, pop in batches. */
+	struct thread_task *done[16];
+	int done_count = 0;
+	bool is_ok = true;
+	while (done_count < TEST_COMPLETION_COUNT) {
+		if (poll(&pfd, 1, 1000) != 1 || (pfd.revents & POLLIN) == 0) {
+			is_ok = false;
+			break;
+		}
+		int count;
+		while ((count = thread_pool_pop_completed(p, done, 16)) > 0) {
+			for (int i = 0; i < count; ++i) {
+				is_ok = is_ok && thread_task_is_finished(done[i]);
+				unit_fail_if(thread_task_delete(done[i]) != 0);
+			}
+			done_count += count;
+		}
+	}
+	unit_check(is_ok && done_count == TEST_COMPLETION_COUNT,
+		   "all are popped after the fd wakeups");
+	unit_check(arg == TEST_COMPLETION_COUNT, "all have run");
+	unit_check(poll(&pfd, 1, 0) == 0, "not readable when all popped");
+
+	/* A not popped task keeps the pool. */
+	unit_fail_if(thread_task_new(&tasks[0], task_make_inc(&arg)) != 0);
+	unit_fail_if(thread_task_set_notify(tasks[0], true) != 0);
+	unit_fail_if(thread_pool_push_task(p, tasks[0]) != 0);
+	unit_fail_if(poll(&pfd, 1, 1000) != 1);
+	unit_check(thread_pool_delete(p) == TPOOL_ERR_HAS_TASKS,
+		   "delete with a not popped task");
+	unit_check(thread_pool_pop_completed(p, done, 16) == 1, "pop one");
+	unit_check(thread_pool_pop_completed(p, done, 16) == 0, "pop none");
+	/* A joined notify task is reused as a usual one. */
+	unit_fail_if(thread_task_set_notify(done[0], false) != 0);
+	unit_fail_if(thread_pool_push_task(p, done[0]) != 0);
+	unit_fail_if(thread_task_join(done[0]) != 0);
+	unit_fail_if(thread_task_delete(done[0]) != 0);
+	unit_check(poll(&pfd, 1, 0) == 0, "a usual task doesn't notify");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_cancel(void)
+{
+	unit_test_start();
+
+	enum { TEST_CANCEL_COUNT = 10 };
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	bool is_started;
+	struct thread_task *blocker;
+	bool is_blocker_started = false;
+	bool is_blocker_released = false;
+	unit_fail_if(thread_task_new(&blocker, [&is_blocker_started,
+						&is_blocker_released]() {
+		__atomic_store_n(&is_blocker_started, true, __ATOMIC_RELEASE);
+		while (!thread_task_is_cancelled(NULL))
+			usleep(100);
+		/* Keeps running after the cancel, until let go. */
+		while (!__atomic_load_n(&is_blocker_released, __ATOMIC_ACQUIRE))
+			usleep(100);
+	}) != 0);
+	unit_check(thread_task_cancel(blocker, &is_started) ==
+		   TPOOL_ERR_TASK_NOT_PUSHED, "cancel not pushed");
+	unit_check(!thread_task_is_cancelled(NULL), "no task outside a pool");
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!__atomic_load_n(&is_blocker_started, __ATOMIC_ACQUIRE))
+		usleep(100);
+
+	/* The only worker is busy, these stay queued. */
+	int arg = 0;
+	struct thread_task *tasks[TEST_CANCEL_COUNT];
+	for (int i = 0; i < TEST_CANCEL_COUNT; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i],
+					     task_make_inc(&arg)) != 0);
+		unit_fail_if(thread_pool_push_task(p, tasks[i]) != 0);
+	}
+	bool is_ok = true;
+	for (int i = 0; i < TEST_CANCEL_COUNT; i += 2) {
+		is_ok = is_ok && thread_task_cancel(tasks[i], &is_started) == 0 &&
+			!is_started && thread_task_is_cancelled(tasks[i]);
+	}
+	unit_check(is_ok, "queued tasks are cancelled before the start");
+	unit_check(thread_task_cancel(blocker, &is_started) == 0 && is_started,
+		   "running task is cancelled after the start");
+	unit_check(thread_task_is_running(blocker),
+		   "a cancelled task is running until it returns");
+	__atomic_store_n(&is_blocker_released, true, __ATOMIC_RELEASE);
+	unit_fail_if(thread_task_join(blocker) != 0);
+	unit_check(!thread_task_is_cancelled(blocker),
+		   "the token is gone after the finish");
+	for (int i = 0; i < TEST_CANCEL_COUNT; ++i) {
+		unit_fail_if(thread_task_join(tasks[i]) != 0);
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(arg == TEST_CANCEL_COUNT / 2, "the cancelled didn't run");
+
+	/* A task pushed again waits for a new cancel. */
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	unit_fail_if(thread_task_cancel(blocker, &is_started) != 0);
+	unit_fail_if(thread_task_join(blocker) != 0);
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	unit_fail_if(thread_task_new(&blocker, task_make_inc(&arg)) != 0);
+	unit_fail_if(thread_pool_push_task(p, blocker) != 0);
+	while (!thread_task_is_finished(blocker))
+		usleep(100);
+	unit_check(thread_task_cancel(blocker, &is_started) == 0 && is_started,
+		   "cancel of a finished task");
+	unit_fail_if(thread_task_join(blocker) != 0);
+	unit_check(arg == TEST_CANCEL_COUNT / 2 + 1, "the finished has run");
+	unit_fail_if(thread_task_delete(blocker) != 0);
+
+	/* A cancelled pending task still takes more dependencies. */
+	struct thread_task *a, *b, *next;
+	unit_fail_if(thread_task_new(&a, task_make_inc(&arg)) != 0);
+	unit_fail_if(thread_task_new(&b, task_make_inc(&arg)) != 0);
+	unit_fail_if(thread_task_new(&next, task_make_inc(&arg)) != 0);
+	unit_fail_if(thread_task_then(a, next) != 0);
+	unit_check(thread_task_cancel(next, &is_started) == 0 && !is_started,
+		   "cancel of a pending task");
+	unit_check(thread_task_then(b, next) == 0,
+		   "a cancelled pending task is not in the pool yet");
+	unit_check(thread_task_is_cancelled(next), "and stays cancelled");
+	unit_fail_if(thread_pool_push_task(p, a) != 0);
+	unit_fail_if(thread_pool_push_task(p, b) != 0);
+	unit_fail_if(thread_task_join(next) != 0);
+	unit_fail_if(thread_task_join(a) != 0);
+	unit_fail_if(thread_task_join(b) != 0);
+	unit_check(arg == TEST_CANCEL_COUNT / 2 + 3,
+		   "the cancelled successor didn't run");
+	unit_fail_if(thread_task_delete(a) != 0);
+	unit_fail_if(thread_task_delete(b) != 0);
+	unit_fail_if(thread_task_delete(next) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_stack_size(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_opts opts;
+	opts.max_thread_count = 2;
+	opts.stack_size = (size_t)PTHREAD_STACK_MIN - 1;
+	unit_check(thread_pool_new_opts(&opts, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "too small stack");
+	opts.stack_size = 256 * 1024;
+	opts.guard_size = 0;
+	unit_fail_if(thread_pool_new_opts(&opts, &p) != 0);
+	size_t stack_size = 0;
+	size_t guard_size = 1;
+	struct thread_task *t;
+	unit_fail_if(thread_task_new(&t, [&stack_size, &guard_size]() {
+		pthread_attr_t attr;
+		unit_fail_if(pthread_getattr_np(pthread_self(), &attr) != 0);
+		pthread_attr_getstacksize(&attr, &stack_size);
+		pthread_attr_getguardsize(&attr, &guard_size);
+		pthread_attr_destroy(&attr);
+	}) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_check(stack_size == opts.stack_size, "stack size is applied");
+	unit_check(guard_size == 0, "guard size is applied");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -361,9 +1315,23 @@ main(int argc, char **argv)
 	test_push();
 	test_thread_pool_delete();
 	test_thread_pool_max_tasks();
+	test_multi_producer();
+	test_recursive_tasks();
+	test_elastic_threads();
+	test_task_callables();
+	test_batch();
+	test_affinity();
+	test_priorities();
+	test_dependencies();
+	test_stats();
+	test_parallel_for();
 	test_timed_join();
 	test_detach_stress();
 	test_detach_long();
+	test_coro();
+	test_completion();
+	test_cancel();
+	test_stack_size();
 
 	unit_test_finish();
 	return 0;
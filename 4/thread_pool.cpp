@@ -1,76 +1,1719 @@
 #include "thread_pool.h"
+#include "probe.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <math.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <new>
+#include <vector>
+
+enum {
+	/** Power of 2, bigger than the max task count. */
+	TPOOL_QUEUE_SIZE = 128 * 1024,
+	/**
+	 * Power of 2, size of a worker's own deque. When it is full, the
+	 * tasks go to the shared queue.
+	 */
+	TPOOL_DEQUE_SIZE = 1024,
+	/** Deleted tasks kept by a thread for reuse. */
+	TPOOL_TASK_CACHE_SIZE = 1024,
+	/** Deleted tasks moved between the threads at once. */
+	TPOOL_TASK_BATCH_SIZE = 64,
+	/** Batches of the deleted tasks kept for all the threads. */
+	TPOOL_TASK_DEPOT_SIZE = 256,
+	/** Dequeue attempts of an idle worker before it sleeps. */
+	TPOOL_SPIN_COUNT = 100,
+	/**
+	 * Each that search of a worker for a task goes from the low
+	 * priority up, so the low priority tasks are not starved.
+	 */
+	TPOOL_AGING_PERIOD = 16,
+	/**
+	 * The data written by different threads is kept this far apart,
+	 * so they don't bounce a shared line between the caches.
+	 */
+#ifdef __cpp_lib_hardware_interference_size
+	TPOOL_CACHE_LINE = std::hardware_destructive_interference_size,
+#else
+	TPOOL_CACHE_LINE = 64,
+#endif
+};
+
+static_assert((TPOOL_QUEUE_SIZE & (TPOOL_QUEUE_SIZE - 1)) == 0,
+	"the queue size must be a power of 2");
+static_assert((int)TPOOL_QUEUE_SIZE > (int)TPOOL_MAX_TASKS,
+	"the queue must fit all the tasks");
+static_assert((TPOOL_DEQUE_SIZE & (TPOOL_DEQUE_SIZE - 1)) == 0,
+	"the deque size must be a power of 2");
+
+enum thread_task_state {
+	/** Never pushed, or joined. Can be pushed or deleted. */
+	TASK_STATE_NEW,
+	TASK_STATE_QUEUED,
+	TASK_STATE_RUNNING,
+	/** Finished, but not joined yet. */
+	TASK_STATE_FINISHED,
+	TASK_STATE_JOINED,
+	/** Waits for the predecessors, the last of them pushes it. */
+	TASK_STATE_PENDING,
+	/**
+	 * Or-ed to the state by a joiner going to sleep on the state as on
+	 * a futex. Only then the finish costs a wakeup syscall.
+	 */
+	TASK_STATE_WAITED = 0x100,
+	/** Or-ed to the state of a task to delete on the finish. */
+	TASK_STATE_DETACHED = 0x200,
+	/**
+	 * Or-ed by the cancel. A task not started by then is finished
+	 * without a run, a running one sees it as its cancellation token.
+	 */
+	TASK_STATE_CANCELLED = 0x400,
+	TASK_STATE_FLAGS = TASK_STATE_WAITED | TASK_STATE_DETACHED |
+			   TASK_STATE_CANCELLED,
+};
 
 struct thread_task {
 	thread_task_f function;
+	/** The pool of the last push. */
+	struct thread_pool *pool;
+	/** The group which joins the task, if set. */
+	struct thread_task_group *group;
+	enum thread_task_priority priority;
+	/** Relative deadline in seconds, 0 if none. */
+	double deadline;
+	/** Absolute CLOCK_MONOTONIC deadline of the last push, in ns. */
+	uint64_t deadline_at;
+	/** CLOCK_MONOTONIC time of the last push, in ns. */
+	uint64_t push_time;
+	/** Next in the cache of the deleted tasks. */
+	struct thread_task *next_free;
+	/** Next batch in the depot, if the task is a batch head. */
+	struct thread_task *next_batch;
+	/** Tasks to push when this one is finished. */
+	std::vector<struct thread_task *> successors;
+	/** Predecessors not finished yet. */
+	int dep_count;
+	/** Next of the ready successors run by the same worker. */
+	struct thread_task *next_ready;
+	/** Goes to the completion queue of the pool when finished. */
+	bool is_notify;
+	/** Next in the completion queue. */
+	struct thread_task *next_completed;
+	/**
+	 * Also a futex word, the joiner sleeps on it. On its own line: it
+	 * is polled by the user threads, and the worker writes the other
+	 * fields meanwhile. The predecessors' workers also change the
+	 * dep_count concurrently.
+	 */
+	alignas(TPOOL_CACHE_LINE) int state;
+};
+
+/** A latch to join many tasks by one wait. */
+struct thread_task_group {
+	pthread_mutex_t mutex;
+	/** Broadcast when no pushed tasks are left. */
+	pthread_cond_t cond;
+	/** Tasks pushed, but not finished yet. Changed under the mutex. */
+	int pending_count;
+};
+
+/** Deleted tasks of a thread. */
+struct thread_task_cache {
+	struct thread_task *head = NULL;
+	int size = 0;
+
+	~thread_task_cache()
+	{
+		while (head != NULL) {
+			struct thread_task *t = head;
+			head = t->next_free;
+			delete t;
+		}
+	}
+};
 
-	/* PUT HERE OTHER MEMBERS */
+/**
+ * Batches of the deleted tasks shared by all the threads. A thread
+ * which deletes more tasks than creates, like a worker finishing the
+ * detached ones, gives the batches away when its cache is full. A
+ * thread which creates more takes them when its cache is empty. So a
+ * task costs one lock per batch instead of a malloc and a free from
+ * the different threads.
+ */
+struct thread_task_depot {
+	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	struct thread_task *batches = NULL;
+	int batch_count = 0;
+
+	~thread_task_depot()
+	{
+		while (batches != NULL) {
+			struct thread_task *t = batches;
+			batches = t->next_batch;
+			while (t != NULL) {
+				struct thread_task *next = t->next_free;
+				delete t;
+				t = next;
+			}
+		}
+	}
+};
+
+/**
+ * Bounded lock-free MPMC queue by Dmitry Vyukov. Each cell has a
+ * sequence number telling whose turn it is: a producer's when it
+ * equals the position, a consumer's when it is the position + 1.
+ */
+struct thread_queue_cell {
+	/**
+	 * The sequence number minus the cell index. Then the initial
+	 * numbers are zeros, and the queue memory of an idle pool isn't
+	 * touched at all.
+	 */
+	size_t seq;
+	struct thread_task *task;
+};
+
+struct thread_queue {
+	struct thread_queue_cell *cells;
+	alignas(TPOOL_CACHE_LINE) size_t enqueue_pos;
+	alignas(TPOOL_CACHE_LINE) size_t dequeue_pos;
+};
+
+enum thread_worker_state {
+	/** The thread is never started in that slot. */
+	WORKER_STATE_FREE,
+	WORKER_STATE_ACTIVE,
+	/** The thread has exited or is exiting, but isn't joined yet. */
+	WORKER_STATE_RETIRED,
+};
+
+/**
+ * A worker thread with its own Chase-Lev deque. The owner pushes and
+ * takes the tasks at the bottom, others steal them from the top. So
+ * the tasks pushed from inside a task mostly don't touch the shared
+ * queue, and the newest ones, still hot in the cache, run first.
+ */
+struct thread_worker {
+	struct thread_pool *pool;
+	pthread_t thread;
+	int id;
+	/** NUMA node index, of the pool's nodes. */
+	int node;
+	/** Protected by the pool's threads mutex. */
+	enum thread_worker_state state;
+	/**
+	 * Statistics. Only the thread of the slot writes them, and with
+	 * atomic stores, so the readers see no torn values. With no shared
+	 * counters the tasks don't contend on them. Not with the fields
+	 * above, which the thieves read on each steal.
+	 */
+	alignas(TPOOL_CACHE_LINE) uint64_t start_time;
+	/** Searches for a task, to take the low priority ones sometimes. */
+	unsigned find_count;
+	uint64_t busy_time;
+	uint64_t finished_count;
+	uint64_t steal_count;
+	/** Tasks being run, more than 1 when they help in a join. */
+	int running_count;
+	uint64_t wait_histogram[TPOOL_HISTOGRAM_SIZE];
+	uint64_t run_histogram[TPOOL_HISTOGRAM_SIZE];
+	alignas(TPOOL_CACHE_LINE) int64_t top;
+	alignas(TPOOL_CACHE_LINE) int64_t bottom;
+	struct thread_task *deque[TPOOL_DEQUE_SIZE];
 };
 
 struct thread_pool {
-	std::vector<pthread_t> threads;
+	/**
+	 * Max thread count of slots. The workers are allocated at the
+	 * first start of a thread in the slot, and are reused after the
+	 * thread retires.
+	 */
+	struct thread_worker **workers;
+	/** Protects the thread start and retirement. */
+	pthread_mutex_t threads_mutex;
+	int max_thread_count;
+	/** Relative timeout for the futex, NULL means infinite. */
+	struct timespec *idle_timeout;
+	struct timespec idle_timeout_value;
+	/**
+	 * Allowed CPUs of each NUMA node. A pool not aware of NUMA has one
+	 * node with all the allowed CPUs.
+	 */
+	std::vector<cpu_set_t> node_cpus;
+	/** Node index of each CPU, empty when there is one node. */
+	std::vector<int> cpu_nodes;
+	/** The workers are pinned to the CPUs of their nodes. */
+	bool is_pinned;
+	/** Stack and guard of the threads, 0 and -1 for the defaults. */
+	size_t stack_size;
+	ssize_t guard_size;
+	/** Shared queue of each node and priority, by node. */
+	struct thread_queue *queues;
+	/** Protects the deadline heap. */
+	pthread_mutex_t deadline_mutex;
+	/** Tasks with deadlines, the earliest on top. */
+	std::vector<struct thread_task *> deadline_heap;
+	/** Size of the heap, to skip the lock when it is empty. */
+	int deadline_count;
+	/**
+	 * Protects the completion queue and its eventfd. Apart from the
+	 * deadline count, read by each search for a task.
+	 */
+	alignas(TPOOL_CACHE_LINE) pthread_mutex_t completion_mutex;
+	/** Finished notify tasks not popped yet, the oldest first. */
+	struct thread_task *completed_head;
+	struct thread_task *completed_tail;
+	/** Readable while the completion queue isn't empty, -1 if none. */
+	int completion_fd;
 
-	/* PUT HERE OTHER MEMBERS */
+	/**
+	 * Slots ever used, the thieves look only at them. Read on each
+	 * search, and rarely changed.
+	 */
+	alignas(TPOOL_CACHE_LINE) int slot_count;
+	/** Running threads. */
+	int thread_count;
+	bool is_stopped;
+	/** Queued and running tasks. Changed by each push and finish. */
+	alignas(TPOOL_CACHE_LINE) int task_count;
+	/**
+	 * Workers which are going to sleep or sleep on the futex. Read by
+	 * each push, changed only by the sleeps and the wakeups.
+	 */
+	alignas(TPOOL_CACHE_LINE) int sleep_count;
+	/** Changed on each wakeup, so a sleep on a stale value fails. */
+	uint32_t futex;
 };
 
+/** The worker of the current thread, if it is a pool thread. */
+static thread_local struct thread_worker *current_worker = NULL;
+/** The task run by the current thread, the innermost in a help. */
+static thread_local struct thread_task *current_task = NULL;
+
+static thread_local struct thread_task_cache task_cache;
+
+/**
+ * Created on the first use, so it is destroyed before the globals
+ * created before main(), like the leak checkers.
+ */
+static struct thread_task_depot &
+thread_task_depot_get(void)
+{
+	static struct thread_task_depot depot;
+	return depot;
+}
+
+static inline uint64_t
+clock_monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Add to the counter having the only writer. */
+static inline void
+stat_inc(uint64_t *counter, uint64_t value = 1)
+{
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+/** Bucket i of a histogram counts the times of [2^i, 2^(i + 1)) ns. */
+static inline void
+stat_histogram_add(uint64_t *histogram, uint64_t duration)
+{
+	int i = 63 - __builtin_clzll(duration | 1);
+	stat_inc(&histogram[i < TPOOL_HISTOGRAM_SIZE ? i :
+			    TPOOL_HISTOGRAM_SIZE - 1]);
+}
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+/** False on the timeout. */
+static bool
+futex_wait(uint32_t *addr, uint32_t value, const struct timespec *timeout)
+{
+	return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, timeout,
+		       NULL, 0) == 0 || errno != ETIMEDOUT;
+}
+
+/** Wait until the absolute CLOCK_MONOTONIC deadline. */
+static void
+futex_wait_until(uint32_t *addr, uint32_t value,
+		 const struct timespec *deadline)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, value, deadline,
+		NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+static void
+futex_wake(uint32_t *addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/**
+ * Push the tasks into the consecutive cells, taken by one atomic add.
+ * No contention with the other pushers and no full queue checks are
+ * needed. The pushed tasks are already counted in the pool's task
+ * count, which is less than the queue size. So when a cell is taken
+ * again after a full circle, its previous task is popped, and even
+ * finished.
+ */
+static void
+thread_queue_push(struct thread_queue *queue, struct thread_task **tasks,
+		  int count)
+{
+	size_t pos = __atomic_fetch_add(&queue->enqueue_pos, count,
+					__ATOMIC_RELAXED);
+	for (int i = 0; i < count; ++i, ++pos) {
+		size_t idx = pos & (TPOOL_QUEUE_SIZE - 1);
+		struct thread_queue_cell *cell = &queue->cells[idx];
+		cell->task = tasks[i];
+		__atomic_store_n(&cell->seq, pos + 1 - idx, __ATOMIC_RELEASE);
+	}
+}
+
+static struct thread_task *
+thread_queue_pop(struct thread_queue *queue)
+{
+	struct thread_queue_cell *cell;
+	size_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+	while (true) {
+		size_t idx = pos & (TPOOL_QUEUE_SIZE - 1);
+		cell = &queue->cells[idx];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) + idx;
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&queue->dequeue_pos,
+					      __ATOMIC_RELAXED);
+		}
+	}
+	struct thread_task *task = cell->task;
+	__atomic_store_n(&cell->seq, pos + TPOOL_QUEUE_SIZE -
+			 (pos & (TPOOL_QUEUE_SIZE - 1)), __ATOMIC_RELEASE);
+	return task;
+}
+
+/*
+ * The deque follows "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" by Le, Pop, Cohen and Zappa Nardelli.
+ */
+
+/** Push to the bottom, only by the owner. False if full. */
+static bool
+thread_deque_push(struct thread_worker *w, struct thread_task *task)
+{
+	int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	if (b - t >= TPOOL_DEQUE_SIZE)
+		return false;
+	__atomic_store_n(&w->deque[b & (TPOOL_DEQUE_SIZE - 1)], task,
+			 __ATOMIC_RELAXED);
+	/* Same as a release fence before, but seen by the sanitizers. */
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/** Take from the bottom, only by the owner. */
+static struct thread_task *
+thread_deque_take(struct thread_worker *w)
+{
+	int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+	if (t > b) {
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	struct thread_task *task = __atomic_load_n(
+		&w->deque[b & (TPOOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	if (t < b)
+		return task;
+	/* The last task, race with the thieves for it. */
+	if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		task = NULL;
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	return task;
+}
+
+/**
+ * Steal from the top, by any thread. On a lost race with another
+ * thief or the owner the flag is set, the deque might be not empty.
+ */
+static struct thread_task *
+thread_deque_steal(struct thread_worker *w, bool *is_contended)
+{
+	int64_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+	struct thread_task *task = __atomic_load_n(
+		&w->deque[t & (TPOOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		*is_contended = true;
+		return NULL;
+	}
+	return task;
+}
+
+static inline struct thread_queue *
+thread_pool_queue(struct thread_pool *pool, int node,
+		  enum thread_task_priority priority)
+{
+	return &pool->queues[node * TPOOL_PRIORITY_COUNT + priority];
+}
+
+/** Pop from the queues of the priority, the node's one first. */
+static struct thread_task *
+thread_pool_queues_pop(struct thread_pool *pool, int node,
+		       enum thread_task_priority priority)
+{
+	int node_count = (int)pool->node_cpus.size();
+	for (int i = 0; i < node_count; ++i) {
+		struct thread_queue *q = thread_pool_queue(
+			pool, (node + i) % node_count, priority);
+		struct thread_task *task = thread_queue_pop(q);
+		if (task != NULL)
+			return task;
+	}
+	return NULL;
+}
+
+static inline bool
+thread_task_deadline_greater(const struct thread_task *a,
+			     const struct thread_task *b)
+{
+	return a->deadline_at > b->deadline_at;
+}
+
+static void
+thread_pool_deadline_push(struct thread_pool *pool, struct thread_task *task)
+{
+	pthread_mutex_lock(&pool->deadline_mutex);
+	pool->deadline_heap.push_back(task);
+	std::push_heap(pool->deadline_heap.begin(), pool->deadline_heap.end(),
+		       thread_task_deadline_greater);
+	__atomic_add_fetch(&pool->deadline_count, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pool->deadline_mutex);
+}
+
+/** Pop the task with the earliest deadline. */
+static struct thread_task *
+thread_pool_deadline_pop(struct thread_pool *pool)
+{
+	if (__atomic_load_n(&pool->deadline_count, __ATOMIC_SEQ_CST) == 0)
+		return NULL;
+	struct thread_task *task = NULL;
+	pthread_mutex_lock(&pool->deadline_mutex);
+	if (!pool->deadline_heap.empty()) {
+		std::pop_heap(pool->deadline_heap.begin(),
+			      pool->deadline_heap.end(),
+			      thread_task_deadline_greater);
+		task = pool->deadline_heap.back();
+		pool->deadline_heap.pop_back();
+		__atomic_sub_fetch(&pool->deadline_count, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&pool->deadline_mutex);
+	return task;
+}
+
+/**
+ * Find a task. The earliest deadline first, then the high priority
+ * queues. Then the own deque of the worker, if it is given, and the
+ * normal priority queues. Then steal from the workers of the same
+ * node, and then from the other ones. The low priority queues are the
+ * last, except for each TPOOL_AGING_PERIOD search, which starts from
+ * them.
+ */
+static struct thread_task *
+thread_pool_find_task(struct thread_pool *pool, struct thread_worker *self,
+		      bool *is_contended)
+{
+	struct thread_task *task;
+	int node = self != NULL ? self->node : 0;
+	if (self != NULL && ++self->find_count % TPOOL_AGING_PERIOD == 0 &&
+	    (task = thread_pool_queues_pop(pool, node, TPOOL_PRIORITY_LOW)) !=
+	    NULL)
+		return task;
+	if ((task = thread_pool_deadline_pop(pool)) != NULL)
+		return task;
+	if ((task = thread_pool_queues_pop(pool, node, TPOOL_PRIORITY_HIGH)) !=
+	    NULL)
+		return task;
+	if (self != NULL && (task = thread_deque_take(self)) != NULL)
+		return task;
+	if ((task = thread_pool_queues_pop(pool, node,
+					   TPOOL_PRIORITY_NORMAL)) != NULL)
+		return task;
+	int node_count = (int)pool->node_cpus.size();
+	int count = __atomic_load_n(&pool->slot_count, __ATOMIC_ACQUIRE);
+	int start = self != NULL ? self->id + 1 : 0;
+	for (int is_remote = 0; is_remote < 2; ++is_remote) {
+		for (int i = 0; i < count; ++i) {
+			/* The slots of the other nodes can be still unused. */
+			struct thread_worker *w = __atomic_load_n(
+				&pool->workers[(start + i) % count],
+				__ATOMIC_ACQUIRE);
+			if (w == NULL || w == self ||
+			    (w->node != node) != (bool)is_remote)
+				continue;
+			if ((task = thread_deque_steal(w, is_contended)) != NULL) {
+				if (self != NULL)
+					stat_inc(&self->steal_count);
+				return task;
+			}
+		}
+		if (node_count == 1)
+			break;
+	}
+	return thread_pool_queues_pop(pool, node, TPOOL_PRIORITY_LOW);
+}
+
+/** Change the state, but keep the flags. Return the old state. */
+static inline int
+thread_task_set_state(struct thread_task *task, int new_state)
+{
+	int state = __atomic_load_n(&task->state, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&task->state, &state,
+					    new_state |
+					    (state & TASK_STATE_FLAGS), true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	return state;
+}
+
+/** Take a batch of the deleted tasks from the depot, if there is one. */
+static void
+thread_task_cache_refill(void)
+{
+	struct thread_task_depot &task_depot = thread_task_depot_get();
+	if (__atomic_load_n(&task_depot.batch_count, __ATOMIC_RELAXED) == 0)
+		return;
+	pthread_mutex_lock(&task_depot.mutex);
+	struct thread_task *batch = task_depot.batches;
+	if (batch != NULL) {
+		task_depot.batches = batch->next_batch;
+		__atomic_store_n(&task_depot.batch_count,
+				 task_depot.batch_count - 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&task_depot.mutex);
+	if (batch == NULL)
+		return;
+	task_cache.head = batch;
+	task_cache.size = TPOOL_TASK_BATCH_SIZE;
+}
+
+/** Give a batch of the cached tasks to the depot, or free them. */
+static void
+thread_task_cache_flush(void)
+{
+	struct thread_task *batch = task_cache.head;
+	struct thread_task *last = batch;
+	for (int i = 1; i < TPOOL_TASK_BATCH_SIZE; ++i)
+		last = last->next_free;
+	task_cache.head = last->next_free;
+	task_cache.size -= TPOOL_TASK_BATCH_SIZE;
+	last->next_free = NULL;
+	struct thread_task_depot &task_depot = thread_task_depot_get();
+	pthread_mutex_lock(&task_depot.mutex);
+	if (task_depot.batch_count < TPOOL_TASK_DEPOT_SIZE) {
+		batch->next_batch = task_depot.batches;
+		task_depot.batches = batch;
+		__atomic_store_n(&task_depot.batch_count,
+				 task_depot.batch_count + 1, __ATOMIC_RELAXED);
+		batch = NULL;
+	}
+	pthread_mutex_unlock(&task_depot.mutex);
+	while (batch != NULL) {
+		struct thread_task *next = batch->next_free;
+		delete batch;
+		batch = next;
+	}
+}
+
+/** Put the deleted task into the cache of the current thread. */
+static void
+thread_task_free(struct thread_task *task)
+{
+	/* The captures are released now, not at the reuse. */
+	task->function.reset();
+	if (task_cache.size >= TPOOL_TASK_CACHE_SIZE)
+		thread_task_cache_flush();
+	task->next_free = task_cache.head;
+	task_cache.head = task;
+	++task_cache.size;
+}
+
+static void
+thread_pool_enqueue(struct thread_pool *pool, struct thread_task **tasks,
+		    int count);
+
+static void
+thread_task_prepare_push(struct thread_pool *pool, struct thread_task *task,
+			 uint64_t now)
+{
+	task->pool = pool;
+	task->push_time = now;
+	thread_task_set_state(task, TASK_STATE_QUEUED);
+	PROBE3(thread_pool, enqueue, pool, task, task->priority);
+	if (task->group != NULL) {
+		pthread_mutex_lock(&task->group->mutex);
+		__atomic_add_fetch(&task->group->pending_count, 1,
+				   __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&task->group->mutex);
+	}
+}
+
+/**
+ * Release the successors of the finished task. The ready ones are
+ * pushed before the task leaves the pool's task count, so the pool
+ * can't be deleted meanwhile. The first of them, and all of them if
+ * the pool is full, are added to the list to run by this worker.
+ */
+static void
+thread_task_release_successors(struct thread_pool *pool,
+			       struct thread_task *task,
+			       struct thread_task **run_list)
+{
+	std::vector<struct thread_task *> &ready = task->successors;
+	size_t count = 0;
+	for (struct thread_task *next : task->successors) {
+		if (__atomic_sub_fetch(&next->dep_count, 1, __ATOMIC_ACQ_REL) == 0)
+			ready[count++] = next;
+	}
+	size_t run_count = 1;
+	if (count > 1) {
+		int n = (int)count - 1;
+		if (__atomic_add_fetch(&pool->task_count, n, __ATOMIC_RELAXED) >
+		    TPOOL_MAX_TASKS) {
+			__atomic_sub_fetch(&pool->task_count, n, __ATOMIC_RELAXED);
+			run_count = count;
+		} else {
+			thread_pool_enqueue(pool, &ready[1], n);
+		}
+	}
+	for (size_t i = 0; i < run_count && i < count; ++i) {
+		__atomic_add_fetch(&pool->task_count, 1, __ATOMIC_RELAXED);
+		thread_task_prepare_push(pool, ready[i], 0);
+		ready[i]->next_ready = *run_list;
+		*run_list = ready[i];
+	}
+	ready.clear();
+}
+
+/**
+ * Finish a notify task into the completion queue. The eventfd counter
+ * is 1 while the queue isn't empty, so it is written only by the first
+ * task of a batch, and the event loop wakes up once for all of them.
+ */
+static void
+thread_task_finish_notify(struct thread_pool *pool, struct thread_task *task)
+{
+	task->next_completed = NULL;
+	pthread_mutex_lock(&pool->completion_mutex);
+	/*
+	 * Under the lock, so the pool delete sees either the task in the
+	 * pool, or in the queue.
+	 */
+	__atomic_sub_fetch(&pool->task_count, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&task->state, TASK_STATE_FINISHED, __ATOMIC_RELEASE);
+	if (pool->completed_tail == NULL) {
+		pool->completed_head = task;
+		if (pool->completion_fd >= 0)
+			eventfd_write(pool->completion_fd, 1);
+	} else {
+		pool->completed_tail->next_completed = task;
+	}
+	pool->completed_tail = task;
+	pthread_mutex_unlock(&pool->completion_mutex);
+}
+
+static void
+thread_task_finish(struct thread_pool *pool, struct thread_task *task)
+{
+	/* Nobody joins or detaches it, it is popped from the pool. */
+	if (task->is_notify) {
+		thread_task_finish_notify(pool, task);
+		return;
+	}
+	/* The task can be deleted or pushed again right after the finish. */
+	struct thread_task_group *group = task->group;
+	/* Before the joiner wakes up, so the pool can be deleted. */
+	__atomic_sub_fetch(&pool->task_count, 1, __ATOMIC_RELEASE);
+	/* A task of a group is joined by the group. */
+	int state = __atomic_exchange_n(&task->state, group == NULL ?
+					TASK_STATE_FINISHED : TASK_STATE_JOINED,
+					__ATOMIC_SEQ_CST);
+	/*
+	 * The joiner might have seen the finish already, and even deleted
+	 * the task. A wakeup on a stale address is harmless though, the
+	 * futex sleepers always check their condition again.
+	 */
+	if ((state & TASK_STATE_WAITED) != 0)
+		futex_wake((uint32_t *)&task->state, 1);
+	/* Nobody has the task anymore, it is reused by this worker. */
+	if ((state & TASK_STATE_DETACHED) != 0)
+		thread_task_free(task);
+	if (group == NULL)
+		return;
+	pthread_mutex_lock(&group->mutex);
+	/* Atomic for the helping joiners, which read it without the lock. */
+	if (__atomic_sub_fetch(&group->pending_count, 1, __ATOMIC_RELEASE) == 0)
+		pthread_cond_broadcast(&group->cond);
+	pthread_mutex_unlock(&group->mutex);
+}
+
+/**
+ * Run the task, and then its ready successors right here, in a loop.
+ * So a chain goes on in the same worker with a hot cache.
+ */
+static void
+thread_task_execute(struct thread_pool *pool, struct thread_task *task)
+{
+	struct thread_worker *self = current_worker;
+	struct thread_task *prev_task = current_task;
+	task->next_ready = NULL;
+	struct thread_task *run_list = task;
+	uint64_t start = clock_monotonic_ns();
+	while ((task = run_list) != NULL) {
+		run_list = task->next_ready;
+		/* The successors run in place didn't wait at all. */
+		stat_histogram_add(self->wait_histogram, task->push_time != 0 ?
+				   start - task->push_time : 0);
+		PROBE3(thread_pool, dequeue, task, self->id, task->push_time != 0 ?
+		       start - task->push_time : 0);
+		__atomic_store_n(&self->running_count, self->running_count + 1,
+				 __ATOMIC_RELAXED);
+		/*
+		 * The cancelled tasks are not removed from the queues and the
+		 * deques, those are lock-free. They are dropped here instead.
+		 */
+		if ((thread_task_set_state(task, TASK_STATE_RUNNING) &
+		     TASK_STATE_CANCELLED) == 0) {
+			current_task = task;
+			task->function();
+		}
+		uint64_t end = clock_monotonic_ns();
+		stat_histogram_add(self->run_histogram, end - start);
+		stat_inc(&self->finished_count);
+		/* The nested tasks of a helping join are busy time already. */
+		if (self->running_count == 1)
+			stat_inc(&self->busy_time, end - start);
+		__atomic_store_n(&self->running_count, self->running_count - 1,
+				 __ATOMIC_RELAXED);
+		if (!task->successors.empty())
+			thread_task_release_successors(pool, task, &run_list);
+		thread_task_finish(pool, task);
+		start = end;
+	}
+	current_task = prev_task;
+}
+
+/**
+ * Run the other tasks of the worker's pool until the value becomes the
+ * target, or there is nothing to run. Otherwise the recursive tasks
+ * waiting for their subtasks could occupy all the threads, and nobody
+ * would run the subtasks.
+ */
+static void
+thread_worker_help_until(struct thread_worker *self, const int *value,
+			 int target)
+{
+	while (__atomic_load_n(value, __ATOMIC_ACQUIRE) != target) {
+		bool is_contended = false;
+		struct thread_task *other =
+			thread_pool_find_task(self->pool, self, &is_contended);
+		if (other != NULL)
+			thread_task_execute(self->pool, other);
+		else if (is_contended)
+			cpu_relax();
+		else
+			return;
+	}
+}
+
+/**
+ * Exit the idle worker, unless a task has appeared meanwhile. Then the
+ * task is returned and the worker stays.
+ */
+static bool
+thread_worker_retire(struct thread_worker *self, struct thread_task **task)
+{
+	struct thread_pool *pool = self->pool;
+	pthread_mutex_lock(&pool->threads_mutex);
+	/*
+	 * Leave the thread count before the last check of the queues. A
+	 * pusher either sees it and starts a new thread, or its task is
+	 * seen here.
+	 */
+	__atomic_sub_fetch(&pool->thread_count, 1, __ATOMIC_SEQ_CST);
+	bool is_contended = false;
+	*task = thread_pool_find_task(pool, self, &is_contended);
+	if (*task != NULL || is_contended) {
+		__atomic_add_fetch(&pool->thread_count, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&pool->threads_mutex);
+		return false;
+	}
+	self->state = WORKER_STATE_RETIRED;
+	pthread_mutex_unlock(&pool->threads_mutex);
+	return true;
+}
+
+/**
+ * Get a task, or sleep until there is one. NULL means the pool is
+ * stopped, or the worker was idle for too long and has retired.
+ */
+static struct thread_task *
+thread_pool_wait_task(struct thread_worker *self)
+{
+	struct thread_pool *pool = self->pool;
+	while (true) {
+		bool is_contended = false;
+		for (int i = 0; i < TPOOL_SPIN_COUNT; ++i) {
+			struct thread_task *task =
+				thread_pool_find_task(pool, self, &is_contended);
+			if (task != NULL)
+				return task;
+			cpu_relax();
+		}
+		/*
+		 * Announce the sleep before the last check of the queues. A
+		 * pusher either sees the announcement and changes the futex,
+		 * or its task is seen here.
+		 */
+		__atomic_add_fetch(&pool->sleep_count, 1, __ATOMIC_SEQ_CST);
+		uint32_t value = __atomic_load_n(&pool->futex, __ATOMIC_SEQ_CST);
+		is_contended = false;
+		struct thread_task *task =
+			thread_pool_find_task(pool, self, &is_contended);
+		bool is_woken = true;
+		if (task == NULL && !is_contended &&
+		    !__atomic_load_n(&pool->is_stopped, __ATOMIC_SEQ_CST))
+			is_woken = futex_wait(&pool->futex, value,
+					      pool->idle_timeout);
+		__atomic_sub_fetch(&pool->sleep_count, 1, __ATOMIC_SEQ_CST);
+		if (task != NULL)
+			return task;
+		if (__atomic_load_n(&pool->is_stopped, __ATOMIC_SEQ_CST))
+			return NULL;
+		if (!is_woken && thread_worker_retire(self, &task))
+			return NULL;
+		if (task != NULL)
+			return task;
+	}
+}
+
+static void *
+thread_pool_worker_f(void *arg)
+{
+	struct thread_worker *self = (struct thread_worker *)arg;
+	struct thread_pool *pool = self->pool;
+	current_worker = self;
+	struct thread_task *task;
+	while ((task = thread_pool_wait_task(self)) != NULL)
+		thread_task_execute(pool, task);
+	return NULL;
+}
+
 int
 thread_pool_new(int thread_count, struct thread_pool **pool)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)thread_count;
-	(void)pool;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	if (thread_count > TPOOL_MAX_THREADS)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	struct thread_pool_opts opts;
+	opts.max_thread_count = thread_count;
+	return thread_pool_new_opts(&opts, pool);
+}
+
+/**
+ * Read a sysfs list of CPUs or nodes, like "0-3,8,10-11". False if it
+ * can't be read.
+ */
+static bool
+sysfs_list_read(const char *path, std::vector<int> &ids)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return false;
+	int first;
+	while (fscanf(f, "%d", &first) == 1) {
+		int last = first;
+		int c = fgetc(f);
+		if (c == '-') {
+			if (fscanf(f, "%d", &last) != 1)
+				break;
+			c = fgetc(f);
+		}
+		for (int id = first; id <= last; ++id)
+			ids.push_back(id);
+		if (c != ',')
+			break;
+	}
+	fclose(f);
+	return true;
+}
+
+/**
+ * Split the allowed CPUs by the NUMA nodes of the machine. The nodes
+ * without the allowed CPUs are skipped. Without sysfs no nodes are
+ * found.
+ */
+static void
+thread_pool_discover_nodes(struct thread_pool *pool, const cpu_set_t *allowed)
+{
+	std::vector<int> nodes;
+	if (!sysfs_list_read("/sys/devices/system/node/possible", nodes))
+		return;
+	std::vector<int> cpu_nodes(CPU_SETSIZE, 0);
+	for (int node : nodes) {
+		char path[64];
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%d/cpulist", node);
+		std::vector<int> cpus;
+		if (!sysfs_list_read(path, cpus))
+			continue;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu : cpus) {
+			if (cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, allowed))
+				continue;
+			CPU_SET(cpu, &set);
+			cpu_nodes[cpu] = (int)pool->node_cpus.size();
+		}
+		if (CPU_COUNT(&set) > 0)
+			pool->node_cpus.push_back(set);
+	}
+	if (pool->node_cpus.size() > 1)
+		pool->cpu_nodes = std::move(cpu_nodes);
+}
+
+int
+thread_pool_new_opts(const struct thread_pool_opts *opts,
+		     struct thread_pool **pool)
+{
+	if (opts->max_thread_count <= 0 || !(opts->idle_timeout >= 0))
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (opts->cpu_set != NULL && CPU_COUNT(opts->cpu_set) == 0)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (opts->stack_size != 0 &&
+	    opts->stack_size < (size_t)PTHREAD_STACK_MIN)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	cpu_set_t allowed;
+	if (opts->cpu_set != NULL)
+		allowed = *opts->cpu_set;
+	else if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		CPU_ZERO(&allowed);
+	struct thread_pool *p = new thread_pool();
+	pthread_mutex_init(&p->threads_mutex, NULL);
+	p->max_thread_count = opts->max_thread_count;
+	p->stack_size = opts->stack_size;
+	p->guard_size = opts->guard_size;
+	/* Beyond 30 years is the same as never. */
+	if (opts->idle_timeout < 1e9) {
+		double sec = floor(opts->idle_timeout);
+		p->idle_timeout_value.tv_sec = (time_t)sec;
+		p->idle_timeout_value.tv_nsec =
+			(long)((opts->idle_timeout - sec) * 1e9);
+		p->idle_timeout = &p->idle_timeout_value;
+	}
+	if (opts->is_numa_aware && CPU_COUNT(&allowed) > 0)
+		thread_pool_discover_nodes(p, &allowed);
+	if (p->node_cpus.empty())
+		p->node_cpus.push_back(allowed);
+	p->is_pinned = (opts->cpu_set != NULL || opts->is_numa_aware) &&
+		       CPU_COUNT(&allowed) > 0;
+	p->workers = new thread_worker *[p->max_thread_count]();
+	pthread_mutex_init(&p->deadline_mutex, NULL);
+	pthread_mutex_init(&p->completion_mutex, NULL);
+	p->completion_fd = -1;
+	size_t queue_count = p->node_cpus.size() * TPOOL_PRIORITY_COUNT;
+	p->queues = new thread_queue[queue_count]();
+	for (size_t i = 0; i < queue_count; ++i) {
+		/* Zeroed pages from the kernel, touched only when used. */
+		p->queues[i].cells = (struct thread_queue_cell *)calloc(
+			TPOOL_QUEUE_SIZE, sizeof(struct thread_queue_cell));
+	}
+	*pool = p;
+	return 0;
+}
+
+int
+thread_pool_thread_count(const struct thread_pool *pool)
+{
+	return __atomic_load_n(&pool->thread_count, __ATOMIC_RELAXED);
+}
+
+int
+thread_pool_stats(const struct thread_pool *pool,
+		  struct thread_pool_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	int count = __atomic_load_n(&pool->slot_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < count; ++i) {
+		const struct thread_worker *w =
+			__atomic_load_n(&pool->workers[i], __ATOMIC_ACQUIRE);
+		if (w == NULL)
+			continue;
+		stats->running_count +=
+			__atomic_load_n(&w->running_count, __ATOMIC_RELAXED);
+		stats->finished_count +=
+			__atomic_load_n(&w->finished_count, __ATOMIC_RELAXED);
+		stats->steal_count +=
+			__atomic_load_n(&w->steal_count, __ATOMIC_RELAXED);
+		for (int j = 0; j < TPOOL_HISTOGRAM_SIZE; ++j) {
+			stats->wait_histogram[j] += __atomic_load_n(
+				&w->wait_histogram[j], __ATOMIC_RELAXED);
+			stats->run_histogram[j] += __atomic_load_n(
+				&w->run_histogram[j], __ATOMIC_RELAXED);
+		}
+	}
+	/* The nested running tasks are counted in the pool once. */
+	int task_count = __atomic_load_n(&pool->task_count, __ATOMIC_RELAXED);
+	stats->queued_count = std::max(task_count - stats->running_count, 0);
+	stats->thread_count = thread_pool_thread_count(pool);
+	return 0;
+}
+
+int
+thread_pool_worker_stats(const struct thread_pool *pool, int id,
+			 struct thread_worker_stats *stats)
+{
+	if (id < 0 || id >= pool->max_thread_count)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	memset(stats, 0, sizeof(*stats));
+	if (id >= __atomic_load_n(&pool->slot_count, __ATOMIC_ACQUIRE))
+		return 0;
+	const struct thread_worker *w =
+		__atomic_load_n(&pool->workers[id], __ATOMIC_ACQUIRE);
+	if (w == NULL)
+		return 0;
+	stats->finished_count =
+		__atomic_load_n(&w->finished_count, __ATOMIC_RELAXED);
+	stats->steal_count = __atomic_load_n(&w->steal_count, __ATOMIC_RELAXED);
+	uint64_t busy_time = __atomic_load_n(&w->busy_time, __ATOMIC_RELAXED);
+	uint64_t duration = clock_monotonic_ns() - w->start_time;
+	if (duration > 0)
+		stats->busy_ratio = std::min((double)busy_time / duration, 1.0);
+	return 0;
 }
 
 int
 thread_pool_delete(struct thread_pool *pool)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)pool;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	pthread_mutex_lock(&pool->completion_mutex);
+	bool has_tasks =
+		__atomic_load_n(&pool->task_count, __ATOMIC_ACQUIRE) != 0 ||
+		pool->completed_head != NULL;
+	pthread_mutex_unlock(&pool->completion_mutex);
+	if (has_tasks)
+		return TPOOL_ERR_HAS_TASKS;
+	__atomic_store_n(&pool->is_stopped, true, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&pool->futex, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&pool->futex, INT32_MAX);
+	/* All are joined before any is deleted, the others steal from it. */
+	for (int i = 0; i < pool->slot_count; ++i) {
+		struct thread_worker *w = pool->workers[i];
+		if (w != NULL && w->state != WORKER_STATE_FREE)
+			pthread_join(w->thread, NULL);
+	}
+	for (int i = 0; i < pool->slot_count; ++i)
+		delete pool->workers[i];
+	pthread_mutex_destroy(&pool->threads_mutex);
+	pthread_mutex_destroy(&pool->deadline_mutex);
+	pthread_mutex_destroy(&pool->completion_mutex);
+	if (pool->completion_fd >= 0)
+		close(pool->completion_fd);
+	delete[] pool->workers;
+	for (size_t i = 0; i < pool->node_cpus.size() * TPOOL_PRIORITY_COUNT; ++i)
+		free(pool->queues[i].cells);
+	delete[] pool->queues;
+	delete pool;
+	return 0;
+}
+
+/** The tasks are more than the threads, and the limit allows more. */
+static inline bool
+thread_pool_needs_thread(struct thread_pool *pool)
+{
+	int count = __atomic_load_n(&pool->thread_count, __ATOMIC_RELAXED);
+	return count < pool->max_thread_count &&
+	       count < __atomic_load_n(&pool->task_count, __ATOMIC_RELAXED);
+}
+
+/** Start a thread in the slot, under the threads mutex. */
+static bool
+thread_pool_start_worker(struct thread_pool *pool, int id)
+{
+	struct thread_worker *w = pool->workers[id];
+	if (w == NULL) {
+		w = new thread_worker();
+		w->pool = pool;
+		w->id = id;
+		w->node = id % (int)pool->node_cpus.size();
+		w->start_time = clock_monotonic_ns();
+		/* Thieves see only the initialized workers. */
+		__atomic_store_n(&pool->workers[id], w, __ATOMIC_RELEASE);
+	} else if (w->state == WORKER_STATE_RETIRED) {
+		/* Its deque is empty, only the thread is replaced. */
+		pthread_join(w->thread, NULL);
+		w->state = WORKER_STATE_FREE;
+	}
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (pool->is_pinned) {
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t),
+					    &pool->node_cpus[w->node]);
+	}
+	if (pool->stack_size != 0)
+		pthread_attr_setstacksize(&attr, pool->stack_size);
+	if (pool->guard_size >= 0)
+		pthread_attr_setguardsize(&attr, pool->guard_size);
+	w->state = WORKER_STATE_ACTIVE;
+	int rc = pthread_create(&w->thread, &attr, thread_pool_worker_f, w);
+	pthread_attr_destroy(&attr);
+	if (rc != 0) {
+		w->state = WORKER_STATE_FREE;
+		return false;
+	}
+	__atomic_add_fetch(&pool->thread_count, 1, __ATOMIC_RELAXED);
+	if (id >= pool->slot_count)
+		__atomic_store_n(&pool->slot_count, id + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/**
+ * A slot without a running thread, of the node if there is one. The
+ * slots go to the nodes round-robin.
+ */
+static int
+thread_pool_free_slot(struct thread_pool *pool, int node)
+{
+	int node_count = (int)pool->node_cpus.size();
+	int found = -1;
+	for (int id = 0; id < pool->max_thread_count; ++id) {
+		struct thread_worker *w = pool->workers[id];
+		if (w != NULL && w->state == WORKER_STATE_ACTIVE)
+			continue;
+		if (id % node_count == node)
+			return id;
+		if (found < 0)
+			found = id;
+	}
+	return found;
+}
+
+/** Start more workers if needed, preferably on the node. */
+static void
+thread_pool_grow(struct thread_pool *pool, int node)
+{
+	if (!thread_pool_needs_thread(pool))
+		return;
+	pthread_mutex_lock(&pool->threads_mutex);
+	while (thread_pool_needs_thread(pool) &&
+	       thread_pool_start_worker(pool, thread_pool_free_slot(pool, node)))
+		;
+	pthread_mutex_unlock(&pool->threads_mutex);
+}
+
+/** Node of the current thread, its tasks go to the node's queue. */
+static int
+thread_pool_current_node(struct thread_pool *pool)
+{
+	struct thread_worker *self = current_worker;
+	if (self != NULL && self->pool == pool)
+		return self->node;
+	if (pool->cpu_nodes.empty())
+		return 0;
+	int cpu = sched_getcpu();
+	if (cpu < 0 || cpu >= (int)pool->cpu_nodes.size())
+		return 0;
+	return pool->cpu_nodes[cpu];
+}
+
+/** Push the tasks, already counted in the pool's task count. */
+static void
+thread_pool_enqueue(struct thread_pool *pool, struct thread_task **tasks,
+		    int count)
+{
+	uint64_t now = clock_monotonic_ns();
+	for (int i = 0; i < count; ++i)
+		thread_task_prepare_push(pool, tasks[i], now);
+	/*
+	 * The normal priority tasks pushed from a task of the same pool go
+	 * to the own deque of the worker, as many as fit. The others go to
+	 * the queues of their priorities by runs of the same one.
+	 */
+	struct thread_worker *self = current_worker;
+	bool is_own = self != NULL && self->pool == pool;
+	int node = thread_pool_current_node(pool);
+	for (int i = 0; i < count;) {
+		struct thread_task *task = tasks[i];
+		if (task->deadline > 0) {
+			task->deadline_at = now + (uint64_t)(task->deadline * 1e9);
+			thread_pool_deadline_push(pool, task);
+			++i;
+			continue;
+		}
+		if (is_own && task->priority == TPOOL_PRIORITY_NORMAL &&
+		    thread_deque_push(self, task)) {
+			++i;
+			continue;
+		}
+		int end = i + 1;
+		while (end < count && tasks[end]->deadline == 0 &&
+		       tasks[end]->priority == task->priority)
+			++end;
+		thread_queue_push(thread_pool_queue(pool, node, task->priority),
+				  tasks + i, end - i);
+		i = end;
+	}
+	/*
+	 * Pairs with the sleep announcement and the retirement in the
+	 * workers.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	thread_pool_grow(pool, node);
+	int sleep_count = __atomic_load_n(&pool->sleep_count, __ATOMIC_SEQ_CST);
+	if (sleep_count > 0) {
+		__atomic_add_fetch(&pool->futex, 1, __ATOMIC_SEQ_CST);
+		futex_wake(&pool->futex, sleep_count < count ? sleep_count :
+			   count);
+	}
+}
+
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks,
+		       int count)
+{
+	if (count <= 0)
+		return count == 0 ? 0 : TPOOL_ERR_INVALID_ARGUMENT;
+	if (__atomic_add_fetch(&pool->task_count, count, __ATOMIC_RELAXED) >
+	    TPOOL_MAX_TASKS) {
+		__atomic_sub_fetch(&pool->task_count, count, __ATOMIC_RELAXED);
+		return TPOOL_ERR_TOO_MANY_TASKS;
+	}
+	thread_pool_enqueue(pool, tasks, count);
+	return 0;
 }
 
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)pool;
-	(void)task;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	return thread_pool_push_tasks(pool, &task, 1);
+}
+
+/**
+ * A range of a parallel loop, shared by its participants. The helper
+ * tasks can start after the range is done, and even after the caller
+ * returns, so it is on the heap with a reference per participant.
+ */
+struct parallel_range {
+	thread_range_f function;
+	void *ctx;
+	int64_t end;
+	int64_t grain;
+	int64_t size;
+	int participant_count;
+	int ref_count;
+	alignas(TPOOL_CACHE_LINE) int64_t next;
+	alignas(TPOOL_CACHE_LINE) int64_t done_count;
+	/** A futex word, set after all the indexes are done. */
+	int is_done;
+};
+
+static void
+parallel_range_unref(struct parallel_range *range)
+{
+	if (__atomic_sub_fetch(&range->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+		delete range;
+}
+
+/**
+ * Run the chunks until the range is exhausted. A chunk is a quarter of
+ * a fair share of the remaining indexes, but not less than the grain.
+ */
+static void
+parallel_range_run(struct parallel_range *range, int slot)
+{
+	int64_t divisor = (int64_t)range->participant_count * 4;
+	int64_t begin = __atomic_load_n(&range->next, __ATOMIC_RELAXED);
+	while (true) {
+		int64_t chunk;
+		do {
+			int64_t remaining = range->end - begin;
+			if (remaining <= 0)
+				return;
+			chunk = std::min(std::max(remaining / divisor, range->grain),
+					 remaining);
+		} while (!__atomic_compare_exchange_n(&range->next, &begin,
+						      begin + chunk, true,
+						      __ATOMIC_RELAXED,
+						      __ATOMIC_RELAXED));
+		range->function(range->ctx, begin, begin + chunk, slot);
+		if (__atomic_add_fetch(&range->done_count, chunk,
+				       __ATOMIC_ACQ_REL) == range->size) {
+			__atomic_store_n(&range->is_done, 1, __ATOMIC_RELEASE);
+			futex_wake((uint32_t *)&range->is_done, 1);
+			return;
+		}
+		begin += chunk;
+	}
+}
+
+int
+thread_pool_parallel_slot_count(const struct thread_pool *pool)
+{
+	return pool->max_thread_count + 1;
+}
+
+int
+thread_pool_parallel_run(struct thread_pool *pool, int64_t begin,
+			 int64_t end, int64_t grain, thread_range_f function,
+			 void *ctx)
+{
+	if (grain < 0)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (begin >= end)
+		return 0;
+	int64_t size = end - begin;
+	if (grain == 0)
+		grain = std::max(size / ((int64_t)pool->max_thread_count * 64),
+				 (int64_t)1);
+	int helper_count = (int)std::min((int64_t)pool->max_thread_count,
+					 (size + grain - 1) / grain - 1);
+	if (helper_count == 0) {
+		function(ctx, begin, end, 0);
+		return 0;
+	}
+	struct parallel_range *range = new parallel_range();
+	range->function = function;
+	range->ctx = ctx;
+	range->end = end;
+	range->grain = grain;
+	range->size = size;
+	range->participant_count = helper_count + 1;
+	range->ref_count = helper_count + 1;
+	range->next = begin;
+	std::vector<struct thread_task *> helpers(helper_count);
+	for (struct thread_task *&t : helpers) {
+		thread_task_new(&t, [range]() {
+			parallel_range_run(range, current_worker->id + 1);
+			parallel_range_unref(range);
+		});
+	}
+	if (thread_pool_push_tasks(pool, helpers.data(), helper_count) == 0) {
+		/* They delete themselves. */
+		for (struct thread_task *t : helpers)
+			thread_task_detach(t);
+	} else {
+		/* The pool is full, do it alone. */
+		for (struct thread_task *t : helpers)
+			thread_task_delete(t);
+		range->participant_count = 1;
+		range->ref_count = 1;
+	}
+	parallel_range_run(range, 0);
+	struct thread_worker *self = current_worker;
+	if (self != NULL && self->pool == pool)
+		thread_worker_help_until(self, &range->is_done, 1);
+	while (__atomic_load_n(&range->is_done, __ATOMIC_ACQUIRE) == 0)
+		futex_wait((uint32_t *)&range->is_done, 0, NULL);
+	parallel_range_unref(range);
+	return 0;
+}
+
+static struct thread_task *
+thread_task_alloc(void)
+{
+	if (task_cache.head == NULL)
+		thread_task_cache_refill();
+	struct thread_task *t = task_cache.head;
+	if (t != NULL) {
+		task_cache.head = t->next_free;
+		--task_cache.size;
+	} else {
+		t = new thread_task();
+	}
+	t->state = TASK_STATE_NEW;
+	t->pool = NULL;
+	t->group = NULL;
+	t->is_notify = false;
+	t->priority = TPOOL_PRIORITY_NORMAL;
+	t->deadline = 0;
+	return t;
 }
 
 int
 thread_task_new(struct thread_task **task, const thread_task_f &function)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	(void)function;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	struct thread_task *t = thread_task_alloc();
+	t->function = function;
+	*task = t;
+	return 0;
+}
+
+int
+thread_task_new(struct thread_task **task, thread_task_f &&function)
+{
+	struct thread_task *t = thread_task_alloc();
+	t->function = std::move(function);
+	*task = t;
+	return 0;
+}
+
+int
+thread_task_new_ex(struct thread_task **task, thread_task_f &&function,
+		   const struct thread_task_opts *opts)
+{
+	if (opts->priority < 0 || opts->priority >= TPOOL_PRIORITY_COUNT ||
+	    !(opts->deadline >= 0) || opts->deadline >= 1e9)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	struct thread_task *t = thread_task_alloc();
+	t->function = std::move(function);
+	t->priority = opts->priority;
+	t->deadline = opts->deadline;
+	*task = t;
+	return 0;
 }
 
 bool
 thread_task_is_finished(const struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return false;
+	int state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE) &
+		    ~TASK_STATE_WAITED;
+	return state == TASK_STATE_FINISHED || state == TASK_STATE_JOINED;
 }
 
 bool
 thread_task_is_running(const struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return false;
+	return (__atomic_load_n(&task->state, __ATOMIC_RELAXED) &
+		~TASK_STATE_FLAGS) == TASK_STATE_RUNNING;
+}
+
+int
+thread_task_cancel(struct thread_task *task, bool *is_started)
+{
+	int state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	while (true) {
+		int s = state & ~TASK_STATE_FLAGS;
+		if (s == TASK_STATE_NEW || s == TASK_STATE_JOINED)
+			return TPOOL_ERR_TASK_NOT_PUSHED;
+		if (s == TASK_STATE_FINISHED) {
+			*is_started = true;
+			return 0;
+		}
+		/* The start either sees the flag, or is seen here. */
+		if (__atomic_compare_exchange_n(&task->state, &state,
+						state | TASK_STATE_CANCELLED,
+						false, __ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			*is_started = s == TASK_STATE_RUNNING;
+			return 0;
+		}
+	}
+}
+
+bool
+thread_task_is_cancelled(const struct thread_task *task)
+{
+	if (task == NULL)
+		task = current_task;
+	return task != NULL && (__atomic_load_n(&task->state,
+		__ATOMIC_RELAXED) & TASK_STATE_CANCELLED) != 0;
+}
+
+/**
+ * Wait until the task is finished, sleeping on its state. NULL
+ * deadline means no timeout. False on the timeout.
+ */
+static bool
+thread_task_wait(struct thread_task *task, const struct timespec *deadline)
+{
+	int state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	while (state != TASK_STATE_FINISHED) {
+		if (deadline != NULL) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec > deadline->tv_sec ||
+			    (now.tv_sec == deadline->tv_sec &&
+			     now.tv_nsec >= deadline->tv_nsec))
+				return false;
+		}
+		if ((state & TASK_STATE_WAITED) == 0 &&
+		    !__atomic_compare_exchange_n(&task->state, &state,
+						 state | TASK_STATE_WAITED,
+						 false, __ATOMIC_SEQ_CST,
+						 __ATOMIC_ACQUIRE))
+			continue;
+		state |= TASK_STATE_WAITED;
+		futex_wait_until((uint32_t *)&task->state, state, deadline);
+		state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	}
+	return true;
+}
+
+/** A task which can be joined, or an error. */
+static int
+thread_task_check_joinable(struct thread_task *task)
+{
+	if (task->group != NULL || task->is_notify)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	int state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	if (state == TASK_STATE_NEW || state == TASK_STATE_JOINED)
+		return TPOOL_ERR_TASK_NOT_PUSHED;
+	return 0;
 }
 
 int
 thread_task_join(struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	int rc = thread_task_check_joinable(task);
+	if (rc != 0)
+		return rc;
+	struct thread_worker *self = current_worker;
+	if (self != NULL && self->pool == task->pool)
+		thread_worker_help_until(self, &task->state,
+					 TASK_STATE_FINISHED);
+	thread_task_wait(task, NULL);
+	__atomic_store_n(&task->state, TASK_STATE_JOINED, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int
+thread_task_set_group(struct thread_task *task,
+		      struct thread_task_group *group)
+{
+	int state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	if (state != TASK_STATE_NEW && state != TASK_STATE_JOINED)
+		return TPOOL_ERR_TASK_IN_POOL;
+	if (group != NULL && task->is_notify)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	task->group = group;
+	return 0;
+}
+
+int
+thread_task_set_notify(struct thread_task *task, bool is_notify)
+{
+	int state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	if (state != TASK_STATE_NEW && state != TASK_STATE_JOINED)
+		return TPOOL_ERR_TASK_IN_POOL;
+	if (is_notify && task->group != NULL)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	task->is_notify = is_notify;
+	return 0;
+}
+
+int
+thread_pool_completion_fd(struct thread_pool *pool)
+{
+	pthread_mutex_lock(&pool->completion_mutex);
+	if (pool->completion_fd < 0) {
+		pool->completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		/* The tasks finished before are notified about too. */
+		if (pool->completion_fd >= 0 && pool->completed_head != NULL)
+			eventfd_write(pool->completion_fd, 1);
+	}
+	int fd = pool->completion_fd;
+	pthread_mutex_unlock(&pool->completion_mutex);
+	return fd;
+}
+
+int
+thread_pool_pop_completed(struct thread_pool *pool,
+			  struct thread_task **tasks, int count)
+{
+	int i = 0;
+	pthread_mutex_lock(&pool->completion_mutex);
+	struct thread_task *t = pool->completed_head;
+	for (; i < count && t != NULL; ++i) {
+		tasks[i] = t;
+		t = t->next_completed;
+		__atomic_store_n(&tasks[i]->state, TASK_STATE_JOINED,
+				 __ATOMIC_RELAXED);
+	}
+	pool->completed_head = t;
+	if (t == NULL && i > 0) {
+		pool->completed_tail = NULL;
+		/* The next finish makes it readable again. */
+		eventfd_t value;
+		if (pool->completion_fd >= 0)
+			eventfd_read(pool->completion_fd, &value);
+	}
+	pthread_mutex_unlock(&pool->completion_mutex);
+	return i;
+}
+
+int
+thread_task_group_new(struct thread_task_group **group)
+{
+	struct thread_task_group *g = new thread_task_group();
+	pthread_mutex_init(&g->mutex, NULL);
+	pthread_cond_init(&g->cond, NULL);
+	*group = g;
+	return 0;
+}
+
+int
+thread_task_group_join(struct thread_task_group *group)
+{
+	struct thread_worker *self = current_worker;
+	if (self != NULL)
+		thread_worker_help_until(self, &group->pending_count, 0);
+	pthread_mutex_lock(&group->mutex);
+	while (group->pending_count != 0)
+		pthread_cond_wait(&group->cond, &group->mutex);
+	pthread_mutex_unlock(&group->mutex);
+	return 0;
+}
+
+int
+thread_task_group_delete(struct thread_task_group *group)
+{
+	pthread_mutex_lock(&group->mutex);
+	int count = group->pending_count;
+	pthread_mutex_unlock(&group->mutex);
+	if (count != 0)
+		return TPOOL_ERR_HAS_TASKS;
+	pthread_mutex_destroy(&group->mutex);
+	pthread_cond_destroy(&group->cond);
+	delete group;
+	return 0;
 }
 
 #if NEED_TIMED_JOIN
@@ -78,20 +1721,77 @@ thread_task_join(struct thread_task *task)
 int
 thread_task_timed_join(struct thread_task *task, double timeout)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	(void)timeout;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	int rc = thread_task_check_joinable(task);
+	if (rc != 0)
+		return rc;
+	/*
+	 * An absolute deadline, so the wakeups and the retries don't
+	 * prolong the wait. Beyond 30 years is the same as never.
+	 */
+	struct timespec deadline;
+	struct timespec *deadline_ptr = NULL;
+	if (timeout < 1e9) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		if (timeout > 0) {
+			double sec = floor(timeout);
+			deadline.tv_sec += (time_t)sec;
+			deadline.tv_nsec += (long)((timeout - sec) * 1e9);
+			if (deadline.tv_nsec >= 1000000000) {
+				++deadline.tv_sec;
+				deadline.tv_nsec -= 1000000000;
+			}
+		}
+		deadline_ptr = &deadline;
+	}
+	if (!thread_task_wait(task, deadline_ptr))
+		return TPOOL_ERR_TIMEOUT;
+	__atomic_store_n(&task->state, TASK_STATE_JOINED, __ATOMIC_RELAXED);
+	return 0;
 }
 
 #endif
 
+static inline bool
+thread_task_is_unpushed(const struct thread_task *task)
+{
+	int state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE) &
+		    ~TASK_STATE_FLAGS;
+	return state == TASK_STATE_NEW || state == TASK_STATE_JOINED ||
+	       state == TASK_STATE_PENDING;
+}
+
+int
+thread_task_then(struct thread_task *task, struct thread_task *next)
+{
+	if (task == next)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (!thread_task_is_unpushed(task) || !thread_task_is_unpushed(next))
+		return TPOOL_ERR_TASK_IN_POOL;
+	task->successors.push_back(next);
+	++next->dep_count;
+	/* A pending one can be cancelled or detached already. */
+	next->state = (next->state & TASK_STATE_FLAGS) | TASK_STATE_PENDING;
+	return 0;
+}
+
 int
 thread_task_delete(struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	int state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	if (state != TASK_STATE_NEW && state != TASK_STATE_JOINED)
+		return TPOOL_ERR_TASK_IN_POOL;
+	/* The successors don't wait for a task which never runs. */
+	for (struct thread_task *next : task->successors) {
+		if (--next->dep_count != 0)
+			continue;
+		if ((next->state & TASK_STATE_DETACHED) != 0)
+			thread_task_free(next);
+		else
+			next->state = TASK_STATE_NEW;
+	}
+	task->successors.clear();
+	thread_task_free(task);
+	return 0;
 }
 
 #if NEED_DETACH
@@ -99,9 +1799,24 @@ thread_task_delete(struct thread_task *task)
 int
 thread_task_detach(struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	if (task->is_notify)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	int state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	while (true) {
+		if (state == TASK_STATE_NEW || state == TASK_STATE_JOINED)
+			return TPOOL_ERR_TASK_NOT_PUSHED;
+		if (state == TASK_STATE_FINISHED) {
+			/* Not joined, but nobody is going to. */
+			task->state = TASK_STATE_JOINED;
+			return thread_task_delete(task);
+		}
+		/* The finish either sees the flag, or is seen here. */
+		if (__atomic_compare_exchange_n(&task->state, &state,
+						state | TASK_STATE_DETACHED,
+						false, __ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE))
+			return 0;
+	}
 }
 
 #endif
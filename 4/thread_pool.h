@@ -1,7 +1,15 @@
 #pragma once
 
-#include <functional>
+#include <new>
+#include <sched.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 /**
  * Here you should specify which features do you want to implement via macros:
@@ -16,17 +24,174 @@
  * It is important to define these macros here, in the header, because it is
  * used by tests.
  */
-#define NEED_DETACH 0
-#define NEED_TIMED_JOIN 0
+#define NEED_DETACH 1
+#define NEED_TIMED_JOIN 1
 
 struct thread_pool;
 struct thread_task;
+struct thread_task_group;
 
-using thread_task_f = std::function<void(void)>;
+/**
+ * A callable for a task, like std::function<void(void)>, but the
+ * callables up to TASK_F_INLINE_SIZE bytes are stored inline, without a
+ * heap allocation. Bigger ones, or ones which can throw on move, are
+ * allocated on the heap. Move-only callables are accepted too, but
+ * such a thread_task_f can only be moved, a copy aborts.
+ */
+class thread_task_f {
+public:
+	enum { TASK_F_INLINE_SIZE = 64 };
+
+	thread_task_f() = default;
+
+	template <typename F, typename = std::enable_if_t<
+		!std::is_same_v<std::decay_t<F>, thread_task_f>>>
+	thread_task_f(F &&f)
+	{
+		using T = std::decay_t<F>;
+		if constexpr (is_inline<T>()) {
+			new (storage) T(std::forward<F>(f));
+			ops = &inline_ops<T>::value;
+		} else {
+			*(T **)storage = new T(std::forward<F>(f));
+			ops = &heap_ops<T>::value;
+		}
+	}
+
+	thread_task_f(const thread_task_f &other)
+	{
+		if (other.ops != nullptr)
+			other.ops->copy(storage, other.storage);
+		ops = other.ops;
+	}
+
+	thread_task_f(thread_task_f &&other) noexcept
+	{
+		if (other.ops != nullptr)
+			other.ops->move(storage, other.storage);
+		ops = other.ops;
+		other.ops = nullptr;
+	}
+
+	thread_task_f &
+	operator=(const thread_task_f &other)
+	{
+		if (this != &other) {
+			reset();
+			if (other.ops != nullptr)
+				other.ops->copy(storage, other.storage);
+			ops = other.ops;
+		}
+		return *this;
+	}
+
+	thread_task_f &
+	operator=(thread_task_f &&other) noexcept
+	{
+		if (this != &other) {
+			reset();
+			if (other.ops != nullptr)
+				other.ops->move(storage, other.storage);
+			ops = other.ops;
+			other.ops = nullptr;
+		}
+		return *this;
+	}
+
+	~thread_task_f() { reset(); }
+
+	/** Must not be called on an empty one. */
+	void
+	operator()() { ops->call(storage); }
+
+	explicit operator bool() const { return ops != nullptr; }
+
+	/** Destroy the callable, the object becomes empty. */
+	void
+	reset()
+	{
+		if (ops != nullptr)
+			ops->destroy(storage);
+		ops = nullptr;
+	}
+
+private:
+	struct callable_ops {
+		void (*call)(void *f);
+		void (*copy)(void *dst, const void *src);
+		/** Move to dst and destroy src. */
+		void (*move)(void *dst, void *src);
+		void (*destroy)(void *f);
+	};
+
+	template <typename T>
+	static constexpr bool
+	is_inline()
+	{
+		return sizeof(T) <= TASK_F_INLINE_SIZE &&
+		       alignof(T) <= alignof(max_align_t) &&
+		       std::is_nothrow_move_constructible_v<T>;
+	}
+
+	template <typename T>
+	struct inline_ops {
+		static void
+		call(void *f) { (*(T *)f)(); }
+
+		static void
+		copy(void *dst, const void *src)
+		{
+			if constexpr (std::is_copy_constructible_v<T>)
+				new (dst) T(*(const T *)src);
+			else
+				abort();
+		}
+
+		static void
+		move(void *dst, void *src)
+		{
+			new (dst) T(std::move(*(T *)src));
+			((T *)src)->~T();
+		}
+
+		static void
+		destroy(void *f) { ((T *)f)->~T(); }
+
+		static constexpr callable_ops value = {call, copy, move, destroy};
+	};
+
+	template <typename T>
+	struct heap_ops {
+		static void
+		call(void *f) { (**(T **)f)(); }
+
+		static void
+		copy(void *dst, const void *src)
+		{
+			if constexpr (std::is_copy_constructible_v<T>)
+				*(T **)dst = new T(**(T *const *)src);
+			else
+				abort();
+		}
+
+		static void
+		move(void *dst, void *src) { *(T **)dst = *(T **)src; }
+
+		static void
+		destroy(void *f) { delete *(T **)f; }
+
+		static constexpr callable_ops value = {call, copy, move, destroy};
+	};
+
+	alignas(max_align_t) unsigned char storage[TASK_F_INLINE_SIZE];
+	const callable_ops *ops = nullptr;
+};
 
 enum {
 	TPOOL_MAX_THREADS = 20,
 	TPOOL_MAX_TASKS = 100000,
+	/** Buckets of the time histograms in the pool statistics. */
+	TPOOL_HISTOGRAM_SIZE = 40,
 };
 
 enum thread_pool_errcode {
@@ -42,7 +207,8 @@ enum thread_pool_errcode {
 /** Thread pool API. */
 
 /**
- * Create a new thread pool with the @a thread_count thread.
+ * Create a new thread pool with the @a thread_count thread. Same as
+ * thread_pool_new_opts() with the default options.
  * @param thread_count Pool size.
  * @param[out] Pointer to store result pool object.
  *
@@ -54,12 +220,120 @@ enum thread_pool_errcode {
 int
 thread_pool_new(int thread_count, struct thread_pool **pool);
 
+struct thread_pool_opts {
+	/** Max thread count, any positive number. */
+	int max_thread_count = 0;
+	/**
+	 * Seconds a thread stays without tasks before it exits. 0 means to
+	 * exit right when there are no tasks. For an infinite timeout pass
+	 * infinity or DBL_MAX or just something huge.
+	 */
+	double idle_timeout = 1;
+	/** CPUs to pin the threads to. NULL means no pinning. */
+	const cpu_set_t *cpu_set = NULL;
+	/**
+	 * Spread the threads over the NUMA nodes of the allowed CPUs, and
+	 * pin each to the CPUs of its node. Each node gets its own queue,
+	 * the tasks pushed from a node are taken by its threads first.
+	 */
+	bool is_numa_aware = false;
+	/**
+	 * Stack size of the threads, 0 means the default of pthread, like
+	 * 8 MB. Small tasks need much less, and each thread reserves its
+	 * whole stack in the virtual memory. Note, a join inside a task
+	 * runs the other tasks on top of the same stack.
+	 */
+	size_t stack_size = 0;
+	/** Guard size below the stacks, -1 means the default, 0 no guard. */
+	ssize_t guard_size = -1;
+};
+
+/**
+ * Create a new thread pool with the given options. The threads are
+ * started on demand, when a task is pushed and all the started ones
+ * are busy. The idle ones exit after the timeout and are started again
+ * when needed.
+ * @param opts Pool options.
+ * @param[out] Pointer to store result pool object.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - max_thread_count is not positive,
+ *       or idle_timeout is negative, or cpu_set is empty, or
+ *       stack_size is less than PTHREAD_STACK_MIN.
+ */
+int
+thread_pool_new_opts(const struct thread_pool_opts *opts,
+		     struct thread_pool **pool);
+
+/**
+ * Get the number of the running threads of @a pool.
+ * @param pool Pool to check.
+ */
+int
+thread_pool_thread_count(const struct thread_pool *pool);
+
+struct thread_pool_stats {
+	/** Pushed tasks waiting to be run. */
+	int queued_count;
+	int running_count;
+	int thread_count;
+	uint64_t finished_count;
+	/** Tasks stolen by the workers from the deques of each other. */
+	uint64_t steal_count;
+	/**
+	 * Finished tasks by the time from the push to the start. Bucket i
+	 * counts the times of [2^i, 2^(i + 1)) nanoseconds, the last one
+	 * counts all the longer ones too.
+	 */
+	uint64_t wait_histogram[TPOOL_HISTOGRAM_SIZE];
+	/** Same, by the run time. */
+	uint64_t run_histogram[TPOOL_HISTOGRAM_SIZE];
+};
+
+/**
+ * Get the statistics of @a pool. They are collected by each worker on
+ * its own, and are summed up here, so the values are not a consistent
+ * snapshot when the pool is busy.
+ * @param pool Pool to check.
+ * @param[out] stats Pointer to store the statistics.
+ *
+ * @retval Always 0.
+ */
+int
+thread_pool_stats(const struct thread_pool *pool,
+		  struct thread_pool_stats *stats);
+
+struct thread_worker_stats {
+	uint64_t finished_count;
+	uint64_t steal_count;
+	/** Share of the time spent in tasks since the first start. */
+	double busy_ratio;
+};
+
+/**
+ * Get the statistics of a worker of @a pool. The workers are the
+ * thread slots, from 0 to max thread count. A slot keeps its
+ * statistics when its thread exits on idle and is started again.
+ * @param pool Pool to check.
+ * @param id Worker index.
+ * @param[out] stats Pointer to store the statistics.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - id is out of the slots.
+ */
+int
+thread_pool_worker_stats(const struct thread_pool *pool, int id,
+			 struct thread_worker_stats *stats);
+
 /**
  * Delete @a pool, free its memory.
  * @param pool Pool to delete.
  * @retval 0 Success.
  * @retval != Error code.
- *     - TPOOL_ERR_HAS_TASKS - pool still has tasks.
+ *     - TPOOL_ERR_HAS_TASKS - pool still has tasks, or the finished
+ *       notify tasks not popped yet.
  */
 int
 thread_pool_delete(struct thread_pool *pool);
@@ -79,10 +353,132 @@ thread_pool_delete(struct thread_pool *pool);
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 
+/**
+ * Push @a count tasks at once. They are published in the queue by one
+ * atomic operation, and not more than @a count sleeping threads are
+ * woken up. The tasks must not be already pushed or deleted.
+ * @param pool Pool to push into.
+ * @param tasks Tasks to push.
+ * @param count Number of the tasks.
+ *
+ * @retval 0 Success.
+ * @retval != Error code. Nothing is pushed then.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool would have too many tasks.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - count is negative.
+ */
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks,
+		       int count);
+
+/**
+ * Function of a parallel loop run on a range of indexes by a
+ * participant. The participants are the calling thread and the
+ * workers, numbered from 0 to thread_pool_parallel_slot_count().
+ */
+typedef void (*thread_range_f)(void *ctx, int64_t begin, int64_t end,
+			       int slot);
+
+/**
+ * Run @a function on the range [@a begin, @a end) split into chunks.
+ * The calling thread runs the chunks too, and the workers help it by
+ * one task each. The chunks start big and get smaller towards the end,
+ * down to @a grain indexes, so the load balances with few chunks. Each
+ * chunk costs one atomic operation, with nothing allocated per index
+ * or per chunk. It returns when all the range is done. The helpers
+ * which got no chunks might still be in the pool then, and the pool
+ * can't be deleted until they end.
+ * @param pool Pool to run on.
+ * @param begin First index.
+ * @param end Index after the last one.
+ * @param grain Min chunk size, 0 means automatic.
+ * @param function Function to run on each chunk.
+ * @param ctx Argument of the function.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - grain is negative.
+ */
+int
+thread_pool_parallel_run(struct thread_pool *pool, int64_t begin,
+			 int64_t end, int64_t grain, thread_range_f function,
+			 void *ctx);
+
+/** Count of the participant slots of a parallel loop in @a pool. */
+int
+thread_pool_parallel_slot_count(const struct thread_pool *pool);
+
+/**
+ * Call @a fn(i) for each i of [@a begin, @a end) in parallel. See
+ * thread_pool_parallel_run() about the chunks.
+ */
+template <typename F>
+int
+thread_pool_parallel_for(struct thread_pool *pool, int64_t begin, int64_t end,
+			 int64_t grain, F &&fn)
+{
+	using fn_t = std::remove_reference_t<F>;
+	thread_range_f call = [](void *ctx, int64_t b, int64_t e, int slot) {
+		(void)slot;
+		fn_t &f = *(fn_t *)ctx;
+		for (int64_t i = b; i < e; ++i)
+			f(i);
+	};
+	return thread_pool_parallel_run(pool, begin, end, grain, call,
+					(void *)std::addressof(fn));
+}
+
+/**
+ * Reduce @a map(i) of each i of [@a begin, @a end) by @a reduce(a, b)
+ * in parallel. Each participant sums up its chunks on its own, and
+ * then the participants' sums are summed up. So @a reduce has to be
+ * associative and commutative, and @a identity neutral to it.
+ * @param[out] result Pointer to store the result.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code, same as of thread_pool_parallel_run().
+ */
+template <typename T, typename M, typename R>
+int
+thread_pool_parallel_reduce(struct thread_pool *pool, int64_t begin,
+			    int64_t end, int64_t grain, const T &identity,
+			    M &&map, R &&reduce, T *result)
+{
+	using map_t = std::remove_reference_t<M>;
+	using reduce_t = std::remove_reference_t<R>;
+	struct reduce_ctx {
+		map_t &map;
+		reduce_t &reduce;
+		const T &identity;
+		std::vector<T> partials;
+	};
+	reduce_ctx ctx{map, reduce, identity,
+		std::vector<T>(thread_pool_parallel_slot_count(pool),
+			       identity)};
+	thread_range_f call = [](void *arg, int64_t b, int64_t e, int slot) {
+		reduce_ctx &c = *(reduce_ctx *)arg;
+		T sum = c.identity;
+		for (int64_t i = b; i < e; ++i)
+			sum = c.reduce(sum, c.map(i));
+		c.partials[slot] = c.reduce(c.partials[slot], sum);
+	};
+	int rc = thread_pool_parallel_run(pool, begin, end, grain, call, &ctx);
+	if (rc != 0)
+		return rc;
+	T sum = identity;
+	for (const T &partial : ctx.partials)
+		sum = reduce(sum, partial);
+	*result = sum;
+	return 0;
+}
+
 /** Thread pool task API. */
 
 /**
- * Create a new task to push it into a pool.
+ * Create a new task to push it into a pool. The deleted tasks are
+ * cached per thread and reused by the next creations, so a task churn
+ * doesn't touch the heap. The threads deleting more than creating,
+ * like the workers finishing the detached tasks, pass the excess to
+ * the others in batches.
  * @param[out] task Pointer to store result task object.
  * @param function Function to run by this task.
  *
@@ -91,6 +487,48 @@ thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 int
 thread_task_new(struct thread_task **task, const thread_task_f &function);
 
+/** Same as above, but the function is moved into the task. */
+int
+thread_task_new(struct thread_task **task, thread_task_f &&function);
+
+enum thread_task_priority {
+	/** Taken before all the others, for latency sensitive work. */
+	TPOOL_PRIORITY_HIGH,
+	TPOOL_PRIORITY_NORMAL,
+	/**
+	 * Background work, taken when there is nothing else. Still once
+	 * in a while a worker takes it first, so it is not starved.
+	 */
+	TPOOL_PRIORITY_LOW,
+	TPOOL_PRIORITY_COUNT,
+};
+
+struct thread_task_opts {
+	enum thread_task_priority priority = TPOOL_PRIORITY_NORMAL;
+	/**
+	 * Seconds since each push, by which the task should be started.
+	 * The tasks with deadlines are taken before all the others, the
+	 * earliest deadline first, regardless of the priority. 0 means no
+	 * deadline.
+	 */
+	double deadline = 0;
+};
+
+/**
+ * Create a new task with a priority and a deadline.
+ * @param[out] task Pointer to store result task object.
+ * @param function Function to run by this task.
+ * @param opts Task options.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the priority is unknown, or the
+ *       deadline is negative or too big.
+ */
+int
+thread_task_new_ex(struct thread_task **task, thread_task_f &&function,
+		   const struct thread_task_opts *opts);
+
 /**
  * Check if @a task is finished and joined.
  * @param task Task to check.
@@ -105,6 +543,32 @@ thread_task_is_finished(const struct thread_task *task);
 bool
 thread_task_is_running(const struct thread_task *task);
 
+/**
+ * Cancel @a task. If it is not started yet, it won't be: it is
+ * finished without a run when a worker takes it, and can be joined as
+ * usual. Its successors are released anyway. If it is running, it is
+ * up to the task to check thread_task_is_cancelled() and return early.
+ * @param task Task to cancel.
+ * @param[out] is_started Whether the task has started before the
+ *     cancel, so its function is or was run.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a pool, or
+ *       is joined already, like a finished task of a group.
+ */
+int
+thread_task_cancel(struct thread_task *task, bool *is_started);
+
+/**
+ * Check if @a task is cancelled and not finished yet. NULL means the
+ * task which is running in the current thread, for the task functions
+ * which don't know their task objects.
+ * @param task Task to check, or NULL.
+ */
+bool
+thread_task_is_cancelled(const struct thread_task *task);
+
 /**
  * Join the task. If it is not finished, then wait until it is.
  * Note, this function does not delete task object. It can be
@@ -114,10 +578,126 @@ thread_task_is_running(const struct thread_task *task);
  * @retval 0 Success.
  * @retval != 0 Error code.
  *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a pool.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - task is in a group, or is a
+ *       notify one.
  */
 int
 thread_task_join(struct thread_task *task);
 
+/**
+ * Make @a task a part of @a group, or of no group if it is NULL. The
+ * tasks of a group are joined by thread_task_group_join() all at once,
+ * and can't be joined by thread_task_join(). Such a task is joined
+ * right when it is finished, it can be deleted or pushed again then.
+ * @param task Task to change.
+ * @param group Group to join the task, or NULL.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is pushed and not joined.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the task is a notify one.
+ */
+int
+thread_task_set_group(struct thread_task *task,
+		      struct thread_task_group *group);
+
+/**
+ * Make @a task a notify one, or a usual one. A finished notify task
+ * goes to the completion queue of its pool, and is joined by
+ * thread_pool_pop_completed(), not by thread_task_join(). It can't be
+ * detached either.
+ * @param task Task to change.
+ * @param is_notify Notify or not.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is pushed and not joined.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the task is in a group.
+ */
+int
+thread_task_set_notify(struct thread_task *task, bool is_notify);
+
+/**
+ * Get an eventfd of @a pool, readable while its completion queue is
+ * not empty. It is created on the first call, non-blocking, and is
+ * closed by thread_pool_delete(). For an event loop: wait for the fd
+ * to be readable, and pop the tasks until none are left. It is reset
+ * by the pop itself, the fd must not be read by the user.
+ * @param pool Pool to notify about.
+ *
+ * @retval >= 0 The descriptor.
+ * @retval -1 Error, errno is set by eventfd().
+ */
+int
+thread_pool_completion_fd(struct thread_pool *pool);
+
+/**
+ * Pop up to @a count finished notify tasks of @a pool, the oldest
+ * first. They are joined then, and can be deleted or pushed again.
+ * Doesn't wait, works with and without the completion fd.
+ * @param pool Pool to pop from.
+ * @param[out] tasks Array to store the tasks.
+ * @param count Size of the array.
+ *
+ * @retval Count of the popped tasks, 0 if none are finished.
+ */
+int
+thread_pool_pop_completed(struct thread_pool *pool,
+			  struct thread_task **tasks, int count);
+
+/**
+ * Make @a next wait for @a task. A task with predecessors is pushed
+ * automatically by the last of them to finish, into its pool, and
+ * should not be pushed by the user. The graph is built by one thread,
+ * before its roots are pushed. The edges are used once: a finished
+ * task forgets its successors. The tasks are still joined and deleted
+ * as usual, meanwhile a deleted predecessor releases its successors.
+ * Set the group of @a next before, if needed.
+ * @param task Predecessor.
+ * @param next Successor.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the tasks are the same.
+ *     - TPOOL_ERR_TASK_IN_POOL - one of the tasks is pushed and not
+ *       joined.
+ */
+int
+thread_task_then(struct thread_task *task, struct thread_task *next);
+
+/** Task group API. */
+
+/**
+ * Create a new task group, a latch to join many tasks by one wait.
+ * @param[out] group Pointer to store result group object.
+ *
+ * @retval Always 0.
+ */
+int
+thread_task_group_new(struct thread_task_group **group);
+
+/**
+ * Wait until all the pushed tasks of @a group are finished. The group
+ * can be used for the next pushes afterwards.
+ * @param group Group to join.
+ *
+ * @retval Always 0.
+ */
+int
+thread_task_group_join(struct thread_task_group *group);
+
+/**
+ * Delete a task group, free its memory. The tasks can't be pushed with
+ * this group after that.
+ * @param group Group to delete.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_HAS_TASKS - the group has pushed not finished tasks.
+ */
+int
+thread_task_group_delete(struct thread_task_group *group);
+
 #if NEED_TIMED_JOIN
 
 /**
@@ -159,6 +739,7 @@ thread_task_delete(struct thread_task *task);
  * @retval != Error code.
  *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a
  *       pool.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - task is a notify one.
 */
 int
 thread_task_detach(struct thread_task *task);
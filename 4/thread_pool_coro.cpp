@@ -0,0 +1,86 @@
+#include "thread_pool_coro.h"
+
+#include <pthread.h>
+
+/** A coroutine of thread_pool_spawn_coro(). */
+struct thread_coro {
+	coro_f func;
+	void *arg;
+};
+
+/** Pool running the coroutines, NULL if none. */
+static struct thread_pool *coro_pool = NULL;
+/** Spawned coroutines which are not finished yet. */
+static size_t coro_pool_live_count = 0;
+/** Protect the wait of the stop for the last coroutine. */
+static pthread_mutex_t coro_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t coro_pool_cond = PTHREAD_COND_INITIALIZER;
+
+/** A task running the coroutines while there are runnable ones. */
+static int
+thread_coro_submit(void *arg)
+{
+	struct thread_pool *pool = (struct thread_pool *)arg;
+	struct thread_task *task;
+	thread_task_new(&task, []() { coro_sched_host_run(); });
+	int rc = thread_pool_push_task(pool, task);
+	if (rc != 0) {
+		thread_task_delete(task);
+		return rc;
+	}
+	/* It deletes itself. */
+	thread_task_detach(task);
+	return 0;
+}
+
+static void *
+thread_coro_f(void *arg)
+{
+	struct thread_coro *c = (struct thread_coro *)arg;
+	c->func(c->arg);
+	delete c;
+	if (__atomic_sub_fetch(&coro_pool_live_count, 1,
+			       __ATOMIC_SEQ_CST) == 0) {
+		pthread_mutex_lock(&coro_pool_mutex);
+		pthread_cond_broadcast(&coro_pool_cond);
+		pthread_mutex_unlock(&coro_pool_mutex);
+	}
+	return NULL;
+}
+
+int
+thread_pool_coro_start(struct thread_pool *pool, int engine_count)
+{
+	if (engine_count <= 0 || coro_pool != NULL)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	coro_pool = pool;
+	coro_sched_host_start(engine_count, thread_coro_submit, pool);
+	return 0;
+}
+
+int
+thread_pool_spawn_coro(struct thread_pool *pool, coro_f func, void *arg)
+{
+	if (pool != coro_pool)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	struct thread_coro *c = new thread_coro();
+	c->func = func;
+	c->arg = arg;
+	__atomic_add_fetch(&coro_pool_live_count, 1, __ATOMIC_SEQ_CST);
+	coro_sched_host_spawn(thread_coro_f, c);
+	return 0;
+}
+
+int
+thread_pool_coro_stop(struct thread_pool *pool)
+{
+	if (pool != coro_pool)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	pthread_mutex_lock(&coro_pool_mutex);
+	while (__atomic_load_n(&coro_pool_live_count, __ATOMIC_SEQ_CST) > 0)
+		pthread_cond_wait(&coro_pool_cond, &coro_pool_mutex);
+	pthread_mutex_unlock(&coro_pool_mutex);
+	coro_sched_host_stop();
+	coro_pool = NULL;
+	return 0;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "libcoro.h"
+#include "thread_pool.h"
+
+/**
+ * Coroutines of libcoro run by the workers of a thread pool. A worker
+ * runs the coroutines only while some of them are runnable. A
+ * coroutine suspended in a wait, like coro_bus_recv(), holds no
+ * worker, and the workers do the other tasks meanwhile. libcoro has
+ * one scheduler per process, so one pool at a time can host it.
+ */
+
+/**
+ * Start running the coroutines of libcoro on the workers of @a pool,
+ * with @a engine_count of them at most at once. Each engine runs its
+ * coroutines one by one, on any worker. So with one engine they don't
+ * run in parallel and can share data not safe for threads, like a
+ * coro_bus. With more they work as in coro_sched_run_mt().
+ * coro_sched_init() must be called before, by the same thread, and
+ * it must be outside of coroutines.
+ * @param pool Pool to run on.
+ * @param engine_count Max coroutines running at once.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - engine_count is not positive,
+ *       or some pool runs the coroutines already.
+ */
+int
+thread_pool_coro_start(struct thread_pool *pool, int engine_count);
+
+/**
+ * Create a coroutine on @a pool. Nobody joins it, and its result is
+ * dropped. Can be called from any thread: from the pool tasks, from
+ * the coroutines of the pool, from the others.
+ * @param pool Pool running the coroutines.
+ * @param func Coroutine function.
+ * @param arg Argument of the function.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the pool doesn't run the
+ *       coroutines.
+ */
+int
+thread_pool_spawn_coro(struct thread_pool *pool, coro_f func, void *arg);
+
+/**
+ * Wait until all the coroutines spawned on @a pool are finished, and
+ * stop running the coroutines on it. The coroutines created by them
+ * with coro_new() must be joined by now too. Must be called by the
+ * thread which has started it.
+ * @param pool Pool running the coroutines.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the pool doesn't run the
+ *       coroutines.
+ */
+int
+thread_pool_coro_stop(struct thread_pool *pool);
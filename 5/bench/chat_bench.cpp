@@ -0,0 +1,529 @@
+/**
+ * Chat server load generator. The server runs in a child process, the
+ * clients are spread over the threads of this one. Each client sends
+ * messages at the given rate, and each message carries its send time, so
+ * every receiver measures the end-to-end fan-out latency. In the end it
+ * prints the latency percentiles, the delivery rate, the server's CPU
+ * usage during the load, and the server's memory per connection, idle
+ * and after the load.
+ *
+ * Usage: chat_bench [-c client_count] [-t thread_count]
+ *                   [-r messages per second per client] [-d seconds]
+ *                   [-m message size] [-s server_thread_count] [-u]
+ *                   [-R room_count] [-C]
+ *
+ * -u - use the io_uring backend of the server.
+ * -C - use the coroutine server, chat_coro_server.h, instead.
+ * -R - split the clients evenly between the rooms, round-robin.
+ */
+#include "chat.h"
+#include "chat_client.h"
+#include "chat_coro_server.h"
+#include "chat_server.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+enum {
+	/**
+	 * Latency histogram: 16 buckets per power of 2, so each bucket is
+	 * within ~6% of its values.
+	 */
+	BENCH_HIST_SUB_BITS = 4,
+	BENCH_HIST_SUB_COUNT = 1 << BENCH_HIST_SUB_BITS,
+	BENCH_HIST_SIZE = 64 * BENCH_HIST_SUB_COUNT,
+	/** Time to get the messages still in flight after the load. */
+	BENCH_DRAIN_MS = 1000,
+	/** Max time to wait in one poll, to keep the send schedule. */
+	BENCH_MAX_WAIT_MS = 10,
+};
+
+static int bench_client_count = 100;
+static int bench_thread_count = 2;
+static double bench_rate = 10;
+static double bench_duration = 5;
+static int bench_msg_size = 64;
+static int bench_server_thread_count = 1;
+static bool bench_use_uring = false;
+static int bench_room_count = 0;
+static bool bench_use_coro = false;
+
+static void
+bench_fail(const char *what, int rc)
+{
+	printf("Error: %s, code %d, errno %d\n", what, rc, errno);
+	exit(-1);
+}
+
+static uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+bench_hist_index(uint64_t value)
+{
+	if (value < BENCH_HIST_SUB_COUNT)
+		return value;
+	int exp = 63 - __builtin_clzll(value);
+	int sub = (value >> (exp - BENCH_HIST_SUB_BITS)) &
+		  (BENCH_HIST_SUB_COUNT - 1);
+	return (exp - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB_COUNT + sub;
+}
+
+/** The lowest value of the bucket. */
+static uint64_t
+bench_hist_value(int index)
+{
+	if (index < BENCH_HIST_SUB_COUNT)
+		return index;
+	int exp = index / BENCH_HIST_SUB_COUNT + BENCH_HIST_SUB_BITS - 1;
+	uint64_t sub = index % BENCH_HIST_SUB_COUNT;
+	return (BENCH_HIST_SUB_COUNT + sub) << (exp - BENCH_HIST_SUB_BITS);
+}
+
+/** Value below which are the given part of all the values. */
+static uint64_t
+bench_hist_percentile(const uint64_t *hist, uint64_t total, double part)
+{
+	uint64_t rank = std::min((uint64_t)(total * part), total - 1);
+	uint64_t sum = 0;
+	for (int i = 0; i < BENCH_HIST_SIZE; ++i) {
+		sum += hist[i];
+		if (sum > rank)
+			return bench_hist_value(i);
+	}
+	return 0;
+}
+
+/** Resident memory of a process in bytes. */
+static uint64_t
+bench_proc_rss(pid_t pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/statm", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		bench_fail("open statm", -1);
+	unsigned long long size = 0;
+	unsigned long long rss = 0;
+	if (fscanf(f, "%llu %llu", &size, &rss) != 2)
+		bench_fail("read statm", -1);
+	fclose(f);
+	return rss * sysconf(_SC_PAGESIZE);
+}
+
+/** User and system CPU time of a process in seconds. */
+static double
+bench_proc_cpu(pid_t pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		bench_fail("open stat", -1);
+	char buf[1024];
+	size_t size = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[size] = 0;
+	/* The name can have spaces, the fields go after its ')'. */
+	const char *pos = strrchr(buf, ')');
+	if (pos == NULL)
+		bench_fail("parse stat", -1);
+	unsigned long long utime = 0;
+	unsigned long long stime = 0;
+	if (sscanf(pos + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+		   "%llu %llu", &utime, &stime) != 2)
+		bench_fail("parse stat", -1);
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static volatile sig_atomic_t bench_server_is_stopped = 0;
+static struct chat_coro_server *bench_coro_server = NULL;
+
+static void
+bench_server_on_term(int signo)
+{
+	(void)signo;
+	bench_server_is_stopped = 1;
+	if (bench_coro_server != NULL)
+		chat_coro_server_stop(bench_coro_server);
+}
+
+static void
+bench_server_notify_port(int notify_fd, int sock)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(sock, (struct sockaddr *)&addr, &len) != 0)
+		bench_fail("getsockname", -1);
+	uint16_t port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+	if (write(notify_fd, &port, sizeof(port)) != sizeof(port))
+		bench_fail("notify", -1);
+}
+
+/**
+ * The coroutine server thread doesn't return until the stop, so another
+ * one watches for all the clients to connect.
+ */
+static void *
+bench_coro_server_watch_f(void *arg)
+{
+	int notify_fd = (int)(intptr_t)arg;
+	while (chat_coro_server_peer_count(bench_coro_server) <
+	       (uint64_t)bench_client_count) {
+		usleep(10 * 1000);
+	}
+	char byte = 1;
+	if (write(notify_fd, &byte, 1) != 1)
+		bench_fail("notify", -1);
+	return NULL;
+}
+
+/** Same as bench_server_run(), but with the coroutine server. */
+static void
+bench_coro_server_run(int notify_fd)
+{
+	bench_coro_server = chat_coro_server_new();
+	signal(SIGTERM, bench_server_on_term);
+	int rc;
+	if ((rc = chat_coro_server_listen(bench_coro_server, 0)) != 0)
+		bench_fail("listen", rc);
+	bench_server_notify_port(notify_fd,
+				 chat_coro_server_get_socket(bench_coro_server));
+	pthread_t watcher;
+	if (pthread_create(&watcher, NULL, bench_coro_server_watch_f,
+			   (void *)(intptr_t)notify_fd) != 0)
+		bench_fail("watcher", -1);
+	pthread_detach(watcher);
+	if ((rc = chat_coro_server_run(bench_coro_server)) != 0)
+		bench_fail("server run", rc);
+	_exit(0);
+}
+
+/**
+ * Body of the server process. Sends the port to the parent, and then a
+ * byte when all the clients are connected.
+ */
+static void
+bench_server_run(int notify_fd)
+{
+	signal(SIGTERM, bench_server_on_term);
+	struct chat_server *s = chat_server_new_ex(bench_server_thread_count);
+	if (s == NULL)
+		bench_fail("server new", -1);
+	int rc;
+	if (bench_use_uring &&
+	    (rc = chat_server_set_backend(s, CHAT_SERVER_BACKEND_URING)) != 0)
+		bench_fail("server backend", rc);
+	if (bench_room_count > 0 && (rc = chat_server_enable_rooms(s)) != 0)
+		bench_fail("server rooms", rc);
+	if ((rc = chat_server_listen(s, 0)) != 0)
+		bench_fail("listen", rc);
+	bench_server_notify_port(notify_fd, chat_server_get_socket(s));
+	bool is_ready = false;
+	std::vector<struct chat_message> msgs;
+	while (!bench_server_is_stopped) {
+		rc = chat_server_update(s, 0.05);
+		if (rc != 0 && rc != CHAT_ERR_TIMEOUT)
+			bench_fail("server update", rc);
+		/* Nobody reads the messages, they only would pile up. */
+		msgs.clear();
+		chat_server_pop_batch(s, &msgs, SIZE_MAX);
+		if (is_ready)
+			continue;
+		struct chat_server_stats stats;
+		chat_server_stats(s, &stats);
+		if (stats.peer_count < (uint64_t)bench_client_count)
+			continue;
+		char byte = 1;
+		if (write(notify_fd, &byte, 1) != 1)
+			bench_fail("notify", -1);
+		is_ready = true;
+	}
+	chat_server_delete(s);
+	_exit(0);
+}
+
+struct bench_worker {
+	std::vector<struct chat_client *> clients;
+	/** When each client sends its next message. */
+	std::vector<uint64_t> next_send;
+	uint64_t load_end;
+	uint64_t drain_end;
+	uint64_t sent_count = 0;
+	uint64_t received_count = 0;
+	/** Latencies in nanoseconds. */
+	uint64_t hist[BENCH_HIST_SIZE] = {};
+	pthread_t thread;
+};
+
+static void
+bench_worker_send(struct bench_worker *w, size_t i, std::string *msg)
+{
+	uint64_t now = bench_now_ns();
+	char ts[32];
+	int size = snprintf(ts, sizeof(ts), "%llu ", (unsigned long long)now);
+	msg->assign(ts, size);
+	if ((int)msg->size() < bench_msg_size - 1)
+		msg->resize(bench_msg_size - 1, 'x');
+	msg->push_back('\n');
+	int rc = chat_client_feed(w->clients[i], msg->data(), msg->size());
+	if (rc != 0)
+		bench_fail("feed", rc);
+	++w->sent_count;
+}
+
+static void *
+bench_worker_f(void *arg)
+{
+	struct bench_worker *w = (struct bench_worker *)arg;
+	uint64_t period = (uint64_t)(1000000000 / bench_rate);
+	size_t count = w->clients.size();
+	std::vector<struct pollfd> pfds(count);
+	std::vector<struct chat_message> msgs;
+	std::string msg;
+	while (true) {
+		uint64_t now = bench_now_ns();
+		if (now >= w->drain_end)
+			break;
+		uint64_t wake = w->drain_end;
+		for (size_t i = 0; i < count && now < w->load_end; ++i) {
+			while (w->next_send[i] <= now) {
+				bench_worker_send(w, i, &msg);
+				w->next_send[i] += period;
+			}
+			wake = std::min(wake, w->next_send[i]);
+		}
+		for (size_t i = 0; i < count; ++i) {
+			struct chat_client *c = w->clients[i];
+			pfds[i].fd = chat_client_get_descriptor(c);
+			pfds[i].events = chat_events_to_poll_events(
+				chat_client_get_events(c));
+			pfds[i].revents = 0;
+		}
+		int timeout_ms = (wake - now + 999999) / 1000000;
+		if (timeout_ms > BENCH_MAX_WAIT_MS)
+			timeout_ms = BENCH_MAX_WAIT_MS;
+		if (poll(pfds.data(), count, timeout_ms) < 0 && errno != EINTR)
+			bench_fail("poll", -1);
+		for (size_t i = 0; i < count; ++i) {
+			if (pfds[i].revents == 0)
+				continue;
+			struct chat_client *c = w->clients[i];
+			int rc = chat_client_update(c, 0);
+			if (rc != 0 && rc != CHAT_ERR_TIMEOUT)
+				bench_fail("client update", rc);
+			msgs.clear();
+			chat_client_pop_batch(c, &msgs, SIZE_MAX);
+			uint64_t recv_time = bench_now_ns();
+			for (const struct chat_message &m : msgs) {
+				uint64_t sent = strtoull(m.data.c_str(), NULL,
+							 10);
+				uint64_t lat = recv_time > sent ?
+					       recv_time - sent : 0;
+				++w->hist[bench_hist_index(lat)];
+				++w->received_count;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void
+bench_raise_fd_limit(void)
+{
+	struct rlimit lim;
+	if (getrlimit(RLIMIT_NOFILE, &lim) != 0)
+		return;
+	lim.rlim_cur = lim.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &lim);
+}
+
+static void
+bench_parse_args(int argc, char **argv)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "c:t:r:d:m:s:uR:C")) != -1) {
+		switch (opt) {
+		case 'c':
+			bench_client_count = atoi(optarg);
+			break;
+		case 't':
+			bench_thread_count = atoi(optarg);
+			break;
+		case 'r':
+			bench_rate = atof(optarg);
+			break;
+		case 'd':
+			bench_duration = atof(optarg);
+			break;
+		case 'm':
+			bench_msg_size = atoi(optarg);
+			break;
+		case 's':
+			bench_server_thread_count = atoi(optarg);
+			break;
+		case 'u':
+			bench_use_uring = true;
+			break;
+		case 'R':
+			bench_room_count = atoi(optarg);
+			break;
+		case 'C':
+			bench_use_coro = true;
+			break;
+		default:
+			printf("Usage: %s [-c client_count] [-t thread_count] "
+			       "[-r rate] [-d seconds] [-m message_size] "
+			       "[-s server_thread_count] [-u] [-R room_count] "
+			       "[-C]\n",
+			       argv[0]);
+			exit(-1);
+		}
+	}
+	if (bench_client_count < 2 || bench_thread_count < 1 ||
+	    bench_rate <= 0 || bench_duration <= 0 || bench_msg_size < 1 ||
+	    bench_room_count < 0 || (bench_room_count > 0 &&
+	    (bench_client_count % bench_room_count != 0 ||
+	     bench_client_count / bench_room_count < 2)) ||
+	    (bench_use_coro && (bench_use_uring || bench_room_count > 0 ||
+	     bench_server_thread_count != 1))) {
+		printf("Invalid arguments\n");
+		exit(-1);
+	}
+	bench_thread_count = std::min(bench_thread_count, bench_client_count);
+}
+
+int
+main(int argc, char **argv)
+{
+	bench_parse_args(argc, argv);
+	bench_raise_fd_limit();
+	signal(SIGPIPE, SIG_IGN);
+	int fds[2];
+	if (pipe(fds) != 0)
+		bench_fail("pipe", -1);
+	/* Before any threads are started. */
+	pid_t pid = fork();
+	if (pid < 0)
+		bench_fail("fork", -1);
+	if (pid == 0) {
+		close(fds[0]);
+		if (bench_use_coro)
+			bench_coro_server_run(fds[1]);
+		bench_server_run(fds[1]);
+	}
+	close(fds[1]);
+	uint16_t port;
+	if (read(fds[0], &port, sizeof(port)) != sizeof(port))
+		bench_fail("server start", -1);
+	uint64_t rss_start = bench_proc_rss(pid);
+
+	char addr[32];
+	snprintf(addr, sizeof(addr), "localhost:%u", (unsigned)port);
+	std::vector<struct bench_worker> workers(bench_thread_count);
+	for (int i = 0; i < bench_client_count; ++i) {
+		struct chat_client *c = chat_client_new("bench");
+		int rc = chat_client_connect(c, addr);
+		if (rc != 0)
+			bench_fail("connect", rc);
+		if (bench_room_count > 0) {
+			char join[32];
+			int len = snprintf(join, sizeof(join), "/join r%d\n",
+					   i % bench_room_count);
+			if ((rc = chat_client_feed(c, join, len)) != 0)
+				bench_fail("join", rc);
+			/* Sent before the load, so the rooms are full by then. */
+			while ((chat_client_get_events(c) &
+				CHAT_EVENT_OUTPUT) != 0) {
+				if ((rc = chat_client_update(c, 0.1)) != 0 &&
+				    rc != CHAT_ERR_TIMEOUT)
+					bench_fail("join", rc);
+			}
+		}
+		workers[i % bench_thread_count].clients.push_back(c);
+	}
+	char byte;
+	if (read(fds[0], &byte, 1) != 1)
+		bench_fail("server accept", -1);
+	uint64_t rss_idle = bench_proc_rss(pid);
+
+	uint64_t period = (uint64_t)(1000000000 / bench_rate);
+	uint64_t start = bench_now_ns();
+	uint64_t load_end = start + (uint64_t)(bench_duration * 1000000000);
+	double cpu_start = bench_proc_cpu(pid);
+	for (struct bench_worker &w : workers) {
+		w.load_end = load_end;
+		w.drain_end = load_end + (uint64_t)BENCH_DRAIN_MS * 1000000;
+		/* Spread the sends of the clients over the period. */
+		size_t count = w.clients.size();
+		for (size_t i = 0; i < count; ++i)
+			w.next_send.push_back(start + period * i / count);
+		pthread_create(&w.thread, NULL, bench_worker_f, &w);
+	}
+	for (struct bench_worker &w : workers)
+		pthread_join(w.thread, NULL);
+	double cpu = bench_proc_cpu(pid) - cpu_start;
+	uint64_t rss_end = bench_proc_rss(pid);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	uint64_t hist[BENCH_HIST_SIZE] = {};
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	for (struct bench_worker &w : workers) {
+		for (int i = 0; i < BENCH_HIST_SIZE; ++i)
+			hist[i] += w.hist[i];
+		sent += w.sent_count;
+		received += w.received_count;
+		for (struct chat_client *c : w.clients)
+			chat_client_delete(c);
+	}
+	int room_size = bench_room_count > 0 ?
+			bench_client_count / bench_room_count : bench_client_count;
+	uint64_t expected = sent * (room_size - 1);
+	printf("clients %d, threads %d, rate %.1lf msg/s per client, "
+	       "size %d, %.1lf s, server threads %d, %s, rooms %d\n",
+	       bench_client_count, bench_thread_count, bench_rate,
+	       bench_msg_size, bench_duration, bench_server_thread_count,
+	       bench_use_coro ? "coroutines" :
+	       bench_use_uring ? "io_uring" : "epoll", bench_room_count);
+	printf("    sent %llu, delivered %llu of %llu (%.2lf%%), "
+	       "%.0lf msg/s\n", (unsigned long long)sent,
+	       (unsigned long long)received, (unsigned long long)expected,
+	       expected > 0 ? 100.0 * received / expected : 0,
+	       received / bench_duration);
+	if (received > 0) {
+		printf("    fan-out latency, us: p50 %.1lf, p99 %.1lf, "
+		       "p999 %.1lf, max %.1lf\n",
+		       bench_hist_percentile(hist, received, 0.5) / 1000.0,
+		       bench_hist_percentile(hist, received, 0.99) / 1000.0,
+		       bench_hist_percentile(hist, received, 0.999) / 1000.0,
+		       bench_hist_percentile(hist, received, 1) / 1000.0);
+	}
+	printf("    server CPU: %.2lf s, %.1lf%% of one core\n", cpu,
+	       100 * cpu / bench_duration);
+	printf("    server memory per connection: idle %.1lf KB, "
+	       "after the load %.1lf KB\n",
+	       ((double)rss_idle - rss_start) / bench_client_count / 1024,
+	       ((double)rss_end - rss_start) / bench_client_count / 1024);
+	return 0;
+}
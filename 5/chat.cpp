@@ -1,6 +1,17 @@
 #include "chat.h"
 
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
 #include <poll.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 int
 chat_events_to_poll_events(int mask)
@@ -12,3 +23,273 @@ chat_events_to_poll_events(int mask)
 		res |= POLLOUT;
 	return res;
 }
+
+int
+chat_timeout_to_ms(double timeout)
+{
+	if (timeout < 0)
+		return -1;
+	/* Round up so a tiny timeout doesn't turn into a busy loop. */
+	double ms = ceil(timeout * 1000);
+	if (ms > INT_MAX)
+		return INT_MAX;
+	return (int)ms;
+}
+
+double
+chat_clock_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+chat_input_reserve(struct chat_input *in, size_t size)
+{
+	if (in->capacity - in->size >= size)
+		return;
+	/* Only the tail with a not complete message is kept. */
+	size_t used = in->size - in->begin;
+	if (in->begin > 0 && in->capacity - used >= size) {
+		memmove(in->data, in->data + in->begin, used);
+	} else {
+		size_t capacity = in->capacity * 2;
+		if (capacity < used + size)
+			capacity = used + size;
+		char *data = new char[capacity];
+		if (used > 0)
+			memcpy(data, in->data + in->begin, used);
+		delete[] in->data;
+		in->data = data;
+		in->capacity = capacity;
+	}
+	in->scanned -= in->begin;
+	in->size = used;
+	in->begin = 0;
+}
+
+static inline bool
+chat_char_is_plain(uint8_t c)
+{
+	return c >= 0x20 && c < 0x7f;
+}
+
+/**
+ * Find the first '\n' in the given range, like memchr(). On the way
+ * drop the plain flag if any byte before it is not printable ASCII: a
+ * control char or a part of a multibyte UTF-8 sequence. So the plain
+ * text, which is most of it, is one vector pass, and only the rest is
+ * looked at byte by byte later.
+ */
+static const char *
+chat_scan_line(const char *pos, const char *end, bool *is_plain)
+{
+#if defined(__SSE2__)
+	__m128i nl = _mm_set1_epi8('\n');
+	__m128i space = _mm_set1_epi8(0x20);
+	__m128i del = _mm_set1_epi8(0x7f);
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		/* Signed, so the bytes from 0x80 are below the space too. */
+		int special = _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del)));
+		if (special != 0) {
+			int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+			if (mask != 0) {
+				int i = __builtin_ctz(mask);
+				if ((special & ((1 << i) - 1)) != 0)
+					*is_plain = false;
+				return pos + i;
+			}
+			*is_plain = false;
+		}
+		pos += 16;
+	}
+#elif defined(__ARM_NEON)
+	uint8x16_t nl = vdupq_n_u8('\n');
+	uint8x16_t space = vdupq_n_u8(0x20);
+	uint8x16_t del = vdupq_n_u8(0x7f);
+	while (end - pos >= 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)pos);
+		uint8x16_t m = vorrq_u8(vcltq_u8(v, space), vcgeq_u8(v, del));
+		/* Narrow each byte of the mask to 4 bits. */
+		uint64_t special = vget_lane_u64(vreinterpret_u64_u8(
+			vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+		if (special != 0) {
+			m = vceqq_u8(v, nl);
+			uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+				vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+			if (mask != 0) {
+				int shift = __builtin_ctzll(mask);
+				if ((special & ((1ull << shift) - 1)) != 0)
+					*is_plain = false;
+				return pos + (shift >> 2);
+			}
+			*is_plain = false;
+		}
+		pos += 16;
+	}
+#endif
+	for (; pos < end; ++pos) {
+		if (*pos == '\n')
+			return pos;
+		if (!chat_char_is_plain(*pos))
+			*is_plain = false;
+	}
+	return NULL;
+}
+
+/**
+ * Check the text is valid UTF-8 and cut the control chars out of it in
+ * place: C0 ones, DEL and C1 ones. Overlong forms, surrogates and code
+ * points beyond U+10FFFF are invalid, then false is returned.
+ */
+static bool
+chat_text_check(char *data, size_t *size)
+{
+	const uint8_t *src = (const uint8_t *)data;
+	const uint8_t *end = src + *size;
+	char *dst = data;
+	while (src < end) {
+		uint8_t c = *src;
+		if (c < 0x80) {
+			if (chat_char_is_plain(c))
+				*dst++ = c;
+			++src;
+			continue;
+		}
+		size_t len;
+		uint32_t cp;
+		uint32_t min;
+		if (c >= 0xc2 && c <= 0xdf) {
+			len = 2;
+			cp = c & 0x1f;
+			min = 0x80;
+		} else if ((c & 0xf0) == 0xe0) {
+			len = 3;
+			cp = c & 0x0f;
+			min = 0x800;
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			len = 4;
+			cp = c & 0x07;
+			min = 0x10000;
+		} else {
+			return false;
+		}
+		if ((size_t)(end - src) < len)
+			return false;
+		for (size_t i = 1; i < len; ++i) {
+			if ((src[i] & 0xc0) != 0x80)
+				return false;
+			cp = (cp << 6) | (src[i] & 0x3f);
+		}
+		if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+			return false;
+		if (cp >= 0xa0) {
+			memmove(dst, src, len);
+			dst += len;
+		}
+		src += len;
+	}
+	*size = dst - data;
+	return true;
+}
+
+bool
+chat_input_pop(struct chat_input *in, std::string_view *msg)
+{
+	char *data = in->data;
+	while (true) {
+		/* Resume from where the previous search stopped. */
+		const char *nl;
+		if (in->is_checked) {
+			nl = chat_scan_line(data + in->scanned, data + in->size,
+					    &in->is_plain);
+		} else {
+			nl = (const char *)memchr(data + in->scanned, '\n',
+						  in->size - in->scanned);
+		}
+		if (nl == NULL)
+			break;
+		size_t begin = in->begin;
+		size_t end = nl - data;
+		bool is_plain = in->is_plain;
+		in->begin = end + 1;
+		in->scanned = end + 1;
+		in->is_plain = true;
+		if (!is_plain) {
+			size_t size = end - begin;
+			if (!chat_text_check(data + begin, &size))
+				continue;
+			end = begin + size;
+		}
+		while (begin < end && isspace((unsigned char)data[begin]))
+			++begin;
+		while (end > begin && isspace((unsigned char)data[end - 1]))
+			--end;
+		if (begin == end)
+			continue;
+		*msg = std::string_view(data + begin, end - begin);
+		return true;
+	}
+	in->scanned = in->size;
+	/* Everything is popped, the buffer can be reused from the start. */
+	if (in->begin == in->size) {
+		in->begin = 0;
+		in->size = 0;
+		in->scanned = 0;
+		in->is_plain = true;
+	}
+	return false;
+}
+
+size_t
+chat_varint_encode(uint64_t value, char *buf)
+{
+	size_t size = 0;
+	while (value >= 0x80) {
+		buf[size++] = (char)(value | 0x80);
+		value >>= 7;
+	}
+	buf[size++] = (char)value;
+	return size;
+}
+
+int
+chat_input_pop_frame(struct chat_input *in, std::string_view *msg)
+{
+	while (true) {
+		uint64_t size = 0;
+		size_t pos = in->begin;
+		int shift = 0;
+		bool is_complete = false;
+		while (pos < in->size) {
+			uint8_t byte = in->data[pos++];
+			size |= (uint64_t)(byte & 0x7f) << shift;
+			if ((byte & 0x80) == 0) {
+				is_complete = true;
+				break;
+			}
+			shift += 7;
+			if (shift >= 7 * CHAT_VARINT_MAX_SIZE)
+				return -1;
+		}
+		if (!is_complete || in->size - pos < size)
+			break;
+		in->begin = pos + size;
+		in->scanned = in->begin;
+		in->is_plain = true;
+		if (size == 0)
+			continue;
+		*msg = std::string_view(in->data + pos, size);
+		return 1;
+	}
+	if (in->begin == in->size) {
+		in->begin = 0;
+		in->size = 0;
+		in->scanned = 0;
+		in->is_plain = true;
+	}
+	return 0;
+}
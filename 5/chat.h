@@ -16,7 +16,10 @@
 #define NEED_AUTHOR 0
 #define NEED_SERVER_FEED 0
 
+#include <stddef.h>
+#include <stdint.h>
 #include <string>
+#include <string_view>
 
 enum chat_errcode {
 	CHAT_ERR_INVALID_ARGUMENT = 1,
@@ -29,6 +32,23 @@ enum chat_errcode {
 	CHAT_ERR_SYS,
 };
 
+enum {
+	/**
+	 * The first byte a client sends to switch its connection to the
+	 * binary framing. The server echoes it back as an acknowledgement.
+	 * Everything before it is text, everything after it is binary.
+	 */
+	CHAT_BINARY_HELLO = 0,
+	/**
+	 * Same as the binary hello, but also asks the server to compress
+	 * the messages it sends, see chat_deflate.h. The server echoes it
+	 * if it agrees, or echoes the binary hello instead.
+	 */
+	CHAT_DEFLATE_HELLO = 1,
+	/** Max size of a varint, enough for any 64 bit number. */
+	CHAT_VARINT_MAX_SIZE = 10,
+};
+
 enum chat_events {
 	CHAT_EVENT_INPUT = 1,
 	CHAT_EVENT_OUTPUT = 2,
@@ -48,3 +68,95 @@ struct chat_message {
 /** Convert chat_events mask to events suitable for poll(). */
 int
 chat_events_to_poll_events(int mask);
+
+/** Convert a timeout in seconds to milliseconds for poll()/epoll_wait(). */
+int
+chat_timeout_to_ms(double timeout);
+
+/** Monotonic time in seconds. For the deadlines. */
+double
+chat_clock_now(void);
+
+/**
+ * Encode a number as a varint: 7 bits per byte, the lowest first, the
+ * high bit means there are more bytes.
+ *
+ * @param value Number to encode.
+ * @param[out] buf Buffer of at least CHAT_VARINT_MAX_SIZE bytes.
+ *
+ * @return Size of the encoded number.
+ */
+size_t
+chat_varint_encode(uint64_t value, char *buf);
+
+/**
+ * Input buffer. Collects the received data and cuts complete messages out
+ * of it. The data is received right into the buffer and the messages are
+ * handed out as views into it, so nothing is copied on the way. The
+ * popped messages are dropped lazily when more space is needed.
+ */
+struct chat_input {
+	/** Received data. */
+	char *data = NULL;
+	/** Size of the received data. */
+	size_t size = 0;
+	/** Size of the allocated buffer. */
+	size_t capacity = 0;
+	/** Start of the first not yet popped message. */
+	size_t begin = 0;
+	/** Offset up to which the data is known to have no '\n'. */
+	size_t scanned = 0;
+	/**
+	 * The text messages are checked: invalid UTF-8 ones are dropped,
+	 * the control chars are cut out of the rest.
+	 */
+	bool is_checked = false;
+	/**
+	 * The scanned part of the not yet popped message has only printable
+	 * ASCII, so the check has nothing to do with it.
+	 */
+	bool is_plain = true;
+
+	chat_input() = default;
+	chat_input(const chat_input &) = delete;
+	chat_input &operator=(const chat_input &) = delete;
+	~chat_input() { delete[] data; }
+};
+
+/**
+ * Make sure the buffer has at least @a size free bytes in the end. The
+ * data is received into [data + size, data + capacity) and then the size
+ * is increased by the received amount. Invalidates the popped views.
+ */
+void
+chat_input_reserve(struct chat_input *in, size_t size);
+
+/**
+ * Pop the next complete message from the input buffer. The message is
+ * trimmed from spaces on both sides. Empty messages are skipped, and so
+ * are the invalid UTF-8 ones if the input is checked.
+ *
+ * @param in Input buffer.
+ * @param[out] msg The message, valid until the next reserve.
+ *
+ * @retval true A message is popped.
+ * @retval false No complete messages left.
+ */
+bool
+chat_input_pop(struct chat_input *in, std::string_view *msg);
+
+/**
+ * Pop the next complete message from the input buffer in the binary
+ * framing: varint size and then the payload. The payload is taken as is,
+ * but the empty ones are skipped. Nothing is scanned, so it costs O(1)
+ * per message.
+ *
+ * @param in Input buffer.
+ * @param[out] msg The message, valid until the next reserve.
+ *
+ * @retval 1 A message is popped.
+ * @retval 0 No complete messages left.
+ * @retval -1 The data is not a valid frame.
+ */
+int
+chat_input_pop_frame(struct chat_input *in, std::string_view *msg);
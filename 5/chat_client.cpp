@@ -1,102 +1,1101 @@
 #include "chat.h"
 #include "chat_client.h"
+#include "chat_deflate.h"
+#include "chat_tls.h"
 
+#include <algorithm>
 #include <cstring>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <netdb.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include <unistd.h>
+#include <unordered_map>
+
+enum {
+	/** Min free space in the input buffer for a single read. */
+	CHAT_CLIENT_READ_SIZE = 64 * 1024,
+	/** Max number of hosts in the resolve cache. */
+	CHAT_CLIENT_RESOLVE_CACHE_SIZE = 1024,
+	/** Max number of events taken from epoll in one group update. */
+	CHAT_CLIENT_GROUP_EVENT_BATCH = 1024,
+};
+
+/** Delay between the connect attempts by default, as in RFC 8305. */
+static const double chat_client_default_attempt_delay = 0.25;
+
+/** A resolved address to connect to. */
+struct chat_client_addr {
+	struct sockaddr_storage addr;
+	socklen_t len;
+};
+
+/** Addresses of a host and port, shared by all the clients. */
+struct chat_resolve_entry {
+	double resolved_at;
+	std::vector<struct chat_client_addr> addrs;
+};
+
+/** Resolve cache by "host:port". Used by any thread. */
+static std::mutex chat_resolve_mutex;
+static std::unordered_map<std::string, struct chat_resolve_entry>
+	chat_resolve_cache;
 
 struct chat_client {
 	/** Socket connected to the server. */
 	int socket = -1;
 	/** Array of received messages. */
-	/* ... */
+	std::deque<struct chat_message> messages;
+	/** Input buffer. */
+	struct chat_input input;
 	/** Output buffer. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	std::string output;
+	/** How much of the output buffer is already sent. */
+	size_t output_sent = 0;
+	/** Use the binary framing. */
+	bool is_binary = false;
+	/** Ask the server to compress what it sends. */
+	bool is_deflate = false;
+	/**
+	 * The server echoed the binary hello. Until then the input is still
+	 * text.
+	 */
+	bool is_acked = false;
+	/** The server echoed the deflate hello, the frames are compressed. */
+	bool is_inflating = false;
+	/** Text fed in the binary mode, cut into messages to send as frames. */
+	struct chat_input feed_input;
+	/** Max time the output is held for before sending. */
+	double flush_delay = 0;
+	/** Output size at which it is sent without waiting. 0 - no limit. */
+	size_t flush_size = 0;
+	/** When the held output has to be sent. */
+	double flush_deadline = 0;
+	/** TLS of the connection, if set. */
+	struct chat_tls_ctx *tls_ctx = NULL;
+	struct chat_client_connect_options connect_options = {};
+	/**
+	 * The connect is in progress, there is no socket yet, or the TLS
+	 * handshake is not done.
+	 */
+	bool is_connecting = false;
+	/** Addresses to connect to, in the order of the attempts. */
+	std::vector<struct chat_client_addr> addrs;
+	/** Next address to try. */
+	size_t next_addr = 0;
+	/** Sockets of the attempts in progress, the newest last. */
+	std::vector<int> attempts;
+	/** When the next address is tried even if the others still go on. */
+	double attempt_deadline = 0;
+	/** Error of the last failed attempt. */
+	int attempt_error = 0;
+	/** Key of the addresses in the resolve cache. */
+	std::string resolve_key;
+	/** Server's name, for TLS. */
+	std::string host;
+	/** TLS handshake after the connect, when it is not blocking. */
+	struct chat_tls *tls = NULL;
+	/** Poll events the handshake waits for. */
+	short tls_events = 0;
+	/** Group driving the client, if any. */
+	struct chat_client_group *group = NULL;
+	/** Position in the group's clients. */
+	size_t group_idx = 0;
+	/** In the group's list of the clients with output. */
+	bool is_group_pending = false;
+	/** In the group's list of the clients with messages to pop. */
+	bool is_group_ready = false;
+	/** The socket is full, the group waits for it to be writable. */
+	bool is_group_blocked = false;
+};
+
+/**
+ * Many clients in one epoll. The sockets are edge-triggered, and are
+ * registered and unregistered by the clients as they open and close,
+ * the connect attempts included.
+ */
+struct chat_client_group {
+	int epoll = -1;
+	std::vector<struct chat_client *> clients;
+	/** The clients with a connect in progress. */
+	std::vector<struct chat_client *> connecting;
+	/** The clients with output to send, held or blocked included. */
+	std::vector<struct chat_client *> pending;
+	/** The clients with received messages, in the order of arrival. */
+	std::deque<struct chat_client *> ready;
+	std::vector<struct epoll_event> events;
 };
 
+/** Check if the client is connected or connecting. */
+static bool
+chat_client_is_started(const struct chat_client *client)
+{
+	return client->socket >= 0 || client->is_connecting;
+}
+
+/** Register a new socket of the client in its group, if any. */
+static void
+chat_client_watch(struct chat_client *client, int sock)
+{
+	if (client->group == NULL)
+		return;
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = client;
+	epoll_ctl(client->group->epoll, EPOLL_CTL_ADD, sock, &ev);
+}
+
+/**
+ * Close a socket of the client. It leaves the group's epoll before, so
+ * a reused descriptor number can't be confused with it.
+ */
+static void
+chat_client_close(struct chat_client *client, int sock)
+{
+	if (client->group != NULL)
+		epoll_ctl(client->group->epoll, EPOLL_CTL_DEL, sock, NULL);
+	close(sock);
+}
+
+/** Tell the group about the client's new output or connect. */
+static void
+chat_client_group_track(struct chat_client *client)
+{
+	struct chat_client_group *group = client->group;
+	if (group == NULL)
+		return;
+	if (client->is_connecting && std::find(group->connecting.begin(),
+			group->connecting.end(), client) == group->connecting.end())
+		group->connecting.push_back(client);
+	if (!client->is_group_pending &&
+	    client->output_sent < client->output.size()) {
+		client->is_group_pending = true;
+		group->pending.push_back(client);
+	}
+}
+
 struct chat_client *
 chat_client_new(std::string_view name)
 {
 	/* Ignore 'name' param if don't want to support it for +5 points. */
 	(void)name;
-	/* IMPLEMENT THIS FUNCTION */
 	return new chat_client();
 }
 
 void
 chat_client_delete(struct chat_client *client)
 {
+	if (client->group != NULL)
+		chat_client_group_remove(client->group, client);
+	if (client->tls != NULL)
+		chat_tls_delete(client->tls);
+	for (int sock : client->attempts)
+		close(sock);
 	if (client->socket >= 0)
 		close(client->socket);
+	if (client->tls_ctx != NULL)
+		chat_tls_ctx_delete(client->tls_ctx);
+	delete client;
+}
 
-	/* IMPLEMENT THIS FUNCTION */
+/**
+ * Start the flush delay, if the output was empty before the just fed
+ * data. The delay is counted from the oldest held byte.
+ */
+static void
+chat_client_hold(struct chat_client *client, bool was_empty)
+{
+	if (was_empty && client->flush_delay > 0 &&
+	    client->output_sent < client->output.size())
+		client->flush_deadline = chat_clock_now() + client->flush_delay;
+	chat_client_group_track(client);
+}
 
-	delete client;
+/** Check if the output has to be sent now. */
+static bool
+chat_client_is_due(const struct chat_client *client)
+{
+	size_t pending = client->output.size() - client->output_sent;
+	if (pending == 0)
+		return false;
+	/* A started send is finished without waiting. */
+	if (client->flush_delay == 0 || client->output_sent > 0)
+		return true;
+	if (client->flush_size != 0 && pending >= client->flush_size)
+		return true;
+	return chat_clock_now() >= client->flush_deadline;
+}
+
+/**
+ * Resolve the host and port, taking the cache if the TTL is positive.
+ * The IPv4 and IPv6 addresses are interleaved, the first family of the
+ * resolver goes first, so a broken family costs one attempt delay.
+ *
+ * @retval 0 Success.
+ * @retval -1 Not resolved.
+ */
+static int
+chat_client_resolve(const std::string &host, const std::string &port,
+		    const std::string &key, double ttl,
+		    std::vector<struct chat_client_addr> *out)
+{
+	if (ttl > 0) {
+		std::lock_guard<std::mutex> lock(chat_resolve_mutex);
+		auto it = chat_resolve_cache.find(key);
+		if (it != chat_resolve_cache.end() &&
+		    chat_clock_now() < it->second.resolved_at + ttl) {
+			*out = it->second.addrs;
+			return 0;
+		}
+	}
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	struct addrinfo *list;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &list) != 0)
+		return -1;
+	std::vector<struct chat_client_addr> families[2];
+	int first = -1;
+	for (struct addrinfo *ai = list; ai != NULL; ai = ai->ai_next) {
+		if (ai->ai_addrlen > sizeof(struct sockaddr_storage))
+			continue;
+		int family = ai->ai_family == AF_INET ? 0 : 1;
+		if (first < 0)
+			first = family;
+		struct chat_client_addr a;
+		memcpy(&a.addr, ai->ai_addr, ai->ai_addrlen);
+		a.len = ai->ai_addrlen;
+		families[family].push_back(a);
+	}
+	freeaddrinfo(list);
+	if (first < 0)
+		return -1;
+	out->clear();
+	std::vector<struct chat_client_addr> &a = families[first];
+	std::vector<struct chat_client_addr> &b = families[1 - first];
+	for (size_t i = 0; i < a.size() || i < b.size(); ++i) {
+		if (i < a.size())
+			out->push_back(a[i]);
+		if (i < b.size())
+			out->push_back(b[i]);
+	}
+	if (ttl > 0) {
+		std::lock_guard<std::mutex> lock(chat_resolve_mutex);
+		if (chat_resolve_cache.size() >= CHAT_CLIENT_RESOLVE_CACHE_SIZE)
+			chat_resolve_cache.clear();
+		chat_resolve_cache[key] = {chat_clock_now(), *out};
+	}
+	return 0;
+}
+
+/** Drop the addresses none of which could be connected to. */
+static void
+chat_client_forget_addrs(const std::string &key)
+{
+	std::lock_guard<std::mutex> lock(chat_resolve_mutex);
+	chat_resolve_cache.erase(key);
+}
+
+static double
+chat_client_attempt_delay(const struct chat_client *client)
+{
+	double delay = client->connect_options.attempt_delay;
+	return delay > 0 ? delay : chat_client_default_attempt_delay;
+}
+
+/**
+ * Start an attempt with the next address. The addresses which fail at
+ * once are skipped.
+ */
+static void
+chat_client_attempt_next(struct chat_client *client)
+{
+	while (client->next_addr < client->addrs.size()) {
+		const struct chat_client_addr *a =
+			&client->addrs[client->next_addr++];
+		int sock = socket(a->addr.ss_family,
+				  SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (sock < 0) {
+			client->attempt_error = errno;
+			continue;
+		}
+		if (connect(sock, (const struct sockaddr *)&a->addr,
+			    a->len) == 0 || errno == EINPROGRESS) {
+			client->attempts.push_back(sock);
+			chat_client_watch(client, sock);
+			client->attempt_deadline = chat_clock_now() +
+				chat_client_attempt_delay(client);
+			return;
+		}
+		client->attempt_error = errno;
+		close(sock);
+	}
+}
+
+/** Drop the connect state, and the output queued while it went on. */
+static void
+chat_client_abort_connect(struct chat_client *client, int err)
+{
+	for (int sock : client->attempts)
+		chat_client_close(client, sock);
+	client->attempts.clear();
+	client->addrs.clear();
+	if (client->tls != NULL) {
+		chat_tls_delete(client->tls);
+		client->tls = NULL;
+	}
+	if (client->socket >= 0) {
+		chat_client_close(client, client->socket);
+		client->socket = -1;
+	}
+	client->is_connecting = false;
+	client->output.clear();
+	client->output_sent = 0;
+	errno = err;
+}
+
+/**
+ * Continue the TLS handshake of a connected socket.
+ *
+ * @retval 0 Done or in progress.
+ * @retval -1 Failed.
+ */
+static int
+chat_client_handshake(struct chat_client *client)
+{
+	switch (chat_tls_handshake(client->tls)) {
+	case CHAT_TLS_WANT_READ:
+		client->tls_events = POLLIN;
+		return 0;
+	case CHAT_TLS_WANT_WRITE:
+		client->tls_events = POLLOUT;
+		return 0;
+	case CHAT_TLS_ERROR:
+		return -1;
+	case CHAT_TLS_DONE:
+		break;
+	}
+	chat_tls_delete(client->tls);
+	client->tls = NULL;
+	client->is_connecting = false;
+	return 0;
+}
+
+/**
+ * Wait for the connect attempts, or the handshake, and advance them.
+ * A new attempt starts when the previous ones take longer than the
+ * attempt delay, or have failed. The first connected one wins.
+ *
+ * @retval 0 Progress, maybe connected.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_TIMEOUT - nothing happened.
+ *     - CHAT_ERR_SYS - all the attempts failed, check errno. EPROTO -
+ *       the TLS handshake failed.
+ */
+static int
+chat_client_poll_connect(struct chat_client *client, double timeout)
+{
+	if (client->tls != NULL) {
+		struct pollfd pfd = {client->socket, client->tls_events, 0};
+		int rc = poll(&pfd, 1, chat_timeout_to_ms(timeout));
+		if (rc < 0 && errno != EINTR) {
+			chat_client_abort_connect(client, errno);
+			return CHAT_ERR_SYS;
+		}
+		if (rc <= 0)
+			return CHAT_ERR_TIMEOUT;
+		if (chat_client_handshake(client) != 0) {
+			chat_client_abort_connect(client, EPROTO);
+			return CHAT_ERR_SYS;
+		}
+		return 0;
+	}
+	if (client->next_addr < client->addrs.size()) {
+		double wait = std::max(client->attempt_deadline -
+				       chat_clock_now(), 0.0);
+		if (timeout < 0 || wait < timeout)
+			timeout = wait;
+	}
+	std::vector<struct pollfd> pfds(client->attempts.size());
+	for (size_t i = 0; i < pfds.size(); ++i)
+		pfds[i] = {client->attempts[i], POLLOUT, 0};
+	int rc = poll(pfds.data(), pfds.size(), chat_timeout_to_ms(timeout));
+	if (rc < 0 && errno != EINTR) {
+		chat_client_abort_connect(client, errno);
+		return CHAT_ERR_SYS;
+	}
+	bool is_progress = false;
+	for (size_t i = 0; i < pfds.size() && rc > 0; ++i) {
+		if (pfds[i].revents == 0)
+			continue;
+		is_progress = true;
+		int sock = pfds[i].fd;
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+			err = errno;
+		if (err != 0) {
+			client->attempt_error = err;
+			chat_client_close(client, sock);
+			client->attempts.erase(std::find(client->attempts.begin(),
+				client->attempts.end(), sock));
+			continue;
+		}
+		/* The others lose. */
+		for (int other : client->attempts) {
+			if (other != sock)
+				chat_client_close(client, other);
+		}
+		client->attempts.clear();
+		client->addrs.clear();
+		client->socket = sock;
+		/* A blocking connect does the handshake itself. */
+		if (client->tls_ctx == NULL ||
+		    !client->connect_options.is_async) {
+			client->is_connecting = false;
+			return 0;
+		}
+		client->tls = chat_tls_new(client->tls_ctx, sock,
+					   client->host.c_str());
+		if (client->tls == NULL || chat_client_handshake(client) != 0) {
+			chat_client_abort_connect(client, EPROTO);
+			return CHAT_ERR_SYS;
+		}
+		return 0;
+	}
+	if (client->attempts.empty() ||
+	    chat_clock_now() >= client->attempt_deadline) {
+		size_t count = client->attempts.size();
+		chat_client_attempt_next(client);
+		is_progress = is_progress || client->attempts.size() > count;
+	}
+	if (client->attempts.empty()) {
+		chat_client_forget_addrs(client->resolve_key);
+		chat_client_abort_connect(client, client->attempt_error);
+		return CHAT_ERR_SYS;
+	}
+	return is_progress ? 0 : CHAT_ERR_TIMEOUT;
 }
 
 int
 chat_client_connect(struct chat_client *client, std::string_view addr)
 {
-	/*
-	 * 1) Use getaddrinfo() to resolve addr to struct sockaddr_in.
-	 * 2) Create a client socket (function socket()).
-	 * 3) Connect it by the found address (function connect()).
-	 */
-	/* IMPLEMENT THIS FUNCTION */
-	(void)client;
-	(void)addr;
+	if (chat_client_is_started(client))
+		return CHAT_ERR_ALREADY_STARTED;
+	size_t colon = addr.rfind(':');
+	if (colon == std::string_view::npos)
+		return CHAT_ERR_NO_ADDR;
+	std::string host(addr.substr(0, colon));
+	std::string port(addr.substr(colon + 1));
+	client->resolve_key.assign(addr);
+	if (chat_client_resolve(host, port, client->resolve_key,
+				client->connect_options.resolve_ttl,
+				&client->addrs) != 0)
+		return CHAT_ERR_NO_ADDR;
+	client->host = std::move(host);
+	client->next_addr = 0;
+	client->attempt_error = 0;
+	client->is_connecting = true;
+	if (client->is_binary) {
+		bool was_empty = client->output.empty();
+		client->output.push_back(client->is_deflate ?
+					 CHAT_DEFLATE_HELLO :
+					 CHAT_BINARY_HELLO);
+		chat_client_hold(client, was_empty);
+	}
+	chat_client_attempt_next(client);
+	if (client->attempts.empty()) {
+		chat_client_abort_connect(client, client->attempt_error);
+		return CHAT_ERR_SYS;
+	}
+	chat_client_group_track(client);
+	if (client->connect_options.is_async)
+		return 0;
+	while (client->socket < 0) {
+		int rc = chat_client_poll_connect(client, -1);
+		if (rc != 0 && rc != CHAT_ERR_TIMEOUT)
+			return rc;
+	}
+	if (client->tls_ctx == NULL)
+		return 0;
+	/* The socket is made blocking, so the handshake is done in one call. */
+	int sock = client->socket;
+	int flags = fcntl(sock, F_GETFL);
+	if (flags < 0 || fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) != 0) {
+		chat_client_abort_connect(client, errno);
+		return CHAT_ERR_SYS;
+	}
+	struct chat_tls *tls = chat_tls_new(client->tls_ctx, sock,
+					    client->host.c_str());
+	bool is_ok = tls != NULL && chat_tls_handshake(tls) == CHAT_TLS_DONE;
+	if (tls != NULL)
+		chat_tls_delete(tls);
+	if (!is_ok) {
+		chat_client_abort_connect(client, EPROTO);
+		return CHAT_ERR_SYS;
+	}
+	if (fcntl(sock, F_SETFL, flags) != 0) {
+		chat_client_abort_connect(client, errno);
+		return CHAT_ERR_SYS;
+	}
+	return 0;
+}
+
+int
+chat_client_set_connect(struct chat_client *client,
+			const struct chat_client_connect_options *options)
+{
+	if (chat_client_is_started(client))
+		return CHAT_ERR_ALREADY_STARTED;
+	/* Written so NaN is rejected too. */
+	if (!(options->attempt_delay >= 0) || !(options->resolve_ttl >= 0))
+		return CHAT_ERR_INVALID_ARGUMENT;
+	client->connect_options = *options;
+	return 0;
+}
+
+int
+chat_client_set_binary(struct chat_client *client)
+{
+	if (chat_client_is_started(client))
+		return CHAT_ERR_ALREADY_STARTED;
+	client->is_binary = true;
+	return 0;
+}
+
+int
+chat_client_set_compression(struct chat_client *client)
+{
+	if (chat_client_is_started(client))
+		return CHAT_ERR_ALREADY_STARTED;
+	if (!chat_deflate_is_supported())
+		return CHAT_ERR_NOT_IMPLEMENTED;
+	client->is_binary = true;
+	client->is_deflate = true;
+	return 0;
+}
 
-	return CHAT_ERR_NOT_IMPLEMENTED;
+int
+chat_client_set_tls(struct chat_client *client, const char *ca_file)
+{
+	if (chat_client_is_started(client))
+		return CHAT_ERR_ALREADY_STARTED;
+	if (!chat_tls_is_supported())
+		return CHAT_ERR_NOT_IMPLEMENTED;
+	struct chat_tls_ctx *ctx = chat_tls_ctx_new_client(ca_file);
+	if (ctx == NULL)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	if (client->tls_ctx != NULL)
+		chat_tls_ctx_delete(client->tls_ctx);
+	client->tls_ctx = ctx;
+	return 0;
+}
+
+int
+chat_client_set_flush(struct chat_client *client, double delay, size_t size)
+{
+	/* Written so NaN is rejected too. */
+	if (!(delay >= 0))
+		return CHAT_ERR_INVALID_ARGUMENT;
+	client->flush_delay = delay;
+	client->flush_size = size;
+	return 0;
 }
 
 struct chat_message *
 chat_client_pop_next(struct chat_client *client)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)client;
-	return NULL;
+	if (client->messages.empty())
+		return NULL;
+	struct chat_message *msg =
+		new chat_message(std::move(client->messages.front()));
+	client->messages.pop_front();
+	return msg;
+}
+
+size_t
+chat_client_pop_batch(struct chat_client *client,
+		      std::vector<struct chat_message> *out, size_t max)
+{
+	size_t count = std::min(max, client->messages.size());
+	auto end = client->messages.begin() + count;
+	out->insert(out->end(), std::make_move_iterator(
+		client->messages.begin()), std::make_move_iterator(end));
+	client->messages.erase(client->messages.begin(), end);
+	return count;
+}
+
+/**
+ * Read everything available on the socket and cut it into messages.
+ *
+ * @retval 0 Success.
+ * @retval -1 The server closed the connection or it is broken.
+ */
+static int
+chat_client_read(struct chat_client *client)
+{
+	struct chat_input *in = &client->input;
+	while (true) {
+		chat_input_reserve(in, CHAT_CLIENT_READ_SIZE);
+		ssize_t rc = recv(client->socket, in->data + in->size,
+				  in->capacity - in->size, 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		if (rc == 0)
+			return -1;
+		in->size += rc;
+		std::string_view data;
+		while (true) {
+			if (!client->is_acked) {
+				char hello = in->begin < in->size ?
+					     in->data[in->begin] : '\n';
+				if (client->is_binary &&
+				    (hello == CHAT_BINARY_HELLO ||
+				     (client->is_deflate &&
+				      hello == CHAT_DEFLATE_HELLO))) {
+					/* The rest is binary. */
+					++in->begin;
+					in->scanned = in->begin;
+					client->is_acked = true;
+					client->is_inflating =
+						hello == CHAT_DEFLATE_HELLO;
+					continue;
+				}
+				if (!chat_input_pop(in, &data))
+					break;
+			} else {
+				int res = chat_input_pop_frame(in, &data);
+				if (res < 0)
+					return -1;
+				if (res == 0)
+					break;
+			}
+			client->messages.emplace_back();
+			if (!client->is_inflating) {
+				client->messages.back().data.assign(data);
+			} else if (chat_deflate_decode(
+					   data, &client->messages.back().data) != 0) {
+				client->messages.pop_back();
+				return -1;
+			}
+		}
+	}
+}
+
+/**
+ * Send as much of the output as the socket takes.
+ *
+ * @retval 0 Success.
+ * @retval -1 The connection is broken.
+ */
+static int
+chat_client_flush(struct chat_client *client)
+{
+	while (client->output_sent < client->output.size()) {
+		ssize_t rc = send(client->socket,
+				  client->output.data() + client->output_sent,
+				  client->output.size() - client->output_sent,
+				  MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		client->output_sent += rc;
+	}
+	if (client->output_sent == client->output.size()) {
+		client->output.clear();
+		client->output_sent = 0;
+	} else if (client->output_sent > client->output.size() / 2) {
+		client->output.erase(0, client->output_sent);
+		client->output_sent = 0;
+	}
+	return 0;
+}
+
+/** Close the broken connection. */
+static void
+chat_client_drop(struct chat_client *client)
+{
+	/* The received messages stay available for popping. */
+	chat_client_close(client, client->socket);
+	client->socket = -1;
+	client->output.clear();
+	client->output_sent = 0;
+}
+
+/** Wait for the socket and handle its events. */
+static int
+chat_client_poll(struct chat_client *client, double timeout)
+{
+	struct pollfd pfd;
+	pfd.fd = client->socket;
+	pfd.events = chat_events_to_poll_events(chat_client_get_events(client));
+	pfd.revents = 0;
+	int rc = poll(&pfd, 1, chat_timeout_to_ms(timeout));
+	if (rc < 0) {
+		if (errno == EINTR)
+			return CHAT_ERR_TIMEOUT;
+		return CHAT_ERR_SYS;
+	}
+	if (rc == 0)
+		return CHAT_ERR_TIMEOUT;
+	bool is_broken = false;
+	if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+		is_broken = chat_client_read(client) != 0;
+	if (!is_broken && (pfd.revents & POLLOUT) != 0)
+		is_broken = chat_client_flush(client) != 0;
+	if (is_broken)
+		chat_client_drop(client);
+	return 0;
 }
 
 int
 chat_client_update(struct chat_client *client, double timeout)
 {
+	if (!chat_client_is_started(client))
+		return CHAT_ERR_NOT_STARTED;
+	if (client->is_connecting)
+		return chat_client_poll_connect(client, timeout);
+	if (client->flush_delay == 0)
+		return chat_client_poll(client, timeout);
 	/*
-	 * The easiest way to wait for updates on a single socket with a timeout
-	 * is to use poll(). Epoll is good for many sockets, poll is good for a
-	 * few.
-	 *
-	 * You create one struct pollfd, fill it, call poll() on it, handle the
-	 * events (do read/write).
+	 * A wakeup for the held output isn't a timeout for the caller unless
+	 * the caller's own timeout is over too.
 	 */
-	(void)client;
-	(void)timeout;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	double deadline = chat_clock_now() + timeout;
+	while (true) {
+		double wait = timeout;
+		if (timeout >= 0)
+			wait = std::max(deadline - chat_clock_now(), 0.0);
+		double next = chat_client_get_timeout(client);
+		bool is_early = next > 0 && (wait < 0 || next < wait);
+		if (is_early)
+			wait = next;
+		int rc = chat_client_poll(client, wait);
+		if (rc != CHAT_ERR_TIMEOUT || !is_early || client->socket < 0)
+			return rc;
+	}
 }
 
 int
 chat_client_get_descriptor(const struct chat_client *client)
 {
+	if (client->socket < 0 && !client->attempts.empty())
+		return client->attempts.back();
 	return client->socket;
 }
 
 int
 chat_client_get_events(const struct chat_client *client)
 {
-	/*
-	 * IMPLEMENT THIS FUNCTION - add OUTPUT event if has non-empty output
-	 * buffer.
-	 */
-	(void)client;
-	return CHAT_EVENT_INPUT;
+	if (client->is_connecting) {
+		/* A connect is done when the socket becomes writable. */
+		if (client->tls == NULL)
+			return client->attempts.empty() ? 0 : CHAT_EVENT_OUTPUT;
+		return client->tls_events == POLLIN ? CHAT_EVENT_INPUT :
+						      CHAT_EVENT_OUTPUT;
+	}
+	if (client->socket < 0)
+		return 0;
+	int res = CHAT_EVENT_INPUT;
+	if (chat_client_is_due(client))
+		res |= CHAT_EVENT_OUTPUT;
+	return res;
+}
+
+double
+chat_client_get_timeout(const struct chat_client *client)
+{
+	if (client->is_connecting && client->tls == NULL) {
+		/*
+		 * Only the newest attempt is the descriptor, the older ones
+		 * are checked at least every attempt delay.
+		 */
+		if (client->next_addr < client->addrs.size()) {
+			return std::max(client->attempt_deadline -
+					chat_clock_now(), 0.0);
+		}
+		if (client->attempts.size() > 1)
+			return chat_client_attempt_delay(client);
+		return -1;
+	}
+	if (client->is_connecting || client->socket < 0 ||
+	    client->output_sent == client->output.size())
+		return -1;
+	if (chat_client_is_due(client))
+		return 0;
+	return std::max(client->flush_deadline - chat_clock_now(), 0.0);
+}
+
+/** Append a message to the output in the binary framing. */
+static void
+chat_client_push_frame(struct chat_client *client, const char *msg,
+		       size_t msg_size)
+{
+	char header[CHAT_VARINT_MAX_SIZE];
+	client->output.append(header, chat_varint_encode(msg_size, header));
+	client->output.append(msg, msg_size);
 }
 
 int
 chat_client_feed(struct chat_client *client, const char *msg, uint32_t msg_size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)client;
-	(void)msg;
-	(void)msg_size;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (!chat_client_is_started(client))
+		return CHAT_ERR_NOT_STARTED;
+	bool was_empty = client->output_sent == client->output.size();
+	if (!client->is_binary) {
+		client->output.append(msg, msg_size);
+		chat_client_hold(client, was_empty);
+		return 0;
+	}
+	/* The text is cut into messages just like the server would do. */
+	struct chat_input *in = &client->feed_input;
+	chat_input_reserve(in, msg_size);
+	memcpy(in->data + in->size, msg, msg_size);
+	in->size += msg_size;
+	std::string_view data;
+	while (chat_input_pop(in, &data))
+		chat_client_push_frame(client, data.data(), data.size());
+	chat_client_hold(client, was_empty);
+	return 0;
+}
+
+int
+chat_client_feed_binary(struct chat_client *client, const char *msg,
+			uint32_t msg_size)
+{
+	if (!client->is_binary)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	if (!chat_client_is_started(client))
+		return CHAT_ERR_NOT_STARTED;
+	bool was_empty = client->output_sent == client->output.size();
+	if (msg_size > 0)
+		chat_client_push_frame(client, msg, msg_size);
+	chat_client_hold(client, was_empty);
+	return 0;
+}
+
+struct chat_client_group *
+chat_client_group_new(void)
+{
+	int fd = epoll_create1(EPOLL_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	struct chat_client_group *group = new chat_client_group();
+	group->epoll = fd;
+	group->events.resize(CHAT_CLIENT_GROUP_EVENT_BATCH);
+	return group;
+}
+
+void
+chat_client_group_delete(struct chat_client_group *group)
+{
+	while (!group->clients.empty())
+		chat_client_group_remove(group, group->clients.back());
+	close(group->epoll);
+	delete group;
+}
+
+int
+chat_client_group_add(struct chat_client_group *group,
+		      struct chat_client *client)
+{
+	if (client->group != NULL)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	client->group = group;
+	client->group_idx = group->clients.size();
+	group->clients.push_back(client);
+	for (int sock : client->attempts)
+		chat_client_watch(client, sock);
+	if (client->socket >= 0)
+		chat_client_watch(client, client->socket);
+	/* Whatever was there before, is not seen by the edges anymore. */
+	client->is_group_blocked = false;
+	chat_client_group_track(client);
+	if (!client->messages.empty()) {
+		client->is_group_ready = true;
+		group->ready.push_back(client);
+	}
+	return 0;
+}
+
+template<typename C>
+static void
+chat_client_group_forget(C *list, struct chat_client *client)
+{
+	auto it = std::find(list->begin(), list->end(), client);
+	if (it != list->end())
+		list->erase(it);
+}
+
+int
+chat_client_group_remove(struct chat_client_group *group,
+			 struct chat_client *client)
+{
+	if (client->group != group)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	for (int sock : client->attempts)
+		epoll_ctl(group->epoll, EPOLL_CTL_DEL, sock, NULL);
+	if (client->socket >= 0)
+		epoll_ctl(group->epoll, EPOLL_CTL_DEL, client->socket, NULL);
+	struct chat_client *last = group->clients.back();
+	group->clients[client->group_idx] = last;
+	last->group_idx = client->group_idx;
+	group->clients.pop_back();
+	chat_client_group_forget(&group->connecting, client);
+	if (client->is_group_pending)
+		chat_client_group_forget(&group->pending, client);
+	if (client->is_group_ready)
+		chat_client_group_forget(&group->ready, client);
+	client->is_group_pending = false;
+	client->is_group_ready = false;
+	client->is_group_blocked = false;
+	client->group = NULL;
+	return 0;
+}
+
+/** Move the client to the ready ones, if it got messages. */
+static void
+chat_client_group_read(struct chat_client *client)
+{
+	if (chat_client_read(client) != 0)
+		chat_client_drop(client);
+	if (!client->is_group_ready && !client->messages.empty()) {
+		client->is_group_ready = true;
+		client->group->ready.push_back(client);
+	}
+}
+
+/**
+ * Advance the connects which are due, and send the output which is due.
+ * Returns the time till the nearest next deadline, or -1.
+ */
+static double
+chat_client_group_check(struct chat_client_group *group, bool *is_progress)
+{
+	double now = chat_clock_now();
+	double next = -1;
+	auto update_next = [&](double deadline) {
+		double wait = std::max(deadline - now, 0.0);
+		if (next < 0 || wait < next)
+			next = wait;
+	};
+	for (size_t i = 0; i < group->connecting.size();) {
+		struct chat_client *c = group->connecting[i];
+		/*
+		 * Each attempt is in the epoll, only the start of the next one
+		 * has a deadline.
+		 */
+		bool is_due = c->is_connecting && c->tls == NULL &&
+			      (c->attempts.empty() || (c->next_addr < c->addrs.size() &&
+			       now >= c->attempt_deadline));
+		if (is_due) {
+			chat_client_poll_connect(c, 0);
+			*is_progress = true;
+		}
+		if (!c->is_connecting) {
+			group->connecting[i] = group->connecting.back();
+			group->connecting.pop_back();
+			if (c->socket >= 0)
+				chat_client_group_read(c);
+			continue;
+		}
+		if (c->tls == NULL && c->next_addr < c->addrs.size())
+			update_next(c->attempt_deadline);
+		++i;
+	}
+	for (size_t i = 0; i < group->pending.size();) {
+		struct chat_client *c = group->pending[i];
+		if (!c->is_connecting && c->socket >= 0 && !c->is_group_blocked &&
+		    chat_client_is_due(c)) {
+			*is_progress = true;
+			if (chat_client_flush(c) != 0)
+				chat_client_drop(c);
+			else if (c->output_sent < c->output.size())
+				c->is_group_blocked = true;
+		}
+		if (!chat_client_is_started(c) ||
+		    c->output_sent == c->output.size()) {
+			c->is_group_pending = false;
+			group->pending[i] = group->pending.back();
+			group->pending.pop_back();
+			continue;
+		}
+		if (!c->is_connecting && !c->is_group_blocked)
+			update_next(c->flush_deadline);
+		++i;
+	}
+	return next;
+}
+
+int
+chat_client_group_update(struct chat_client_group *group, double timeout)
+{
+	bool is_progress = false;
+	double next = chat_client_group_check(group, &is_progress);
+	if (is_progress)
+		timeout = 0;
+	else if (next >= 0 && (timeout < 0 || next < timeout))
+		timeout = next;
+	int count = epoll_wait(group->epoll, group->events.data(),
+			       group->events.size(), chat_timeout_to_ms(timeout));
+	if (count < 0) {
+		if (errno != EINTR)
+			return CHAT_ERR_SYS;
+		count = 0;
+	}
+	for (int i = 0; i < count; ++i) {
+		const struct epoll_event *ev = &group->events[i];
+		struct chat_client *c = (struct chat_client *)ev->data.ptr;
+		if (c->is_connecting) {
+			if (chat_client_poll_connect(c, 0) == CHAT_ERR_SYS)
+				continue;
+			if (!c->is_connecting)
+				chat_client_group_read(c);
+			continue;
+		}
+		if (c->socket < 0)
+			continue;
+		if ((ev->events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0)
+			chat_client_group_read(c);
+		if (c->socket >= 0 && (ev->events & EPOLLOUT) != 0)
+			c->is_group_blocked = false;
+	}
+	/* The writable ones, and the connected ones, send right away. */
+	chat_client_group_check(group, &is_progress);
+	return is_progress || count > 0 ? 0 : CHAT_ERR_TIMEOUT;
+}
+
+size_t
+chat_client_group_pop_batch(struct chat_client_group *group,
+			    std::vector<struct chat_message> *out,
+			    std::vector<struct chat_client *> *clients, size_t max)
+{
+	size_t count = 0;
+	while (count < max && !group->ready.empty()) {
+		struct chat_client *c = group->ready.front();
+		size_t n = chat_client_pop_batch(c, out, max - count);
+		clients->insert(clients->end(), n, c);
+		count += n;
+		if (!c->messages.empty())
+			break;
+		c->is_group_ready = false;
+		group->ready.pop_front();
+	}
+	return count;
 }
@@ -2,8 +2,11 @@
 
 #include <stdint.h>
 #include <string_view>
+#include <vector>
 
+struct chat_message;
 struct chat_client;
+struct chat_client_group;
 
 /**
  * Create a new chat client. No bind, no listen, just allocate and
@@ -17,7 +20,15 @@ void
 chat_client_delete(struct chat_client *client);
 
 /**
- * Try to connect to the given address.
+ * Try to connect to the given address. All the resolved addresses are
+ * tried, IPv4 and IPv6 in turn. The next one is tried when the previous
+ * ones fail or take longer than the attempt delay, without stopping
+ * them, and the first connected wins (Happy Eyeballs, RFC 8305).
+ *
+ * By default it returns when connected. In the async mode it returns
+ * once the attempts are started, and they go on in
+ * chat_client_update(). The messages can be fed meanwhile, they are sent
+ * when connected.
  *
  * @param client Chat client.
  * @param addr Address to connect to, like 'localhost:1234',
@@ -25,13 +36,121 @@ chat_client_delete(struct chat_client *client);
  *
  * @retval 0 Success.
  * @retval !=0 Error code.
- *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected or
+ *       connecting.
  *     - CHAT_ERR_NO_ADDR - the addr couldn't be resolved to any IP.
- *     - CHAT_ERR_SYS - a system error, check errno.
+ *     - CHAT_ERR_SYS - a system error, check errno. EPROTO - the TLS
+ *       handshake failed.
  */
 int
 chat_client_connect(struct chat_client *client, std::string_view addr);
 
+struct chat_client_connect_options {
+	/**
+	 * Return from chat_client_connect() at once. Then a failed connect
+	 * is reported by chat_client_update().
+	 */
+	bool is_async;
+	/**
+	 * Seconds to wait for an attempt before the next address is tried
+	 * too. 0 - 0.25, as RFC 8305 recommends.
+	 */
+	double attempt_delay;
+	/**
+	 * Seconds to reuse the resolved addresses of a host for, by all the
+	 * clients. 0 - resolve on each connect, the default. The addresses
+	 * are dropped from the cache if none of them could be connected to.
+	 */
+	double resolve_ttl;
+};
+
+/**
+ * Set how the client connects. Has to be called before connect.
+ *
+ * @param client Chat client.
+ * @param options New options.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - a negative value.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ */
+int
+chat_client_set_connect(struct chat_client *client,
+			const struct chat_client_connect_options *options);
+
+/**
+ * Switch the client to the binary framing. Each message is sent and
+ * received prefixed with its size instead of being terminated by '\n'.
+ * It is negotiated with the server right after connect, so has to be
+ * called before it.
+ *
+ * @param client Chat client.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ */
+int
+chat_client_set_binary(struct chat_client *client);
+
+/**
+ * Switch the client to the binary framing and ask the server to compress
+ * the messages it sends. A server without the compression sends them
+ * plain, so it works with any server. The messages sent by the client
+ * are not compressed. Has to be called before connect.
+ *
+ * @param client Chat client.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - built without zlib.
+ */
+int
+chat_client_set_compression(struct chat_client *client);
+
+/**
+ * Encrypt the connection with TLS. The handshake is done by OpenSSL in
+ * chat_client_connect(), and then the crypto is moved into the kernel
+ * (kTLS), so the messages are sent and received as without TLS. Has to be
+ * called before connect.
+ *
+ * @param client Chat client.
+ * @param ca_file PEM file with the certificates to verify the server
+ *     with, by the host name from the address. NULL - no verification,
+ *     only the encryption.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - no OpenSSL or no kTLS in the kernel.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the file can't be loaded.
+ *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
+ */
+int
+chat_client_set_tls(struct chat_client *client, const char *ca_file);
+
+/**
+ * Hold the fed messages for a while, so many small ones go out together
+ * in one send. By default everything is sent in the next update.
+ *
+ * While the output is held, the client doesn't want CHAT_EVENT_OUTPUT,
+ * and chat_client_update() sleeps no longer than till the end of the
+ * delay. An external event loop has to use chat_client_get_timeout() for
+ * that. Can be changed any time, applies to the next feeds.
+ *
+ * @param client Chat client.
+ * @param delay Max time in seconds the output is held for. 0 - no delay.
+ * @param size The output is sent right away once it is this big. 0 - no
+ *     limit, only the delay matters.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - a negative delay.
+ */
+int
+chat_client_set_flush(struct chat_client *client, double delay, size_t size);
+
 /**
  * Pop a next pending chat message. The returned message has to be
  * freed using chat_message_delete().
@@ -44,6 +163,22 @@ chat_client_connect(struct chat_client *client, std::string_view addr);
 struct chat_message *
 chat_client_pop_next(struct chat_client *client);
 
+/**
+ * Pop up to @a max pending chat messages at once. The messages are moved
+ * to the end of @a out. Unlike with chat_client_pop_next(), nothing is
+ * allocated per message, and a vector reused between the calls keeps its
+ * memory.
+ *
+ * @param client Chat client.
+ * @param out Vector to append the messages to.
+ * @param max Max number of messages to pop.
+ *
+ * @return Number of the popped messages.
+ */
+size_t
+chat_client_pop_batch(struct chat_client *client,
+		      std::vector<struct chat_message> *out, size_t max);
+
 /**
  * Wait for any update for the given timeout and do this update.
  *
@@ -54,7 +189,8 @@ chat_client_pop_next(struct chat_client *client);
  * @retval !=0 Error code.
  *     - CHAT_ERR_TIMEOUT - no updates, timed out.
  *     - CHAT_ERR_NOT_STARTED - the client is not connected yet.
- *     - CHAT_ERR_SYS - a system error, check errno.
+ *     - CHAT_ERR_SYS - a system error, check errno. Or an async
+ *       connect failed, then the client is not connected anymore.
  */
 int
 chat_client_update(struct chat_client *client, double timeout);
@@ -62,7 +198,8 @@ chat_client_update(struct chat_client *client, double timeout);
 /**
  * Get client's descriptor suitable for event loops like poll/epoll/kqueue. This
  * is useful when want to embed the client into some external event loop. For
- * example, to join it with reading stdin.
+ * example, to join it with reading stdin. During an async connect it is
+ * the socket of the newest attempt.
  *
  * @retval >=0 A valid descriptor.
  * @retval -1 No descriptor.
@@ -80,6 +217,18 @@ chat_client_get_descriptor(const struct chat_client *client);
 int
 chat_client_get_events(const struct chat_client *client);
 
+/**
+ * Get how long an external event loop can wait for the client's
+ * descriptor, before the held output has to be sent. Or, during an async
+ * connect, before the next attempt is due or the older attempts have to
+ * be checked.
+ *
+ * @retval >=0 Timeout in seconds. 0 means the output is due already.
+ * @retval -1 No output is held.
+ */
+double
+chat_client_get_timeout(const struct chat_client *client);
+
 /**
  * Feed a message to the client.
  *
@@ -94,3 +243,98 @@ chat_client_get_events(const struct chat_client *client);
 int
 chat_client_feed(struct chat_client *client, const char *msg,
 		 uint32_t msg_size);
+
+/**
+ * Feed one whole message in the binary mode. It is sent as is, with any
+ * bytes inside. The receivers in the text mode still get it cut by '\n'.
+ *
+ * @param client Chat client.
+ * @param msg Message.
+ * @param msg_size Size of the message. Empty messages are ignored.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the client is not in the binary mode.
+ *     - CHAT_ERR_NOT_STARTED - the client is not connected yet.
+ */
+int
+chat_client_feed_binary(struct chat_client *client, const char *msg,
+			uint32_t msg_size);
+
+/**
+ * Create a group of clients driven by one epoll, so one thread can keep
+ * many thousands of connections. The clients in a group are updated by
+ * chat_client_group_update() only, not by chat_client_update().
+ *
+ * @retval not-NULL A group.
+ * @retval NULL A system error, check errno.
+ */
+struct chat_client_group *
+chat_client_group_new(void);
+
+/** Remove all the clients from the group and free it. */
+void
+chat_client_group_delete(struct chat_client_group *group);
+
+/**
+ * Add a client to the group. It can be connected, connecting or not
+ * started yet. The connects in the async mode go on in the group
+ * updates. A client whose connect failed or whose connection broke
+ * stays in the group, with no descriptor, and can be connected again.
+ * A deleted client leaves its group itself.
+ *
+ * @param group Group.
+ * @param client Chat client.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the client is in a group already.
+ */
+int
+chat_client_group_add(struct chat_client_group *group,
+		      struct chat_client *client);
+
+/**
+ * Remove a client from the group. Then it can be updated on its own.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the client is not in this group.
+ */
+int
+chat_client_group_remove(struct chat_client_group *group,
+			 struct chat_client *client);
+
+/**
+ * Wait for any update of any client in the group for the given timeout,
+ * and do all the updates which are ready. The same as
+ * chat_client_update() does for each client, but with one epoll_wait().
+ *
+ * @param group Group.
+ * @param timeout Timeout in seconds to wait for.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_TIMEOUT - no updates, timed out.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int
+chat_client_group_update(struct chat_client_group *group, double timeout);
+
+/**
+ * Pop up to @a max pending messages of all the clients in the group,
+ * the clients which got them first go first. Works like
+ * chat_client_pop_batch(), and the receiving client of each message is
+ * appended to @a clients at the same position.
+ *
+ * @param group Group.
+ * @param out Vector to append the messages to.
+ * @param clients Vector to append the receivers of the messages to.
+ * @param max Max number of messages to pop.
+ *
+ * @return Number of the popped messages.
+ */
+size_t
+chat_client_group_pop_batch(struct chat_client_group *group,
+			    std::vector<struct chat_message> *out,
+			    std::vector<struct chat_client *> *clients, size_t max);
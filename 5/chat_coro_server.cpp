@@ -0,0 +1,430 @@
+#include "chat_coro_server.h"
+
+#include "chat.h"
+#include "corobus.h"
+#include "libcoro.h"
+#include "probe.h"
+#include "rlist.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+enum {
+	/** How many messages the slowest peer can be behind. */
+	CHAT_CORO_TOPIC_SIZE = 64 * 1024,
+	/** Free space ensured in the input buffer before each read. */
+	CHAT_CORO_READ_SIZE = 64 * 1024,
+	/**
+	 * The peers don't need much: the buffers are on the heap. Less
+	 * than the default, so the reserved memory per peer is small.
+	 */
+	CHAT_CORO_STACK_SIZE = 64 * 1024,
+};
+
+/** How often the acceptor checks for a stop. */
+static const uint64_t CHAT_CORO_STOP_CHECK_NS = 50 * 1000 * 1000;
+
+struct chat_coro_peer;
+
+/**
+ * Message in the topic. The topic carries only the slot numbers, so the
+ * text is stored once for all the peers.
+ */
+struct chat_coro_msg {
+	/** The text with the '\n', as it is sent. */
+	std::string data;
+	/** Not sent back to its author. */
+	struct chat_coro_peer *author;
+	/** Not NULL, then not a message: it stops the writer of the peer. */
+	struct chat_coro_peer *target;
+	/** Subscribers which haven't received it yet. */
+	size_t refs;
+};
+
+struct chat_coro_peer {
+	struct chat_coro_server *server;
+	int socket;
+	/** Subscriber of the topic, the writer receives from it. */
+	int sub;
+	/** Sends to the socket, while the peer coroutine reads. */
+	struct coro *writer;
+	/** The writer has failed or is stopped, and is unsubscribed. */
+	bool is_writer_done;
+	struct chat_input input;
+	/** Received from the topic, not sent yet. */
+	std::string output;
+	/** How much of the output is sent. */
+	size_t output_sent;
+	/** Link in the server's peers. */
+	struct rlist in_peers;
+};
+
+struct chat_coro_server {
+	int socket;
+	struct coro_bus *bus;
+	int topic;
+	/** Messages by the slots, NULL for the free ones. */
+	std::vector<struct chat_coro_msg *> msgs;
+	std::vector<unsigned> free_slots;
+	/** The topic subscribers, to know how many get each message. */
+	size_t sub_count;
+	struct rlist peers;
+	/** Finished peer coroutines, joined by the acceptor. */
+	std::vector<struct coro *> done;
+	struct coro *acceptor;
+	/** Read by the other threads. */
+	uint64_t peer_count;
+	bool is_stopped;
+	int rc;
+};
+
+struct chat_coro_server *
+chat_coro_server_new(void)
+{
+	struct chat_coro_server *server = new chat_coro_server();
+	server->socket = -1;
+	server->bus = NULL;
+	server->topic = -1;
+	server->sub_count = 0;
+	rlist_create(&server->peers);
+	server->acceptor = NULL;
+	server->peer_count = 0;
+	server->is_stopped = false;
+	server->rc = 0;
+	return server;
+}
+
+void
+chat_coro_server_delete(struct chat_coro_server *server)
+{
+	if (server->socket >= 0)
+		close(server->socket);
+	delete server;
+}
+
+int
+chat_coro_server_listen(struct chat_coro_server *server, uint16_t port)
+{
+	if (server->socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			  0);
+	if (sock < 0)
+		return CHAT_ERR_SYS;
+	int value = 1;
+	int rc = 0;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &value,
+		       sizeof(value)) != 0)
+		rc = CHAT_ERR_SYS;
+	else if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		rc = errno == EADDRINUSE ? CHAT_ERR_PORT_BUSY : CHAT_ERR_SYS;
+	else if (listen(sock, SOMAXCONN) != 0)
+		rc = CHAT_ERR_SYS;
+	if (rc != 0) {
+		int err = errno;
+		close(sock);
+		errno = err;
+		return rc;
+	}
+	server->socket = sock;
+	return 0;
+}
+
+int
+chat_coro_server_get_socket(const struct chat_coro_server *server)
+{
+	return server->socket;
+}
+
+void
+chat_coro_server_stop(struct chat_coro_server *server)
+{
+	__atomic_store_n(&server->is_stopped, true, __ATOMIC_RELEASE);
+}
+
+uint64_t
+chat_coro_server_peer_count(const struct chat_coro_server *server)
+{
+	return __atomic_load_n(&server->peer_count, __ATOMIC_RELAXED);
+}
+
+/** Drop one reference to the message, freeing it with the last one. */
+static void
+chat_coro_msg_unref(struct chat_coro_server *server, unsigned slot)
+{
+	struct chat_coro_msg *msg = server->msgs[slot];
+	if (--msg->refs > 0)
+		return;
+	delete msg;
+	server->msgs[slot] = NULL;
+	server->free_slots.push_back(slot);
+}
+
+/**
+ * Publish the message of the author, or a stop of the target's writer.
+ * Waits while the slowest peer is too far behind.
+ */
+static void
+chat_coro_publish(struct chat_coro_server *server,
+		  struct chat_coro_peer *author, struct chat_coro_peer *target,
+		  std::string_view data)
+{
+	struct chat_coro_msg *msg = new chat_coro_msg();
+	if (target == NULL) {
+		msg->data.reserve(data.size() + 1);
+		msg->data.assign(data);
+		msg->data.push_back('\n');
+	}
+	msg->author = author;
+	msg->target = target;
+	msg->refs = 0;
+	unsigned slot;
+	if (!server->free_slots.empty()) {
+		slot = server->free_slots.back();
+		server->free_slots.pop_back();
+		server->msgs[slot] = msg;
+	} else {
+		slot = server->msgs.size();
+		server->msgs.push_back(msg);
+	}
+	PROBE3(chat, broadcast, msg, msg->data.size(), server->sub_count);
+	int rc = coro_bus_topic_publish(server->bus, server->topic, slot);
+	/*
+	 * Counted after the wait: the subscribers which came or left
+	 * meanwhile are the ones of the publish moment, and the receivers
+	 * don't run before this coroutine yields.
+	 */
+	msg->refs = rc == 0 ? server->sub_count : 0;
+	if (msg->refs == 0) {
+		msg->refs = 1;
+		chat_coro_msg_unref(server, slot);
+	}
+}
+
+/**
+ * Take a message from the topic into the peer's output.
+ *
+ * @retval true Go on.
+ * @retval false It is the stop of this writer.
+ */
+static bool
+chat_coro_peer_take(struct chat_coro_peer *peer, unsigned slot)
+{
+	struct chat_coro_server *server = peer->server;
+	struct chat_coro_msg *msg = server->msgs[slot];
+	bool is_stop = msg->target == peer;
+	if (msg->target == NULL && msg->author != peer)
+		peer->output.append(msg->data);
+	chat_coro_msg_unref(server, slot);
+	return !is_stop;
+}
+
+/**
+ * Send the output, waiting for the socket to have space.
+ *
+ * @retval 0 All is sent.
+ * @retval -1 The socket is broken or closed.
+ */
+static int
+chat_coro_peer_flush(struct chat_coro_peer *peer)
+{
+	while (peer->output_sent < peer->output.size()) {
+		ssize_t rc = send(peer->socket,
+				  peer->output.data() + peer->output_sent,
+				  peer->output.size() - peer->output_sent,
+				  MSG_NOSIGNAL);
+		if (rc >= 0) {
+			peer->output_sent += rc;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
+		if (coro_io_wait(peer->socket, CORO_IO_WRITE) < 0)
+			return -1;
+	}
+	peer->output.clear();
+	peer->output_sent = 0;
+	return 0;
+}
+
+/**
+ * Writer of a peer: everything from the topic except the peer's own
+ * messages goes to the socket. All the messages received by then are
+ * sent at once.
+ */
+static void *
+chat_coro_writer_f(void *arg)
+{
+	struct chat_coro_peer *peer = (struct chat_coro_peer *)arg;
+	struct chat_coro_server *server = peer->server;
+	unsigned slot;
+	while (true) {
+		if (coro_bus_topic_recv(server->bus, server->topic, peer->sub,
+					&slot) != 0 ||
+		    !chat_coro_peer_take(peer, slot))
+			break;
+		bool is_stop = false;
+		while (!is_stop && coro_bus_topic_try_recv(server->bus,
+			server->topic, peer->sub, &slot) == 0)
+			is_stop = !chat_coro_peer_take(peer, slot);
+		if (is_stop || chat_coro_peer_flush(peer) != 0)
+			break;
+	}
+	peer->is_writer_done = true;
+	/* Wakes the reader up, if the socket broke on a write. */
+	shutdown(peer->socket, SHUT_RDWR);
+	/* The unread messages must not wait for this peer anymore. */
+	while (coro_bus_topic_try_recv(server->bus, server->topic, peer->sub,
+				       &slot) == 0)
+		chat_coro_msg_unref(server, slot);
+	coro_bus_topic_unsubscribe(server->bus, server->topic, peer->sub);
+	--server->sub_count;
+	return NULL;
+}
+
+/**
+ * Reader of a peer, and its owner: cuts the received data into messages
+ * and publishes them. When the peer is gone, stops the writer and frees
+ * the peer.
+ */
+static void *
+chat_coro_peer_f(void *arg)
+{
+	struct chat_coro_peer *peer = (struct chat_coro_peer *)arg;
+	struct chat_coro_server *server = peer->server;
+	struct chat_input *in = &peer->input;
+	while (true) {
+		chat_input_reserve(in, CHAT_CORO_READ_SIZE);
+		ssize_t rc = recv(peer->socket, in->data + in->size,
+				  in->capacity - in->size, 0);
+		if (rc == 0)
+			break;
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				break;
+			if (coro_io_wait(peer->socket, CORO_IO_READ) < 0)
+				break;
+			continue;
+		}
+		in->size += rc;
+		std::string_view data;
+		while (chat_input_pop(in, &data))
+			chat_coro_publish(server, peer, NULL, data);
+	}
+	/* Also wakes the writer up if it waits for the socket. */
+	shutdown(peer->socket, SHUT_RDWR);
+	if (!peer->is_writer_done)
+		chat_coro_publish(server, NULL, peer, std::string_view());
+	coro_join(peer->writer);
+
+	rlist_del(&peer->in_peers);
+	close(peer->socket);
+	delete peer;
+	__atomic_sub_fetch(&server->peer_count, 1, __ATOMIC_RELAXED);
+	server->done.push_back(coro_this());
+	coro_wakeup(server->acceptor);
+	return NULL;
+}
+
+static void
+chat_coro_server_add_peer(struct chat_coro_server *server, int sock)
+{
+	PROBE1(chat, peer__accept, sock);
+	struct chat_coro_peer *peer = new chat_coro_peer();
+	peer->server = server;
+	peer->socket = sock;
+	/* Subscribed right away, so it gets all the messages from now on. */
+	peer->sub = coro_bus_topic_subscribe(server->bus, server->topic);
+	++server->sub_count;
+	peer->is_writer_done = false;
+	peer->input.is_checked = true;
+	peer->output_sent = 0;
+	rlist_add_tail(&server->peers, &peer->in_peers);
+	__atomic_add_fetch(&server->peer_count, 1, __ATOMIC_RELAXED);
+	peer->writer = coro_new_ex(chat_coro_writer_f, peer,
+				   CHAT_CORO_STACK_SIZE);
+	coro_new_ex(chat_coro_peer_f, peer, CHAT_CORO_STACK_SIZE);
+}
+
+/** Join the finished peer coroutines. */
+static void
+chat_coro_server_reap(struct chat_coro_server *server)
+{
+	while (!server->done.empty()) {
+		struct coro *c = server->done.back();
+		server->done.pop_back();
+		coro_join(c);
+	}
+}
+
+/**
+ * Accept the clients until the stop, then disconnect all of them and
+ * wait for their coroutines to end.
+ */
+static void *
+chat_coro_acceptor_f(void *arg)
+{
+	struct chat_coro_server *server = (struct chat_coro_server *)arg;
+	while (!__atomic_load_n(&server->is_stopped, __ATOMIC_ACQUIRE)) {
+		int sock = accept4(server->socket, NULL, NULL,
+				   SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock >= 0) {
+			chat_coro_server_add_peer(server, sock);
+			continue;
+		}
+		if (errno == EINTR || errno == ECONNABORTED)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			server->rc = CHAT_ERR_SYS;
+			break;
+		}
+		chat_coro_server_reap(server);
+		coro_io_wait_timeout(server->socket, CORO_IO_READ,
+				     CHAT_CORO_STOP_CHECK_NS);
+	}
+	struct chat_coro_peer *peer;
+	rlist_foreach_entry(peer, &server->peers, in_peers)
+		shutdown(peer->socket, SHUT_RDWR);
+	while (!rlist_empty(&server->peers)) {
+		chat_coro_server_reap(server);
+		coro_suspend();
+	}
+	chat_coro_server_reap(server);
+	return NULL;
+}
+
+int
+chat_coro_server_run(struct chat_coro_server *server)
+{
+	if (server->socket < 0)
+		return CHAT_ERR_NOT_STARTED;
+	server->rc = 0;
+	coro_sched_init();
+	server->bus = coro_bus_new();
+	server->topic = coro_bus_channel_open_topic(server->bus,
+						    CHAT_CORO_TOPIC_SIZE);
+	server->acceptor = coro_new(chat_coro_acceptor_f, server);
+	coro_sched_run();
+	coro_join(server->acceptor);
+	server->acceptor = NULL;
+	coro_bus_delete(server->bus);
+	server->bus = NULL;
+	server->topic = -1;
+	coro_sched_destroy();
+	__atomic_store_n(&server->is_stopped, false, __ATOMIC_RELAXED);
+	return server->rc;
+}
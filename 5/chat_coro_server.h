@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Chat server on the coroutines of libcoro, an alternative to the state
+ * machine of chat_server.h with the same text protocol. Each peer is a
+ * coroutine reading its socket linearly and publishing the messages into
+ * a corobus topic, and another one sending to the socket what it gets
+ * from the topic. The sockets are waited for with coro_io_wait().
+ *
+ * Served by one thread which calls chat_coro_server_run(). Only the text
+ * messages: no binary framing, rooms, history, TLS, nor the limits. A
+ * slow reader holds the others back once it is the topic size behind,
+ * instead of being dropped.
+ *
+ * The server owns the libcoro scheduler while running, so nothing else
+ * in the process can use libcoro meanwhile.
+ */
+struct chat_coro_server;
+
+/** Create a new server, not listening yet. */
+struct chat_coro_server *
+chat_coro_server_new(void);
+
+/** Free the server. It must be not running. */
+void
+chat_coro_server_delete(struct chat_coro_server *server);
+
+/**
+ * Listen for new clients on the given port, 0 for any free one.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_PORT_BUSY - the port is already busy.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int
+chat_coro_server_listen(struct chat_coro_server *server, uint16_t port);
+
+/** Listening socket, or -1 if not listening. */
+int
+chat_coro_server_get_socket(const struct chat_coro_server *server);
+
+/**
+ * Serve the clients until chat_coro_server_stop(). Then all the peers
+ * are disconnected, and the server can be deleted.
+ *
+ * @retval 0 Stopped.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_NOT_STARTED - the server is not listening.
+ *     - CHAT_ERR_SYS - accept failed, check errno.
+ */
+int
+chat_coro_server_run(struct chat_coro_server *server);
+
+/**
+ * Make chat_coro_server_run() return soon. Can be called from any
+ * thread and from a signal handler.
+ */
+void
+chat_coro_server_stop(struct chat_coro_server *server);
+
+/** Number of the connected peers. Can be called from any thread. */
+uint64_t
+chat_coro_server_peer_count(const struct chat_coro_server *server);
@@ -0,0 +1,145 @@
+#include "chat_deflate.h"
+
+#if CHAT_HAVE_ZLIB
+
+#include <algorithm>
+#include <zlib.h>
+
+/**
+ * Streams of the thread, made once and reset per message. An init
+ * allocates and zeroes a few hundred KB, more than a short message
+ * costs to compress.
+ */
+struct chat_deflate_streams {
+	z_stream deflater = {};
+	z_stream inflater = {};
+	/** Level of the deflater, 0 if it is not made yet. */
+	int level = 0;
+	bool has_inflater = false;
+
+	~chat_deflate_streams()
+	{
+		if (level != 0)
+			deflateEnd(&deflater);
+		if (has_inflater)
+			inflateEnd(&inflater);
+	}
+};
+
+static thread_local struct chat_deflate_streams chat_deflate_streams;
+
+bool
+chat_deflate_is_supported(void)
+{
+	return true;
+}
+
+/** Negative window bits mean raw deflate, without a header or a sum. */
+static const int chat_deflate_window_bits = -15;
+
+void
+chat_deflate_encode(std::string_view data, int level, std::string *out)
+{
+	struct chat_deflate_streams *s = &chat_deflate_streams;
+	out->clear();
+	if (level != s->level) {
+		if (s->level != 0)
+			deflateEnd(&s->deflater);
+		s->deflater = {};
+		s->level = 0;
+		if (level > 0 &&
+		    deflateInit2(&s->deflater, level, Z_DEFLATED,
+				 chat_deflate_window_bits, 8,
+				 Z_DEFAULT_STRATEGY) == Z_OK)
+			s->level = level;
+	} else if (s->level != 0) {
+		deflateReset(&s->deflater);
+	}
+	if (s->level != 0 && !data.empty()) {
+		/* Not bigger than the stored data, or it is stored. */
+		out->resize(data.size() + 1);
+		(*out)[0] = CHAT_DEFLATE_DEFLATED;
+		s->deflater.next_in = (Bytef *)data.data();
+		s->deflater.avail_in = data.size();
+		s->deflater.next_out = (Bytef *)&(*out)[1];
+		s->deflater.avail_out = data.size() - 1;
+		if (deflate(&s->deflater, Z_FINISH) == Z_STREAM_END) {
+			out->resize(data.size() - s->deflater.avail_out);
+			return;
+		}
+	}
+	out->resize(data.size() + 1);
+	(*out)[0] = CHAT_DEFLATE_STORED;
+	data.copy(&(*out)[1], data.size());
+}
+
+int
+chat_deflate_decode(std::string_view payload, std::string *out)
+{
+	out->clear();
+	if (payload.empty())
+		return -1;
+	char codec = payload[0];
+	payload.remove_prefix(1);
+	if (codec == CHAT_DEFLATE_STORED) {
+		out->assign(payload);
+		return 0;
+	}
+	if (codec != CHAT_DEFLATE_DEFLATED)
+		return -1;
+	struct chat_deflate_streams *s = &chat_deflate_streams;
+	if (!s->has_inflater) {
+		if (inflateInit2(&s->inflater, chat_deflate_window_bits) != Z_OK)
+			return -1;
+		s->has_inflater = true;
+	} else {
+		inflateReset(&s->inflater);
+	}
+	s->inflater.next_in = (Bytef *)payload.data();
+	s->inflater.avail_in = payload.size();
+	size_t size = 0;
+	while (true) {
+		/* Text compresses a few times, start with that. */
+		out->resize(std::max({out->size() * 2, payload.size() * 4,
+				      (size_t)256}));
+		s->inflater.next_out = (Bytef *)&(*out)[size];
+		s->inflater.avail_out = out->size() - size;
+		int rc = inflate(&s->inflater, Z_FINISH);
+		size = out->size() - s->inflater.avail_out;
+		if (rc == Z_STREAM_END)
+			break;
+		/* Only the lack of the space is fine, the rest is broken. */
+		if ((rc != Z_OK && rc != Z_BUF_ERROR) ||
+		    s->inflater.avail_out != 0)
+			return -1;
+	}
+	out->resize(size);
+	return 0;
+}
+
+#else /* !CHAT_HAVE_ZLIB */
+
+bool
+chat_deflate_is_supported(void)
+{
+	return false;
+}
+
+void
+chat_deflate_encode(std::string_view data, int level, std::string *out)
+{
+	(void)level;
+	out->assign(1, CHAT_DEFLATE_STORED);
+	out->append(data);
+}
+
+int
+chat_deflate_decode(std::string_view payload, std::string *out)
+{
+	if (payload.empty() || payload[0] != CHAT_DEFLATE_STORED)
+		return -1;
+	out->assign(payload.substr(1));
+	return 0;
+}
+
+#endif /* !CHAT_HAVE_ZLIB */
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+/**
+ * Compression of the single messages with the raw deflate of zlib. Each
+ * message is compressed on its own, with no window shared with the
+ * previous ones, so the server compresses a broadcast once for all the
+ * peers, no matter which messages each of them got before.
+ *
+ * A compressed frame's payload is a codec byte followed by the data.
+ * The messages which don't get smaller are stored as is.
+ *
+ * Without zlib at build time nothing is supported.
+ */
+enum {
+	CHAT_DEFLATE_STORED = 0,
+	CHAT_DEFLATE_DEFLATED = 1,
+	/** Max level, like in zlib. 0 means no compression. */
+	CHAT_DEFLATE_MAX_LEVEL = 9,
+};
+
+/** Check if the library is built with zlib. */
+bool
+chat_deflate_is_supported(void);
+
+/**
+ * Make the payload of a compressed frame.
+ *
+ * @param data Message.
+ * @param level Compression level, 1 - fastest, 9 - smallest, 0 - the
+ *     data is stored.
+ * @param[out] out Payload, replaced.
+ */
+void
+chat_deflate_encode(std::string_view data, int level, std::string *out);
+
+/**
+ * Get the message out of the payload of a compressed frame.
+ *
+ * @param payload Payload.
+ * @param[out] out Message, replaced.
+ *
+ * @retval 0 Success.
+ * @retval -1 The payload is broken.
+ */
+int
+chat_deflate_decode(std::string_view payload, std::string *out);
@@ -1,129 +1,2362 @@
 #include "chat.h"
+#include "chat_deflate.h"
 #include "chat_server.h"
+#include "chat_tls.h"
+#include "chat_uring.h"
+#include "probe.h"
+#include "rlist.h"
 
+#include <algorithm>
+#include <assert.h>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/errqueue.h>
+#include <mutex>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <unordered_map>
+
+enum {
+	/** Max number of events taken from epoll in one update. */
+	CHAT_SERVER_EVENT_BATCH = 256,
+	/** Min free space in a peer's input buffer for a single read. */
+	CHAT_SERVER_READ_SIZE = 64 * 1024,
+	/** Max number of slabs sent in one call. */
+	CHAT_SERVER_IOV_COUNT = IOV_MAX,
+	/** Size of the io_uring submission queue. */
+	CHAT_SERVER_URING_ENTRIES = 1024,
+	/** Number and size of the buffers io_uring receives into. */
+	CHAT_SERVER_URING_BUF_COUNT = 128,
+	CHAT_SERVER_URING_BUF_SIZE = 16 * 1024,
+	/** Max wait for the zerocopy sends to complete in a handoff. */
+	CHAT_SERVER_HANDOFF_ZEROCOPY_WAIT_MS = 1000,
+};
+
+/**
+ * Operation in io_uring. Stored in the low bits of the completion's user
+ * data, the rest is the peer if any.
+ */
+enum chat_op {
+	CHAT_OP_ACCEPT,
+	CHAT_OP_INBOX,
+	CHAT_OP_RECV,
+	CHAT_OP_SEND,
+	CHAT_OP_SHUTDOWN,
+	/** Giving a receive buffer back. Completes only on errors. */
+	CHAT_OP_BUFS,
+	CHAT_OP_MASK = 7,
+};
+
+enum chat_peer_mode {
+	/** Nothing is received yet. */
+	CHAT_PEER_MODE_UNKNOWN,
+	/** Messages are separated by '\n'. */
+	CHAT_PEER_MODE_TEXT,
+	/** Messages are prefixed with their varint size. */
+	CHAT_PEER_MODE_BINARY,
+	/**
+	 * Binary, but the messages going to the peer are compressed. What
+	 * it sends is the same as in the binary mode.
+	 */
+	CHAT_PEER_MODE_DEFLATE,
+};
+
+/**
+ * A message being broadcast. It is stored once and referenced from the
+ * output queues of all the receivers, in all the shards.
+ */
+struct chat_slab {
+	/**
+	 * Number of the output queues and shard inboxes still having this
+	 * slab. Can be dropped by any shard, so is accessed atomically.
+	 */
+	int ref_count;
+	/** Message with its trailing '\n', ready to be sent as is. */
+	std::string data;
+	/**
+	 * Varint size of the message for the binary peers. They get it
+	 * followed by the data without the '\n'.
+	 */
+	char header[CHAT_VARINT_MAX_SIZE];
+	uint8_t header_size;
+	/**
+	 * Compressed payload for the deflate peers and its varint size.
+	 * Made by the first shard which needs it, the others reuse it.
+	 */
+	std::string deflated;
+	char deflated_header[CHAT_VARINT_MAX_SIZE];
+	uint8_t deflated_header_size;
+	std::once_flag deflate_once;
+	/** The data is sent as is to all the peers. Not a message. */
+	bool is_raw;
+	/**
+	 * Room the message is posted to, when the rooms are enabled. A
+	 * message of a peer without rooms is not broadcast, but still goes
+	 * to shard 0 to be popped.
+	 */
+	std::string room;
+	bool has_room;
+};
+
+/** Create a slab for a message with one reference. */
+static struct chat_slab *
+chat_slab_new(std::string_view payload)
+{
+	struct chat_slab *slab = new chat_slab();
+	slab->ref_count = 1;
+	slab->data.reserve(payload.size() + 1);
+	slab->data.append(payload);
+	slab->data.push_back('\n');
+	slab->header_size = chat_varint_encode(payload.size(), slab->header);
+	slab->is_raw = false;
+	slab->has_room = false;
+	return slab;
+}
+
+/** Create a slab sent as is to any peer, with one reference. */
+static struct chat_slab *
+chat_slab_new_raw(std::string_view data)
+{
+	struct chat_slab *slab = new chat_slab();
+	slab->ref_count = 1;
+	slab->data.assign(data);
+	slab->header_size = 0;
+	slab->is_raw = true;
+	slab->has_room = false;
+	return slab;
+}
+
+/** Check if the slab goes to a peer in the given mode with no framing. */
+static bool
+chat_slab_is_plain(const struct chat_slab *slab, enum chat_peer_mode mode)
+{
+	return slab->is_raw || mode == CHAT_PEER_MODE_UNKNOWN ||
+	       mode == CHAT_PEER_MODE_TEXT;
+}
+
+/**
+ * Get the frame of a slab for a binary or a deflate peer. For the latter
+ * the slab has to be compressed already.
+ */
+static void
+chat_slab_frame(const struct chat_slab *slab, enum chat_peer_mode mode,
+		std::string_view *header, std::string_view *payload)
+{
+	if (mode == CHAT_PEER_MODE_DEFLATE) {
+		*header = std::string_view(slab->deflated_header,
+					   slab->deflated_header_size);
+		*payload = slab->deflated;
+		return;
+	}
+	*header = std::string_view(slab->header, slab->header_size);
+	*payload = std::string_view(slab->data.data(), slab->data.size() - 1);
+}
+
+/** Size of the slab on the wire for a peer in the given mode. */
+static size_t
+chat_slab_wire_size(const struct chat_slab *slab, enum chat_peer_mode mode)
+{
+	if (chat_slab_is_plain(slab, mode))
+		return slab->data.size();
+	std::string_view header, payload;
+	chat_slab_frame(slab, mode, &header, &payload);
+	return header.size() + payload.size();
+}
+
+/**
+ * Fill the vectors to send the slab to a peer in the given mode, skipping
+ * the first @a offset bytes.
+ *
+ * @return Number of the used vectors, 1 or 2.
+ */
+static int
+chat_slab_fill_iov(const struct chat_slab *slab, enum chat_peer_mode mode,
+		   size_t offset, struct iovec *iov)
+{
+	if (chat_slab_is_plain(slab, mode)) {
+		iov[0].iov_base = (char *)slab->data.data() + offset;
+		iov[0].iov_len = slab->data.size() - offset;
+		return 1;
+	}
+	std::string_view header, payload;
+	chat_slab_frame(slab, mode, &header, &payload);
+	if (offset >= header.size()) {
+		offset -= header.size();
+		iov[0].iov_base = (char *)payload.data() + offset;
+		iov[0].iov_len = payload.size() - offset;
+		return 1;
+	}
+	iov[0].iov_base = (char *)header.data() + offset;
+	iov[0].iov_len = header.size() - offset;
+	iov[1].iov_base = (char *)payload.data();
+	iov[1].iov_len = payload.size();
+	return 2;
+}
+
+static void
+chat_slab_ref(struct chat_slab *slab, int count)
+{
+	__atomic_add_fetch(&slab->ref_count, count, __ATOMIC_RELAXED);
+}
+
+static void
+chat_slab_unref(struct chat_slab *slab)
+{
+	if (__atomic_sub_fetch(&slab->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+		delete slab;
+}
+
+/**
+ * A slab referenced by a zerocopy send. The kernel reads the slab's
+ * memory until the send is completed.
+ */
+struct chat_zerocopy_ref {
+	/** Number of the zerocopy send on the socket. */
+	uint32_t seq;
+	struct chat_slab *slab;
+};
+
+/** A slab sent from one shard to another. */
+struct chat_post {
+	struct chat_slab *slab;
+	/** Next post in the inbox. */
+	struct chat_post *next;
+};
+
+/** Update a statistic having a single writer and concurrent readers. */
+static void
+chat_stat_add(uint64_t *stat, int64_t delta)
+{
+	__atomic_store_n(stat, *stat + delta, __ATOMIC_RELAXED);
+}
+
+struct chat_room;
+
+/** A peer being a member of a room. */
+struct chat_membership {
+	struct chat_room *room;
+	/** Index of the peer in the room's members. */
+	size_t index;
+};
 
 struct chat_peer {
 	/** Client's socket. To read/write messages. */
 	int socket;
-	/** Output buffer. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	/** Framing, chosen by the first received byte. */
+	enum chat_peer_mode mode;
+	/**
+	 * Number of the first slabs in the output queue to send as text
+	 * even in the binary mode. They were queued before the peer switched
+	 * to it.
+	 */
+	size_t text_count;
+	/** Input buffer. */
+	struct chat_input input;
+	/** Output queue. */
+	std::deque<struct chat_slab *> output;
+	/** How much of the first slab in the output queue is already sent. */
+	size_t output_sent;
+	/** Not yet sent size of the output queue, as it goes on the wire. */
+	size_t output_size;
+	/**
+	 * The output went above the high mark. New messages are dropped for
+	 * this peer until the output goes down to the low mark.
+	 */
+	bool is_lagging;
+	/**
+	 * The socket had space in its send buffer the last time it was
+	 * used. With the edge-triggered epoll the socket is reported
+	 * writable again only after it was full.
+	 */
+	bool is_writable;
+	/**
+	 * Number of the io_uring operations referencing the peer. The peer
+	 * can't be freed until they are completed.
+	 */
+	int op_count;
+	/** A send is in io_uring. */
+	bool is_sending;
+	/**
+	 * The peer is deleted, but still has operations in io_uring. It is
+	 * freed with the last one.
+	 */
+	bool is_closed;
+	/**
+	 * Slabs of the zerocopy sends not completed yet, by the send
+	 * numbers. Each holds a reference, released by the completion from
+	 * the socket's error queue.
+	 */
+	std::deque<struct chat_zerocopy_ref> zerocopy_refs;
+	/** Number of the next zerocopy send of the socket. */
+	uint32_t zerocopy_seq;
+	/**
+	 * The kernel has copied the data of a zerocopy send anyway, like
+	 * on loopback. It would do so again, for the pinning cost. So the
+	 * peer gets the usual sends from now on.
+	 */
+	bool is_zerocopy_copied;
+	/** Message of the send in io_uring, with the vectors. */
+	struct msghdr send_msg;
+	std::vector<struct iovec> send_iov;
+	/** When the peer is disconnected if nothing is received. */
+	double idle_deadline;
+	/** When the peer is pinged if nothing is received. */
+	double ping_deadline;
+	/** Links in the shard's queues ordered by the deadlines. */
+	struct rlist in_idle;
+	struct rlist in_ping;
+	/**
+	 * TLS handshake in progress. The peer is not in the shard's peers
+	 * until it is done, and gets no messages.
+	 */
+	struct chat_tls *tls;
+	/** Rooms of the peer in the order of joining. Posts go to the last. */
+	std::vector<struct chat_membership> rooms;
+	/**
+	 * Link in the shard's list of all peers. Or of the closed ones
+	 * waiting for their operations.
+	 */
+	struct rlist in_peers;
+	/** Link in the shard's list of peers to flush. */
+	struct rlist in_flush;
 };
 
-struct chat_server {
+/**
+ * Members of a room in one shard. A vector, so a broadcast is a plain walk
+ * over an array. The other shards have their own members of the same
+ * room.
+ */
+struct chat_room {
+	std::string name;
+	std::vector<struct chat_peer *> members;
+};
+
+static uint64_t
+chat_op_data(struct chat_peer *peer, enum chat_op op)
+{
+	return (uint64_t)(uintptr_t)peer | op;
+}
+
+/**
+ * A part of the server with its own listening socket, epoll and peers.
+ * It is served by one thread and shares nothing with the other shards
+ * except the inboxes. Shard 0 is served by the thread calling
+ * chat_server_update().
+ */
+struct chat_shard {
+	/** Server owning the shard. */
+	struct chat_server *server;
 	/** Listening socket. To accept new clients. */
 	int socket = -1;
-	/** Array of peers. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	/** Epoll descriptor with the listening socket and all the peers. */
+	int epoll = -1;
+	/**
+	 * Eventfd signaled when the inbox becomes not empty. Only when there
+	 * are multiple shards.
+	 */
+	int inbox_fd = -1;
+	/**
+	 * Stack of the slabs posted by the other shards, the newest first.
+	 * Pushed by any thread, taken all at once by the owner.
+	 */
+	struct chat_post *inbox = NULL;
+	/** List of all peers. */
+	struct rlist peers;
+	/** Number of peers in the list. */
+	int peer_count = 0;
+	/**
+	 * Peers having new output and a writable socket. They are flushed
+	 * in the end of the update, so many messages broadcast during one
+	 * update are sent with one send() per peer.
+	 */
+	struct rlist flush_queue;
+	/** Number of peers with a non-empty output queue. */
+	int output_peer_count = 0;
+	/**
+	 * Peers ordered by the idle and ping deadlines. All the peers have
+	 * the same timeouts, so a peer with a new deadline just goes to the
+	 * tail, and only the heads can be expired.
+	 */
+	struct rlist idle_queue;
+	struct rlist ping_queue;
+	/** Time of the last wakeup. Only updated when there are timeouts. */
+	double now = 0;
+	/** Peers in the middle of the TLS handshake. */
+	struct rlist handshakes;
+	/** Rooms having members in this shard, by name. */
+	std::unordered_map<std::string, struct chat_room *> rooms;
+	/**
+	 * Ring of the last messages, each shard has all of them. The slabs
+	 * are shared with the other shards and the output queues.
+	 */
+	std::vector<struct chat_slab *> history;
+	/** Position of the oldest message once the ring is full. */
+	size_t history_pos = 0;
+	/**
+	 * Statistics of this shard. Updated only by the owner, but can be
+	 * read by other threads, so the updates are atomic.
+	 */
+	struct chat_server_stats stats = {};
+	/** The listening socket has SO_ZEROCOPY, inherited by the peers. */
+	bool is_zerocopy = false;
+	/** Thread serving the shard. Not used for shard 0. */
+	pthread_t thread;
+	/** Used instead of the epoll with the io_uring backend. */
+	struct chat_uring ring;
+	/** Buffers to receive into, taken by the ring on demand. */
+	struct chat_uring_bufs bufs;
+	/**
+	 * Eventfd signaled on each completion of the ring. Only for shard 0,
+	 * to be its descriptor.
+	 */
+	int ring_event_fd = -1;
+	/** Counter of the inbox eventfd, read by the ring. */
+	uint64_t inbox_value = 0;
+	/** Peers deleted but still having operations in the ring. */
+	struct rlist zombies;
+	/** The shard is being closed and waits for the zombies. */
+	bool is_closing = false;
+};
+
+struct chat_server {
+	/** Shards, at least one. */
+	struct chat_shard *shards;
+	int shard_count;
+	/** The shards' threads are started. */
+	bool is_started = false;
+	/** The shards' threads have to exit. */
+	bool is_stopped = false;
+	/** Output limits of each peer. */
+	struct chat_server_limits limits = {};
+	/** Options of the sockets. */
+	struct chat_server_options options = {};
+	struct chat_server_timeouts timeouts = {};
+	/** TLS of all the connections, if set. */
+	struct chat_tls_ctx *tls_ctx = NULL;
+	/** Messages go only to the members of their rooms. */
+	bool is_rooms = false;
+	/** Max number of messages in the history. */
+	size_t history_size = 0;
+	/** Compression level for the deflate peers, 0 - no compression. */
+	int deflate_level = 0;
+	enum chat_server_backend backend = CHAT_SERVER_BACKEND_EPOLL;
+	/**
+	 * Received messages not yet popped. Only touched by shard 0. Stored
+	 * by value, so a batch pop moves them out without any allocations.
+	 */
+	std::deque<struct chat_message> messages;
 };
 
 struct chat_server *
 chat_server_new(void)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	return new chat_server();
+	return chat_server_new_ex(1);
+}
+
+struct chat_server *
+chat_server_new_ex(int thread_count)
+{
+	if (thread_count < 1 || thread_count > CHAT_SERVER_MAX_THREADS)
+		return NULL;
+	struct chat_server *server = new chat_server();
+	server->shard_count = thread_count;
+	server->shards = new chat_shard[thread_count];
+	for (int i = 0; i < thread_count; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+		shard->server = server;
+		rlist_create(&shard->peers);
+		rlist_create(&shard->flush_queue);
+		rlist_create(&shard->zombies);
+		rlist_create(&shard->idle_queue);
+		rlist_create(&shard->ping_queue);
+		rlist_create(&shard->handshakes);
+	}
+	return server;
+}
+
+static bool
+chat_shard_is_uring(const struct chat_shard *shard)
+{
+	return shard->server->backend == CHAT_SERVER_BACKEND_URING;
+}
+
+static void
+chat_peer_free(struct chat_peer *peer)
+{
+	for (struct chat_slab *slab : peer->output)
+		chat_slab_unref(slab);
+	if (!peer->zerocopy_refs.empty()) {
+		/*
+		 * The kernel still can send from the slabs, which are reused
+		 * once released. The reset drops the socket's data at once.
+		 */
+		struct linger lg = {1, 0};
+		setsockopt(peer->socket, SOL_SOCKET, SO_LINGER, &lg,
+			   sizeof(lg));
+		for (const struct chat_zerocopy_ref &ref : peer->zerocopy_refs)
+			chat_slab_unref(ref.slab);
+	}
+	close(peer->socket);
+	delete peer;
+}
+
+/** Drop an operation reference of the peer and free it if closed. */
+static void
+chat_peer_release(struct chat_peer *peer)
+{
+	assert(peer->op_count > 0);
+	if (--peer->op_count > 0 || !peer->is_closed)
+		return;
+	rlist_del(&peer->in_peers);
+	chat_peer_free(peer);
+}
+
+/** Make the peer a member of the room, and the room its current one. */
+static void
+chat_peer_join(struct chat_shard *shard, struct chat_peer *peer,
+	       std::string_view name)
+{
+	for (size_t i = 0; i < peer->rooms.size(); ++i) {
+		if (peer->rooms[i].room->name != name)
+			continue;
+		struct chat_membership m = peer->rooms[i];
+		peer->rooms.erase(peer->rooms.begin() + i);
+		peer->rooms.push_back(m);
+		return;
+	}
+	struct chat_room *&room = shard->rooms[std::string(name)];
+	if (room == NULL) {
+		room = new chat_room();
+		room->name = name;
+	}
+	peer->rooms.push_back({room, room->members.size()});
+	room->members.push_back(peer);
+}
+
+/** Drop the peer's membership number @a i. */
+static void
+chat_peer_leave_at(struct chat_shard *shard, struct chat_peer *peer,
+		   size_t i)
+{
+	struct chat_room *room = peer->rooms[i].room;
+	size_t index = peer->rooms[i].index;
+	peer->rooms.erase(peer->rooms.begin() + i);
+	/* The last member takes the place, its index has to be fixed. */
+	struct chat_peer *last = room->members.back();
+	room->members[index] = last;
+	room->members.pop_back();
+	if (last != peer) {
+		for (struct chat_membership &m : last->rooms) {
+			if (m.room == room) {
+				m.index = index;
+				break;
+			}
+		}
+	}
+	if (room->members.empty()) {
+		shard->rooms.erase(room->name);
+		delete room;
+	}
+}
+
+static void
+chat_peer_leave(struct chat_shard *shard, struct chat_peer *peer,
+		std::string_view name)
+{
+	for (size_t i = 0; i < peer->rooms.size(); ++i) {
+		if (peer->rooms[i].room->name == name) {
+			chat_peer_leave_at(shard, peer, i);
+			return;
+		}
+	}
+}
+
+static void
+chat_peer_delete(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (peer->tls != NULL) {
+		/* Not counted anywhere yet. Never with io_uring. */
+		rlist_del(&peer->in_peers);
+		rlist_del(&peer->in_idle);
+		rlist_del(&peer->in_ping);
+		chat_tls_delete(peer->tls);
+		epoll_ctl(shard->epoll, EPOLL_CTL_DEL, peer->socket, NULL);
+		chat_peer_free(peer);
+		return;
+	}
+	while (!peer->rooms.empty())
+		chat_peer_leave_at(shard, peer, peer->rooms.size() - 1);
+	rlist_del(&peer->in_peers);
+	--shard->peer_count;
+	chat_stat_add(&shard->stats.peer_count, -1);
+	if (peer->is_lagging)
+		chat_stat_add(&shard->stats.lagging_count, -1);
+	rlist_del(&peer->in_flush);
+	rlist_del(&peer->in_idle);
+	rlist_del(&peer->in_ping);
+	if (!peer->output.empty())
+		--shard->output_peer_count;
+	if (!chat_shard_is_uring(shard)) {
+		epoll_ctl(shard->epoll, EPOLL_CTL_DEL, peer->socket, NULL);
+		chat_peer_free(peer);
+		return;
+	}
+	if (peer->op_count == 0) {
+		chat_peer_free(peer);
+		return;
+	}
+	/*
+	 * The ring still has the peer's receive and maybe a send pointing at
+	 * the output. Shutdown makes them end soon.
+	 */
+	peer->is_closed = true;
+	rlist_add_tail(&shard->zombies, &peer->in_peers);
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(&shard->ring);
+	if (sqe == NULL) {
+		shutdown(peer->socket, SHUT_RDWR);
+		return;
+	}
+	sqe->opcode = IORING_OP_SHUTDOWN;
+	sqe->fd = peer->socket;
+	sqe->len = SHUT_RDWR;
+	sqe->user_data = chat_op_data(peer, CHAT_OP_SHUTDOWN);
+	++peer->op_count;
+}
+
+/** Take all the posts from the inbox in the order they were posted. */
+static struct chat_post *
+chat_shard_take_inbox(struct chat_shard *shard)
+{
+	struct chat_post *post = __atomic_exchange_n(&shard->inbox, NULL,
+						     __ATOMIC_ACQUIRE);
+	struct chat_post *res = NULL;
+	while (post != NULL) {
+		struct chat_post *next = post->next;
+		post->next = res;
+		res = post;
+		post = next;
+	}
+	return res;
+}
+
+static int
+chat_shard_complete_all(struct chat_shard *shard, int *count);
+
+/** Close everything opened by chat_shard_open(). */
+static void
+chat_shard_close(struct chat_shard *shard)
+{
+	while (!rlist_empty(&shard->peers)) {
+		chat_peer_delete(shard, rlist_first_entry(&shard->peers,
+			struct chat_peer, in_peers));
+	}
+	while (!rlist_empty(&shard->handshakes)) {
+		chat_peer_delete(shard, rlist_first_entry(&shard->handshakes,
+			struct chat_peer, in_peers));
+	}
+	if (shard->ring.fd >= 0) {
+		/*
+		 * The zombies' memory can be used by the kernel until their
+		 * operations are completed.
+		 */
+		shard->is_closing = true;
+		while (!rlist_empty(&shard->zombies)) {
+			if (chat_uring_enter(&shard->ring, -1) != 0)
+				break;
+			int count;
+			chat_shard_complete_all(shard, &count);
+		}
+		chat_uring_destroy(&shard->ring);
+		while (!rlist_empty(&shard->zombies)) {
+			chat_peer_free(rlist_shift_entry(&shard->zombies,
+				struct chat_peer, in_peers));
+		}
+		shard->is_closing = false;
+	}
+	chat_uring_bufs_destroy(&shard->bufs);
+	if (shard->ring_event_fd >= 0) {
+		close(shard->ring_event_fd);
+		shard->ring_event_fd = -1;
+	}
+	struct chat_post *post = chat_shard_take_inbox(shard);
+	while (post != NULL) {
+		struct chat_post *next = post->next;
+		chat_slab_unref(post->slab);
+		delete post;
+		post = next;
+	}
+	for (struct chat_slab *slab : shard->history)
+		chat_slab_unref(slab);
+	shard->history.clear();
+	shard->history_pos = 0;
+	if (shard->inbox_fd >= 0) {
+		if (shard->epoll >= 0) {
+			epoll_ctl(shard->epoll, EPOLL_CTL_DEL, shard->inbox_fd,
+				  NULL);
+		}
+		close(shard->inbox_fd);
+		shard->inbox_fd = -1;
+	}
+	if (shard->socket >= 0) {
+		if (shard->epoll >= 0) {
+			epoll_ctl(shard->epoll, EPOLL_CTL_DEL, shard->socket,
+				  NULL);
+		}
+		close(shard->socket);
+		shard->socket = -1;
+	}
+	if (shard->epoll >= 0) {
+		close(shard->epoll);
+		shard->epoll = -1;
+	}
+}
+
+static void
+chat_shard_wakeup(struct chat_shard *shard)
+{
+	uint64_t one = 1;
+	ssize_t rc = write(shard->inbox_fd, &one, sizeof(one));
+	(void)rc;
+}
+
+/** Stop the threads of the shards and wait for them to exit. */
+static void
+chat_server_stop(struct chat_server *server)
+{
+	if (!server->is_started)
+		return;
+	__atomic_store_n(&server->is_stopped, true, __ATOMIC_RELEASE);
+	for (int i = 1; i < server->shard_count; ++i)
+		chat_shard_wakeup(&server->shards[i]);
+	for (int i = 1; i < server->shard_count; ++i)
+		pthread_join(server->shards[i].thread, NULL);
+	server->is_started = false;
+	server->is_stopped = false;
 }
 
 void
 chat_server_delete(struct chat_server *server)
 {
-	if (server->socket >= 0)
-		close(server->socket);
+	chat_server_stop(server);
+	for (int i = 0; i < server->shard_count; ++i)
+		chat_shard_close(&server->shards[i]);
+	if (server->tls_ctx != NULL)
+		chat_tls_ctx_delete(server->tls_ctx);
+	delete[] server->shards;
+	delete server;
+}
 
-	/* IMPLEMENT THIS FUNCTION */
+static int
+chat_shard_arm_accept(struct chat_shard *shard)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(&shard->ring);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = shard->socket;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = chat_op_data(NULL, CHAT_OP_ACCEPT);
+	return 0;
+}
 
-	delete server;
+static int
+chat_shard_arm_inbox(struct chat_shard *shard)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(&shard->ring);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = shard->inbox_fd;
+	sqe->addr = (uint64_t)(uintptr_t)&shard->inbox_value;
+	sqe->len = sizeof(shard->inbox_value);
+	sqe->off = -1;
+	sqe->user_data = chat_op_data(NULL, CHAT_OP_INBOX);
+	return 0;
 }
 
-int
-chat_server_listen(struct chat_server *server, uint16_t port)
+/**
+ * Create the shard's ring and start accepting in it. The listening
+ * socket is already created.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code, like in chat_server_listen().
+ */
+static int
+chat_shard_open_uring(struct chat_shard *shard)
 {
+	if (chat_uring_create(&shard->ring, CHAT_SERVER_URING_ENTRIES) != 0)
+		return CHAT_ERR_SYS;
+	if (chat_uring_bufs_create(&shard->ring, &shard->bufs, 0,
+				   CHAT_SERVER_URING_BUF_COUNT,
+				   CHAT_SERVER_URING_BUF_SIZE,
+				   chat_op_data(NULL, CHAT_OP_BUFS)) != 0)
+		return CHAT_ERR_SYS;
+	if (shard == &shard->server->shards[0]) {
+		shard->ring_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (shard->ring_event_fd < 0)
+			return CHAT_ERR_SYS;
+		if (chat_uring_register_eventfd(&shard->ring,
+						shard->ring_event_fd) != 0)
+			return CHAT_ERR_SYS;
+	}
+	if (chat_shard_arm_accept(shard) != 0)
+		return CHAT_ERR_SYS;
+	if (shard->server->shard_count > 1) {
+		/* Blocking, so the ring waits for it instead of failing. */
+		shard->inbox_fd = eventfd(0, EFD_CLOEXEC);
+		if (shard->inbox_fd < 0 || chat_shard_arm_inbox(shard) != 0)
+			return CHAT_ERR_SYS;
+	}
+	if (chat_uring_submit(&shard->ring) != 0)
+		return CHAT_ERR_SYS;
+	return 0;
+}
+
+/** Set an option if it is not the default. */
+static int
+chat_socket_set_int(int sock, int level, int name, int value)
+{
+	if (value == 0)
+		return 0;
+	return setsockopt(sock, level, name, &value, sizeof(value));
+}
+
+/**
+ * Set the options on the listening socket. Before bind, because the
+ * buffer sizes affect the window scale negotiated with the clients.
+ *
+ * @retval 0 Success.
+ * @retval -1 A system error, check errno.
+ */
+static int
+chat_shard_set_options(struct chat_shard *shard)
+{
+	const struct chat_server_options *options = &shard->server->options;
+	int sock = shard->socket;
+	if (chat_socket_set_int(sock, IPPROTO_TCP, TCP_NODELAY,
+				options->no_delay ? 1 : 0) != 0 ||
+	    chat_socket_set_int(sock, SOL_SOCKET, SO_SNDBUF,
+				options->send_buffer_size) != 0 ||
+	    chat_socket_set_int(sock, SOL_SOCKET, SO_RCVBUF,
+				options->recv_buffer_size) != 0 ||
+	    chat_socket_set_int(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+				options->defer_accept_sec) != 0 ||
+	    chat_socket_set_int(sock, SOL_SOCKET, SO_BUSY_POLL,
+				options->busy_poll_usec) != 0)
+		return -1;
+	/*
+	 * Not an error when the kernel can't do it, the sends just copy.
+	 * It doesn't work with kTLS nor with the ring sends.
+	 */
+	shard->is_zerocopy = options->zerocopy_threshold != 0 &&
+			     shard->server->tls_ctx == NULL &&
+			     !chat_shard_is_uring(shard) &&
+			     chat_socket_set_int(sock, SOL_SOCKET, SO_ZEROCOPY,
+						 1) == 0;
+	return 0;
+}
+
+/**
+ * Create the shard's listening socket and epoll or ring.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code, like in chat_server_listen().
+ */
+static int
+chat_shard_open_epoll(struct chat_shard *shard);
+
+static int
+chat_shard_open(struct chat_shard *shard, uint16_t port)
+{
+	bool is_shared = shard->server->shard_count > 1;
+	bool is_uring = chat_shard_is_uring(shard);
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
 	/* Listen on all IPs of this machine. */
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
+	/* The ring waits for the blocking sockets itself. */
+	shard->socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC |
+			       (is_uring ? 0 : SOCK_NONBLOCK), 0);
+	if (shard->socket < 0)
+		return CHAT_ERR_SYS;
+	int value = 1;
+	if (setsockopt(shard->socket, SOL_SOCKET, SO_REUSEADDR, &value,
+		       sizeof(value)) != 0)
+		return CHAT_ERR_SYS;
 	/*
-	 * 1) Create a server socket (function socket()).
-	 * 2) Bind the server socket to addr (function bind()).
-	 * 3) Listen the server socket (function listen()).
-	 * 4) Create epoll/kqueue if needed.
+	 * Each shard has its own listening socket on the same port. The
+	 * kernel balances the new clients between them.
 	 */
-	/* IMPLEMENT THIS FUNCTION */
-	(void)server;
+	if (is_shared && setsockopt(shard->socket, SOL_SOCKET, SO_REUSEPORT,
+				    &value, sizeof(value)) != 0)
+		return CHAT_ERR_SYS;
+	if (chat_shard_set_options(shard) != 0)
+		return CHAT_ERR_SYS;
+	if (bind(shard->socket, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		return errno == EADDRINUSE ? CHAT_ERR_PORT_BUSY : CHAT_ERR_SYS;
+	const struct chat_server_options *options = &shard->server->options;
+	int backlog = options->backlog != 0 ? options->backlog : SOMAXCONN;
+	if (listen(shard->socket, backlog) != 0)
+		return CHAT_ERR_SYS;
+	if (is_uring)
+		return chat_shard_open_uring(shard);
+	return chat_shard_open_epoll(shard);
+}
 
-	return CHAT_ERR_NOT_IMPLEMENTED;
+/**
+ * Create the shard's epoll with the listening socket, already created.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code, like in chat_server_listen().
+ */
+static int
+chat_shard_open_epoll(struct chat_shard *shard)
+{
+	shard->epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (shard->epoll < 0)
+		return CHAT_ERR_SYS;
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	/* The shard itself stands for the listening socket. */
+	ev.data.ptr = shard;
+	if (epoll_ctl(shard->epoll, EPOLL_CTL_ADD, shard->socket, &ev) != 0)
+		return CHAT_ERR_SYS;
+	if (shard->server->shard_count == 1)
+		return 0;
+	shard->inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (shard->inbox_fd < 0)
+		return CHAT_ERR_SYS;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &shard->inbox;
+	if (epoll_ctl(shard->epoll, EPOLL_CTL_ADD, shard->inbox_fd, &ev) != 0)
+		return CHAT_ERR_SYS;
+	return 0;
 }
 
-struct chat_message *
-chat_server_pop_next(struct chat_server *server)
+static int
+chat_shard_update(struct chat_shard *shard, double timeout);
+
+static void *
+chat_shard_worker_f(void *arg)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)server;
+	struct chat_shard *shard = (struct chat_shard *)arg;
+	struct chat_server *server = shard->server;
+	while (!__atomic_load_n(&server->is_stopped, __ATOMIC_ACQUIRE))
+		chat_shard_update(shard, -1);
 	return NULL;
 }
 
+/** Start the threads of the shards other than 0. */
+static void
+chat_server_start(struct chat_server *server)
+{
+	for (int i = 1; i < server->shard_count; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+		if (pthread_create(&shard->thread, NULL, chat_shard_worker_f,
+				   shard) != 0)
+			abort();
+	}
+	server->is_started = server->shard_count > 1;
+}
+
 int
-chat_server_update(struct chat_server *server, double timeout)
+chat_server_listen(struct chat_server *server, uint16_t port)
 {
+	if (server->shards[0].socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (server->tls_ctx != NULL &&
+	    server->backend != CHAT_SERVER_BACKEND_EPOLL)
+		return CHAT_ERR_NOT_IMPLEMENTED;
+	int rc = 0;
+	for (int i = 0; i < server->shard_count && rc == 0; ++i) {
+		rc = chat_shard_open(&server->shards[i], port);
+		if (rc != 0 || port != 0)
+			continue;
+		/* The other shards take the port chosen for the first one. */
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		if (getsockname(server->shards[0].socket,
+				(struct sockaddr *)&addr, &len) != 0)
+			rc = CHAT_ERR_SYS;
+		port = ntohs(addr.sin_port);
+	}
+	if (rc != 0) {
+		int err = errno;
+		for (int i = 0; i < server->shard_count; ++i)
+			chat_shard_close(&server->shards[i]);
+		errno = err;
+		return rc;
+	}
+	chat_server_start(server);
+	return 0;
+}
+
+int
+chat_server_set_backend(struct chat_server *server,
+			enum chat_server_backend backend)
+{
+	if (server->shards[0].socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (backend == CHAT_SERVER_BACKEND_URING && !chat_uring_is_supported())
+		return CHAT_ERR_NOT_IMPLEMENTED;
+	server->backend = backend;
+	return 0;
+}
+
+int
+chat_server_set_limits(struct chat_server *server,
+		       const struct chat_server_limits *limits)
+{
+	if (server->shards[0].socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (limits->output_high_mark != 0 &&
+	    limits->output_low_mark > limits->output_high_mark)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	server->limits = *limits;
+	return 0;
+}
+
+int
+chat_server_set_options(struct chat_server *server,
+			const struct chat_server_options *options)
+{
+	if (server->shards[0].socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (options->backlog < 0 || options->send_buffer_size < 0 ||
+	    options->recv_buffer_size < 0 || options->defer_accept_sec < 0 ||
+	    options->busy_poll_usec < 0)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	server->options = *options;
+	return 0;
+}
+
+int
+chat_server_set_tls(struct chat_server *server, const char *cert_file,
+		    const char *key_file)
+{
+	if (server->shards[0].socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (!chat_tls_is_supported())
+		return CHAT_ERR_NOT_IMPLEMENTED;
+	struct chat_tls_ctx *ctx = chat_tls_ctx_new_server(cert_file, key_file);
+	if (ctx == NULL)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	if (server->tls_ctx != NULL)
+		chat_tls_ctx_delete(server->tls_ctx);
+	server->tls_ctx = ctx;
+	return 0;
+}
+
+int
+chat_server_enable_rooms(struct chat_server *server)
+{
+	if (server->shards[0].socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->is_rooms = true;
+	return 0;
+}
+
+int
+chat_server_set_history(struct chat_server *server, size_t count)
+{
+	if (server->shards[0].socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	server->history_size = count;
+	return 0;
+}
+
+int
+chat_server_set_compression(struct chat_server *server, int level)
+{
+	if (server->shards[0].socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (level < 0 || level > CHAT_DEFLATE_MAX_LEVEL)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	if (level > 0 && !chat_deflate_is_supported())
+		return CHAT_ERR_NOT_IMPLEMENTED;
+	server->deflate_level = level;
+	return 0;
+}
+
+int
+chat_server_set_timeouts(struct chat_server *server,
+			 const struct chat_server_timeouts *timeouts)
+{
+	if (server->shards[0].socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	/* Written so NaN is rejected too. */
+	if (!(timeouts->idle_timeout >= 0) || !(timeouts->ping_interval >= 0))
+		return CHAT_ERR_INVALID_ARGUMENT;
+	server->timeouts = *timeouts;
+	return 0;
+}
+
+void
+chat_server_stats(const struct chat_server *server,
+		  struct chat_server_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i < server->shard_count; ++i) {
+		const struct chat_server_stats *s = &server->shards[i].stats;
+		stats->peer_count += __atomic_load_n(&s->peer_count,
+						     __ATOMIC_RELAXED);
+		stats->lagging_count += __atomic_load_n(&s->lagging_count,
+							__ATOMIC_RELAXED);
+		stats->dropped_count += __atomic_load_n(&s->dropped_count,
+							__ATOMIC_RELAXED);
+		stats->evicted_count += __atomic_load_n(&s->evicted_count,
+							__ATOMIC_RELAXED);
+		stats->expired_count += __atomic_load_n(&s->expired_count,
+							__ATOMIC_RELAXED);
+		stats->zerocopy_count += __atomic_load_n(&s->zerocopy_count,
+							 __ATOMIC_RELAXED);
+		stats->zerocopy_copied_count += __atomic_load_n(
+			&s->zerocopy_copied_count, __ATOMIC_RELAXED);
+		stats->deflate_count += __atomic_load_n(
+			&s->deflate_count, __ATOMIC_RELAXED);
+	}
+}
+
+struct chat_message *
+chat_server_pop_next(struct chat_server *server)
+{
+	if (server->messages.empty())
+		return NULL;
+	struct chat_message *msg =
+		new chat_message(std::move(server->messages.front()));
+	server->messages.pop_front();
+	return msg;
+}
+
+size_t
+chat_server_pop_batch(struct chat_server *server,
+		      std::vector<struct chat_message> *out, size_t max)
+{
+	size_t count = std::min(max, server->messages.size());
+	auto end = server->messages.begin() + count;
+	out->insert(out->end(), std::make_move_iterator(
+		server->messages.begin()), std::make_move_iterator(end));
+	server->messages.erase(server->messages.begin(), end);
+	return count;
+}
+
+/**
+ * Compress the slab for the deflate peers. Only once for all the shards,
+ * a concurrent call waits for the first one to finish it. An empty
+ * message, like a ping, stays an empty frame, which the clients skip.
+ */
+static void
+chat_slab_deflate(struct chat_shard *shard, struct chat_slab *slab)
+{
+	std::call_once(slab->deflate_once, [shard, slab]() {
+		std::string_view data(slab->data.data(), slab->data.size() - 1);
+		if (!data.empty()) {
+			chat_deflate_encode(data, shard->server->deflate_level,
+					    &slab->deflated);
+			chat_stat_add(&shard->stats.deflate_count, 1);
+		}
+		slab->deflated_header_size = chat_varint_encode(
+			slab->deflated.size(), slab->deflated_header);
+	});
+}
+
+/**
+ * Mode to send the slab number @a i of the peer's output in. The ones
+ * queued before the hello echo go as text.
+ */
+static enum chat_peer_mode
+chat_peer_slab_mode(const struct chat_peer *peer, size_t i)
+{
+	return i >= peer->text_count ? peer->mode : CHAT_PEER_MODE_TEXT;
+}
+
+/**
+ * Append a slab to the peer's output, taking the reference given by the
+ * caller. The peer is queued for a flush, unless its socket is known to
+ * be full. Then it is flushed when epoll reports it writable.
+ *
+ * A lagging peer doesn't get the slab at all. A peer above the hard cap
+ * is queued for a flush regardless of the socket, so it is evicted by
+ * the flush.
+ */
+static void
+chat_peer_push(struct chat_shard *shard, struct chat_peer *peer,
+	       struct chat_slab *slab)
+{
+	const struct chat_server_limits *limits = &shard->server->limits;
+	if (peer->is_lagging) {
+		chat_stat_add(&shard->stats.dropped_count, 1);
+		chat_slab_unref(slab);
+		return;
+	}
+	if (peer->output.empty())
+		++shard->output_peer_count;
+	peer->output.push_back(slab);
+	if (peer->mode == CHAT_PEER_MODE_DEFLATE && !slab->is_raw)
+		chat_slab_deflate(shard, slab);
+	peer->output_size += chat_slab_wire_size(slab, peer->mode);
+	if (limits->output_high_mark != 0 &&
+	    peer->output_size > limits->output_high_mark) {
+		peer->is_lagging = true;
+		chat_stat_add(&shard->stats.lagging_count, 1);
+	}
+	bool is_over_cap = limits->output_hard_cap != 0 &&
+			   peer->output_size > limits->output_hard_cap;
+	if ((peer->is_writable || is_over_cap) &&
+	    rlist_empty(&peer->in_flush))
+		rlist_add_tail(&shard->flush_queue, &peer->in_flush);
+}
+
+/** Drop the lagging state if the output went down to the low mark. */
+static void
+chat_peer_check_lag(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (peer->is_lagging &&
+	    peer->output_size <= shard->server->limits.output_low_mark) {
+		peer->is_lagging = false;
+		chat_stat_add(&shard->stats.lagging_count, -1);
+	}
+}
+
+/**
+ * Fill the vectors with as many queued slabs as fit into one call. A
+ * binary slab takes 2 vectors, its header and its data.
+ *
+ * @return Number of the used vectors.
+ */
+static int
+chat_peer_fill_iov(const struct chat_peer *peer, struct iovec *iov, int max)
+{
+	int count = 0;
+	size_t offset = peer->output_sent;
+	size_t i = 0;
+	for (struct chat_slab *slab : peer->output) {
+		if (count + 2 > max)
+			break;
+		count += chat_slab_fill_iov(slab, chat_peer_slab_mode(peer, i),
+					    offset, &iov[count]);
+		offset = 0;
+		++i;
+	}
+	return count;
+}
+
+/**
+ * Reference the slabs covered by a zerocopy send of @a sent bytes from
+ * the head of the output. Before the output is consumed.
+ */
+static void
+chat_peer_hold_zerocopy(struct chat_shard *shard, struct chat_peer *peer,
+			size_t sent)
+{
+	size_t offset = peer->output_sent;
+	size_t i = 0;
+	uint32_t seq = peer->zerocopy_seq++;
+	while (sent > 0) {
+		struct chat_slab *slab = peer->output[i];
+		size_t rest = chat_slab_wire_size(
+			slab, chat_peer_slab_mode(peer, i)) - offset;
+		chat_slab_ref(slab, 1);
+		peer->zerocopy_refs.push_back({seq, slab});
+		sent -= std::min(sent, rest);
+		offset = 0;
+		++i;
+	}
+	chat_stat_add(&shard->stats.zerocopy_count, 1);
+}
+
+/**
+ * Release the slabs of the completed zerocopy sends. The completions
+ * come in the socket's error queue, each for a range of the sends.
+ */
+static void
+chat_peer_complete_zerocopy(struct chat_shard *shard, struct chat_peer *peer)
+{
+	while (!peer->zerocopy_refs.empty()) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		if (recvmsg(peer->socket, &mh, MSG_ERRQUEUE) < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm != NULL;
+		     cm = CMSG_NXTHDR(&mh, cm)) {
+			if (cm->cmsg_level != SOL_IP ||
+			    cm->cmsg_type != IP_RECVERR)
+				continue;
+			struct sock_extended_err err;
+			memcpy(&err, CMSG_DATA(cm), sizeof(err));
+			if (err.ee_errno != 0 ||
+			    err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			if ((err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0 &&
+			    !peer->is_zerocopy_copied) {
+				peer->is_zerocopy_copied = true;
+				chat_stat_add(&shard->stats.zerocopy_copied_count,
+					      1);
+			}
+			/* A TCP socket completes the sends in order. */
+			std::deque<struct chat_zerocopy_ref> &refs =
+				peer->zerocopy_refs;
+			while (!refs.empty() &&
+			       (int32_t)(refs.front().seq - err.ee_data) <= 0) {
+				chat_slab_unref(refs.front().slab);
+				refs.pop_front();
+			}
+		}
+	}
+}
+
+/** Drop the sent part of the output. */
+static void
+chat_peer_consume(struct chat_shard *shard, struct chat_peer *peer,
+		  size_t sent)
+{
+	peer->output_size -= sent;
+	while (sent > 0) {
+		struct chat_slab *slab = peer->output.front();
+		size_t rest = chat_slab_wire_size(
+			slab, chat_peer_slab_mode(peer, 0)) - peer->output_sent;
+		if (sent < rest) {
+			peer->output_sent += sent;
+			break;
+		}
+		sent -= rest;
+		peer->output.pop_front();
+		peer->output_sent = 0;
+		if (peer->text_count > 0)
+			--peer->text_count;
+		chat_slab_unref(slab);
+	}
+	if (peer->output.empty())
+		--shard->output_peer_count;
+}
+
+/**
+ * Give the output to the ring to send. Only one send at a time, so the
+ * data goes in order. The slabs stay in the queue until the send is
+ * completed.
+ *
+ * @retval 0 Success.
+ * @retval -1 A system error.
+ */
+static int
+chat_peer_submit_send(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (peer->is_sending || peer->output.empty())
+		return 0;
+	int max = std::min(peer->output.size() * 2,
+			   (size_t)CHAT_SERVER_IOV_COUNT);
+	if ((int)peer->send_iov.size() < max)
+		peer->send_iov.resize(max);
+	memset(&peer->send_msg, 0, sizeof(peer->send_msg));
+	peer->send_msg.msg_iov = peer->send_iov.data();
+	peer->send_msg.msg_iovlen = chat_peer_fill_iov(
+		peer, peer->send_iov.data(), max);
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(&shard->ring);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = peer->socket;
+	sqe->addr = (uint64_t)(uintptr_t)&peer->send_msg;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = chat_op_data(peer, CHAT_OP_SEND);
+	peer->is_sending = true;
+	++peer->op_count;
+	return 0;
+}
+
+/**
+ * Send as much of the output as the socket takes. With io_uring the send
+ * is only submitted.
+ *
+ * @retval 0 Success.
+ * @retval -1 The peer is broken and has to be deleted.
+ */
+static int
+chat_peer_flush(struct chat_shard *shard, struct chat_peer *peer)
+{
+	size_t cap = shard->server->limits.output_hard_cap;
+	if (cap != 0 && peer->output_size > cap) {
+		chat_stat_add(&shard->stats.evicted_count, 1);
+		return -1;
+	}
+	if (chat_shard_is_uring(shard))
+		return chat_peer_submit_send(shard, peer);
+	struct iovec iov[CHAT_SERVER_IOV_COUNT];
+	size_t zerocopy_threshold = shard->server->options.zerocopy_threshold;
+	while (!peer->output.empty()) {
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = chat_peer_fill_iov(peer, iov,
+						   CHAT_SERVER_IOV_COUNT);
+		/*
+		 * Only the big sends, the small ones are cheaper to copy than
+		 * to pin and to complete.
+		 */
+		int flags = MSG_NOSIGNAL;
+		if (shard->is_zerocopy && !peer->is_zerocopy_copied &&
+		    peer->output_size >= zerocopy_threshold)
+			flags |= MSG_ZEROCOPY;
+		/* Not writev(), because need MSG_NOSIGNAL. */
+		ssize_t rc = sendmsg(peer->socket, &mh, flags);
+		if (rc < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY) != 0) {
+			/* Too many completions pending, copy this one. */
+			flags &= ~MSG_ZEROCOPY;
+			rc = sendmsg(peer->socket, &mh, flags);
+		}
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				peer->is_writable = false;
+				break;
+			}
+			return -1;
+		}
+		if ((flags & MSG_ZEROCOPY) != 0)
+			chat_peer_hold_zerocopy(shard, peer, rc);
+		chat_peer_consume(shard, peer, rc);
+	}
+	chat_peer_check_lag(shard, peer);
+	return 0;
+}
+
+/**
+ * Give the slab to all the peers of the shard except the author, if it
+ * is from this shard. With the rooms - only to the members of the slab's
+ * room. The caller's reference is kept.
+ */
+static void
+chat_shard_broadcast(struct chat_shard *shard, struct chat_slab *slab,
+		     struct chat_peer *author)
+{
+	if (shard->server->is_rooms) {
+		if (!slab->has_room)
+			return;
+		auto it = shard->rooms.find(slab->room);
+		if (it == shard->rooms.end())
+			return;
+		/* The author is always a member of the room. */
+		const std::vector<struct chat_peer *> &members =
+			it->second->members;
+		int count = members.size() - (author != NULL ? 1 : 0);
+		if (count <= 0)
+			return;
+		PROBE3(chat, broadcast, slab, slab->data.size(), count);
+		chat_slab_ref(slab, count);
+		for (struct chat_peer *peer : members) {
+			if (peer != author)
+				chat_peer_push(shard, peer, slab);
+		}
+		return;
+	}
+	int count = shard->peer_count - (author != NULL ? 1 : 0);
+	if (count <= 0)
+		return;
+	PROBE3(chat, broadcast, slab, slab->data.size(), count);
+	chat_slab_ref(slab, count);
+	struct chat_peer *peer;
+	rlist_foreach_entry(peer, &shard->peers, in_peers) {
+		if (peer != author)
+			chat_peer_push(shard, peer, slab);
+	}
+}
+
+/** Add the slab to the history, dropping the oldest one if it is full. */
+static void
+chat_shard_remember(struct chat_shard *shard, struct chat_slab *slab)
+{
+	size_t size = shard->server->history_size;
+	if (size == 0)
+		return;
+	chat_slab_ref(slab, 1);
+	if (shard->history.size() < size) {
+		shard->history.push_back(slab);
+		return;
+	}
+	chat_slab_unref(shard->history[shard->history_pos]);
+	shard->history[shard->history_pos] = slab;
+	shard->history_pos = (shard->history_pos + 1) % size;
+}
+
+/**
+ * Queue the history for a new peer, the oldest first. It goes as text,
+ * before the peer could choose the binary mode.
+ */
+static void
+chat_peer_replay(struct chat_shard *shard, struct chat_peer *peer)
+{
+	bool is_rooms = shard->server->is_rooms;
+	size_t count = shard->history.size();
+	for (size_t i = 0; i < count; ++i) {
+		struct chat_slab *slab =
+			shard->history[(shard->history_pos + i) % count];
+		if (is_rooms && (!slab->has_room || !slab->room.empty()))
+			continue;
+		chat_slab_ref(slab, 1);
+		chat_peer_push(shard, peer, slab);
+	}
+}
+
+/** Post the slab to the inboxes of all the other shards. */
+static void
+chat_shard_post(struct chat_shard *shard, struct chat_slab *slab)
+{
+	struct chat_server *server = shard->server;
+	chat_slab_ref(slab, server->shard_count - 1);
+	for (int i = 0; i < server->shard_count; ++i) {
+		struct chat_shard *dst = &server->shards[i];
+		if (dst == shard)
+			continue;
+		struct chat_post *post = new chat_post();
+		post->slab = slab;
+		struct chat_post *head = __atomic_load_n(&dst->inbox,
+							 __ATOMIC_RELAXED);
+		do {
+			post->next = head;
+		} while (!__atomic_compare_exchange_n(&dst->inbox, &head, post,
+						      true, __ATOMIC_RELEASE,
+						      __ATOMIC_RELAXED));
+		/*
+		 * The owner is woken up only by the first post. The post
+		 * itself can't be used anymore, it might be taken already.
+		 */
+		if (head == NULL)
+			chat_shard_wakeup(dst);
+	}
+}
+
+/** Save a message for popping from chat_server_pop_next(). */
+static void
+chat_shard_save(struct chat_shard *shard, std::string_view data)
+{
+	shard->server->messages.emplace_back();
+	shard->server->messages.back().data.assign(data);
+}
+
+/** Broadcast the slabs posted by the other shards. */
+static void
+chat_shard_read_inbox(struct chat_shard *shard)
+{
+	/* The ring reads the eventfd itself. */
+	if (!chat_shard_is_uring(shard)) {
+		uint64_t value;
+		ssize_t rc = read(shard->inbox_fd, &value, sizeof(value));
+		(void)rc;
+	}
+	bool is_main = shard == &shard->server->shards[0];
+	struct chat_post *post = chat_shard_take_inbox(shard);
+	while (post != NULL) {
+		struct chat_post *next = post->next;
+		struct chat_slab *slab = post->slab;
+		chat_shard_broadcast(shard, slab, NULL);
+		chat_shard_remember(shard, slab);
+		if (is_main) {
+			chat_shard_save(shard, std::string_view(
+				slab->data.data(), slab->data.size() - 1));
+		}
+		chat_slab_unref(slab);
+		delete post;
+		post = next;
+	}
+}
+
+/**
+ * Choose the framing by the first received byte. The binary hello is
+ * consumed and echoed back. Everything queued before the echo still goes
+ * as text, so the client can tell where the binary part starts.
+ *
+ * The deflate hello is echoed the same way if the compression is on.
+ * Otherwise the echo is the binary hello, and the peer gets the plain
+ * binary frames.
+ */
+static void
+chat_peer_choose_mode(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct chat_input *in = &peer->input;
+	char hello = in->data[in->begin];
+	if (hello == CHAT_DEFLATE_HELLO && shard->server->deflate_level > 0) {
+		peer->mode = CHAT_PEER_MODE_DEFLATE;
+	} else if (hello == CHAT_BINARY_HELLO || hello == CHAT_DEFLATE_HELLO) {
+		peer->mode = CHAT_PEER_MODE_BINARY;
+		hello = CHAT_BINARY_HELLO;
+	} else {
+		peer->mode = CHAT_PEER_MODE_TEXT;
+		return;
+	}
+	++in->begin;
+	in->scanned = in->begin;
+	peer->text_count = peer->output.size();
+	/* The echo is not a message, so the limits don't apply to it. */
+	struct chat_slab *slab = chat_slab_new_raw(std::string_view(&hello, 1));
+	if (peer->output.empty())
+		++shard->output_peer_count;
+	peer->output.push_back(slab);
+	peer->output_size += slab->data.size();
+	if (peer->is_writable && rlist_empty(&peer->in_flush))
+		rlist_add_tail(&shard->flush_queue, &peer->in_flush);
+}
+
+static bool
+chat_shard_has_timeouts(const struct chat_shard *shard)
+{
+	const struct chat_server_timeouts *timeouts = &shard->server->timeouts;
+	return timeouts->idle_timeout > 0 || timeouts->ping_interval > 0;
+}
+
+/**
+ * Restart the peer's timeouts, because it sent something. Called once per
+ * read, not per message.
+ */
+static void
+chat_peer_touch(struct chat_shard *shard, struct chat_peer *peer)
+{
+	const struct chat_server_timeouts *timeouts = &shard->server->timeouts;
+	if (timeouts->idle_timeout > 0) {
+		peer->idle_deadline = shard->now + timeouts->idle_timeout;
+		rlist_move_tail(&shard->idle_queue, &peer->in_idle);
+	}
+	if (timeouts->ping_interval > 0) {
+		peer->ping_deadline = shard->now + timeouts->ping_interval;
+		rlist_move_tail(&shard->ping_queue, &peer->in_ping);
+	}
+}
+
+/** Match a command and get its argument. */
+static bool
+chat_command_match(std::string_view data, std::string_view command,
+		   std::string_view *arg)
+{
+	if (data.substr(0, command.size()) != command)
+		return false;
+	data.remove_prefix(command.size());
+	if (!data.empty() && data[0] != ' ')
+		return false;
+	while (!data.empty() && data[0] == ' ')
+		data.remove_prefix(1);
+	*arg = data;
+	return true;
+}
+
+/**
+ * Handle the message if it is a room command.
+ *
+ * @retval true It was a command.
+ * @retval false It is a usual message.
+ */
+static bool
+chat_peer_command(struct chat_shard *shard, struct chat_peer *peer,
+		  std::string_view data)
+{
+	std::string_view name;
+	if (chat_command_match(data, "/join", &name)) {
+		chat_peer_join(shard, peer, name);
+		return true;
+	}
+	if (chat_command_match(data, "/leave", &name)) {
+		chat_peer_leave(shard, peer, name);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Cut the received data into messages. Each complete message is saved
+ * for popping and broadcast to all the other peers right after the read
+ * which completed it.
+ *
+ * @retval 0 Success.
+ * @retval -1 The data is broken and the peer has to be deleted.
+ */
+static int
+chat_peer_parse(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct chat_input *in = &peer->input;
+	bool is_main = shard == &shard->server->shards[0];
+	bool is_shared = shard->server->shard_count > 1;
+	bool is_rooms = shard->server->is_rooms;
+	bool is_history = shard->server->history_size > 0;
+	if (peer->mode == CHAT_PEER_MODE_UNKNOWN)
+		chat_peer_choose_mode(shard, peer);
+	std::string_view data;
+	while (true) {
+		if (peer->mode == CHAT_PEER_MODE_TEXT) {
+			if (!chat_input_pop(in, &data))
+				return 0;
+		} else {
+			int res = chat_input_pop_frame(in, &data);
+			if (res < 0)
+				return -1;
+			if (res == 0)
+				return 0;
+		}
+		if (is_rooms && chat_peer_command(shard, peer, data))
+			continue;
+		/*
+		 * The fan-out is a pointer push per peer, the text is copied
+		 * only once into the slab.
+		 */
+		if (shard->peer_count > 1 || is_shared || is_history) {
+			struct chat_slab *slab = chat_slab_new(data);
+			if (is_rooms && !peer->rooms.empty()) {
+				slab->room = peer->rooms.back().room->name;
+				slab->has_room = true;
+			}
+			chat_shard_broadcast(shard, slab, peer);
+			chat_shard_remember(shard, slab);
+			if (is_shared)
+				chat_shard_post(shard, slab);
+			chat_slab_unref(slab);
+		}
+		/* Messages of the other shards come to shard 0 via its inbox. */
+		if (is_main)
+			chat_shard_save(shard, data);
+	}
+}
+
+/**
+ * Read everything available on the peer's socket.
+ *
+ * @retval 0 Success.
+ * @retval -1 The peer is closed or broken and has to be deleted.
+ */
+static int
+chat_peer_read(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct chat_input *in = &peer->input;
+	bool is_touched = false;
+	while (true) {
+		chat_input_reserve(in, CHAT_SERVER_READ_SIZE);
+		ssize_t rc = recv(peer->socket, in->data + in->size,
+				  in->capacity - in->size, 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		if (rc == 0)
+			return -1;
+		in->size += rc;
+		if (!is_touched) {
+			chat_peer_touch(shard, peer);
+			is_touched = true;
+		}
+		if (chat_peer_parse(shard, peer) != 0)
+			return -1;
+	}
+}
+
+/**
+ * Start receiving from the peer in the ring. One operation receives
+ * until an error or running out of the buffers.
+ */
+static int
+chat_peer_arm_recv(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(&shard->ring);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = peer->socket;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = shard->bufs.group;
+	sqe->user_data = chat_op_data(peer, CHAT_OP_RECV);
+	++peer->op_count;
+	return 0;
+}
+
+/** Create a peer with the socket, not linked anywhere yet. */
+static struct chat_peer *
+chat_peer_new(int sock)
+{
+	struct chat_peer *peer = new chat_peer();
+	peer->socket = sock;
+	peer->mode = CHAT_PEER_MODE_UNKNOWN;
+	peer->text_count = 0;
+	peer->input.is_checked = true;
+	peer->output_sent = 0;
+	peer->output_size = 0;
+	peer->is_lagging = false;
+	peer->is_writable = true;
+	peer->op_count = 0;
+	peer->is_sending = false;
+	peer->is_closed = false;
+	peer->zerocopy_seq = 0;
+	peer->is_zerocopy_copied = false;
+	rlist_create(&peer->in_flush);
+	rlist_create(&peer->in_idle);
+	rlist_create(&peer->in_ping);
+	peer->tls = NULL;
+	return peer;
+}
+
+/**
+ * Add the peer to the socket's events. It is added once with all the
+ * events and stays like that until closed. Edge-triggered EPOLLOUT comes
+ * only when the send buffer gets space after being full, i.e. only while
+ * the peer has pending output. No EPOLL_CTL_MOD per message.
+ */
+static int
+chat_shard_watch_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = peer;
+	return epoll_ctl(shard->epoll, EPOLL_CTL_ADD, peer->socket, &ev);
+}
+
+/**
+ * Add a new peer with an accepted socket.
+ *
+ * @retval 0 Success.
+ * @retval -1 A system error, check errno. The socket is closed.
+ */
+static int
+chat_shard_add_peer(struct chat_shard *shard, int sock)
+{
+	PROBE1(chat, peer__accept, sock);
+	struct chat_peer *peer = chat_peer_new(sock);
+	struct chat_tls_ctx *tls_ctx = shard->server->tls_ctx;
+	if (tls_ctx != NULL) {
+		peer->tls = chat_tls_new(tls_ctx, sock, NULL);
+		if (peer->tls == NULL) {
+			close(sock);
+			delete peer;
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	int rc;
+	if (chat_shard_is_uring(shard))
+		rc = chat_peer_arm_recv(shard, peer);
+	else
+		rc = chat_shard_watch_peer(shard, peer);
+	if (rc != 0) {
+		int err = errno;
+		if (peer->tls != NULL)
+			chat_tls_delete(peer->tls);
+		close(sock);
+		delete peer;
+		errno = err;
+		return -1;
+	}
+	/* The idle timeout limits the handshake too. */
+	chat_peer_touch(shard, peer);
+	if (peer->tls != NULL) {
+		rlist_add_tail(&shard->handshakes, &peer->in_peers);
+		return 0;
+	}
+	rlist_add_tail(&shard->peers, &peer->in_peers);
+	++shard->peer_count;
+	chat_stat_add(&shard->stats.peer_count, 1);
+	if (shard->server->is_rooms)
+		chat_peer_join(shard, peer, std::string_view());
+	chat_peer_replay(shard, peer);
+	return 0;
+}
+
+/**
+ * Continue the peer's TLS handshake. When it is done, the peer becomes a
+ * usual one, with the kernel doing the crypto.
+ *
+ * @retval 0 Success.
+ * @retval -1 The handshake failed and the peer has to be deleted.
+ */
+static int
+chat_peer_handshake(struct chat_shard *shard, struct chat_peer *peer)
+{
+	switch (chat_tls_handshake(peer->tls)) {
+	case CHAT_TLS_WANT_READ:
+	case CHAT_TLS_WANT_WRITE:
+		/* Both events are always in the epoll. */
+		return 0;
+	case CHAT_TLS_ERROR:
+		return -1;
+	case CHAT_TLS_DONE:
+		break;
+	}
+	chat_tls_delete(peer->tls);
+	peer->tls = NULL;
+	rlist_move_tail(&shard->peers, &peer->in_peers);
+	++shard->peer_count;
+	chat_stat_add(&shard->stats.peer_count, 1);
+	if (shard->server->is_rooms)
+		chat_peer_join(shard, peer, std::string_view());
+	chat_peer_replay(shard, peer);
+	/* The epoll is edge-triggered, the data might be there already. */
+	return chat_peer_read(shard, peer);
+}
+
+/**
+ * Accept all the pending clients, so a storm of connections is absorbed
+ * in one wakeup. The sockets are made non-blocking by accept4() itself.
+ * The listener is the shard's own socket, or one of a takeover being
+ * drained.
+ *
+ * @retval 0 Success.
+ * @retval -1 A system error, check errno.
+ */
+static int
+chat_shard_accept(struct chat_shard *shard, int listener)
+{
+	while (true) {
+		int sock = accept4(listener, NULL, NULL,
+				   SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		if (chat_shard_add_peer(shard, sock) != 0)
+			return -1;
+	}
+}
+
+/**
+ * Flush the peers queued for output.
+ *
+ * @retval true Something was flushed.
+ * @retval false The queue was empty.
+ */
+static bool
+chat_shard_flush(struct chat_shard *shard)
+{
+	if (rlist_empty(&shard->flush_queue))
+		return false;
+	do {
+		struct chat_peer *peer = rlist_shift_entry(&shard->flush_queue,
+			struct chat_peer, in_flush);
+		if (chat_peer_flush(shard, peer) != 0)
+			chat_peer_delete(shard, peer);
+	} while (!rlist_empty(&shard->flush_queue));
+	return true;
+}
+
+/**
+ * Get how long to wait for the nearest deadline of the peers.
+ *
+ * @retval >=0 Seconds to wait.
+ * @retval -1 No deadlines.
+ */
+static double
+chat_shard_timeout(const struct chat_shard *shard)
+{
+	double deadline = -1;
+	if (!rlist_empty(&shard->idle_queue)) {
+		deadline = rlist_first_entry(&shard->idle_queue,
+			struct chat_peer, in_idle)->idle_deadline;
+	}
+	if (!rlist_empty(&shard->ping_queue)) {
+		double ping = rlist_first_entry(&shard->ping_queue,
+			struct chat_peer, in_ping)->ping_deadline;
+		if (deadline < 0 || ping < deadline)
+			deadline = ping;
+	}
+	if (deadline < 0)
+		return -1;
+	return std::max(deadline - shard->now, 0.0);
+}
+
+/**
+ * Disconnect the idle peers and ping the quiet ones. Only the expired
+ * heads of the queues are touched. A peer which still has output isn't
+ * pinged, its pending send checks the connection anyway.
+ *
+ * @retval true Something expired.
+ * @retval false Nothing expired.
+ */
+static bool
+chat_shard_expire(struct chat_shard *shard)
+{
+	shard->now = chat_clock_now();
+	bool is_expired = false;
+	while (!rlist_empty(&shard->idle_queue)) {
+		struct chat_peer *peer = rlist_first_entry(&shard->idle_queue,
+			struct chat_peer, in_idle);
+		if (peer->idle_deadline > shard->now)
+			break;
+		chat_stat_add(&shard->stats.expired_count, 1);
+		chat_peer_delete(shard, peer);
+		is_expired = true;
+	}
+	double interval = shard->server->timeouts.ping_interval;
+	struct chat_slab *ping = NULL;
+	while (!rlist_empty(&shard->ping_queue)) {
+		struct chat_peer *peer = rlist_first_entry(&shard->ping_queue,
+			struct chat_peer, in_ping);
+		if (peer->ping_deadline > shard->now)
+			break;
+		peer->ping_deadline = shard->now + interval;
+		rlist_move_tail(&shard->ping_queue, &peer->in_ping);
+		is_expired = true;
+		if (!peer->output.empty() || peer->is_lagging ||
+		    peer->tls != NULL)
+			continue;
+		/* All the pings of one update share one slab. */
+		if (ping == NULL)
+			ping = chat_slab_new(std::string_view());
+		chat_slab_ref(ping, 1);
+		chat_peer_push(shard, peer, ping);
+	}
+	if (ping != NULL)
+		chat_slab_unref(ping);
+	return is_expired;
+}
+
+/**
+ * Handle a received chunk. The buffer is copied into the input, so it can
+ * be given back to the kernel right away.
+ *
+ * @retval 0 Success.
+ * @retval -1 The peer is closed or broken and has to be deleted.
+ */
+static int
+chat_peer_complete_recv(struct chat_shard *shard, struct chat_peer *peer,
+			int res, uint32_t flags)
+{
+	bool is_armed = (flags & IORING_CQE_F_MORE) != 0;
+	if ((flags & IORING_CQE_F_BUFFER) != 0) {
+		unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (res > 0 && !peer->is_closed) {
+			struct chat_input *in = &peer->input;
+			chat_input_reserve(in, res);
+			memcpy(in->data + in->size,
+			       chat_uring_bufs_get(&shard->bufs, id), res);
+			in->size += res;
+		}
+		if (chat_uring_bufs_put(&shard->ring, &shard->bufs, id) != 0)
+			return -1;
+	}
+	if (peer->is_closed) {
+		if (!is_armed)
+			chat_peer_release(peer);
+		return 0;
+	}
+	if (!is_armed)
+		--peer->op_count;
+	if (res > 0) {
+		chat_peer_touch(shard, peer);
+		if (chat_peer_parse(shard, peer) != 0)
+			return -1;
+	} else if (res != -ENOBUFS) {
+		/* EOF or an error. */
+		return -1;
+	}
 	/*
-	 * 1) Wait on epoll/kqueue/poll for update on any socket.
-	 * 2) Handle the update.
-	 * 2.1) If the update was on listen-socket, then you probably need to
-	 *     call accept() on it - a new client wants to join.
-	 * 2.2) If the update was on a client-socket, then you might want to
-	 *     read/write on it.
+	 * The receive can stop, for example when all the buffers were busy.
+	 * They are given back already.
 	 */
-	(void)server;
-	(void)timeout;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (!is_armed)
+		return chat_peer_arm_recv(shard, peer);
+	return 0;
+}
+
+/**
+ * Handle a completed send.
+ *
+ * @retval 0 Success.
+ * @retval -1 The peer is broken and has to be deleted.
+ */
+static int
+chat_peer_complete_send(struct chat_shard *shard, struct chat_peer *peer,
+			int res)
+{
+	peer->is_sending = false;
+	if (peer->is_closed) {
+		chat_peer_release(peer);
+		return 0;
+	}
+	--peer->op_count;
+	if (res < 0 && res != -EINTR && res != -EAGAIN)
+		return -1;
+	if (res > 0)
+		chat_peer_consume(shard, peer, res);
+	chat_peer_check_lag(shard, peer);
+	if (!peer->output.empty() && rlist_empty(&peer->in_flush))
+		rlist_add_tail(&shard->flush_queue, &peer->in_flush);
+	return 0;
+}
+
+/**
+ * Handle a completion of the ring.
+ *
+ * @retval 0 Success.
+ * @retval -1 A system error, check errno.
+ */
+static int
+chat_shard_complete(struct chat_shard *shard, uint64_t data, int res,
+		    uint32_t flags)
+{
+	struct chat_peer *peer = (struct chat_peer *)(uintptr_t)
+		(data & ~(uint64_t)CHAT_OP_MASK);
+	switch (data & CHAT_OP_MASK) {
+	case CHAT_OP_ACCEPT:
+		if ((flags & IORING_CQE_F_MORE) == 0 && !shard->is_closing &&
+		    chat_shard_arm_accept(shard) != 0)
+			return -1;
+		if (res < 0) {
+			if (res == -ECONNABORTED || res == -EINTR)
+				return 0;
+			errno = -res;
+			return -1;
+		}
+		if (shard->is_closing) {
+			close(res);
+			return 0;
+		}
+		return chat_shard_add_peer(shard, res);
+	case CHAT_OP_INBOX:
+		if (shard->is_closing)
+			return 0;
+		chat_shard_read_inbox(shard);
+		return chat_shard_arm_inbox(shard);
+	case CHAT_OP_RECV:
+		if (chat_peer_complete_recv(shard, peer, res, flags) != 0)
+			chat_peer_delete(shard, peer);
+		return 0;
+	case CHAT_OP_SEND:
+		if (chat_peer_complete_send(shard, peer, res) != 0)
+			chat_peer_delete(shard, peer);
+		return 0;
+	case CHAT_OP_SHUTDOWN:
+		chat_peer_release(peer);
+		return 0;
+	case CHAT_OP_BUFS:
+		/* The buffer is lost. */
+		errno = -res;
+		return -1;
+	default:
+		abort();
+	}
+}
+
+/**
+ * Handle all the completions of the ring.
+ *
+ * @param shard Shard.
+ * @param[out] count Number of the completions.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ */
+static int
+chat_shard_complete_all(struct chat_shard *shard, int *count)
+{
+	struct chat_uring *ring = &shard->ring;
+	*count = 0;
+	if (chat_uring_peek(ring) == NULL)
+		return 0;
+	/*
+	 * Reset the descriptor before taking the completions, so the new ones
+	 * signal it again.
+	 */
+	if (shard->ring_event_fd >= 0) {
+		uint64_t value;
+		ssize_t rc = read(shard->ring_event_fd, &value, sizeof(value));
+		(void)rc;
+	}
+	int res = 0;
+	struct io_uring_cqe *cqe;
+	while ((cqe = chat_uring_peek(ring)) != NULL) {
+		uint64_t data = cqe->user_data;
+		int rc = cqe->res;
+		uint32_t flags = cqe->flags;
+		chat_uring_advance(ring);
+		++*count;
+		if (chat_shard_complete(shard, data, rc, flags) != 0)
+			res = CHAT_ERR_SYS;
+	}
+	return res;
+}
+
+/**
+ * Update with io_uring. New sends are submitted together with waiting for
+ * the completions, and the sends made by the completions are submitted
+ * in the end. So it is at most 2 system calls for any number of messages.
+ */
+static int
+chat_shard_update_uring(struct chat_shard *shard, double timeout)
+{
+	bool is_progress = chat_shard_flush(shard);
+	if (chat_uring_enter(&shard->ring, is_progress ? 0 :
+			     chat_timeout_to_ms(timeout)) != 0)
+		return CHAT_ERR_SYS;
+	if (chat_shard_has_timeouts(shard))
+		shard->now = chat_clock_now();
+	int count;
+	int res = chat_shard_complete_all(shard, &count);
+	if (chat_shard_has_timeouts(shard) && chat_shard_expire(shard))
+		is_progress = true;
+	if (chat_shard_flush(shard))
+		is_progress = true;
+	if (chat_uring_submit(&shard->ring) != 0)
+		res = CHAT_ERR_SYS;
+	if (res == 0 && count == 0 && !is_progress)
+		return CHAT_ERR_TIMEOUT;
+	return res;
+}
+
+/** Update with epoll. */
+static int
+chat_shard_update_epoll(struct chat_shard *shard, double timeout)
+{
+	/*
+	 * Only the ready sockets and the peers with new output are touched.
+	 * Idle peers cost nothing here.
+	 */
+	bool is_progress = chat_shard_flush(shard);
+	struct epoll_event events[CHAT_SERVER_EVENT_BATCH];
+	int count = epoll_wait(shard->epoll, events, CHAT_SERVER_EVENT_BATCH,
+			       is_progress ? 0 : chat_timeout_to_ms(timeout));
+	if (count < 0) {
+		if (errno == EINTR)
+			return is_progress ? 0 : CHAT_ERR_TIMEOUT;
+		return CHAT_ERR_SYS;
+	}
+	if (chat_shard_has_timeouts(shard))
+		shard->now = chat_clock_now();
+	int res = 0;
+	for (int i = 0; i < count; ++i) {
+		void *ptr = events[i].data.ptr;
+		if (ptr == shard) {
+			if (chat_shard_accept(shard, shard->socket) != 0)
+				res = CHAT_ERR_SYS;
+			continue;
+		}
+		if (ptr == &shard->inbox) {
+			chat_shard_read_inbox(shard);
+			continue;
+		}
+		struct chat_peer *peer = (struct chat_peer *)ptr;
+		uint32_t mask = events[i].events;
+		if (peer->tls != NULL) {
+			if (chat_peer_handshake(shard, peer) != 0)
+				chat_peer_delete(shard, peer);
+			continue;
+		}
+		if ((mask & EPOLLERR) != 0 && !peer->zerocopy_refs.empty())
+			chat_peer_complete_zerocopy(shard, peer);
+		if ((mask & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0 &&
+		    chat_peer_read(shard, peer) != 0) {
+			chat_peer_delete(shard, peer);
+			continue;
+		}
+		if ((mask & EPOLLOUT) != 0) {
+			peer->is_writable = true;
+			if (!peer->output.empty() &&
+			    rlist_empty(&peer->in_flush)) {
+				rlist_add_tail(&shard->flush_queue,
+					       &peer->in_flush);
+			}
+		}
+	}
+	if (chat_shard_has_timeouts(shard) && chat_shard_expire(shard))
+		is_progress = true;
+	if (chat_shard_flush(shard))
+		is_progress = true;
+	if (res == 0 && count == 0 && !is_progress)
+		return CHAT_ERR_TIMEOUT;
+	return res;
+}
+
+static int
+chat_shard_update_backend(struct chat_shard *shard, double timeout)
+{
+	if (chat_shard_is_uring(shard))
+		return chat_shard_update_uring(shard, timeout);
+	return chat_shard_update_epoll(shard, timeout);
+}
+
+/**
+ * Update the shard. The wait is cut short by the peers' deadlines. A
+ * wakeup for a deadline isn't a timeout for the caller unless the
+ * caller's own timeout is over too.
+ */
+static int
+chat_shard_update(struct chat_shard *shard, double timeout)
+{
+	if (!chat_shard_has_timeouts(shard))
+		return chat_shard_update_backend(shard, timeout);
+	shard->now = chat_clock_now();
+	double deadline = shard->now + timeout;
+	while (true) {
+		double wait = timeout;
+		if (timeout >= 0)
+			wait = std::max(deadline - shard->now, 0.0);
+		double next = chat_shard_timeout(shard);
+		bool is_early = next >= 0 && (wait < 0 || next < wait);
+		if (is_early)
+			wait = next;
+		int rc = chat_shard_update_backend(shard, wait);
+		if (rc != CHAT_ERR_TIMEOUT || !is_early)
+			return rc;
+	}
 }
 
 int
-chat_server_get_descriptor(const struct chat_server *server)
+chat_server_update(struct chat_server *server, double timeout)
 {
-#if NEED_SERVER_FEED
-	/* IMPLEMENT THIS FUNCTION if want +5 points. */
+	if (server->shards[0].socket < 0)
+		return CHAT_ERR_NOT_STARTED;
+	return chat_shard_update(&server->shards[0], timeout);
+}
 
+int
+chat_server_get_descriptor(const struct chat_server *server)
+{
 	/*
-	 * Server has multiple sockets - own and from connected clients. Hence
-	 * you can't return a socket here. But if you are using epoll/kqueue,
-	 * then you can return their descriptor. These descriptors can be polled
-	 * just like sockets and will return an event when any of their owned
-	 * descriptors has any events.
-	 *
-	 * For example, assume you created an epoll descriptor and added to
-	 * there a listen-socket and a few client-sockets. Now if you will call
-	 * poll() on the epoll's descriptor, then on return from poll() you can
-	 * be sure epoll_wait() can return something useful for some of those
-	 * sockets.
+	 * The epoll descriptor is readable when any of the sockets inside
+	 * has events. The ring's eventfd - when any operation is completed.
 	 */
-#endif
-	(void)server;
-	return -1;
+	if (server->backend == CHAT_SERVER_BACKEND_URING)
+		return server->shards[0].ring_event_fd;
+	return server->shards[0].epoll;
 }
 
 int
 chat_server_get_socket(const struct chat_server *server)
 {
-	return server->socket;
+	return server->shards[0].socket;
 }
 
 int
 chat_server_get_events(const struct chat_server *server)
 {
-	/*
-	 * IMPLEMENT THIS FUNCTION - add OUTPUT event if has non-empty output
-	 * buffer in any of the client-sockets.
-	 */
-	(void)server;
-	return CHAT_EVENT_INPUT;
+	const struct chat_shard *shard = &server->shards[0];
+	if (shard->socket < 0)
+		return 0;
+	int res = CHAT_EVENT_INPUT;
+	/* The ring sends without waiting for the socket to be writable. */
+	if (shard->output_peer_count > 0 &&
+	    server->backend != CHAT_SERVER_BACKEND_URING)
+		res |= CHAT_EVENT_OUTPUT;
+	return res;
 }
 
 int
@@ -137,3 +2370,538 @@ chat_server_feed(struct chat_server *server, const char *msg, uint32_t msg_size)
 	(void)msg_size;
 	return CHAT_ERR_NOT_IMPLEMENTED;
 }
+
+/** Type of a record in a handoff, its first byte. */
+enum chat_handoff_type {
+	/** A listening socket, with its descriptor. */
+	CHAT_HANDOFF_LISTENER,
+	/** A peer with its descriptor and its state. */
+	CHAT_HANDOFF_PEER,
+	/** A message of the history, the oldest goes first. */
+	CHAT_HANDOFF_HISTORY,
+	/** Nothing follows. */
+	CHAT_HANDOFF_END,
+};
+
+/** A peer received in a takeover. */
+struct chat_handoff_peer {
+	int socket;
+	enum chat_peer_mode mode;
+	/** The old server had the rooms. */
+	bool is_rooms;
+	/** The input not parsed yet, like a part of a message. */
+	std::string input;
+	/** The output not sent yet, as it goes on the wire. */
+	std::string output;
+	/** Rooms in the order of joining. */
+	std::vector<std::string> rooms;
+};
+
+/** A history message received in a takeover. */
+struct chat_handoff_message {
+	std::string data;
+	std::string room;
+	bool has_room;
+};
+
+/** Everything received in a takeover. */
+struct chat_handoff {
+	std::vector<int> listeners;
+	std::vector<struct chat_handoff_peer> peers;
+	std::vector<struct chat_handoff_message> history;
+	/** Received descriptors not yet taken by their records. */
+	std::deque<int> fds;
+};
+
+/** Close all the descriptors still owned by the handoff. */
+static void
+chat_handoff_close(struct chat_handoff *h)
+{
+	for (int fd : h->listeners) {
+		if (fd >= 0)
+			close(fd);
+	}
+	for (const struct chat_handoff_peer &peer : h->peers)
+		close(peer.socket);
+	for (int fd : h->fds)
+		close(fd);
+	h->listeners.clear();
+	h->peers.clear();
+	h->fds.clear();
+}
+
+static void
+chat_handoff_put_str(std::string *rec, std::string_view str)
+{
+	char header[CHAT_VARINT_MAX_SIZE];
+	rec->append(header, chat_varint_encode(str.size(), header));
+	rec->append(str);
+}
+
+static bool
+chat_handoff_get_byte(std::string_view *rec, uint8_t *value)
+{
+	if (rec->empty())
+		return false;
+	*value = (*rec)[0];
+	rec->remove_prefix(1);
+	return true;
+}
+
+static bool
+chat_handoff_get_varint(std::string_view *rec, uint64_t *value)
+{
+	*value = 0;
+	for (int i = 0; i < CHAT_VARINT_MAX_SIZE; ++i) {
+		uint8_t byte;
+		if (!chat_handoff_get_byte(rec, &byte))
+			return false;
+		*value |= (uint64_t)(byte & 0x7f) << (7 * i);
+		if ((byte & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
+
+static bool
+chat_handoff_get_str(std::string_view *rec, std::string *str)
+{
+	uint64_t size;
+	if (!chat_handoff_get_varint(rec, &size) || size > rec->size())
+		return false;
+	str->assign(rec->substr(0, size));
+	rec->remove_prefix(size);
+	return true;
+}
+
+/** Wait for the descriptor to be ready, when it is non-blocking. */
+static int
+chat_handoff_wait(int fd, short events)
+{
+	struct pollfd pfd = {fd, events, 0};
+	int rc = poll(&pfd, 1, -1);
+	return rc < 0 && errno != EINTR ? -1 : 0;
+}
+
+/**
+ * Send the record as a frame, with the descriptor if it is not -1. The
+ * descriptor goes with the first byte, so the receiver has it by the
+ * time the record is complete.
+ *
+ * @retval 0 Success.
+ * @retval -1 A system error, check errno.
+ */
+static int
+chat_handoff_send(int fd, std::string_view rec, int sock)
+{
+	std::string frame;
+	chat_handoff_put_str(&frame, rec);
+	size_t sent = 0;
+	while (sent < frame.size()) {
+		struct iovec iov;
+		iov.iov_base = &frame[sent];
+		iov.iov_len = frame.size() - sent;
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		char control[CMSG_SPACE(sizeof(int))];
+		if (sock >= 0 && sent == 0) {
+			memset(control, 0, sizeof(control));
+			mh.msg_control = control;
+			mh.msg_controllen = sizeof(control);
+			struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+			cm->cmsg_level = SOL_SOCKET;
+			cm->cmsg_type = SCM_RIGHTS;
+			cm->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cm), &sock, sizeof(int));
+		}
+		ssize_t rc = sendmsg(fd, &mh, MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (chat_handoff_wait(fd, POLLOUT) != 0)
+					return -1;
+				continue;
+			}
+			return -1;
+		}
+		sent += rc;
+	}
+	return 0;
+}
+
+/** Render the peer's not sent output as it would go on the wire. */
+static void
+chat_peer_render_output(const struct chat_peer *peer, std::string *out)
+{
+	size_t offset = peer->output_sent;
+	for (size_t i = 0; i < peer->output.size(); ++i) {
+		struct iovec iov[2];
+		int count = chat_slab_fill_iov(peer->output[i],
+					       chat_peer_slab_mode(peer, i),
+					       offset, iov);
+		for (int j = 0; j < count; ++j)
+			out->append((const char *)iov[j].iov_base, iov[j].iov_len);
+		offset = 0;
+	}
+}
+
+/**
+ * Wait for the zerocopy sends of the peer, until the deadline. The
+ * socket outlives the handoff, and the kernel would read the slabs sent
+ * from it after they are freed.
+ */
+static void
+chat_peer_drain_zerocopy(struct chat_shard *shard, struct chat_peer *peer,
+			 double deadline)
+{
+	while (!peer->zerocopy_refs.empty()) {
+		double now = chat_clock_now();
+		if (now >= deadline)
+			return;
+		/* The completions are reported as POLLERR. */
+		struct pollfd pfd = {peer->socket, 0, 0};
+		if (poll(&pfd, 1, chat_timeout_to_ms(deadline - now)) < 0 &&
+		    errno != EINTR)
+			return;
+		chat_peer_complete_zerocopy(shard, peer);
+	}
+}
+
+/** Send the peers of the shard, the listening socket is sent before. */
+static int
+chat_shard_handoff_peers(struct chat_shard *shard, int fd)
+{
+	bool is_rooms = shard->server->is_rooms;
+	std::string rec;
+	struct chat_peer *peer;
+	rlist_foreach_entry(peer, &shard->peers, in_peers) {
+		struct chat_input *in = &peer->input;
+		rec.clear();
+		rec.push_back(CHAT_HANDOFF_PEER);
+		rec.push_back(peer->mode);
+		rec.push_back(is_rooms);
+		chat_handoff_put_str(&rec, std::string_view(
+			in->data + in->begin, in->size - in->begin));
+		std::string output;
+		chat_peer_render_output(peer, &output);
+		chat_handoff_put_str(&rec, output);
+		char header[CHAT_VARINT_MAX_SIZE];
+		rec.append(header, chat_varint_encode(peer->rooms.size(),
+						      header));
+		for (const struct chat_membership &m : peer->rooms)
+			chat_handoff_put_str(&rec, m.room->name);
+		if (chat_handoff_send(fd, rec, peer->socket) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+int
+chat_server_handoff(struct chat_server *server, int fd)
+{
+	if (server->shards[0].socket < 0)
+		return CHAT_ERR_NOT_STARTED;
+	if (server->tls_ctx != NULL ||
+	    server->backend != CHAT_SERVER_BACKEND_EPOLL)
+		return CHAT_ERR_NOT_IMPLEMENTED;
+	/* The shards are touched by this thread only from now on. */
+	chat_server_stop(server);
+	double deadline = chat_clock_now() +
+			  CHAT_SERVER_HANDOFF_ZEROCOPY_WAIT_MS / 1000.0;
+	for (int i = 0; i < server->shard_count; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+		/* Nothing is left behind in the inboxes and the backlogs. */
+		if (shard->inbox_fd >= 0)
+			chat_shard_read_inbox(shard);
+		chat_shard_accept(shard, shard->socket);
+		struct chat_peer *peer;
+		rlist_foreach_entry(peer, &shard->peers, in_peers)
+			chat_peer_drain_zerocopy(shard, peer, deadline);
+	}
+	int rc = 0;
+	std::string rec(1, CHAT_HANDOFF_LISTENER);
+	for (int i = 0; i < server->shard_count && rc == 0; ++i)
+		rc = chat_handoff_send(fd, rec, server->shards[i].socket);
+	struct chat_shard *main = &server->shards[0];
+	size_t count = main->history.size();
+	for (size_t i = 0; i < count && rc == 0; ++i) {
+		const struct chat_slab *slab =
+			main->history[(main->history_pos + i) % count];
+		rec.assign(1, CHAT_HANDOFF_HISTORY);
+		rec.push_back(slab->has_room);
+		chat_handoff_put_str(&rec, slab->room);
+		chat_handoff_put_str(&rec, std::string_view(
+			slab->data.data(), slab->data.size() - 1));
+		rc = chat_handoff_send(fd, rec, -1);
+	}
+	for (int i = 0; i < server->shard_count && rc == 0; ++i)
+		rc = chat_shard_handoff_peers(&server->shards[i], fd);
+	rec.assign(1, CHAT_HANDOFF_END);
+	if (rc == 0)
+		rc = chat_handoff_send(fd, rec, -1);
+	if (rc != 0) {
+		/* Nothing is lost, this server keeps the clients. */
+		int err = errno;
+		chat_server_start(server);
+		errno = err;
+		return CHAT_ERR_SYS;
+	}
+	for (int i = 0; i < server->shard_count; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+		struct chat_peer *peer;
+		rlist_foreach_entry(peer, &shard->peers, in_peers) {
+			/*
+			 * Still can be read by the kernel, so they are leaked.
+			 * Besides, the drop of a peer with them resets the
+			 * connection, which is not this server's any more.
+			 */
+			peer->zerocopy_refs.clear();
+		}
+		chat_shard_close(shard);
+	}
+	return 0;
+}
+
+/**
+ * Take a record of a takeover.
+ *
+ * @retval 0 Success.
+ * @retval 1 The end record.
+ * @retval -1 The record is broken.
+ */
+static int
+chat_handoff_parse(struct chat_handoff *h, std::string_view rec)
+{
+	uint8_t type;
+	if (!chat_handoff_get_byte(&rec, &type))
+		return -1;
+	if (type == CHAT_HANDOFF_END)
+		return 1;
+	if (type == CHAT_HANDOFF_HISTORY) {
+		struct chat_handoff_message msg;
+		uint8_t has_room;
+		if (!chat_handoff_get_byte(&rec, &has_room) ||
+		    !chat_handoff_get_str(&rec, &msg.room) ||
+		    !chat_handoff_get_str(&rec, &msg.data))
+			return -1;
+		msg.has_room = has_room != 0;
+		h->history.push_back(std::move(msg));
+		return 0;
+	}
+	if ((type != CHAT_HANDOFF_LISTENER && type != CHAT_HANDOFF_PEER) ||
+	    h->fds.empty())
+		return -1;
+	int sock = h->fds.front();
+	h->fds.pop_front();
+	if (type == CHAT_HANDOFF_LISTENER) {
+		h->listeners.push_back(sock);
+		return 0;
+	}
+	h->peers.emplace_back();
+	struct chat_handoff_peer *peer = &h->peers.back();
+	peer->socket = sock;
+	uint8_t mode, is_rooms;
+	uint64_t room_count;
+	if (!chat_handoff_get_byte(&rec, &mode) ||
+	    mode > CHAT_PEER_MODE_DEFLATE ||
+	    !chat_handoff_get_byte(&rec, &is_rooms) ||
+	    !chat_handoff_get_str(&rec, &peer->input) ||
+	    !chat_handoff_get_str(&rec, &peer->output) ||
+	    !chat_handoff_get_varint(&rec, &room_count) ||
+	    room_count > rec.size())
+		return -1;
+	peer->mode = (enum chat_peer_mode)mode;
+	peer->is_rooms = is_rooms != 0;
+	peer->rooms.resize(room_count);
+	for (std::string &room : peer->rooms) {
+		if (!chat_handoff_get_str(&rec, &room))
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Receive all the records of a takeover.
+ *
+ * @retval 0 Success.
+ * @retval -1 A system error, check errno. EPROTO - broken data.
+ */
+static int
+chat_handoff_recv(int fd, struct chat_handoff *h)
+{
+	struct chat_input in;
+	while (true) {
+		std::string_view rec;
+		int rc;
+		while ((rc = chat_input_pop_frame(&in, &rec)) == 1) {
+			rc = chat_handoff_parse(h, rec);
+			if (rc < 0)
+				break;
+			if (rc == 1)
+				return 0;
+		}
+		if (rc < 0) {
+			errno = EPROTO;
+			return -1;
+		}
+		chat_input_reserve(&in, CHAT_SERVER_READ_SIZE);
+		struct iovec iov;
+		iov.iov_base = in.data + in.size;
+		iov.iov_len = in.capacity - in.size;
+		/* Each send carries a descriptor at most. */
+		char control[CMSG_SPACE(sizeof(int) * 4)];
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		ssize_t size = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+		if (size < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (chat_handoff_wait(fd, POLLIN) != 0)
+					return -1;
+				continue;
+			}
+			return -1;
+		}
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm != NULL;
+		     cm = CMSG_NXTHDR(&mh, cm)) {
+			if (cm->cmsg_level != SOL_SOCKET ||
+			    cm->cmsg_type != SCM_RIGHTS)
+				continue;
+			size_t count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (size_t i = 0; i < count; ++i) {
+				int sock;
+				memcpy(&sock, CMSG_DATA(cm) + i * sizeof(int),
+				       sizeof(int));
+				h->fds.push_back(sock);
+			}
+		}
+		if (size == 0 || (mh.msg_flags & MSG_CTRUNC) != 0) {
+			errno = EPROTO;
+			return -1;
+		}
+		in.size += size;
+	}
+}
+
+/**
+ * Add a peer of the old server. It keeps its framing and rooms, and gets
+ * the rest of its old output before anything new.
+ */
+static struct chat_peer *
+chat_shard_adopt_peer(struct chat_shard *shard,
+		      const struct chat_handoff_peer *state)
+{
+	struct chat_peer *peer = chat_peer_new(state->socket);
+	if (chat_shard_watch_peer(shard, peer) != 0) {
+		close(peer->socket);
+		delete peer;
+		return NULL;
+	}
+	/* Or the ignored MSG_ZEROCOPY would never complete. */
+	if (shard->is_zerocopy)
+		chat_socket_set_int(peer->socket, SOL_SOCKET, SO_ZEROCOPY, 1);
+	peer->mode = state->mode;
+	chat_peer_touch(shard, peer);
+	rlist_add_tail(&shard->peers, &peer->in_peers);
+	++shard->peer_count;
+	chat_stat_add(&shard->stats.peer_count, 1);
+	if (shard->server->is_rooms) {
+		if (!state->is_rooms)
+			chat_peer_join(shard, peer, std::string_view());
+		for (const std::string &room : state->rooms)
+			chat_peer_join(shard, peer, room);
+	}
+	if (!state->input.empty()) {
+		struct chat_input *in = &peer->input;
+		chat_input_reserve(in, state->input.size());
+		memcpy(in->data, state->input.data(), state->input.size());
+		in->size = state->input.size();
+	}
+	if (!state->output.empty())
+		chat_peer_push(shard, peer, chat_slab_new_raw(state->output));
+	return peer;
+}
+
+int
+chat_server_takeover(struct chat_server *server, int fd)
+{
+	if (server->shards[0].socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (server->tls_ctx != NULL ||
+	    server->backend != CHAT_SERVER_BACKEND_EPOLL)
+		return CHAT_ERR_NOT_IMPLEMENTED;
+	struct chat_handoff h;
+	if (chat_handoff_recv(fd, &h) != 0 || h.listeners.empty()) {
+		int err = h.listeners.empty() ? EPROTO : errno;
+		chat_handoff_close(&h);
+		errno = err;
+		return CHAT_ERR_SYS;
+	}
+	/*
+	 * The shards take the old listening sockets. The extra shards share
+	 * them, and the extra sockets are drained and closed below.
+	 */
+	int count = server->shard_count;
+	int listener_count = h.listeners.size();
+	int rc = 0;
+	for (int i = 0; i < count && rc == 0; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+		if (i < listener_count) {
+			shard->socket = h.listeners[i];
+			h.listeners[i] = -1;
+		} else {
+			shard->socket = fcntl(
+				server->shards[i % listener_count].socket,
+				F_DUPFD_CLOEXEC, 0);
+		}
+		if (shard->socket < 0 || chat_shard_set_options(shard) != 0)
+			rc = CHAT_ERR_SYS;
+		else
+			rc = chat_shard_open_epoll(shard);
+	}
+	if (rc != 0) {
+		int err = errno;
+		for (int i = 0; i < count; ++i)
+			chat_shard_close(&server->shards[i]);
+		chat_handoff_close(&h);
+		errno = err;
+		return rc;
+	}
+	for (const struct chat_handoff_message &msg : h.history) {
+		struct chat_slab *slab = chat_slab_new(msg.data);
+		slab->room = msg.room;
+		slab->has_room = msg.has_room;
+		for (int i = 0; i < count; ++i)
+			chat_shard_remember(&server->shards[i], slab);
+		chat_slab_unref(slab);
+	}
+	std::vector<std::pair<struct chat_shard *, struct chat_peer *>> peers;
+	for (size_t i = 0; i < h.peers.size(); ++i) {
+		struct chat_shard *shard = &server->shards[i % count];
+		struct chat_peer *peer = chat_shard_adopt_peer(shard,
+							       &h.peers[i]);
+		if (peer != NULL)
+			peers.push_back({shard, peer});
+	}
+	h.peers.clear();
+	for (int i = listener_count - 1; i >= count; --i) {
+		chat_shard_accept(&server->shards[i % count], h.listeners[i]);
+		close(h.listeners[i]);
+		h.listeners.pop_back();
+	}
+	/* The old server could have a part of a message, or a whole one. */
+	for (auto &[shard, peer] : peers) {
+		if (peer->input.size > 0 && chat_peer_parse(shard, peer) != 0)
+			chat_peer_delete(shard, peer);
+	}
+	chat_server_start(server);
+	return 0;
+}
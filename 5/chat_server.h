@@ -1,7 +1,10 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
+#include <vector>
 
+struct chat_message;
 struct chat_server;
 
 /**
@@ -11,6 +14,33 @@ struct chat_server;
 struct chat_server *
 chat_server_new(void);
 
+enum {
+	/** Max number of threads serving the clients of one server. */
+	CHAT_SERVER_MAX_THREADS = 64,
+};
+
+/**
+ * Create a new chat server served by the given number of threads. Each
+ * thread has its own listening socket on the same port (SO_REUSEPORT),
+ * its own epoll and its own clients. The kernel balances new clients
+ * between the threads. Broadcasts between the threads go via lock-free
+ * inboxes.
+ *
+ * The calling thread is one of them: its part of the server is served
+ * by chat_server_update(). All the messages from all the threads are
+ * popped from chat_server_pop_next() in that thread. The descriptor and
+ * the events of the server are about that thread's part too. Other
+ * threads are started by chat_server_listen().
+ *
+ * @param thread_count Number of threads, 1 is the same as
+ *     chat_server_new().
+ *
+ * @retval not-NULL A new server.
+ * @retval NULL The thread count is not in [1, CHAT_SERVER_MAX_THREADS].
+ */
+struct chat_server *
+chat_server_new_ex(int thread_count);
+
 /** Free all server's resources. */
 void
 chat_server_delete(struct chat_server *server);
@@ -25,11 +55,319 @@ chat_server_delete(struct chat_server *server);
  * @retval !=0 Error code.
  *     - CHAT_ERR_PORT_BUSY - the port is already busy.
  *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - TLS is set with the io_uring backend.
  *     - CHAT_ERR_SYS - a system error, check errno.
  */
 int
 chat_server_listen(struct chat_server *server, uint16_t port);
 
+enum chat_server_backend {
+	/** Readiness events from epoll. The default. */
+	CHAT_SERVER_BACKEND_EPOLL,
+	/**
+	 * Completions from io_uring: multishot accept, multishot receive
+	 * into the buffers provided to the kernel, and asynchronous sends.
+	 * One update makes one or two system calls regardless of how many
+	 * messages it handles. Linux 6.0+.
+	 */
+	CHAT_SERVER_BACKEND_URING,
+};
+
+/**
+ * Choose how the server waits for and does the IO. Can't be changed after
+ * listen.
+ *
+ * With io_uring the server's descriptor is an eventfd signaled on each
+ * completion, and the server never wants CHAT_EVENT_OUTPUT, because the
+ * sends are done by the kernel.
+ *
+ * @param server Chat server.
+ * @param backend The backend.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - the kernel doesn't support it.
+ */
+int
+chat_server_set_backend(struct chat_server *server,
+			enum chat_server_backend backend);
+
+/** Limits of a peer's output not yet taken by the client. */
+struct chat_server_limits {
+	/**
+	 * Output size above which no new messages are queued for the peer,
+	 * they are dropped. 0 means no limit.
+	 */
+	size_t output_high_mark;
+	/**
+	 * Output size to which a peer above the high mark has to go down to
+	 * get new messages again.
+	 */
+	size_t output_low_mark;
+	/** Output size above which the peer is disconnected. 0 - no limit. */
+	size_t output_hard_cap;
+};
+
+/**
+ * Set the output limits of every peer. Protects the server from clients
+ * which don't read their messages. By default there are no limits.
+ *
+ * @param server Chat server.
+ * @param limits New limits.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the low mark is above the high one.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_limits(struct chat_server *server,
+		       const struct chat_server_limits *limits);
+
+/**
+ * Socket options of the server. They are set on the listening sockets,
+ * and the accepted ones inherit them, so it costs nothing per client. 0
+ * means the system default for each of them.
+ */
+struct chat_server_options {
+	/** Max number of not yet accepted clients. 0 - SOMAXCONN. */
+	int backlog;
+	/**
+	 * Send the small messages right away, without waiting for the
+	 * previous data to be acknowledged (TCP_NODELAY).
+	 */
+	bool no_delay;
+	/** Sizes of the kernel buffers of each client's socket. */
+	int send_buffer_size;
+	int recv_buffer_size;
+	/**
+	 * Accept a client only when its first data comes, but not later than
+	 * in this many seconds (TCP_DEFER_ACCEPT). The idle connections
+	 * don't wake the server up then.
+	 */
+	int defer_accept_sec;
+	/**
+	 * Busy poll the device queue for this many microseconds when a read
+	 * has no data (SO_BUSY_POLL). Can require CAP_NET_ADMIN.
+	 */
+	int busy_poll_usec;
+	/**
+	 * Send with MSG_ZEROCOPY when a peer has at least this many bytes
+	 * to send at once. 0 - never. The pages of the broadcast messages
+	 * are pinned instead of copied into the socket, and the messages
+	 * are kept until the kernel reports the sends done. Pays off for
+	 * the big messages only. Not with TLS nor with io_uring, and on
+	 * loopback the kernel copies anyway.
+	 */
+	size_t zerocopy_threshold;
+};
+
+/**
+ * Set the socket options. By default everything is the system default
+ * except the backlog, which is SOMAXCONN.
+ *
+ * @param server Chat server.
+ * @param options New options.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - a negative value.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_options(struct chat_server *server,
+			const struct chat_server_options *options);
+
+/**
+ * Encrypt all the connections with TLS. The handshake of each client is
+ * done by OpenSSL without blocking the other clients, and then the crypto
+ * is moved into the kernel (kTLS). After that the messages go with the
+ * same sendmsg() as without TLS, still one copy per broadcast and no
+ * copies in user space. Only with the epoll backend.
+ *
+ * @param server Chat server.
+ * @param cert_file PEM file with the certificate chain.
+ * @param key_file PEM file with the private key.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - no OpenSSL or no kTLS in the kernel.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the files can't be loaded.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_tls(struct chat_server *server, const char *cert_file,
+		    const char *key_file);
+
+/**
+ * Enable the rooms. Then each peer is a member of a set of rooms, and a
+ * message goes only to the members of the room it is posted to. The cost
+ * of a broadcast is the size of the room, not of the whole server.
+ *
+ * The peers manage their rooms with messages, which are not broadcast:
+ *     - "/join <room>" - become a member of the room and post there from
+ *       now on;
+ *     - "/leave <room>" - stop being a member. The posts go to the last
+ *       joined room left, or nowhere if there are none.
+ * A new peer is in the room with the empty name, so without the commands
+ * everything works as without the rooms. chat_server_pop_next() still
+ * returns the messages of all the rooms.
+ *
+ * @param server Chat server.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_enable_rooms(struct chat_server *server);
+
+/**
+ * Keep the last messages and send them to each new client before the new
+ * ones, so it sees what was said before it came. The history keeps the
+ * same buffers as the broadcasts, so it costs no copies, and each message
+ * is stored once for the whole server. With the rooms a new client gets
+ * only the history of the room with the empty name, the one it starts
+ * in.
+ *
+ * @param server Chat server.
+ * @param count Max number of messages to keep. 0 - no history, the
+ *     default.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_history(struct chat_server *server, size_t count);
+
+/**
+ * Compress the messages going to the clients which ask for it with the
+ * deflate hello. Each broadcast is compressed once, on the first send to
+ * such a client, and all of them in all the shards get the same buffer.
+ * The clients which don't ask get the messages as before. Only the
+ * egress is compressed, the clients send the plain binary frames.
+ *
+ * @param server Chat server.
+ * @param level zlib compression level, 1 - fastest, 9 - smallest. 0 -
+ *     no compression, the default. Then the deflate hello gets the
+ *     binary one in response.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the level is out of the range.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - built without zlib.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_compression(struct chat_server *server, int level);
+
+/** Timeouts of the peers, in seconds. 0 means no timeout. */
+struct chat_server_timeouts {
+	/** Time without any input after which a peer is disconnected. */
+	double idle_timeout;
+	/**
+	 * Time without any input after which a peer is sent a ping, and then
+	 * again after each such interval. The ping is an empty message, the
+	 * clients skip it. It makes a dead connection fail on the send even
+	 * if the peer never sends anything.
+	 */
+	double ping_interval;
+};
+
+/**
+ * Set the peer timeouts. They are checked during the updates, which never
+ * sleep past the nearest deadline. Every shard has its peers ordered by
+ * the deadlines, so an update touches only the expired ones. By default
+ * there are no timeouts.
+ *
+ * @param server Chat server.
+ * @param timeouts New timeouts.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_INVALID_ARGUMENT - a negative value.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ */
+int
+chat_server_set_timeouts(struct chat_server *server,
+			 const struct chat_server_timeouts *timeouts);
+
+/**
+ * Hand the server over to another process, like a new version of it,
+ * with no reconnects. The listening sockets and the connected peers are
+ * sent through @a fd, a connected UNIX stream socket, and the other
+ * process takes them with chat_server_takeover(). Each peer goes with
+ * its framing, rooms, not parsed input, and not sent output. The history
+ * goes too. The clients see nothing, at most a pause.
+ *
+ * The call blocks until everything is sent, so the other side has to be
+ * reading. Then this server is not listening anymore, and can only be
+ * deleted, or listen anew. The messages not popped yet stay in it. On
+ * failure it goes on serving the clients as before.
+ *
+ * @param server Chat server.
+ * @param fd UNIX socket to send to.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_NOT_STARTED - the server is not listening.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - with TLS or the io_uring backend.
+ *     - CHAT_ERR_SYS - a system error, check errno.
+ */
+int
+chat_server_handoff(struct chat_server *server, int fd);
+
+/**
+ * Take the listening sockets and the peers handed over by
+ * chat_server_handoff() in another process, instead of listening. The
+ * settings of this server apply to them, and the shards don't have to
+ * match: the peers are spread over the shards, and the extra listening
+ * sockets are drained and closed. A peer which got compressed messages
+ * keeps getting the compressed frames, stored as is if this server has
+ * no compression. Blocks until everything is received.
+ *
+ * @param server Chat server.
+ * @param fd UNIX socket to receive from.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - with TLS or the io_uring backend.
+ *     - CHAT_ERR_SYS - a system error, check errno. EPROTO - the data
+ *       is broken.
+ */
+int
+chat_server_takeover(struct chat_server *server, int fd);
+
+struct chat_server_stats {
+	/** Connected peers. */
+	uint64_t peer_count;
+	/** Peers above the high mark right now. */
+	uint64_t lagging_count;
+	/** Messages not queued for the peers above the high mark. */
+	uint64_t dropped_count;
+	/** Peers disconnected for going above the hard cap. */
+	uint64_t evicted_count;
+	/** Peers disconnected for being idle. */
+	uint64_t expired_count;
+	/** Sends done with MSG_ZEROCOPY. */
+	uint64_t zerocopy_count;
+	/** Peers whose zerocopy sends the kernel had to copy anyway. */
+	uint64_t zerocopy_copied_count;
+	/** Messages compressed, once per broadcast for all the peers. */
+	uint64_t deflate_count;
+};
+
+/**
+ * Get the server's statistics. Can be called from any thread, the values
+ * are gathered from all the server's threads.
+ */
+void
+chat_server_stats(const struct chat_server *server,
+		  struct chat_server_stats *stats);
+
 /**
  * Pop a next pending chat message. The returned message has to be
  * freed using chat_message_delete().
@@ -42,6 +380,22 @@ chat_server_listen(struct chat_server *server, uint16_t port);
 struct chat_message *
 chat_server_pop_next(struct chat_server *server);
 
+/**
+ * Pop up to @a max pending chat messages at once. The messages are moved
+ * to the end of @a out. Unlike with chat_server_pop_next(), nothing is
+ * allocated per message, and a vector reused between the calls keeps its
+ * memory.
+ *
+ * @param server Chat server.
+ * @param out Vector to append the messages to.
+ * @param max Max number of messages to pop.
+ *
+ * @return Number of the popped messages.
+ */
+size_t
+chat_server_pop_batch(struct chat_server *server,
+		      std::vector<struct chat_message> *out, size_t max);
+
 /**
  * Wait for any update on any of the sockets for the given timeout
  * and do this update.
@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static int
 port_from_str(const char *str, uint16_t *port)
@@ -26,7 +27,8 @@ int
 main(int argc, char **argv)
 {
 	if (argc < 2) {
-		printf("Expected a port to listen on\n");
+		printf("Expected a port to listen on and optionally a "
+		       "thread count and 'uring'\n");
 		return -1;
 	}
 	uint16_t port = 0;
@@ -35,7 +37,20 @@ main(int argc, char **argv)
 		printf("Invalid port\n");
 		return -1;
 	}
-	struct chat_server *serv = chat_server_new();
+	int thread_count = argc >= 3 ? atoi(argv[2]) : 1;
+	struct chat_server *serv = chat_server_new_ex(thread_count);
+	if (serv == NULL) {
+		printf("Invalid thread count\n");
+		return -1;
+	}
+	if (argc >= 4 && strcmp(argv[3], "uring") == 0) {
+		rc = chat_server_set_backend(serv, CHAT_SERVER_BACKEND_URING);
+		if (rc != 0) {
+			printf("Couldn't use io_uring: %d\n", rc);
+			chat_server_delete(serv);
+			return -1;
+		}
+	}
 	rc = chat_server_listen(serv, port);
 	if (rc != 0) {
 		printf("Couldn't listen: %d\n", rc);
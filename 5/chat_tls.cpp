@@ -0,0 +1,241 @@
+#include "chat_tls.h"
+
+#include <stddef.h>
+
+#if CHAT_HAVE_TLS
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+struct chat_tls_ctx {
+	SSL_CTX *ctx;
+	bool is_server;
+};
+
+struct chat_tls {
+	SSL *ssl;
+};
+
+bool
+chat_tls_is_supported(void)
+{
+	/* Check if the kernel takes the keys of a connected TCP socket. */
+	int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener < 0)
+		return false;
+	int sock = -1;
+	bool res = false;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(listener, 1) != 0 ||
+	    getsockname(listener, (struct sockaddr *)&addr, &len) != 0)
+		goto end;
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0 ||
+	    connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		goto end;
+	res = setsockopt(sock, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+end:
+	if (sock >= 0)
+		close(sock);
+	close(listener);
+	return res;
+}
+
+/** Settings of both sides: only what the kernel can take over. */
+static SSL_CTX *
+chat_tls_ctx_create(const SSL_METHOD *method)
+{
+	SSL_CTX *ctx = SSL_CTX_new(method);
+	if (ctx == NULL)
+		return NULL;
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+	/* Older OpenSSL can't give TLS 1.3 receive keys to the kernel. */
+	SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+#endif
+	if (SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20") != 1 ||
+	    SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:"
+				     "TLS_AES_256_GCM_SHA384:"
+				     "TLS_CHACHA20_POLY1305_SHA256") != 1) {
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+struct chat_tls_ctx *
+chat_tls_ctx_new_server(const char *cert_file, const char *key_file)
+{
+	SSL_CTX *ctx = chat_tls_ctx_create(TLS_server_method());
+	if (ctx == NULL)
+		return NULL;
+	/*
+	 * The tickets would come to the client after the handshake, as
+	 * records the kernel doesn't pass to a plain recv().
+	 */
+	SSL_CTX_set_num_tickets(ctx, 0);
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key(ctx) != 1) {
+		ERR_clear_error();
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+	struct chat_tls_ctx *res = new chat_tls_ctx();
+	res->ctx = ctx;
+	res->is_server = true;
+	return res;
+}
+
+struct chat_tls_ctx *
+chat_tls_ctx_new_client(const char *ca_file)
+{
+	SSL_CTX *ctx = chat_tls_ctx_create(TLS_client_method());
+	if (ctx == NULL)
+		return NULL;
+	if (ca_file != NULL) {
+		if (SSL_CTX_load_verify_locations(ctx, ca_file, NULL) != 1) {
+			ERR_clear_error();
+			SSL_CTX_free(ctx);
+			return NULL;
+		}
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	}
+	struct chat_tls_ctx *res = new chat_tls_ctx();
+	res->ctx = ctx;
+	res->is_server = false;
+	return res;
+}
+
+void
+chat_tls_ctx_delete(struct chat_tls_ctx *ctx)
+{
+	SSL_CTX_free(ctx->ctx);
+	delete ctx;
+}
+
+struct chat_tls *
+chat_tls_new(struct chat_tls_ctx *ctx, int sock, const char *host)
+{
+	SSL *ssl = SSL_new(ctx->ctx);
+	if (ssl == NULL)
+		return NULL;
+	if (SSL_set_fd(ssl, sock) != 1)
+		goto error;
+	if (ctx->is_server) {
+		SSL_set_accept_state(ssl);
+	} else {
+		if (host != NULL &&
+		    (SSL_set_tlsext_host_name(ssl, host) != 1 ||
+		     SSL_set1_host(ssl, host) != 1))
+			goto error;
+		SSL_set_connect_state(ssl);
+	}
+	{
+		struct chat_tls *tls = new chat_tls();
+		tls->ssl = ssl;
+		return tls;
+	}
+error:
+	ERR_clear_error();
+	SSL_free(ssl);
+	return NULL;
+}
+
+enum chat_tls_status
+chat_tls_handshake(struct chat_tls *tls)
+{
+	int rc = SSL_do_handshake(tls->ssl);
+	if (rc == 1) {
+		/* Without the kernel in both directions it is not usable. */
+		if (BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) &&
+		    BIO_get_ktls_recv(SSL_get_rbio(tls->ssl)))
+			return CHAT_TLS_DONE;
+		return CHAT_TLS_ERROR;
+	}
+	switch (SSL_get_error(tls->ssl, rc)) {
+	case SSL_ERROR_WANT_READ:
+		return CHAT_TLS_WANT_READ;
+	case SSL_ERROR_WANT_WRITE:
+		return CHAT_TLS_WANT_WRITE;
+	default:
+		ERR_clear_error();
+		return CHAT_TLS_ERROR;
+	}
+}
+
+void
+chat_tls_delete(struct chat_tls *tls)
+{
+	/*
+	 * No shutdown, the socket stays open and the kernel keeps the keys.
+	 * The socket is not closed either, it was set with BIO_NOCLOSE.
+	 */
+	SSL_free(tls->ssl);
+	delete tls;
+}
+
+#else /* !CHAT_HAVE_TLS */
+
+bool
+chat_tls_is_supported(void)
+{
+	return false;
+}
+
+struct chat_tls_ctx *
+chat_tls_ctx_new_server(const char *cert_file, const char *key_file)
+{
+	(void)cert_file;
+	(void)key_file;
+	return NULL;
+}
+
+struct chat_tls_ctx *
+chat_tls_ctx_new_client(const char *ca_file)
+{
+	(void)ca_file;
+	return NULL;
+}
+
+void
+chat_tls_ctx_delete(struct chat_tls_ctx *ctx)
+{
+	(void)ctx;
+}
+
+struct chat_tls *
+chat_tls_new(struct chat_tls_ctx *ctx, int sock, const char *host)
+{
+	(void)ctx;
+	(void)sock;
+	(void)host;
+	return NULL;
+}
+
+enum chat_tls_status
+chat_tls_handshake(struct chat_tls *tls)
+{
+	(void)tls;
+	return CHAT_TLS_ERROR;
+}
+
+void
+chat_tls_delete(struct chat_tls *tls)
+{
+	(void)tls;
+}
+
+#endif /* !CHAT_HAVE_TLS */
@@ -0,0 +1,83 @@
+#pragma once
+
+/**
+ * TLS with the crypto in the kernel (kTLS). The handshake is done by
+ * OpenSSL, and then the keys are given to the socket. After that the
+ * socket is used with the plain send/recv/sendmsg, and the kernel
+ * encrypts and decrypts in place, without any copies in user space.
+ *
+ * Without OpenSSL at build time or kTLS in the kernel nothing is
+ * supported.
+ */
+struct chat_tls_ctx;
+struct chat_tls;
+
+enum chat_tls_status {
+	/** The handshake is done, the socket is encrypted by the kernel. */
+	CHAT_TLS_DONE,
+	/** The socket has to become readable to continue. */
+	CHAT_TLS_WANT_READ,
+	/** The socket has to become writable to continue. */
+	CHAT_TLS_WANT_WRITE,
+	/** The handshake failed or the kernel didn't take the keys. */
+	CHAT_TLS_ERROR,
+};
+
+/**
+ * Check if the library is built with OpenSSL and the kernel has kTLS.
+ * Costs a few system calls.
+ */
+bool
+chat_tls_is_supported(void);
+
+/**
+ * Create a context for the server side.
+ *
+ * @param cert_file PEM file with the certificate chain.
+ * @param key_file PEM file with the private key.
+ *
+ * @retval not-NULL The context.
+ * @retval NULL The files can't be loaded or don't match.
+ */
+struct chat_tls_ctx *
+chat_tls_ctx_new_server(const char *cert_file, const char *key_file);
+
+/**
+ * Create a context for the client side.
+ *
+ * @param ca_file PEM file with the certificates to verify the server
+ *     with. NULL - no verification, only the encryption.
+ *
+ * @retval not-NULL The context.
+ * @retval NULL The file can't be loaded.
+ */
+struct chat_tls_ctx *
+chat_tls_ctx_new_client(const char *ca_file);
+
+void
+chat_tls_ctx_delete(struct chat_tls_ctx *ctx);
+
+/**
+ * Start a handshake on a connected socket. The socket can be blocking or
+ * not, it is never closed by the handshake.
+ *
+ * @param ctx Context, defines the side.
+ * @param sock Socket.
+ * @param host Server's name for the client side, NULL for the server.
+ *
+ * @retval not-NULL The handshake.
+ * @retval NULL Memory error.
+ */
+struct chat_tls *
+chat_tls_new(struct chat_tls_ctx *ctx, int sock, const char *host);
+
+/**
+ * Continue the handshake. On a blocking socket it is done in one call.
+ * The handshake can be deleted once it is done, the socket keeps the
+ * kernel encryption.
+ */
+enum chat_tls_status
+chat_tls_handshake(struct chat_tls *tls);
+
+void
+chat_tls_delete(struct chat_tls *tls);
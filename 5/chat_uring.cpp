@@ -0,0 +1,286 @@
+#include "chat_uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int
+chat_uring_sys_setup(unsigned entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+chat_uring_sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+		     unsigned flags, void *arg, size_t arg_size)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       arg, arg_size);
+}
+
+static int
+chat_uring_sys_register(int fd, unsigned opcode, void *arg, unsigned count)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+int
+chat_uring_create(struct chat_uring *ring, unsigned entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	/* Completions of many sends and receives per one submission. */
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = entries * 4;
+	int fd = chat_uring_sys_setup(entries, &params);
+	if (fd < 0)
+		return -1;
+	if ((params.features & IORING_FEAT_EXT_ARG) == 0 ||
+	    (params.features & IORING_FEAT_NODROP) == 0 ||
+	    (params.features & IORING_FEAT_CQE_SKIP) == 0) {
+		close(fd);
+		errno = ENOSYS;
+		return -1;
+	}
+	ring->fd = fd;
+	ring->sq_map_size = params.sq_off.array +
+			    params.sq_entries * sizeof(unsigned);
+	ring->cq_map_size = params.cq_off.cqes +
+			    params.cq_entries * sizeof(struct io_uring_cqe);
+	bool is_single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (is_single) {
+		if (ring->cq_map_size > ring->sq_map_size)
+			ring->sq_map_size = ring->cq_map_size;
+		ring->cq_map_size = ring->sq_map_size;
+	}
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED) {
+		ring->sq_map = NULL;
+		goto error;
+	}
+	if (is_single) {
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = mmap(NULL, ring->cq_map_size,
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, fd,
+				    IORING_OFF_CQ_RING);
+		if (ring->cq_map == MAP_FAILED) {
+			ring->cq_map = NULL;
+			goto error;
+		}
+	}
+	ring->sqes_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *)mmap(
+		NULL, ring->sqes_map_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto error;
+	}
+	{
+		char *sq = (char *)ring->sq_map;
+		char *cq = (char *)ring->cq_map;
+		ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+		ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+		ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+		ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+		ring->sq_entries = params.sq_entries;
+		ring->sq_local_tail = *ring->sq_tail;
+		ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+		ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+		ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+		ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	}
+	/* The entries go to the array in order, so fill it once. */
+	for (unsigned i = 0; i < ring->sq_entries; ++i)
+		ring->sq_array[i] = i;
+	return 0;
+error:
+	int err = errno;
+	chat_uring_destroy(ring);
+	errno = err;
+	return -1;
+}
+
+void
+chat_uring_destroy(struct chat_uring *ring)
+{
+	if (ring->sqes != NULL)
+		munmap(ring->sqes, ring->sqes_map_size);
+	if (ring->cq_map != NULL && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+	if (ring->sq_map != NULL)
+		munmap(ring->sq_map, ring->sq_map_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	*ring = chat_uring();
+}
+
+/** Make the prepared entries visible to the kernel. */
+static unsigned
+chat_uring_flush(struct chat_uring *ring)
+{
+	unsigned tail = *ring->sq_tail;
+	if (tail == ring->sq_local_tail)
+		return 0;
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	return ring->sq_local_tail - tail;
+}
+
+struct io_uring_sqe *
+chat_uring_get_sqe(struct chat_uring *ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head >= ring->sq_entries) {
+		if (chat_uring_submit(ring) != 0)
+			return NULL;
+	}
+	struct io_uring_sqe *sqe =
+		&ring->sqes[ring->sq_local_tail & ring->sq_mask];
+	++ring->sq_local_tail;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int
+chat_uring_enter(struct chat_uring *ring, int timeout_ms)
+{
+	unsigned to_submit = chat_uring_flush(ring);
+	unsigned min_complete = timeout_ms != 0 ? 1 : 0;
+	if (chat_uring_peek(ring) != NULL)
+		min_complete = 0;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	if (timeout_ms > 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+	/* Running the completions is needed even without waiting. */
+	while (chat_uring_sys_enter(ring->fd, to_submit, min_complete,
+				    IORING_ENTER_GETEVENTS |
+				    IORING_ENTER_EXT_ARG,
+				    &arg, sizeof(arg)) < 0) {
+		/*
+		 * EBUSY - too many completions are not reaped yet. All the
+		 * new entries will be submitted the next time.
+		 */
+		if (errno == ETIME || errno == EINTR || errno == EBUSY)
+			return 0;
+		if (errno != EAGAIN)
+			return -1;
+	}
+	return 0;
+}
+
+int
+chat_uring_submit(struct chat_uring *ring)
+{
+	unsigned to_submit = chat_uring_flush(ring);
+	if (to_submit == 0)
+		return 0;
+	while (chat_uring_sys_enter(ring->fd, to_submit, 0, 0, NULL, 0) < 0) {
+		if (errno == EBUSY)
+			return 0;
+		if (errno != EINTR && errno != EAGAIN)
+			return -1;
+	}
+	return 0;
+}
+
+struct io_uring_cqe *
+chat_uring_peek(struct chat_uring *ring)
+{
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+void
+chat_uring_advance(struct chat_uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int
+chat_uring_register_eventfd(struct chat_uring *ring, int fd)
+{
+	if (chat_uring_sys_register(ring->fd, IORING_REGISTER_EVENTFD, &fd,
+				    1) < 0)
+		return -1;
+	return 0;
+}
+
+/** Give the buffers [id, id + count) to the kernel. */
+static int
+chat_uring_bufs_provide(struct chat_uring *ring, struct chat_uring_bufs *bufs,
+			unsigned id, unsigned count)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(ring);
+	if (sqe == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = count;
+	sqe->addr = (uint64_t)(uintptr_t)chat_uring_bufs_get(bufs, id);
+	sqe->len = bufs->size;
+	sqe->off = id;
+	sqe->buf_group = bufs->group;
+	sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+	sqe->user_data = bufs->user_data;
+	return 0;
+}
+
+int
+chat_uring_bufs_create(struct chat_uring *ring, struct chat_uring_bufs *bufs,
+		       uint16_t group, unsigned count, unsigned size,
+		       uint64_t user_data)
+{
+	bufs->data = new char[(size_t)count * size];
+	bufs->count = count;
+	bufs->size = size;
+	bufs->group = group;
+	bufs->user_data = user_data;
+	if (chat_uring_bufs_provide(ring, bufs, 0, count) != 0) {
+		int err = errno;
+		chat_uring_bufs_destroy(bufs);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+void
+chat_uring_bufs_destroy(struct chat_uring_bufs *bufs)
+{
+	delete[] bufs->data;
+	*bufs = chat_uring_bufs();
+}
+
+int
+chat_uring_bufs_put(struct chat_uring *ring, struct chat_uring_bufs *bufs,
+		    unsigned id)
+{
+	return chat_uring_bufs_provide(ring, bufs, id, 1);
+}
+
+bool
+chat_uring_is_supported(void)
+{
+	struct chat_uring ring;
+	if (chat_uring_create(&ring, 2) != 0)
+		return false;
+	struct chat_uring_bufs bufs;
+	bool res = chat_uring_bufs_create(&ring, &bufs, 0, 1, 1, 0) == 0 &&
+		   chat_uring_submit(&ring) == 0 &&
+		   chat_uring_peek(&ring) == NULL;
+	chat_uring_destroy(&ring);
+	chat_uring_bufs_destroy(&bufs);
+	return res;
+}
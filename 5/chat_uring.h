@@ -0,0 +1,171 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A minimal io_uring on top of the raw system calls, just enough for the
+ * chat server. The submission entries are prepared without any system
+ * calls and are all submitted by one chat_uring_enter().
+ */
+struct chat_uring {
+	/** Ring descriptor. */
+	int fd = -1;
+	/** Submission queue, shared with the kernel. */
+	unsigned *sq_head = NULL;
+	unsigned *sq_tail = NULL;
+	unsigned *sq_array = NULL;
+	unsigned sq_mask = 0;
+	unsigned sq_entries = 0;
+	/** Tail including the prepared, but not yet submitted entries. */
+	unsigned sq_local_tail = 0;
+	struct io_uring_sqe *sqes = NULL;
+	/** Completion queue, shared with the kernel. */
+	unsigned *cq_head = NULL;
+	unsigned *cq_tail = NULL;
+	unsigned cq_mask = 0;
+	struct io_uring_cqe *cqes = NULL;
+	/** Mappings of the queues. The completion one can be the same. */
+	void *sq_map = NULL;
+	size_t sq_map_size = 0;
+	void *cq_map = NULL;
+	size_t cq_map_size = 0;
+	size_t sqes_map_size = 0;
+};
+
+/**
+ * Create a ring.
+ *
+ * @param ring Ring to initialize.
+ * @param entries Size of the submission queue. The completion queue is
+ *     bigger.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error, check errno.
+ */
+int
+chat_uring_create(struct chat_uring *ring, unsigned entries);
+
+/** Close the ring. All the operations in it are cancelled. */
+void
+chat_uring_destroy(struct chat_uring *ring);
+
+/**
+ * Get a zeroed submission entry to fill. When the queue is full, it is
+ * submitted first.
+ *
+ * @retval not-NULL The entry.
+ * @retval NULL Error, check errno.
+ */
+struct io_uring_sqe *
+chat_uring_get_sqe(struct chat_uring *ring);
+
+/**
+ * Submit all the prepared entries and wait for at least one completion.
+ *
+ * @param ring Ring.
+ * @param timeout_ms Timeout in milliseconds. 0 - don't wait, just run the
+ *     pending completions. -1 - infinite.
+ *
+ * @retval 0 Success or timeout.
+ * @retval -1 Error, check errno.
+ */
+int
+chat_uring_enter(struct chat_uring *ring, int timeout_ms);
+
+/**
+ * Submit all the prepared entries without waiting for anything.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error, check errno.
+ */
+int
+chat_uring_submit(struct chat_uring *ring);
+
+/**
+ * Get the next completion or NULL if there are none. It stays in the
+ * queue until chat_uring_advance().
+ */
+struct io_uring_cqe *
+chat_uring_peek(struct chat_uring *ring);
+
+/** Drop the completion returned by chat_uring_peek(). */
+void
+chat_uring_advance(struct chat_uring *ring);
+
+/**
+ * Signal the eventfd on each completion.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error, check errno.
+ */
+int
+chat_uring_register_eventfd(struct chat_uring *ring, int fd);
+
+/**
+ * Buffers provided to the kernel for receiving. An operation takes any of
+ * them when the data comes, so the idle connections don't need any
+ * memory. They are given to the kernel by submission entries, which go
+ * together with the other ones, so it costs no system calls.
+ */
+struct chat_uring_bufs {
+	/** Memory of all the buffers. */
+	char *data = NULL;
+	unsigned count = 0;
+	unsigned size = 0;
+	/** Group ID used in the operations. */
+	uint16_t group = 0;
+	/**
+	 * User data of the completions of giving the buffers back. They come
+	 * only on errors.
+	 */
+	uint64_t user_data = 0;
+};
+
+/**
+ * Create the buffers and give them all to the kernel.
+ *
+ * @param ring Ring.
+ * @param bufs Buffers to initialize.
+ * @param group Group ID.
+ * @param count Number of buffers.
+ * @param size Size of each buffer.
+ * @param user_data User data of the error completions.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error, check errno.
+ */
+int
+chat_uring_bufs_create(struct chat_uring *ring, struct chat_uring_bufs *bufs,
+		       uint16_t group, unsigned count, unsigned size,
+		       uint64_t user_data);
+
+/** Free the buffers. Their ring has to be closed already. */
+void
+chat_uring_bufs_destroy(struct chat_uring_bufs *bufs);
+
+/** Get a buffer by the ID from a completion. */
+static inline const char *
+chat_uring_bufs_get(const struct chat_uring_bufs *bufs, unsigned id)
+{
+	return bufs->data + (size_t)id * bufs->size;
+}
+
+/**
+ * Give a buffer back to the kernel.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error, check errno.
+ */
+int
+chat_uring_bufs_put(struct chat_uring *ring, struct chat_uring_bufs *bufs,
+		    unsigned id);
+
+/**
+ * Check if the kernel has everything needed for the chat server: the
+ * extended wait arguments, the provided buffers, and skipping of the
+ * successful completions. Linux 6.0+ for the multishot receive.
+ */
+bool
+chat_uring_is_supported(void);
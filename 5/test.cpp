@@ -1,13 +1,22 @@
 #include "unit.h"
 #include "chat.h"
 #include "chat_client.h"
+#include "chat_coro_server.h"
+#include "chat_deflate.h"
 #include "chat_server.h"
 
+#include <algorithm>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <new>
 #include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 enum {
 	TEST_MSG_ID_LEN = 64,
@@ -397,7 +406,7 @@ test_multi_client(void)
 	}
 	unit_msg("Check all is delivered");
 	test_msg_clear_id(test_msg);
-	int *msg_counts = new int[client_count];
+	int *msg_counts = new int[client_count]();
 	for (int i = 0, end = msg_count * client_count; i < end; ++i) {
 		msg = chat_server_pop_next(s);
 		unit_fail_if(msg == NULL);
@@ -507,7 +516,7 @@ test_stress(void)
 			test_stress_worker_f, &ctx);
 		unit_fail_if(rc != 0);
 	}
-	int *msg_counts = new int[client_count];
+	int *msg_counts = new int[client_count]();
 	struct test_msg *test_msg = test_msg_new(ctx.msg_len);
 	unit_msg("Receive all messages");
 	for (int i = 0, end = ctx.msg_count * client_count; i < end; ++i) {
@@ -546,6 +555,937 @@ test_stress(void)
 	unit_test_finish();
 }
 
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	unit_check(chat_server_new_ex(0) == NULL, "0 threads");
+	unit_check(chat_server_new_ex(CHAT_SERVER_MAX_THREADS + 1) == NULL,
+		   "too many threads");
+	struct chat_server *s = chat_server_new_ex(4);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_listen(s, 0) == CHAT_ERR_ALREADY_STARTED,
+		   "listen twice");
+	uint16_t port = server_get_port(s);
+	const int client_count = 8;
+	const int msg_count = 20;
+	struct test_msg *test_msg = test_msg_new(100);
+	struct chat_client *clis[client_count];
+	for (int i = 0; i < client_count; ++i) {
+		clis[i] = chat_client_new("cli");
+		unit_fail_if(chat_client_connect(
+			clis[i], make_addr_str(port)) != 0);
+	}
+	for (int mi = 0; mi < msg_count; ++mi) {
+		for (int ci = 0; ci < client_count; ++ci) {
+			test_msg_set_id(test_msg, ci, mi);
+			unit_fail_if(chat_client_feed(
+				clis[ci], test_msg->data, test_msg->size) != 0);
+		}
+	}
+	test_msg_clear_id(test_msg);
+	// Clients are spread over the threads, but the messages of one
+	// client still come in order everywhere.
+	int server_counts[client_count] = {};
+	int client_counts[client_count][client_count] = {};
+	int server_total = 0;
+	int client_total = 0;
+	const int server_expected = client_count * msg_count;
+	const int client_expected = client_count * (client_count - 1) *
+				    msg_count;
+	while (server_total < server_expected ||
+	       client_total < client_expected) {
+		int rc = chat_server_update(s, 0);
+		unit_fail_if(rc != 0 && rc != CHAT_ERR_TIMEOUT);
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(s)) != NULL) {
+			int cli_id = -1;
+			int msg_id = -1;
+			chat_message_extract_id(msg, &cli_id, &msg_id);
+			unit_fail_if(cli_id >= client_count || cli_id < 0);
+			unit_fail_if(server_counts[cli_id] != msg_id);
+			++server_counts[cli_id];
+			test_msg_check_data(test_msg, msg->data);
+			++server_total;
+			delete msg;
+		}
+		for (int ci = 0; ci < client_count; ++ci) {
+			rc = chat_client_update(clis[ci], 0);
+			unit_fail_if(rc != 0 && rc != CHAT_ERR_TIMEOUT);
+			while ((msg = chat_client_pop_next(clis[ci])) != NULL) {
+				int cli_id = -1;
+				int msg_id = -1;
+				chat_message_extract_id(msg, &cli_id, &msg_id);
+				unit_fail_if(cli_id >= client_count ||
+					     cli_id < 0 || cli_id == ci);
+				unit_fail_if(client_counts[ci][cli_id] !=
+					     msg_id);
+				++client_counts[ci][cli_id];
+				test_msg_check_data(test_msg, msg->data);
+				++client_total;
+				delete msg;
+			}
+		}
+	}
+	unit_check(server_total == server_expected, "server got all msgs");
+	unit_check(client_total == client_expected, "clients got all msgs");
+	for (int i = 0; i < client_count; ++i)
+		chat_client_delete(clis[i]);
+	chat_server_delete(s);
+	test_msg_delete(test_msg);
+
+	unit_test_finish();
+}
+
+static void
+test_output_limits(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	struct chat_server_limits limits;
+	limits.output_high_mark = 1024;
+	limits.output_low_mark = 2048;
+	limits.output_hard_cap = 0;
+	unit_check(chat_server_set_limits(s, &limits) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "low mark above high mark");
+	limits.output_high_mark = 1024 * 1024;
+	limits.output_low_mark = 64 * 1024;
+	unit_check(chat_server_set_limits(s, &limits) == 0, "set limits");
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_limits(s, &limits) ==
+		   CHAT_ERR_ALREADY_STARTED, "no limits after listen");
+	uint16_t port = server_get_port(s);
+	struct chat_client *sender = chat_client_new("sender");
+	unit_fail_if(chat_client_connect(sender, make_addr_str(port)) != 0);
+	struct chat_client *reader = chat_client_new("reader");
+	unit_fail_if(chat_client_connect(reader, make_addr_str(port)) != 0);
+	server_consume_events(s);
+	struct chat_server_stats stats;
+	chat_server_stats(s, &stats);
+	unit_check(stats.peer_count == 2, "peer count");
+	//
+	// The reader doesn't read, so at some point its messages start
+	// being dropped.
+	//
+	struct test_msg *test_msg = test_msg_new(64 * 1024);
+	int sent_count = 0;
+	struct chat_message *msg;
+	while (stats.dropped_count == 0) {
+		unit_fail_if(sent_count == 10000);
+		unit_fail_if(chat_client_feed(sender,
+			test_msg->data, test_msg->size) != 0);
+		++sent_count;
+		client_consume_events(sender);
+		server_consume_events(s);
+		while ((msg = chat_server_pop_next(s)) != NULL)
+			delete msg;
+		chat_server_stats(s, &stats);
+	}
+	unit_check(stats.lagging_count == 1, "reader is lagging");
+	unit_check(stats.evicted_count == 0, "nobody is evicted");
+	//
+	// When the reader catches up, it gets messages again.
+	//
+	int read_count = 0;
+	while (true) {
+		int rc1 = chat_client_update(reader, 0);
+		int rc2 = chat_server_update(s, 0);
+		while ((msg = chat_client_pop_next(reader)) != NULL) {
+			++read_count;
+			delete msg;
+		}
+		if (rc1 == CHAT_ERR_TIMEOUT && rc2 == CHAT_ERR_TIMEOUT)
+			break;
+	}
+	chat_server_stats(s, &stats);
+	unit_check(stats.lagging_count == 0, "reader caught up");
+	unit_check(read_count < sent_count, "some messages were dropped");
+	unit_fail_if(chat_client_feed(sender, "after\n", 6) != 0);
+	client_consume_events(sender);
+	msg = client_pop_next_blocking(reader, s);
+	unit_check(msg->data == "after", "reader gets new messages");
+	delete msg;
+	chat_client_delete(reader);
+	chat_client_delete(sender);
+	chat_server_delete(s);
+	//
+	// A reader above the hard cap is disconnected.
+	//
+	s = chat_server_new();
+	limits.output_high_mark = 0;
+	limits.output_low_mark = 0;
+	limits.output_hard_cap = 1024 * 1024;
+	unit_fail_if(chat_server_set_limits(s, &limits) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	port = server_get_port(s);
+	sender = chat_client_new("sender");
+	unit_fail_if(chat_client_connect(sender, make_addr_str(port)) != 0);
+	reader = chat_client_new("reader");
+	unit_fail_if(chat_client_connect(reader, make_addr_str(port)) != 0);
+	server_consume_events(s);
+	sent_count = 0;
+	chat_server_stats(s, &stats);
+	while (stats.evicted_count == 0) {
+		unit_fail_if(sent_count == 10000);
+		unit_fail_if(chat_client_feed(sender,
+			test_msg->data, test_msg->size) != 0);
+		++sent_count;
+		client_consume_events(sender);
+		server_consume_events(s);
+		while ((msg = chat_server_pop_next(s)) != NULL)
+			delete msg;
+		chat_server_stats(s, &stats);
+	}
+	unit_check(stats.peer_count == 1, "reader is evicted");
+	unit_check(stats.dropped_count == 0, "nothing is dropped");
+	chat_client_delete(reader);
+	chat_client_delete(sender);
+	chat_server_delete(s);
+	test_msg_delete(test_msg);
+
+	unit_test_finish();
+}
+
+static void
+test_pop_batch(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	const char *data = "m0\nm1\nm2\nm3\nm4\nm5\nm6\nm7\nm8\nm9\n";
+	unit_fail_if(chat_client_feed(c1, data, strlen(data)) != 0);
+	client_consume_events(c1);
+	server_consume_events(s);
+
+	std::vector<chat_message> msgs;
+	unit_check(chat_server_pop_batch(s, &msgs, 4) == 4, "server part");
+	unit_check(chat_server_pop_batch(s, &msgs, 100) == 6, "server rest");
+	unit_check(chat_server_pop_batch(s, &msgs, 100) == 0, "server empty");
+	bool is_ok = msgs.size() == 10;
+	for (size_t i = 0; i < msgs.size() && is_ok; ++i)
+		is_ok = msgs[i].data == "m" + std::to_string(i);
+	unit_check(is_ok, "server batch in order");
+
+	msgs.clear();
+	while (msgs.size() < 10) {
+		chat_client_update(c2, 0);
+		chat_server_update(s, 0);
+		chat_client_pop_batch(c2, &msgs, 3);
+	}
+	is_ok = msgs.size() == 10;
+	for (size_t i = 0; i < msgs.size() && is_ok; ++i)
+		is_ok = msgs[i].data == "m" + std::to_string(i);
+	unit_check(is_ok, "client batch in order");
+	unit_check(chat_client_pop_next(c2) == NULL, "client empty");
+
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_binary(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_check(chat_client_feed_binary(c1, "a", 1) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "no binary feed in text mode");
+	unit_fail_if(chat_client_set_binary(c1) != 0);
+	unit_check(chat_client_feed_binary(c1, "a", 1) == CHAT_ERR_NOT_STARTED,
+		   "no binary feed before connect");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	unit_check(chat_client_set_binary(c1) == CHAT_ERR_ALREADY_STARTED,
+		   "no switch after connect");
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	struct chat_client *c3 = chat_client_new("c3");
+	unit_fail_if(chat_client_set_binary(c3) != 0);
+	unit_fail_if(chat_client_connect(c3, make_addr_str(port)) != 0);
+
+	/* Text is cut into messages before being framed. */
+	const char *text = "  text1 \ntext2\n";
+	unit_fail_if(chat_client_feed(c1, text, strlen(text)) != 0);
+	struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+	unit_check(msg != NULL && msg->data == "text1", "server got text");
+	delete msg;
+	msg = server_pop_next_blocking_from(s, c1);
+	unit_check(msg != NULL && msg->data == "text2", "server got text");
+	delete msg;
+	const char *names[] = {"text1", "text2"};
+	struct chat_client *receivers[] = {c2, c3};
+	bool is_ok = true;
+	for (struct chat_client *c : receivers) {
+		for (const char *name : names) {
+			msg = client_pop_next_blocking(c, s);
+			is_ok = is_ok && msg != NULL && msg->data == name;
+			delete msg;
+		}
+	}
+	unit_check(is_ok, "text and binary clients got text");
+
+	/* Binary payload is taken as is. */
+	std::string bin("a\0b", 3);
+	unit_fail_if(chat_client_feed_binary(c1, bin.data(), bin.size()) != 0);
+	msg = server_pop_next_blocking_from(s, c1);
+	unit_check(msg != NULL && msg->data == bin, "server got binary");
+	delete msg;
+	msg = client_pop_next_blocking(c3, s);
+	unit_check(msg != NULL && msg->data == bin, "binary client got binary");
+	delete msg;
+	msg = client_pop_next_blocking(c2, s);
+	unit_check(msg != NULL && msg->data == bin, "text client got binary");
+	delete msg;
+
+	/* Only binary clients can get '\n' inside a message. */
+	std::string big(1024 * 1024, 'x');
+	big[100] = '\n';
+	unit_fail_if(chat_client_feed_binary(c1, big.data(), big.size()) != 0);
+	msg = server_pop_next_blocking_from(s, c1);
+	unit_check(msg != NULL && msg->data == big, "server got big binary");
+	delete msg;
+	msg = client_pop_next_blocking(c3, s);
+	unit_check(msg != NULL && msg->data == big,
+		   "binary client got big binary");
+	delete msg;
+
+	/* Text clients are heard by the binary ones. */
+	unit_fail_if(chat_client_feed(c2, "from c2\n", 8) != 0);
+	msg = server_pop_next_blocking_from(s, c2);
+	unit_check(msg != NULL && msg->data == "from c2", "server got text");
+	delete msg;
+	msg = client_pop_next_blocking(c1, s);
+	unit_check(msg != NULL && msg->data == "from c2",
+		   "binary client got text from text client");
+	delete msg;
+
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_client_delete(c3);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_text_check(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+
+	/*
+	 * The controls are cut out, the invalid UTF-8 messages are dropped.
+	 * The long ones go through the vector scan.
+	 */
+	std::string text = "he\x01llo\tworld\r\n"
+		"caf\xc3\xa9 \xf0\x9f\x98\x80\n"
+		"bad \xff\n"
+		"overlong \xc0\xaf\n"
+		"surrogate \xed\xa0\x80\n"
+		"cut \xe2\x82\n"
+		"a\xc2\x85z\n"
+		"ok\n\x01z\n" +
+		std::string(100, 'x') + "\x7fy\n" +
+		std::string(100, 'x') + "\xd0\xb6\n";
+	unit_fail_if(chat_client_feed(c1, text.data(), text.size()) != 0);
+	const char *expected[] = {
+		"helloworld",
+		"caf\xc3\xa9 \xf0\x9f\x98\x80",
+		"az",
+		"ok",
+		"z",
+	};
+	bool is_ok = true;
+	for (const char *e : expected) {
+		struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+		is_ok = is_ok && msg != NULL && msg->data == e;
+		delete msg;
+	}
+	unit_check(is_ok, "server got the checked text");
+	struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+	unit_check(msg != NULL && msg->data == std::string(100, 'x') + "y",
+		   "long with a control");
+	delete msg;
+	msg = server_pop_next_blocking_from(s, c1);
+	unit_check(msg != NULL && msg->data == std::string(100, 'x') +
+		   "\xd0\xb6", "long with UTF-8");
+	delete msg;
+	msg = client_pop_next_blocking(c2, s);
+	unit_check(msg != NULL && msg->data == "helloworld",
+		   "others get the checked text");
+	delete msg;
+
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_uring_threads(int thread_count)
+{
+	struct chat_server *s = chat_server_new_ex(thread_count);
+	unit_fail_if(chat_server_set_backend(s, CHAT_SERVER_BACKEND_URING) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_backend(s, CHAT_SERVER_BACKEND_EPOLL) ==
+		   CHAT_ERR_ALREADY_STARTED, "no backend change after listen");
+	unit_check(chat_server_get_descriptor(s) >= 0, "descriptor");
+	uint16_t port = server_get_port(s);
+	const int client_count = 4;
+	struct chat_client *clis[client_count];
+	for (int i = 0; i < client_count; ++i) {
+		clis[i] = chat_client_new("cli");
+		if (i == client_count - 1)
+			unit_fail_if(chat_client_set_binary(clis[i]) != 0);
+		unit_fail_if(chat_client_connect(
+			clis[i], make_addr_str(port)) != 0);
+	}
+	/* Big enough not to fit into the socket buffers at once. */
+	std::string big(5 * 1024 * 1024, 'b');
+	big.back() = '\n';
+	const char *small = "small\n";
+	unit_fail_if(chat_client_feed(clis[0], small, strlen(small)) != 0);
+	unit_fail_if(chat_client_feed(clis[0], big.data(), big.size()) != 0);
+	struct chat_message *msg = server_pop_next_blocking_from(s, clis[0]);
+	unit_check(msg != NULL && msg->data == "small", "server got small");
+	delete msg;
+	msg = server_pop_next_blocking_from(s, clis[0]);
+	big.pop_back();
+	unit_check(msg != NULL && msg->data == big, "server got big");
+	delete msg;
+	bool is_ok = true;
+	for (int i = 1; i < client_count; ++i) {
+		msg = client_pop_next_blocking(clis[i], s);
+		is_ok = is_ok && msg != NULL && msg->data == "small";
+		delete msg;
+		msg = client_pop_next_blocking(clis[i], s);
+		is_ok = is_ok && msg != NULL && msg->data == big;
+		delete msg;
+	}
+	unit_check(is_ok, "clients got all");
+
+	/* A client leaving with the output not yet sent. */
+	unit_fail_if(chat_client_feed(clis[1], big.data(), big.size()) != 0);
+	unit_fail_if(chat_client_feed(clis[1], "\n", 1) != 0);
+	msg = server_pop_next_blocking_from(s, clis[1]);
+	unit_check(msg != NULL && msg->data == big, "server got big");
+	delete msg;
+	chat_client_delete(clis[2]);
+	clis[2] = NULL;
+	struct chat_server_stats stats;
+	do {
+		chat_server_update(s, 0.01);
+		chat_server_stats(s, &stats);
+	} while (stats.peer_count != client_count - 1);
+	msg = client_pop_next_blocking(clis[0], s);
+	unit_check(msg != NULL && msg->data == big, "others still get it");
+	delete msg;
+
+	for (int i = 0; i < client_count; ++i) {
+		if (clis[i] != NULL)
+			chat_client_delete(clis[i]);
+	}
+	chat_server_delete(s);
+}
+
+static void
+test_uring(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	int rc = chat_server_set_backend(s, CHAT_SERVER_BACKEND_URING);
+	chat_server_delete(s);
+	if (rc == CHAT_ERR_NOT_IMPLEMENTED) {
+		unit_msg("io_uring is not supported");
+	} else {
+		unit_fail_if(rc != 0);
+		test_uring_threads(1);
+		test_uring_threads(3);
+	}
+
+	unit_test_finish();
+}
+
+static void
+test_options(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	struct chat_server_options options = {};
+	options.backlog = -1;
+	unit_check(chat_server_set_options(s, &options) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "negative backlog");
+	options.backlog = 16;
+	options.no_delay = true;
+	options.send_buffer_size = 128 * 1024;
+	options.recv_buffer_size = 128 * 1024;
+	options.defer_accept_sec = 1;
+	unit_fail_if(chat_server_set_options(s, &options) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_options(s, &options) ==
+		   CHAT_ERR_ALREADY_STARTED, "no options after listen");
+	int value = 0;
+	socklen_t len = sizeof(value);
+	unit_fail_if(getsockopt(chat_server_get_socket(s), IPPROTO_TCP,
+				TCP_NODELAY, &value, &len) != 0);
+	unit_check(value != 0, "no delay");
+
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	/* With the deferred accept the clients are seen after they send. */
+	unit_fail_if(chat_client_feed(c2, "hi\n", 3) != 0);
+	struct chat_message *msg = server_pop_next_blocking_from(s, c2);
+	unit_check(msg != NULL && msg->data == "hi", "server got msg");
+	delete msg;
+	unit_fail_if(chat_client_feed(c1, "hello\n", 6) != 0);
+	msg = server_pop_next_blocking_from(s, c1);
+	unit_check(msg != NULL && msg->data == "hello", "server got msg");
+	delete msg;
+	msg = client_pop_next_blocking(c2, s);
+	unit_check(msg != NULL && msg->data == "hello", "client got msg");
+	delete msg;
+
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_timeouts_backend(enum chat_server_backend backend)
+{
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_set_backend(s, backend) != 0);
+	struct chat_server_timeouts timeouts = {};
+	timeouts.idle_timeout = -1;
+	unit_check(chat_server_set_timeouts(s, &timeouts) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "negative timeout");
+	timeouts.idle_timeout = 0.5;
+	timeouts.ping_interval = 0.05;
+	unit_fail_if(chat_server_set_timeouts(s, &timeouts) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_timeouts(s, &timeouts) ==
+		   CHAT_ERR_ALREADY_STARTED, "no timeouts after listen");
+
+	uint16_t port = server_get_port(s);
+	struct chat_client *quiet = chat_client_new("quiet");
+	unit_fail_if(chat_client_connect(quiet, make_addr_str(port)) != 0);
+	struct chat_client *quiet_bin = chat_client_new("quiet_bin");
+	unit_fail_if(chat_client_set_binary(quiet_bin) != 0);
+	unit_fail_if(chat_client_connect(quiet_bin, make_addr_str(port)) != 0);
+	struct chat_client *active = chat_client_new("active");
+	unit_fail_if(chat_client_connect(active, make_addr_str(port)) != 0);
+	/* The binary client's hello is its only input. */
+	unit_fail_if(chat_client_update(quiet_bin, 0) != 0);
+	struct chat_server_stats stats;
+	do {
+		chat_server_update(s, 0.01);
+		chat_server_stats(s, &stats);
+	} while (stats.peer_count != 3);
+
+	/* The pings come often, but the quiet clients see nothing of them. */
+	bool is_ok = true;
+	double deadline = chat_clock_now() + 10;
+	double next_feed = 0;
+	while (stats.expired_count < 2 && chat_clock_now() < deadline) {
+		if (chat_clock_now() >= next_feed) {
+			unit_fail_if(chat_client_feed(active, "alive\n", 6) != 0);
+			next_feed = chat_clock_now() + 0.05;
+		}
+		chat_client_update(active, 0);
+		int rc = chat_server_update(s, 0.01);
+		unit_fail_if(rc != 0 && rc != CHAT_ERR_TIMEOUT);
+		chat_client_update(quiet, 0);
+		chat_client_update(quiet_bin, 0);
+		struct chat_message *msg;
+		while ((msg = chat_client_pop_next(quiet)) != NULL) {
+			is_ok = is_ok && msg->data == "alive";
+			delete msg;
+		}
+		while ((msg = chat_client_pop_next(quiet_bin)) != NULL) {
+			is_ok = is_ok && msg->data == "alive";
+			delete msg;
+		}
+		chat_server_stats(s, &stats);
+	}
+	unit_check(is_ok, "pings are invisible");
+	unit_check(stats.expired_count == 2, "quiet clients are expired");
+	unit_check(stats.peer_count == 1, "active client stays");
+	for (int i = 0; i < 1000 && (chat_client_get_descriptor(quiet) >= 0 ||
+	     chat_client_get_descriptor(quiet_bin) >= 0); ++i) {
+		chat_client_update(quiet, 0.01);
+		chat_client_update(quiet_bin, 0.01);
+	}
+	unit_check(chat_client_get_descriptor(quiet) < 0 &&
+		   chat_client_get_descriptor(quiet_bin) < 0,
+		   "quiet clients are disconnected");
+
+	chat_client_delete(quiet);
+	chat_client_delete(quiet_bin);
+	chat_client_delete(active);
+	chat_server_delete(s);
+}
+
+static void
+test_timeouts(void)
+{
+	unit_test_start();
+
+	test_timeouts_backend(CHAT_SERVER_BACKEND_EPOLL);
+	struct chat_server *s = chat_server_new();
+	bool is_uring = chat_server_set_backend(
+		s, CHAT_SERVER_BACKEND_URING) == 0;
+	chat_server_delete(s);
+	if (is_uring)
+		test_timeouts_backend(CHAT_SERVER_BACKEND_URING);
+
+	unit_test_finish();
+}
+
+static void
+test_client_flush(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_check(chat_client_set_flush(c1, -1, 0) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "negative delay");
+	unit_fail_if(chat_client_set_flush(c1, 0.2, 100) != 0);
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	unit_check(chat_client_get_timeout(c1) == -1, "nothing is held");
+
+	/* Small feeds are held together. */
+	unit_fail_if(chat_client_feed(c1, "a\n", 2) != 0);
+	unit_fail_if(chat_client_feed(c1, "b\n", 2) != 0);
+	unit_check(chat_client_get_events(c1) == CHAT_EVENT_INPUT,
+		   "no output while held");
+	double timeout = chat_client_get_timeout(c1);
+	unit_check(timeout > 0 && timeout <= 0.2, "timeout of the delay");
+	unit_check(chat_client_update(c1, 0) == CHAT_ERR_TIMEOUT,
+		   "nothing sent before the delay");
+	server_consume_events(s);
+	unit_check(chat_server_pop_next(s) == NULL, "server got nothing");
+	double start = chat_clock_now();
+	unit_fail_if(chat_client_update(c1, 1) != 0);
+	unit_check(chat_clock_now() - start < 0.5, "update woke up for it");
+	unit_check(chat_client_get_timeout(c1) == -1, "nothing is held");
+	struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+	unit_check(msg != NULL && msg->data == "a", "server got a");
+	delete msg;
+	msg = server_pop_next_blocking_from(s, c1);
+	unit_check(msg != NULL && msg->data == "b", "server got b");
+	delete msg;
+
+	/* A big enough output goes right away. */
+	std::string big(100, 'x');
+	big.back() = '\n';
+	unit_fail_if(chat_client_feed(c1, big.data(), big.size()) != 0);
+	unit_check(chat_client_get_timeout(c1) == 0, "big output is due");
+	unit_check((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) != 0,
+		   "big output is wanted");
+	msg = server_pop_next_blocking_from(s, c1);
+	big.pop_back();
+	unit_check(msg != NULL && msg->data == big, "server got big");
+	delete msg;
+
+	/* Without the delay everything goes in the next update again. */
+	unit_fail_if(chat_client_set_flush(c1, 0, 0) != 0);
+	unit_fail_if(chat_client_feed(c1, "c\n", 2) != 0);
+	unit_check((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) != 0,
+		   "output is wanted");
+	msg = server_pop_next_blocking_from(s, c1);
+	unit_check(msg != NULL && msg->data == "c", "server got c");
+	delete msg;
+
+	chat_client_delete(c1);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+struct test_connect_ctx {
+	struct chat_client *client;
+	uint16_t port;
+	/** Result of the connect, -1 while it is in progress. */
+	int rc;
+};
+
+static void *
+test_connect_worker_f(void *arg)
+{
+	struct test_connect_ctx *ctx = (struct test_connect_ctx *)arg;
+	int rc = chat_client_connect(ctx->client, make_addr_str(ctx->port));
+	__atomic_store_n(&ctx->rc, rc, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void
+test_tls(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	int rc = chat_server_set_tls(s, "no_such_cert.pem", "no_such_key.pem");
+	struct chat_client *c1 = chat_client_new("c1");
+	if (rc == CHAT_ERR_NOT_IMPLEMENTED) {
+		unit_check(chat_client_set_tls(c1, NULL) ==
+			   CHAT_ERR_NOT_IMPLEMENTED, "no client TLS either");
+		unit_msg("kTLS is not supported");
+		chat_client_delete(c1);
+		chat_server_delete(s);
+		unit_test_finish();
+		return;
+	}
+	unit_check(rc == CHAT_ERR_INVALID_ARGUMENT, "no cert");
+	const char *cert = "test_tls_cert.pem";
+	const char *key = "test_tls_key.pem";
+	if (system("openssl req -x509 -newkey rsa:2048 -nodes -days 1 "
+		   "-subj /CN=localhost -addext subjectAltName=DNS:localhost "
+		   "-keyout test_tls_key.pem -out test_tls_cert.pem "
+		   "2>/dev/null") != 0) {
+		unit_msg("couldn't make a certificate");
+		chat_client_delete(c1);
+		chat_server_delete(s);
+		unit_test_finish();
+		return;
+	}
+	unit_fail_if(chat_server_set_tls(s, cert, key) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_tls(s, cert, key) ==
+		   CHAT_ERR_ALREADY_STARTED, "no TLS change after listen");
+	uint16_t port = server_get_port(s);
+
+	/* connect() is blocking, the server has to make the handshake. */
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_set_tls(c1, cert) != 0);
+	unit_fail_if(chat_client_set_tls(c2, NULL) != 0);
+	unit_fail_if(chat_client_set_binary(c2) != 0);
+	struct test_connect_ctx ctx[2] = {{c1, port, -1}, {c2, port, -1}};
+	for (struct test_connect_ctx &c : ctx) {
+		pthread_t t;
+		unit_fail_if(pthread_create(&t, NULL, test_connect_worker_f,
+					    &c) != 0);
+		while (__atomic_load_n(&c.rc, __ATOMIC_ACQUIRE) == -1)
+			chat_server_update(s, 0.01);
+		pthread_join(t, NULL);
+		unit_check(c.rc == 0, "connected with TLS");
+	}
+	struct chat_server_stats stats;
+	do {
+		chat_server_update(s, 0.01);
+		chat_server_stats(s, &stats);
+	} while (stats.peer_count != 2);
+
+	unit_fail_if(chat_client_feed(c1, "secret\n", 7) != 0);
+	struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+	unit_check(msg != NULL && msg->data == "secret", "server got msg");
+	delete msg;
+	msg = client_pop_next_blocking(c2, s);
+	unit_check(msg != NULL && msg->data == "secret", "client got msg");
+	delete msg;
+	unit_fail_if(chat_client_feed_binary(c2, "bin\nary", 7) != 0);
+	msg = server_pop_next_blocking_from(s, c2);
+	unit_check(msg != NULL && msg->data == "bin\nary", "server got bin");
+	delete msg;
+
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s);
+	remove(cert);
+	remove(key);
+
+	unit_test_finish();
+}
+
+/** Feed a message and wait until the server gets it. */
+static void
+test_rooms_send(struct chat_server *s, struct chat_client *c, const char *cmd,
+		const char *data)
+{
+	std::string text = std::string(cmd) + data + "\n";
+	unit_fail_if(chat_client_feed(c, text.data(), text.size()) != 0);
+	struct chat_message *msg = server_pop_next_blocking_from(s, c);
+	unit_fail_if(msg == NULL || msg->data != data);
+	delete msg;
+}
+
+/** Check the next message the client gets. */
+static bool
+test_rooms_next_is(struct chat_client *c, struct chat_server *s,
+		   const char *data)
+{
+	struct chat_message *msg = client_pop_next_blocking(c, s);
+	bool res = msg != NULL && msg->data == data;
+	delete msg;
+	return res;
+}
+
+static void
+test_rooms_threads(int thread_count)
+{
+	struct chat_server *s = chat_server_new_ex(thread_count);
+	unit_fail_if(chat_server_enable_rooms(s) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_enable_rooms(s) == CHAT_ERR_ALREADY_STARTED,
+		   "no rooms change after listen");
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_set_binary(c2) != 0);
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	struct chat_client *c3 = chat_client_new("c3");
+	unit_fail_if(chat_client_connect(c3, make_addr_str(port)) != 0);
+	struct chat_server_stats stats;
+	do {
+		chat_server_update(s, 0.01);
+		chat_server_stats(s, &stats);
+	} while (stats.peer_count != 3);
+
+	/*
+	 * Every message after a command is seen by the server only after the
+	 * command is done, so the commands are synchronized by them.
+	 */
+	test_rooms_send(s, c1, "/join a\n", "c1 in a");
+	test_rooms_send(s, c2, "/join a\n", "c2 in a");
+	test_rooms_send(s, c3, "", "c3 in lobby");
+	unit_check(test_rooms_next_is(c1, s, "c2 in a"), "room member got it");
+	unit_check(test_rooms_next_is(c1, s, "c3 in lobby"),
+		   "lobby is still joined");
+	unit_check(test_rooms_next_is(c2, s, "c3 in lobby"),
+		   "lobby is still joined");
+
+	test_rooms_send(s, c1, "", "for a");
+	test_rooms_send(s, c2, "/join\n", "for lobby");
+	unit_check(test_rooms_next_is(c2, s, "for a"), "room member got it");
+	unit_check(test_rooms_next_is(c3, s, "for lobby"),
+		   "non-member didn't get it");
+	unit_check(test_rooms_next_is(c1, s, "for lobby"), "lobby member got it");
+
+	test_rooms_send(s, c2, "/leave\n/leave a\n", "for nobody");
+	test_rooms_send(s, c1, "/leave a\n", "back to lobby");
+	unit_check(test_rooms_next_is(c3, s, "back to lobby"),
+		   "posts go to the last joined room");
+	test_rooms_send(s, c3, "/join a\n", "a again");
+	for (int i = 0; i < 10; ++i) {
+		chat_client_update(c1, 0.01);
+		chat_client_update(c2, 0.01);
+		chat_server_update(s, 0.01);
+	}
+	struct chat_message *msg = chat_client_pop_next(c1);
+	unit_check(msg == NULL, "left rooms give nothing");
+	delete msg;
+	msg = chat_client_pop_next(c2);
+	unit_check(msg == NULL, "member of no rooms gets nothing");
+	delete msg;
+
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_client_delete(c3);
+	chat_server_delete(s);
+}
+
+static void
+test_rooms(void)
+{
+	unit_test_start();
+
+	test_rooms_threads(1);
+	test_rooms_threads(3);
+
+	unit_test_finish();
+}
+
+static void
+test_history(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_set_history(s, 2) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_history(s, 3) == CHAT_ERR_ALREADY_STARTED,
+		   "no history change after listen");
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	/* The author is alone, but the messages are still kept. */
+	test_rooms_send(s, c1, "", "m1");
+	test_rooms_send(s, c1, "", "m2");
+	test_rooms_send(s, c1, "", "m3");
+
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	struct chat_client *c3 = chat_client_new("c3");
+	unit_fail_if(chat_client_set_binary(c3) != 0);
+	unit_fail_if(chat_client_connect(c3, make_addr_str(port)) != 0);
+	unit_check(test_rooms_next_is(c2, s, "m2"), "oldest kept message");
+	unit_check(test_rooms_next_is(c2, s, "m3"), "newest kept message");
+	unit_check(test_rooms_next_is(c3, s, "m2"), "binary got the history");
+	unit_check(test_rooms_next_is(c3, s, "m3"), "in order");
+	test_rooms_send(s, c1, "", "m4");
+	unit_check(test_rooms_next_is(c2, s, "m4"), "then the new ones");
+	unit_check(test_rooms_next_is(c3, s, "m4"), "then the new ones");
+	struct chat_message *msg = chat_client_pop_next(c1);
+	unit_check(msg == NULL, "no history for the old peer");
+	delete msg;
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_client_delete(c3);
+	chat_server_delete(s);
+
+	/* Only the lobby history with the rooms. */
+	s = chat_server_new();
+	unit_fail_if(chat_server_enable_rooms(s) != 0);
+	unit_fail_if(chat_server_set_history(s, 10) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	port = server_get_port(s);
+	c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	test_rooms_send(s, c1, "/join a\n", "in a");
+	test_rooms_send(s, c1, "/leave a\n", "in lobby");
+	c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	unit_check(test_rooms_next_is(c2, s, "in lobby"), "lobby history");
+	test_rooms_send(s, c1, "", "live");
+	unit_check(test_rooms_next_is(c2, s, "live"), "no other rooms");
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
 static void
 test_big_author(void)
 {
@@ -670,6 +1610,559 @@ test_server_feed(void)
 #endif
 }
 
+/** Pop from @a c while the author @a a sends through the server. */
+static struct chat_message *
+client_pop_next_blocking_from(struct chat_client *c, struct chat_client *a,
+			      struct chat_server *s)
+{
+	struct chat_message *msg;
+	while ((msg = chat_client_pop_next(c)) == NULL) {
+		chat_client_update(a, 0);
+		chat_server_update(s, 0);
+		chat_client_update(c, 0);
+	}
+	return msg;
+}
+
+static void
+test_zerocopy(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	struct chat_server_options options = {};
+	options.zerocopy_threshold = 64 * 1024;
+	unit_fail_if(chat_server_set_options(s, &options) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(c2, "hi\n", 3) != 0);
+	struct chat_message *msg = server_pop_next_blocking_from(s, c2);
+	delete msg;
+
+	/* A big one goes with the zerocopy, the small ones - as usual. */
+	struct test_msg *test_msg = test_msg_new(1024 * 1024);
+	unit_fail_if(chat_client_feed(c1, test_msg->data,
+				      test_msg->size) != 0);
+	unit_fail_if(chat_client_feed(c1, "small\n", 6) != 0);
+	msg = client_pop_next_blocking_from(c2, c1, s);
+	test_msg_check_data(test_msg, msg->data);
+	delete msg;
+	msg = client_pop_next_blocking_from(c2, c1, s);
+	unit_check(msg->data == "small", "small after the big");
+	delete msg;
+	struct chat_server_stats stats;
+	chat_server_stats(s, &stats);
+	unit_check(stats.zerocopy_count > 0, "zerocopy sends");
+
+	/* On loopback the kernel copies, so the peer goes back to copies. */
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(chat_client_feed(c1, test_msg->data,
+					      test_msg->size) != 0);
+		msg = client_pop_next_blocking_from(c2, c1, s);
+		test_msg_check_data(test_msg, msg->data);
+		delete msg;
+	}
+	client_consume_events(c1);
+	server_consume_events(s);
+	chat_server_stats(s, &stats);
+	unit_check(stats.zerocopy_copied_count == 1, "the copies are seen");
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		delete msg;
+
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s);
+	test_msg_delete(test_msg);
+
+	unit_test_finish();
+}
+
+static void
+test_compression(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new_ex(2);
+	if (!chat_deflate_is_supported()) {
+		unit_check(chat_server_set_compression(s, 1) ==
+			   CHAT_ERR_NOT_IMPLEMENTED, "no compression");
+		unit_msg("zlib is not supported");
+		chat_server_delete(s);
+		unit_test_finish();
+		return;
+	}
+	unit_check(chat_server_set_compression(s, CHAT_DEFLATE_MAX_LEVEL + 1) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "bad level");
+	unit_fail_if(chat_server_set_compression(s, 6) != 0);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	unit_check(chat_server_set_compression(s, 1) ==
+		   CHAT_ERR_ALREADY_STARTED, "no compression change after listen");
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	const int receiver_count = 3;
+	struct chat_client *receivers[receiver_count];
+	for (int i = 0; i < receiver_count; ++i) {
+		receivers[i] = chat_client_new("cli");
+		unit_fail_if(chat_client_set_compression(receivers[i]) != 0);
+		unit_fail_if(chat_client_connect(receivers[i],
+						 make_addr_str(port)) != 0);
+		unit_check(chat_client_set_compression(receivers[i]) ==
+			   CHAT_ERR_ALREADY_STARTED, "no switch after connect");
+	}
+	/* The hellos are taken before the broadcasts. */
+	struct chat_message *msg;
+	for (struct chat_client *c : receivers) {
+		unit_fail_if(chat_client_feed(c, "hi\n", 3) != 0);
+		msg = server_pop_next_blocking_from(s, c);
+		delete msg;
+	}
+	for (struct chat_client *c : receivers) {
+		for (int i = 0; i < receiver_count - 1; ++i) {
+			msg = client_pop_next_blocking(c, s);
+			delete msg;
+		}
+	}
+	for (int i = 0; i < receiver_count - 1; ++i) {
+		msg = client_pop_next_blocking(c1, s);
+		delete msg;
+	}
+	struct chat_server_stats stats;
+	chat_server_stats(s, &stats);
+	uint64_t deflate_count = stats.deflate_count;
+
+	/* Repetitive text gets deflated, the short one is stored. */
+	struct test_msg *test_msg = test_msg_new(1024 * 1024);
+	unit_fail_if(chat_client_feed(c1, test_msg->data,
+				      test_msg->size) != 0);
+	unit_fail_if(chat_client_feed(c1, "small\n", 6) != 0);
+	for (struct chat_client *c : receivers) {
+		msg = client_pop_next_blocking_from(c, c1, s);
+		test_msg_check_data(test_msg, msg->data);
+		delete msg;
+		msg = client_pop_next_blocking_from(c, c1, s);
+		unit_check(msg->data == "small", "small after the big");
+		delete msg;
+	}
+	chat_server_stats(s, &stats);
+	unit_check(stats.deflate_count - deflate_count == 2,
+		   "compressed once for all the receivers");
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		delete msg;
+	for (struct chat_client *c : receivers)
+		chat_client_delete(c);
+	chat_server_delete(s);
+
+	/* Without the compression on the server it is plain binary. */
+	s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	port = server_get_port(s);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_set_compression(c2) != 0);
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(c2, "hi\n", 3) != 0);
+	msg = server_pop_next_blocking_from(s, c2);
+	delete msg;
+	chat_client_delete(c1);
+	c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(c1, test_msg->data,
+				      test_msg->size) != 0);
+	msg = client_pop_next_blocking_from(c2, c1, s);
+	test_msg_check_data(test_msg, msg->data);
+	delete msg;
+	chat_server_stats(s, &stats);
+	unit_check(stats.deflate_count == 0, "plain binary fallback");
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		delete msg;
+
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s);
+	test_msg_delete(test_msg);
+
+	unit_test_finish();
+}
+
+static void
+test_connect_options(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("c1");
+	struct chat_client_connect_options options = {};
+	options.attempt_delay = -1;
+	unit_check(chat_client_set_connect(c1, &options) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "bad delay");
+	options.attempt_delay = 0.05;
+	options.resolve_ttl = 60;
+	options.is_async = true;
+	unit_fail_if(chat_client_set_connect(c1, &options) != 0);
+	unit_fail_if(chat_client_set_binary(c1) != 0);
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	unit_check(chat_client_set_connect(c1, &options) ==
+		   CHAT_ERR_ALREADY_STARTED, "no change when connecting");
+	unit_check(chat_client_get_descriptor(c1) >= 0, "attempt descriptor");
+	/* Fed before connected, sent after the hello. */
+	unit_fail_if(chat_client_feed(c1, "early\n", 6) != 0);
+	struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+	unit_check(msg->data == "early", "async connect");
+	delete msg;
+
+	/* The second one takes the cached addresses. */
+	struct chat_client *c2 = chat_client_new("c2");
+	options.is_async = false;
+	unit_fail_if(chat_client_set_connect(c2, &options) != 0);
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(c2, "sync\n", 5) != 0);
+	msg = server_pop_next_blocking_from(s, c2);
+	unit_check(msg->data == "sync", "cached connect");
+	delete msg;
+	msg = client_pop_next_blocking(c1, s);
+	unit_check(msg->data == "sync", "binary after async connect");
+	delete msg;
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s);
+
+	/* Nobody listens now. */
+	c1 = chat_client_new("c1");
+	unit_check(chat_client_connect(c1, make_addr_str(port)) ==
+		   CHAT_ERR_SYS && errno == ECONNREFUSED, "sync refused");
+	options.is_async = true;
+	unit_fail_if(chat_client_set_connect(c1, &options) != 0);
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	int rc;
+	while ((rc = chat_client_update(c1, 1)) == CHAT_ERR_TIMEOUT || rc == 0)
+		{};
+	unit_check(rc == CHAT_ERR_SYS && errno == ECONNREFUSED,
+		   "async refused");
+	unit_check(chat_client_update(c1, 0) == CHAT_ERR_NOT_STARTED,
+		   "not connected after a failure");
+	chat_client_delete(c1);
+
+	unit_test_finish();
+}
+
+static void
+test_client_group(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client_group *g = chat_client_group_new();
+	unit_fail_if(g == NULL);
+	const int count = 20;
+	std::vector<struct chat_client *> clients;
+	struct chat_client_connect_options options = {};
+	options.is_async = true;
+	for (int i = 0; i < count; ++i) {
+		struct chat_client *c = chat_client_new("c");
+		unit_fail_if(chat_client_set_connect(c, &options) != 0);
+		/* Some are binary, and some hold the output. */
+		if (i % 2 == 0)
+			unit_fail_if(chat_client_set_binary(c) != 0);
+		if (i % 3 == 0)
+			unit_fail_if(chat_client_set_flush(c, 0.01, 0) != 0);
+		unit_fail_if(chat_client_group_add(g, c) != 0);
+		unit_fail_if(chat_client_connect(c, make_addr_str(port)) != 0);
+		clients.push_back(c);
+	}
+	unit_check(chat_client_group_add(g, clients[0]) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "add twice");
+	/*
+	 * Everyone has to be in the server's peers before the counted feeds.
+	 * The messages of this round are skipped by the receivers.
+	 */
+	for (struct chat_client *c : clients)
+		unit_fail_if(chat_client_feed(c, "hi\n", 3) != 0);
+	int hi_count = 0;
+	while (hi_count < count) {
+		chat_client_group_update(g, 0);
+		chat_server_update(s, 0);
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(s)) != NULL) {
+			++hi_count;
+			delete msg;
+		}
+	}
+	for (int i = 0; i < count; ++i) {
+		std::string msg = "msg " + std::to_string(i) + "\n";
+		unit_fail_if(chat_client_feed(clients[i], msg.data(),
+					      msg.size()) != 0);
+	}
+	std::vector<struct chat_message> msgs;
+	std::vector<struct chat_client *> receivers;
+	std::vector<int> got(count, 0);
+	size_t total = 0;
+	bool is_ok = true;
+	while (total < (size_t)count * (count - 1)) {
+		chat_client_group_update(g, 0.01);
+		chat_server_update(s, 0);
+		msgs.clear();
+		receivers.clear();
+		chat_client_group_pop_batch(g, &msgs, &receivers, 7);
+		is_ok = is_ok && msgs.size() == receivers.size() &&
+			msgs.size() <= 7;
+		for (size_t i = 0; i < receivers.size(); ++i) {
+			auto it = std::find(clients.begin(), clients.end(),
+					    receivers[i]);
+			is_ok = is_ok && it != clients.end();
+			if (!is_ok || msgs[i].data == "hi")
+				continue;
+			is_ok = msgs[i].data != "msg " +
+				std::to_string(it - clients.begin());
+			++got[it - clients.begin()];
+			++total;
+		}
+	}
+	unit_check(is_ok, "each message has its receiver");
+	unit_check(std::all_of(got.begin(), got.end(),
+			       [&](int n) { return n == count - 1; }),
+		   "everyone got everyone else");
+
+	/* A removed client works on its own, a deleted one leaves. */
+	unit_fail_if(chat_client_group_remove(g, clients[1]) != 0);
+	unit_check(chat_client_group_remove(g, clients[1]) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "remove twice");
+	chat_client_delete(clients[2]);
+	unit_fail_if(chat_client_feed(clients[3], "after\n", 6) != 0);
+	struct chat_message *msg;
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		delete msg;
+	while ((msg = chat_client_pop_next(clients[1])) == NULL) {
+		chat_client_group_update(g, 0);
+		chat_client_update(clients[1], 0);
+		chat_server_update(s, 0);
+	}
+	unit_check(msg->data == "after", "removed client receives");
+	delete msg;
+	chat_client_group_delete(g);
+	for (int i = 0; i < count; ++i) {
+		if (i != 2)
+			chat_client_delete(clients[i]);
+	}
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+struct test_takeover_ctx {
+	struct chat_server *server;
+	int fd;
+	int rc;
+};
+
+static void *
+test_takeover_worker_f(void *arg)
+{
+	struct test_takeover_ctx *ctx = (struct test_takeover_ctx *)arg;
+	ctx->rc = chat_server_takeover(ctx->server, ctx->fd);
+	return NULL;
+}
+
+static void
+test_handoff(void)
+{
+	unit_test_start();
+
+	struct chat_server *s1 = chat_server_new();
+	unit_fail_if(chat_server_set_history(s1, 1) != 0);
+	unit_check(chat_server_handoff(s1, -1) == CHAT_ERR_NOT_STARTED,
+		   "no handoff before listen");
+	unit_fail_if(chat_server_listen(s1, 0) != 0);
+	uint16_t port = server_get_port(s1);
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_set_binary(c2) != 0);
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(c1, "before\n", 7) != 0);
+	struct chat_message *msg = server_pop_next_blocking_from(s1, c1);
+	delete msg;
+	msg = client_pop_next_blocking(c2, s1);
+	unit_check(msg->data == "before", "got a message before");
+	delete msg;
+	/* This one has sent nothing, its buffer is empty. */
+	struct chat_client *c4 = chat_client_new("c4");
+	unit_fail_if(chat_client_connect(c4, make_addr_str(port)) != 0);
+	client_consume_events(c4);
+	/* A half of a message is in the old server's buffer. */
+	unit_fail_if(chat_client_feed(c1, "par", 3) != 0);
+	client_consume_events(c1);
+	server_consume_events(s1);
+
+	struct chat_server *s2 = chat_server_new_ex(2);
+	unit_fail_if(chat_server_set_history(s2, 1) != 0);
+	int fds[2];
+	unit_fail_if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0);
+	struct test_takeover_ctx ctx = {s2, fds[1], -1};
+	pthread_t t;
+	unit_fail_if(pthread_create(&t, NULL, test_takeover_worker_f,
+				    &ctx) != 0);
+	unit_check(chat_server_handoff(s1, fds[0]) == 0, "handoff");
+	pthread_join(t, NULL);
+	unit_check(ctx.rc == 0, "takeover");
+	close(fds[0]);
+	close(fds[1]);
+	unit_check(chat_server_update(s1, 0) == CHAT_ERR_NOT_STARTED,
+		   "the old server is stopped");
+	chat_server_delete(s1);
+	unit_check(chat_server_takeover(s2, -1) == CHAT_ERR_ALREADY_STARTED,
+		   "no takeover when listening");
+	unit_check(server_get_port(s2) == port, "same port");
+
+	/* The connections and their state survive. */
+	unit_fail_if(chat_client_feed(c1, "tial\n", 5) != 0);
+	msg = server_pop_next_blocking_from(s2, c1);
+	unit_check(msg->data == "partial", "the half is kept");
+	delete msg;
+	msg = client_pop_next_blocking(c2, s2);
+	unit_check(msg->data == "partial", "still binary");
+	delete msg;
+	unit_fail_if(chat_client_feed_binary(c2, "from c2", 7) != 0);
+	msg = client_pop_next_blocking_from(c1, c2, s2);
+	unit_check(msg->data == "from c2", "the other way");
+	delete msg;
+	/* New clients come to the new server, and see the old history. */
+	struct chat_client *c3 = chat_client_new("c3");
+	unit_fail_if(chat_client_connect(c3, make_addr_str(port)) != 0);
+	msg = client_pop_next_blocking(c3, s2);
+	unit_check(msg->data == "from c2", "history");
+	delete msg;
+	while ((msg = chat_server_pop_next(s2)) != NULL)
+		delete msg;
+	unit_fail_if(chat_client_feed(c4, "from c4\n", 8) != 0);
+	msg = server_pop_next_blocking_from(s2, c4);
+	unit_check(msg->data == "from c4", "a peer with empty input");
+	delete msg;
+
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_client_delete(c3);
+	chat_client_delete(c4);
+	chat_server_delete(s2);
+
+	unit_test_finish();
+}
+
+struct test_coro_server_ctx {
+	struct chat_coro_server *s;
+	int rc;
+};
+
+static void *
+test_coro_server_worker_f(void *arg)
+{
+	struct test_coro_server_ctx *ctx = (struct test_coro_server_ctx *)arg;
+	ctx->rc = chat_coro_server_run(ctx->s);
+	return NULL;
+}
+
+/** The server is in another thread, only the client is updated. */
+static struct chat_message *
+client_pop_next_waiting(struct chat_client *c)
+{
+	struct chat_message *msg;
+	while ((msg = chat_client_pop_next(c)) == NULL)
+		chat_client_update(c, 0.1);
+	return msg;
+}
+
+static void
+client_feed_blocking(struct chat_client *c, const char *msg)
+{
+	unit_fail_if(chat_client_feed(c, msg, strlen(msg)) != 0);
+	while ((chat_client_get_events(c) & CHAT_EVENT_OUTPUT) != 0)
+		chat_client_update(c, 0.1);
+}
+
+static void
+coro_server_wait_peer_count(const struct chat_coro_server *s,
+			    struct chat_client *c, uint64_t count)
+{
+	while (chat_coro_server_peer_count(s) != count)
+		chat_client_update(c, 0.01);
+}
+
+static void
+test_coro_server(void)
+{
+	unit_test_start();
+
+	struct chat_coro_server *s = chat_coro_server_new();
+	unit_check(chat_coro_server_run(s) == CHAT_ERR_NOT_STARTED,
+		   "run without listen");
+	unit_fail_if(chat_coro_server_listen(s, 0) != 0);
+	unit_check(chat_coro_server_listen(s, 0) == CHAT_ERR_ALREADY_STARTED,
+		   "listen twice");
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	unit_fail_if(getsockname(chat_coro_server_get_socket(s),
+				 (struct sockaddr *)&addr, &len) != 0);
+	uint16_t port = ntohs(addr.sin_port);
+	struct test_coro_server_ctx ctx = {s, -1};
+	pthread_t t;
+	unit_fail_if(pthread_create(&t, NULL, test_coro_server_worker_f,
+				    &ctx) != 0);
+
+	struct chat_client *c1 = chat_client_new("c1");
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	coro_server_wait_peer_count(s, c1, 2);
+
+	client_feed_blocking(c1, "hello\n");
+	struct chat_message *msg = client_pop_next_waiting(c2);
+	unit_check(msg->data == "hello", "a message is relayed");
+	delete msg;
+	client_feed_blocking(c2, "a\nb\n");
+	msg = client_pop_next_waiting(c1);
+	unit_check(msg->data == "a", "not to the author, and in order");
+	delete msg;
+	msg = client_pop_next_waiting(c1);
+	unit_check(msg->data == "b", "the next one");
+	delete msg;
+
+	struct chat_client *c3 = chat_client_new("c3");
+	unit_fail_if(chat_client_connect(c3, make_addr_str(port)) != 0);
+	coro_server_wait_peer_count(s, c3, 3);
+	client_feed_blocking(c3, "late\n");
+	msg = client_pop_next_waiting(c1);
+	unit_check(msg->data == "late", "a new peer is heard");
+	delete msg;
+	msg = client_pop_next_waiting(c2);
+	unit_check(msg->data == "late", "by everyone");
+	delete msg;
+
+	chat_client_delete(c2);
+	coro_server_wait_peer_count(s, c1, 2);
+	client_feed_blocking(c1, "bye\n");
+	msg = client_pop_next_waiting(c3);
+	unit_check(msg->data == "bye", "the others work after a disconnect");
+	delete msg;
+
+	chat_coro_server_stop(s);
+	pthread_join(t, NULL);
+	unit_check(ctx.rc == 0, "stopped");
+	unit_check(chat_coro_server_peer_count(s) == 0,
+		   "the peers are disconnected");
+	chat_client_delete(c1);
+	chat_client_delete(c3);
+	chat_coro_server_delete(s);
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -691,8 +2184,26 @@ main(int argc, char **argv)
 	test_multi_feed();
 	test_multi_client();
 	test_stress();
+	test_threads();
+	test_output_limits();
+	test_pop_batch();
+	test_binary();
+	test_text_check();
+	test_uring();
+	test_options();
+	test_timeouts();
+	test_client_flush();
+	test_tls();
+	test_rooms();
+	test_history();
 	test_big_author();
 	test_server_feed();
+	test_zerocopy();
+	test_compression();
+	test_handoff();
+	test_connect_options();
+	test_client_group();
+	test_coro_server();
 
 	unit_test_finish();
 	return 0;
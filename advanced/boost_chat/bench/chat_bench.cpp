@@ -0,0 +1,294 @@
+// The server under load, in both designs, with 1, 2, 4, ... up to N io threads.
+//
+// - strand: one io_context run by N threads, all the server's work goes through one
+//   strand.
+// - sharded: N io_contexts with a thread each, the peers are spread over them.
+//
+// K clients live in their own io_context. Each one sends M messages in rounds, paced by
+// the given rate, and every message carries its send time. So each of the other K - 1
+// clients measures the broadcast latency when the message comes. Printed are the
+// messages/s taken by the server, the deliveries/s made by it, and the latency
+// percentiles.
+//
+// Usage: chat_bench [max_thread_count] [client_count] [msg_count] [msg_size]
+//                   [rounds_per_second]
+//
+// rounds_per_second - 0 means no pacing, all the messages are fed as fast as possible.
+//
+#include "chat.h"
+#include "chat_client.h"
+#include "chat_server.h"
+
+#include <algorithm>
+#include <atomic>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+enum
+{
+	// Time to get all the messages before the run is considered broken.
+	BENCH_TIMEOUT_SEC = 60,
+};
+
+static const char* BENCH_HELLO = "hello";
+
+class bench_io_core final
+{
+public:
+	~bench_io_core() { stop(); }
+
+	void
+	start(
+		uint32_t thread_count)
+	{
+		for (uint32_t i = 0; i < thread_count; ++i) {
+			m_workers.emplace_back([this]() {
+				boost::asio::executor_work_guard<
+					boost::asio::io_context::executor_type> work(
+					m_backend.get_executor());
+				m_backend.run();
+			});
+		}
+	}
+
+	void
+	stop()
+	{
+		m_backend.stop();
+		for (std::thread& w : m_workers)
+			w.join();
+		m_workers.clear();
+	}
+
+	boost::asio::io_context& backend() { return m_backend; }
+
+private:
+	boost::asio::io_context m_backend;
+	std::vector<std::thread> m_workers;
+};
+
+static uint64_t
+bench_now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// A client with its latencies. The callbacks of one client are serialized by its strand.
+struct bench_client final
+{
+	bench_client(
+		boost::asio::io_context& ioCtx,
+		std::string_view name) : m_cli(ioCtx, name) {}
+
+	chat_client m_cli;
+	std::vector<uint64_t> m_latencies;
+};
+
+struct bench_ctx final
+{
+	uint32_t client_count;
+	uint32_t msg_count;
+	uint32_t msg_size;
+	uint32_t rate;
+
+	std::atomic_uint64_t delivery_count{0};
+	std::atomic_uint32_t hello_count{0};
+	std::atomic_uint64_t server_msg_count{0};
+};
+
+static void
+bench_client_recv(
+	bench_client& c,
+	bench_ctx& ctx)
+{
+	c.m_cli.recv_async([&c, &ctx](chat_errcode err, std::unique_ptr<chat_message> msg) {
+		if (err != CHAT_ERR_NONE)
+			return;
+		if (msg->m_data != BENCH_HELLO) {
+			c.m_latencies.push_back(bench_now_ns() - std::stoull(msg->m_data));
+			ctx.delivery_count.fetch_add(1, std::memory_order_relaxed);
+		}
+		bench_client_recv(c, ctx);
+	});
+}
+
+// The server keeps the messages until they are taken, so they are taken all the time.
+static void
+bench_server_recv(
+	chat_server& server,
+	bench_ctx& ctx)
+{
+	server.recv_async([&server, &ctx](chat_errcode err,
+		std::unique_ptr<chat_message> msg) {
+		if (err != CHAT_ERR_NONE)
+			return;
+		if (msg->m_data == BENCH_HELLO)
+			ctx.hello_count.fetch_add(1, std::memory_order_relaxed);
+		else
+			ctx.server_msg_count.fetch_add(1, std::memory_order_relaxed);
+		bench_server_recv(server, ctx);
+	});
+}
+
+static bool
+bench_wait(
+	const std::atomic_uint64_t& counter,
+	uint64_t target)
+{
+	uint64_t deadline = bench_now_ns() + BENCH_TIMEOUT_SEC * 1000000000ull;
+	while (counter.load(std::memory_order_relaxed) < target) {
+		if (bench_now_ns() > deadline)
+			return false;
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+	return true;
+}
+
+static void
+bench_run(
+	chat_server& server,
+	const char* design,
+	uint32_t thread_count,
+	bench_ctx& ctx)
+{
+	bench_server_recv(server, ctx);
+	bench_io_core client_core;
+	client_core.start(2);
+	std::string endpoint = "localhost:" + std::to_string(server.port());
+
+	std::vector<std::unique_ptr<bench_client>> clients;
+	for (uint32_t i = 0; i < ctx.client_count; ++i) {
+		clients.emplace_back(std::make_unique<bench_client>(client_core.backend(),
+			"cli_" + std::to_string(i)));
+		bench_client& c = *clients.back();
+		event ev;
+		chat_errcode res = CHAT_ERR_NONE;
+		c.m_cli.connect_async(endpoint, [&](chat_errcode err) {
+			res = err;
+			ev.send();
+		});
+		ev.recv();
+		if (res != CHAT_ERR_NONE) {
+			std::cout << "Connect error: chat " << res << '\n';
+			abort();
+		}
+		c.m_latencies.reserve((size_t)ctx.msg_count * ctx.client_count);
+		bench_client_recv(c, ctx);
+	}
+	// The peers are in the server when their first messages come.
+	for (std::unique_ptr<bench_client>& c : clients)
+		c->m_cli.feed_async(std::string(BENCH_HELLO) + '\n');
+	while (ctx.hello_count.load(std::memory_order_relaxed) < ctx.client_count)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	uint64_t start = bench_now_ns();
+	uint64_t period = ctx.rate == 0 ? 0 : 1000000000ull / ctx.rate;
+	std::string msg;
+	for (uint32_t r = 0; r < ctx.msg_count; ++r) {
+		for (std::unique_ptr<bench_client>& c : clients) {
+			msg = std::to_string(bench_now_ns());
+			msg.resize(std::max<size_t>(msg.size(), ctx.msg_size), ' ');
+			msg += '\n';
+			c->m_cli.feed_async(msg);
+		}
+		if (period == 0)
+			continue;
+		uint64_t next = start + (r + 1) * period;
+		uint64_t now = bench_now_ns();
+		if (next > now)
+			std::this_thread::sleep_for(std::chrono::nanoseconds(next - now));
+	}
+	uint64_t target = (uint64_t)ctx.msg_count * ctx.client_count *
+		(ctx.client_count - 1);
+	if (not bench_wait(ctx.delivery_count, target)) {
+		std::cout << design << ": timed out, delivered " <<
+			ctx.delivery_count.load() << " of " << target << '\n';
+		abort();
+	}
+	double sec = (bench_now_ns() - start) / 1e9;
+	client_core.stop();
+
+	std::vector<uint64_t> lat;
+	lat.reserve(target);
+	for (std::unique_ptr<bench_client>& c : clients)
+		lat.insert(lat.end(), c->m_latencies.begin(), c->m_latencies.end());
+	std::sort(lat.begin(), lat.end());
+	auto pct = [&lat](double p) {
+		return lat[std::min<size_t>(lat.size() - 1, lat.size() * p)] / 1000.0;
+	};
+	std::cout << design << "\t" << thread_count << "\t" <<
+		(uint64_t)(ctx.msg_count * ctx.client_count / sec) << "\t" <<
+		(uint64_t)(target / sec) << "\t" << pct(0.5) << "\t" << pct(0.9) << "\t" <<
+		pct(0.99) << "\t" << pct(0.999) << "\t" << lat.back() / 1000.0 << '\n';
+	clients.clear();
+}
+
+static void
+bench_strand(
+	uint32_t thread_count,
+	bench_ctx& ctx)
+{
+	bench_io_core core;
+	core.start(thread_count);
+	chat_server server(core.backend());
+	if (server.start(0) != CHAT_ERR_NONE)
+		abort();
+	bench_run(server, "strand", thread_count, ctx);
+}
+
+static void
+bench_sharded(
+	uint32_t thread_count,
+	bench_ctx& ctx)
+{
+	std::vector<std::unique_ptr<bench_io_core>> cores;
+	std::vector<boost::asio::io_context*> backends;
+	for (uint32_t i = 0; i < thread_count; ++i) {
+		cores.emplace_back(std::make_unique<bench_io_core>());
+		cores.back()->start(1);
+		backends.push_back(&cores.back()->backend());
+	}
+	chat_server server(backends);
+	if (server.start(0) != CHAT_ERR_NONE)
+		abort();
+	bench_run(server, "sharded", thread_count, ctx);
+}
+
+int
+main(int argc, char** argv)
+{
+	uint32_t max_thread_count = argc > 1 ? atoi(argv[1]) :
+		std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+	uint32_t client_count = argc > 2 ? atoi(argv[2]) : 50;
+	uint32_t msg_count = argc > 3 ? atoi(argv[3]) : 200;
+	uint32_t msg_size = argc > 4 ? atoi(argv[4]) : 64;
+	uint32_t rate = argc > 5 ? atoi(argv[5]) : 0;
+	if (max_thread_count == 0 || client_count < 2 || msg_count == 0) {
+		std::cout << "Usage: chat_bench [max_thread_count] [client_count] "
+			"[msg_count] [msg_size] [rounds_per_second]\n";
+		return -1;
+	}
+	std::cout << "clients: " << client_count << ", messages per client: " <<
+		msg_count << ", size: " << msg_size << ", rounds/s: " << rate << '\n';
+	std::cout << "design\tthreads\tmsgs/s\tdelivered/s\tp50 us\tp90 us\tp99 us\t"
+		"p99.9 us\tmax us\n";
+	for (uint32_t t = 1; t <= max_thread_count; t *= 2) {
+		for (int is_sharded = 0; is_sharded < 2; ++is_sharded) {
+			bench_ctx ctx;
+			ctx.client_count = client_count;
+			ctx.msg_count = msg_count;
+			ctx.msg_size = msg_size;
+			ctx.rate = rate;
+			if (is_sharded)
+				bench_sharded(t, ctx);
+			else
+				bench_strand(t, ctx);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,152 @@
+// Costs of the server's containers, old and new, without the network.
+//
+// - broadcast: visit every peer and queue a shared message to it. The old peers were an
+//   std::list of shared_ptr with an std::deque output queue each, the new ones are a
+//   vector with a chat_ring each.
+// - fifo: push and pop the requests and messages, std::list of unique_ptr against
+//   chat_ring.
+//
+// Usage: containers_bench [peer_count] [round_count]
+//
+#include "chat.h"
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <random>
+
+using bench_frame = std::shared_ptr<const std::string>;
+
+struct bench_list_peer
+{
+	std::deque<bench_frame> m_out_queue;
+};
+
+struct bench_vector_peer
+{
+	chat_ring<bench_frame> m_out_queue;
+};
+
+struct bench_request
+{
+	std::function<void(int)> m_cb;
+};
+
+static double
+bench_now()
+{
+	return std::chrono::duration<double>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Allocate the peers interleaved with garbage, like a long living server does, so the
+// list nodes are not in a row.
+template<typename Peer, typename Container>
+static void
+bench_fill(
+	Container& peers,
+	uint32_t count,
+	std::vector<std::unique_ptr<char[]>>& garbage)
+{
+	std::mt19937 rnd(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		garbage.emplace_back(std::make_unique<char[]>(16 + rnd() % 512));
+		peers.emplace_back(std::make_shared<Peer>());
+	}
+}
+
+template<typename Container>
+static double
+bench_broadcast(
+	Container& peers,
+	uint32_t round_count)
+{
+	bench_frame frame = std::make_shared<const std::string>(64, 'x');
+	double start = bench_now();
+	for (uint32_t r = 0; r < round_count; ++r) {
+		for (auto& p : peers)
+			p->m_out_queue.push_back(bench_frame(frame));
+		// Like a send of the whole queue.
+		for (auto& p : peers)
+			p->m_out_queue.pop_front();
+	}
+	return (bench_now() - start) * 1e9 / round_count / peers.size();
+}
+
+static double
+bench_fifo_list(
+	uint32_t count)
+{
+	std::list<std::unique_ptr<bench_request>> reqs;
+	std::list<std::unique_ptr<chat_message>> msgs;
+	int sum = 0;
+	double start = bench_now();
+	for (uint32_t i = 0; i < count; ++i) {
+		reqs.emplace_back(std::make_unique<bench_request>());
+		reqs.back()->m_cb = [&sum](int v) { sum += v; };
+		msgs.emplace_back(std::make_unique<chat_message>());
+		std::unique_ptr<bench_request> req = std::move(reqs.front());
+		reqs.pop_front();
+		std::unique_ptr<chat_message> msg = std::move(msgs.front());
+		msgs.pop_front();
+		req->m_cb((int)msg->m_data.size() + 1);
+	}
+	double res = (bench_now() - start) * 1e9 / count;
+	if (sum != (int)count)
+		abort();
+	return res;
+}
+
+static double
+bench_fifo_ring(
+	uint32_t count)
+{
+	chat_ring<bench_request> reqs;
+	chat_ring<std::unique_ptr<chat_message>> msgs;
+	int sum = 0;
+	double start = bench_now();
+	for (uint32_t i = 0; i < count; ++i) {
+		bench_request req;
+		req.m_cb = [&sum](int v) { sum += v; };
+		reqs.push_back(std::move(req));
+		msgs.push_back(std::make_unique<chat_message>());
+		std::function<void(int)> cb = std::move(reqs.front().m_cb);
+		reqs.pop_front();
+		std::unique_ptr<chat_message> msg = std::move(msgs.front());
+		msgs.pop_front();
+		cb((int)msg->m_data.size() + 1);
+	}
+	double res = (bench_now() - start) * 1e9 / count;
+	if (sum != (int)count)
+		abort();
+	return res;
+}
+
+int
+main(int argc, char** argv)
+{
+	uint32_t peer_count = argc > 1 ? atoi(argv[1]) : 1000;
+	uint32_t round_count = argc > 2 ? atoi(argv[2]) : 10000;
+	if (peer_count == 0 || round_count == 0) {
+		std::cout << "Usage: containers_bench [peer_count] [round_count]\n";
+		return -1;
+	}
+	std::vector<std::unique_ptr<char[]>> garbage;
+	std::list<std::shared_ptr<bench_list_peer>> list_peers;
+	bench_fill<bench_list_peer>(list_peers, peer_count, garbage);
+	std::vector<std::shared_ptr<bench_vector_peer>> vector_peers;
+	bench_fill<bench_vector_peer>(vector_peers, peer_count, garbage);
+
+	std::cout << "peers: " << peer_count << ", rounds: " << round_count << '\n';
+	std::cout << "broadcast, ns per peer:\n";
+	std::cout << "\tlist + deque: " << bench_broadcast(list_peers, round_count) << '\n';
+	std::cout << "\tvector + ring: " << bench_broadcast(vector_peers, round_count) << '\n';
+	uint32_t op_count = peer_count * round_count;
+	std::cout << "request + message fifo, ns per pair:\n";
+	std::cout << "\tlist: " << bench_fifo_list(op_count) << '\n';
+	std::cout << "\tring: " << bench_fifo_ring(op_count) << '\n';
+	return 0;
+}
@@ -1,18 +1,201 @@
 #include "chat.h"
 
-event::event() : m_is_set(false) {}
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static void
+chat_frame_put_size(
+	std::string& out,
+	size_t size)
+{
+	uint32_t value = (uint32_t)size;
+	out.append((const char*)&value, sizeof(value));
+}
+
+static uint32_t
+chat_frame_get_size(
+	const char* pos)
+{
+	uint32_t value;
+	memcpy(&value, pos, sizeof(value));
+	return value;
+}
+
+void
+chat_frame_put_data(
+	std::string& out,
+	std::string_view data)
+{
+	chat_frame_put_size(out, data.length());
+	out.append(data);
+}
+
+void
+chat_frame_put_msg(
+	std::string& out,
+	std::string_view author,
+	std::string_view data)
+{
+	chat_frame_put_size(out, author.length());
+	chat_frame_put_size(out, data.length());
+	out.append(author);
+	out.append(data);
+}
+
+size_t
+chat_frame_size_data(
+	std::string_view in)
+{
+	if (in.length() < CHAT_FRAME_SIZE_LEN)
+		return 0;
+	return CHAT_FRAME_SIZE_LEN + chat_frame_get_size(in.data());
+}
+
+size_t
+chat_frame_size_msg(
+	std::string_view in)
+{
+	if (in.length() < 2 * CHAT_FRAME_SIZE_LEN)
+		return 0;
+	return 2 * CHAT_FRAME_SIZE_LEN + (size_t)chat_frame_get_size(in.data()) +
+		chat_frame_get_size(in.data() + CHAT_FRAME_SIZE_LEN);
+}
+
+bool
+chat_frame_get_data(
+	std::string_view& in,
+	std::string_view& data)
+{
+	if (in.length() < CHAT_FRAME_SIZE_LEN)
+		return false;
+	size_t size = chat_frame_get_size(in.data());
+	if (in.length() - CHAT_FRAME_SIZE_LEN < size)
+		return false;
+	data = in.substr(CHAT_FRAME_SIZE_LEN, size);
+	in.remove_prefix(CHAT_FRAME_SIZE_LEN + size);
+	return true;
+}
+
+bool
+chat_frame_get_msg(
+	std::string_view& in,
+	std::string_view& author,
+	std::string_view& data)
+{
+	if (in.length() < 2 * CHAT_FRAME_SIZE_LEN)
+		return false;
+	size_t author_size = chat_frame_get_size(in.data());
+	size_t data_size = chat_frame_get_size(in.data() + CHAT_FRAME_SIZE_LEN);
+	size_t size = 2 * CHAT_FRAME_SIZE_LEN + author_size + data_size;
+	if (in.length() < size)
+		return false;
+	author = in.substr(2 * CHAT_FRAME_SIZE_LEN, author_size);
+	data = in.substr(2 * CHAT_FRAME_SIZE_LEN + author_size, data_size);
+	in.remove_prefix(size);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+char*
+chat_in_buf::prepare(
+	size_t need,
+	size_t& size)
+{
+	size_t used = m_end - m_begin;
+	size_t want = m_recv_size;
+	if (need > used && need - used > want)
+		want = need - used;
+	if (m_buf.length() - m_end < want) {
+		if (m_begin > 0) {
+			memmove(m_buf.data(), m_buf.data() + m_begin, used);
+			m_begin = 0;
+			m_end = used;
+		}
+		if (m_buf.length() - m_end < want)
+			m_buf.resize(std::max(m_end + want, m_buf.length() * 2));
+	}
+	size = m_buf.length() - m_end;
+	return m_buf.data() + m_end;
+}
+
+void
+chat_in_buf::commit(
+	size_t size)
+{
+	m_end += size;
+	if (size >= m_recv_size)
+		m_recv_size = std::min<size_t>(m_recv_size * 2, CHAT_RECV_BUF_MAX);
+	else if (size < m_recv_size / 4)
+		m_recv_size = std::max<size_t>(m_recv_size / 2, CHAT_RECV_BUF_SIZE);
+}
+
+void
+chat_in_buf::consume(
+	size_t size)
+{
+	m_begin += size;
+	if (m_begin != m_end)
+		return;
+	m_begin = 0;
+	m_end = 0;
+	if (m_buf.length() > 2 * m_recv_size)
+		std::string(m_recv_size, 0).swap(m_buf);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+enum
+{
+	CHAT_EVENT_IS_WAITED = 1u << 31,
+	CHAT_EVENT_COUNT_MASK = CHAT_EVENT_IS_WAITED - 1,
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) and
+	std::atomic<uint32_t>::is_always_lock_free, "futex works on plain words");
+
+event::event(
+	uint32_t count)
+	: m_state(count)
+{
+	assert((count & CHAT_EVENT_IS_WAITED) == 0);
+}
 
 void
 event::send()
 {
-	std::unique_lock lock(m_mutex);
-	m_is_set = true;
+	uint32_t state = m_state.load(std::memory_order_relaxed);
+	do {
+		if ((state & CHAT_EVENT_COUNT_MASK) == 0)
+			return;
+	} while (not m_state.compare_exchange_weak(state, state - 1,
+		std::memory_order_acq_rel, std::memory_order_relaxed));
+	if (state != (CHAT_EVENT_IS_WAITED | 1))
+		return;
+	// The waiter can return and free the event right after the update, before the wake.
+	// It is fine, a wake doesn't touch the memory.
+	syscall(SYS_futex, (uint32_t*)&m_state, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr,
+		nullptr, 0);
 }
 
 void
 event::recv()
 {
-	std::unique_lock lock(m_mutex);
-	while (not m_is_set)
-		m_cond.wait(lock);
+	uint32_t state = m_state.load(std::memory_order_acquire);
+	while ((state & CHAT_EVENT_COUNT_MASK) != 0) {
+		if ((state & CHAT_EVENT_IS_WAITED) == 0) {
+			if (not m_state.compare_exchange_weak(state,
+				state | CHAT_EVENT_IS_WAITED, std::memory_order_acquire))
+				continue;
+			state |= CHAT_EVENT_IS_WAITED;
+		}
+		// Returns at once if any send came after the load.
+		syscall(SYS_futex, (uint32_t*)&m_state, FUTEX_WAIT_PRIVATE, state, nullptr,
+			nullptr, 0);
+		state = m_state.load(std::memory_order_acquire);
+	}
 }
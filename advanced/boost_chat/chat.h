@@ -1,12 +1,23 @@
 #pragma once
 
-#include <condition_variable>
-#include <mutex>
+#include <atomic>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
 #include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 enum
 {
 	CHAT_RECV_BUF_SIZE = 128,
+	// A receipt grows up to this under load. Bigger messages are waited for whole.
+	CHAT_RECV_BUF_MAX = 64 * 1024,
+	// Enough for an async receive or send operation with its handler.
+	CHAT_HANDLER_MEMORY_SIZE = 512,
 };
 
 enum chat_errcode
@@ -32,10 +43,383 @@ struct chat_message
 	// <YOUR CODE IF NEEDED>
 };
 
+// The protocol. All the numbers are 32 bit in the host byte order, both sides are
+// assumed to run on the same kind of machines.
+//
+// Client to server: a frame per message - size, data. The first frame is the client's
+// name.
+//
+// Server to client: a frame per message - author's size, data's size, author, data.
+//
+// The sizes come first so the receiver can wait for the whole message without scanning
+// its bytes.
+enum
+{
+	CHAT_FRAME_SIZE_LEN = sizeof(uint32_t),
+};
+
+// The author of the messages fed to the server itself.
+#define CHAT_SERVER_AUTHOR "server"
+
+void
+chat_frame_put_data(
+	std::string& out,
+	std::string_view data);
+
+void
+chat_frame_put_msg(
+	std::string& out,
+	std::string_view author,
+	std::string_view data);
+
+// Size of the whole first client-to-server frame in `in`. 0 when even its header is not
+// complete.
+size_t
+chat_frame_size_data(
+	std::string_view in);
+
+// Size of the whole first server-to-client frame in `in`, or 0.
+size_t
+chat_frame_size_msg(
+	std::string_view in);
+
+// Take the next complete client-to-server frame from the beginning of `in`. On success
+// `in` is moved past the frame.
+bool
+chat_frame_get_data(
+	std::string_view& in,
+	std::string_view& data);
+
+// Take the next complete server-to-client frame from the beginning of `in`.
+bool
+chat_frame_get_msg(
+	std::string_view& in,
+	std::string_view& author,
+	std::string_view& data);
+
+// Accumulates the fed text and cuts it into messages by '\n'. Each message is trimmed
+// from spaces at both sides, the empty ones are skipped. An incomplete tail waits for
+// the next feed.
+struct chat_feed_buf
+{
+public:
+	template<typename F>
+	void
+	feed(
+		std::string_view text,
+		F&& on_msg);
+
+private:
+	std::string m_tail;
+};
+
+template<typename F>
+void
+chat_feed_buf::feed(
+	std::string_view text,
+	F&& on_msg)
+{
+	while (not text.empty()) {
+		size_t end = text.find('\n');
+		if (end == std::string_view::npos) {
+			m_tail.append(text);
+			return;
+		}
+		std::string_view line = text.substr(0, end);
+		text.remove_prefix(end + 1);
+		if (not m_tail.empty()) {
+			m_tail.append(line);
+			line = m_tail;
+		}
+		size_t begin = 0;
+		while (begin < line.length() && isspace((unsigned char)line[begin]))
+			++begin;
+		size_t len = line.length();
+		while (len > begin && isspace((unsigned char)line[len - 1]))
+			--len;
+		if (len > begin)
+			on_msg(line.substr(begin, len - begin));
+		m_tail.clear();
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// FIFO queue on a ring buffer. Unlike std::list it doesn't allocate per element and keeps
+// them next to each other. Grows x2 and never shrinks, so a steady queue doesn't
+// allocate at all. The popped slots are reset to T() to free what they hold.
+template<typename T>
+class chat_ring
+{
+public:
+	chat_ring() : m_head(0), m_count(0) {}
+
+	bool
+	empty() const { return m_count == 0; }
+
+	size_t
+	size() const { return m_count; }
+
+	T&
+	front() { return m_data[m_head]; }
+
+	T&
+	operator[](
+		size_t i) { return m_data[(m_head + i) & (m_data.size() - 1)]; }
+
+	void
+	push_back(
+		T&& value);
+
+	void
+	push_back(
+		const T& value) { push_back(T(value)); }
+
+	void
+	pop_front();
+
+	void
+	clear();
+
+private:
+	// Power of 2 size.
+	std::vector<T> m_data;
+	size_t m_head;
+	size_t m_count;
+};
+
+template<typename T>
+void
+chat_ring<T>::push_back(
+	T&& value)
+{
+	if (m_count == m_data.size()) {
+		std::vector<T> data(m_data.empty() ? 8 : m_data.size() * 2);
+		for (size_t i = 0; i < m_count; ++i)
+			data[i] = std::move((*this)[i]);
+		m_data.swap(data);
+		m_head = 0;
+	}
+	m_data[(m_head + m_count) & (m_data.size() - 1)] = std::move(value);
+	++m_count;
+}
+
+template<typename T>
+void
+chat_ring<T>::pop_front()
+{
+	m_data[m_head] = T();
+	m_head = (m_head + 1) & (m_data.size() - 1);
+	--m_count;
+}
+
+template<typename T>
+void
+chat_ring<T>::clear()
+{
+	while (m_count > 0)
+		pop_front();
+	m_head = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Memory for the handler of one pending async operation. A chain of operations where the
+// next one starts only after the previous one completes, like a receive loop, reuses it
+// and doesn't allocate. Asio frees the operation's memory before calling the handler, so
+// the handler can start the next operation in the same memory. Too big or overlapping
+// requests go to the heap.
+class chat_handler_memory
+{
+public:
+	chat_handler_memory() : m_is_used(false) {}
+	chat_handler_memory(const chat_handler_memory&) = delete;
+	chat_handler_memory& operator=(const chat_handler_memory&) = delete;
+
+	void*
+	allocate(
+		size_t size)
+	{
+		if (not m_is_used && size <= sizeof(m_storage)) {
+			m_is_used = true;
+			return &m_storage;
+		}
+		return ::operator new(size);
+	}
+
+	void
+	deallocate(
+		void* ptr)
+	{
+		if (ptr == &m_storage) {
+			m_is_used = false;
+			return;
+		}
+		::operator delete(ptr);
+	}
+
+private:
+	std::aligned_storage_t<CHAT_HANDLER_MEMORY_SIZE> m_storage;
+	bool m_is_used;
+};
+
+template<typename T>
+class chat_handler_allocator
+{
+public:
+	using value_type = T;
+
+	explicit chat_handler_allocator(
+		chat_handler_memory& mem) noexcept : m_mem(&mem) {}
+
+	template<typename U>
+	chat_handler_allocator(
+		const chat_handler_allocator<U>& other) noexcept : m_mem(other.m_mem) {}
+
+	T*
+	allocate(
+		size_t count) const { return (T*)m_mem->allocate(sizeof(T) * count); }
+
+	void
+	deallocate(
+		T* ptr,
+		size_t) const { m_mem->deallocate(ptr); }
+
+	bool
+	operator==(
+		const chat_handler_allocator& other) const noexcept
+	{ return m_mem == other.m_mem; }
+
+	bool
+	operator!=(
+		const chat_handler_allocator& other) const noexcept
+	{ return m_mem != other.m_mem; }
+
+private:
+	chat_handler_memory* m_mem;
+
+	template<typename U>
+	friend class chat_handler_allocator;
+};
+
+// A handler with its memory, found by asio as the handler's associated allocator.
+template<typename Handler>
+class chat_alloc_handler
+{
+public:
+	using allocator_type = chat_handler_allocator<Handler>;
+
+	chat_alloc_handler(
+		chat_handler_memory& mem,
+		Handler&& handler)
+		: m_mem(&mem)
+		, m_handler(std::move(handler)) {}
+
+	allocator_type
+	get_allocator() const noexcept { return allocator_type(*m_mem); }
+
+	template<typename... Args>
+	void
+	operator()(
+		Args&&... args) { m_handler(std::forward<Args>(args)...); }
+
+private:
+	chat_handler_memory* m_mem;
+	Handler m_handler;
+};
+
+template<typename Handler>
+inline chat_alloc_handler<std::decay_t<Handler>>
+chat_make_alloc_handler(
+	chat_handler_memory& mem,
+	Handler&& handler)
+{
+	return chat_alloc_handler<std::decay_t<Handler>>(mem, std::forward<Handler>(handler));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Somebody waiting for an operation to end, completed in the executor of the object which
+// does the operation. The base of the awaitable API: a waiter lives in the frame of the
+// waiting coroutine, so waiting costs neither std::function nor a heap allocation.
+class chat_waiter
+{
+public:
+	virtual void
+	complete(
+		chat_errcode err) = 0;
+
+	// The object is gone and the wait is never going to end. The waiter must not be
+	// touched after that, it can be freed right in the call.
+	virtual void
+	destroy() = 0;
+
+protected:
+	~chat_waiter() = default;
+};
+
+#if defined(__cpp_impl_coroutine)
+#define CHAT_HAS_CO_AWAIT 1
+#else
+#define CHAT_HAS_CO_AWAIT 0
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Receive buffer. The data is received right into its free space and parsed in place.
+//
+// The receipt size adapts to the load. It doubles after each receipt which filled it, up
+// to CHAT_RECV_BUF_MAX, and halves after the ones that used less than a quarter, down to
+// CHAT_RECV_BUF_SIZE. When the buffer is drained and is much bigger than the receipt
+// size, the memory is given back, so an idle peer keeps only a small buffer.
+struct chat_in_buf
+{
+public:
+	chat_in_buf() : m_begin(0), m_end(0), m_recv_size(CHAT_RECV_BUF_SIZE) {}
+
+	// Free space for the next receipt. `need` is the size of the message at the start of
+	// the data if known, 0 otherwise. Then the space fits the whole rest of it.
+	char*
+	prepare(
+		size_t need,
+		size_t& size);
+
+	void
+	commit(
+		size_t size);
+
+	// The received and not yet consumed data.
+	std::string_view
+	data() const { return std::string_view(m_buf.data() + m_begin, m_end - m_begin); }
+
+	void
+	consume(
+		size_t size);
+
+	size_t
+	recv_size() const { return m_recv_size; }
+
+	size_t
+	capacity() const { return m_buf.length(); }
+
+private:
+	std::string m_buf;
+	size_t m_begin;
+	size_t m_end;
+	size_t m_recv_size;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// One-shot event for the sync calls across the threads. It is set by `count` sends, so
+// a whole batch of callbacks wakes the waiter once. The sends are atomic operations only,
+// the kernel is entered (futex) just to sleep and to wake the one who sleeps. The extra
+// sends are ignored.
 struct event
 {
 public:
-	event();
+	event(
+		uint32_t count = 1);
 
 	void
 	send();
@@ -43,7 +427,67 @@ public:
 	recv();
 
 private:
-	std::mutex m_mutex;
-	std::condition_variable m_cond;
-	bool m_is_set;
-};
\ No newline at end of file
+	// The sends left and a flag that somebody sleeps.
+	std::atomic<uint32_t> m_state;
+};
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#if CHAT_HAS_CO_AWAIT
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <optional>
+
+// Waiter of a coroutine. Keeps the handler which resumes the coroutine. Is supposed to be
+// a local variable in the coroutine, so it lives exactly while the coroutine waits.
+class chat_co_waiter final : public chat_waiter
+{
+public:
+	using handler_type = boost::asio::async_result<
+		boost::asio::use_awaitable_t<>, void(chat_errcode)>::handler_type;
+
+	// Suspend the coroutine until complete(). The start function gives the waiter to the
+	// operation. It is called when the coroutine is already suspended, so the waiter
+	// can be completed right away even from another thread.
+	template<typename Start>
+	auto
+	wait(
+		Start&& start)
+	{
+		return boost::asio::async_initiate<decltype(boost::asio::use_awaitable),
+			void(chat_errcode)>([this, &start](handler_type&& handler) {
+			m_handler.emplace(std::move(handler));
+			start(*this);
+		}, boost::asio::use_awaitable);
+	}
+
+	void
+	complete(
+		chat_errcode err) override
+	{
+		// The coroutine can end right in the handler and free the waiter.
+		handler_type handler = std::move(*m_handler);
+		m_handler.reset();
+		// Inline when the coroutine runs in the executor of the operation.
+		boost::asio::any_io_executor exec = handler.get_executor();
+		boost::asio::dispatch(exec, [handler = std::move(handler), err]() mutable {
+			handler(err);
+		});
+	}
+
+	void
+	destroy() override
+	{
+		// The handler owns the frames of the coroutine, this waiter's one too.
+		handler_type handler = std::move(*m_handler);
+		m_handler.reset();
+	}
+
+private:
+	std::optional<handler_type> m_handler;
+};
+
+#endif
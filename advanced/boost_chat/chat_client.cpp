@@ -2,17 +2,25 @@
 #include "chat_client.h"
 
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/connect.hpp>
 #include <boost/asio/io_context.hpp>
-#include <boost/asio/io_context_strand.hpp>
 #include <boost/asio/ip/tcp.hpp>
-#include <list>
+#include <boost/asio/read.hpp>
+#include <boost/asio/strand.hpp>
 
+// Either a callback or a waiter with the place for the message.
 struct chat_client_request final
 {
+	chat_client_request() = default;
 	chat_client_request(
 		chat_client_on_msg_f&& cb) : m_cb(std::move(cb)) {}
+	chat_client_request(
+		chat_message& msg,
+		chat_waiter& waiter) : m_msg(&msg), m_waiter(&waiter) {}
 
 	chat_client_on_msg_f m_cb;
+	chat_message* m_msg = nullptr;
+	chat_waiter* m_waiter = nullptr;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -38,7 +46,38 @@ public:
 	feed_async(
 		std::string_view text);
 
+	void
+	stop();
+
+	boost::asio::any_io_executor
+	get_executor() const { return m_strand; }
+
+	bool
+	recv_try(
+		chat_message& msg,
+		chat_errcode& err);
+
+	void
+	recv_wait(
+		chat_message& msg,
+		chat_waiter& waiter);
+
+	bool
+	send_try(
+		std::string_view text,
+		chat_errcode& err);
+
+	void
+	send_wait(
+		std::string_view text,
+		chat_waiter& waiter);
+
 private:
+	void
+	priv_in_strand_connect(
+		std::string&& endpoint,
+		chat_client_on_connect_f&& cb);
+
 	void
 	priv_in_strand_on_resolve(
 		const boost::system::error_code& err,
@@ -52,13 +91,20 @@ private:
 
 	void
 	priv_in_strand_on_new_request(
-		std::unique_ptr<chat_client_request> req);
+		chat_client_request&& req);
 
 	void
-	priv_in_strand_recv();
+	priv_in_strand_serve_requests();
+
+	// The receive and send loops pass the reference to the peer from one operation to
+	// the next by move, so they don't touch its counter.
+	void
+	priv_in_strand_recv(
+		std::shared_ptr<chat_client_peer>&& self);
 
 	void
 	priv_in_strand_on_recv(
+		std::shared_ptr<chat_client_peer>&& self,
 		const boost::system::error_code& err,
 		std::size_t size);
 
@@ -66,34 +112,70 @@ private:
 	priv_in_strand_on_new_feed(
 		std::string_view text);
 
+	void
+	priv_in_strand_on_new_send(
+		std::string_view text,
+		chat_waiter& waiter);
+
+	// Complete the senders which don't need to wait anymore.
+	void
+	priv_in_strand_serve_senders();
+
+	size_t
+	priv_out_size() const
+	{ return m_out_buf.length() + m_send_buf.length() - m_send_pos; }
+
 	void
 	priv_in_strand_send();
 
+	void
+	priv_in_strand_send_next(
+		std::shared_ptr<chat_client_peer>&& self);
+
 	void
 	priv_in_strand_on_send(
+		std::shared_ptr<chat_client_peer>&& self,
 		const boost::system::error_code& err,
 		std::size_t size);
 
+	void
+	priv_in_strand_stop();
+
 	// Strand "serializes" all callbacks associated with it. It means the strand will
 	// invoke them one by one, never in more than one thread at a time. That in turn
 	// means, that inside strand callbacks you don't need to protect its data with any
 	// mutexes.
-	boost::asio::io_context::strand m_strand;
+	boost::asio::strand<boost::asio::io_context::executor_type> m_strand;
 	boost::asio::ip::tcp::socket m_sock;
 
 	// Requests which are waiting for data.
-	std::list<std::unique_ptr<chat_client_request>> m_reqs;
+	chat_ring<chat_client_request> m_reqs;
 	// Full messages waiting to be delivered to requests.
-	std::list<std::unique_ptr<chat_message>> m_in_msgs;
+	chat_ring<chat_message> m_in_msgs;
 	// Input buffer for reading the next incoming messages.
-	std::string m_in_buf;
-	// Output buffer for prearing the next outgoing messages.
+	chat_in_buf m_in_buf;
+	// Output buffer for prearing the next outgoing messages. Starts with the name.
 	std::string m_out_buf;
+	// The buffer being sent now, and how much of it is sent. New messages go to
+	// m_out_buf meanwhile.
+	std::string m_send_buf;
+	size_t m_send_pos;
+	// Partial message fed without '\n' yet.
+	chat_feed_buf m_feed_buf;
+	// Senders waiting for the output to be sent.
+	chat_ring<chat_waiter*> m_senders;
 
 	boost::asio::ip::tcp::resolver m_resolver;
 	const std::string m_name;
 
-	// <YOUR CODE IF NEEDED>
+	chat_handler_memory m_recv_mem;
+	chat_handler_memory m_send_mem;
+
+	bool m_is_connected;
+	bool m_is_sending;
+	// The connection is lost or the client is deleted. Nothing is sent or received
+	// anymore and the requests get an error once the received messages end.
+	bool m_is_stopped;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -108,7 +190,8 @@ chat_client::chat_client(
 
 chat_client::~chat_client()
 {
-	// <YOUR CODE IF NEEDED>
+	// The pending operations keep the peer alive, so it has to be stopped explicitly.
+	m_conn->stop();
 }
 
 void
@@ -133,56 +216,98 @@ chat_client::feed_async(
 	m_conn->feed_async(text);
 }
 
+boost::asio::any_io_executor
+chat_client::get_executor() const
+{
+	return m_conn->get_executor();
+}
+
+bool
+chat_client::recv_try(
+	chat_message& msg,
+	chat_errcode& err)
+{
+	return m_conn->recv_try(msg, err);
+}
+
+void
+chat_client::recv_wait(
+	chat_message& msg,
+	chat_waiter& waiter)
+{
+	m_conn->recv_wait(msg, waiter);
+}
+
+bool
+chat_client::send_try(
+	std::string_view text,
+	chat_errcode& err)
+{
+	return m_conn->send_try(text, err);
+}
+
+void
+chat_client::send_wait(
+	std::string_view text,
+	chat_waiter& waiter)
+{
+	m_conn->send_wait(text, waiter);
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 chat_client_peer::chat_client_peer(
 	boost::asio::io_context& ioCtx,
 	std::string_view name)
-	: m_strand(ioCtx)
+	: m_strand(boost::asio::make_strand(ioCtx))
 	, m_sock(ioCtx)
+	, m_send_pos(0)
 	, m_resolver(ioCtx)
 	, m_name(name)
+	, m_is_connected(false)
+	, m_is_sending(false)
+	, m_is_stopped(false)
 {
-	// <YOUR CODE IF NEEDED>
+	chat_frame_put_data(m_out_buf, m_name);
 }
 
 chat_client_peer::~chat_client_peer()
 {
-	for (std::unique_ptr<chat_client_request>& r : m_reqs)
-		r->m_cb(CHAT_ERR_CANCELED, {});
-	m_reqs.clear();
-
-	// <YOUR CODE IF NEEDED>
+	// The waiters are not completed, their coroutines could run in a context which is
+	// being destroyed. They are freed instead.
+	while (not m_reqs.empty()) {
+		chat_client_request req = std::move(m_reqs.front());
+		m_reqs.pop_front();
+		if (req.m_waiter != nullptr)
+			req.m_waiter->destroy();
+		else
+			req.m_cb(CHAT_ERR_CANCELED, {});
+	}
+	while (not m_senders.empty()) {
+		chat_waiter* waiter = m_senders.front();
+		m_senders.pop_front();
+		waiter->destroy();
+	}
 }
 
 void
 chat_client_peer::connect_async(
-	std::string_view /* endpoint */,
-	chat_client_on_connect_f&& /* cb */)
+	std::string_view endpoint,
+	chat_client_on_connect_f&& cb)
 {
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Extract host and port from the endpoint string.
-	//
-	// 2) Start resolving them to an IP:
-	// m_resolver.async_resolve(host, port, boost::asio::bind_executor(m_strand,
-	//	[ref = shared_from_this(), this, cb = std::move(cb)](
-	//		const boost::system::error_code& err,
-	//		boost::asio::ip::tcp::resolver::results_type results) {
-	//	priv_in_strand_on_resolve(err, std::move(cb), results);
-	// }));
+	boost::asio::post(m_strand, [ref = shared_from_this(), this,
+		endpoint = std::string(endpoint), cb = std::move(cb)]() mutable {
+		priv_in_strand_connect(std::move(endpoint), std::move(cb));
+	});
 }
 
 void
 chat_client_peer::recv_async(
 	chat_client_on_msg_f&& cb)
 {
-	std::unique_ptr<chat_client_request> req =
-		std::make_unique<chat_client_request>(std::move(cb));
 	boost::asio::post(m_strand,
-		[ref = shared_from_this(), req = std::move(req), this]() mutable {
-		priv_in_strand_on_new_request(std::move(req));
+		[ref = shared_from_this(), cb = std::move(cb), this]() mutable {
+		priv_in_strand_on_new_request(chat_client_request(std::move(cb)));
 	});
 }
 
@@ -190,162 +315,364 @@ void
 chat_client_peer::feed_async(
 	std::string_view text)
 {
-	boost::asio::post(m_strand, std::bind(
-		&chat_client_peer::priv_in_strand_on_new_feed, shared_from_this(),
-		std::string(text)));
+	boost::asio::post(m_strand, [ref = shared_from_this(), this,
+		text = std::string(text)]() {
+		priv_in_strand_on_new_feed(text);
+	});
 }
 
-void
-chat_client_peer::priv_in_strand_on_resolve(
-	const boost::system::error_code& /* err */,
-	chat_client_on_connect_f&& /* cb */,
-	boost::asio::ip::tcp::resolver::results_type /* results */)
+bool
+chat_client_peer::recv_try(
+	chat_message& msg,
+	chat_errcode& err)
 {
-	assert(m_strand.running_in_this_thread());
+	if (not m_strand.running_in_this_thread() or not m_reqs.empty())
+		return false;
+	if (not m_in_msgs.empty()) {
+		msg = std::move(m_in_msgs.front());
+		m_in_msgs.pop_front();
+		err = CHAT_ERR_NONE;
+		return true;
+	}
+	if (m_is_stopped) {
+		err = CHAT_ERR_CANCELED;
+		return true;
+	}
+	return false;
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+void
+chat_client_peer::recv_wait(
+	chat_message& msg,
+	chat_waiter& waiter)
+{
+	if (m_strand.running_in_this_thread()) {
+		priv_in_strand_on_new_request(chat_client_request(msg, waiter));
+		return;
+	}
+	boost::asio::post(m_strand, [ref = shared_from_this(), this, &msg, &waiter]() {
+		priv_in_strand_on_new_request(chat_client_request(msg, waiter));
+	});
+}
 
-	// 1) Choose one of the results (it is an array).
-	// 2) Do
-	// m_sock.async_connect(endpoint, boost::asio::bind_executor(m_strand,
-	//	[ref = shared_from_this(), this, cb = std::move(cb)](
-	//		const boost::system::error_code& err) {
-	//	priv_in_strand_on_connect(err, std::move(cb));
-	// }));
+bool
+chat_client_peer::send_try(
+	std::string_view text,
+	chat_errcode& err)
+{
+	if (not m_strand.running_in_this_thread())
+		return false;
+	if (m_is_stopped) {
+		err = CHAT_ERR_CANCELED;
+		return true;
+	}
+	// The older senders go first.
+	if (not m_senders.empty() or priv_out_size() >= CHAT_CLIENT_SEND_LIMIT)
+		return false;
+	priv_in_strand_on_new_feed(text);
+	err = CHAT_ERR_NONE;
+	return true;
 }
 
 void
-chat_client_peer::priv_in_strand_on_connect(
-	const boost::system::error_code& /* err */,
-	chat_client_on_connect_f&& /* cb */)
+chat_client_peer::send_wait(
+	std::string_view text,
+	chat_waiter& waiter)
 {
-	assert(m_strand.running_in_this_thread());
+	if (m_strand.running_in_this_thread()) {
+		priv_in_strand_on_new_send(text, waiter);
+		return;
+	}
+	boost::asio::post(m_strand, [ref = shared_from_this(), this,
+		text = std::string(text), &waiter]() {
+		priv_in_strand_on_new_send(text, waiter);
+	});
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+void
+chat_client_peer::stop()
+{
+	boost::asio::post(m_strand, [ref = shared_from_this(), this]() {
+		priv_in_strand_stop();
+	});
 }
 
 void
-chat_client_peer::priv_in_strand_on_new_request(
-	std::unique_ptr<chat_client_request> req)
+chat_client_peer::priv_in_strand_connect(
+	std::string&& endpoint,
+	chat_client_on_connect_f&& cb)
 {
 	assert(m_strand.running_in_this_thread());
-	if (not m_reqs.empty()) {
-		// Older requests are not served yet. Means we need to wait for them to be served
-		// to preserve the FIFO order.
-		m_reqs.emplace_back(std::move(req));
+	if (m_is_stopped) {
+		cb(CHAT_ERR_CANCELED);
 		return;
 	}
-	if (not m_in_msgs.empty()) {
-		// Already have data to return. Then just return it.
-		req->m_cb(CHAT_ERR_NONE, std::move(m_in_msgs.front()));
-		m_in_msgs.pop_front();
+	if (m_is_connected) {
+		cb(CHAT_ERR_ALREADY_STARTED);
 		return;
 	}
+	size_t sep = endpoint.rfind(':');
+	if (sep == std::string::npos || sep == 0 || sep + 1 == endpoint.length()) {
+		cb(CHAT_ERR_INVALID_ARGUMENT);
+		return;
+	}
+	m_resolver.async_resolve(endpoint.substr(0, sep), endpoint.substr(sep + 1),
+		boost::asio::ip::resolver_base::numeric_service,
+		boost::asio::bind_executor(m_strand,
+		[ref = shared_from_this(), this, cb = std::move(cb)](
+			const boost::system::error_code& err,
+			boost::asio::ip::tcp::resolver::results_type results) mutable {
+		priv_in_strand_on_resolve(err, std::move(cb), results);
+	}));
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+void
+chat_client_peer::priv_in_strand_on_resolve(
+	const boost::system::error_code& err,
+	chat_client_on_connect_f&& cb,
+	boost::asio::ip::tcp::resolver::results_type results)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_is_stopped) {
+		cb(CHAT_ERR_CANCELED);
+		return;
+	}
+	if (err) {
+		cb(CHAT_ERR_NO_ADDR);
+		return;
+	}
+	// Only IPv4 is served. The results are tried in order until one connects.
+	boost::asio::async_connect(m_sock, results,
+		[](const boost::system::error_code&,
+			const boost::asio::ip::tcp::endpoint& next) {
+		return next.protocol() == boost::asio::ip::tcp::v4();
+	}, boost::asio::bind_executor(m_strand,
+		[ref = shared_from_this(), this, cb = std::move(cb)](
+			const boost::system::error_code& err,
+			const boost::asio::ip::tcp::endpoint&) mutable {
+		priv_in_strand_on_connect(err, std::move(cb));
+	}));
+}
 
-	// No ready messages. It means you need to receive some new ones.
-	//
-	// 1) Save the request for serving it later.
-	// m_reqs.emplace_back(std::move(req));
-	//
-	// 2) priv_in_strand_recv();
+void
+chat_client_peer::priv_in_strand_on_connect(
+	const boost::system::error_code& err,
+	chat_client_on_connect_f&& cb)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_is_stopped) {
+		cb(CHAT_ERR_CANCELED);
+		return;
+	}
+	if (err) {
+		boost::system::error_code ignored;
+		m_sock.close(ignored);
+		cb(err == boost::asio::error::not_found ? CHAT_ERR_NO_ADDR : CHAT_ERR_SYS);
+		return;
+	}
+	boost::system::error_code ignored;
+	m_sock.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+	m_is_connected = true;
+	priv_in_strand_send();
+	priv_in_strand_recv(shared_from_this());
+	cb(CHAT_ERR_NONE);
 }
 
 void
-chat_client_peer::priv_in_strand_recv()
+chat_client_peer::priv_in_strand_on_new_request(
+	chat_client_request&& req)
 {
 	assert(m_strand.running_in_this_thread());
+	m_reqs.push_back(std::move(req));
+	priv_in_strand_serve_requests();
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+void
+chat_client_peer::priv_in_strand_serve_requests()
+{
+	assert(m_strand.running_in_this_thread());
+	// The requests are served in FIFO order, the older ones first.
+	while (not m_reqs.empty() and not m_in_msgs.empty()) {
+		chat_client_request req = std::move(m_reqs.front());
+		m_reqs.pop_front();
+		chat_message msg = std::move(m_in_msgs.front());
+		m_in_msgs.pop_front();
+		if (req.m_waiter != nullptr) {
+			*req.m_msg = std::move(msg);
+			req.m_waiter->complete(CHAT_ERR_NONE);
+			continue;
+		}
+		req.m_cb(CHAT_ERR_NONE, std::make_unique<chat_message>(std::move(msg)));
+	}
+	if (not m_is_stopped)
+		return;
+	while (not m_reqs.empty()) {
+		chat_client_request req = std::move(m_reqs.front());
+		m_reqs.pop_front();
+		if (req.m_waiter != nullptr)
+			req.m_waiter->complete(CHAT_ERR_CANCELED);
+		else
+			req.m_cb(CHAT_ERR_CANCELED, {});
+	}
+}
 
-	// 1) Ensure you have enough space in m_in_buf. Reserve at least CHAT_RECV_BUF_SIZE.
-	// Grow it x2 when need more.
-	//
-	// 2) Receive more data.
-	// uint8_t* buf = m_in_buf.data() + m_in_buf.length();
-	// size_t size = m_in_buf.capacity() - m_in_buf.length();
-	// m_sock.async_receive(boost::asio::buffer(buf, size),
-	//	boost::asio::bind_executor(strand_,
-	//		std::bind(&chat_client_peer::priv_in_strand_on_recv, shared_from_this(),
-	//		std::placeholder::_1, std::placeholders::_2)));
+void
+chat_client_peer::priv_in_strand_recv(
+	std::shared_ptr<chat_client_peer>&& self)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_is_stopped)
+		return;
+	size_t used = m_in_buf.data().length();
+	size_t need = chat_frame_size_msg(m_in_buf.data());
+	size_t size;
+	char* buf = m_in_buf.prepare(need, size);
+	auto on_recv = boost::asio::bind_executor(m_strand,
+		chat_make_alloc_handler(m_recv_mem, [this, self = std::move(self)](
+			const boost::system::error_code& err, std::size_t size) mutable {
+		priv_in_strand_on_recv(std::move(self), err, size);
+	}));
+	// A big message is waited for whole, in one completion instead of one per
+	// receipt.
+	if (need > used + CHAT_RECV_BUF_MAX) {
+		boost::asio::async_read(m_sock, boost::asio::buffer(buf, size),
+			boost::asio::transfer_at_least(need - used), std::move(on_recv));
+		return;
+	}
+	m_sock.async_receive(boost::asio::buffer(buf, size), std::move(on_recv));
 }
 
 void
 chat_client_peer::priv_in_strand_on_recv(
-	const boost::system::error_code& /* err */,
-	std::size_t /* size */)
+	std::shared_ptr<chat_client_peer>&& self,
+	const boost::system::error_code& err,
+	std::size_t size)
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Start considering the newly received bytes.
-	// m_in_buf.resize(m_in_buf.length() + size);
-	//
-	// 2) Parse the buffer trying to extract complete messages. Put each extracted one
-	// into m_in_msgs.
-	//
-	// 3) Hand the received messages from m_in_msgs to pending requests in m_reqs.
-	//
-	// 4) Keep receiving until you get at least one full message.
-	//
-	// In your code you might make m_in_buf more efficient.
+	if (m_is_stopped)
+		return;
+	if (err) {
+		priv_in_strand_stop();
+		return;
+	}
+	m_in_buf.commit(size);
+	std::string_view in = m_in_buf.data();
+	size_t total = in.length();
+	std::string_view author;
+	std::string_view data;
+	while (chat_frame_get_msg(in, author, data)) {
+		chat_message msg;
+		msg.m_author = author;
+		msg.m_data = data;
+		m_in_msgs.push_back(std::move(msg));
+	}
+	m_in_buf.consume(total - in.length());
+	priv_in_strand_serve_requests();
+	priv_in_strand_recv(std::move(self));
 }
 
 void
 chat_client_peer::priv_in_strand_on_new_feed(
-	std::string_view /* text */)
+	std::string_view text)
 {
 	assert(m_strand.running_in_this_thread());
+	if (m_is_stopped)
+		return;
+	m_feed_buf.feed(text, [this](std::string_view msg) {
+		chat_frame_put_data(m_out_buf, msg);
+	});
+	priv_in_strand_send();
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+void
+chat_client_peer::priv_in_strand_on_new_send(
+	std::string_view text,
+	chat_waiter& waiter)
+{
+	assert(m_strand.running_in_this_thread());
+	priv_in_strand_on_new_feed(text);
+	m_senders.push_back(&waiter);
+	priv_in_strand_serve_senders();
+}
 
-	// 1) Append the data to the pending output buffer m_out_buf.
-	// 2) priv_in_strand_send();
+void
+chat_client_peer::priv_in_strand_serve_senders()
+{
+	assert(m_strand.running_in_this_thread());
+	chat_errcode err = m_is_stopped ? CHAT_ERR_CANCELED : CHAT_ERR_NONE;
+	while (not m_senders.empty() and
+	       (m_is_stopped or priv_out_size() < CHAT_CLIENT_SEND_LIMIT)) {
+		chat_waiter* waiter = m_senders.front();
+		m_senders.pop_front();
+		waiter->complete(err);
+	}
 }
 
 void
 chat_client_peer::priv_in_strand_send()
 {
 	assert(m_strand.running_in_this_thread());
+	if (not m_is_connected or m_is_stopped or m_is_sending)
+		return;
+	if (m_send_pos == m_send_buf.length() and m_out_buf.empty())
+		return;
+	m_is_sending = true;
+	priv_in_strand_send_next(shared_from_this());
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// If the buffer m_out_buf contains a complete message, then send it using
-	// m_sock.async_send(boost::asio::buffer(m_out_buf.data(), m_out_buf.length()),
-	//	boost::asio::bind_executor(m_strand,
-	//		std::bind(&chat_client_peer::priv_in_strand_on_send, shared_from_this(),
-	//			std::placeholders::_1, std::placeholders::_2)));
-	//
-	// You don't have to send whole messages. Could send the parts right away if your
-	// protocol is fine with that. But you might need to send full ones if you encode them
-	// anyhow. For example, prefix each message with its total size to make receipt on the
-	// other end more optimal.
-	//
-	// When m_out_buf is needed (only if you are sending full messages), you should keep
-	// it valid and unchanged until the sending is complete. Which means you might need a
-	// second buffer where you would store newer messages while the older ones are being
-	// sent.
+void
+chat_client_peer::priv_in_strand_send_next(
+	std::shared_ptr<chat_client_peer>&& self)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_send_pos == m_send_buf.length()) {
+		m_send_buf.clear();
+		m_send_buf.swap(m_out_buf);
+		m_send_pos = 0;
+	}
+	m_sock.async_send(boost::asio::buffer(m_send_buf.data() + m_send_pos,
+		m_send_buf.length() - m_send_pos),
+		boost::asio::bind_executor(m_strand,
+			chat_make_alloc_handler(m_send_mem, [this, self = std::move(self)](
+				const boost::system::error_code& err, std::size_t size) mutable {
+			priv_in_strand_on_send(std::move(self), err, size);
+		})));
 }
 
 void
 chat_client_peer::priv_in_strand_on_send(
-	const boost::system::error_code& /* err */,
-	std::size_t /* size */)
+	std::shared_ptr<chat_client_peer>&& self,
+	const boost::system::error_code& err,
+	std::size_t size)
 {
 	assert(m_strand.running_in_this_thread());
+	m_is_sending = false;
+	if (m_is_stopped)
+		return;
+	if (err) {
+		priv_in_strand_stop();
+		return;
+	}
+	m_send_pos += size;
+	if (m_send_pos != m_send_buf.length() or not m_out_buf.empty()) {
+		m_is_sending = true;
+		priv_in_strand_send_next(std::move(self));
+	}
+	// The senders can send more right in the completion, so it goes after the send is
+	// continued.
+	priv_in_strand_serve_senders();
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// Be careful about partial writes. The sent size might be < m_out_buf.length(). Then
-	// you must send the rest again. Keep sending as long as you have something to send.
+void
+chat_client_peer::priv_in_strand_stop()
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_is_stopped)
+		return;
+	m_is_stopped = true;
+	m_resolver.cancel();
+	boost::system::error_code ignored;
+	m_sock.close(ignored);
+	priv_in_strand_serve_requests();
+	priv_in_strand_serve_senders();
 }
@@ -2,6 +2,7 @@
 
 #include "chat.h"
 
+#include <boost/asio/any_io_executor.hpp>
 #include <functional>
 #include <memory>
 
@@ -12,6 +13,12 @@ using chat_client_on_msg_f = std::function<void(chat_errcode err, std::unique_pt
 
 class chat_client_peer;
 
+enum
+{
+	// Unsent data after which the senders wait.
+	CHAT_CLIENT_SEND_LIMIT = 64 * 1024,
+};
+
 class chat_client final
 {
 public:
@@ -31,6 +38,86 @@ public:
 	feed_async(
 		std::string_view text);
 
+	// The strand of the client. Coroutines spawned on it send and receive without any
+	// hops.
+	boost::asio::any_io_executor
+	get_executor() const;
+
+	// Take the oldest received message if nobody else waits for it, or get the error if
+	// the client is stopped and all the messages are taken. Works only in
+	// get_executor(), elsewhere it returns false right away.
+	bool
+	recv_try(
+		chat_message& msg,
+		chat_errcode& err);
+
+	// Wait for a message without std::function and without allocating the message. Can
+	// be called from any thread. The waiter is completed in get_executor(), with the
+	// message moved into msg on success.
+	void
+	recv_wait(
+		chat_message& msg,
+		chat_waiter& waiter);
+
+	// The sends are limited by the data not sent yet. While it is below
+	// CHAT_CLIENT_SEND_LIMIT, the text is fed and the send is done at once. Otherwise
+	// the text is fed and the sender waits until the data is sent enough. So a fast
+	// sender never grows the buffers without bounds. A stopped client fails the sends.
+	//
+	// Works only in get_executor(), elsewhere it returns false right away without
+	// feeding anything.
+	bool
+	send_try(
+		std::string_view text,
+		chat_errcode& err);
+
+	void
+	send_wait(
+		std::string_view text,
+		chat_waiter& waiter);
+
+#if CHAT_HAS_CO_AWAIT
+	boost::asio::awaitable<chat_errcode>
+	recv(
+		chat_message& msg);
+
+	boost::asio::awaitable<chat_errcode>
+	send(
+		std::string_view text);
+#endif
+
 private:
 	const std::shared_ptr<chat_client_peer> m_conn;
 };
+
+#if CHAT_HAS_CO_AWAIT
+
+inline boost::asio::awaitable<chat_errcode>
+chat_client::recv(
+	chat_message& msg)
+{
+	chat_errcode err;
+	if (recv_try(msg, err))
+		co_return err;
+	chat_co_waiter waiter;
+	co_return co_await waiter.wait([this, &msg](chat_waiter& w) {
+		recv_wait(msg, w);
+	});
+}
+
+// The text has to live until the send is done, like a temporary in the co_await
+// expression does.
+inline boost::asio::awaitable<chat_errcode>
+chat_client::send(
+	std::string_view text)
+{
+	chat_errcode err;
+	if (send_try(text, err))
+		co_return err;
+	chat_co_waiter waiter;
+	co_return co_await waiter.wait([this, text](chat_waiter& w) {
+		send_wait(text, w);
+	});
+}
+
+#endif
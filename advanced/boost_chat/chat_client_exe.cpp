@@ -57,8 +57,10 @@ chat_client_app::chat_client_app(
 	, m_input(m_ioctx, dup(STDIN_FILENO))
 	, m_res(0)
 {
-	m_cli.connect_async(endpoint, boost::asio::bind_executor(m_strand,
-		std::bind(&chat_client_app::priv_on_connect, this, std::placeholders::_1)));
+	m_cli.connect_async(endpoint, [this](chat_errcode err) {
+		boost::asio::post(m_strand, std::bind(&chat_client_app::priv_on_connect, this,
+			err));
+	});
 }
 
 int
@@ -73,16 +75,21 @@ void
 chat_client_app::priv_recv_next()
 {
 	assert(m_strand.running_in_this_thread());
-	m_cli.recv_async(boost::asio::bind_executor(m_strand,
-		std::bind(&chat_client_app::priv_on_recv, this, std::placeholders::_1,
-			std::placeholders::_2)));
+	// The callback is called in the chat's own strand. Binding it to an executor
+	// wouldn't help, std::function hides the binding.
+	m_cli.recv_async([this](chat_errcode err, std::unique_ptr<chat_message> msg) {
+		boost::asio::post(m_strand, [this, err, msg = std::move(msg)]() mutable {
+			priv_on_recv(err, std::move(msg));
+		});
+	});
 }
 
 void
 chat_client_app::priv_read_next()
 {
 	assert(m_strand.running_in_this_thread());
-	boost::asio::async_read(m_input, boost::asio::buffer(m_in_buf, CHAT_RECV_BUF_SIZE),
+	// A part of the input is enough, the chat cuts it into messages itself.
+	m_input.async_read_some(boost::asio::buffer(m_in_buf, CHAT_RECV_BUF_SIZE),
 		boost::asio::bind_executor(m_strand,
 			std::bind(&chat_client_app::priv_on_input, this, std::placeholders::_1,
 				std::placeholders::_2)));
@@ -115,7 +122,7 @@ chat_client_app::priv_on_recv(
 		m_ioctx.stop();
 		return;
 	}
-	std::cout << msg->m_author << ": " << msg->m_data;
+	std::cout << msg->m_author << ": " << msg->m_data << '\n';
 	priv_recv_next();
 }
 
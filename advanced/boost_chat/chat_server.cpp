@@ -1,12 +1,17 @@
 #include "chat.h"
 #include "chat_server.h"
 
+#include <boost/asio/any_io_executor.hpp>
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/dispatch.hpp>
 #include <boost/asio/io_context.hpp>
-#include <boost/asio/io_context_strand.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/strand.hpp>
+#include <algorithm>
 #include <iostream>
-#include <list>
+#include <optional>
 
 enum chat_server_state
 {
@@ -21,70 +26,129 @@ enum chat_server_peer_state
 	CHAT_SERVER_PEER_STATE_STOPPED,
 };
 
+enum
+{
+	// Max number of messages given to one send.
+	CHAT_SERVER_SEND_BATCH = 64,
+};
+
+class chat_server_peer;
+
+// Message encoded for the clients. The same buffer is queued to all the peers.
+using chat_server_frame = std::shared_ptr<const std::string>;
+
+using chat_server_strand = boost::asio::strand<boost::asio::io_context::executor_type>;
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// A part of the peers served by one executor. All the shard's data is accessed only in
+// its executor.
+class chat_server_shard final
+{
+public:
+	chat_server_shard(
+		boost::asio::io_context& ioCtx,
+		bool is_strand);
+
+	bool
+	running_in_this_thread() const;
+
+	boost::asio::io_context& m_ioctx;
+	// Only when the context can be run by many threads.
+	std::optional<chat_server_strand> m_strand;
+	// The strand or the context's own executor.
+	boost::asio::any_io_executor m_exec;
+
+	// Unordered, a peer knows its index for O(1) removal.
+	std::vector<std::shared_ptr<chat_server_peer>> m_peers;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 class chat_server_peer final : public std::enable_shared_from_this<chat_server_peer>
 {
 public:
 	chat_server_peer(
 		boost::asio::ip::tcp::socket&& sock,
-		std::shared_ptr<chat_server_ctx> server);
+		chat_server_ctx* server,
+		chat_server_shard* shard);
 	~chat_server_peer();
 
-	void
-	start();
-
-	void
-	stop();
-
-	void
-	feed_async(
-		std::string_view text);
-
 private:
 	void
-	priv_in_strand_on_new_feed(
-		std::string&& text);
+	priv_in_shard_push(
+		const chat_server_frame& frame);
 
+	// The receive and send loops pass the reference to the peer from one operation to
+	// the next by move, so they don't touch its counter.
 	void
-	priv_in_strand_recv();
+	priv_in_shard_recv(
+		std::shared_ptr<chat_server_peer>&& self);
 
 	void
-	priv_in_strand_on_recv(
+	priv_in_shard_on_recv(
+		std::shared_ptr<chat_server_peer>&& self,
 		const boost::system::error_code& err,
 		std::size_t size);
 
 	void
-	priv_in_strand_send();
+	priv_in_shard_send();
+
+	void
+	priv_in_shard_send_next(
+		std::shared_ptr<chat_server_peer>&& self);
 
 	void
-	priv_in_strand_on_send(
+	priv_in_shard_on_send(
+		std::shared_ptr<chat_server_peer>&& self,
 		const boost::system::error_code& err,
 		std::size_t size);
 
 	void
-	priv_in_strand_stop();
+	priv_in_shard_stop();
 
 	chat_server_peer_state m_state;
 
-	boost::asio::io_context::strand m_strand;
+	chat_server_shard* const m_shard;
+	// Position in the shard's peers. SIZE_MAX when not there.
+	size_t m_index;
 	boost::asio::ip::tcp::socket m_sock;
-	std::shared_ptr<chat_server_ctx> m_server;
+	// Not owned. The peer is stopped before the server is gone.
+	chat_server_ctx* const m_server;
 
-	std::string m_in_buf;
-	std::string m_out_buf;
+	chat_in_buf m_in_buf;
+	// The first message is the peer's name.
+	std::string m_name;
+	bool m_has_name;
 
-	// <YOUR CODE IF NEEDED>
+	// Messages to send and how much of the first one is sent already.
+	chat_ring<chat_server_frame> m_out_queue;
+	size_t m_out_pos;
+	bool m_is_sending;
+	// Lives while a send is in progress.
+	std::vector<boost::asio::const_buffer> m_out_bufs;
+
+	chat_handler_memory m_recv_mem;
+	chat_handler_memory m_send_mem;
 
 	friend chat_server_ctx;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// Either a callback or a waiter with the place for the message.
 struct chat_server_request final
 {
+	chat_server_request() = default;
 	chat_server_request(
 		chat_server_on_msg_f&& cb) : m_cb(std::move(cb)) {}
+	chat_server_request(
+		chat_message& msg,
+		chat_waiter& waiter) : m_msg(&msg), m_waiter(&waiter) {}
 
 	chat_server_on_msg_f m_cb;
+	chat_message* m_msg = nullptr;
+	chat_waiter* m_waiter = nullptr;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -93,7 +157,8 @@ class chat_server_ctx final : public std::enable_shared_from_this<chat_server_ct
 {
 public:
 	chat_server_ctx(
-		boost::asio::io_context& ioCtx);
+		const std::vector<boost::asio::io_context*>& ioCtxs,
+		bool is_strand);
 	~chat_server_ctx();
 
 	chat_errcode
@@ -114,54 +179,89 @@ public:
 	feed_async(
 		std::string_view text);
 
+	boost::asio::any_io_executor
+	get_executor() { return priv_main().m_exec; }
+
+	bool
+	recv_try(
+		chat_message& msg);
+
+	void
+	recv_wait(
+		chat_message& msg,
+		chat_waiter& waiter);
+
 private:
+	chat_server_shard&
+	priv_main() { return *m_shards[0]; }
+
 	void
-	priv_in_strand_accept();
+	priv_in_main_accept();
 
 	void
-	priv_in_strand_on_accept(
+	priv_in_main_on_accept(
 		const boost::system::error_code& err,
-		boost::asio::ip::tcp::socket sock);
+		boost::asio::ip::tcp::socket sock,
+		chat_server_shard* shard);
 
 	void
-	priv_in_strand_stop();
+	priv_in_main_stop();
 
 	void
-	priv_in_strand_on_new_request(
-		std::unique_ptr<chat_server_request> req);
+	priv_in_shard_stop(
+		chat_server_shard& shard);
 
 	void
-	priv_peer_on_recv(
-		std::unique_ptr<chat_message> msg);
+	priv_in_main_on_new_request(
+		chat_server_request&& req);
 
 	void
-	priv_in_strand_peer_on_recv(
-		std::unique_ptr<chat_message> msg);
+	priv_in_main_serve_requests();
 
 	void
-	priv_peer_on_close(
-		std::shared_ptr<chat_server_peer> peer);
+	priv_in_shard_peer_on_recv(
+		chat_server_peer& peer,
+		std::string_view data);
 
 	void
-	priv_in_strand_peer_on_close(
-		std::shared_ptr<chat_server_peer> peer);
+	priv_in_main_peer_on_recv(
+		chat_message&& msg);
 
 	void
-	priv_in_strand_on_new_feed(
+	priv_in_shard_peer_on_close(
+		chat_server_peer& peer);
+
+	void
+	priv_in_main_on_new_feed(
 		std::string_view text);
 
+	// Send the frame to all the peers except the author. The other shards get it by
+	// posting.
+	void
+	priv_in_shard_broadcast(
+		chat_server_shard& shard,
+		const chat_server_frame& frame,
+		const chat_server_peer* author);
+
+	void
+	priv_in_shard_broadcast_local(
+		chat_server_shard& shard,
+		const chat_server_frame& frame,
+		const chat_server_peer* author);
+
 	chat_server_state m_state;
 
-	boost::asio::io_context::strand m_strand;
+	std::vector<std::unique_ptr<chat_server_shard>> m_shards;
+	// The shard for the next accepted peer.
+	size_t m_next_shard;
+
 	boost::asio::ip::tcp::acceptor m_sock;
 	uint16_t m_port;
 
-	std::list<std::shared_ptr<chat_server_peer>> m_peers;
-
-	std::list<std::unique_ptr<chat_server_request>> m_reqs;
-	std::list<std::unique_ptr<chat_message>> m_in_msgs;
-
-	// <YOUR CODE IF NEEDED>
+	chat_ring<chat_server_request> m_reqs;
+	chat_ring<chat_message> m_in_msgs;
+	// Partial message fed to the server without '\n' yet.
+	chat_feed_buf m_feed_buf;
 
 	friend chat_server_peer;
 };
@@ -170,16 +270,20 @@ private:
 
 chat_server::chat_server(
 	boost::asio::io_context& ioCtx)
-	: m_ctx(std::make_shared<chat_server_ctx>(ioCtx))
+	: m_ctx(std::make_shared<chat_server_ctx>(
+		std::vector<boost::asio::io_context*>{&ioCtx}, true))
+{
+}
+
+chat_server::chat_server(
+	const std::vector<boost::asio::io_context*>& ioCtxs)
+	: m_ctx(std::make_shared<chat_server_ctx>(ioCtxs, false))
 {
-	// <YOUR CODE IF NEEDED>
 }
 
 chat_server::~chat_server()
 {
 	m_ctx->stop();
-
-	// <YOUR CODE IF NEEDED>
 }
 
 chat_errcode
@@ -209,190 +313,272 @@ chat_server::feed_async(
 	m_ctx->feed_async(text);
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////
-
-chat_server_peer::chat_server_peer(
-	boost::asio::ip::tcp::socket&& sock,
-	std::shared_ptr<chat_server_ctx> server)
-	: m_state(CHAT_SERVER_PEER_STATE_CONNECTED)
-	, m_strand(sock.get_executor().context())
-	, m_sock(std::move(sock))
-	, m_server(std::move(server))
+boost::asio::any_io_executor
+chat_server::get_executor() const
 {
+	return m_ctx->get_executor();
 }
 
-chat_server_peer::~chat_server_peer()
+bool
+chat_server::recv_try(
+	chat_message& msg)
 {
-	// <YOUR CODE IF NEEDED>
+	return m_ctx->recv_try(msg);
 }
 
 void
-chat_server_peer::start()
+chat_server::recv_wait(
+	chat_message& msg,
+	chat_waiter& waiter)
 {
-	boost::asio::post(m_strand, std::bind(&chat_server_peer::priv_in_strand_recv,
-		shared_from_this()));
+	m_ctx->recv_wait(msg, waiter);
 }
 
-void
-chat_server_peer::stop()
+//////////////////////////////////////////////////////////////////////////////////////////
+
+chat_server_shard::chat_server_shard(
+	boost::asio::io_context& ioCtx,
+	bool is_strand)
+	: m_ioctx(ioCtx)
 {
-	boost::asio::post(m_strand, std::bind(&chat_server_peer::priv_in_strand_stop,
-		shared_from_this()));
+	if (is_strand) {
+		m_strand.emplace(boost::asio::make_strand(ioCtx));
+		m_exec = *m_strand;
+	} else {
+		m_exec = ioCtx.get_executor();
+	}
 }
 
-void
-chat_server_peer::feed_async(
-	std::string_view text)
+bool
+chat_server_shard::running_in_this_thread() const
 {
-	boost::asio::post(m_strand, [ref = shared_from_this(), this,
-		text = std::string(text)]() mutable {
-		priv_in_strand_on_new_feed(std::move(text));
-	});
+	if (m_strand)
+		return m_strand->running_in_this_thread();
+	return m_ioctx.get_executor().running_in_this_thread();
 }
 
-void
-chat_server_peer::priv_in_strand_on_new_feed(
-	std::string&& /* text */)
-{
-	assert(m_strand.running_in_this_thread());
+//////////////////////////////////////////////////////////////////////////////////////////
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+chat_server_peer::chat_server_peer(
+	boost::asio::ip::tcp::socket&& sock,
+	chat_server_ctx* server,
+	chat_server_shard* shard)
+	: m_state(CHAT_SERVER_PEER_STATE_CONNECTED)
+	, m_shard(shard)
+	, m_index(SIZE_MAX)
+	, m_sock(std::move(sock))
+	, m_server(server)
+	, m_has_name(false)
+	, m_out_pos(0)
+	, m_is_sending(false)
+{
+}
 
-	// 1) Append the data to the pending output buffer m_out_buf.
-	// 2) priv_in_strand_send();
+chat_server_peer::~chat_server_peer()
+{
 }
 
 void
-chat_server_peer::priv_in_strand_recv()
+chat_server_peer::priv_in_shard_push(
+	const chat_server_frame& frame)
 {
-	assert(m_strand.running_in_this_thread());
+	assert(m_shard->running_in_this_thread());
 	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
 		return;
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Ensure you have enough space in m_in_buf. Reserve at least CHAT_RECV_BUF_SIZE.
-	// Grow it x2 when need more.
-	//
-	// 2) Receive more data.
-	// uint8_t* buf = m_in_buf.data() + m_in_buf.length();
-	// size_t size = m_in_buf.capacity() - m_in_buf.length();
-	// m_sock.async_receive(boost::asio::buffer(buf, size),
-	//	boost::asio::bind_executor(strand_,
-	//		std::bind(&chat_server_peer::priv_in_strand_on_recv, shared_from_this(),
-	//		std::placeholder::_1, std::placeholders::_2)));
+	m_out_queue.push_back(frame);
+	priv_in_shard_send();
 }
 
 void
-chat_server_peer::priv_in_strand_on_recv(
-	const boost::system::error_code& /* err */,
-	std::size_t /* size */)
+chat_server_peer::priv_in_shard_recv(
+	std::shared_ptr<chat_server_peer>&& self)
 {
-	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Start considering the newly received bytes.
-	// m_in_buf.resize(m_in_buf.length() + size);
-	//
-	// 2) Parse the buffer trying to extract complete messages. Send each extracted one
-	// to the server: m_server->priv_peer_on_recv(msg).
-	//
-	// 3) Keep receiving infinitely.
-	//
-	// In your code you might make m_in_buf more efficient.
+	assert(m_shard->running_in_this_thread());
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+		return;
+	size_t used = m_in_buf.data().length();
+	size_t need = chat_frame_size_data(m_in_buf.data());
+	size_t size;
+	char* buf = m_in_buf.prepare(need, size);
+	auto on_recv = boost::asio::bind_executor(m_shard->m_exec,
+		chat_make_alloc_handler(m_recv_mem, [this, self = std::move(self)](
+			const boost::system::error_code& err, std::size_t size) mutable {
+		priv_in_shard_on_recv(std::move(self), err, size);
+	}));
+	// A big message is waited for whole, in one completion instead of one per
+	// receipt.
+	if (need > used + CHAT_RECV_BUF_MAX) {
+		boost::asio::async_read(m_sock, boost::asio::buffer(buf, size),
+			boost::asio::transfer_at_least(need - used), std::move(on_recv));
+		return;
+	}
+	m_sock.async_receive(boost::asio::buffer(buf, size), std::move(on_recv));
 }
 
 void
-chat_server_peer::priv_in_strand_send()
+chat_server_peer::priv_in_shard_on_recv(
+	std::shared_ptr<chat_server_peer>&& self,
+	const boost::system::error_code& err,
+	std::size_t size)
 {
-	assert(m_strand.running_in_this_thread());
+	// A stopped peer can outlive the server with its shards, so the shard is not
+	// touched.
 	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
 		return;
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// If the buffer m_out_buf contains a complete message, then send it using
-	// m_sock.async_send(boost::asio::buffer(m_out_buf.data(), m_out_buf.length()),
-	//	boost::asio::bind_executor(m_strand,
-	//		std::bind(&chat_server_peer::priv_in_strand_on_send, shared_from_this(),
-	//			std::placeholders::_1, std::placeholders::_2)));
-	//
-	// You don't have to send whole messages. Could send the parts right away if your
-	// protocol is fine with that. But you might need to send full ones if you encode them
-	// anyhow. For example, prefix each message with its total size to make receipt on the
-	// other end more optimal.
-	//
-	// When m_out_buf is needed (only if you are sending full messages), you should keep
-	// it valid and unchanged until the sending is complete. Which means you might need a
-	// second buffer where you would store newer messages while the older ones are being
-	// sent.
+	assert(m_shard->running_in_this_thread());
+	if (err) {
+		priv_in_shard_stop();
+		return;
+	}
+	m_in_buf.commit(size);
+	std::string_view in = m_in_buf.data();
+	size_t total = in.length();
+	std::string_view data;
+	while (chat_frame_get_data(in, data)) {
+		if (not m_has_name) {
+			m_name = data;
+			m_has_name = true;
+			continue;
+		}
+		m_server->priv_in_shard_peer_on_recv(*this, data);
+	}
+	m_in_buf.consume(total - in.length());
+	priv_in_shard_recv(std::move(self));
 }
 
 void
-chat_server_peer::priv_in_strand_on_send(
-	const boost::system::error_code& /* err */,
-	std::size_t /* size */)
+chat_server_peer::priv_in_shard_send()
 {
-	assert(m_strand.running_in_this_thread());
+	assert(m_shard->running_in_this_thread());
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED or m_is_sending or
+	    m_out_queue.empty())
+		return;
+	m_is_sending = true;
+	priv_in_shard_send_next(shared_from_this());
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+void
+chat_server_peer::priv_in_shard_send_next(
+	std::shared_ptr<chat_server_peer>&& self)
+{
+	assert(m_shard->running_in_this_thread());
+	// All the queued messages go in one send, the first one from where it stopped.
+	m_out_bufs.clear();
+	size_t pos = m_out_pos;
+	size_t count = std::min<size_t>(m_out_queue.size(), CHAT_SERVER_SEND_BATCH);
+	for (size_t i = 0; i < count; ++i) {
+		const chat_server_frame& f = m_out_queue[i];
+		m_out_bufs.emplace_back(f->data() + pos, f->length() - pos);
+		pos = 0;
+	}
+	m_sock.async_send(m_out_bufs, boost::asio::bind_executor(m_shard->m_exec,
+		chat_make_alloc_handler(m_send_mem, [this, self = std::move(self)](
+			const boost::system::error_code& err, std::size_t size) mutable {
+		priv_in_shard_on_send(std::move(self), err, size);
+	})));
+}
 
-	// Be careful about partial writes. The sent size might be < m_out_buf.length(). Then
-	// you must send the rest again. Keep sending as long as you have something to send.
+void
+chat_server_peer::priv_in_shard_on_send(
+	std::shared_ptr<chat_server_peer>&& self,
+	const boost::system::error_code& err,
+	std::size_t size)
+{
+	m_is_sending = false;
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+		return;
+	assert(m_shard->running_in_this_thread());
+	if (err) {
+		priv_in_shard_stop();
+		return;
+	}
+	// The send could be partial, then the rest goes next time.
+	while (size > 0) {
+		size_t left = m_out_queue.front()->length() - m_out_pos;
+		if (size < left) {
+			m_out_pos += size;
+			break;
+		}
+		size -= left;
+		m_out_pos = 0;
+		m_out_queue.pop_front();
+	}
+	if (not m_out_queue.empty()) {
+		m_is_sending = true;
+		priv_in_shard_send_next(std::move(self));
+	}
 }
 
 void
-chat_server_peer::priv_in_strand_stop()
+chat_server_peer::priv_in_shard_stop()
 {
-	assert(m_strand.running_in_this_thread());
+	assert(m_shard->running_in_this_thread());
 	if (m_state != CHAT_SERVER_PEER_STATE_CONNECTED)
 		return;
-	m_state = CHAT_SERVER_PEER_STATE_CONNECTED;
-	m_sock.close();
-	m_server->priv_peer_on_close(shared_from_this());
-	m_server.reset();
+	m_state = CHAT_SERVER_PEER_STATE_STOPPED;
+	boost::system::error_code ignored;
+	m_sock.close(ignored);
+	m_out_queue.clear();
+	m_server->priv_in_shard_peer_on_close(*this);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
 chat_server_ctx::chat_server_ctx(
-	boost::asio::io_context& ioCtx)
+	const std::vector<boost::asio::io_context*>& ioCtxs,
+	bool is_strand)
 	: m_state(CHAT_SERVER_STATE_NEW)
-	, m_strand(ioCtx)
-	, m_sock(ioCtx)
+	, m_next_shard(0)
+	, m_sock(*ioCtxs.at(0))
+	, m_port(0)
 {
-	// <YOUR CODE IF NEEDED>
+	m_shards.reserve(ioCtxs.size());
+	for (boost::asio::io_context* ctx : ioCtxs)
+		m_shards.emplace_back(std::make_unique<chat_server_shard>(*ctx, is_strand));
 }
 
 chat_server_ctx::~chat_server_ctx()
 {
-	// <YOUR CODE IF NEEDED>
+	// The pending requests are dropped silently. Their callbacks can refer to the owner
+	// of the server, which is gone by now. The waiters own their coroutines, which have
+	// to be freed.
+	while (not m_reqs.empty()) {
+		chat_waiter* waiter = m_reqs.front().m_waiter;
+		m_reqs.pop_front();
+		if (waiter != nullptr)
+			waiter->destroy();
+	}
 }
 
 chat_errcode
 chat_server_ctx::start(
 	uint16_t port)
 {
-	assert(m_state == CHAT_SERVER_STATE_NEW);
-	// <YOUR CODE IF NEEDED>
-	//
-	// You need to handle errors without throwing exceptions and return them
-	// gracefully.
-	//
-	boost::asio::ip::tcp::endpoint endpoint;
-	endpoint.port(port);
-	m_sock.bind(endpoint);
-	m_port = m_sock.local_endpoint().port();
-	m_sock.listen();
+	if (m_state != CHAT_SERVER_STATE_NEW)
+		return CHAT_ERR_ALREADY_STARTED;
+	boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
+	boost::system::error_code err;
+	if (m_sock.open(endpoint.protocol(), err))
+		return CHAT_ERR_SYS;
+	m_sock.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true), err);
+	if (m_sock.bind(endpoint, err)) {
+		boost::system::error_code ignored;
+		m_sock.close(ignored);
+		if (err == boost::asio::error::address_in_use)
+			return CHAT_ERR_PORT_BUSY;
+		return CHAT_ERR_SYS;
+	}
+	boost::asio::ip::tcp::endpoint local = m_sock.local_endpoint(err);
+	if (err || m_sock.listen(boost::asio::socket_base::max_listen_connections, err)) {
+		boost::system::error_code ignored;
+		m_sock.close(ignored);
+		return CHAT_ERR_SYS;
+	}
+	m_port = local.port();
 	m_state = CHAT_SERVER_STATE_LISTEN;
-	boost::asio::post(m_strand, std::bind(
-		&chat_server_ctx::priv_in_strand_accept, shared_from_this()));
+	boost::asio::post(priv_main().m_exec, [ref = shared_from_this(), this]() {
+		priv_in_main_accept();
+	});
 	return CHAT_ERR_NONE;
 }
 
@@ -406,19 +592,46 @@ chat_server_ctx::port() const
 void
 chat_server_ctx::stop()
 {
-	boost::asio::post(m_strand, std::bind(
-		&chat_server_ctx::priv_in_strand_stop, shared_from_this()));
+	boost::asio::post(priv_main().m_exec, [ref = shared_from_this(), this]() {
+		priv_in_main_stop();
+	});
 }
 
 void
 chat_server_ctx::recv_async(
 	chat_server_on_msg_f&& cb)
 {
-	std::unique_ptr<chat_server_request> req =
-		std::make_unique<chat_server_request>(std::move(cb));
-	boost::asio::post(m_strand,
-		[ref = shared_from_this(), req = std::move(req), this]() mutable {
-		priv_in_strand_on_new_request(std::move(req));
+	boost::asio::post(priv_main().m_exec,
+		[ref = shared_from_this(), cb = std::move(cb), this]() mutable {
+		priv_in_main_on_new_request(chat_server_request(std::move(cb)));
+	});
+}
+
+bool
+chat_server_ctx::recv_try(
+	chat_message& msg)
+{
+	if (not priv_main().running_in_this_thread())
+		return false;
+	if (not m_reqs.empty() or m_in_msgs.empty())
+		return false;
+	msg = std::move(m_in_msgs.front());
+	m_in_msgs.pop_front();
+	return true;
+}
+
+void
+chat_server_ctx::recv_wait(
+	chat_message& msg,
+	chat_waiter& waiter)
+{
+	if (priv_main().running_in_this_thread()) {
+		priv_in_main_on_new_request(chat_server_request(msg, waiter));
+		return;
+	}
+	boost::asio::post(priv_main().m_exec, [ref = shared_from_this(), this, &msg,
+		&waiter]() {
+		priv_in_main_on_new_request(chat_server_request(msg, waiter));
 	});
 }
 
@@ -426,26 +639,35 @@ void
 chat_server_ctx::feed_async(
 	std::string_view text)
 {
-	boost::asio::post(m_strand, std::bind(&chat_server_ctx::priv_in_strand_on_new_feed,
-		shared_from_this(), std::string(text)));
+	boost::asio::post(priv_main().m_exec, [ref = shared_from_this(), this,
+		text = std::string(text)]() {
+		priv_in_main_on_new_feed(text);
+	});
 }
 
 void
-chat_server_ctx::priv_in_strand_accept()
+chat_server_ctx::priv_in_main_accept()
 {
-	assert(m_strand.running_in_this_thread());
-	assert(m_state == CHAT_SERVER_STATE_LISTEN);
-	m_sock.async_accept(boost::asio::bind_executor(m_strand, std::bind(
-		&chat_server_ctx::priv_in_strand_on_accept, shared_from_this(),
-		std::placeholders::_1, std::placeholders::_2)));
+	assert(priv_main().running_in_this_thread());
+	if (m_state != CHAT_SERVER_STATE_LISTEN)
+		return;
+	// The socket is created right in the context of its shard.
+	chat_server_shard* shard = m_shards[m_next_shard].get();
+	m_next_shard = (m_next_shard + 1) % m_shards.size();
+	m_sock.async_accept(shard->m_ioctx, boost::asio::bind_executor(priv_main().m_exec,
+		[ref = shared_from_this(), this, shard](const boost::system::error_code& err,
+			boost::asio::ip::tcp::socket sock) {
+		priv_in_main_on_accept(err, std::move(sock), shard);
+	}));
 }
 
 void
-chat_server_ctx::priv_in_strand_on_accept(
+chat_server_ctx::priv_in_main_on_accept(
 	const boost::system::error_code& err,
-	boost::asio::ip::tcp::socket sock)
+	boost::asio::ip::tcp::socket sock,
+	chat_server_shard* shard)
 {
-	assert(m_strand.running_in_this_thread());
+	assert(priv_main().running_in_this_thread());
 	if (m_state == CHAT_SERVER_STATE_STOPPED)
 		return;
 	if (err) {
@@ -455,98 +677,166 @@ chat_server_ctx::priv_in_strand_on_accept(
 		abort();
 		return;
 	}
+	boost::system::error_code ignored;
+	sock.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
 	std::shared_ptr<chat_server_peer> peer = std::make_shared<chat_server_peer>(
-		std::move(sock), shared_from_this());
-	peer->start();
-	m_peers.emplace_back(std::move(peer));
-	priv_in_strand_accept();
+		std::move(sock), this, shard);
+	// The stop of the shards is posted after this, so the peer is always stopped.
+	boost::asio::dispatch(shard->m_exec, [ref = shared_from_this(), shard,
+		peer = std::move(peer)]() mutable {
+		peer->priv_in_shard_recv(std::shared_ptr<chat_server_peer>(peer));
+		peer->m_index = shard->m_peers.size();
+		shard->m_peers.emplace_back(std::move(peer));
+	});
+	priv_in_main_accept();
 }
 
 void
-chat_server_ctx::priv_in_strand_stop()
+chat_server_ctx::priv_in_main_stop()
 {
-	assert(m_strand.running_in_this_thread());
+	assert(priv_main().running_in_this_thread());
 	if (m_state != CHAT_SERVER_STATE_LISTEN)
 		return;
 	m_state = CHAT_SERVER_STATE_STOPPED;
-	m_sock.close();
-	for (std::shared_ptr<chat_server_peer>& p : m_peers)
-		p->stop();
-	m_peers.clear();
+	boost::system::error_code ignored;
+	m_sock.close(ignored);
+	for (std::unique_ptr<chat_server_shard>& s : m_shards) {
+		boost::asio::dispatch(s->m_exec, [ref = shared_from_this(), this,
+			shard = s.get()]() {
+			priv_in_shard_stop(*shard);
+		});
+	}
 }
 
 void
-chat_server_ctx::priv_in_strand_on_new_request(
-	std::unique_ptr<chat_server_request> req)
-{
-	assert(m_strand.running_in_this_thread());
-	if (not m_reqs.empty() or m_in_msgs.empty()) {
-		m_reqs.emplace_back(std::move(req));
-		return;
+chat_server_ctx::priv_in_shard_stop(
+	chat_server_shard& shard)
+{
+	assert(shard.running_in_this_thread());
+	std::vector<std::shared_ptr<chat_server_peer>> peers = std::move(shard.m_peers);
+	shard.m_peers.clear();
+	for (std::shared_ptr<chat_server_peer>& p : peers) {
+		p->m_index = SIZE_MAX;
+		p->priv_in_shard_stop();
 	}
-	// Already have data to return. Then just return it.
-	req->m_cb(CHAT_ERR_NONE, std::move(m_in_msgs.front()));
-	m_in_msgs.pop_front();
 }
 
 void
-chat_server_ctx::priv_peer_on_recv(
-	std::unique_ptr<chat_message> msg)
+chat_server_ctx::priv_in_main_on_new_request(
+	chat_server_request&& req)
 {
-	boost::asio::post(m_strand, [ref = shared_from_this(), this,
-		msg = std::move(msg)]() mutable {
-		priv_in_strand_peer_on_recv(std::move(msg));
-	});
+	assert(priv_main().running_in_this_thread());
+	m_reqs.push_back(std::move(req));
+	priv_in_main_serve_requests();
 }
 
 void
-chat_server_ctx::priv_in_strand_peer_on_recv(
-	std::unique_ptr<chat_message> msg)
-{
-	assert(m_strand.running_in_this_thread());
-	m_in_msgs.emplace_back(std::move(msg));
+chat_server_ctx::priv_in_main_serve_requests()
+{
+	assert(priv_main().running_in_this_thread());
+	while (not m_reqs.empty() and not m_in_msgs.empty()) {
+		chat_server_request req = std::move(m_reqs.front());
+		m_reqs.pop_front();
+		chat_message msg = std::move(m_in_msgs.front());
+		m_in_msgs.pop_front();
+		if (req.m_waiter != nullptr) {
+			*req.m_msg = std::move(msg);
+			req.m_waiter->complete(CHAT_ERR_NONE);
+			continue;
+		}
+		req.m_cb(CHAT_ERR_NONE, std::make_unique<chat_message>(std::move(msg)));
+	}
+}
 
-	// <YOUR CODE IF NEEDED>
-	//
-	// Serve the pending receive-requests if there are any.
+void
+chat_server_ctx::priv_in_shard_peer_on_recv(
+	chat_server_peer& peer,
+	std::string_view data)
+{
+	assert(peer.m_shard->running_in_this_thread());
+	std::string frame;
+	chat_frame_put_msg(frame, peer.m_name, data);
+	priv_in_shard_broadcast(*peer.m_shard,
+		std::make_shared<const std::string>(std::move(frame)), &peer);
+
+	chat_message msg;
+	msg.m_author = peer.m_name;
+	msg.m_data = data;
+	// Inline when the peer is in the main shard.
+	boost::asio::dispatch(priv_main().m_exec, [ref = shared_from_this(), this,
+		msg = std::move(msg)]() mutable {
+		priv_in_main_peer_on_recv(std::move(msg));
+	});
 }
 
 void
-chat_server_ctx::priv_peer_on_close(
-	std::shared_ptr<chat_server_peer> peer)
+chat_server_ctx::priv_in_main_peer_on_recv(
+	chat_message&& msg)
 {
-	boost::asio::post(m_strand, [ref = shared_from_this(), this,
-		peer = std::move(peer)]() mutable {
-		priv_in_strand_peer_on_close(std::move(peer));
-	});
+	assert(priv_main().running_in_this_thread());
+	m_in_msgs.push_back(std::move(msg));
+	priv_in_main_serve_requests();
 }
 
 void
-chat_server_ctx::priv_in_strand_peer_on_close(
-	std::shared_ptr<chat_server_peer> peer)
-{
-	assert(m_strand.running_in_this_thread());
-	for (auto it = m_peers.begin(); it != m_peers.end(); ++it) {
-		if (*it == peer) {
-			m_peers.erase(it);
-			return;
-		}
-	}
-	if (m_state == CHAT_SERVER_STATE_STOPPED)
+chat_server_ctx::priv_in_shard_peer_on_close(
+	chat_server_peer& peer)
+{
+	chat_server_shard& shard = *peer.m_shard;
+	assert(shard.running_in_this_thread());
+	size_t index = peer.m_index;
+	// The shard is being stopped and the peer is already out of the list.
+	if (index == SIZE_MAX)
 		return;
-	// Unreachable. If it is reachable, then you have a bug.
-	abort();
+	assert(shard.m_peers[index].get() == &peer);
+	peer.m_index = SIZE_MAX;
+	if (index + 1 != shard.m_peers.size()) {
+		shard.m_peers[index] = std::move(shard.m_peers.back());
+		shard.m_peers[index]->m_index = index;
+	}
+	shard.m_peers.pop_back();
 }
 
 void
-chat_server_ctx::priv_in_strand_on_new_feed(
+chat_server_ctx::priv_in_main_on_new_feed(
 	std::string_view text)
 {
-	assert(m_strand.running_in_this_thread());
-	for (std::shared_ptr<chat_server_peer>& p : m_peers)
-		p->feed_async(text);
+	assert(priv_main().running_in_this_thread());
+	m_feed_buf.feed(text, [this](std::string_view data) {
+		std::string frame;
+		chat_frame_put_msg(frame, CHAT_SERVER_AUTHOR, data);
+		priv_in_shard_broadcast(priv_main(),
+			std::make_shared<const std::string>(std::move(frame)), nullptr);
+	});
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////
+void
+chat_server_ctx::priv_in_shard_broadcast(
+	chat_server_shard& shard,
+	const chat_server_frame& frame,
+	const chat_server_peer* author)
+{
+	assert(shard.running_in_this_thread());
+	priv_in_shard_broadcast_local(shard, frame, author);
+	for (std::unique_ptr<chat_server_shard>& s : m_shards) {
+		if (s.get() == &shard)
+			continue;
+		boost::asio::post(s->m_exec, [ref = shared_from_this(), this,
+			other = s.get(), frame]() {
+			priv_in_shard_broadcast_local(*other, frame, nullptr);
+		});
+	}
+}
 
-//////////////////////////////////////////////////////////////////////////////////////////
+void
+chat_server_ctx::priv_in_shard_broadcast_local(
+	chat_server_shard& shard,
+	const chat_server_frame& frame,
+	const chat_server_peer* author)
+{
+	assert(shard.running_in_this_thread());
+	for (std::shared_ptr<chat_server_peer>& p : shard.m_peers) {
+		if (p.get() != author)
+			p->priv_in_shard_push(frame);
+	}
+}
@@ -2,7 +2,10 @@
 
 #include "chat.h"
 
+#include <boost/asio/any_io_executor.hpp>
 #include <functional>
+#include <memory>
+#include <vector>
 
 namespace boost { namespace asio { class io_context; } }
 
@@ -13,8 +16,16 @@ using chat_server_on_msg_f = std::function<void(chat_errcode err, std::unique_pt
 class chat_server final
 {
 public:
+	// All the work is serialized by one strand. The context can be run by any number
+	// of threads.
 	chat_server(
 		boost::asio::io_context& ioCtx);
+	// Sharded mode. The peers are spread over the contexts and each context serves only
+	// its own peers, without any strands. So each context must be run by exactly one
+	// thread. A message is posted to the other contexts as one shared buffer. The
+	// acceptor and the callbacks of recv_async() live in the first context.
+	chat_server(
+		const std::vector<boost::asio::io_context*>& ioCtxs);
 	~chat_server();
 
 	chat_errcode
@@ -32,6 +43,47 @@ public:
 	feed_async(
 		std::string_view text);
 
+	// The executor of the acceptor and of the callbacks. Coroutines spawned on it receive
+	// the messages without any hops.
+	boost::asio::any_io_executor
+	get_executor() const;
+
+	// Take the oldest received message if nobody else waits for it. Works only in
+	// get_executor(), elsewhere it returns false right away.
+	bool
+	recv_try(
+		chat_message& msg);
+
+	// Wait for a message without std::function and without allocating the message. Can
+	// be called from any thread. The waiter is completed in get_executor(), with the
+	// message moved into msg.
+	void
+	recv_wait(
+		chat_message& msg,
+		chat_waiter& waiter);
+
+#if CHAT_HAS_CO_AWAIT
+	boost::asio::awaitable<chat_errcode>
+	recv(
+		chat_message& msg);
+#endif
+
 private:
 	const std::shared_ptr<chat_server_ctx> m_ctx;
 };
+
+#if CHAT_HAS_CO_AWAIT
+
+inline boost::asio::awaitable<chat_errcode>
+chat_server::recv(
+	chat_message& msg)
+{
+	if (recv_try(msg))
+		co_return CHAT_ERR_NONE;
+	chat_co_waiter waiter;
+	co_return co_await waiter.wait([this, &msg](chat_waiter& w) {
+		recv_wait(msg, w);
+	});
+}
+
+#endif
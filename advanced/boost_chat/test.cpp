@@ -54,6 +54,38 @@ private:
 	std::vector<std::unique_ptr<std::thread>> m_workers;
 };
 
+// A context per thread, for the sharded server.
+class io_shards final
+{
+public:
+	~io_shards() { stop(); }
+
+	void
+	start(
+		uint32_t count)
+	{
+		assert(m_cores.empty());
+		for (uint32_t i = 0; i < count; ++i) {
+			m_cores.push_back(std::make_unique<io_core>());
+			m_cores.back()->start(1);
+			m_backends.push_back(&m_cores.back()->backend());
+		}
+	}
+
+	void
+	stop()
+	{
+		for (std::unique_ptr<io_core>& c : m_cores)
+			c->stop();
+	}
+
+	const std::vector<boost::asio::io_context*>& backends() { return m_backends; }
+
+private:
+	std::vector<std::unique_ptr<io_core>> m_cores;
+	std::vector<boost::asio::io_context*> m_backends;
+};
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 struct test_msg final
@@ -62,8 +94,8 @@ struct test_msg final
 	create(
 		size_t len)
 	{
-		len += TEST_MSG_ID_LEN + 1;
-		m_data.resize(len);
+		len += TEST_MSG_ID_LEN;
+		m_data.resize(len + 1);
 		memset(m_data.data(), '0', TEST_MSG_ID_LEN);
 		for (size_t i = TEST_MSG_ID_LEN; i < len; ++i)
 			m_data[i] = 'a' + i % ('z' - 'a' + 1);
@@ -142,6 +174,29 @@ server_recv_blocking(
 	return msg;
 }
 
+// All the requests are sent at once and the whole batch is waited with one wakeup.
+static std::vector<std::unique_ptr<chat_message>>
+server_recv_blocking_batch(
+	chat_server& server,
+	uint32_t count)
+{
+	event ev(count);
+	std::vector<chat_errcode> errs(count, CHAT_ERR_NONE);
+	std::vector<std::unique_ptr<chat_message>> msgs(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		server.recv_async([&, i](chat_errcode err_res,
+			std::unique_ptr<chat_message> msg_res) mutable {
+			errs[i] = err_res;
+			msgs[i] = std::move(msg_res);
+			ev.send();
+		});
+	}
+	ev.recv();
+	for (chat_errcode err : errs)
+		unit_assert(err == CHAT_ERR_NONE);
+	return msgs;
+}
+
 static std::unique_ptr<chat_message>
 client_recv_blocking(
 	chat_client& cli)
@@ -175,6 +230,74 @@ client_connect_blocking(
 	return err;
 }
 
+static void
+test_recv_buf()
+{
+	unit_test_start();
+
+	chat_in_buf buf;
+	size_t size;
+	unit_check(buf.recv_size() == CHAT_RECV_BUF_SIZE, "starts small");
+	unit_msg("full receipts");
+	for (int i = 0; i < 20; ++i) {
+		buf.prepare(0, size);
+		unit_assert(size >= buf.recv_size());
+		size_t recv_size = buf.recv_size();
+		buf.commit(recv_size);
+		buf.consume(recv_size);
+	}
+	unit_check(buf.recv_size() == CHAT_RECV_BUF_MAX, "grew to the max");
+	unit_msg("small receipts");
+	for (int i = 0; i < 20; ++i) {
+		buf.prepare(0, size);
+		buf.commit(10);
+		buf.consume(10);
+	}
+	unit_check(buf.recv_size() == CHAT_RECV_BUF_SIZE, "shrank to the min");
+	unit_check(buf.capacity() <= 2 * CHAT_RECV_BUF_SIZE, "memory is given back");
+
+	unit_msg("a big message");
+	const size_t big = 10 * CHAT_RECV_BUF_MAX;
+	buf.prepare(0, size);
+	buf.commit(10);
+	char* pos = buf.prepare(big, size);
+	unit_check(size >= big - 10, "fits the whole message");
+	memset(pos, 'x', big - 10);
+	buf.commit(big - 10);
+	unit_check(buf.data().length() == big, "all data is there");
+	buf.consume(big);
+	unit_check(buf.capacity() <= 2 * buf.recv_size(), "big buffer is dropped");
+}
+
+static void
+test_event()
+{
+	unit_test_start();
+
+	event ev(3);
+	std::atomic_uint32_t done(0);
+	std::vector<std::thread> threads;
+	for (uint32_t i = 0; i < 3; ++i) {
+		threads.emplace_back([&]() {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			done.fetch_add(1, std::memory_order_relaxed);
+			ev.send();
+		});
+	}
+	ev.recv();
+	unit_check(done.load(std::memory_order_relaxed) == 3, "set by all the sends");
+	for (std::thread& t : threads)
+		t.join();
+	ev.send();
+	ev.recv();
+	unit_check(true, "extra send is ignored");
+
+	event done_ev;
+	done_ev.send();
+	done_ev.recv();
+	unit_check(true, "no wait after the send");
+}
+
 static void
 test_trivial()
 {
@@ -354,15 +477,10 @@ test_multi_feed()
 }
 
 static void
-test_multi_client(void)
+test_multi_client_on(
+	io_core& core,
+	chat_server& server)
 {
-	unit_test_start();
-
-	io_core core;
-	core.start(3);
-
-	chat_server server(core.backend());
-	unit_assert(server.start(0) == CHAT_ERR_NONE);
 	std::string endpoint = make_addr_str(server.port());
 
 	uint32_t client_count = 20;
@@ -373,7 +491,7 @@ test_multi_client(void)
 
 	unit_msg("Connect clients");
 	std::vector<std::unique_ptr<chat_client>> clis;
-	clis.resize(client_count);
+	clis.reserve(client_count);
 	for (uint32_t i = 0; i < client_count; ++i) {
 		clis.emplace_back(std::make_unique<chat_client>(
 			core.backend(), "cli_" + std::to_string(i)));
@@ -438,6 +556,60 @@ test_multi_client(void)
 	}
 }
 
+static void
+test_multi_client(void)
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(3);
+
+	chat_server server(core.backend());
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+	test_multi_client_on(core, server);
+}
+
+static void
+test_sharded(void)
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(2);
+	io_shards shards;
+	shards.start(3);
+
+	chat_server server(shards.backends());
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+	unit_check(server.start(0) == CHAT_ERR_ALREADY_STARTED, "start twice");
+	test_multi_client_on(core, server);
+
+	unit_msg("Clients in all the shards");
+	std::vector<std::unique_ptr<chat_client>> clis;
+	for (uint32_t i = 0; i < 4; ++i) {
+		clis.emplace_back(std::make_unique<chat_client>(
+			core.backend(), "cli_" + std::to_string(i)));
+		unit_assert(client_connect_blocking(*clis.back(),
+			make_addr_str(server.port())) == CHAT_ERR_NONE);
+	}
+	// A connect is done before the server accepts it. But the peers are accepted in
+	// order, so when the last one talks, all the others are in the chat.
+	clis.back()->feed_async("  \n  a b \t\n");
+	std::unique_ptr<chat_message> msg = server_recv_blocking(server);
+	unit_check(msg->m_data == "a b", "trimmed, empty skipped");
+	for (uint32_t i = 0; i + 1 < clis.size(); ++i) {
+		msg = client_recv_blocking(*clis[i]);
+		unit_check(msg->m_data == "a b" && msg->m_author == "cli_3",
+			"got it from another shard");
+	}
+	server.feed_async("from server\n");
+	for (std::unique_ptr<chat_client>& c : clis) {
+		msg = client_recv_blocking(*c);
+		unit_check(msg->m_data == "from server" &&
+			msg->m_author == CHAT_SERVER_AUTHOR, "server's message");
+	}
+}
+
 struct test_stress_ctx final
 {
 	uint32_t msg_count;
@@ -503,8 +675,9 @@ test_stress()
 	req.create(ctx.msg_len);
 
 	unit_msg("Receive all messages");
-	for (uint32_t i = 0, end = ctx.msg_count * client_count; i < end; ++i) {
-		std::unique_ptr<chat_message> rsp = server_recv_blocking(server);
+	std::vector<std::unique_ptr<chat_message>> rsps = server_recv_blocking_batch(
+		server, ctx.msg_count * client_count);
+	for (std::unique_ptr<chat_message>& rsp : rsps) {
 		uint32_t cli_id = 0;
 		uint32_t msg_id = 0;
 		chat_message_extract_id(*rsp, &cli_id, &msg_id);
@@ -561,7 +734,7 @@ test_big_author()
 
 	cli1.feed_async(body);
 	std::unique_ptr<chat_message> rsp = server_recv_blocking(server);
-	body[body_len] = 0;
+	body.resize(body_len);
 	unit_check(rsp->m_data == body, "msg data");
 	unit_check(rsp->m_author == author1, "msg author");
 
@@ -575,11 +748,14 @@ main(void)
 {
 	unit_test_start();
 
+	test_recv_buf();
+	test_event();
 	test_trivial();
 	test_basic();
 	test_big_messages();
 	test_multi_feed();
 	test_multi_client();
+	test_sharded();
 	test_stress();
 	test_big_author();
 	return 0;
@@ -0,0 +1,278 @@
+#include "chat.h"
+#include "chat_client.h"
+#include "chat_server.h"
+#include "unitpp.h"
+
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <thread>
+
+// The awaitable API. Needs C++20, so is built separately from the main test.
+
+class io_core final
+{
+public:
+	~io_core() { stop(); }
+
+	void
+	start(
+		uint32_t thread_count)
+	{
+		assert(m_workers.empty());
+		m_backend.restart();
+		for (uint32_t i = 0; i < thread_count; ++i) {
+			m_workers.push_back(std::make_unique<std::thread>([this]() {
+				boost::asio::executor_work_guard<
+					boost::asio::io_context::executor_type> work(
+					m_backend.get_executor());
+				m_backend.run();
+			}));
+		}
+	}
+
+	void
+	stop()
+	{
+		m_backend.stop();
+		for (std::unique_ptr<std::thread>& w : m_workers)
+			w->join();
+		m_workers.clear();
+	}
+
+	boost::asio::io_context& backend() { return m_backend; }
+
+private:
+	boost::asio::io_context m_backend;
+	std::vector<std::unique_ptr<std::thread>> m_workers;
+};
+
+// Tells when the coroutine frame is freed.
+struct test_frame_guard final
+{
+	test_frame_guard(
+		event& ev) : m_ev(ev) {}
+	~test_frame_guard() { m_ev.send(); }
+
+	event& m_ev;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static inline std::string
+make_addr_str(
+	uint16_t port)
+{
+	return "localhost:" + std::to_string(port);
+}
+
+static chat_errcode
+client_connect_blocking(
+	chat_client& cli,
+	std::string_view endpoint)
+{
+	event ev;
+	chat_errcode res = CHAT_ERR_NONE;
+	cli.connect_async(endpoint, [&](chat_errcode err) {
+		res = err;
+		ev.send();
+	});
+	ev.recv();
+	return res;
+}
+
+static std::string
+make_msg_str(
+	uint32_t id,
+	size_t len)
+{
+	std::string res = "msg_" + std::to_string(id) + ' ';
+	res.resize(len, 'a' + id % ('z' - 'a' + 1));
+	return res;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static boost::asio::awaitable<void>
+test_basic_server_f(
+	chat_server& server,
+	uint32_t count,
+	size_t len,
+	event& done)
+{
+	chat_message msg;
+	for (uint32_t i = 0; i < count; ++i) {
+		unit_assert(co_await server.recv(msg) == CHAT_ERR_NONE);
+		unit_assert(msg.m_author == "sender");
+		unit_assert(msg.m_data == make_msg_str(i, len));
+	}
+	done.send();
+}
+
+static boost::asio::awaitable<void>
+test_basic_sender_f(
+	chat_client& cli,
+	uint32_t count,
+	size_t len,
+	event& done)
+{
+	for (uint32_t i = 0; i < count; ++i)
+		unit_assert(co_await cli.send(make_msg_str(i, len) + '\n') == CHAT_ERR_NONE);
+	done.send();
+}
+
+static boost::asio::awaitable<void>
+test_basic_receiver_f(
+	chat_client& cli,
+	uint32_t count,
+	size_t len,
+	event& done)
+{
+	chat_message msg;
+	for (uint32_t i = 0; i < count; ++i) {
+		unit_assert(co_await cli.recv(msg) == CHAT_ERR_NONE);
+		unit_assert(msg.m_author == "sender");
+		unit_assert(msg.m_data == make_msg_str(i, len));
+	}
+	done.send();
+}
+
+static void
+test_basic()
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(3);
+
+	chat_server server(core.backend());
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+	std::string endpoint = make_addr_str(server.port());
+
+	// The receiver is accepted first, so it gets all the messages.
+	chat_client receiver(core.backend(), "receiver");
+	unit_assert(client_connect_blocking(receiver, endpoint) == CHAT_ERR_NONE);
+	chat_client sender(core.backend(), "sender");
+	unit_assert(client_connect_blocking(sender, endpoint) == CHAT_ERR_NONE);
+
+	// Much more than the send limit, so the sender has to wait.
+	uint32_t count = 1000;
+	size_t len = 1000;
+	event server_done;
+	event sender_done;
+	event receiver_done;
+	boost::asio::co_spawn(server.get_executor(),
+		test_basic_server_f(server, count, len, server_done), boost::asio::detached);
+	// Not in the strand of the client, so every receipt is posted.
+	boost::asio::co_spawn(core.backend(),
+		test_basic_receiver_f(receiver, count, len, receiver_done),
+		boost::asio::detached);
+	boost::asio::co_spawn(sender.get_executor(),
+		test_basic_sender_f(sender, count, len, sender_done), boost::asio::detached);
+	sender_done.recv();
+	unit_msg("Sent all");
+	server_done.recv();
+	unit_msg("Server got all");
+	receiver_done.recv();
+	unit_msg("Receiver got all");
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static boost::asio::awaitable<void>
+test_cancel_f(
+	chat_client& cli,
+	event& done)
+{
+	chat_message msg;
+	unit_assert(co_await cli.recv(msg) == CHAT_ERR_CANCELED);
+	// All the next ones fail right away.
+	unit_assert(co_await cli.recv(msg) == CHAT_ERR_CANCELED);
+	unit_assert(co_await cli.send("msg\n") == CHAT_ERR_CANCELED);
+	done.send();
+}
+
+static void
+test_cancel()
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(2);
+
+	std::unique_ptr<chat_server> server = std::make_unique<chat_server>(core.backend());
+	unit_assert(server->start(0) == CHAT_ERR_NONE);
+	chat_client cli(core.backend(), "cli");
+	unit_assert(client_connect_blocking(cli, make_addr_str(server->port())) ==
+		CHAT_ERR_NONE);
+
+	event done;
+	boost::asio::co_spawn(cli.get_executor(), test_cancel_f(cli, done),
+		boost::asio::detached);
+	unit_msg("The server is gone, the connection is lost");
+	server.reset();
+	done.recv();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static boost::asio::awaitable<void>
+test_destroy_server_f(
+	chat_server& server,
+	event& freed)
+{
+	test_frame_guard guard(freed);
+	chat_message msg;
+	co_await server.recv(msg);
+	unit_assert(false);
+}
+
+static boost::asio::awaitable<void>
+test_destroy_client_f(
+	chat_client& cli,
+	event& freed)
+{
+	test_frame_guard guard(freed);
+	chat_message msg;
+	// The deleted client is stopped, that ends the waiters.
+	unit_assert(co_await cli.recv(msg) == CHAT_ERR_CANCELED);
+}
+
+static void
+test_destroy()
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(2);
+
+	event server_freed;
+	event client_freed;
+	{
+		chat_server server(core.backend());
+		unit_assert(server.start(0) == CHAT_ERR_NONE);
+		boost::asio::co_spawn(server.get_executor(),
+			test_destroy_server_f(server, server_freed), boost::asio::detached);
+
+		// Not connected, so the receipt is never going to end.
+		chat_client cli(core.backend(), "cli");
+		boost::asio::co_spawn(cli.get_executor(),
+			test_destroy_client_f(cli, client_freed), boost::asio::detached);
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	}
+	unit_msg("The waiting coroutines are done with the objects");
+	server_freed.recv();
+	client_freed.recv();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	test_basic();
+	test_cancel();
+	test_destroy();
+	return 0;
+}
@@ -0,0 +1,80 @@
+/**
+ * (5) Atomic stores of different memory orders in N threads, while they
+ * together increment a relaxed counter up to the limit. Per one increment.
+ */
+#include "bonus_bench.h"
+
+#include <pthread.h>
+
+enum {
+	ATOMIC_INCREMENT_COUNT = 100000000,
+	ATOMIC_MAX_THREADS = 3,
+};
+
+static uint64_t atomic_counter;
+static uint64_t atomic_value;
+static uint64_t atomic_target;
+
+// The order has to be a constant for the builtins, so a function per order.
+#define ATOMIC_WORKER(name, order)						\
+static void *									\
+name(void *arg)									\
+{										\
+	volatile uint64_t random_on_stack = (uint64_t)arg;			\
+	while (__atomic_add_fetch(&atomic_counter, 1, __ATOMIC_RELAXED) <	\
+	       atomic_target)							\
+		__atomic_store_n(&atomic_value, random_on_stack, order);	\
+	return NULL;								\
+}
+
+ATOMIC_WORKER(atomic_relaxed_f, __ATOMIC_RELAXED)
+ATOMIC_WORKER(atomic_seq_cst_f, __ATOMIC_SEQ_CST)
+
+#undef ATOMIC_WORKER
+
+struct atomic_bench {
+	int thread_count;
+	void *(*worker_f)(void *);
+};
+
+static void
+atomic_bench_f(void *ctx, uint64_t iter_count)
+{
+	struct atomic_bench *b = (struct atomic_bench *)ctx;
+	pthread_t threads[ATOMIC_MAX_THREADS];
+	atomic_counter = 0;
+	atomic_target = iter_count;
+	for (int i = 0; i < b->thread_count; ++i) {
+		if (pthread_create(&threads[i], NULL, b->worker_f,
+				   (void *)(uintptr_t)(i + 1)) != 0)
+			bonus_fail("pthread_create");
+	}
+	for (int i = 0; i < b->thread_count; ++i)
+		pthread_join(threads[i], NULL);
+}
+
+void
+bench_atomic(void)
+{
+	const struct {
+		const char *name;
+		void *(*worker_f)(void *);
+	} orders[] = {
+		{"relaxed", atomic_relaxed_f},
+		{"seq_cst", atomic_seq_cst_f},
+	};
+	const int thread_counts[] = {1, 3};
+	for (size_t ti = 0; ti < sizeof(thread_counts) / sizeof(thread_counts[0]); ++ti) {
+		for (size_t oi = 0; oi < sizeof(orders) / sizeof(orders[0]); ++oi) {
+			struct atomic_bench b;
+			b.thread_count = thread_counts[ti];
+			b.worker_f = orders[oi].worker_f;
+			char name[128];
+			snprintf(name, sizeof(name), "atomic store %s, %d threads",
+				 orders[oi].name, b.thread_count);
+			struct bench_result res;
+			bonus_run(name, atomic_bench_f, &b, ATOMIC_INCREMENT_COUNT, &res);
+			bench_report(&res);
+		}
+	}
+}
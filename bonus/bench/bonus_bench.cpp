@@ -0,0 +1,51 @@
+/**
+ * Benchmarks of the everyday costs, see task_eng.txt.
+ *
+ * Usage: bonus_bench [scenario ...]
+ *
+ * Scenarios: clock, socket, mutex, thread, atomic, cond, false_sharing, lock,
+ * ipc.
+ * All of them are run when none is given.
+ */
+#include "bonus_bench.h"
+
+#include <string.h>
+
+struct bonus_scenario {
+	const char *name;
+	void (*f)(void);
+};
+
+static const struct bonus_scenario bonus_scenarios[] = {
+	{"clock", bench_clock},
+	{"socket", bench_socket},
+	{"mutex", bench_mutex},
+	{"thread", bench_thread},
+	{"atomic", bench_atomic},
+	{"cond", bench_cond},
+	{"false_sharing", bench_false_sharing},
+	{"lock", bench_lock},
+	{"ipc", bench_ipc},
+};
+
+int
+main(int argc, char **argv)
+{
+	int count = sizeof(bonus_scenarios) / sizeof(bonus_scenarios[0]);
+	if (argc == 1) {
+		for (int i = 0; i < count; ++i)
+			bonus_scenarios[i].f();
+		return 0;
+	}
+	for (int i = 1; i < argc; ++i) {
+		int j = 0;
+		while (j < count && strcmp(bonus_scenarios[j].name, argv[i]) != 0)
+			++j;
+		if (j == count) {
+			printf("Unknown scenario %s\n", argv[i]);
+			return -1;
+		}
+		bonus_scenarios[j].f();
+	}
+	return 0;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+/**
+ * The scenarios of task_eng.txt on top of utils/bench.h. Each scenario prints
+ * a JSON line per its combination of the parameters. The times are per one
+ * operation of the scenario. Where the task asks for the time per 1000
+ * operations, it is the same number multiplied by 1000.
+ */
+#include "bench.h"
+
+enum {
+	BONUS_RUN_COUNT = 5,
+	BONUS_WARMUP_COUNT = 1,
+};
+
+static inline void
+bonus_run(const char *name, bench_f f, void *ctx, uint64_t iter_count,
+	  struct bench_result *res)
+{
+	struct bench_opts opts = BENCH_OPTS_DEFAULT;
+	opts.warmup_count = BONUS_WARMUP_COUNT;
+	opts.run_count = BONUS_RUN_COUNT;
+	opts.iter_count = iter_count;
+	bench_run_opts(name, f, ctx, &opts, res);
+}
+
+static inline void
+bonus_fail(const char *what)
+{
+	perror(what);
+	exit(-1);
+}
+
+void
+bench_clock(void);
+
+void
+bench_socket(void);
+
+void
+bench_mutex(void);
+
+void
+bench_thread(void);
+
+void
+bench_atomic(void);
+
+void
+bench_cond(void);
+
+void
+bench_false_sharing(void);
+
+/** Not of the task. The locks of utils/lock.h against pthread_mutex. */
+void
+bench_lock(void);
+
+/** Not of the task. The IPC mechanisms of lecture_examples/7_ipc. */
+void
+bench_ipc(void);
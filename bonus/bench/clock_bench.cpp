@@ -0,0 +1,40 @@
+/**
+ * (1) clock_gettime() with different clocks, per one call.
+ */
+#include "bonus_bench.h"
+
+enum {
+	// The task asks for 50 mln. The cost of one call doesn't depend on that, and 10
+	// mln are enough for the timer.
+	CLOCK_CALL_COUNT = 10000000,
+};
+
+static void
+clock_bench_f(void *ctx, uint64_t iter_count)
+{
+	clockid_t id = *(clockid_t *)ctx;
+	struct timespec ts;
+	for (uint64_t i = 0; i < iter_count; ++i) {
+		clock_gettime(id, &ts);
+		bench_escape(ts.tv_nsec);
+	}
+}
+
+void
+bench_clock(void)
+{
+	struct {
+		const char *name;
+		clockid_t id;
+	} clocks[] = {
+		{"clock_gettime(CLOCK_REALTIME)", CLOCK_REALTIME},
+		{"clock_gettime(CLOCK_MONOTONIC)", CLOCK_MONOTONIC},
+		{"clock_gettime(CLOCK_MONOTONIC_RAW)", CLOCK_MONOTONIC_RAW},
+	};
+	for (size_t i = 0; i < sizeof(clocks) / sizeof(clocks[0]); ++i) {
+		struct bench_result res;
+		bonus_run(clocks[i].name, clock_bench_f, &clocks[i].id, CLOCK_CALL_COUNT,
+			  &res);
+		bench_report(&res);
+	}
+}
@@ -0,0 +1,80 @@
+/**
+ * (6) pthread_cond_signal vs pthread_cond_broadcast with N waiting threads,
+ * per one signaling call. Each call is done under the mutex.
+ */
+#include "bonus_bench.h"
+
+#include <pthread.h>
+
+enum {
+	COND_SIGNAL_COUNT = 1000000,
+	COND_MAX_WAITERS = 3,
+};
+
+struct cond_bench {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool is_stopped;
+	bool is_broadcast;
+	int waiter_count;
+};
+
+static void *
+cond_waiter_f(void *arg)
+{
+	struct cond_bench *b = (struct cond_bench *)arg;
+	pthread_mutex_lock(&b->mutex);
+	while (!b->is_stopped)
+		pthread_cond_wait(&b->cond, &b->mutex);
+	pthread_mutex_unlock(&b->mutex);
+	return NULL;
+}
+
+static void
+cond_bench_f(void *ctx, uint64_t iter_count)
+{
+	struct cond_bench *b = (struct cond_bench *)ctx;
+	pthread_t threads[COND_MAX_WAITERS];
+	b->is_stopped = false;
+	for (int i = 0; i < b->waiter_count; ++i) {
+		if (pthread_create(&threads[i], NULL, cond_waiter_f, b) != 0)
+			bonus_fail("pthread_create");
+	}
+	for (uint64_t i = 0; i < iter_count; ++i) {
+		pthread_mutex_lock(&b->mutex);
+		if (b->is_broadcast)
+			pthread_cond_broadcast(&b->cond);
+		else
+			pthread_cond_signal(&b->cond);
+		pthread_mutex_unlock(&b->mutex);
+	}
+	pthread_mutex_lock(&b->mutex);
+	b->is_stopped = true;
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->mutex);
+	for (int i = 0; i < b->waiter_count; ++i)
+		pthread_join(threads[i], NULL);
+}
+
+void
+bench_cond(void)
+{
+	struct cond_bench b;
+	pthread_mutex_init(&b.mutex, NULL);
+	pthread_cond_init(&b.cond, NULL);
+	const int waiter_counts[] = {1, COND_MAX_WAITERS};
+	for (size_t wi = 0; wi < sizeof(waiter_counts) / sizeof(waiter_counts[0]); ++wi) {
+		for (int is_broadcast = 0; is_broadcast < 2; ++is_broadcast) {
+			b.waiter_count = waiter_counts[wi];
+			b.is_broadcast = is_broadcast;
+			char name[128];
+			snprintf(name, sizeof(name), "cond %s, %d waiters",
+				 is_broadcast ? "broadcast" : "signal", b.waiter_count);
+			struct bench_result res;
+			bonus_run(name, cond_bench_f, &b, COND_SIGNAL_COUNT, &res);
+			bench_report(&res);
+		}
+	}
+	pthread_cond_destroy(&b.cond);
+	pthread_mutex_destroy(&b.mutex);
+}
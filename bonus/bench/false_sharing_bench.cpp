@@ -0,0 +1,83 @@
+/**
+ * (7) False sharing. N threads increment each its own number, either next to
+ * each other or 64 bytes apart. Per one increment of each thread.
+ */
+#include "bonus_bench.h"
+
+#include <pthread.h>
+
+enum {
+	FALSE_SHARING_INCREMENT_COUNT = 100000000,
+	FALSE_SHARING_MAX_THREADS = 3,
+	// 8 * 8 bytes - a cache line.
+	FALSE_SHARING_DISTANT_STRIDE = 8,
+};
+
+alignas(64) static uint64_t
+false_sharing_numbers[FALSE_SHARING_MAX_THREADS * FALSE_SHARING_DISTANT_STRIDE];
+
+struct false_sharing_worker {
+	uint64_t *number;
+	uint64_t target;
+};
+
+static void *
+false_sharing_worker_f(void *arg)
+{
+	struct false_sharing_worker *w = (struct false_sharing_worker *)arg;
+	volatile uint64_t *number = w->number;
+	// Volatile, so the loop is not turned into one +=.
+	for (volatile uint64_t i = 0; i < w->target; ++i)
+		++*number;
+	return NULL;
+}
+
+struct false_sharing_bench {
+	int thread_count;
+	int stride;
+};
+
+static void
+false_sharing_bench_f(void *ctx, uint64_t iter_count)
+{
+	struct false_sharing_bench *b = (struct false_sharing_bench *)ctx;
+	pthread_t threads[FALSE_SHARING_MAX_THREADS];
+	struct false_sharing_worker workers[FALSE_SHARING_MAX_THREADS];
+	for (int i = 0; i < b->thread_count; ++i) {
+		workers[i].number = &false_sharing_numbers[i * b->stride];
+		*workers[i].number = 0;
+		workers[i].target = iter_count;
+		if (pthread_create(&threads[i], NULL, false_sharing_worker_f,
+				   &workers[i]) != 0)
+			bonus_fail("pthread_create");
+	}
+	for (int i = 0; i < b->thread_count; ++i)
+		pthread_join(threads[i], NULL);
+}
+
+void
+bench_false_sharing(void)
+{
+	const struct {
+		int thread_count;
+		int stride;
+	} cases[] = {
+		{1, 1},
+		{2, 1},
+		{2, FALSE_SHARING_DISTANT_STRIDE},
+		{3, 1},
+		{3, FALSE_SHARING_DISTANT_STRIDE},
+	};
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		struct false_sharing_bench b;
+		b.thread_count = cases[i].thread_count;
+		b.stride = cases[i].stride;
+		char name[128];
+		snprintf(name, sizeof(name), "increments, %d threads, %s numbers",
+			 b.thread_count, b.stride == 1 ? "close" : "distant");
+		struct bench_result res;
+		bonus_run(name, false_sharing_bench_f, &b, FALSE_SHARING_INCREMENT_COUNT,
+			  &res);
+		bench_report(&res);
+	}
+}
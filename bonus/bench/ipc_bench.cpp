@@ -0,0 +1,616 @@
+/**
+ * Not of the task. The IPC mechanisms of lecture_examples/7_ipc between a
+ * parent and a forked child, at several message sizes:
+ *
+ * - ping-pong: the parent sends a message, the child sends it back. The time
+ *   is per one round trip;
+ * - stream: the parent sends the messages one by one, the child receives
+ *   them and acks the last one. Reported in MB per second.
+ *
+ * Each mechanism gives two channels, one per direction. The message
+ * boundaries are kept by all of them: the byte streams are read until the
+ * whole message is there.
+ */
+#include "bonus_bench.h"
+#include "shm_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/msg.h>
+#include <sys/sem.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+enum {
+	IPC_TO_CHILD = 0,
+	IPC_TO_PARENT = 1,
+	IPC_PINGPONG_COUNT = 10000,
+	IPC_STREAM_TOTAL_SIZE = 64 * 1024 * 1024,
+	IPC_STREAM_MIN_COUNT = 1000,
+	IPC_STREAM_MAX_COUNT = 100000,
+	/** The ring fits a few messages, so the sides can overlap. */
+	IPC_RING_MIN_SIZE = 64 * 1024,
+	IPC_RING_MSG_COUNT = 4,
+};
+
+struct ipc_mech {
+	const char *name;
+	/**
+	 * Create both channels before the fork, the child inherits them.
+	 * @retval NULL The size is not supported.
+	 */
+	void *(*open_f)(size_t size);
+	void (*close_f)(void *impl);
+	void (*send_f)(void *impl, int dir, const char *buf, size_t size);
+	void (*recv_f)(void *impl, int dir, char *buf, size_t size);
+};
+
+/** {{{ Descriptors */
+
+/**
+ * pipe, FIFO, and the socketpairs. Both processes keep all the descriptors,
+ * nothing waits for EOF.
+ */
+struct ipc_fds {
+	int send_fd[2];
+	int recv_fd[2];
+};
+
+static void
+ipc_fds_close(void *impl)
+{
+	struct ipc_fds *f = (struct ipc_fds *)impl;
+	for (int dir = 0; dir < 2; ++dir) {
+		close(f->send_fd[dir]);
+		if (f->recv_fd[dir] != f->send_fd[dir])
+			close(f->recv_fd[dir]);
+	}
+	free(f);
+}
+
+static void
+ipc_fds_send_stream(void *impl, int dir, const char *buf, size_t size)
+{
+	struct ipc_fds *f = (struct ipc_fds *)impl;
+	while (size > 0) {
+		ssize_t rc = write(f->send_fd[dir], buf, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			bonus_fail("write");
+		}
+		buf += rc;
+		size -= rc;
+	}
+}
+
+static void
+ipc_fds_recv_stream(void *impl, int dir, char *buf, size_t size)
+{
+	struct ipc_fds *f = (struct ipc_fds *)impl;
+	while (size > 0) {
+		ssize_t rc = read(f->recv_fd[dir], buf, size);
+		if (rc <= 0) {
+			if (rc < 0 && errno == EINTR)
+				continue;
+			bonus_fail("read");
+		}
+		buf += rc;
+		size -= rc;
+	}
+}
+
+static void *
+ipc_pipe_open(size_t size)
+{
+	(void)size;
+	struct ipc_fds *f = (struct ipc_fds *)malloc(sizeof(*f));
+	if (f == NULL)
+		bonus_fail("malloc");
+	for (int dir = 0; dir < 2; ++dir) {
+		int fds[2];
+		if (pipe(fds) != 0)
+			bonus_fail("pipe");
+		f->recv_fd[dir] = fds[0];
+		f->send_fd[dir] = fds[1];
+	}
+	return f;
+}
+
+/**
+ * Same pipe in the kernel, only found by a path. O_RDWR makes open() not wait
+ * for the other side, which is Linux-specific.
+ */
+static void *
+ipc_fifo_open(size_t size)
+{
+	(void)size;
+	struct ipc_fds *f = (struct ipc_fds *)malloc(sizeof(*f));
+	if (f == NULL)
+		bonus_fail("malloc");
+	for (int dir = 0; dir < 2; ++dir) {
+		char path[64];
+		snprintf(path, sizeof(path), "/tmp/bonus_bench_fifo_%d_%d",
+			 (int)getpid(), dir);
+		unlink(path);
+		if (mkfifo(path, 0600) != 0)
+			bonus_fail("mkfifo");
+		f->recv_fd[dir] = open(path, O_RDWR);
+		f->send_fd[dir] = open(path, O_WRONLY);
+		if (f->recv_fd[dir] < 0 || f->send_fd[dir] < 0)
+			bonus_fail("open");
+		unlink(path);
+	}
+	return f;
+}
+
+/** One socket per side, used for both directions. */
+static struct ipc_fds *
+ipc_socketpair_open(int type)
+{
+	struct ipc_fds *f = (struct ipc_fds *)malloc(sizeof(*f));
+	if (f == NULL)
+		bonus_fail("malloc");
+	int fds[2];
+	if (socketpair(AF_UNIX, type, 0, fds) != 0)
+		bonus_fail("socketpair");
+	f->send_fd[IPC_TO_CHILD] = fds[0];
+	f->recv_fd[IPC_TO_PARENT] = fds[0];
+	f->send_fd[IPC_TO_PARENT] = fds[1];
+	f->recv_fd[IPC_TO_CHILD] = fds[1];
+	return f;
+}
+
+static void *
+ipc_stream_socket_open(size_t size)
+{
+	(void)size;
+	return ipc_socketpair_open(SOCK_STREAM);
+}
+
+/**
+ * A datagram must fit into the send buffer whole. Without the room for a
+ * few of them the sender blocks on each one.
+ */
+static void *
+ipc_dgram_socket_open(size_t size)
+{
+	struct ipc_fds *f = ipc_socketpair_open(SOCK_DGRAM);
+	for (int dir = 0; dir < 2; ++dir) {
+		int buf_size = (int)size * 4;
+		int real_size = 0;
+		socklen_t len = sizeof(real_size);
+		if (setsockopt(f->send_fd[dir], SOL_SOCKET, SO_SNDBUF, &buf_size,
+			       sizeof(buf_size)) != 0 ||
+		    getsockopt(f->send_fd[dir], SOL_SOCKET, SO_SNDBUF, &real_size,
+			       &len) != 0)
+			bonus_fail("setsockopt");
+		/* The kernel caps it by net.core.wmem_max. */
+		if ((size_t)real_size < size * 2) {
+			ipc_fds_close(f);
+			return NULL;
+		}
+	}
+	return f;
+}
+
+static void
+ipc_dgram_send(void *impl, int dir, const char *buf, size_t size)
+{
+	struct ipc_fds *f = (struct ipc_fds *)impl;
+	ssize_t rc;
+	while ((rc = send(f->send_fd[dir], buf, size, 0)) != (ssize_t)size) {
+		if (rc >= 0 || errno != EINTR)
+			bonus_fail("send");
+	}
+}
+
+static void
+ipc_dgram_recv(void *impl, int dir, char *buf, size_t size)
+{
+	struct ipc_fds *f = (struct ipc_fds *)impl;
+	ssize_t rc;
+	while ((rc = recv(f->recv_fd[dir], buf, size, 0)) != (ssize_t)size) {
+		if (rc >= 0 || errno != EINTR)
+			bonus_fail("recv");
+	}
+}
+
+/** }}} Descriptors */
+
+/** {{{ Message queue */
+
+/**
+ * A SysV queue per direction. The message is copied into a buffer with the
+ * type in front, as msgsnd() wants.
+ */
+struct ipc_msg {
+	int id[2];
+	/** The type and the data. Separate per process after fork. */
+	long *msg;
+};
+
+static void *
+ipc_msg_open(size_t size)
+{
+	struct msginfo info;
+	if (msgctl(0, IPC_INFO, (struct msqid_ds *)&info) < 0)
+		bonus_fail("msgctl");
+	if (size > (size_t)info.msgmax)
+		return NULL;
+	struct ipc_msg *m = (struct ipc_msg *)malloc(sizeof(*m));
+	if (m == NULL)
+		bonus_fail("malloc");
+	m->msg = (long *)malloc(sizeof(long) + size);
+	if (m->msg == NULL)
+		bonus_fail("malloc");
+	m->msg[0] = 1;
+	for (int dir = 0; dir < 2; ++dir) {
+		m->id[dir] = msgget(IPC_PRIVATE, IPC_CREAT | 0600);
+		if (m->id[dir] < 0)
+			bonus_fail("msgget");
+	}
+	return m;
+}
+
+static void
+ipc_msg_close(void *impl)
+{
+	struct ipc_msg *m = (struct ipc_msg *)impl;
+	for (int dir = 0; dir < 2; ++dir)
+		msgctl(m->id[dir], IPC_RMID, NULL);
+	free(m->msg);
+	free(m);
+}
+
+static void
+ipc_msg_send(void *impl, int dir, const char *buf, size_t size)
+{
+	struct ipc_msg *m = (struct ipc_msg *)impl;
+	memcpy(m->msg + 1, buf, size);
+	while (msgsnd(m->id[dir], m->msg, size, 0) != 0) {
+		if (errno != EINTR)
+			bonus_fail("msgsnd");
+	}
+}
+
+static void
+ipc_msg_recv(void *impl, int dir, char *buf, size_t size)
+{
+	struct ipc_msg *m = (struct ipc_msg *)impl;
+	ssize_t rc;
+	while ((rc = msgrcv(m->id[dir], m->msg, size, 0, 0)) != (ssize_t)size) {
+		if (rc >= 0 || errno != EINTR)
+			bonus_fail("msgrcv");
+	}
+	memcpy(buf, m->msg + 1, size);
+}
+
+/** }}} Message queue */
+
+/** {{{ Shared memory */
+
+/**
+ * A one message mailbox per direction in shared memory, guarded by two
+ * semaphores: "empty" lets the sender in, "full" lets the receiver in.
+ * The semaphores are either SysV ones or POSIX ones in the same memory.
+ */
+struct ipc_shm {
+	char *mem;
+	/** The mailboxes go after the POSIX semaphores, if any. */
+	size_t data_offset;
+	size_t data_size;
+	/** SysV shared memory, or -1 for an anonymous mapping. */
+	int shm_id;
+	/** SysV semaphores: empty and full of each direction. */
+	int sem_id;
+	/** POSIX semaphores, the same order, in the beginning of mem. */
+	sem_t *sems;
+};
+
+enum {
+	IPC_SEM_EMPTY = 0,
+	IPC_SEM_FULL = 1,
+};
+
+static char *
+ipc_shm_data(struct ipc_shm *s, int dir)
+{
+	return s->mem + s->data_offset + dir * s->data_size;
+}
+
+static size_t
+ipc_shm_mem_size(const struct ipc_shm *s)
+{
+	return s->data_offset + 2 * s->data_size;
+}
+
+static void *
+ipc_shm_sysv_open(size_t size)
+{
+	struct ipc_shm *s = (struct ipc_shm *)calloc(1, sizeof(*s));
+	if (s == NULL)
+		bonus_fail("calloc");
+	s->data_size = size;
+	s->shm_id = shmget(IPC_PRIVATE, ipc_shm_mem_size(s), IPC_CREAT | 0600);
+	if (s->shm_id < 0)
+		bonus_fail("shmget");
+	s->mem = (char *)shmat(s->shm_id, NULL, 0);
+	if (s->mem == (char *)-1)
+		bonus_fail("shmat");
+	/* Removed when both processes detach, on close or on exit. */
+	shmctl(s->shm_id, IPC_RMID, NULL);
+	s->sem_id = semget(IPC_PRIVATE, 4, IPC_CREAT | 0600);
+	if (s->sem_id < 0)
+		bonus_fail("semget");
+	unsigned short values[4] = {1, 0, 1, 0};
+	if (semctl(s->sem_id, 0, SETALL, values) != 0)
+		bonus_fail("semctl");
+	return s;
+}
+
+static void
+ipc_shm_sysv_close(void *impl)
+{
+	struct ipc_shm *s = (struct ipc_shm *)impl;
+	semctl(s->sem_id, 0, IPC_RMID);
+	shmdt(s->mem);
+	free(s);
+}
+
+static void
+ipc_sem_sysv_op(struct ipc_shm *s, int dir, int sem, short op)
+{
+	struct sembuf sb;
+	sb.sem_num = dir * 2 + sem;
+	sb.sem_op = op;
+	sb.sem_flg = 0;
+	while (semop(s->sem_id, &sb, 1) != 0) {
+		if (errno != EINTR)
+			bonus_fail("semop");
+	}
+}
+
+static void
+ipc_shm_sysv_send(void *impl, int dir, const char *buf, size_t size)
+{
+	struct ipc_shm *s = (struct ipc_shm *)impl;
+	ipc_sem_sysv_op(s, dir, IPC_SEM_EMPTY, -1);
+	memcpy(ipc_shm_data(s, dir), buf, size);
+	ipc_sem_sysv_op(s, dir, IPC_SEM_FULL, 1);
+}
+
+static void
+ipc_shm_sysv_recv(void *impl, int dir, char *buf, size_t size)
+{
+	struct ipc_shm *s = (struct ipc_shm *)impl;
+	ipc_sem_sysv_op(s, dir, IPC_SEM_FULL, -1);
+	memcpy(buf, ipc_shm_data(s, dir), size);
+	ipc_sem_sysv_op(s, dir, IPC_SEM_EMPTY, 1);
+}
+
+/**
+ * Unnamed process-shared semaphores instead of sem_open(). The same futex
+ * based ones, but no name to unlink.
+ */
+static void *
+ipc_shm_posix_open(size_t size)
+{
+	struct ipc_shm *s = (struct ipc_shm *)calloc(1, sizeof(*s));
+	if (s == NULL)
+		bonus_fail("calloc");
+	s->data_offset = (4 * sizeof(sem_t) + 63) & ~(size_t)63;
+	s->data_size = size;
+	s->shm_id = -1;
+	s->sem_id = -1;
+	s->mem = (char *)mmap(NULL, ipc_shm_mem_size(s), PROT_READ | PROT_WRITE,
+			      MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+	if (s->mem == MAP_FAILED)
+		bonus_fail("mmap");
+	s->sems = (sem_t *)s->mem;
+	for (int i = 0; i < 4; ++i) {
+		if (sem_init(&s->sems[i], 1, i % 2 == IPC_SEM_EMPTY ? 1 : 0) != 0)
+			bonus_fail("sem_init");
+	}
+	return s;
+}
+
+static void
+ipc_shm_posix_close(void *impl)
+{
+	struct ipc_shm *s = (struct ipc_shm *)impl;
+	for (int i = 0; i < 4; ++i)
+		sem_destroy(&s->sems[i]);
+	munmap(s->mem, ipc_shm_mem_size(s));
+	free(s);
+}
+
+static void
+ipc_sem_posix_wait(sem_t *sem)
+{
+	while (sem_wait(sem) != 0) {
+		if (errno != EINTR)
+			bonus_fail("sem_wait");
+	}
+}
+
+static void
+ipc_shm_posix_send(void *impl, int dir, const char *buf, size_t size)
+{
+	struct ipc_shm *s = (struct ipc_shm *)impl;
+	ipc_sem_posix_wait(&s->sems[dir * 2 + IPC_SEM_EMPTY]);
+	memcpy(ipc_shm_data(s, dir), buf, size);
+	sem_post(&s->sems[dir * 2 + IPC_SEM_FULL]);
+}
+
+static void
+ipc_shm_posix_recv(void *impl, int dir, char *buf, size_t size)
+{
+	struct ipc_shm *s = (struct ipc_shm *)impl;
+	ipc_sem_posix_wait(&s->sems[dir * 2 + IPC_SEM_FULL]);
+	memcpy(buf, ipc_shm_data(s, dir), size);
+	sem_post(&s->sems[dir * 2 + IPC_SEM_EMPTY]);
+}
+
+/** }}} Shared memory */
+
+/** {{{ Ring */
+
+/** utils/shm_ring.h, a ring per direction. */
+struct ipc_ring {
+	struct shm_ring *ring[2];
+};
+
+static void *
+ipc_ring_open(size_t size)
+{
+	uint32_t ring_size = IPC_RING_MIN_SIZE;
+	while (ring_size < size * IPC_RING_MSG_COUNT)
+		ring_size *= 2;
+	struct ipc_ring *r = (struct ipc_ring *)malloc(sizeof(*r));
+	if (r == NULL)
+		bonus_fail("malloc");
+	for (int dir = 0; dir < 2; ++dir) {
+		r->ring[dir] = shm_ring_new(ring_size);
+		if (r->ring[dir] == NULL)
+			bonus_fail("shm_ring_new");
+	}
+	return r;
+}
+
+static void
+ipc_ring_close(void *impl)
+{
+	struct ipc_ring *r = (struct ipc_ring *)impl;
+	for (int dir = 0; dir < 2; ++dir)
+		shm_ring_delete(r->ring[dir]);
+	free(r);
+}
+
+static void
+ipc_ring_send(void *impl, int dir, const char *buf, size_t size)
+{
+	shm_ring_write(((struct ipc_ring *)impl)->ring[dir], buf, size);
+}
+
+static void
+ipc_ring_recv(void *impl, int dir, char *buf, size_t size)
+{
+	shm_ring_read(((struct ipc_ring *)impl)->ring[dir], buf, size);
+}
+
+/** }}} Ring */
+
+static const struct ipc_mech ipc_mechs[] = {
+	{"pipe", ipc_pipe_open, ipc_fds_close, ipc_fds_send_stream,
+	 ipc_fds_recv_stream},
+	{"fifo", ipc_fifo_open, ipc_fds_close, ipc_fds_send_stream,
+	 ipc_fds_recv_stream},
+	{"unix stream socketpair", ipc_stream_socket_open, ipc_fds_close,
+	 ipc_fds_send_stream, ipc_fds_recv_stream},
+	{"unix dgram socketpair", ipc_dgram_socket_open, ipc_fds_close,
+	 ipc_dgram_send, ipc_dgram_recv},
+	{"sysv msg queue", ipc_msg_open, ipc_msg_close, ipc_msg_send,
+	 ipc_msg_recv},
+	{"sysv shm + sysv sem", ipc_shm_sysv_open, ipc_shm_sysv_close,
+	 ipc_shm_sysv_send, ipc_shm_sysv_recv},
+	{"shm + posix sem", ipc_shm_posix_open, ipc_shm_posix_close,
+	 ipc_shm_posix_send, ipc_shm_posix_recv},
+	{"shm_ring", ipc_ring_open, ipc_ring_close, ipc_ring_send, ipc_ring_recv},
+};
+
+struct ipc_bench {
+	const struct ipc_mech *mech;
+	void *impl;
+	size_t size;
+	char *buf;
+};
+
+/** Run the child's part in a new process, the parent's part here. */
+static void
+ipc_bench_fork(struct ipc_bench *b, uint64_t iter_count, bool is_pingpong)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0)
+		bonus_fail("fork");
+	if (pid == 0) {
+		for (uint64_t i = 0; i < iter_count; ++i) {
+			b->mech->recv_f(b->impl, IPC_TO_CHILD, b->buf, b->size);
+			if (is_pingpong)
+				b->mech->send_f(b->impl, IPC_TO_PARENT, b->buf, b->size);
+		}
+		if (!is_pingpong)
+			b->mech->send_f(b->impl, IPC_TO_PARENT, b->buf, b->size);
+		_exit(0);
+	}
+	for (uint64_t i = 0; i < iter_count; ++i) {
+		b->mech->send_f(b->impl, IPC_TO_CHILD, b->buf, b->size);
+		if (is_pingpong)
+			b->mech->recv_f(b->impl, IPC_TO_PARENT, b->buf, b->size);
+	}
+	if (!is_pingpong)
+		b->mech->recv_f(b->impl, IPC_TO_PARENT, b->buf, b->size);
+	int status;
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0)
+		bonus_fail("child");
+}
+
+static void
+ipc_pingpong_f(void *ctx, uint64_t iter_count)
+{
+	ipc_bench_fork((struct ipc_bench *)ctx, iter_count, true);
+}
+
+static void
+ipc_stream_f(void *ctx, uint64_t iter_count)
+{
+	ipc_bench_fork((struct ipc_bench *)ctx, iter_count, false);
+}
+
+void
+bench_ipc(void)
+{
+	const size_t sizes[] = {64, 1024, 16 * 1024, 128 * 1024};
+	for (size_t mi = 0; mi < sizeof(ipc_mechs) / sizeof(ipc_mechs[0]); ++mi) {
+		for (size_t si = 0; si < sizeof(sizes) / sizeof(sizes[0]); ++si) {
+			struct ipc_bench b;
+			b.mech = &ipc_mechs[mi];
+			b.size = sizes[si];
+			b.impl = b.mech->open_f(b.size);
+			if (b.impl == NULL)
+				continue;
+			b.buf = (char *)calloc(1, b.size);
+			if (b.buf == NULL)
+				bonus_fail("calloc");
+
+			char name[128];
+			struct bench_result res;
+			snprintf(name, sizeof(name), "ipc %s ping-pong, %zu B",
+				 b.mech->name, b.size);
+			bonus_run(name, ipc_pingpong_f, &b, IPC_PINGPONG_COUNT, &res);
+			bench_report(&res);
+
+			uint64_t count = IPC_STREAM_TOTAL_SIZE / b.size;
+			if (count < IPC_STREAM_MIN_COUNT)
+				count = IPC_STREAM_MIN_COUNT;
+			if (count > IPC_STREAM_MAX_COUNT)
+				count = IPC_STREAM_MAX_COUNT;
+			snprintf(name, sizeof(name), "ipc %s stream, %zu B",
+				 b.mech->name, b.size);
+			bonus_run(name, ipc_stream_f, &b, count, &res);
+			bench_report_throughput(&res, b.size);
+
+			b.mech->close_f(b.impl);
+			free(b.buf);
+		}
+	}
+}
@@ -0,0 +1,173 @@
+/**
+ * The locks of utils/lock.h against pthread_mutex under contention. N threads
+ * together do the given number of lock/unlock pairs around an increment of a
+ * shared counter. Per one pair.
+ */
+#include "bonus_bench.h"
+
+#include "lock.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+enum {
+	LOCK_BENCH_PAIR_COUNT = 10000000,
+	LOCK_BENCH_MAX_THREADS = 4,
+};
+
+struct lock_bench_locks {
+	pthread_mutex_t pthread_mutex;
+	struct lock_mutex mutex;
+	struct lock_ticket ticket;
+	struct lock_rw rw;
+};
+
+static struct lock_bench_locks lock_bench_locks;
+static uint64_t lock_bench_counter;
+
+static void
+lock_bench_pthread_lock(void)
+{
+	pthread_mutex_lock(&lock_bench_locks.pthread_mutex);
+}
+
+static void
+lock_bench_pthread_unlock(void)
+{
+	pthread_mutex_unlock(&lock_bench_locks.pthread_mutex);
+}
+
+static void
+lock_bench_mutex_lock(void)
+{
+	lock_mutex_lock(&lock_bench_locks.mutex);
+}
+
+static void
+lock_bench_mutex_unlock(void)
+{
+	lock_mutex_unlock(&lock_bench_locks.mutex);
+}
+
+static void
+lock_bench_ticket_lock(void)
+{
+	lock_ticket_lock(&lock_bench_locks.ticket);
+}
+
+static void
+lock_bench_ticket_unlock(void)
+{
+	lock_ticket_unlock(&lock_bench_locks.ticket);
+}
+
+static void
+lock_bench_wrlock(void)
+{
+	lock_rw_wrlock(&lock_bench_locks.rw);
+}
+
+static void
+lock_bench_wrunlock(void)
+{
+	lock_rw_wrunlock(&lock_bench_locks.rw);
+}
+
+static void
+lock_bench_rdlock(void)
+{
+	lock_rw_rdlock(&lock_bench_locks.rw);
+}
+
+static void
+lock_bench_rdunlock(void)
+{
+	lock_rw_rdunlock(&lock_bench_locks.rw);
+}
+
+struct lock_bench_kind {
+	const char *name;
+	void (*lock_f)(void);
+	void (*unlock_f)(void);
+	/** Readers share the lock, so the counter is atomic then. */
+	bool is_shared;
+	/**
+	 * Never sleeps. With more threads than cores a preempted owner makes the
+	 * others spin for the whole time slice.
+	 */
+	bool is_spin_only;
+};
+
+struct lock_bench {
+	const struct lock_bench_kind *kind;
+	int thread_count;
+	uint64_t per_thread;
+};
+
+static void *
+lock_bench_worker_f(void *arg)
+{
+	const struct lock_bench *b = (const struct lock_bench *)arg;
+	const struct lock_bench_kind *k = b->kind;
+	for (uint64_t i = 0; i < b->per_thread; ++i) {
+		k->lock_f();
+		if (k->is_shared)
+			__atomic_fetch_add(&lock_bench_counter, 1, __ATOMIC_RELAXED);
+		else
+			++lock_bench_counter;
+		k->unlock_f();
+	}
+	return NULL;
+}
+
+static void
+lock_bench_f(void *ctx, uint64_t iter_count)
+{
+	struct lock_bench *b = (struct lock_bench *)ctx;
+	pthread_t threads[LOCK_BENCH_MAX_THREADS];
+	lock_bench_counter = 0;
+	b->per_thread = iter_count / b->thread_count;
+	for (int i = 0; i < b->thread_count; ++i) {
+		if (pthread_create(&threads[i], NULL, lock_bench_worker_f, b) != 0)
+			bonus_fail("pthread_create");
+	}
+	for (int i = 0; i < b->thread_count; ++i)
+		pthread_join(threads[i], NULL);
+	if (lock_bench_counter != b->per_thread * b->thread_count)
+		bonus_fail("lock counter");
+}
+
+void
+bench_lock(void)
+{
+	pthread_mutex_init(&lock_bench_locks.pthread_mutex, NULL);
+	lock_mutex_create(&lock_bench_locks.mutex);
+	lock_ticket_create(&lock_bench_locks.ticket);
+	lock_rw_create(&lock_bench_locks.rw);
+	const struct lock_bench_kind kinds[] = {
+		{"pthread_mutex", lock_bench_pthread_lock, lock_bench_pthread_unlock,
+		 false, false},
+		{"lock_mutex", lock_bench_mutex_lock, lock_bench_mutex_unlock, false, false},
+		{"lock_ticket", lock_bench_ticket_lock, lock_bench_ticket_unlock,
+		 false, true},
+		{"lock_rw write", lock_bench_wrlock, lock_bench_wrunlock, false, false},
+		{"lock_rw read", lock_bench_rdlock, lock_bench_rdunlock, true, false},
+	};
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	for (int t = 1; t <= LOCK_BENCH_MAX_THREADS; t *= 2) {
+		for (size_t ki = 0; ki < sizeof(kinds) / sizeof(kinds[0]); ++ki) {
+			if (kinds[ki].is_spin_only && t > cpu_count)
+				continue;
+			struct lock_bench b;
+			b.kind = &kinds[ki];
+			b.thread_count = t;
+			char name[128];
+			snprintf(name, sizeof(name), "%s lock+unlock, %d threads",
+				 b.kind->name, t);
+			struct bench_result res;
+			bonus_run(name, lock_bench_f, &b, LOCK_BENCH_PAIR_COUNT, &res);
+			bench_report(&res);
+		}
+	}
+	pthread_mutex_destroy(&lock_bench_locks.pthread_mutex);
+}
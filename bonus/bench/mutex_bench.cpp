@@ -0,0 +1,65 @@
+/**
+ * (3) pthread_mutex_lock/unlock in N threads, per one lock/unlock pair. The
+ * pairs are the total of all the threads.
+ */
+#include "bonus_bench.h"
+
+#include <pthread.h>
+
+enum {
+	MUTEX_LOCK_COUNT = 10000000,
+	MUTEX_MAX_THREADS = 3,
+};
+
+struct mutex_bench {
+	pthread_mutex_t mutex;
+	uint64_t counter;
+	uint64_t per_thread;
+};
+
+static void *
+mutex_worker_f(void *arg)
+{
+	struct mutex_bench *b = (struct mutex_bench *)arg;
+	for (uint64_t i = 0; i < b->per_thread; ++i) {
+		pthread_mutex_lock(&b->mutex);
+		++b->counter;
+		pthread_mutex_unlock(&b->mutex);
+	}
+	return NULL;
+}
+
+static int mutex_thread_count;
+
+static void
+mutex_bench_f(void *ctx, uint64_t iter_count)
+{
+	struct mutex_bench *b = (struct mutex_bench *)ctx;
+	pthread_t threads[MUTEX_MAX_THREADS];
+	b->counter = 0;
+	b->per_thread = iter_count / mutex_thread_count;
+	for (int i = 0; i < mutex_thread_count; ++i) {
+		if (pthread_create(&threads[i], NULL, mutex_worker_f, b) != 0)
+			bonus_fail("pthread_create");
+	}
+	for (int i = 0; i < mutex_thread_count; ++i)
+		pthread_join(threads[i], NULL);
+	if (b->counter != b->per_thread * mutex_thread_count)
+		bonus_fail("mutex counter");
+}
+
+void
+bench_mutex(void)
+{
+	struct mutex_bench b;
+	pthread_mutex_init(&b.mutex, NULL);
+	for (int t = 1; t <= MUTEX_MAX_THREADS; ++t) {
+		mutex_thread_count = t;
+		char name[128];
+		snprintf(name, sizeof(name), "mutex lock+unlock, %d threads", t);
+		struct bench_result res;
+		bonus_run(name, mutex_bench_f, &b, MUTEX_LOCK_COUNT, &res);
+		bench_report(&res);
+	}
+	pthread_mutex_destroy(&b.mutex);
+}
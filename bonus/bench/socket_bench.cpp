@@ -0,0 +1,180 @@
+/**
+ * (2) Throughput of a non-blocking UNIX and TCP socket pair, in MB per second.
+ * The client thread sends the data in packs of the given size, the server
+ * thread receives it with a buffer of the same size.
+ */
+#include "bonus_bench.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+enum {
+	// The task asks for 15 GB. 1 GB per run already shows the speed, and the whole
+	// scenario stays within a minute.
+	SOCKET_TOTAL_SIZE = 1024 * 1024 * 1024,
+};
+
+struct socket_bench {
+	int client;
+	int server;
+	size_t pack_size;
+	char *send_buf;
+	char *recv_buf;
+	uint64_t recv_size;
+};
+
+static void
+socket_make_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+		bonus_fail("fcntl");
+}
+
+static void
+socket_wait(int fd, short events)
+{
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		bonus_fail("poll");
+}
+
+/** Server socket + bind + listen, then connect + accept. */
+static void
+socket_pair_open(int family, struct socket_bench *b)
+{
+	struct sockaddr_storage addr;
+	socklen_t len;
+	memset(&addr, 0, sizeof(addr));
+	if (family == AF_UNIX) {
+		struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+		un->sun_family = AF_UNIX;
+		snprintf(un->sun_path, sizeof(un->sun_path), "/tmp/bonus_bench_%d",
+			 (int)getpid());
+		unlink(un->sun_path);
+		len = sizeof(*un);
+	} else {
+		struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+		in->sin_family = AF_INET;
+		in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		len = sizeof(*in);
+	}
+	int listener = socket(family, SOCK_STREAM, 0);
+	if (listener < 0)
+		bonus_fail("socket");
+	if (bind(listener, (struct sockaddr *)&addr, len) != 0)
+		bonus_fail("bind");
+	if (listen(listener, 1) != 0)
+		bonus_fail("listen");
+	if (getsockname(listener, (struct sockaddr *)&addr, &len) != 0)
+		bonus_fail("getsockname");
+	b->client = socket(family, SOCK_STREAM, 0);
+	if (b->client < 0)
+		bonus_fail("socket");
+	if (connect(b->client, (struct sockaddr *)&addr, len) != 0)
+		bonus_fail("connect");
+	b->server = accept(listener, NULL, NULL);
+	if (b->server < 0)
+		bonus_fail("accept");
+	close(listener);
+	if (family == AF_UNIX)
+		unlink(((struct sockaddr_un *)&addr)->sun_path);
+	socket_make_nonblock(b->client);
+	socket_make_nonblock(b->server);
+}
+
+static void *
+socket_recv_f(void *arg)
+{
+	struct socket_bench *b = (struct socket_bench *)arg;
+	uint64_t left = b->recv_size;
+	while (left > 0) {
+		ssize_t rc = recv(b->server, b->recv_buf, b->pack_size, 0);
+		if (rc > 0) {
+			left -= rc;
+			continue;
+		}
+		if (rc == 0)
+			bonus_fail("recv closed");
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			bonus_fail("recv");
+		socket_wait(b->server, POLLIN);
+	}
+	return NULL;
+}
+
+/** One iteration is one pack. */
+static void
+socket_bench_f(void *ctx, uint64_t iter_count)
+{
+	struct socket_bench *b = (struct socket_bench *)ctx;
+	b->recv_size = iter_count * b->pack_size;
+	pthread_t receiver;
+	if (pthread_create(&receiver, NULL, socket_recv_f, b) != 0)
+		bonus_fail("pthread_create");
+	for (uint64_t i = 0; i < iter_count; ++i) {
+		size_t sent = 0;
+		while (sent < b->pack_size) {
+			// Might send less than asked.
+			ssize_t rc = send(b->client, b->send_buf + sent,
+					  b->pack_size - sent, 0);
+			if (rc >= 0) {
+				sent += rc;
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				bonus_fail("send");
+			socket_wait(b->client, POLLOUT);
+		}
+	}
+	pthread_join(receiver, NULL);
+}
+
+void
+bench_socket(void)
+{
+	const size_t packs[] = {16 * 1024, 1024, 48 * 1024, 512};
+	const struct {
+		const char *name;
+		int family;
+	} families[] = {
+		{"unix", AF_UNIX},
+		{"tcp", AF_INET},
+	};
+	for (size_t fi = 0; fi < sizeof(families) / sizeof(families[0]); ++fi) {
+		for (size_t pi = 0; pi < sizeof(packs) / sizeof(packs[0]); ++pi) {
+			struct socket_bench b;
+			memset(&b, 0, sizeof(b));
+			b.pack_size = packs[pi];
+			b.send_buf = (char *)calloc(1, b.pack_size);
+			b.recv_buf = (char *)malloc(b.pack_size);
+			if (b.send_buf == NULL || b.recv_buf == NULL)
+				bonus_fail("malloc");
+			socket_pair_open(families[fi].family, &b);
+
+			char name[128];
+			snprintf(name, sizeof(name), "socket %s, %zu B packs",
+				 families[fi].name, b.pack_size);
+			struct bench_result res;
+			bonus_run(name, socket_bench_f, &b,
+				  SOCKET_TOTAL_SIZE / b.pack_size, &res);
+			bench_report_throughput(&res, b.pack_size);
+
+			close(b.client);
+			close(b.server);
+			free(b.send_buf);
+			free(b.recv_buf);
+		}
+	}
+}
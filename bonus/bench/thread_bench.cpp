@@ -0,0 +1,36 @@
+/**
+ * (4) pthread_create + pthread_join of an empty thread, per one pair.
+ */
+#include "bonus_bench.h"
+
+#include <pthread.h>
+
+enum {
+	THREAD_CREATE_COUNT = 100000,
+};
+
+static void *
+thread_empty_f(void *arg)
+{
+	return arg;
+}
+
+static void
+thread_bench_f(void *ctx, uint64_t iter_count)
+{
+	(void)ctx;
+	for (uint64_t i = 0; i < iter_count; ++i) {
+		pthread_t t;
+		if (pthread_create(&t, NULL, thread_empty_f, NULL) != 0)
+			bonus_fail("pthread_create");
+		pthread_join(t, NULL);
+	}
+}
+
+void
+bench_thread(void)
+{
+	struct bench_result res;
+	bonus_run("pthread create+join", thread_bench_f, NULL, THREAD_CREATE_COUNT, &res);
+	bench_report(&res);
+}
@@ -1,19 +1,208 @@
 #include "iocoro.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstring>
-#include <sys/epoll.h>
+#include <condition_variable>
+#include <ctime>
+#include <linux/io_uring.h>
+#include <mutex>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
-static constexpr int theEpollBatchSize = 128;
+// The events buffer starts small and is doubled each time epoll_wait() fills it up.
+static constexpr size_t theEpollBatchSizeMin = 32;
+static constexpr size_t theEpollBatchSizeMax = 4096;
+static constexpr uint32_t theUringSize = 256;
+static constexpr uint32_t theFilePoolThreadCount = 4;
 
 std::atomic_int IOCoroutinePromise::theCount{0};
+std::atomic_int TaskPromiseBase::theCount{0};
 std::atomic_int IOTask::theCount{0};
+std::atomic_bool IOCore::theIsUringEnabled{true};
+
+static thread_local IOCore *theCurrentCore = nullptr;
+
+static uint64_t
+ioNowMs()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000 + t.tv_nsec / 1'000'000;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static constexpr size_t theFrameSizeStep = 64;
+static constexpr size_t theFrameClassCount = 16;
+// Beyond that the frames are given back to malloc. Otherwise a thread which only frees
+// the frames allocated elsewhere would grow its cache without bounds.
+static constexpr uint32_t theFrameCacheMaxCount = 256;
+// Free receive buffers kept by a core, 4MB. The rest go back to malloc after a burst.
+static constexpr uint32_t theBufferCacheMaxCount = 1024;
+
+std::atomic_uint64_t IOCoroutineFramePool::theHitCount{0};
+std::atomic_uint64_t IOCoroutineFramePool::theMissCount{0};
+std::atomic_uint64_t IOBufferPool::theHitCount{0};
+std::atomic_uint64_t IOBufferPool::theMissCount{0};
+
+struct IOCoroutineFrame
+{
+	IOCoroutineFrame *myNext;
+};
+
+struct IOCoroutineFrameCache
+{
+	~IOCoroutineFrameCache();
+
+	IOCoroutineFrame *myHeads[theFrameClassCount] = {};
+	uint32_t myCounts[theFrameClassCount] = {};
+};
+
+static thread_local IOCoroutineFrameCache theFrameCache;
+// Trivial, so it is valid even after the cache is destroyed at the thread's exit.
+static thread_local bool theFrameCacheIsGone = false;
+
+IOCoroutineFrameCache::~IOCoroutineFrameCache()
+{
+	theFrameCacheIsGone = true;
+	for (IOCoroutineFrame *&head : myHeads)
+	{
+		while (head != nullptr)
+		{
+			IOCoroutineFrame *next = head->myNext;
+			::operator delete(head);
+			head = next;
+		}
+	}
+}
+
+static inline size_t
+frameClass(
+	size_t size)
+{
+	return (size + theFrameSizeStep - 1) / theFrameSizeStep - 1;
+}
+
+void *
+IOCoroutineFramePool::allocate(
+	size_t size)
+{
+	size_t cls = frameClass(size);
+	if (cls >= theFrameClassCount || theFrameCacheIsGone)
+		return ::operator new(size);
+	IOCoroutineFrame *&head = theFrameCache.myHeads[cls];
+	if (head == nullptr)
+	{
+		theMissCount.fetch_add(1, std::memory_order_relaxed);
+		return ::operator new((cls + 1) * theFrameSizeStep);
+	}
+	theHitCount.fetch_add(1, std::memory_order_relaxed);
+	IOCoroutineFrame *res = head;
+	head = res->myNext;
+	--theFrameCache.myCounts[cls];
+	return res;
+}
+
+void
+IOCoroutineFramePool::deallocate(
+	void *ptr,
+	size_t size)
+{
+	size_t cls = frameClass(size);
+	if (cls >= theFrameClassCount || theFrameCacheIsGone ||
+		theFrameCache.myCounts[cls] >= theFrameCacheMaxCount)
+	{
+		::operator delete(ptr);
+		return;
+	}
+	IOCoroutineFrame *frame = (IOCoroutineFrame *)ptr;
+	frame->myNext = theFrameCache.myHeads[cls];
+	theFrameCache.myHeads[cls] = frame;
+	++theFrameCache.myCounts[cls];
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+IOBufferPool::~IOBufferPool()
+{
+	assert(myUsedCount == 0);
+	while (myFree != nullptr)
+	{
+		Node *next = myFree->myNext;
+		::operator delete(myFree);
+		myFree = next;
+	}
+}
+
+uint8_t *
+IOBufferPool::take()
+{
+	++myUsedCount;
+	if (myFree == nullptr)
+	{
+		theMissCount.fetch_add(1, std::memory_order_relaxed);
+		return (uint8_t *)::operator new(theIOBufferSize);
+	}
+	theHitCount.fetch_add(1, std::memory_order_relaxed);
+	Node *res = myFree;
+	myFree = res->myNext;
+	--myFreeCount;
+	return (uint8_t *)res;
+}
+
+void
+IOBufferPool::put(
+	uint8_t *data)
+{
+	assert(myUsedCount > 0);
+	--myUsedCount;
+	if (myFreeCount >= theBufferCacheMaxCount)
+	{
+		::operator delete(data);
+		return;
+	}
+	Node *node = (Node *)data;
+	node->myNext = myFree;
+	myFree = node;
+	++myFreeCount;
+}
+
+IOBuffer&
+IOBuffer::operator=(
+	IOBuffer &&other) noexcept
+{
+	if (this != &other)
+	{
+		reset();
+		myPool = std::exchange(other.myPool, nullptr);
+		myData = std::exchange(other.myData, nullptr);
+		mySize = std::exchange(other.mySize, 0);
+	}
+	return *this;
+}
+
+void
+IOBuffer::reset()
+{
+	if (myData == nullptr)
+		return;
+	myPool->put(myData);
+	myPool = nullptr;
+	myData = nullptr;
+	mySize = 0;
+}
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-AsyncOperation::AsyncOperation(IOTask *sub)
+AsyncOperation::AsyncOperation(
+	IOTask *sub,
+	uint32_t timeout)
 	: myTask(sub)
+	, myTimeout(timeout)
 {
 }
 
@@ -24,16 +213,36 @@ AsyncOperation::await_suspend(
 	assert(myTask->myAsyncOp == nullptr);
 	myCoro = coro;
 	myTask->myAsyncOp = this;
+	if (myTimeout != theIOTimeoutInfinite)
+		myTask->myCore.timerAdd(this, myTimeout);
 	return true;
 }
 
+void
+AsyncOperation::onTimeout()
+{
+	assert(myTask->myAsyncOp == this);
+	myTask->myAsyncOp = nullptr;
+	onCancel();
+	errno = ETIMEDOUT;
+	myCoro.resume();
+}
+
+void
+AsyncOperation::resume()
+{
+	myTask->myCore.timerRemove(this);
+	myCoro.resume();
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 AsyncRecv::AsyncRecv(
 	IOTask *sub,
 	void *data,
-	size_t size)
-	: AsyncOperation(sub)
+	size_t size,
+	uint32_t timeout)
+	: AsyncOperation(sub, timeout)
 	, myData(data)
 	, mySize(size)
 	, myRes(-1)
@@ -48,7 +257,13 @@ AsyncRecv::execute()
 		return;
 	myRes = recv(myTask->myFd, myData, mySize, 0);
 	if (myRes >= 0)
+	{
+		// Got less than asked - the socket is drained. Then the next recv would fail
+		// anyway, better wait for the next edge right away.
+		if (myRes > 0 && (size_t)myRes < mySize)
+			myTask->myEventsReady &= ~IO_EVENT_READ;
 		return;
+	}
 	assert(errno == EWOULDBLOCK);
 	// The event is consumed, no more data to read. Wait for a new event.
 	myTask->myEventsReady &= ~IO_EVENT_READ;
@@ -62,8 +277,8 @@ AsyncRecv::onIOEvent()
 		if (myTask->myState == IO_TASK_STATE_DELETING)
 		{
 			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
+			onCancel();
+			resume();
 			return true;
 		}
 		return false;
@@ -72,7 +287,65 @@ AsyncRecv::onIOEvent()
 	// Could be a spurious wakeup.
 	if (myRes < 0)
 		return false;
-	myCoro.resume();
+	resume();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncRecvBuffer::AsyncRecvBuffer(
+	IOTask *sub,
+	IOBuffer &buf,
+	uint32_t timeout)
+	: AsyncOperation(sub, timeout)
+	, myBuf(buf)
+	, myRes(-1)
+{
+	myBuf.reset();
+	execute();
+}
+
+void
+AsyncRecvBuffer::execute()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+		return;
+	IOBufferPool &pool = myTask->myCore.myBufferPool;
+	uint8_t *data = pool.take();
+	myRes = recv(myTask->myFd, data, theIOBufferSize, 0);
+	if (myRes > 0)
+	{
+		if ((size_t)myRes < theIOBufferSize)
+			myTask->myEventsReady &= ~IO_EVENT_READ;
+		myBuf.myPool = &pool;
+		myBuf.myData = data;
+		myBuf.mySize = myRes;
+		return;
+	}
+	pool.put(data);
+	if (myRes == 0)
+		return;
+	assert(errno == EWOULDBLOCK);
+	myTask->myEventsReady &= ~IO_EVENT_READ;
+}
+
+bool
+AsyncRecvBuffer::onIOEvent()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+	{
+		if (myTask->myState == IO_TASK_STATE_DELETING)
+		{
+			onCancel();
+			resume();
+			return true;
+		}
+		return false;
+	}
+	execute();
+	if (myRes < 0)
+		return false;
+	resume();
 	return true;
 }
 
@@ -81,8 +354,9 @@ AsyncRecv::onIOEvent()
 AsyncSend::AsyncSend(
 	IOTask *sub,
 	const void *data,
-	size_t size)
-	: AsyncOperation(sub)
+	size_t size,
+	uint32_t timeout)
+	: AsyncOperation(sub, timeout)
 	, myData(data)
 	, mySize(size)
 	, myRes(-1)
@@ -97,7 +371,12 @@ AsyncSend::execute()
 		return;
 	myRes = send(myTask->myFd, myData, mySize, 0);
 	if (myRes >= 0)
+	{
+		// Sent less than asked - the buffer is full. The next send would fail too.
+		if ((size_t)myRes < mySize)
+			myTask->myEventsReady &= ~IO_EVENT_WRITE;
 		return;
+	}
 	assert(errno == EWOULDBLOCK);
 	// Can't write anymore. Need to wait for a new write-event.
 	myTask->myEventsReady &= ~IO_EVENT_WRITE;
@@ -111,8 +390,8 @@ AsyncSend::onIOEvent()
 		if (myTask->myState == IO_TASK_STATE_DELETING)
 		{
 			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
+			onCancel();
+			resume();
 			return true;
 		}
 		return false;
@@ -121,7 +400,7 @@ AsyncSend::onIOEvent()
 	// Could be a spurious wakeup.
 	if (myRes < 0)
 		return false;
-	myCoro.resume();
+	resume();
 	return true;
 }
 
@@ -130,8 +409,9 @@ AsyncSend::onIOEvent()
 AsyncAccept::AsyncAccept(
 	IOTask *sub,
 	sockaddr *addr,
-	socklen_t *size)
-	: AsyncOperation(sub)
+	socklen_t *size,
+	uint32_t timeout)
+	: AsyncOperation(sub, timeout)
 	, myAddr(addr)
 	, mySize(size)
 	, myRes(-1)
@@ -160,8 +440,8 @@ AsyncAccept::onIOEvent()
 		if (myTask->myState == IO_TASK_STATE_DELETING)
 		{
 			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
+			onCancel();
+			resume();
 			return true;
 		}
 		return false;
@@ -170,7 +450,68 @@ AsyncAccept::onIOEvent()
 	// Could be a spurious wakeup.
 	if (myRes < 0)
 		return false;
-	myCoro.resume();
+	resume();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncAcceptBatch::AsyncAcceptBatch(
+	IOTask *sub,
+	int *socks,
+	uint32_t count,
+	uint32_t timeout)
+	: AsyncOperation(sub, timeout)
+	, mySocks(socks)
+	, myCount(count)
+	, myRes(0)
+{
+	assert(count > 0);
+	execute();
+}
+
+void
+AsyncAcceptBatch::execute()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+		return;
+	while ((uint32_t)myRes < myCount)
+	{
+		int sock = accept4(myTask->myFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock >= 0)
+		{
+			mySocks[myRes++] = sock;
+			continue;
+		}
+		// The client has gone before it was accepted.
+		if (errno == ECONNABORTED)
+			continue;
+		assert(errno == EWOULDBLOCK);
+		// The backlog is drained. Need to wait for a new read-event.
+		myTask->myEventsReady &= ~IO_EVENT_READ;
+		return;
+	}
+}
+
+bool
+AsyncAcceptBatch::onIOEvent()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+	{
+		if (myTask->myState == IO_TASK_STATE_DELETING)
+		{
+			// Cancellation.
+			onCancel();
+			resume();
+			return true;
+		}
+		return false;
+	}
+	execute();
+	// Could be a spurious wakeup.
+	if (myRes == 0)
+		return false;
+	resume();
 	return true;
 }
 
@@ -179,8 +520,9 @@ AsyncAccept::onIOEvent()
 AsyncConnect::AsyncConnect(
 	IOTask *sub,
 	const sockaddr *addr,
-	socklen_t size)
-	: AsyncOperation(sub)
+	socklen_t size,
+	uint32_t timeout)
+	: AsyncOperation(sub, timeout)
 	, myIsDone(false)
 	, myRes(-1)
 {
@@ -206,19 +548,409 @@ AsyncConnect::onIOEvent()
 		if (myTask->myState == IO_TASK_STATE_DELETING)
 		{
 			// Cancellation.
-			myIsDone = true;
-			myRes = -1;
-			myCoro.resume();
+			onCancel();
+			resume();
 			return true;
 		}
 		return false;
 	}
 	myIsDone = true;
 	myRes = 0;
-	myCoro.resume();
+	resume();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+bool
+AsyncSchedule::await_ready() const noexcept
+{
+	return IOCore::current() == &myCore;
+}
+
+void
+AsyncSchedule::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	myCoro = coro;
+	myCore.post(this);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void
+AsyncSleep::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	myCoro = coro;
+	myCore.timerAdd(this, myTimeout);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Submission and completion rings of io_uring, used directly via the syscalls. Each core
+// has its own ring and is the only one using it, so no locks. The submissions are
+// collected and given to the kernel once per roll.
+//
+class IOUring
+{
+public:
+	~IOUring();
+
+	// Nullptr if the kernel doesn't have io_uring, or it is forbidden.
+	static IOUring *
+	create(
+		IOCore &core);
+
+	void
+	submit(
+		AsyncFileOperation *op);
+
+	// Give all the new submissions to the kernel.
+	void
+	flush();
+
+	// Resume the coroutines of all the done operations.
+	void
+	reap();
+
+private:
+	IOUring(
+		IOCore &core) : myCore(core) {}
+
+	bool
+	priv_push(
+		AsyncFileOperation *op);
+
+	IOCore &myCore;
+	int myFd = -1;
+	uint32_t myEntryCount = 0;
+	uint32_t myCompleteCount = 0;
+	void *mySubmitRing = MAP_FAILED;
+	size_t mySubmitRingSize = 0;
+	void *myCompleteRing = MAP_FAILED;
+	size_t myCompleteRingSize = 0;
+	io_uring_sqe *mySubmitEntries = (io_uring_sqe *)MAP_FAILED;
+	unsigned *mySubmitHead = nullptr;
+	unsigned *mySubmitTail = nullptr;
+	unsigned mySubmitMask = 0;
+	unsigned *mySubmitArray = nullptr;
+	unsigned *myCompleteHead = nullptr;
+	unsigned *myCompleteTail = nullptr;
+	unsigned myCompleteMask = 0;
+	io_uring_cqe *myCompleteEntries = nullptr;
+	// Pushed, but not given to the kernel yet.
+	uint32_t myToSubmitCount = 0;
+	// Given to the kernel, not completed yet. Never more than the completion ring, so it
+	// can't overflow.
+	uint32_t myInFlightCount = 0;
+	// The operations which didn't fit, in FIFO order.
+	AsyncFileOperation *myBacklogHead = nullptr;
+	AsyncFileOperation *myBacklogTail = nullptr;
+};
+
+IOUring::~IOUring()
+{
+	assert(myInFlightCount == 0 && myToSubmitCount == 0);
+	assert(myBacklogHead == nullptr);
+	if (mySubmitEntries != MAP_FAILED)
+		munmap(mySubmitEntries, myEntryCount * sizeof(io_uring_sqe));
+	if (myCompleteRing != MAP_FAILED && myCompleteRing != mySubmitRing)
+		munmap(myCompleteRing, myCompleteRingSize);
+	if (mySubmitRing != MAP_FAILED)
+		munmap(mySubmitRing, mySubmitRingSize);
+	if (myFd >= 0)
+		close(myFd);
+}
+
+IOUring *
+IOUring::create(
+	IOCore &core)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, theUringSize, &params);
+	if (fd < 0)
+	{
+		LOG_DEBUG("io_uring is not available: " << strerror(errno));
+		return nullptr;
+	}
+	std::unique_ptr<IOUring> res(new IOUring(core));
+	res->myFd = fd;
+	res->myEntryCount = params.sq_entries;
+	res->myCompleteCount = params.cq_entries;
+	res->mySubmitRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	res->myCompleteRingSize = params.cq_off.cqes +
+		params.cq_entries * sizeof(io_uring_cqe);
+	bool isSingleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (isSingleMap)
+	{
+		res->mySubmitRingSize = std::max(res->mySubmitRingSize, res->myCompleteRingSize);
+		res->myCompleteRingSize = res->mySubmitRingSize;
+	}
+	res->mySubmitRing = mmap(nullptr, res->mySubmitRingSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (res->mySubmitRing == MAP_FAILED)
+		return nullptr;
+	if (isSingleMap)
+	{
+		res->myCompleteRing = res->mySubmitRing;
+	}
+	else
+	{
+		res->myCompleteRing = mmap(nullptr, res->myCompleteRingSize,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (res->myCompleteRing == MAP_FAILED)
+			return nullptr;
+	}
+	res->mySubmitEntries = (io_uring_sqe *)mmap(nullptr,
+		params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (res->mySubmitEntries == MAP_FAILED)
+		return nullptr;
+	char *sq = (char *)res->mySubmitRing;
+	res->mySubmitHead = (unsigned *)(sq + params.sq_off.head);
+	res->mySubmitTail = (unsigned *)(sq + params.sq_off.tail);
+	res->mySubmitMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	res->mySubmitArray = (unsigned *)(sq + params.sq_off.array);
+	char *cq = (char *)res->myCompleteRing;
+	res->myCompleteHead = (unsigned *)(cq + params.cq_off.head);
+	res->myCompleteTail = (unsigned *)(cq + params.cq_off.tail);
+	res->myCompleteMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	res->myCompleteEntries = (io_uring_cqe *)(cq + params.cq_off.cqes);
+	// The completions wake the core up like any other event.
+	int eventFd = core.myEventFd;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &eventFd, 1) != 0)
+	{
+		LOG_DEBUG("io_uring eventfd failed: " << strerror(errno));
+		return nullptr;
+	}
+	return res.release();
+}
+
+void
+IOUring::submit(
+	AsyncFileOperation *op)
+{
+	if (myBacklogHead == nullptr && priv_push(op))
+		return;
+	op->myNext = nullptr;
+	if (myBacklogTail == nullptr)
+		myBacklogHead = op;
+	else
+		myBacklogTail->myNext = op;
+	myBacklogTail = op;
+}
+
+bool
+IOUring::priv_push(
+	AsyncFileOperation *op)
+{
+	if (myInFlightCount + myToSubmitCount >= myCompleteCount)
+		return false;
+	if (myToSubmitCount == myEntryCount)
+		flush();
+	// The tail is changed only by this thread, the head - by the kernel.
+	unsigned tail = *mySubmitTail;
+	unsigned idx = tail & mySubmitMask;
+	io_uring_sqe *sqe = &mySubmitEntries[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op->myIsWrite ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = op->myFd;
+	sqe->addr = (uint64_t)&op->myVec;
+	sqe->len = 1;
+	sqe->off = op->myOffset;
+	sqe->user_data = (uint64_t)op;
+	mySubmitArray[idx] = idx;
+	__atomic_store_n(mySubmitTail, tail + 1, __ATOMIC_RELEASE);
+	++myToSubmitCount;
 	return true;
 }
 
+void
+IOUring::flush()
+{
+	while (myToSubmitCount > 0)
+	{
+		int rc = syscall(__NR_io_uring_enter, myFd, myToSubmitCount, 0, 0, nullptr, 0);
+		if (rc < 0)
+		{
+			// Out of memory in the kernel for now. Will try in the next roll.
+			assert(errno == EAGAIN || errno == EBUSY || errno == EINTR);
+			return;
+		}
+		myToSubmitCount -= rc;
+		myInFlightCount += rc;
+	}
+}
+
+void
+IOUring::reap()
+{
+	// The head is changed only by this thread, the tail - by the kernel.
+	unsigned head = *myCompleteHead;
+	while (true)
+	{
+		if (head == __atomic_load_n(myCompleteTail, __ATOMIC_ACQUIRE))
+			return;
+		io_uring_cqe *cqe = &myCompleteEntries[head & myCompleteMask];
+		AsyncFileOperation *op = (AsyncFileOperation *)cqe->user_data;
+		op->myRes = cqe->res;
+		__atomic_store_n(myCompleteHead, ++head, __ATOMIC_RELEASE);
+		--myInFlightCount;
+		while (myBacklogHead != nullptr && priv_push(myBacklogHead))
+		{
+			myBacklogHead = myBacklogHead->myNext;
+			if (myBacklogHead == nullptr)
+				myBacklogTail = nullptr;
+		}
+		// Can submit new operations.
+		--myCore.myFileOpCount;
+		op->myCoro.resume();
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// The threads doing the file IO for the cores which don't have io_uring. Shared by all
+// the cores. The done operations are given back to their cores.
+//
+class IOFilePool
+{
+public:
+	static IOFilePool &
+	instance();
+
+	~IOFilePool();
+
+	void
+	submit(
+		AsyncFileOperation *op);
+
+private:
+	IOFilePool();
+
+	void
+	priv_worker_f();
+
+	std::mutex myMutex;
+	std::condition_variable myCond;
+	AsyncFileOperation *myHead;
+	AsyncFileOperation *myTail;
+	bool myIsStopped;
+	std::vector<std::thread> myThreads;
+};
+
+IOFilePool &
+IOFilePool::instance()
+{
+	static IOFilePool thePool;
+	return thePool;
+}
+
+IOFilePool::IOFilePool()
+	: myHead(nullptr)
+	, myTail(nullptr)
+	, myIsStopped(false)
+{
+	for (uint32_t i = 0; i < theFilePoolThreadCount; ++i)
+		myThreads.emplace_back([this]() { priv_worker_f(); });
+}
+
+IOFilePool::~IOFilePool()
+{
+	{
+		std::unique_lock lock(myMutex);
+		myIsStopped = true;
+		myCond.notify_all();
+	}
+	for (std::thread &t : myThreads)
+		t.join();
+	assert(myHead == nullptr);
+}
+
+void
+IOFilePool::submit(
+	AsyncFileOperation *op)
+{
+	std::unique_lock lock(myMutex);
+	op->myNext = nullptr;
+	if (myTail == nullptr)
+		myHead = op;
+	else
+		myTail->myNext = op;
+	myTail = op;
+	myCond.notify_one();
+}
+
+void
+IOFilePool::priv_worker_f()
+{
+	std::unique_lock lock(myMutex);
+	while (true)
+	{
+		if (myHead == nullptr)
+		{
+			if (myIsStopped)
+				return;
+			myCond.wait(lock);
+			continue;
+		}
+		AsyncFileOperation *op = myHead;
+		myHead = op->myNext;
+		if (myHead == nullptr)
+			myTail = nullptr;
+		lock.unlock();
+		ssize_t rc;
+		if (op->myIsWrite)
+			rc = pwritev(op->myFd, &op->myVec, 1, op->myOffset);
+		else
+			rc = preadv(op->myFd, &op->myVec, 1, op->myOffset);
+		op->myRes = rc >= 0 ? rc : -errno;
+		IOCore &core = op->myCore;
+		// The op can be freed right after it is given to the core.
+		core.fileComplete(op);
+		core.myFilePoolUseCount.fetch_sub(1);
+		lock.lock();
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncFileOperation::AsyncFileOperation(
+	IOCore &core,
+	int fd,
+	void *data,
+	size_t size,
+	off_t offset,
+	bool isWrite)
+	: myCore(core)
+	, myFd(fd)
+	, myVec({data, size})
+	, myOffset(offset)
+	, myIsWrite(isWrite)
+	, myRes(-1)
+	, myNext(nullptr)
+{
+}
+
+void
+AsyncFileOperation::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	myCoro = coro;
+	myCore.fileSubmit(this);
+}
+
+ssize_t
+AsyncFileOperation::await_resume()
+{
+	if (myRes >= 0)
+		return myRes;
+	errno = -myRes;
+	return -1;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 IOTask::IOTask(
@@ -230,6 +962,8 @@ IOTask::IOTask(
 	, myEventsReady(0)
 	, myAsyncOp(nullptr)
 	, myCore(core)
+	, myNextNew(nullptr)
+	, myNextClosed(nullptr)
 {
 	LOG_DEBUG("IOTask create");
 	theCount.fetch_add(1, std::memory_order_relaxed);
@@ -256,9 +990,15 @@ IOTask::close()
 
 IOCore::IOCore()
 	: myFd(epoll_create1(0))
+	, myEvents(theEpollBatchSizeMin)
+	, myUring(nullptr)
+	, myIsUringChecked(false)
+	, myFileOpCount(0)
+	, myFilePoolUseCount(0)
 {
 	LOG_DEBUG("IOCore create");
 	myIsStopped = false;
+	myIsWakeupPending = false;
 	// Eventfd is used to wakeup from epoll_wait() for handling non-kernel events. For
 	// example, to let IOCore know, that there are new or deleting tasks to process.
 	myEventFd = eventfd(0, EFD_NONBLOCK);
@@ -268,12 +1008,22 @@ IOCore::IOCore()
 IOCore::~IOCore()
 {
 	LOG_DEBUG("IOCore destroy");
+	// The file operations can't be canceled, they must be done before that.
+	assert(myFileOpCount == 0);
+	while (myFilePoolUseCount.load() != 0)
+		std::this_thread::yield();
+	delete myUring;
 	unsubscribe(myEventSub);
 	myEventSub = nullptr;
 	myEventFd = -1;
 	processQueues();
 	assert(myTasks.empty());
-	assert(myQueue.empty());
+	// The sleeping coroutines must be done before the core is destroyed.
+	assert(myTimers.empty());
+	assert(myNewQueue.isEmpty());
+	assert(myClosedQueue.isEmpty());
+	assert(myPostQueue.isEmpty());
+	assert(myFileDoneQueue.isEmpty());
 	assert(myFd >= 0);
 	int rc = close(myFd);
 	assert(rc == 0);
@@ -282,6 +1032,8 @@ IOCore::~IOCore()
 void
 IOCore::wakeup()
 {
+	if (myIsWakeupPending.exchange(true))
+		return;
 	uint64_t val = 1;
 	ssize_t rc = write(myEventFd, &val, sizeof(val));
 	assert(rc == sizeof(val));
@@ -291,14 +1043,8 @@ IOTask *
 IOCore::subscribe(
 	int fd)
 {
-	std::unique_lock lock(myMutex);
-	for (IOTask *s : myTasks)
-		assert(s->myFd != fd);
-	for (IOTask *s : myQueue)
-		assert(s->myFd != fd);
 	IOTask *s = new IOTask(*this, fd);
-	myQueue.push_back(s);
-	mySize.fetch_add(1, std::memory_order_relaxed);
+	myNewQueue.push(s);
 	wakeup();
 	return s;
 }
@@ -307,30 +1053,40 @@ void
 IOCore::unsubscribe(
 	IOTask *s)
 {
-	std::unique_lock lock(myMutex);
-	for (IOTask *is : myQueue)
-		assert(is != s);
-	assert(myTasks[s->myIdx] == s);
-	assert(s->myState == IO_TASK_STATE_WORKING);
-	s->myState = IO_TASK_STATE_DELETING;
-	myQueue.push_back(s);
-	mySize.fetch_add(1, std::memory_order_relaxed);
+	// The state is changed by the core's thread, when it takes the task.
+	myClosedQueue.push(s);
+	wakeup();
+}
+
+IOCore *
+IOCore::current()
+{
+	return theCurrentCore;
+}
+
+void
+IOCore::post(
+	AsyncSchedule *op)
+{
+	myPostQueue.push(op);
 	wakeup();
 }
 
 void
 IOCore::roll()
 {
+	theCurrentCore = this;
 	processQueues();
-	epoll_event evs[theEpollBatchSize];
-	int rc = epoll_wait(myFd, evs, theEpollBatchSize, -1);
+	if (myUring != nullptr)
+		myUring->flush();
+	int rc = epoll_wait(myFd, myEvents.data(), myEvents.size(), timerWaitTimeout());
 	if (rc < 0 && errno == EINTR)
 		return;
 	assert(rc >= 0);
 	LOG_THIS_DEBUG(IOCore, roll, rc << " events");
 	for (int i = 0; i < rc; ++i)
 	{
-		epoll_event& ev = evs[i];
+		epoll_event& ev = myEvents[i];
 		IOTask *s = (IOTask *)ev.data.ptr;
 		int mask = 0;
 		if ((ev.events & EPOLLIN) != 0)
@@ -365,60 +1121,261 @@ IOCore::roll()
 				s->myAsyncOp = op;
 		}
 	}
+	// The buffer is full - there could be more events. Take more at once next time.
+	if ((size_t)rc == myEvents.size() && myEvents.size() < theEpollBatchSizeMax)
+		myEvents.resize(myEvents.size() * 2);
+	if (myUring != nullptr)
+		myUring->reap();
+	processTimers();
 }
 
 void
 IOCore::processQueues()
 {
-	if (mySize.load(std::memory_order_relaxed) == 0)
+	// Every push sets the flag, so without it the queues are empty. Any push after the
+	// reset wakes the core up again.
+	if (!myIsWakeupPending.load(std::memory_order_relaxed))
 		return;
-	std::unique_lock lock(myMutex);
-	if (myQueue.empty())
-		return;
-	for (IOTask *s : myQueue)
+	myIsWakeupPending.store(false);
+	// The closed ones are taken first. Then all of them are surely already taken from
+	// the new ones, even if they were closed right after the subscription.
+	IOTask *closed = myClosedQueue.popAll();
+	for (IOTask *s = myNewQueue.popAll(); s != nullptr;)
 	{
-		if (s->myState == IO_TASK_STATE_NEW)
-		{
-			LOG_THIS_DEBUG(IOCore, processQueues, "add " << s);
-			s->myState = IO_TASK_STATE_WORKING;
-			// Assume that in a new socket all the events are there. The task will clear
-			// those which are not really available yet.
-			s->myEventsReady = IO_EVENT_READ | IO_EVENT_WRITE;
-			s->myIdx = myTasks.size();
-			epoll_event ev;
-			memset(&ev, 0, sizeof(ev));
-			ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-			ev.data.ptr = (void *)s;
-			int rc = epoll_ctl(myFd, EPOLL_CTL_ADD, s->myFd, &ev);
-			assert(rc == 0);
-			myTasks.push_back(s);
-		}
-		else if (s->myState == IO_TASK_STATE_DELETING)
+		IOTask *next = s->myNextNew;
+		assert(s->myState == IO_TASK_STATE_NEW);
+		LOG_THIS_DEBUG(IOCore, processQueues, "add " << s);
+		s->myState = IO_TASK_STATE_WORKING;
+		// Assume that in a new socket all the events are there. The task will clear
+		// those which are not really available yet.
+		s->myEventsReady = IO_EVENT_READ | IO_EVENT_WRITE;
+		s->myIdx = myTasks.size();
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		// Registered once for both directions and never changed. The readiness is
+		// tracked in the task, so the operations don't do any epoll_ctl.
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.ptr = (void *)s;
+		int rc = epoll_ctl(myFd, EPOLL_CTL_ADD, s->myFd, &ev);
+		assert(rc == 0);
+		myTasks.push_back(s);
+		s = next;
+	}
+	while (closed != nullptr)
+	{
+		IOTask *s = closed;
+		closed = s->myNextClosed;
+		assert(s->myState == IO_TASK_STATE_WORKING);
+		assert(myTasks.size() > (size_t)s->myIdx);
+		assert(myTasks[s->myIdx] == s);
+		assert(s->myFd >= 0);
+		LOG_THIS_DEBUG(IOCore, processQueues, "drop " << s);
+		s->myState = IO_TASK_STATE_DELETING;
+		// Cyclic deletion, for O(1).
+		myTasks.back()->myIdx = s->myIdx;
+		myTasks[s->myIdx] = myTasks.back();
+		myTasks.pop_back();
+		// No EPOLL_CTL_DEL. The fd is never duplicated, so its close below removes it
+		// from the epoll. And the events are not handled now, so none of them can
+		// refer to the deleted task.
+		if (s->myAsyncOp != nullptr)
 		{
-			assert(myTasks.size() > s->myIdx);
-			assert(myTasks[s->myIdx] == s);
-			assert(s->myFd >= 0);
-			LOG_THIS_DEBUG(IOCore, processQueues, "drop " << s);
-			// Cyclic deletion, for O(1).
-			myTasks.back()->myIdx = s->myIdx;
-			myTasks[s->myIdx] = myTasks.back();
-			int rc = epoll_ctl(myFd, EPOLL_CTL_DEL, s->myFd, nullptr);
-			assert(rc == 0);
-			if (s->myAsyncOp != nullptr)
-			{
-				LOG_THIS_DEBUG(IOCore, processQueues, "cancel " << s);
-				s->myEventsReady = 0;
-				s->myAsyncOp->onIOEvent();
-				s->myAsyncOp = nullptr;
-			}
-			delete s;
-			myTasks.resize(myTasks.size() - 1);
+			LOG_THIS_DEBUG(IOCore, processQueues, "cancel " << s);
+			s->myEventsReady = 0;
+			s->myAsyncOp->onIOEvent();
+			s->myAsyncOp = nullptr;
 		}
-		else
+		delete s;
+	}
+	// The new tasks are added first, so the posted coroutines can use them.
+	for (AsyncSchedule *op = myPostQueue.popAll(); op != nullptr;)
+	{
+		// The coroutine can end and free the node.
+		AsyncSchedule *next = op->myNext;
+		op->myCoro.resume();
+		op = next;
+	}
+	for (AsyncFileOperation *op = myFileDoneQueue.popAll(); op != nullptr;)
+	{
+		AsyncFileOperation *next = op->myNext;
+		--myFileOpCount;
+		op->myCoro.resume();
+		op = next;
+	}
+}
+
+void
+IOCore::fileSubmit(
+	AsyncFileOperation *op)
+{
+	assert(current() == this);
+	if (!myIsUringChecked)
+	{
+		myIsUringChecked = true;
+		if (theIsUringEnabled.load(std::memory_order_relaxed))
+			myUring = IOUring::create(*this);
+	}
+	++myFileOpCount;
+	if (myUring != nullptr)
+		myUring->submit(op);
+	else
+	{
+		myFilePoolUseCount.fetch_add(1);
+		IOFilePool::instance().submit(op);
+	}
+}
+
+void
+IOCore::fileComplete(
+	AsyncFileOperation *op)
+{
+	myFileDoneQueue.push(op);
+	wakeup();
+}
+
+void
+IOCore::timerAdd(
+	IOTimer *t,
+	uint32_t ms)
+{
+	assert(current() == this);
+	assert(t->myIdx < 0);
+	t->myDeadline = ioNowMs() + ms;
+	t->myIdx = myTimers.size();
+	myTimers.push_back(t);
+	timerSiftUp(t->myIdx);
+}
+
+void
+IOCore::timerRemove(
+	IOTimer *t)
+{
+	if (t->myIdx < 0)
+		return;
+	size_t idx = t->myIdx;
+	assert(myTimers[idx] == t);
+	t->myIdx = -1;
+	IOTimer *last = myTimers.back();
+	myTimers.pop_back();
+	if (last == t)
+		return;
+	// The last one takes the hole and goes either up or down.
+	myTimers[idx] = last;
+	last->myIdx = idx;
+	timerSiftUp(idx);
+	timerSiftDown(last->myIdx);
+}
+
+void
+IOCore::timerSiftUp(
+	size_t idx)
+{
+	IOTimer *t = myTimers[idx];
+	while (idx > 0)
+	{
+		size_t parentIdx = (idx - 1) / 2;
+		IOTimer *parent = myTimers[parentIdx];
+		if (parent->myDeadline <= t->myDeadline)
+			break;
+		myTimers[idx] = parent;
+		parent->myIdx = idx;
+		idx = parentIdx;
+	}
+	myTimers[idx] = t;
+	t->myIdx = idx;
+}
+
+void
+IOCore::timerSiftDown(
+	size_t idx)
+{
+	IOTimer *t = myTimers[idx];
+	size_t count = myTimers.size();
+	while (true)
+	{
+		size_t childIdx = idx * 2 + 1;
+		if (childIdx >= count)
+			break;
+		if (childIdx + 1 < count &&
+			myTimers[childIdx + 1]->myDeadline < myTimers[childIdx]->myDeadline)
 		{
-			assert(false);
+			++childIdx;
 		}
+		IOTimer *child = myTimers[childIdx];
+		if (t->myDeadline <= child->myDeadline)
+			break;
+		myTimers[idx] = child;
+		child->myIdx = idx;
+		idx = childIdx;
+	}
+	myTimers[idx] = t;
+	t->myIdx = idx;
+}
+
+int
+IOCore::timerWaitTimeout() const
+{
+	if (myTimers.empty())
+		return -1;
+	uint64_t now = ioNowMs();
+	uint64_t deadline = myTimers.front()->myDeadline;
+	if (deadline <= now)
+		return 0;
+	return std::min<uint64_t>(deadline - now, INT32_MAX);
+}
+
+void
+IOCore::processTimers()
+{
+	if (myTimers.empty())
+		return;
+	uint64_t now = ioNowMs();
+	while (!myTimers.empty())
+	{
+		IOTimer *t = myTimers.front();
+		if (t->myDeadline > now)
+			break;
+		timerRemove(t);
+		// Can add new timers, and the timer itself can be freed.
+		t->onTimeout();
 	}
-	myQueue.clear();
-	mySize.store(myTasks.size(), std::memory_order_relaxed);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+IOCoreGroup::IOCoreGroup(
+	uint32_t count)
+{
+	assert(count > 0);
+	myCores.reserve(count);
+	for (uint32_t i = 0; i < count; ++i)
+		myCores.push_back(std::make_unique<IOCore>());
+}
+
+IOCoreGroup::~IOCoreGroup()
+{
+	stop();
+}
+
+void
+IOCoreGroup::start()
+{
+	assert(myThreads.empty());
+	for (std::unique_ptr<IOCore> &core : myCores)
+	{
+		myThreads.emplace_back([c = core.get()]() {
+			while (!c->isStopped())
+				c->roll();
+		});
+	}
+}
+
+void
+IOCoreGroup::stop()
+{
+	for (std::unique_ptr<IOCore> &core : myCores)
+		core->stop();
+	for (std::thread &t : myThreads)
+		t.join();
+	myThreads.clear();
 }
@@ -1,12 +1,21 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <cassert>
 #include <coroutine>
+#include <cstdint>
+#include <functional>
 #include <iostream>
-#include <mutex>
+#include <memory>
+#include <optional>
 #include <sstream>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #define MAYBE_UNUSED(...) ((void)sizeof(1, ##__VA_ARGS__))
@@ -28,8 +37,12 @@
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+struct AsyncRecvBuffer;
+class IOBufferPool;
 class IOCore;
+class IOFilePool;
 class IOTask;
+class IOUring;
 
 enum IOEventBit
 {
@@ -44,6 +57,120 @@ enum IOTaskState
 	IO_TASK_STATE_DELETING,
 };
 
+static constexpr uint32_t theIOTimeoutInfinite = UINT32_MAX;
+// Size of each buffer of the receive pools of the cores.
+static constexpr size_t theIOBufferSize = 4096;
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Intrusive multi-producer single-consumer queue. A push is one CAS and never blocks. The
+// consumer takes all the items at once.
+//
+template<typename T, T *T::*Next>
+class IOMpscQueue
+{
+public:
+	IOMpscQueue() : myHead(nullptr) {}
+
+	void
+	push(
+		T *item)
+	{
+		T *head = myHead.load(std::memory_order_relaxed);
+		do
+		{
+			item->*Next = head;
+		} while (!myHead.compare_exchange_weak(head, item));
+	}
+
+	// Take all the items, in the order of pushing.
+	T *
+	popAll()
+	{
+		T *head = myHead.exchange(nullptr);
+		T *res = nullptr;
+		while (head != nullptr)
+		{
+			T *next = head->*Next;
+			head->*Next = res;
+			res = head;
+			head = next;
+		}
+		return res;
+	}
+
+	bool
+	isEmpty() const { return myHead.load(std::memory_order_relaxed) == nullptr; }
+
+private:
+	std::atomic<T *> myHead;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Intrusive FIFO list for a single thread.
+//
+template<typename T, T *T::*Next>
+class IOList
+{
+public:
+	IOList() : myHead(nullptr), myTail(nullptr) {}
+
+	void
+	push(
+		T *item)
+	{
+		item->*Next = nullptr;
+		if (myHead == nullptr)
+			myHead = item;
+		else
+			myTail->*Next = item;
+		myTail = item;
+	}
+
+	T *
+	pop()
+	{
+		T *res = myHead;
+		if (res != nullptr && (myHead = res->*Next) == nullptr)
+			myTail = nullptr;
+		return res;
+	}
+
+	T *
+	front() const { return myHead; }
+
+	bool
+	isEmpty() const { return myHead == nullptr; }
+
+private:
+	T *myHead;
+	T *myTail;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Frames of the coroutines. Freed frames are cached per thread, in size classes, so
+// a coroutine per request or connection doesn't go to malloc in a steady state. A frame
+// can be freed in another thread than the one which allocated it, then it goes to the
+// cache of the freeing thread.
+//
+struct IOCoroutineFramePool
+{
+	static void *
+	allocate(
+		size_t size);
+
+	static void
+	deallocate(
+		void *ptr,
+		size_t size);
+
+	// The allocations served by the caches and by malloc.
+	static std::atomic_uint64_t theHitCount;
+	static std::atomic_uint64_t theMissCount;
+};
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 struct IOCoroutinePromise;
@@ -90,6 +217,16 @@ struct IOCoroutinePromise
 		theCount.fetch_sub(1, std::memory_order_relaxed);
 	}
 
+	// The whole coroutine frame is allocated by the promise's operators, if it has them.
+	static void *
+	operator new(
+		size_t size) { return IOCoroutineFramePool::allocate(size); }
+
+	static void
+	operator delete(
+		void *ptr,
+		size_t size) { IOCoroutineFramePool::deallocate(ptr, size); }
+
 	IOCoroutine
 	get_return_object() { return {IOCoroutine::from_promise(*this)}; }
 
@@ -111,10 +248,273 @@ struct IOCoroutinePromise
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-struct AsyncOperation
+// A coroutine which can return a value and be awaited by another coroutine. It is lazy,
+// starts only when awaited, and resumes the awaiting one when done. Both transitions are
+// symmetric transfers: await_suspend() returns the handle to switch to, and the compiler
+// jumps there instead of calling resume() on top of the current stack. So a deep chain
+// of nested tasks neither grows the stack nor goes through a queue of the core. The
+// frame is owned by the Task object and is freed together with it.
+//
+// The root of a chain is still an IOCoroutine, which nobody awaits.
+//
+template<typename T>
+class Task;
+
+struct TaskPromiseBase
+{
+	TaskPromiseBase() { theCount.fetch_add(1, std::memory_order_relaxed); }
+	~TaskPromiseBase() { theCount.fetch_sub(1, std::memory_order_relaxed); }
+
+	static void *
+	operator new(
+		size_t size) { return IOCoroutineFramePool::allocate(size); }
+
+	static void
+	operator delete(
+		void *ptr,
+		size_t size) { IOCoroutineFramePool::deallocate(ptr, size); }
+
+	// Switch back to the awaiting coroutine. The task's frame stays suspended at the end,
+	// its result is taken from there.
+	struct FinalAwaiter
+	{
+		bool
+		await_ready() noexcept { return false; }
+
+		template<typename P>
+		std::coroutine_handle<>
+		await_suspend(
+			std::coroutine_handle<P> coro) noexcept
+			{ return coro.promise().myContinuation; }
+
+		void
+		await_resume() noexcept {}
+	};
+
+	std::suspend_always
+	initial_suspend() noexcept { return {}; }
+
+	FinalAwaiter
+	final_suspend() noexcept { return {}; }
+
+	void
+	unhandled_exception() { abort(); }
+
+	std::coroutine_handle<> myContinuation;
+
+	static std::atomic_int theCount;
+};
+
+template<typename T>
+struct TaskPromise final : public TaskPromiseBase
+{
+	Task<T>
+	get_return_object();
+
+	template<typename U>
+	void
+	return_value(
+		U &&value) { myValue.emplace(std::forward<U>(value)); }
+
+	T
+	takeResult() { return std::move(*myValue); }
+
+	std::optional<T> myValue;
+};
+
+template<>
+struct TaskPromise<void> final : public TaskPromiseBase
+{
+	Task<void>
+	get_return_object();
+
+	void
+	return_void() {}
+
+	void
+	takeResult() {}
+};
+
+template<typename T>
+class Task
+{
+public:
+	using promise_type = TaskPromise<T>;
+	using Handle = std::coroutine_handle<promise_type>;
+
+	Task(
+		Task &&other) noexcept : myCoro(std::exchange(other.myCoro, nullptr)) {}
+	Task(
+		const Task&) = delete;
+	Task& operator=(
+		const Task&) = delete;
+	Task& operator=(
+		Task&&) = delete;
+
+	~Task()
+	{
+		if (myCoro)
+			myCoro.destroy();
+	}
+
+	// Can be awaited once. The awaiting coroutine continues in the thread where the task
+	// has finished.
+	auto
+	operator co_await() && noexcept
+	{
+		struct Awaiter
+		{
+			bool
+			await_ready() const noexcept { return myCoro.done(); }
+
+			std::coroutine_handle<>
+			await_suspend(
+				std::coroutine_handle<> coro) noexcept
+			{
+				myCoro.promise().myContinuation = coro;
+				return myCoro;
+			}
+
+			T
+			await_resume() { return myCoro.promise().takeResult(); }
+
+			Handle myCoro;
+		};
+		return Awaiter{myCoro};
+	}
+
+private:
+	Task(
+		Handle coro) : myCoro(coro) {}
+
+	Handle myCoro;
+
+	friend promise_type;
+};
+
+template<typename T>
+inline Task<T>
+TaskPromise<T>::get_return_object() { return Task<T>(Task<T>::Handle::from_promise(*this)); }
+
+inline Task<void>
+TaskPromise<void>::get_return_object()
+	{ return Task<void>(Task<void>::Handle::from_promise(*this)); }
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Node of the timer heap of a core. Used only in the core's thread.
+//
+struct IOTimer
+{
+	IOTimer() : myDeadline(0), myIdx(-1) {}
+
+	virtual void
+	onTimeout() = 0;
+
+private:
+	uint64_t myDeadline;
+	// Position in the heap, -1 when not there.
+	int myIdx;
+
+	friend IOCore;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Receive buffers of a core, all of theIOBufferSize. A socket takes one only when the data
+// has arrived, and gives it back when done with it. So the idle connections hold no
+// receive memory, and the pool grows only to the number of the sockets being handled at
+// once. The free buffers are reused in LIFO order, the most recent one is likely still in
+// the CPU cache. Used only in the core's thread.
+//
+class IOBufferPool
+{
+public:
+	IOBufferPool() : myFree(nullptr), myFreeCount(0), myUsedCount(0) {}
+	IOBufferPool(
+		const IOBufferPool&) = delete;
+	IOBufferPool& operator=(
+		const IOBufferPool&) = delete;
+	~IOBufferPool();
+
+	uint8_t *
+	take();
+
+	void
+	put(
+		uint8_t *data);
+
+	// Buffers given out and not put back yet.
+	uint32_t
+	usedCount() const { return myUsedCount; }
+
+	// The buffers served by the caches and by malloc, in all the cores.
+	static std::atomic_uint64_t theHitCount;
+	static std::atomic_uint64_t theMissCount;
+
+private:
+	struct Node
+	{
+		Node *myNext;
+	};
+
+	Node *myFree;
+	uint32_t myFreeCount;
+	uint32_t myUsedCount;
+};
+
+// The data received into a buffer of the pool by asyncRecvBuffer(). Owns the buffer, and
+// gives it back to the pool when destroyed or reset. That has to happen in the thread of
+// the core, which the coroutines of its sockets are in anyway.
+//
+class IOBuffer
+{
+public:
+	IOBuffer() : myPool(nullptr), myData(nullptr), mySize(0) {}
+	IOBuffer(
+		IOBuffer &&other) noexcept
+		: myPool(std::exchange(other.myPool, nullptr))
+		, myData(std::exchange(other.myData, nullptr))
+		, mySize(std::exchange(other.mySize, 0)) {}
+	IOBuffer(
+		const IOBuffer&) = delete;
+	IOBuffer& operator=(
+		const IOBuffer&) = delete;
+	IOBuffer& operator=(
+		IOBuffer &&other) noexcept;
+
+	~IOBuffer() { reset(); }
+
+	void
+	reset();
+
+	uint8_t *
+	data() const { return myData; }
+
+	size_t
+	size() const { return mySize; }
+
+	bool
+	isEmpty() const { return mySize == 0; }
+
+private:
+	IOBufferPool *myPool;
+	uint8_t *myData;
+	size_t mySize;
+
+	friend AsyncRecvBuffer;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// An operation with a timeout fails with -1 and errno ETIMEDOUT, if it couldn't be done in
+// time. The timeout counts only when the operation has to wait.
+//
+struct AsyncOperation : private IOTimer
 {
 	AsyncOperation(
-		IOTask *sub);
+		IOTask *sub,
+		uint32_t timeout);
 	AsyncOperation(
 		const AsyncOperation&) = delete;
 	AsyncOperation& operator=(
@@ -131,8 +531,21 @@ private:
 	virtual bool
 	onIOEvent() = 0;
 
+	// Set the result of a failed operation, when it is canceled or timed out.
+	virtual void
+	onCancel() = 0;
+
+	void
+	onTimeout() final;
+
 protected:
+	// The timer is disarmed before the resume, because the awaitable is gone together with
+	// the co_await expression.
+	void
+	resume();
+
 	IOTask *const myTask;
+	const uint32_t myTimeout;
 	std::coroutine_handle<> myCoro;
 
 	friend IOCore;
@@ -145,7 +558,8 @@ struct AsyncRecv final : public AsyncOperation
 	AsyncRecv(
 		IOTask *sub,
 		void *data,
-		size_t size);
+		size_t size,
+		uint32_t timeout);
 	AsyncRecv(
 		const AsyncRecv&) = delete;
 	AsyncRecv& operator=(
@@ -166,6 +580,9 @@ private:
 	bool
 	onIOEvent() final;
 
+	void
+	onCancel() final { myRes = -1; }
+
 	void *const myData;
 	const size_t mySize;
 	ssize_t myRes;
@@ -173,12 +590,52 @@ private:
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// Same as AsyncRecv, but into a buffer taken from the pool of the core right before the
+// recv, when the socket is readable. The buffer is given to the caller only with the data,
+// and goes back to the pool right away on EOF, error, or nothing to read. The buffer the
+// caller had before is released first.
+//
+struct AsyncRecvBuffer final : public AsyncOperation
+{
+	AsyncRecvBuffer(
+		IOTask *sub,
+		IOBuffer &buf,
+		uint32_t timeout);
+	AsyncRecvBuffer(
+		const AsyncRecvBuffer&) = delete;
+	AsyncRecvBuffer& operator=(
+		const AsyncRecvBuffer&) = delete;
+
+	bool
+	await_ready() const noexcept { return myRes >= 0; }
+
+	// The size of the data in the buffer, 0 on EOF, -1 on an error.
+	ssize_t
+	await_resume() { return myRes; }
+
+private:
+	void
+	execute();
+
+	bool
+	onIOEvent() final;
+
+	void
+	onCancel() final { myRes = -1; }
+
+	IOBuffer &myBuf;
+	ssize_t myRes;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 struct AsyncSend final : public AsyncOperation
 {
 	AsyncSend(
 		IOTask *sub,
 		const void *data,
-		size_t size);
+		size_t size,
+		uint32_t timeout);
 	AsyncSend(
 		const AsyncSend&) = delete;
 	AsyncSend& operator=(
@@ -197,6 +654,9 @@ private:
 	bool
 	onIOEvent() final;
 
+	void
+	onCancel() final { myRes = -1; }
+
 	const void *const myData;
 	const size_t mySize;
 	ssize_t myRes;
@@ -209,7 +669,8 @@ struct AsyncAccept final : public AsyncOperation
 	AsyncAccept(
 		IOTask *sub,
 		sockaddr *addr,
-		socklen_t *size);
+		socklen_t *size,
+		uint32_t timeout);
 	AsyncAccept(
 		const AsyncAccept&) = delete;
 	AsyncAccept& operator=(
@@ -228,6 +689,9 @@ private:
 	bool
 	onIOEvent() final;
 
+	void
+	onCancel() final { myRes = -1; }
+
 	sockaddr *const myAddr;
 	socklen_t *const mySize;
 	int myRes;
@@ -235,12 +699,52 @@ private:
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// Accept all the pending connections up to the given count at once, with one resumption.
+// The sockets are already non-blocking. Returns their count, or -1 on a cancel or a
+// timeout.
+//
+struct AsyncAcceptBatch final : public AsyncOperation
+{
+	AsyncAcceptBatch(
+		IOTask *sub,
+		int *socks,
+		uint32_t count,
+		uint32_t timeout);
+	AsyncAcceptBatch(
+		const AsyncAcceptBatch&) = delete;
+	AsyncAcceptBatch& operator=(
+		const AsyncAcceptBatch&) = delete;
+
+	bool
+	await_ready() const noexcept { return myRes != 0; }
+
+	int
+	await_resume() { return myRes; }
+
+private:
+	void
+	execute();
+
+	bool
+	onIOEvent() final;
+
+	void
+	onCancel() final { myRes = -1; }
+
+	int *const mySocks;
+	const uint32_t myCount;
+	int myRes;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 struct AsyncConnect final : public AsyncOperation
 {
 	AsyncConnect(
 		IOTask *sub,
 		const sockaddr *addr,
-		socklen_t size);
+		socklen_t size,
+		uint32_t timeout);
 	AsyncConnect(
 		const AsyncConnect&) = delete;
 	AsyncConnect& operator=(
@@ -256,12 +760,152 @@ private:
 	bool
 	onIOEvent() final;
 
+	void
+	onCancel() final { myIsDone = true; myRes = -1; }
+
 	bool myIsDone;
 	int myRes;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// Move the coroutine to the thread of the given core. Nothing happens if it is there
+// already. Otherwise the coroutine is queued into the core and resumed by its thread.
+//
+struct AsyncSchedule final
+{
+	AsyncSchedule(
+		IOCore &core) : myCore(core), myNext(nullptr) {}
+	AsyncSchedule(
+		const AsyncSchedule&) = delete;
+	AsyncSchedule& operator=(
+		const AsyncSchedule&) = delete;
+
+	bool
+	await_ready() const noexcept;
+
+	void
+	await_suspend(
+		std::coroutine_handle<> coro);
+
+	void
+	await_resume() {}
+
+private:
+	IOCore &myCore;
+	std::coroutine_handle<> myCoro;
+	// The awaitable lives in the suspended coroutine, so it is the queue node itself.
+	AsyncSchedule *myNext;
+
+	friend IOCore;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Continue the coroutine after the given number of milliseconds, in the same core.
+//
+struct AsyncSleep final : private IOTimer
+{
+	AsyncSleep(
+		IOCore &core,
+		uint32_t ms) : myCore(core), myTimeout(ms) {}
+	AsyncSleep(
+		const AsyncSleep&) = delete;
+	AsyncSleep& operator=(
+		const AsyncSleep&) = delete;
+
+	bool
+	await_ready() const noexcept { return myTimeout == 0; }
+
+	void
+	await_suspend(
+		std::coroutine_handle<> coro);
+
+	void
+	await_resume() {}
+
+private:
+	void
+	onTimeout() final { myCoro.resume(); }
+
+	IOCore &myCore;
+	const uint32_t myTimeout;
+	std::coroutine_handle<> myCoro;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Read or write of a file at the given offset. Regular files are always "ready" for epoll,
+// so they are done by io_uring of the core when the kernel has it, or by a helper thread
+// pool otherwise. The coroutine is resumed in the core's thread either way. Returns the
+// byte count, or -1 with errno set.
+//
+struct AsyncFileOperation
+{
+	AsyncFileOperation(
+		IOCore &core,
+		int fd,
+		void *data,
+		size_t size,
+		off_t offset,
+		bool isWrite);
+	AsyncFileOperation(
+		const AsyncFileOperation&) = delete;
+	AsyncFileOperation& operator=(
+		const AsyncFileOperation&) = delete;
+
+	bool
+	await_ready() const noexcept { return false; }
+
+	void
+	await_suspend(
+		std::coroutine_handle<> coro);
+
+	ssize_t
+	await_resume();
+
+private:
+	IOCore &myCore;
+	const int myFd;
+	// Readv/writev instead of read/write, because io_uring has them since its first
+	// version.
+	iovec myVec;
+	const off_t myOffset;
+	const bool myIsWrite;
+	// Byte count or -errno.
+	ssize_t myRes;
+	std::coroutine_handle<> myCoro;
+	// Link in the queues of the backends and of the core.
+	AsyncFileOperation *myNext;
+
+	friend IOCore;
+	friend IOFilePool;
+	friend IOUring;
+};
+
+struct AsyncRead final : public AsyncFileOperation
+{
+	AsyncRead(
+		IOCore &core,
+		int fd,
+		void *data,
+		size_t size,
+		off_t offset) : AsyncFileOperation(core, fd, data, size, offset, false) {}
+};
+
+struct AsyncWrite final : public AsyncFileOperation
+{
+	AsyncWrite(
+		IOCore &core,
+		int fd,
+		const void *data,
+		size_t size,
+		off_t offset)
+		: AsyncFileOperation(core, fd, (void *)data, size, offset, true) {}
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 class IOTask
 {
 public:
@@ -280,17 +924,30 @@ public:
 	//////////////////////////////////////////////
 	// Those all are arguments for co_await.
 	//
+	// The timeouts are in milliseconds.
 	AsyncRecv
-	asyncRecv(void *data, size_t size) { return AsyncRecv(this, data, size); }
+	asyncRecv(void *data, size_t size, uint32_t timeout = theIOTimeoutInfinite)
+		{ return AsyncRecv(this, data, size, timeout); }
+
+	AsyncRecvBuffer
+	asyncRecvBuffer(IOBuffer &buf, uint32_t timeout = theIOTimeoutInfinite)
+		{ return AsyncRecvBuffer(this, buf, timeout); }
 
 	AsyncSend
-	asyncSend(const void *data, size_t size) { return AsyncSend(this, data, size); }
+	asyncSend(const void *data, size_t size, uint32_t timeout = theIOTimeoutInfinite)
+		{ return AsyncSend(this, data, size, timeout); }
 
 	AsyncAccept
-	asyncAccept(sockaddr *addr, socklen_t *size) { return AsyncAccept(this, addr, size); }
+	asyncAccept(sockaddr *addr, socklen_t *size, uint32_t timeout = theIOTimeoutInfinite)
+		{ return AsyncAccept(this, addr, size, timeout); }
+
+	AsyncAcceptBatch
+	asyncAcceptBatch(int *socks, uint32_t count, uint32_t timeout = theIOTimeoutInfinite)
+		{ return AsyncAcceptBatch(this, socks, count, timeout); }
 
 	AsyncConnect
-	asyncConnect(const sockaddr *addr, socklen_t size) { return AsyncConnect(this, addr, size); }
+	asyncConnect(const sockaddr *addr, socklen_t size, uint32_t timeout = theIOTimeoutInfinite)
+		{ return AsyncConnect(this, addr, size, timeout); }
 	//
 	//////////////////////////////////////////////
 
@@ -306,11 +963,17 @@ private:
 	// more than once at a time, which means the current operation can only be one.
 	AsyncOperation* myAsyncOp;
 	IOCore &myCore;
+	// Links in the queues of the core. Separate, because the task can be closed before
+	// the core has taken it from the queue of the new ones.
+	IOTask *myNextNew;
+	IOTask *myNextClosed;
 
 	friend AsyncAccept;
+	friend AsyncAcceptBatch;
 	friend AsyncConnect;
 	friend AsyncOperation;
 	friend AsyncRecv;
+	friend AsyncRecvBuffer;
 	friend AsyncSend;
 	friend IOCore;
 };
@@ -333,19 +996,51 @@ struct IOCore
 	bool
 	isStopped() const { return myIsStopped.load(std::memory_order_relaxed); }
 
-	// Create a new task for async operations on the given fd.
+	// The core being rolled in this thread, if any.
+	static IOCore *
+	current();
+
+	// Argument for co_await, to continue the coroutine in this core's thread. A task can
+	// only be used in the thread of its core.
+	AsyncSchedule
+	asyncSchedule() { return AsyncSchedule(*this); }
+
+	// Argument for co_await, to sleep the given number of milliseconds. Can only be
+	// awaited in the core's thread.
+	AsyncSleep
+	asyncSleep(
+		uint32_t ms) { return AsyncSleep(*this, ms); }
+
+	// Arguments for co_await, for file IO. Can only be awaited in the core's thread.
+	AsyncRead
+	asyncRead(int fd, void *data, size_t size, off_t offset)
+		{ return AsyncRead(*this, fd, data, size, offset); }
+
+	AsyncWrite
+	asyncWrite(int fd, const void *data, size_t size, off_t offset)
+		{ return AsyncWrite(*this, fd, data, size, offset); }
+
+	// Whether the file IO goes to io_uring. It is created on the first file operation.
+	// Only the thread pool is used when io_uring is disabled before that.
+	bool
+	isUringUsed() const { return myUring != nullptr; }
+
+	static std::atomic_bool theIsUringEnabled;
+
+	// Create a new task for async operations on the given fd. Lock-free, can be called
+	// from any thread.
 	IOTask *
 	subscribe(
 		int fd);
 
 	// Destroy the task asynchronously. The memory will be freed, the task can't be used
-	// anymore after unsubscription.
+	// anymore after unsubscription. Lock-free, can be called from any thread.
 	void
 	unsubscribe(
 		IOTask *s);
 
-	// Get all pending events from the kernel and handle them. Can only be done in one
-	// thread at a time.
+	// Get all pending events from the kernel and handle them, then the expired timers.
+	// Waits until the nearest timer at most. Can only be done in one thread at a time.
 	void
 	roll();
 
@@ -353,15 +1048,452 @@ private:
 	void
 	processQueues();
 
+	// Resume the coroutine in the core's thread. Can be called from any thread.
+	void
+	post(
+		AsyncSchedule *op);
+
+	// The timers are a binary min-heap by the deadline. Adding and removing are
+	// O(log(N)), the nearest one is always on top. Used only in the core's thread.
+	void
+	timerAdd(
+		IOTimer *t,
+		uint32_t ms);
+
+	// Nothing happens if the timer is not armed.
+	void
+	timerRemove(
+		IOTimer *t);
+
+	void
+	timerSiftUp(
+		size_t idx);
+
+	void
+	timerSiftDown(
+		size_t idx);
+
+	// Milliseconds until the nearest deadline, or -1 for none. For epoll_wait().
+	int
+	timerWaitTimeout() const;
+
+	void
+	processTimers();
+
+	// Give the operation to io_uring or to the thread pool. Used only in the core's
+	// thread.
+	void
+	fileSubmit(
+		AsyncFileOperation *op);
+
+	// Resume the coroutine of the done operation in the core's thread. Can be called from
+	// any thread.
+	void
+	fileComplete(
+		AsyncFileOperation *op);
+
 	int myEventFd;
 	IOTask *myEventSub;
 	int myFd;
 	std::atomic_bool myIsStopped;
+	// The eventfd is written once until the core handles the queues, no matter how many
+	// pushes and wakeups were done meanwhile.
+	std::atomic_bool myIsWakeupPending;
 
-	std::mutex myMutex;
-	// Tasks currently in work.
+	// Tasks currently in work. Used only by the core's thread.
 	std::vector<IOTask *> myTasks;
-	// Incoming tasks. New and deleting ones.
-	std::vector<IOTask *> myQueue;
-	std::atomic_uint64_t mySize;
+	std::vector<IOTimer *> myTimers;
+	// Buffer for epoll_wait(). Grows while the events fill it up.
+	std::vector<epoll_event> myEvents;
+	// Incoming tasks, new and closed ones, and the coroutines posted to this core.
+	IOMpscQueue<IOTask, &IOTask::myNextNew> myNewQueue;
+	IOMpscQueue<IOTask, &IOTask::myNextClosed> myClosedQueue;
+	IOMpscQueue<AsyncSchedule, &AsyncSchedule::myNext> myPostQueue;
+	IOMpscQueue<AsyncFileOperation, &AsyncFileOperation::myNext> myFileDoneQueue;
+	// Created on the first file operation, if the kernel has io_uring. Its completions
+	// are signaled via the eventfd of the core.
+	IOUring *myUring;
+	bool myIsUringChecked;
+	// The file operations in flight. Used only by the core's thread.
+	uint32_t myFileOpCount;
+	// For the receives of the sockets of this core.
+	IOBufferPool myBufferPool;
+	// The pool's threads which can still touch the core. A thread wakes the core up
+	// after giving it an operation, and the core can be deleted meanwhile.
+	std::atomic_uint32_t myFilePoolUseCount;
+
+	friend AsyncFileOperation;
+	friend AsyncOperation;
+	friend AsyncRecvBuffer;
+	friend AsyncSchedule;
+	friend AsyncSleep;
+	friend IOFilePool;
+	friend IOUring;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// N cores on N threads. The sockets are spread over the cores by hash of their fd, and
+// all the IO of a socket is done in the thread of its core. The cores wake each other up
+// with their eventfds when a task or a coroutine is given to another core.
+//
+class IOCoreGroup
+{
+public:
+	IOCoreGroup(
+		uint32_t count);
+	~IOCoreGroup();
+
+	// Start the threads rolling the cores.
+	void
+	start();
+
+	void
+	stop();
+
+	IOCore&
+	coreFor(
+		int fd) { return *myCores[std::hash<int>{}(fd) % myCores.size()]; }
+
+	// Create the task in the core owning the fd.
+	IOTask *
+	subscribe(
+		int fd) { return coreFor(fd).subscribe(fd); }
+
+	size_t
+	size() const { return myCores.size(); }
+
+private:
+	std::vector<std::unique_ptr<IOCore>> myCores;
+	std::vector<std::thread> myThreads;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+class Channel;
+
+// A send or a receive of a few items via a channel. When it has to wait, it stays in a
+// list of the channel, and another coroutine completes it by giving it the items or by
+// taking them from it. Then the waiting coroutine is resumed by that other one.
+//
+template<typename T>
+struct AsyncChannelOperation
+{
+	AsyncChannelOperation(
+		Channel<T> &channel,
+		T *data,
+		size_t count,
+		size_t minCount,
+		bool isSend)
+		: myChannel(channel)
+		, myData(data)
+		, myCount(count)
+		, myMinCount(std::min(minCount, count))
+		, myIsSend(isSend)
+		, myDone(0)
+		, myNext(nullptr) {}
+	AsyncChannelOperation(
+		const AsyncChannelOperation&) = delete;
+	AsyncChannelOperation& operator=(
+		const AsyncChannelOperation&) = delete;
+
+	bool
+	await_ready() { return myChannel.execute(this); }
+
+	std::coroutine_handle<>
+	await_suspend(
+		std::coroutine_handle<> coro)
+	{
+		myCoro = coro;
+		return myChannel.wait(this);
+	}
+
+protected:
+	// The coroutines woken by this operation go first.
+	size_t
+	finish()
+	{
+		myChannel.resumeWoken();
+		return myDone;
+	}
+
+	Channel<T> &myChannel;
+	T *const myData;
+	const size_t myCount;
+	const size_t myMinCount;
+	const bool myIsSend;
+	size_t myDone;
+	std::coroutine_handle<> myCoro;
+	// Link in the lists of the channel.
+	AsyncChannelOperation *myNext;
+
+	friend Channel<T>;
+};
+
+template<typename T>
+struct AsyncChannelSend final : public AsyncChannelOperation<T>
+{
+	AsyncChannelSend(
+		Channel<T> &channel,
+		T &&value)
+		: AsyncChannelOperation<T>(channel, &myValue, 1, 1, true)
+		, myValue(std::move(value)) {}
+
+	// False if the channel is closed.
+	bool
+	await_resume() { return this->finish() == 1; }
+
+private:
+	T myValue;
 };
+
+template<typename T>
+struct AsyncChannelRecv final : public AsyncChannelOperation<T>
+{
+	AsyncChannelRecv(
+		Channel<T> &channel) : AsyncChannelOperation<T>(channel, &myValue, 1, 1, false) {}
+
+	// Nothing if the channel is closed and empty.
+	std::optional<T>
+	await_resume()
+	{
+		if (this->finish() == 0)
+			return std::nullopt;
+		return std::move(myValue);
+	}
+
+private:
+	T myValue;
+};
+
+template<typename T>
+struct AsyncChannelBatch final : public AsyncChannelOperation<T>
+{
+	using AsyncChannelOperation<T>::AsyncChannelOperation;
+
+	// The item count, 0 if the channel is closed.
+	size_t
+	await_resume() { return this->finish(); }
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Bounded queue of items between coroutines, like corobus. The items are in a ring
+// buffer, and the coroutines waiting for a free space or for the items are in the lists.
+// A send to a waiting receiver gives the items right into its buffer, and a receive
+// moves the items of a waiting sender into the ring.
+//
+// The woken coroutine is resumed right away, in the same thread. When the waker has to
+// wait itself, the woken one gets its thread via symmetric transfer. Otherwise the woken
+// one runs inline until its next suspension, before the waker's co_await returns. No
+// queues of the cores and no eventfd writes then. Hence a channel can only be used by the
+// coroutines of one thread, like of one core.
+//
+template<typename T>
+class Channel
+{
+public:
+	using Operation = AsyncChannelOperation<T>;
+
+	Channel(
+		size_t capacity)
+		: myRing(capacity), myHead(0), mySize(0), myIsClosed(false) { assert(capacity > 0); }
+	Channel(
+		const Channel&) = delete;
+	Channel& operator=(
+		const Channel&) = delete;
+
+	~Channel()
+	{
+		assert(mySenders.isEmpty());
+		assert(myReceivers.isEmpty());
+		assert(myWoken.isEmpty());
+	}
+
+	// Fail the waiting and the future sends. The receives get the items left in the ring,
+	// and then fail too.
+	void
+	close();
+
+	bool
+	isClosed() const { return myIsClosed; }
+
+	size_t
+	size() const { return mySize; }
+
+	size_t
+	capacity() const { return myRing.size(); }
+
+	//////////////////////////////////////////////
+	// Those all are arguments for co_await.
+	//
+	AsyncChannelSend<T>
+	asyncSend(T value) { return AsyncChannelSend<T>(*this, std::move(value)); }
+
+	AsyncChannelRecv<T>
+	asyncRecv() { return AsyncChannelRecv<T>(*this); }
+
+	// Move as many items as fit, waiting only while none does. Like coro_bus_send_v().
+	AsyncChannelBatch<T>
+	asyncSendMany(T *data, size_t count)
+		{ return AsyncChannelBatch<T>(*this, data, count, 1, true); }
+
+	// Receive up to the count of items, waiting until at least minCount of them are got.
+	// Less only when the channel is closed. Like coro_bus_recv_v_min().
+	AsyncChannelBatch<T>
+	asyncRecvMany(T *data, size_t count, size_t minCount = 1)
+		{ return AsyncChannelBatch<T>(*this, data, count, minCount, false); }
+	//
+	//////////////////////////////////////////////
+
+private:
+	// Do what can be done without waiting. True if the operation is complete.
+	bool
+	execute(
+		Operation *op);
+
+	std::coroutine_handle<>
+	wait(
+		Operation *op);
+
+	void
+	send(
+		Operation *op);
+
+	void
+	recv(
+		Operation *op);
+
+	// Move the items of the waiting senders into the free space.
+	void
+	refill();
+
+	void
+	resumeWoken();
+
+	std::vector<T> myRing;
+	size_t myHead;
+	size_t mySize;
+	bool myIsClosed;
+	IOList<Operation, &Operation::myNext> mySenders;
+	IOList<Operation, &Operation::myNext> myReceivers;
+	// Completed operations whose coroutines are not resumed yet.
+	IOList<Operation, &Operation::myNext> myWoken;
+
+	friend Operation;
+};
+
+template<typename T>
+inline void
+Channel<T>::close()
+{
+	myIsClosed = true;
+	while (Operation *op = mySenders.pop())
+		myWoken.push(op);
+	while (Operation *op = myReceivers.pop())
+		myWoken.push(op);
+	resumeWoken();
+}
+
+template<typename T>
+inline bool
+Channel<T>::execute(
+	Operation *op)
+{
+	if (op->myIsSend)
+		send(op);
+	else
+		recv(op);
+	return myIsClosed || op->myDone >= op->myMinCount;
+}
+
+template<typename T>
+inline std::coroutine_handle<>
+Channel<T>::wait(
+	Operation *op)
+{
+	if (op->myIsSend)
+		mySenders.push(op);
+	else
+		myReceivers.push(op);
+	// A batch could wake somebody and still wait for more. All the woken ones but the last
+	// are resumed inline, and the thread is given to the last one. The op can be complete
+	// and even gone meanwhile, it isn't touched anymore.
+	while (true)
+	{
+		Operation *next = myWoken.pop();
+		if (next == nullptr)
+			return std::noop_coroutine();
+		if (myWoken.isEmpty())
+			return next->myCoro;
+		next->myCoro.resume();
+	}
+}
+
+template<typename T>
+inline void
+Channel<T>::send(
+	Operation *op)
+{
+	if (myIsClosed)
+		return;
+	// The receivers wait only when the ring is empty.
+	while (op->myDone < op->myCount && !myReceivers.isEmpty())
+	{
+		Operation *r = myReceivers.front();
+		size_t n = std::min(op->myCount - op->myDone, r->myCount - r->myDone);
+		std::move(op->myData + op->myDone, op->myData + op->myDone + n,
+			r->myData + r->myDone);
+		op->myDone += n;
+		r->myDone += n;
+		if (r->myDone < r->myMinCount)
+			break;
+		myWoken.push(myReceivers.pop());
+	}
+	size_t cap = myRing.size();
+	while (op->myDone < op->myCount && mySize < cap)
+		myRing[(myHead + mySize++) % cap] = std::move(op->myData[op->myDone++]);
+}
+
+template<typename T>
+inline void
+Channel<T>::recv(
+	Operation *op)
+{
+	size_t cap = myRing.size();
+	while (op->myDone < op->myCount && mySize > 0)
+	{
+		op->myData[op->myDone++] = std::move(myRing[myHead]);
+		myHead = (myHead + 1) % cap;
+		--mySize;
+		if (mySize == 0)
+			refill();
+	}
+	refill();
+}
+
+template<typename T>
+inline void
+Channel<T>::refill()
+{
+	size_t cap = myRing.size();
+	while (mySize < cap && !mySenders.isEmpty())
+	{
+		Operation *s = mySenders.front();
+		while (s->myDone < s->myCount && mySize < cap)
+			myRing[(myHead + mySize++) % cap] = std::move(s->myData[s->myDone++]);
+		if (s->myDone < s->myMinCount)
+			break;
+		myWoken.push(mySenders.pop());
+	}
+}
+
+template<typename T>
+inline void
+Channel<T>::resumeWoken()
+{
+	// The resumed ones can wake more.
+	while (Operation *op = myWoken.pop())
+		op->myCoro.resume();
+}
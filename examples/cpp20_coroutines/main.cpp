@@ -12,6 +12,21 @@
 
 static constexpr uint64_t theRequestTargetCount = 50;
 static constexpr int theClientCount = 100;
+static constexpr int theServerThreadCount = 4;
+// Connections accepted per resumption of the server.
+static constexpr uint32_t theAcceptBatchSize = 32;
+// Milliseconds. Much more than the test takes, it is just to see the timers work.
+static constexpr uint32_t theRecvTimeout = 5000;
+static constexpr uint32_t theFileBlockCount = 64;
+static constexpr size_t theFileBlockSize = 4096;
+// The nested tasks don't grow the stack only when the compiler makes their symmetric
+// transfers tail calls, which GCC does with -O2 but not in a debug build. So the depth is
+// safe on a usual 8MB stack even without them, and the test prints how much the stack
+// grew instead.
+static constexpr uint32_t theTaskChainDepth = 10'000;
+static constexpr uint64_t theChannelItemCount = 1'000'000;
+static constexpr size_t theChannelCapacity = 64;
+static constexpr size_t theChannelBatchSize = 16;
 
 static uint64_t
 getUsec();
@@ -24,6 +39,16 @@ static void
 makeFdNonblock(
 	int fd);
 
+static void
+runFileIO(
+	bool isUringEnabled);
+
+static void
+runTaskChain();
+
+static void
+runChannelPipeline();
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 class Context
@@ -74,9 +99,17 @@ private:
 	IOCoroutine
 	coroRun();
 
+	Task<void>
+	coroServe();
+
+	Task<bool>
+	coroRequest();
+
 	IOTask *myTask;
 	uint64_t myRecvCount;
 	uint64_t mySendCount;
+	// Received, but not counted by the requests yet.
+	uint64_t myRecvAheadCount;
 	const std::shared_ptr<Context> myContext;
 };
 
@@ -92,7 +125,7 @@ struct Server
 
 	uint16_t
 	bindAndListenAndRun(
-		IOCore &core);
+		IOCoreGroup &cores);
 
 	void
 	stop();
@@ -102,6 +135,8 @@ private:
 	coroRun();
 
 	IOTask *myTask;
+	// The accepted sockets are spread over the cores.
+	IOCoreGroup *myCores;
 	const std::shared_ptr<Context> myContext;
 };
 
@@ -112,11 +147,11 @@ run()
 {
 	std::shared_ptr<Context> context = std::make_shared<Context>();
 
-	IOCore serverCore;
+	IOCoreGroup serverCores(theServerThreadCount);
 	std::cout << "start server" << std::endl;
 	Server server(context);
-	uint16_t port = server.bindAndListenAndRun(serverCore);
-	std::thread serverThread(ioCoreRunF, std::ref(serverCore));
+	uint16_t port = server.bindAndListenAndRun(serverCores);
+	serverCores.start();
 
 	std::cout << "start clients" << std::endl;
 	IOCore clientCore;
@@ -131,20 +166,33 @@ run()
 	clientThread.join();
 	uint64_t t2 = getUsec();
 	std::cout << "Took " << (t2 - t1) / 1000.0 << " ms" << std::endl;
+	std::cout << "Coroutine frames cached: " <<
+		IOCoroutineFramePool::theHitCount.load(std::memory_order_relaxed) <<
+		", allocated: " <<
+		IOCoroutineFramePool::theMissCount.load(std::memory_order_relaxed) << std::endl;
+	// Only as many as the sockets which had the data at once, not one per connection.
+	std::cout << "Receive buffers reused: " <<
+		IOBufferPool::theHitCount.load(std::memory_order_relaxed) <<
+		", allocated: " <<
+		IOBufferPool::theMissCount.load(std::memory_order_relaxed) << std::endl;
 
 	std::cout << "wait for the server to stop" << std::endl;
 	server.stop();
 	context->waitServerFinish();
-	serverCore.stop();
-	serverThread.join();
+	serverCores.stop();
 	return 0;
 }
 
 int main()
 {
 	int rc = run();
+	runFileIO(true);
+	runFileIO(false);
+	runTaskChain();
+	runChannelPipeline();
 	assert(Client::theCount.load(std::memory_order_relaxed) == 0);
 	assert(IOCoroutinePromise::theCount.load(std::memory_order_relaxed) == 0);
+	assert(TaskPromiseBase::theCount.load(std::memory_order_relaxed) == 0);
 	assert(IOTask::theCount.load(std::memory_order_relaxed) == 0);
 	return rc;
 }
@@ -220,6 +268,7 @@ Client::Client(
 	: myTask(nullptr)
 	, myRecvCount(0)
 	, mySendCount(0)
+	, myRecvAheadCount(0)
 	, myContext(ctx)
 {
 	LOG_THIS_DEBUG(Client, Client, "create");
@@ -259,9 +308,7 @@ Client::connectAndRun(
 		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 		int rc = co_await self->myTask->asyncConnect((sockaddr *)&addr, sizeof(addr));
 		assert(rc == 0);
-		// Unfortunately, can't reuse the current coroutine for running the main loop.
-		// Have to create a new one.
-		self->coroRun();
+		co_await self->coroServe();
 		co_return;
 	}(this, port);
 }
@@ -273,7 +320,7 @@ Client::wrapAndRun(
 {
 	LOG_THIS_DEBUG(Client, wrap, myTask);
 	assert(myTask == nullptr);
-	makeFdNonblock(sock);
+	// Accepted as non-blocking already.
 	myTask = core.subscribe(sock);
 	coroRun();
 }
@@ -281,30 +328,62 @@ Client::wrapAndRun(
 IOCoroutine
 Client::coroRun()
 {
-	LOG_THIS_DEBUG(Client, coroRun, "");
+	co_await coroServe();
+	co_return;
+}
+
+Task<void>
+Client::coroServe()
+{
+	LOG_THIS_DEBUG(Client, coroServe, "");
+	// The socket could be given to another core than the one which created it.
+	co_await myTask->core().asyncSchedule();
 	for (uint32_t i = 0; i < theRequestTargetCount; ++i)
 	{
-		uint8_t data;
-		LOG_THIS_DEBUG(Client, coroRun, "send");
-		ssize_t rc = co_await myTask->asyncSend(&data, 1);
-		LOG_THIS_DEBUG(Client, coroRun, "sent " << rc);
-		assert(rc == 1);
-		LOG_THIS_DEBUG(Client, coroRun, "receive");
-		rc = co_await myTask->asyncRecv(&data, 1);
-		LOG_THIS_DEBUG(Client, coroRun, "received " << rc);
-		assert(rc == 1);
+		bool ok = co_await coroRequest();
+		assert(ok);
+		MAYBE_UNUSED(ok);
 	}
-	LOG_THIS_DEBUG(Client, coroRun, "finish");
+	LOG_THIS_DEBUG(Client, coroServe, "finish");
 	myContext->onClientFinish();
 	delete this;
 	co_return;
 }
 
+Task<bool>
+Client::coroRequest()
+{
+	uint8_t data = 0;
+	LOG_THIS_DEBUG(Client, coroRequest, "send");
+	ssize_t rc = co_await myTask->asyncSend(&data, 1);
+	LOG_THIS_DEBUG(Client, coroRequest, "sent " << rc);
+	if (rc != 1)
+		co_return false;
+	++mySendCount;
+	LOG_THIS_DEBUG(Client, coroRequest, "receive");
+	if (myRecvAheadCount == 0)
+	{
+		// The buffer is from the core's pool, and goes back there with the task's frame.
+		// It can get the next responses too, when the peer sends faster than this one
+		// reads.
+		IOBuffer buf;
+		rc = co_await myTask->asyncRecvBuffer(buf, theRecvTimeout);
+		LOG_THIS_DEBUG(Client, coroRequest, "received " << rc);
+		if (rc <= 0)
+			co_return false;
+		myRecvAheadCount = rc;
+	}
+	--myRecvAheadCount;
+	++myRecvCount;
+	co_return true;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 Server::Server(
 	const std::shared_ptr<Context>& ctx)
 	: myTask(nullptr)
+	, myCores(nullptr)
 	, myContext(ctx)
 {
 }
@@ -316,7 +395,7 @@ Server::~Server()
 
 uint16_t
 Server::bindAndListenAndRun(
-	IOCore &core)
+	IOCoreGroup &cores)
 {
 	sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
@@ -334,7 +413,8 @@ Server::bindAndListenAndRun(
 	rc = listen(sock, SOMAXCONN);
 	assert(rc == 0);
 	makeFdNonblock(sock);
-	myTask = core.subscribe(sock);
+	myCores = &cores;
+	myTask = cores.subscribe(sock);
 	LOG_THIS_DEBUG(Server, bindAndListen, myTask);
 
 	rc = getsockname(sock, (sockaddr *)&addr, &len);
@@ -356,18 +436,173 @@ IOCoroutine
 Server::coroRun()
 {
 	IOTask *task = myTask;
+	int socks[theAcceptBatchSize];
 	while (true)
 	{
 		LOG_THIS_DEBUG(Server, coroRun, "accept start");
-		sockaddr_in addr;
-		socklen_t len = sizeof(addr);
-		int sock = co_await task->asyncAccept((sockaddr *)&addr, &len);
+		int count = co_await task->asyncAcceptBatch(socks, theAcceptBatchSize);
 		// Could be cancel.
-		if (sock < 0)
+		if (count < 0)
 			break;
-		LOG_THIS_DEBUG(Server, coroRun, "new client, " << sock);
-		(new Client(myContext))->wrapAndRun(task->core(), sock);
+		LOG_THIS_DEBUG(Server, coroRun, "new clients, " << count);
+		// Each client starts in the core of its socket. The cores are woken up once per
+		// batch, while they handle their queues.
+		for (int i = 0; i < count; ++i)
+			(new Client(myContext))->wrapAndRun(myCores->coreFor(socks[i]), socks[i]);
 	}
 	myContext->onServerFinish();
 	co_return;
 }
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static IOCoroutine
+coroFileIO(
+	IOCore &core,
+	int fd)
+{
+	std::vector<uint8_t> block(theFileBlockSize);
+	for (uint32_t i = 0; i < theFileBlockCount; ++i)
+	{
+		memset(block.data(), 'a' + i % 26, block.size());
+		ssize_t rc = co_await core.asyncWrite(fd, block.data(), block.size(),
+			i * theFileBlockSize);
+		assert(rc == (ssize_t)block.size());
+	}
+	for (uint32_t i = 0; i < theFileBlockCount; ++i)
+	{
+		ssize_t rc = co_await core.asyncRead(fd, block.data(), block.size(),
+			i * theFileBlockSize);
+		assert(rc == (ssize_t)block.size());
+		for (uint8_t c : block)
+			assert(c == 'a' + i % 26);
+	}
+	core.stop();
+	co_return;
+}
+
+static void
+runFileIO(
+	bool isUringEnabled)
+{
+	IOCore::theIsUringEnabled.store(isUringEnabled, std::memory_order_relaxed);
+	char path[] = "/tmp/iocoro_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	unlink(path);
+
+	IOCore core;
+	uint64_t t1 = getUsec();
+	// Has to start in the core's thread.
+	[](IOCore &core, int fd) -> IOCoroutine {
+		co_await core.asyncSchedule();
+		coroFileIO(core, fd);
+		co_return;
+	}(core, fd);
+	ioCoreRunF(core);
+	uint64_t t2 = getUsec();
+	std::cout << "File IO via " << (core.isUringUsed() ? "io_uring" : "thread pool") <<
+		" took " << (t2 - t1) / 1000.0 << " ms" << std::endl;
+	close(fd);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Stack position of the deepest task in the chain.
+static uintptr_t theTaskChainStackPos = 0;
+
+// Each level awaits the next one. The deepest one finishes without suspending, and its
+// result travels up the chain through the symmetric transfers.
+static Task<uint64_t>
+coroTaskChain(
+	uint32_t depth)
+{
+	if (depth == 0) {
+		theTaskChainStackPos = (uintptr_t)__builtin_frame_address(0);
+		co_return 0;
+	}
+	uint64_t res = co_await coroTaskChain(depth - 1);
+	co_return res + depth;
+}
+
+static void
+runTaskChain()
+{
+	uint64_t res = 0;
+	uintptr_t stackPos = 0;
+	uint64_t t1 = getUsec();
+	[](uint64_t &res, uintptr_t &stackPos) -> IOCoroutine {
+		stackPos = (uintptr_t)__builtin_frame_address(0);
+		res = co_await coroTaskChain(theTaskChainDepth);
+		co_return;
+	}(res, stackPos);
+	uint64_t t2 = getUsec();
+	assert(res == (uint64_t)theTaskChainDepth * (theTaskChainDepth + 1) / 2);
+	std::cout << "Task chain of depth " << theTaskChainDepth << " took " <<
+		(t2 - t1) / 1000.0 << " ms, the stack grew by " <<
+		(stackPos - theTaskChainStackPos) << " bytes" << std::endl;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Producer -> squares -> consumer. No core is needed, the stages resume each other.
+static IOCoroutine
+coroChannelProduce(
+	Channel<uint64_t> &out)
+{
+	for (uint64_t i = 0; i < theChannelItemCount; ++i)
+	{
+		bool ok = co_await out.asyncSend(i);
+		assert(ok);
+		MAYBE_UNUSED(ok);
+	}
+	out.close();
+	co_return;
+}
+
+static IOCoroutine
+coroChannelSquare(
+	Channel<uint64_t> &in,
+	Channel<uint64_t> &out)
+{
+	while (std::optional<uint64_t> value = co_await in.asyncRecv())
+	{
+		bool ok = co_await out.asyncSend(*value * *value);
+		assert(ok);
+		MAYBE_UNUSED(ok);
+	}
+	out.close();
+	co_return;
+}
+
+static IOCoroutine
+coroChannelConsume(
+	Channel<uint64_t> &in,
+	uint64_t &sum)
+{
+	uint64_t batch[theChannelBatchSize];
+	while (size_t count = co_await in.asyncRecvMany(batch, theChannelBatchSize,
+		theChannelBatchSize))
+	{
+		for (size_t i = 0; i < count; ++i)
+			sum += batch[i];
+	}
+	co_return;
+}
+
+static void
+runChannelPipeline()
+{
+	Channel<uint64_t> values(theChannelCapacity);
+	Channel<uint64_t> squares(theChannelCapacity);
+	uint64_t sum = 0;
+	uint64_t t1 = getUsec();
+	coroChannelConsume(squares, sum);
+	coroChannelSquare(values, squares);
+	coroChannelProduce(values);
+	uint64_t t2 = getUsec();
+	uint64_t n = theChannelItemCount - 1;
+	assert(sum == n * (n + 1) * (2 * n + 1) / 6);
+	std::cout << "Channel pipeline of " << theChannelItemCount << " items took " <<
+		(t2 - t1) / 1000.0 << " ms" << std::endl;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+/**
+ * The echo servers of lecture_examples/9_aio behind one driver. The protocol
+ * is the same: a client sends an int, the server answers with the int + 1.
+ * The event loop backend is pluggable, and a load generator measures how
+ * each of them scales with the connection count.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+/** {{{ Backend */
+
+/**
+ * Readiness of the descriptors for reading. All of them are level-triggered,
+ * like in the lecture examples.
+ */
+struct echo_backend {
+	const char *name;
+	/** Descriptors must be less than that. Zero means no limit. */
+	int fd_limit;
+	void *(*create_f)(void);
+	void (*destroy_f)(void *impl);
+	/** Return 0 on success, -1 on error with errno. */
+	int (*add_f)(void *impl, int fd);
+	int (*del_f)(void *impl, int fd);
+	/**
+	 * Wait for the readable descriptors and store them into ready. Timeout
+	 * is in milliseconds, negative means infinite.
+	 * @retval Count of the ready descriptors, or -1 on error with errno.
+	 */
+	int (*wait_f)(void *impl, int *ready, int ready_cap, int timeout_ms);
+};
+
+/** select, poll, epoll, kqueue, whatever of them are available. */
+const struct echo_backend *const *
+echo_backends(int *count);
+
+const struct echo_backend *
+echo_backend_by_name(const char *name);
+
+/** The one without a linear cost per wait. */
+const struct echo_backend *
+echo_backend_best(void);
+
+/** }}} Backend */
+
+/** {{{ Server */
+
+struct echo_server;
+
+struct echo_server_stats {
+	/** Events handled, the new connections and the requests. */
+	uint64_t event_count;
+	uint64_t wait_count;
+	/** CPU time of the server thread. */
+	uint64_t cpu_ns;
+	uint64_t accept_count;
+};
+
+/**
+ * Start the server in its own thread on 127.0.0.1 and a random port.
+ * @retval NULL Error, errno is set.
+ */
+struct echo_server *
+echo_server_start(const struct echo_backend *backend);
+
+uint16_t
+echo_server_port(const struct echo_server *s);
+
+/** Can be called from any thread, while the server is working. */
+void
+echo_server_stats(struct echo_server *s, struct echo_server_stats *stats);
+
+void
+echo_server_stop(struct echo_server *s);
+
+/** }}} Server */
+
+/** {{{ Load */
+
+struct echo_load_result {
+	uint64_t request_count;
+	uint64_t duration_ns;
+	/** What the server did during the measured time. */
+	struct echo_server_stats server;
+};
+
+/**
+ * Open the connections, keep one request in flight on each of the first
+ * active_count of them for the given time. The rest are idle. Only the time
+ * after all the connections are accepted is measured.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+echo_load_run(uint16_t port, int conn_count, int active_count, uint64_t duration_ns,
+	      struct echo_server *server, struct echo_load_result *res);
+
+/** }}} Load */
+
+uint64_t
+echo_now_ns(void);
@@ -0,0 +1,424 @@
+#include "echo.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#define ECHO_HAS_EPOLL 1
+#endif
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+	defined(__OpenBSD__)
+#include <sys/event.h>
+#define ECHO_HAS_KQUEUE 1
+#endif
+
+enum {
+	ECHO_BACKEND_FD_INITIAL_CAP = 64,
+};
+
+uint64_t
+echo_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** {{{ select */
+
+/**
+ * The kernel scans all the descriptors up to the max one on each call, and
+ * so does the user to find the ready ones. Also the set is copied each time,
+ * because select() overwrites it.
+ */
+struct echo_select {
+	fd_set fds;
+	int max_fd;
+};
+
+static void *
+echo_select_create(void)
+{
+	struct echo_select *s = malloc(sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	FD_ZERO(&s->fds);
+	s->max_fd = -1;
+	return s;
+}
+
+static void
+echo_select_destroy(void *impl)
+{
+	free(impl);
+}
+
+static int
+echo_select_add(void *impl, int fd)
+{
+	struct echo_select *s = impl;
+	if (fd >= FD_SETSIZE) {
+		errno = EMFILE;
+		return -1;
+	}
+	FD_SET(fd, &s->fds);
+	if (fd > s->max_fd)
+		s->max_fd = fd;
+	return 0;
+}
+
+static int
+echo_select_del(void *impl, int fd)
+{
+	struct echo_select *s = impl;
+	FD_CLR(fd, &s->fds);
+	while (s->max_fd >= 0 && !FD_ISSET(s->max_fd, &s->fds))
+		--s->max_fd;
+	return 0;
+}
+
+static int
+echo_select_wait(void *impl, int *ready, int ready_cap, int timeout_ms)
+{
+	struct echo_select *s = impl;
+	fd_set fds = s->fds;
+	struct timeval tv;
+	struct timeval *tvp = NULL;
+	if (timeout_ms >= 0) {
+		tv.tv_sec = timeout_ms / 1000;
+		tv.tv_usec = (timeout_ms % 1000) * 1000;
+		tvp = &tv;
+	}
+	int rc = select(s->max_fd + 1, &fds, NULL, NULL, tvp);
+	if (rc <= 0)
+		return rc;
+	int count = 0;
+	for (int fd = 0; fd <= s->max_fd && count < rc && count < ready_cap; ++fd) {
+		if (FD_ISSET(fd, &fds))
+			ready[count++] = fd;
+	}
+	return count;
+}
+
+static const struct echo_backend echo_backend_select = {
+	"select", FD_SETSIZE,
+	echo_select_create, echo_select_destroy, echo_select_add, echo_select_del,
+	echo_select_wait,
+};
+
+/** }}} select */
+
+/** {{{ poll */
+
+/**
+ * The whole array goes to the kernel on each call, and is scanned for the
+ * ready ones after. Removal is a swap with the last one, via the index of
+ * each descriptor in the array.
+ */
+struct echo_poll {
+	struct pollfd *fds;
+	int count;
+	int cap;
+	/** Position of each descriptor in fds. */
+	int *idx;
+	int idx_cap;
+};
+
+static void *
+echo_poll_create(void)
+{
+	struct echo_poll *p = calloc(1, sizeof(*p));
+	return p;
+}
+
+static void
+echo_poll_destroy(void *impl)
+{
+	struct echo_poll *p = impl;
+	free(p->fds);
+	free(p->idx);
+	free(p);
+}
+
+static int
+echo_poll_add(void *impl, int fd)
+{
+	struct echo_poll *p = impl;
+	if (p->count == p->cap) {
+		int cap = p->cap == 0 ? ECHO_BACKEND_FD_INITIAL_CAP : p->cap * 2;
+		struct pollfd *fds = realloc(p->fds, cap * sizeof(fds[0]));
+		if (fds == NULL)
+			return -1;
+		p->fds = fds;
+		p->cap = cap;
+	}
+	if (fd >= p->idx_cap) {
+		int cap = p->idx_cap == 0 ? ECHO_BACKEND_FD_INITIAL_CAP : p->idx_cap;
+		while (cap <= fd)
+			cap *= 2;
+		int *idx = realloc(p->idx, cap * sizeof(idx[0]));
+		if (idx == NULL)
+			return -1;
+		p->idx = idx;
+		p->idx_cap = cap;
+	}
+	p->idx[fd] = p->count;
+	struct pollfd *pfd = &p->fds[p->count++];
+	pfd->fd = fd;
+	pfd->events = POLLIN;
+	pfd->revents = 0;
+	return 0;
+}
+
+static int
+echo_poll_del(void *impl, int fd)
+{
+	struct echo_poll *p = impl;
+	int i = p->idx[fd];
+	struct pollfd *last = &p->fds[--p->count];
+	p->fds[i] = *last;
+	p->idx[last->fd] = i;
+	return 0;
+}
+
+static int
+echo_poll_wait(void *impl, int *ready, int ready_cap, int timeout_ms)
+{
+	struct echo_poll *p = impl;
+	int rc = poll(p->fds, p->count, timeout_ms);
+	if (rc <= 0)
+		return rc;
+	int count = 0;
+	for (int i = 0; i < p->count && count < rc && count < ready_cap; ++i) {
+		if (p->fds[i].revents != 0)
+			ready[count++] = p->fds[i].fd;
+	}
+	return count;
+}
+
+static const struct echo_backend echo_backend_poll = {
+	"poll", 0,
+	echo_poll_create, echo_poll_destroy, echo_poll_add, echo_poll_del,
+	echo_poll_wait,
+};
+
+/** }}} poll */
+
+#if ECHO_HAS_EPOLL
+
+/** {{{ epoll */
+
+/**
+ * The kernel keeps the set, and a wait returns only the ready ones. The cost
+ * is per event, not per descriptor.
+ */
+struct echo_epoll {
+	int fd;
+	struct epoll_event *events;
+	int event_cap;
+};
+
+static void *
+echo_epoll_create(void)
+{
+	struct echo_epoll *e = malloc(sizeof(*e));
+	if (e == NULL)
+		return NULL;
+	e->fd = epoll_create1(0);
+	if (e->fd < 0) {
+		free(e);
+		return NULL;
+	}
+	e->events = NULL;
+	e->event_cap = 0;
+	return e;
+}
+
+static void
+echo_epoll_destroy(void *impl)
+{
+	struct echo_epoll *e = impl;
+	close(e->fd);
+	free(e->events);
+	free(e);
+}
+
+static int
+echo_epoll_add(void *impl, int fd)
+{
+	struct echo_epoll *e = impl;
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(e->fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int
+echo_epoll_del(void *impl, int fd)
+{
+	struct echo_epoll *e = impl;
+	return epoll_ctl(e->fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int
+echo_epoll_wait(void *impl, int *ready, int ready_cap, int timeout_ms)
+{
+	struct echo_epoll *e = impl;
+	if (e->event_cap < ready_cap) {
+		struct epoll_event *events = realloc(e->events,
+						     ready_cap * sizeof(events[0]));
+		if (events == NULL)
+			return -1;
+		e->events = events;
+		e->event_cap = ready_cap;
+	}
+	int rc = epoll_wait(e->fd, e->events, ready_cap, timeout_ms);
+	for (int i = 0; i < rc; ++i)
+		ready[i] = e->events[i].data.fd;
+	return rc;
+}
+
+static const struct echo_backend echo_backend_epoll = {
+	"epoll", 0,
+	echo_epoll_create, echo_epoll_destroy, echo_epoll_add, echo_epoll_del,
+	echo_epoll_wait,
+};
+
+/** }}} epoll */
+
+#endif /* ECHO_HAS_EPOLL */
+
+#if ECHO_HAS_KQUEUE
+
+/** {{{ kqueue */
+
+struct echo_kqueue {
+	int fd;
+	struct kevent *events;
+	int event_cap;
+};
+
+static void *
+echo_kqueue_create(void)
+{
+	struct echo_kqueue *k = malloc(sizeof(*k));
+	if (k == NULL)
+		return NULL;
+	k->fd = kqueue();
+	if (k->fd < 0) {
+		free(k);
+		return NULL;
+	}
+	k->events = NULL;
+	k->event_cap = 0;
+	return k;
+}
+
+static void
+echo_kqueue_destroy(void *impl)
+{
+	struct echo_kqueue *k = impl;
+	close(k->fd);
+	free(k->events);
+	free(k);
+}
+
+static int
+echo_kqueue_ctl(struct echo_kqueue *k, int fd, int flags)
+{
+	struct kevent ev;
+	EV_SET(&ev, fd, EVFILT_READ, flags, 0, 0, 0);
+	return kevent(k->fd, &ev, 1, NULL, 0, NULL);
+}
+
+static int
+echo_kqueue_add(void *impl, int fd)
+{
+	return echo_kqueue_ctl(impl, fd, EV_ADD);
+}
+
+static int
+echo_kqueue_del(void *impl, int fd)
+{
+	return echo_kqueue_ctl(impl, fd, EV_DELETE);
+}
+
+static int
+echo_kqueue_wait(void *impl, int *ready, int ready_cap, int timeout_ms)
+{
+	struct echo_kqueue *k = impl;
+	if (k->event_cap < ready_cap) {
+		struct kevent *events = realloc(k->events, ready_cap * sizeof(events[0]));
+		if (events == NULL)
+			return -1;
+		k->events = events;
+		k->event_cap = ready_cap;
+	}
+	struct timespec ts;
+	struct timespec *tsp = NULL;
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+		tsp = &ts;
+	}
+	int rc = kevent(k->fd, NULL, 0, k->events, ready_cap, tsp);
+	for (int i = 0; i < rc; ++i)
+		ready[i] = (int)k->events[i].ident;
+	return rc;
+}
+
+static const struct echo_backend echo_backend_kqueue = {
+	"kqueue", 0,
+	echo_kqueue_create, echo_kqueue_destroy, echo_kqueue_add, echo_kqueue_del,
+	echo_kqueue_wait,
+};
+
+/** }}} kqueue */
+
+#endif /* ECHO_HAS_KQUEUE */
+
+static const struct echo_backend *const echo_backend_list[] = {
+	&echo_backend_select,
+	&echo_backend_poll,
+#if ECHO_HAS_EPOLL
+	&echo_backend_epoll,
+#endif
+#if ECHO_HAS_KQUEUE
+	&echo_backend_kqueue,
+#endif
+};
+
+const struct echo_backend *const *
+echo_backends(int *count)
+{
+	*count = sizeof(echo_backend_list) / sizeof(echo_backend_list[0]);
+	return echo_backend_list;
+}
+
+const struct echo_backend *
+echo_backend_by_name(const char *name)
+{
+	int count;
+	const struct echo_backend *const *list = echo_backends(&count);
+	for (int i = 0; i < count; ++i) {
+		if (strcmp(list[i]->name, name) == 0)
+			return list[i];
+	}
+	return NULL;
+}
+
+const struct echo_backend *
+echo_backend_best(void)
+{
+	int count;
+	const struct echo_backend *const *list = echo_backends(&count);
+	/* The kernel-side ones go last. */
+	return list[count - 1];
+}
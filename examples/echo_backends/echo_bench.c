@@ -0,0 +1,142 @@
+/**
+ * Usage: echo_bench [-b backend,...] [-c conn_count,...] [-a active_count]
+ *                   [-d duration_ms]
+ *
+ * For each connection count and backend an echo server is started, and the
+ * clients keep one request in flight on each active connection. Printed are
+ * the requests per second, the server CPU time per event, and the events per
+ * one wait call.
+ *
+ * Defaults: all backends, 10,100,1000,10000,50000 connections, 100 of them
+ * active, 1000 ms per run. The active count is fixed, so the growth of the
+ * cost per event comes only from the idle connections.
+ */
+#include "echo.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+enum {
+	ECHO_BENCH_MAX_RUNS = 64,
+	/** Listener, the stop pipe, the client's backend, stdio. */
+	ECHO_BENCH_EXTRA_FDS = 16,
+};
+
+static int
+echo_bench_parse_list(char *str, char **items, int cap)
+{
+	int count = 0;
+	for (char *tok = strtok(str, ","); tok != NULL && count < cap;
+	     tok = strtok(NULL, ","))
+		items[count++] = tok;
+	return count;
+}
+
+/** Both ends of each connection are in this process. */
+static int
+echo_bench_raise_fd_limit(void)
+{
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+		return 0;
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	getrlimit(RLIMIT_NOFILE, &rl);
+	return rl.rlim_cur > (rlim_t)1 << 30 ? 1 << 30 : (int)rl.rlim_cur;
+}
+
+int
+main(int argc, char **argv)
+{
+	char default_counts[] = "10,100,1000,10000,50000";
+	char *backend_str = NULL;
+	char *count_str = default_counts;
+	int active_count = 100;
+	int duration_ms = 1000;
+	int opt;
+	while ((opt = getopt(argc, argv, "b:c:a:d:")) != -1) {
+		switch (opt) {
+		case 'b':
+			backend_str = optarg;
+			break;
+		case 'c':
+			count_str = optarg;
+			break;
+		case 'a':
+			active_count = atoi(optarg);
+			break;
+		case 'd':
+			duration_ms = atoi(optarg);
+			break;
+		default:
+			printf("Usage: echo_bench [-b backend,...] [-c conn_count,...] "
+			       "[-a active_count] [-d duration_ms]\n");
+			return -1;
+		}
+	}
+	const struct echo_backend *backends[ECHO_BENCH_MAX_RUNS];
+	int backend_count = 0;
+	if (backend_str == NULL) {
+		const struct echo_backend *const *all = echo_backends(&backend_count);
+		memcpy(backends, all, backend_count * sizeof(backends[0]));
+	} else {
+		char *names[ECHO_BENCH_MAX_RUNS];
+		int count = echo_bench_parse_list(backend_str, names, ECHO_BENCH_MAX_RUNS);
+		for (int i = 0; i < count; ++i) {
+			backends[backend_count] = echo_backend_by_name(names[i]);
+			if (backends[backend_count] == NULL) {
+				printf("Unknown backend %s\n", names[i]);
+				return -1;
+			}
+			++backend_count;
+		}
+	}
+	char *count_items[ECHO_BENCH_MAX_RUNS];
+	int conn_run_count = echo_bench_parse_list(count_str, count_items,
+						   ECHO_BENCH_MAX_RUNS);
+	int fd_limit = echo_bench_raise_fd_limit();
+
+	printf("backend\tconns\tactive\treq/s\tns/event\tevents/wait\n");
+	for (int ci = 0; ci < conn_run_count; ++ci) {
+		int conn_count = atoi(count_items[ci]);
+		int active = active_count <= 0 || active_count > conn_count ?
+			conn_count : active_count;
+		for (int bi = 0; bi < backend_count; ++bi) {
+			const struct echo_backend *b = backends[bi];
+			int need = 2 * conn_count + ECHO_BENCH_EXTRA_FDS;
+			if (need > fd_limit || (b->fd_limit != 0 && need > b->fd_limit)) {
+				printf("%s\t%d\t%d\tskipped, needs %d descriptors, the limit is "
+				       "%d\n", b->name, conn_count, active, need,
+				       b->fd_limit != 0 && b->fd_limit < fd_limit ?
+				       b->fd_limit : fd_limit);
+				continue;
+			}
+			struct echo_server *server = echo_server_start(b);
+			if (server == NULL) {
+				perror("server start");
+				return -1;
+			}
+			struct echo_load_result res;
+			if (echo_load_run(echo_server_port(server), conn_count, active,
+					  (uint64_t)duration_ms * 1000000, server, &res) != 0) {
+				perror("load");
+				echo_server_stop(server);
+				return -1;
+			}
+			echo_server_stop(server);
+			double sec = res.duration_ns / 1e9;
+			uint64_t events = res.server.event_count;
+			uint64_t waits = res.server.wait_count;
+			printf("%s\t%d\t%d\t%.0lf\t%.0lf\t\t%.1lf\n", b->name, conn_count,
+			       active, res.request_count / sec,
+			       events == 0 ? 0.0 : (double)res.server.cpu_ns / events,
+			       waits == 0 ? 0.0 : (double)events / waits);
+			fflush(stdout);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,188 @@
+#include "echo.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+enum {
+	/**
+	 * The connections to one server address are limited by the ephemeral
+	 * port range. More of them are spread over 127.0.0.2, 127.0.0.3, ...
+	 */
+	ECHO_LOAD_CONNS_PER_ADDR = 20000,
+	/**
+	 * Connect is done in batches, and the server has to accept a batch
+	 * before the next one. Otherwise the backlog overflows, and the SYNs are
+	 * retried only after a second.
+	 */
+	ECHO_LOAD_CONNECT_BATCH = 256,
+	ECHO_LOAD_READY_CAP = 1024,
+	ECHO_LOAD_WAIT_MS = 100,
+};
+
+struct echo_load_conn {
+	int fd;
+	/** The sent value, the answer must be + 1. */
+	int value;
+	int answer;
+	int size;
+};
+
+static void
+echo_load_wait_accepts(struct echo_server *server, uint64_t count)
+{
+	struct echo_server_stats stats;
+	while (true) {
+		echo_server_stats(server, &stats);
+		if (stats.accept_count >= count)
+			return;
+		usleep(100);
+	}
+}
+
+static int
+echo_load_connect(uint16_t port, int i)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (fd < 0)
+		return -1;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	if (i >= ECHO_LOAD_CONNS_PER_ADDR) {
+		uint32_t host = INADDR_LOOPBACK + 1 + i / ECHO_LOAD_CONNS_PER_ADDR;
+		addr.sin_addr.s_addr = htonl(host);
+#ifdef IP_BIND_ADDRESS_NO_PORT
+		/* The port is picked at connect, by the whole address pair. */
+		int on = 1;
+		setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof(on));
+#endif
+		if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+			goto error;
+	}
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		goto error;
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+		goto error;
+	return fd;
+error:
+	close(fd);
+	return -1;
+}
+
+static int
+echo_load_send(struct echo_load_conn *c)
+{
+	++c->value;
+	c->size = 0;
+	if (send(c->fd, &c->value, sizeof(c->value), 0) != sizeof(c->value))
+		return -1;
+	return 0;
+}
+
+int
+echo_load_run(uint16_t port, int conn_count, int active_count, uint64_t duration_ns,
+	      struct echo_server *server, struct echo_load_result *res)
+{
+	int rc = -1;
+	const struct echo_backend *backend = echo_backend_best();
+	void *impl = backend->create_f();
+	struct echo_load_conn *conns = calloc(conn_count, sizeof(conns[0]));
+	/* Connection by descriptor. */
+	struct echo_load_conn **by_fd = NULL;
+	int by_fd_size = 0;
+	int open_count = 0;
+	if (impl == NULL || conns == NULL)
+		goto out;
+	struct echo_server_stats stats;
+	echo_server_stats(server, &stats);
+	uint64_t accept_base = stats.accept_count;
+	for (int i = 0; i < conn_count; ++i) {
+		if (i % ECHO_LOAD_CONNECT_BATCH == 0)
+			echo_load_wait_accepts(server, accept_base + i);
+		int fd = echo_load_connect(port, i);
+		if (fd < 0)
+			goto out;
+		conns[i].fd = fd;
+		++open_count;
+		if (fd >= by_fd_size)
+			by_fd_size = fd + 1;
+	}
+	echo_load_wait_accepts(server, accept_base + conn_count);
+	by_fd = calloc(by_fd_size, sizeof(by_fd[0]));
+	if (by_fd == NULL)
+		goto out;
+	for (int i = 0; i < active_count; ++i) {
+		struct echo_load_conn *c = &conns[i];
+		by_fd[c->fd] = c;
+		if (backend->add_f(impl, c->fd) != 0)
+			goto out;
+	}
+
+	struct echo_server_stats begin;
+	echo_server_stats(server, &begin);
+	uint64_t start_ns = echo_now_ns();
+	uint64_t deadline = start_ns + duration_ns;
+	for (int i = 0; i < active_count; ++i) {
+		if (echo_load_send(&conns[i]) != 0)
+			goto out;
+	}
+	uint64_t request_count = 0;
+	int ready[ECHO_LOAD_READY_CAP];
+	while (echo_now_ns() < deadline) {
+		int count = backend->wait_f(impl, ready, ECHO_LOAD_READY_CAP,
+					    ECHO_LOAD_WAIT_MS);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			goto out;
+		}
+		for (int i = 0; i < count; ++i) {
+			struct echo_load_conn *c = by_fd[ready[i]];
+			ssize_t n = recv(c->fd, (char *)&c->answer + c->size,
+					 sizeof(c->answer) - c->size, 0);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				continue;
+			if (n <= 0) {
+				fprintf(stderr, "the server closed a connection\n");
+				goto out;
+			}
+			c->size += n;
+			if (c->size < (int)sizeof(c->answer))
+				continue;
+			if (c->answer != c->value + 1) {
+				fprintf(stderr, "wrong answer %d to %d\n", c->answer, c->value);
+				goto out;
+			}
+			++request_count;
+			if (echo_load_send(c) != 0)
+				goto out;
+		}
+	}
+	struct echo_server_stats end;
+	echo_server_stats(server, &end);
+	res->duration_ns = echo_now_ns() - start_ns;
+	res->request_count = request_count;
+	res->server.event_count = end.event_count - begin.event_count;
+	res->server.wait_count = end.wait_count - begin.wait_count;
+	res->server.cpu_ns = end.cpu_ns - begin.cpu_ns;
+	res->server.accept_count = end.accept_count - begin.accept_count;
+	rc = 0;
+out:
+	for (int i = 0; i < open_count; ++i)
+		close(conns[i].fd);
+	free(by_fd);
+	free(conns);
+	if (impl != NULL)
+		backend->destroy_f(impl);
+	return rc;
+}
@@ -0,0 +1,235 @@
+#include "echo.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	ECHO_SERVER_READY_CAP = 1024,
+};
+
+/** A request can come in parts, even though it is just an int. */
+struct echo_conn {
+	int value;
+	int size;
+	bool is_open;
+};
+
+struct echo_server {
+	const struct echo_backend *backend;
+	void *impl;
+	int listener;
+	uint16_t port;
+	/** Written to stop the loop. */
+	int stop_pipe[2];
+	pthread_t thread;
+	/** Indexed by descriptor. */
+	struct echo_conn *conns;
+	int conn_cap;
+	uint64_t event_count;
+	uint64_t wait_count;
+	uint64_t accept_count;
+};
+
+static int
+echo_fd_make_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void
+echo_server_accept(struct echo_server *s)
+{
+	while (true) {
+		int fd = accept(s->listener, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				perror("accept");
+			return;
+		}
+		if (fd >= s->conn_cap) {
+			int cap = s->conn_cap;
+			while (cap <= fd)
+				cap *= 2;
+			struct echo_conn *conns = realloc(s->conns, cap * sizeof(conns[0]));
+			if (conns == NULL) {
+				close(fd);
+				continue;
+			}
+			memset(conns + s->conn_cap, 0,
+			       (cap - s->conn_cap) * sizeof(conns[0]));
+			s->conns = conns;
+			s->conn_cap = cap;
+		}
+		if (echo_fd_make_nonblock(fd) != 0 || s->backend->add_f(s->impl, fd) != 0) {
+			perror("add");
+			close(fd);
+			continue;
+		}
+		s->conns[fd].value = 0;
+		s->conns[fd].size = 0;
+		s->conns[fd].is_open = true;
+		__atomic_store_n(&s->accept_count, s->accept_count + 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void
+echo_server_close(struct echo_server *s, int fd)
+{
+	s->backend->del_f(s->impl, fd);
+	close(fd);
+	s->conns[fd].is_open = false;
+}
+
+/** Same as interact() in the lecture examples. */
+static void
+echo_server_interact(struct echo_server *s, int fd)
+{
+	struct echo_conn *c = &s->conns[fd];
+	ssize_t rc = recv(fd, (char *)&c->value + c->size, sizeof(c->value) - c->size, 0);
+	if (rc == 0) {
+		echo_server_close(s, fd);
+		return;
+	}
+	if (rc < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			echo_server_close(s, fd);
+		return;
+	}
+	c->size += rc;
+	if (c->size < (int)sizeof(c->value))
+		return;
+	c->size = 0;
+	int value = c->value + 1;
+	/* The client waits for the answer before the next request, so it fits. */
+	if (send(fd, &value, sizeof(value), 0) != sizeof(value))
+		echo_server_close(s, fd);
+}
+
+static void *
+echo_server_f(void *arg)
+{
+	struct echo_server *s = arg;
+	int ready[ECHO_SERVER_READY_CAP];
+	while (true) {
+		int count = s->backend->wait_f(s->impl, ready, ECHO_SERVER_READY_CAP, -1);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("wait");
+			break;
+		}
+		__atomic_store_n(&s->wait_count, s->wait_count + 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&s->event_count, s->event_count + count, __ATOMIC_RELAXED);
+		for (int i = 0; i < count; ++i) {
+			int fd = ready[i];
+			if (fd == s->stop_pipe[0])
+				return NULL;
+			if (fd == s->listener)
+				echo_server_accept(s);
+			else
+				echo_server_interact(s, fd);
+		}
+	}
+	return NULL;
+}
+
+struct echo_server *
+echo_server_start(const struct echo_backend *backend)
+{
+	struct echo_server *s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	s->backend = backend;
+	s->conn_cap = 64;
+	s->conns = calloc(s->conn_cap, sizeof(s->conns[0]));
+	s->impl = backend->create_f();
+	s->listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (s->conns == NULL || s->impl == NULL || s->listener < 0)
+		goto error;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = 0;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if (bind(s->listener, (struct sockaddr *)&addr, len) != 0 ||
+	    listen(s->listener, SOMAXCONN) != 0 ||
+	    getsockname(s->listener, (struct sockaddr *)&addr, &len) != 0 ||
+	    echo_fd_make_nonblock(s->listener) != 0)
+		goto error;
+	s->port = ntohs(addr.sin_port);
+	if (pipe(s->stop_pipe) != 0)
+		goto error;
+	if (backend->add_f(s->impl, s->listener) != 0 ||
+	    backend->add_f(s->impl, s->stop_pipe[0]) != 0)
+		goto error_pipe;
+	if (pthread_create(&s->thread, NULL, echo_server_f, s) != 0)
+		goto error_pipe;
+	return s;
+
+error_pipe:
+	close(s->stop_pipe[0]);
+	close(s->stop_pipe[1]);
+error:
+	if (s->listener >= 0)
+		close(s->listener);
+	if (s->impl != NULL)
+		backend->destroy_f(s->impl);
+	free(s->conns);
+	free(s);
+	return NULL;
+}
+
+uint16_t
+echo_server_port(const struct echo_server *s)
+{
+	return s->port;
+}
+
+void
+echo_server_stats(struct echo_server *s, struct echo_server_stats *stats)
+{
+	stats->event_count = __atomic_load_n(&s->event_count, __ATOMIC_RELAXED);
+	stats->wait_count = __atomic_load_n(&s->wait_count, __ATOMIC_RELAXED);
+	stats->accept_count = __atomic_load_n(&s->accept_count, __ATOMIC_RELAXED);
+	stats->cpu_ns = 0;
+#if !defined(__APPLE__)
+	/* Read from outside, so the server doesn't spend time on it. */
+	clockid_t clock;
+	struct timespec ts;
+	if (pthread_getcpuclockid(s->thread, &clock) == 0 &&
+	    clock_gettime(clock, &ts) == 0)
+		stats->cpu_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void
+echo_server_stop(struct echo_server *s)
+{
+	char c = 0;
+	if (write(s->stop_pipe[1], &c, 1) != 1)
+		perror("write");
+	pthread_join(s->thread, NULL);
+	for (int fd = 0; fd < s->conn_cap; ++fd) {
+		if (s->conns[fd].is_open)
+			close(fd);
+	}
+	close(s->stop_pipe[0]);
+	close(s->stop_pipe[1]);
+	close(s->listener);
+	s->backend->destroy_f(s->impl);
+	free(s->conns);
+	free(s);
+}
@@ -0,0 +1,34 @@
+#!/bin/bash
+# Throughput of ext_sort vs sort -n on the same random file. The outputs are
+# compared to be sure both sorted it right.
+#
+# Usage: ./bench.sh [number_count] [chunk_mb]
+
+set -e
+count=${1:-20000000}
+chunk_mb=${2:-256}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+awk -v n="$count" 'BEGIN {
+	srand(1)
+	for (i = 0; i < n; ++i)
+		printf("%d\n", int((rand() - 0.5) * 4000000000))
+}' > "$dir/in.txt"
+echo "input: $count numbers, $(du -m "$dir/in.txt" | cut -f1) MB"
+
+bench() {
+	local name=$1
+	shift
+	local start=$(date +%s%N)
+	"$@"
+	local end=$(date +%s%N)
+	echo "$name: $(( (end - start) / 1000000 )) ms"
+}
+
+bench "ext_sort" ./ext_sort -m "$chunk_mb" -o "$dir/out_ext.txt" "$dir/in.txt" 2>/dev/null
+bench "sort -n" env LC_ALL=C sort -n -o "$dir/out_sort.txt" "$dir/in.txt"
+bench "sort -n --parallel=$(nproc)" env LC_ALL=C sort -n --parallel="$(nproc)" \
+	-S 50% -o "$dir/out_sort.txt" "$dir/in.txt"
+cmp "$dir/out_ext.txt" "$dir/out_sort.txt"
+echo "outputs are equal"
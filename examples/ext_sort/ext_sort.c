@@ -0,0 +1,585 @@
+/**
+ * External sort of big text files with integers, one or more per line. A
+ * grown up version of the sorts in lecture_examples/7_ipc.
+ *
+ * The input files are mapped and cut into chunks. Each chunk is cut further
+ * into a part per thread, and each thread parses and radix-sorts its part.
+ * The parts of a chunk are merged into a sorted run. The runs are merged into
+ * the output. When all the input is one chunk, its parts are merged straight
+ * into the output. The merges are k-way, via a loser tree.
+ *
+ * The runs are binary, stored in unlinked temporary files, and are written
+ * and read via mmap. The output is mapped too.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	/** "-9223372036854775808\n". */
+	NUMBER_MAX_LEN = 21,
+	RADIX_BITS = 8,
+	RADIX_SIZE = 1 << RADIX_BITS,
+	RADIX_PASS_COUNT = 64 / RADIX_BITS,
+	THREAD_MAX_COUNT = 256,
+};
+
+static void
+fail(const char *what)
+{
+	if (errno != 0)
+		perror(what);
+	else
+		fprintf(stderr, "%s\n", what);
+	exit(-1);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool
+is_space(char c)
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+/** {{{ Parsing */
+
+/**
+ * Either the numbers are read or the program is terminated. The range has to
+ * start and end on a number border.
+ */
+static size_t
+parse_numbers(const char *pos, const char *end, int64_t *out)
+{
+	int64_t *begin = out;
+	while (true) {
+		while (pos < end && is_space(*pos))
+			++pos;
+		if (pos == end)
+			break;
+		bool is_neg = *pos == '-';
+		if (is_neg)
+			++pos;
+		if (pos == end || *pos < '0' || *pos > '9') {
+			errno = 0;
+			fail("not a number in the input");
+		}
+		/* Accumulate as negative, so INT64_MIN fits. */
+		int64_t value = 0;
+		while (pos < end && *pos >= '0' && *pos <= '9') {
+			int digit = *pos++ - '0';
+			if (value < (INT64_MIN + digit) / 10) {
+				errno = 0;
+				fail("too big number in the input");
+			}
+			value = value * 10 - digit;
+		}
+		if (pos < end && !is_space(*pos)) {
+			errno = 0;
+			fail("not a number in the input");
+		}
+		if (!is_neg) {
+			if (value == INT64_MIN) {
+				errno = 0;
+				fail("too big number in the input");
+			}
+			value = -value;
+		}
+		*out++ = value;
+	}
+	return out - begin;
+}
+
+/** Move the border forward to the next whitespace, so it doesn't cut a number. */
+static const char *
+border_adjust(const char *pos, const char *end)
+{
+	while (pos < end && !is_space(*pos))
+		++pos;
+	return pos;
+}
+
+/** }}} Parsing */
+
+/** {{{ Radix sort */
+
+static inline uint64_t
+radix_key(int64_t v)
+{
+	/* Flip the sign, so the negative are before the positive as unsigned. */
+	return (uint64_t)v ^ ((uint64_t)1 << 63);
+}
+
+/**
+ * LSD radix sort by 8 bits. The passes where all the numbers have the same
+ * digit are skipped. The result is in the numbers, tmp is of the same size.
+ */
+static void
+radix_sort(int64_t *numbers, int64_t *tmp, size_t count)
+{
+	size_t counts[RADIX_PASS_COUNT][RADIX_SIZE];
+	memset(counts, 0, sizeof(counts));
+	for (size_t i = 0; i < count; ++i) {
+		uint64_t key = radix_key(numbers[i]);
+		for (int p = 0; p < RADIX_PASS_COUNT; ++p)
+			++counts[p][(key >> (p * RADIX_BITS)) & (RADIX_SIZE - 1)];
+	}
+	int64_t *src = numbers;
+	int64_t *dst = tmp;
+	for (int p = 0; p < RADIX_PASS_COUNT; ++p) {
+		size_t *c = counts[p];
+		int shift = p * RADIX_BITS;
+		if (count == 0 || c[(radix_key(src[0]) >> shift) & (RADIX_SIZE - 1)] == count)
+			continue;
+		size_t offset = 0;
+		for (int d = 0; d < RADIX_SIZE; ++d) {
+			size_t n = c[d];
+			c[d] = offset;
+			offset += n;
+		}
+		for (size_t i = 0; i < count; ++i) {
+			int64_t v = src[i];
+			dst[c[(radix_key(v) >> shift) & (RADIX_SIZE - 1)]++] = v;
+		}
+		int64_t *t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != numbers)
+		memcpy(numbers, src, count * sizeof(numbers[0]));
+}
+
+/** }}} Radix sort */
+
+/** {{{ Loser tree */
+
+struct merge_source {
+	const int64_t *pos;
+	const int64_t *end;
+};
+
+/**
+ * K-way merge. The inner nodes keep the source which lost the match there,
+ * the winner of the whole tree is kept separately. Taking the minimum then
+ * costs one path from the leaf to the root, log(k) comparisons.
+ */
+struct loser_tree {
+	struct merge_source *sources;
+	int count;
+	/** Inner nodes, 1 .. count - 1. The leaf of source i is count + i. */
+	int *losers;
+	int winner;
+};
+
+/** Exhausted sources are bigger than any number. */
+static inline bool
+loser_tree_less(const struct loser_tree *t, int a, int b)
+{
+	const struct merge_source *sa = &t->sources[a];
+	const struct merge_source *sb = &t->sources[b];
+	if (sa->pos == sa->end)
+		return false;
+	if (sb->pos == sb->end)
+		return true;
+	return *sa->pos < *sb->pos;
+}
+
+/** Play the match of the subtree, return the winner. */
+static int
+loser_tree_build(struct loser_tree *t, int node)
+{
+	if (node >= t->count)
+		return node - t->count;
+	int left = loser_tree_build(t, 2 * node);
+	int right = loser_tree_build(t, 2 * node + 1);
+	if (loser_tree_less(t, right, left)) {
+		t->losers[node] = left;
+		return right;
+	}
+	t->losers[node] = right;
+	return left;
+}
+
+static void
+loser_tree_create(struct loser_tree *t, struct merge_source *sources, int count)
+{
+	t->sources = sources;
+	t->count = count;
+	t->losers = malloc(count * sizeof(t->losers[0]));
+	if (t->losers == NULL)
+		fail("malloc");
+	t->winner = loser_tree_build(t, 1);
+}
+
+static void
+loser_tree_destroy(struct loser_tree *t)
+{
+	free(t->losers);
+}
+
+/**
+ * Take the minimum.
+ * @retval false All the sources are exhausted.
+ */
+static inline bool
+loser_tree_pop(struct loser_tree *t, int64_t *out)
+{
+	struct merge_source *s = &t->sources[t->winner];
+	if (s->pos == s->end)
+		return false;
+	*out = *s->pos++;
+	int winner = t->winner;
+	for (int node = (t->count + winner) / 2; node > 0; node /= 2) {
+		int loser = t->losers[node];
+		if (loser_tree_less(t, loser, winner)) {
+			t->losers[node] = winner;
+			winner = loser;
+		}
+	}
+	t->winner = winner;
+	return true;
+}
+
+/** }}} Loser tree */
+
+/** {{{ Output */
+
+/** Print the number with the line end, return the length. */
+static inline size_t
+number_print(int64_t v, char *out)
+{
+	char buf[NUMBER_MAX_LEN];
+	char *pos = buf + sizeof(buf);
+	*--pos = '\n';
+	uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+	do {
+		*--pos = '0' + u % 10;
+		u /= 10;
+	} while (u != 0);
+	if (v < 0)
+		*--pos = '-';
+	size_t len = buf + sizeof(buf) - pos;
+	memcpy(out, pos, len);
+	return len;
+}
+
+/**
+ * Map a file of the given size for writing. It is sparse, so an upper bound is
+ * fine as the size, if the file is truncated to the real size after.
+ */
+static void *
+file_map_write(int fd, size_t size)
+{
+	if (ftruncate(fd, size) != 0)
+		fail("ftruncate");
+	if (size == 0)
+		return NULL;
+	void *res = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (res == MAP_FAILED)
+		fail("mmap");
+	return res;
+}
+
+/** Merge into the text output. */
+static void
+merge_to_text(struct merge_source *sources, int count, size_t total, int fd)
+{
+	size_t cap = total * NUMBER_MAX_LEN;
+	char *out = file_map_write(fd, cap);
+	char *pos = out;
+	struct loser_tree t;
+	loser_tree_create(&t, sources, count);
+	int64_t v;
+	while (loser_tree_pop(&t, &v))
+		pos += number_print(v, pos);
+	loser_tree_destroy(&t);
+	size_t size = pos - out;
+	if (cap != 0)
+		munmap(out, cap);
+	if (ftruncate(fd, size) != 0)
+		fail("ftruncate");
+}
+
+/** }}} Output */
+
+/** {{{ Chunks and runs */
+
+struct ext_sort {
+	int thread_count;
+	size_t chunk_size;
+	const char *tmp_dir;
+	/** Sorted binary runs of the chunks. */
+	struct run *runs;
+	int run_count;
+	int run_cap;
+	size_t total;
+};
+
+struct run {
+	int fd;
+	size_t count;
+	const int64_t *numbers;
+};
+
+struct part {
+	const char *begin;
+	const char *end;
+	int64_t *numbers;
+	size_t count;
+};
+
+static void *
+part_sort_f(void *arg)
+{
+	struct part *p = arg;
+	/* Each number takes at least 2 bytes, the digit and the border. */
+	size_t cap = (p->end - p->begin) / 2 + 1;
+	p->numbers = malloc(cap * sizeof(p->numbers[0]));
+	int64_t *tmp = malloc(cap * sizeof(tmp[0]));
+	if (p->numbers == NULL || tmp == NULL)
+		fail("malloc");
+	p->count = parse_numbers(p->begin, p->end, p->numbers);
+	radix_sort(p->numbers, tmp, p->count);
+	free(tmp);
+	return NULL;
+}
+
+/** Parse and sort a part of the chunk per thread. */
+static void
+chunk_sort(const struct ext_sort *s, const char *begin, const char *end,
+	   struct part *parts)
+{
+	size_t step = (end - begin) / s->thread_count + 1;
+	const char *pos = begin;
+	pthread_t threads[THREAD_MAX_COUNT];
+	for (int i = 0; i < s->thread_count; ++i) {
+		parts[i].begin = pos;
+		pos = (size_t)(end - pos) > step ? border_adjust(pos + step, end) : end;
+		parts[i].end = pos;
+		if (pthread_create(&threads[i], NULL, part_sort_f, &parts[i]) != 0)
+			fail("pthread_create");
+	}
+	for (int i = 0; i < s->thread_count; ++i)
+		pthread_join(threads[i], NULL);
+}
+
+static void
+parts_to_sources(const struct part *parts, int count, struct merge_source *sources,
+		 size_t *total)
+{
+	*total = 0;
+	for (int i = 0; i < count; ++i) {
+		sources[i].pos = parts[i].numbers;
+		sources[i].end = parts[i].numbers + parts[i].count;
+		*total += parts[i].count;
+	}
+}
+
+static void
+parts_free(struct part *parts, int count)
+{
+	for (int i = 0; i < count; ++i)
+		free(parts[i].numbers);
+}
+
+/** Merge the parts of the chunk into a new run. */
+static void
+run_add(struct ext_sort *s, struct part *parts)
+{
+	struct merge_source sources[THREAD_MAX_COUNT];
+	size_t count;
+	parts_to_sources(parts, s->thread_count, sources, &count);
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/ext_sort_XXXXXX", s->tmp_dir);
+	int fd = mkstemp(path);
+	if (fd < 0)
+		fail("mkstemp");
+	/* Is deleted when closed. */
+	unlink(path);
+	int64_t *out = file_map_write(fd, count * sizeof(out[0]));
+	struct loser_tree t;
+	loser_tree_create(&t, sources, s->thread_count);
+	for (size_t i = 0; loser_tree_pop(&t, &out[i]); ++i);
+	loser_tree_destroy(&t);
+	if (count != 0)
+		munmap(out, count * sizeof(out[0]));
+
+	if (s->run_count == s->run_cap) {
+		s->run_cap = s->run_cap == 0 ? 16 : s->run_cap * 2;
+		s->runs = realloc(s->runs, s->run_cap * sizeof(s->runs[0]));
+		if (s->runs == NULL)
+			fail("realloc");
+	}
+	struct run *r = &s->runs[s->run_count++];
+	r->fd = fd;
+	r->count = count;
+	r->numbers = NULL;
+	s->total += count;
+}
+
+/** Merge all the runs into the output. */
+static void
+runs_merge(struct ext_sort *s, int out_fd)
+{
+	struct merge_source *sources = malloc(s->run_count * sizeof(sources[0]));
+	if (sources == NULL)
+		fail("malloc");
+	for (int i = 0; i < s->run_count; ++i) {
+		struct run *r = &s->runs[i];
+		if (r->count != 0) {
+			void *mem = mmap(NULL, r->count * sizeof(int64_t), PROT_READ,
+					 MAP_PRIVATE, r->fd, 0);
+			if (mem == MAP_FAILED)
+				fail("mmap");
+			madvise(mem, r->count * sizeof(int64_t), MADV_SEQUENTIAL);
+			r->numbers = mem;
+		}
+		sources[i].pos = r->numbers;
+		sources[i].end = r->numbers + r->count;
+	}
+	merge_to_text(sources, s->run_count, s->total, out_fd);
+	for (int i = 0; i < s->run_count; ++i) {
+		struct run *r = &s->runs[i];
+		if (r->count != 0)
+			munmap((void *)r->numbers, r->count * sizeof(int64_t));
+		close(r->fd);
+	}
+	free(sources);
+	free(s->runs);
+}
+
+/** }}} Chunks and runs */
+
+struct input {
+	int fd;
+	const char *data;
+	size_t size;
+};
+
+static void
+usage(void)
+{
+	printf("Usage: ext_sort [-j threads] [-m chunk_mb] [-t tmp_dir] -o output "
+	       "input...\n");
+	exit(-1);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t start_ns = now_ns();
+	struct ext_sort s;
+	memset(&s, 0, sizeof(s));
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	s.thread_count = cpu_count > 0 ? cpu_count : 1;
+	s.chunk_size = 256;
+	s.tmp_dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+	const char *out_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "j:m:t:o:")) != -1) {
+		switch (opt) {
+		case 'j':
+			s.thread_count = atoi(optarg);
+			break;
+		case 'm':
+			s.chunk_size = atoll(optarg);
+			break;
+		case 't':
+			s.tmp_dir = optarg;
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (out_path == NULL || optind == argc || s.thread_count <= 0 ||
+	    s.chunk_size == 0)
+		usage();
+	if (s.thread_count > THREAD_MAX_COUNT)
+		s.thread_count = THREAD_MAX_COUNT;
+	s.chunk_size *= 1024 * 1024;
+
+	int input_count = argc - optind;
+	struct input *inputs = malloc(input_count * sizeof(inputs[0]));
+	if (inputs == NULL)
+		fail("malloc");
+	size_t input_size = 0;
+	for (int i = 0; i < input_count; ++i) {
+		struct input *in = &inputs[i];
+		in->fd = open(argv[optind + i], O_RDONLY);
+		if (in->fd < 0)
+			fail(argv[optind + i]);
+		struct stat st;
+		if (fstat(in->fd, &st) != 0)
+			fail("fstat");
+		in->size = st.st_size;
+		in->data = NULL;
+		if (in->size != 0) {
+			in->data = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+			if (in->data == MAP_FAILED)
+				fail("mmap");
+			madvise((void *)in->data, in->size, MADV_SEQUENTIAL);
+		}
+		input_size += in->size;
+	}
+	int out_fd = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (out_fd < 0)
+		fail(out_path);
+
+	struct part parts[THREAD_MAX_COUNT];
+	if (input_count == 1 && input_size <= s.chunk_size) {
+		/* All fits into one chunk, no runs needed. */
+		chunk_sort(&s, inputs[0].data, inputs[0].data + inputs[0].size, parts);
+		struct merge_source sources[THREAD_MAX_COUNT];
+		size_t total;
+		parts_to_sources(parts, s.thread_count, sources, &total);
+		merge_to_text(sources, s.thread_count, total, out_fd);
+		parts_free(parts, s.thread_count);
+	} else {
+		for (int i = 0; i < input_count; ++i) {
+			const char *pos = inputs[i].data;
+			const char *end = pos + inputs[i].size;
+			while (pos < end) {
+				const char *next = (size_t)(end - pos) > s.chunk_size ?
+					border_adjust(pos + s.chunk_size, end) : end;
+				chunk_sort(&s, pos, next, parts);
+				run_add(&s, parts);
+				parts_free(parts, s.thread_count);
+				/* The chunk is not needed anymore, don't keep it cached. */
+				madvise((void *)pos, next - pos, MADV_DONTNEED);
+				pos = next;
+			}
+		}
+		runs_merge(&s, out_fd);
+	}
+	close(out_fd);
+	for (int i = 0; i < input_count; ++i) {
+		if (inputs[i].size != 0)
+			munmap((void *)inputs[i].data, inputs[i].size);
+		close(inputs[i].fd);
+	}
+	free(inputs);
+	double sec = (now_ns() - start_ns) / 1000000000.0;
+	fprintf(stderr, "sort time = %lfs, %.1lf MB/s\n", sec,
+		input_size / sec / 1024 / 1024);
+	return 0;
+}
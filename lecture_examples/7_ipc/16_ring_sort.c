@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <stdint.h>
+#include "../../utils/shm_ring.h"
+
+/*
+ * Same as 3_mem_sort.c, but the shared memory is a ring from
+ * utils/shm_ring.h. The writer doesn't wait for the reader to take the whole
+ * buffer, both work at the same time on the different parts of the ring. And
+ * when one has to wait for another, it sleeps on a futex instead of spinning.
+ */
+
+#define RING_SIZE 65536
+
+struct worker {
+	struct shm_ring *ring;
+	int *array;
+	int size;
+	int id;
+};
+
+int
+cmp(const void *a, const void *b)
+{
+	return *(int *)a - *(int *)b;
+}
+
+void
+sorter(struct worker *worker, const char *filename)
+{
+	FILE *file = fopen(filename, "r");
+	int size = 0;
+	int capacity = 1024;
+	int *array = malloc(capacity * sizeof(int));
+	while (fscanf(file, "%d", &array[size]) > 0) {
+		++size;
+		if (size == capacity) {
+			capacity *= 2;
+			array = realloc(array, capacity * sizeof(int));
+		}
+	}
+	qsort(array, size, sizeof(int), cmp);
+	fclose(file);
+	printf("Worker %d sorted %d numbers\n", worker->id, size);
+	shm_ring_write(worker->ring, &size, sizeof(size));
+	shm_ring_write(worker->ring, array, sizeof(int) * size);
+	free(array);
+}
+
+int
+main(int argc, const char **argv)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t start_ns = ts.tv_sec * 1000000000 + ts.tv_nsec;
+	int nfiles = argc - 1;
+	struct worker *workers = malloc(sizeof(struct worker) * nfiles);
+	struct worker *w = workers;
+	for (int i = 0; i < nfiles; ++i, ++w) {
+		w->id = i;
+		w->ring = shm_ring_new(RING_SIZE);
+		if (fork() == 0) {
+			sorter(w, argv[i + 1]);
+			free(workers);
+			return 0;
+		}
+	}
+	int total_size = 0;
+	w = workers;
+	for (int i = 0; i < nfiles; ++i, ++w) {
+		shm_ring_read(w->ring, &w->size, sizeof(w->size));
+		w->array = malloc(w->size * sizeof(int));
+		shm_ring_read(w->ring, w->array, w->size * sizeof(int));
+		printf("Got %d numbers from worker %d\n", w->size, w->id);
+		wait(NULL);
+		shm_ring_delete(w->ring);
+		total_size += w->size;
+	}
+	int *total_array = malloc(total_size * sizeof(int));
+	int *pos = total_array;
+	w = workers;
+	for (int i = 0; i < nfiles; ++i, ++w) {
+		memcpy(pos, w->array, w->size * sizeof(int));
+		pos += w->size;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t end_ns = ts.tv_sec * 1000000000 + ts.tv_nsec;
+	double sec = (end_ns - start_ns) / 1000000000.0;
+	printf("presort time = %lfs\n", sec);
+	return 0;
+}
@@ -0,0 +1,443 @@
+#pragma once
+
+/**
+ * Allocators for the memory of a known lifetime or of a few fixed sizes.
+ *
+ * - arena - bump allocator. Takes memory from big mapped chunks, frees it
+ *   only all at once. Not thread-safe.
+ *
+ * - slab_pool - objects of one size on top of an arena. Thread-safe, the
+ *   freed objects are kept in a lock-free stack and never go back to the
+ *   system until the pool is destroyed.
+ *
+ * - slab_cache - a thread's cache of a slab_pool. Usually a thread_local
+ *   object per pool. Takes and returns the objects in batches, so the shared
+ *   stack is touched once per many operations.
+ *
+ * - slab_set - slab pools of power-of-2 size classes, for the buffers of
+ *   different sizes.
+ *
+ * The chunks can be backed by huge pages. With ARENA_HUGETLB they are taken
+ * from the reserved pool of the explicit huge pages (/proc/sys/vm/nr_hugepages).
+ * When there are none, the usual pages are used. With ARENA_THP the chunks
+ * are advised to be transparent huge pages.
+ *
+ * Under heap_help each chunk is accounted as an allocation, so the arenas
+ * which are never destroyed are reported as leaks.
+ */
+#include "lflist.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+enum {
+	ARENA_PAGE_SIZE = 4096,
+	ARENA_HUGE_PAGE_SIZE = 2 * 1024 * 1024,
+	ARENA_CHUNK_SIZE_DEFAULT = ARENA_HUGE_PAGE_SIZE,
+	/** Objects moved between a slab_cache and its pool at once. */
+	SLAB_CACHE_BATCH = 32,
+	/** When a cache has more objects, a batch of them goes back to the pool. */
+	SLAB_CACHE_MAX = 2 * SLAB_CACHE_BATCH,
+	SLAB_SET_MIN_SIZE = 16,
+	SLAB_SET_CLASS_COUNT = 13,
+	/** 64KB. */
+	SLAB_SET_MAX_SIZE = SLAB_SET_MIN_SIZE << (SLAB_SET_CLASS_COUNT - 1),
+};
+
+enum arena_flag {
+	/** Explicit huge pages, if available. */
+	ARENA_HUGETLB = 1 << 0,
+	/** Transparent huge pages. */
+	ARENA_THP = 1 << 1,
+};
+
+/**
+ * heap_help accounting, when it is linked into the process. The names are
+ * not mangled, so the weak references resolve from C and C++ alike.
+ */
+void
+heaph_trace(void *ptr, size_t size) __attribute__((weak));
+
+void
+heaph_untrace(void *ptr) __attribute__((weak));
+
+/** {{{ Memory mapping */
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	/** Of the whole mapping, together with this header. */
+	size_t size;
+};
+
+static inline size_t
+arena_round_up(size_t size, size_t align)
+{
+	return (size + align - 1) & ~(align - 1);
+}
+
+static inline struct arena_chunk *
+arena_chunk_new(size_t size, int flags)
+{
+	void *mem = MAP_FAILED;
+	if ((flags & ARENA_HUGETLB) != 0) {
+		size_t huge_size = arena_round_up(size, ARENA_HUGE_PAGE_SIZE);
+		mem = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED)
+			size = huge_size;
+	}
+	if (mem == MAP_FAILED) {
+		if ((flags & (ARENA_HUGETLB | ARENA_THP)) != 0)
+			size = arena_round_up(size, ARENA_HUGE_PAGE_SIZE);
+		else
+			size = arena_round_up(size, ARENA_PAGE_SIZE);
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		/* Only a hint. Without THP in the kernel it fails, and it is fine. */
+		if ((flags & (ARENA_HUGETLB | ARENA_THP)) != 0)
+			madvise(mem, size, MADV_HUGEPAGE);
+#endif
+	}
+	struct arena_chunk *chunk = (struct arena_chunk *)mem;
+	chunk->next = NULL;
+	chunk->size = size;
+	if (heaph_trace != NULL)
+		heaph_trace(mem, size);
+	return chunk;
+}
+
+static inline void
+arena_chunk_delete(struct arena_chunk *chunk)
+{
+	if (heaph_untrace != NULL)
+		heaph_untrace(chunk);
+	munmap(chunk, chunk->size);
+}
+
+/** }}} Memory mapping */
+
+/** {{{ Arena */
+
+struct arena {
+	/** The newest one is first, the allocations are done from it. */
+	struct arena_chunk *chunks;
+	char *pos;
+	char *end;
+	size_t chunk_size;
+	int flags;
+	/** Of all the chunks. */
+	size_t mapped_size;
+};
+
+/**
+ * @param chunk_size Size of each mapping. Zero means the default. An
+ *        allocation bigger than that gets its own chunk.
+ * @param flags Mask of arena_flag.
+ */
+static inline void
+arena_create(struct arena *a, size_t chunk_size, int flags)
+{
+	a->chunks = NULL;
+	a->pos = NULL;
+	a->end = NULL;
+	a->chunk_size = chunk_size != 0 ? chunk_size : (size_t)ARENA_CHUNK_SIZE_DEFAULT;
+	a->flags = flags;
+	a->mapped_size = 0;
+}
+
+static inline void
+arena_destroy(struct arena *a)
+{
+	struct arena_chunk *chunk = a->chunks;
+	while (chunk != NULL) {
+		struct arena_chunk *next = chunk->next;
+		arena_chunk_delete(chunk);
+		chunk = next;
+	}
+	a->chunks = NULL;
+	a->pos = NULL;
+	a->end = NULL;
+	a->mapped_size = 0;
+}
+
+/**
+ * Allocate memory of the given size and alignment, which must be a power of 2.
+ * @retval NULL The system is out of memory.
+ */
+static inline void *
+arena_alloc_aligned(struct arena *a, size_t size, size_t align)
+{
+	assert(align != 0 && (align & (align - 1)) == 0);
+	char *res = (char *)arena_round_up((uintptr_t)a->pos, align);
+	if (a->pos != NULL && res <= a->end && size <= (size_t)(a->end - res)) {
+		a->pos = res + size;
+		return res;
+	}
+	size_t need = sizeof(struct arena_chunk) + align + size;
+	struct arena_chunk *chunk = arena_chunk_new(
+		need > a->chunk_size ? need : a->chunk_size, a->flags);
+	if (chunk == NULL)
+		return NULL;
+	chunk->next = a->chunks;
+	a->chunks = chunk;
+	a->mapped_size += chunk->size;
+	res = (char *)arena_round_up((uintptr_t)(chunk + 1), align);
+	a->pos = res + size;
+	a->end = (char *)chunk + chunk->size;
+	return res;
+}
+
+static inline void *
+arena_alloc(struct arena *a, size_t size)
+{
+	return arena_alloc_aligned(a, size, sizeof(void *));
+}
+
+/**
+ * Free all the allocations at once. The newest chunk is kept for the next
+ * ones, the others are unmapped.
+ */
+static inline void
+arena_reset(struct arena *a)
+{
+	struct arena_chunk *chunk = a->chunks;
+	if (chunk == NULL)
+		return;
+	struct arena_chunk *old = chunk->next;
+	while (old != NULL) {
+		struct arena_chunk *next = old->next;
+		a->mapped_size -= old->size;
+		arena_chunk_delete(old);
+		old = next;
+	}
+	chunk->next = NULL;
+	a->pos = (char *)(chunk + 1);
+}
+
+/** }}} Arena */
+
+/** {{{ Slab pool */
+
+struct slab_pool {
+	/** The freed objects. Their memory stays mapped, as lf_stack wants. */
+	struct lf_stack free_objs;
+	/** Protects the arena. */
+	pthread_mutex_t mutex;
+	struct arena arena;
+	size_t obj_size;
+};
+
+/**
+ * @param obj_size Size of each object. The objects are aligned by the
+ *        pointer size, or by 16 when they are not smaller than that.
+ */
+static inline void
+slab_pool_create(struct slab_pool *p, size_t obj_size, size_t chunk_size, int flags)
+{
+	lf_stack_create(&p->free_objs);
+	pthread_mutex_init(&p->mutex, NULL);
+	arena_create(&p->arena, chunk_size, flags);
+	if (obj_size < sizeof(struct lf_link))
+		obj_size = sizeof(struct lf_link);
+	p->obj_size = arena_round_up(obj_size, obj_size >= 16 ? 16 : sizeof(void *));
+}
+
+/**
+ * All the objects are freed, including the ones not returned to the pool and
+ * the ones in the caches.
+ */
+static inline void
+slab_pool_destroy(struct slab_pool *p)
+{
+	arena_destroy(&p->arena);
+	pthread_mutex_destroy(&p->mutex);
+}
+
+/**
+ * Allocate up to the given count of new objects, linked via their first
+ * bytes.
+ * @retval Number of the allocated objects. Zero if out of memory.
+ */
+static inline int
+slab_pool_alloc_new(struct slab_pool *p, int count, struct lf_link **head)
+{
+	pthread_mutex_lock(&p->mutex);
+	int res = 0;
+	for (; res < count; ++res) {
+		struct lf_link *obj = (struct lf_link *)arena_alloc_aligned(
+			&p->arena, p->obj_size, p->obj_size >= 16 ? 16 : sizeof(void *));
+		if (obj == NULL)
+			break;
+		obj->next = *head;
+		*head = obj;
+	}
+	pthread_mutex_unlock(&p->mutex);
+	return res;
+}
+
+/**
+ * @retval NULL Out of memory.
+ */
+static inline void *
+slab_pool_alloc(struct slab_pool *p)
+{
+	struct lf_link *obj = lf_stack_pop(&p->free_objs);
+	if (obj != NULL)
+		return obj;
+	if (slab_pool_alloc_new(p, 1, &obj) == 0)
+		return NULL;
+	return obj;
+}
+
+static inline void
+slab_pool_free(struct slab_pool *p, void *ptr)
+{
+	lf_stack_push(&p->free_objs, (struct lf_link *)ptr);
+}
+
+/** }}} Slab pool */
+
+/** {{{ Slab cache */
+
+struct slab_cache {
+	struct slab_pool *pool;
+	struct lf_link *objs;
+	int count;
+};
+
+static inline void
+slab_cache_create(struct slab_cache *c, struct slab_pool *pool)
+{
+	c->pool = pool;
+	c->objs = NULL;
+	c->count = 0;
+}
+
+/**
+ * Return all the cached objects to the pool. Must be done before the thread
+ * owning the cache exits, or its objects are not reused until the pool is
+ * destroyed.
+ */
+static inline void
+slab_cache_flush(struct slab_cache *c)
+{
+	while (c->objs != NULL) {
+		struct lf_link *obj = c->objs;
+		c->objs = obj->next;
+		lf_stack_push(&c->pool->free_objs, obj);
+	}
+	c->count = 0;
+}
+
+/**
+ * @retval NULL Out of memory.
+ */
+static inline void *
+slab_cache_alloc(struct slab_cache *c)
+{
+	if (c->objs == NULL) {
+		assert(c->count == 0);
+		struct lf_link *obj;
+		while (c->count < SLAB_CACHE_BATCH &&
+		       (obj = lf_stack_pop(&c->pool->free_objs)) != NULL) {
+			obj->next = c->objs;
+			c->objs = obj;
+			++c->count;
+		}
+		if (c->count == 0) {
+			c->count = slab_pool_alloc_new(c->pool, SLAB_CACHE_BATCH, &c->objs);
+			if (c->count == 0)
+				return NULL;
+		}
+	}
+	struct lf_link *res = c->objs;
+	c->objs = res->next;
+	--c->count;
+	return res;
+}
+
+static inline void
+slab_cache_free(struct slab_cache *c, void *ptr)
+{
+	struct lf_link *obj = (struct lf_link *)ptr;
+	obj->next = c->objs;
+	c->objs = obj;
+	if (++c->count <= SLAB_CACHE_MAX)
+		return;
+	for (int i = 0; i < SLAB_CACHE_BATCH; ++i) {
+		obj = c->objs;
+		c->objs = obj->next;
+		lf_stack_push(&c->pool->free_objs, obj);
+	}
+	c->count -= SLAB_CACHE_BATCH;
+}
+
+/** }}} Slab cache */
+
+/** {{{ Slab set */
+
+struct slab_set {
+	struct slab_pool pools[SLAB_SET_CLASS_COUNT];
+};
+
+static inline void
+slab_set_create(struct slab_set *s, size_t chunk_size, int flags)
+{
+	for (int i = 0; i < SLAB_SET_CLASS_COUNT; ++i)
+		slab_pool_create(&s->pools[i], SLAB_SET_MIN_SIZE << i, chunk_size, flags);
+}
+
+static inline void
+slab_set_destroy(struct slab_set *s)
+{
+	for (int i = 0; i < SLAB_SET_CLASS_COUNT; ++i)
+		slab_pool_destroy(&s->pools[i]);
+}
+
+/**
+ * The pool of the smallest class fitting the size.
+ * @pre size <= SLAB_SET_MAX_SIZE
+ */
+static inline struct slab_pool *
+slab_set_pool(struct slab_set *s, size_t size)
+{
+	assert(size <= SLAB_SET_MAX_SIZE);
+	if (size <= SLAB_SET_MIN_SIZE)
+		return &s->pools[0];
+	int idx = 64 - __builtin_clzll((unsigned long long)(size - 1)) -
+		  __builtin_ctz(SLAB_SET_MIN_SIZE);
+	return &s->pools[idx];
+}
+
+/**
+ * @pre size <= SLAB_SET_MAX_SIZE
+ * @retval NULL Out of memory.
+ */
+static inline void *
+slab_set_alloc(struct slab_set *s, size_t size)
+{
+	return slab_pool_alloc(slab_set_pool(s, size));
+}
+
+/** The size must be the same as at allocation. */
+static inline void
+slab_set_free(struct slab_set *s, void *ptr, size_t size)
+{
+	slab_pool_free(slab_set_pool(s, size), ptr);
+}
+
+/** }}} Slab set */
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
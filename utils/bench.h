@@ -0,0 +1,179 @@
+#pragma once
+
+/**
+ * Microbenchmark harness. A benchmark is a function doing the measured
+ * operation the given number of times. The harness picks the number of
+ * iterations so one run takes long enough for the clock, warms up, then
+ * does several runs and reports the time per iteration of them as one JSON
+ * line. The lines of different commits can be compared by any script.
+ *
+ *     static void
+ *     my_bench_f(void *ctx, uint64_t iter_count)
+ *     {
+ *             for (uint64_t i = 0; i < iter_count; ++i)
+ *                     bench_escape(do_something(ctx));
+ *     }
+ *
+ *     struct bench_result res;
+ *     bench_run("something", my_bench_f, ctx, &res);
+ *     bench_report(&res);
+ *
+ * Prints:
+ *     {"name": "something", "iter_count": 65536, "run_count": 20,
+ *      "min_ns": 10.1, "median_ns": 10.3, "p90_ns": 10.9, "p99_ns": 11.5,
+ *      "max_ns": 11.5}
+ * in one line.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef void (*bench_f)(void *ctx, uint64_t iter_count);
+
+struct bench_opts {
+	/** Runs which are not counted. To warm up the caches and the branch predictor. */
+	int warmup_count;
+	/** Counted runs. */
+	int run_count;
+	/** The iteration count is doubled until one run takes at least that long. */
+	uint64_t min_run_ns;
+	/**
+	 * Fixed iteration count of a run, when the scenario defines it. Zero means it is
+	 * picked via min_run_ns.
+	 */
+	uint64_t iter_count;
+};
+
+#define BENCH_OPTS_DEFAULT {3, 20, 10000000, 0}
+
+/** All the times are nanoseconds per iteration. */
+struct bench_result {
+	const char *name;
+	uint64_t iter_count;
+	int run_count;
+	double min_ns;
+	double median_ns;
+	double p90_ns;
+	double p99_ns;
+	double max_ns;
+};
+
+static inline uint64_t
+bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Make the compiler think the value is used, so it doesn't drop the computation. */
+#define bench_escape(value) do {						\
+	__typeof__(value) bench_escape_v = (value);				\
+	__asm__ volatile("" : : "g"(&bench_escape_v) : "memory");		\
+} while (0)
+
+static inline int
+bench_cmp_double(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r ? 1 : 0;
+}
+
+/** Nearest rank. The samples must be sorted. */
+static inline double
+bench_percentile(const double *samples, int count, int percent)
+{
+	int idx = (count * percent + 99) / 100 - 1;
+	if (idx < 0)
+		idx = 0;
+	return samples[idx];
+}
+
+static inline double
+bench_run_once(bench_f f, void *ctx, uint64_t iter_count)
+{
+	uint64_t start = bench_now_ns();
+	f(ctx, iter_count);
+	return (double)(bench_now_ns() - start);
+}
+
+static inline void
+bench_run_opts(const char *name, bench_f f, void *ctx,
+	       const struct bench_opts *opts, struct bench_result *res)
+{
+	uint64_t iter_count = opts->iter_count;
+	if (iter_count == 0) {
+		iter_count = 1;
+		while (bench_run_once(f, ctx, iter_count) < opts->min_run_ns &&
+		       iter_count < (UINT64_MAX >> 1))
+			iter_count *= 2;
+	}
+	for (int i = 0; i < opts->warmup_count; ++i)
+		bench_run_once(f, ctx, iter_count);
+
+	int count = opts->run_count > 0 ? opts->run_count : 1;
+	double *samples = (double *)malloc(count * sizeof(samples[0]));
+	if (samples == NULL)
+		abort();
+	for (int i = 0; i < count; ++i)
+		samples[i] = bench_run_once(f, ctx, iter_count) / iter_count;
+	qsort(samples, count, sizeof(samples[0]), bench_cmp_double);
+
+	res->name = name;
+	res->iter_count = iter_count;
+	res->run_count = count;
+	res->min_ns = samples[0];
+	res->median_ns = samples[count / 2];
+	res->p90_ns = bench_percentile(samples, count, 90);
+	res->p99_ns = bench_percentile(samples, count, 99);
+	res->max_ns = samples[count - 1];
+	free(samples);
+}
+
+static inline void
+bench_run(const char *name, bench_f f, void *ctx, struct bench_result *res)
+{
+	struct bench_opts opts = BENCH_OPTS_DEFAULT;
+	bench_run_opts(name, f, ctx, &opts, res);
+}
+
+static inline void
+bench_print_name(const char *name)
+{
+	printf("{\"name\": \"");
+	for (const char *c = name; *c != 0; ++c) {
+		if (*c == '"' || *c == '\\')
+			putchar('\\');
+		putchar(*c);
+	}
+	printf("\"");
+}
+
+/** One JSON object per line. */
+static inline void
+bench_report(const struct bench_result *res)
+{
+	bench_print_name(res->name);
+	printf(", \"iter_count\": %llu, \"run_count\": %d, \"min_ns\": %.2lf, "
+	       "\"median_ns\": %.2lf, \"p90_ns\": %.2lf, \"p99_ns\": %.2lf, "
+	       "\"max_ns\": %.2lf}\n", (unsigned long long)res->iter_count,
+	       res->run_count, res->min_ns, res->median_ns, res->p90_ns,
+	       res->p99_ns, res->max_ns);
+	fflush(stdout);
+}
+
+/** Same, but as MB per second, when each iteration moves the given number of bytes. */
+static inline void
+bench_report_throughput(const struct bench_result *res, uint64_t iter_size)
+{
+	double mb = (double)iter_size / (1024 * 1024);
+	bench_print_name(res->name);
+	printf(", \"iter_count\": %llu, \"run_count\": %d, \"min_mb_per_sec\": %.2lf, "
+	       "\"median_mb_per_sec\": %.2lf, \"max_mb_per_sec\": %.2lf}\n",
+	       (unsigned long long)res->iter_count, res->run_count,
+	       mb * 1e9 / res->max_ns, mb * 1e9 / res->median_ns,
+	       mb * 1e9 / res->min_ns);
+	fflush(stdout);
+}
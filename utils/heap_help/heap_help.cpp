@@ -1,21 +1,37 @@
+#include "heap_help.h"
+
+#include "../lock.h"
+
 #include <cstdlib>
 #include <cxxabi.h>
 #include <dlfcn.h>
 #include <execinfo.h>
-#include <map>
+#include <malloc.h>
 #include <new>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
-#include <mutex>
+#include <algorithm>
+#include <atomic>
 
 namespace
 {
 enum {
 	MAX_BACKTRACE_LEN = 64,
 	ALLOCATION_BATCH_SIZE = 1024,
+	// The allocations are spread over the shards by hash of their address. Each shard has
+	// its own lock, so the threads rarely wait for each other. Must be a power of 2.
+	SHARD_COUNT = 64,
+	// Same for the unique stacks, by hash of their frames.
+	STACK_SHARD_COUNT = 16,
+	TABLE_MIN_CAPACITY = 64,
+	// Frames shown for a site in the profile's table. The full stacks are in the folded
+	// file.
+	PROFILE_SITE_FRAME_COUNT = 4,
 };
 
 enum report_mode {
@@ -42,11 +58,28 @@ enum content_mode {
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// Unique stack. All the allocations done from the same place share it. They are never
+// freed, there are as many of them as places doing allocations.
+struct stack_trace {
+	uint64_t hash;
+	int size;
+	// Profile of the site. Updated without locks, by any thread.
+	std::atomic_uint64_t alloc_count;
+	std::atomic_uint64_t alloc_size;
+	std::atomic_uint64_t free_count;
+	std::atomic_uint64_t live_size;
+	std::atomic_uint64_t peak_live_size;
+	// Sum of the lifetimes of the freed allocations.
+	std::atomic_uint64_t lifetime_ns;
+	void *frames[];
+};
+
 // Single allocation done on the heap by a user.
 struct allocation {
-	void *trace[MAX_BACKTRACE_LEN];
-	int trace_size;
-	int depth;
+	// Null if the backtrace wasn't taken.
+	stack_trace *trace;
+	// Only in the profile mode.
+	uint64_t time_ns;
 	void *mem;
 	size_t size;
 	allocation *next;
@@ -66,6 +99,72 @@ struct symbol {
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+#ifdef HEAP_HELP_PRELOAD
+
+// The preloaded library hooks malloc() and the others of the libc, and new/delete come
+// to them via libstdc++. The originals are called via their internal names, they are
+// there before any symbol lookup works.
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+}
+
+// Set while the heap help itself works in this thread. Its own allocations, including
+// the ones of backtrace() and of stdio, go to the libc untraced then. Otherwise they
+// would recurse into it, and take the locks which it holds already.
+static thread_local bool glob_is_inside;
+// The report is started, and then the tables are destroyed. The allocations and frees
+// which come after that, from the other destructors and atexit handlers, go to the libc
+// as is.
+static std::atomic_bool glob_is_stopped;
+
+struct inside_guard {
+	inside_guard() : m_prev(glob_is_inside) { glob_is_inside = true; }
+	~inside_guard() { glob_is_inside = m_prev; }
+
+	bool m_prev;
+};
+
+#else
+
+struct inside_guard {};
+
+#endif
+
+// The preloaded library reports to stderr, so as not to mix itself into the output of
+// the profiled program.
+static FILE *
+report_file()
+{
+#ifdef HEAP_HELP_PRELOAD
+	return stderr;
+#else
+	return stdout;
+#endif
+}
+
+// Whether the frame is an allocation function, called by the user.
+static bool
+is_alloc_entry(const char *name)
+{
+	static const char *const names[] = {
+		"malloc", "calloc", "realloc", "reallocarray", "posix_memalign",
+		"aligned_alloc", "memalign", "valloc", "pvalloc",
+	};
+	if (strncmp(name, "_Znw", 4) == 0 || strncmp(name, "_Zna", 4) == 0)
+		return true;
+	for (const char *n : names) {
+		if (strcmp(name, n) == 0)
+			return true;
+	}
+	return false;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 static void
 heaph_assert_do(bool flag, const char *expr, int line)
 {
@@ -76,9 +175,9 @@ heaph_assert_do(bool flag, const char *expr, int line)
 	volatile const char *err_msg = strerror(err);
 	(void)err;
 	(void)err_msg;
-	printf("\n");
-	printf("HH: assertion failure, line %d\n", line);
-	printf("HH: %s\n", expr);
+	fprintf(report_file(), "\n");
+	fprintf(report_file(), "HH: assertion failure, line %d\n", line);
+	fprintf(report_file(), "HH: %s\n", expr);
 	_exit(-1);
 }
 
@@ -104,35 +203,263 @@ trace_resolve(void *const *addrs, int count, struct symbol *syms)
 	return rc;
 }
 
+static const char *
+symbol_name(const symbol *sym, char **demangled_name, size_t *demangled_size)
+{
+	int status = 0;
+	const char *name = abi::__cxa_demangle(
+		sym->name, *demangled_name, demangled_size, &status);
+	if (name == nullptr)
+		return sym->name;
+	*demangled_name = (char *)name;
+	return name;
+}
+
+static uint64_t
+now_ns()
+{
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
-template<class T>
-struct hh_allocator
+static inline uint64_t
+ptr_hash(const void *ptr)
+{
+	uint64_t h = (uintptr_t)ptr;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// Open addressing hash table of the allocations by their addresses. Linear probing. A
+// deletion shifts the next entries back into the hole, so there are no tombstones. The
+// memory is taken via malloc(), not new, to avoid recursion.
+class allocation_table
 {
-	using value_type = T;
+public:
+	allocation_table() = default;
+	~allocation_table() { std::free(m_slots); }
+
+	// False if the address is already there.
+	bool
+	insert(allocation *a);
+
+	// Nullptr if not found.
+	allocation *
+	erase(const void *mem);
+
+	size_t
+	size() const { return m_size; }
 
-	T *
-	allocate(size_t n)
+	template<typename F>
+	void
+	for_each(F &&f) const
 	{
-		T *res = (T *)std::malloc(n * sizeof(T));
-		heaph_assert(res != nullptr);
-		return res;
+		for (size_t i = 0; i < m_capacity; ++i) {
+			if (m_slots[i] != nullptr)
+				f(m_slots[i]);
+		}
+	}
+
+private:
+	size_t
+	home_of(const void *mem) const
+	{
+		// The low bits of the hash select the shard, the rest - the slot.
+		return (ptr_hash(mem) / SHARD_COUNT) & (m_capacity - 1);
 	}
 
 	void
-	deallocate(T *p, std::size_t)
+	grow();
+
+	allocation **m_slots = nullptr;
+	size_t m_capacity = 0;
+	size_t m_size = 0;
+};
+
+bool
+allocation_table::insert(allocation *a)
+{
+	if ((m_size + 1) * 2 > m_capacity)
+		grow();
+	size_t mask = m_capacity - 1;
+	for (size_t i = home_of(a->mem);; i = (i + 1) & mask) {
+		allocation *old = m_slots[i];
+		if (old == nullptr) {
+			m_slots[i] = a;
+			++m_size;
+			return true;
+		}
+		if (old->mem == a->mem)
+			return false;
+	}
+}
+
+allocation *
+allocation_table::erase(const void *mem)
+{
+	if (m_size == 0)
+		return nullptr;
+	size_t mask = m_capacity - 1;
+	size_t i = home_of(mem);
+	while (true) {
+		allocation *a = m_slots[i];
+		if (a == nullptr)
+			return nullptr;
+		if (a->mem == mem)
+			break;
+		i = (i + 1) & mask;
+	}
+	allocation *res = m_slots[i];
+	m_slots[i] = nullptr;
+	--m_size;
+	// An entry can fill the hole if its home is not between the hole and the entry.
+	for (size_t j = (i + 1) & mask; m_slots[j] != nullptr; j = (j + 1) & mask) {
+		size_t home = home_of(m_slots[j]->mem);
+		if (((j - home) & mask) < ((j - i) & mask))
+			continue;
+		m_slots[i] = m_slots[j];
+		m_slots[j] = nullptr;
+		i = j;
+	}
+	return res;
+}
+
+void
+allocation_table::grow()
+{
+	allocation **old_slots = m_slots;
+	size_t old_capacity = m_capacity;
+	m_capacity = old_capacity == 0 ? (size_t)TABLE_MIN_CAPACITY : old_capacity * 2;
+	m_slots = (allocation **)std::calloc(m_capacity, sizeof(*m_slots));
+	heaph_assert(m_slots != nullptr);
+	size_t mask = m_capacity - 1;
+	for (size_t i = 0; i < old_capacity; ++i) {
+		allocation *a = old_slots[i];
+		if (a == nullptr)
+			continue;
+		size_t j = home_of(a->mem);
+		while (m_slots[j] != nullptr)
+			j = (j + 1) & mask;
+		m_slots[j] = a;
+	}
+	std::free(old_slots);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static uint64_t
+frames_hash(void *const *frames, int count)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (int i = 0; i < count; ++i)
+		h = (h ^ ptr_hash(frames[i])) * 0x100000001b3ULL;
+	return h;
+}
+
+// Open addressing hash table of the unique stacks, same as the allocations one. The
+// stacks are never deleted.
+class stack_table
+{
+public:
+	stack_table() = default;
+	~stack_table() { std::free(m_slots); }
+
+	// Find the same stack or add a copy of the new one.
+	stack_trace *
+	intern(void *const *frames, int count, uint64_t hash);
+
+	size_t
+	size() const { return m_size; }
+
+	template<typename F>
+	void
+	for_each(F &&f) const
 	{
-		std::free(p);
+		for (size_t i = 0; i < m_capacity; ++i) {
+			if (m_slots[i] != nullptr)
+				f(m_slots[i]);
+		}
 	}
+
+private:
+	void
+	grow();
+
+	stack_trace **m_slots = nullptr;
+	size_t m_capacity = 0;
+	size_t m_size = 0;
 };
 
-using allocation_node = std::map<void *, allocation *>::value_type;
-using allocation_map = std::map<
-	void *,
-	allocation *,
-	std::less<>,
-	hh_allocator<allocation_node>
->;
+stack_trace *
+stack_table::intern(void *const *frames, int count, uint64_t hash)
+{
+	if ((m_size + 1) * 2 > m_capacity)
+		grow();
+	size_t mask = m_capacity - 1;
+	size_t frames_size = count * sizeof(frames[0]);
+	for (size_t i = (hash / STACK_SHARD_COUNT) & mask;; i = (i + 1) & mask) {
+		stack_trace *st = m_slots[i];
+		if (st == nullptr) {
+			void *mem = std::malloc(sizeof(*st) + frames_size);
+			heaph_assert(mem != nullptr);
+			st = new (mem) stack_trace();
+			st->hash = hash;
+			st->size = count;
+			memcpy(st->frames, frames, frames_size);
+			m_slots[i] = st;
+			++m_size;
+			return st;
+		}
+		if (st->hash == hash && st->size == count &&
+		    memcmp(st->frames, frames, frames_size) == 0)
+			return st;
+	}
+}
+
+void
+stack_table::grow()
+{
+	stack_trace **old_slots = m_slots;
+	size_t old_capacity = m_capacity;
+	m_capacity = old_capacity == 0 ? (size_t)TABLE_MIN_CAPACITY : old_capacity * 2;
+	m_slots = (stack_trace **)std::calloc(m_capacity, sizeof(*m_slots));
+	heaph_assert(m_slots != nullptr);
+	size_t mask = m_capacity - 1;
+	for (size_t i = 0; i < old_capacity; ++i) {
+		stack_trace *st = old_slots[i];
+		if (st == nullptr)
+			continue;
+		size_t j = (st->hash / STACK_SHARD_COUNT) & mask;
+		while (m_slots[j] != nullptr)
+			j = (j + 1) & mask;
+		m_slots[j] = st;
+	}
+	std::free(old_slots);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// All members are trivially initialized. The allocations can start before the
+// constructors of the globals are called.
+struct alignas(64) heap_help_shard {
+	lock_mutex mutex = LOCK_MUTEX_INITIALIZER;
+	allocation_table allocations;
+	// Unused allocation objects. For re-use.
+	allocation *alloc_pool = nullptr;
+	// Freshly created allocation objects. Taken from here when the pool is empty.
+	allocation_batch *alloc_batch = nullptr;
+	uint64_t alloc_count = 0;
+};
+
+struct alignas(64) stack_shard {
+	lock_mutex mutex = LOCK_MUTEX_INITIALIZER;
+	stack_table stacks;
+};
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
@@ -148,27 +475,75 @@ public:
 	void
 	untrace(void *ptr);
 
+	// Can be called at any moment, except inside of the signal handlers.
+	void
+	profile_dump();
+
+	uint64_t
+	get_alloc_count();
+
+	uint64_t
+	get_total_alloc_count();
+
 private:
-	std::mutex m_mutex;
-	allocation_map m_allocations;
-	// Unused allocation objects. For re-use.
-	allocation *m_alloc_pool;
-	// Freshly created allocation objects. Taken from here when the pool is empty.
-	allocation_batch *m_alloc_batch;
-	uint64_t m_alloc_count;
+	heap_help_shard &
+	shard_of(const void *ptr) { return m_shards[ptr_hash(ptr) & (SHARD_COUNT - 1)]; }
+
+	void
+	lock_all();
+
+	void
+	unlock_all();
+
+	stack_trace *
+	stack_intern(void *const *frames, int count);
+
+	uint64_t
+	get_stack_count();
+
+	heap_help_shard m_shards[SHARD_COUNT];
+	stack_shard m_stack_shards[STACK_SHARD_COUNT];
 
 	report_mode m_report_mode;
 	content_mode m_content_mode;
 	backtrace_mode m_backtrace_mode;
+	// The backtrace is taken for 1 of each N allocations of a shard. 0 and 1 mean all of
+	// them. Zero before the constructor is called.
+	uint32_t m_sample_rate;
+	// HHREPORT=p. The leaks are reported like with "l".
+	bool m_is_profile;
+	// The files are <prefix>.folded and <prefix>.sites. Empty for heap_help.<pid>, the
+	// pid is taken at the dump, so a forked child doesn't overwrite the parent's files.
+	char m_profile_prefix[256];
 };
 
+// Set by SIGUSR1, the profile is dumped by the next allocation. The handler can't do it
+// itself, most of the dumping isn't async-signal-safe.
+static std::atomic_bool glob_profile_is_requested;
+
+// Of the current thread since its start. Trivially initialized, so can be used before
+// any constructors.
+static thread_local heaph_stats glob_thread_stats;
+static thread_local heaph_stats glob_thread_stats_begin;
+
+static void
+profile_signal_f(int)
+{
+	glob_profile_is_requested.store(true, std::memory_order_relaxed);
+}
+
 heap_help::heap_help()
-	: m_alloc_pool(nullptr)
-	, m_alloc_batch(nullptr)
-	, m_alloc_count(0)
-	, m_report_mode(REPORT_MODE_LEAKS)
+#ifdef HEAP_HELP_PRELOAD
+	// Any program has some memory which it never frees, like the buffers of stdio. The
+	// report has to be asked for explicitly then.
+	: m_report_mode(REPORT_MODE_QUIET)
+#else
+	: m_report_mode(REPORT_MODE_LEAKS)
+#endif
 	, m_content_mode(CONTENT_MODE_ORIGINAL)
 	, m_backtrace_mode(BACKTRACE_ON)
+	, m_sample_rate(1)
+	, m_is_profile(false)
 {
 	const char *hh_report = getenv("HHREPORT");
 	if (hh_report != nullptr) {
@@ -178,6 +553,16 @@ heap_help::heap_help()
 			m_report_mode = REPORT_MODE_LEAKS;
 		else if (strcmp(hh_report, "q") == 0)
 			m_report_mode = REPORT_MODE_QUIET;
+		else if (strcmp(hh_report, "p") == 0 || strcmp(hh_report, "profile") == 0)
+			m_is_profile = true;
+	}
+	if (m_is_profile) {
+		const char *prefix = getenv("HHPROFILE");
+		if (prefix != nullptr)
+			snprintf(m_profile_prefix, sizeof(m_profile_prefix), "%s", prefix);
+		else
+			m_profile_prefix[0] = 0;
+		signal(SIGUSR1, profile_signal_f);
 	}
 
 	const char *hh_content = getenv("HHCONTENT");
@@ -195,23 +580,45 @@ heap_help::heap_help()
 		else if (strcmp(bt_mode, "off") == 0)
 			m_backtrace_mode = BACKTRACE_OFF;
 	}
+
+	const char *hh_sample = getenv("HHSAMPLE");
+	if (hh_sample != nullptr) {
+		int rate = atoi(hh_sample);
+		if (rate > 0)
+			m_sample_rate = rate;
+	}
 }
 
 heap_help::~heap_help()
 {
+#ifdef HEAP_HELP_PRELOAD
+	glob_is_stopped.store(true);
+#endif
+	inside_guard guard;
+	(void)guard;
+	if (m_is_profile)
+		profile_dump();
 	if (m_report_mode == REPORT_MODE_QUIET)
 		return;
-	m_mutex.lock();
-	if (m_allocations.empty())
+	FILE *out = report_file();
+	lock_all();
+	uint64_t alloc_count = 0;
+	uint64_t total_count = 0;
+	for (const heap_help_shard &s : m_shards) {
+		alloc_count += s.allocations.size();
+		total_count += s.alloc_count;
+	}
+	if (alloc_count == 0)
 	{
-		uint64_t count = m_alloc_count;
-		m_mutex.unlock();
+		unlock_all();
 
 		if (m_report_mode == REPORT_MODE_VERBOSE) {
-			printf("\n");
-			printf("HH: found no leaks\n");
-			printf("HH: total allocation count - %llu\n",
-			       (long long)count);
+			fprintf(out, "\n");
+			fprintf(out, "HH: found no leaks\n");
+			fprintf(out, "HH: total allocation count - %llu\n",
+			       (long long)total_count);
+			fprintf(out, "HH: unique stack count - %llu\n",
+			       (long long)get_stack_count());
 		}
 		return;
 	}
@@ -224,88 +631,296 @@ heap_help::~heap_help()
 	const char *prefix = "\n";
 	char *demangled_name = nullptr;
 	size_t demangled_size = 0;
-	for (const auto& [ptr, a] : m_allocations) {
+	auto report_f = [&](const allocation *a) {
 		leak_size += a->size;
 		if (report_count >= report_limit)
-			continue;
-		bool has_trace = trace_resolve(a->trace, a->trace_size, syms) == 0;
-		printf("%s", prefix);
+			return;
+		fprintf(out, "%s", prefix);
 		prefix = "";
-		printf("#### Leak %llu (%zu bytes) ####\n",
+		fprintf(out, "#### Leak %llu (%zu bytes) ####\n",
 			(long long)++report_count, a->size);
-		if (!has_trace) {
-			printf("Couldn't get the trace\n");
-			continue;
+		const stack_trace *st = a->trace;
+		if (st == nullptr) {
+			fprintf(out, "The trace is not sampled\n");
+			return;
 		}
-		for (int i = 0; i < a->trace_size; ++i) {
-			int status = 0;
-			const char *original_name = syms[i].name;
-			const char *name = abi::__cxa_demangle(
-				original_name, demangled_name, &demangled_size, &status);
-			if (name == nullptr)
-				name = original_name;
-			printf("%d - %s\n", i, name);
+		if (trace_resolve(st->frames, st->size, syms) != 0) {
+			fprintf(out, "Couldn't get the trace\n");
+			return;
 		}
-	}
+		for (int i = 0; i < st->size; ++i) {
+			fprintf(out, "%d - %s\n", i,
+				symbol_name(&syms[i], &demangled_name, &demangled_size));
+		}
+	};
+	for (const heap_help_shard &s : m_shards)
+		s.allocations.for_each(report_f);
 	std::free(demangled_name);
-	printf("%s", prefix), prefix = "";
-	printf("HH: found %lld leaks (%llu bytes)\n", (long long)m_allocations.size(),
+	fprintf(out, "%s", prefix), prefix = "";
+	fprintf(out, "HH: found %lld leaks (%llu bytes)\n", (long long)alloc_count,
 		(long long)leak_size);
-	if (report_count < m_allocations.size()) {
-		printf("HH: only first %llu reports are shown\n",
+	if (report_count < alloc_count) {
+		fprintf(out, "HH: only first %llu reports are shown\n",
 			(long long)report_count);
 	}
-	printf("HH: total allocation count - %llu\n", (long long)m_alloc_count);
-	m_mutex.unlock();
+	fprintf(out, "HH: total allocation count - %llu\n", (long long)total_count);
+	fprintf(out, "HH: unique stack count - %llu\n", (long long)get_stack_count());
+	unlock_all();
+#ifndef HEAP_HELP_PRELOAD
+	// _exit() doesn't flush, and the output might be not a terminal.
+	fflush(stdout);
 	_exit(-1);
+#endif
 }
 
 void
 heap_help::trace(void *ptr, size_t size)
 {
-	m_mutex.lock();
-	allocation *a = m_alloc_pool;
+	if (glob_profile_is_requested.load(std::memory_order_relaxed) &&
+	    glob_profile_is_requested.exchange(false))
+		profile_dump();
+	++glob_thread_stats.alloc_count;
+	glob_thread_stats.alloc_size += size;
+	heap_help_shard &s = shard_of(ptr);
+	lock_mutex_lock(&s.mutex);
+	allocation *a = s.alloc_pool;
 	if (a != nullptr) {
-		m_alloc_pool = a->next;
+		s.alloc_pool = a->next;
 	} else {
-		if (m_alloc_batch == nullptr ||
-		    m_alloc_batch->used == ALLOCATION_BATCH_SIZE) {
-			m_alloc_batch =
-				(allocation_batch *)std::malloc(sizeof(*m_alloc_batch));
-			heaph_assert(m_alloc_batch != nullptr);
-			m_alloc_batch->used = 0;
+		if (s.alloc_batch == nullptr ||
+		    s.alloc_batch->used == ALLOCATION_BATCH_SIZE) {
+			s.alloc_batch =
+				(allocation_batch *)std::malloc(sizeof(*s.alloc_batch));
+			heaph_assert(s.alloc_batch != nullptr);
+			s.alloc_batch->used = 0;
 		} else {
-			heaph_assert(m_alloc_batch->used < ALLOCATION_BATCH_SIZE);
+			heaph_assert(s.alloc_batch->used < ALLOCATION_BATCH_SIZE);
 		}
-		a = &m_alloc_batch->allocs[m_alloc_batch->used++];
+		a = &s.alloc_batch->allocs[s.alloc_batch->used++];
 	}
 	a->mem = ptr;
 	a->size = size;
-	heaph_assert(m_allocations.emplace(ptr, a).second);
-	++m_alloc_count;
-	m_mutex.unlock();
+	a->trace = nullptr;
+	a->time_ns = 0;
+	heaph_assert(s.allocations.insert(a));
+	bool is_sampled = m_sample_rate <= 1 || s.alloc_count % m_sample_rate == 0;
+	++s.alloc_count;
+	lock_mutex_unlock(&s.mutex);
 
-	if (m_backtrace_mode == BACKTRACE_ON)
-		a->trace_size = backtrace(a->trace, MAX_BACKTRACE_LEN);
-	heaph_assert(a->trace_size >= 0);
+	if (m_backtrace_mode != BACKTRACE_ON || !is_sampled)
+		return;
+	void *frames[MAX_BACKTRACE_LEN];
+	int count = backtrace(frames, MAX_BACKTRACE_LEN);
+	heaph_assert(count >= 0);
+	stack_trace *st = stack_intern(frames, count);
+	a->trace = st;
+	if (!m_is_profile)
+		return;
+	a->time_ns = now_ns();
+	st->alloc_count.fetch_add(1, std::memory_order_relaxed);
+	st->alloc_size.fetch_add(size, std::memory_order_relaxed);
+	uint64_t live = st->live_size.fetch_add(size, std::memory_order_relaxed) + size;
+	uint64_t peak = st->peak_live_size.load(std::memory_order_relaxed);
+	while (peak < live && !st->peak_live_size.compare_exchange_weak(peak, live,
+			std::memory_order_relaxed));
 }
 
 void
 heap_help::untrace(void *ptr)
 {
-	m_mutex.lock();
-	auto it = m_allocations.find(ptr);
-	if (it == m_allocations.end())
+	heap_help_shard &s = shard_of(ptr);
+	lock_mutex_lock(&s.mutex);
+	allocation *a = s.allocations.erase(ptr);
+	if (a == nullptr)
 	{
-		m_mutex.unlock();
+		lock_mutex_unlock(&s.mutex);
+#ifndef HEAP_HELP_PRELOAD
 		heaph_assert(! "Freeing unknown or already freed memory");
+#endif
+		// Allocated by the heap help itself, untraced.
 		return;
 	}
-	allocation *a = it->second;
-	a->next = m_alloc_pool;
-	m_alloc_pool = a;
-	m_allocations.erase(it);
-	m_mutex.unlock();
+	stack_trace *st = a->trace;
+	uint64_t time_ns = a->time_ns;
+	size_t size = a->size;
+	a->next = s.alloc_pool;
+	s.alloc_pool = a;
+	lock_mutex_unlock(&s.mutex);
+
+	++glob_thread_stats.free_count;
+	glob_thread_stats.free_size += size;
+
+	if (!m_is_profile || st == nullptr)
+		return;
+	st->free_count.fetch_add(1, std::memory_order_relaxed);
+	st->live_size.fetch_sub(size, std::memory_order_relaxed);
+	st->lifetime_ns.fetch_add(now_ns() - time_ns, std::memory_order_relaxed);
+}
+
+void
+heap_help::profile_dump()
+{
+	inside_guard guard;
+	(void)guard;
+	char prefix[sizeof(m_profile_prefix)];
+	if (m_profile_prefix[0] != 0)
+		memcpy(prefix, m_profile_prefix, sizeof(prefix));
+	else
+		snprintf(prefix, sizeof(prefix), "heap_help.%d", (int)getpid());
+	char path[sizeof(prefix) + 16];
+	snprintf(path, sizeof(path), "%s.folded", prefix);
+	FILE *folded = fopen(path, "w");
+	snprintf(path, sizeof(path), "%s.sites", prefix);
+	FILE *sites = fopen(path, "w");
+	if (folded == nullptr || sites == nullptr) {
+		fprintf(report_file(), "HH: couldn't open the profile files %s.*\n", prefix);
+		if (folded != nullptr)
+			fclose(folded);
+		if (sites != nullptr)
+			fclose(sites);
+		return;
+	}
+	// The sites are sorted by the allocated bytes. The stacks are never freed, so the
+	// pointers stay valid after the locks are released.
+	uint64_t stack_count = get_stack_count();
+	stack_trace **list = (stack_trace **)std::malloc(
+		(stack_count + 1) * sizeof(*list));
+	heaph_assert(list != nullptr);
+	uint64_t list_size = 0;
+	for (stack_shard &s : m_stack_shards) {
+		lock_mutex_lock(&s.mutex);
+		s.stacks.for_each([&](stack_trace *st) {
+			if (list_size < stack_count &&
+			    st->alloc_count.load(std::memory_order_relaxed) > 0)
+				list[list_size++] = st;
+		});
+		lock_mutex_unlock(&s.mutex);
+	}
+	std::sort(list, list + list_size, [](const stack_trace *a, const stack_trace *b) {
+		return a->alloc_size.load(std::memory_order_relaxed) >
+			b->alloc_size.load(std::memory_order_relaxed);
+	});
+
+	fprintf(sites, "# sample rate 1/%u\n", m_sample_rate <= 1 ? 1 : m_sample_rate);
+	fprintf(sites, "# bytes\tcount\tlive\tpeak_live\tavg_lifetime_us\tsite\n");
+	symbol syms[MAX_BACKTRACE_LEN];
+	char *demangled_name = nullptr;
+	size_t demangled_size = 0;
+	for (uint64_t i = 0; i < list_size; ++i) {
+		const stack_trace *st = list[i];
+		trace_resolve(st->frames, st->size, syms);
+		// The first frames are inside the heap help, up to the operator new or malloc().
+		int begin = 0;
+		for (int j = 0; j < st->size && j < 6; ++j) {
+			const char *name = syms[j].name;
+			if (name != nullptr && is_alloc_entry(name))
+				begin = j + 1;
+#ifdef HEAP_HELP_PRELOAD
+			// Its static functions have no names, but are in the library's file.
+			else if (j == begin && syms[j].file != nullptr &&
+				 syms[j].file == syms[0].file)
+				begin = j + 1;
+#endif
+		}
+		uint64_t free_count = st->free_count.load(std::memory_order_relaxed);
+		uint64_t lifetime_ns = st->lifetime_ns.load(std::memory_order_relaxed);
+		fprintf(sites, "%llu\t%llu\t%llu\t%llu\t%.1f\t",
+			(long long)st->alloc_size.load(std::memory_order_relaxed),
+			(long long)st->alloc_count.load(std::memory_order_relaxed),
+			(long long)st->live_size.load(std::memory_order_relaxed),
+			(long long)st->peak_live_size.load(std::memory_order_relaxed),
+			free_count == 0 ? 0.0 : lifetime_ns / 1000.0 / free_count);
+		for (int j = begin; j < st->size && j < begin + PROFILE_SITE_FRAME_COUNT; ++j) {
+			fprintf(sites, "%s", j == begin ? "" : " <- ");
+			if (syms[j].name == nullptr)
+				fprintf(sites, "[%p]", st->frames[j]);
+			else
+				fprintf(sites, "%s", symbol_name(&syms[j], &demangled_name,
+					&demangled_size));
+		}
+		fprintf(sites, "\n");
+		// The folded stacks, the root first. Can be given to flamegraph.pl as is.
+		for (int j = st->size - 1; j >= begin; --j) {
+			const char *name = syms[j].name;
+			if (name == nullptr) {
+				fprintf(folded, "%s[%p]", j == st->size - 1 ? "" : ";",
+					st->frames[j]);
+				continue;
+			}
+			name = symbol_name(&syms[j], &demangled_name, &demangled_size);
+			fprintf(folded, "%s", j == st->size - 1 ? "" : ";");
+			// The separator can't be inside of a frame.
+			for (const char *c = name; *c != 0; ++c)
+				fputc(*c == ';' ? ':' : *c, folded);
+		}
+		fprintf(folded, " %llu\n",
+			(long long)st->alloc_size.load(std::memory_order_relaxed));
+	}
+	std::free(demangled_name);
+	std::free(list);
+	fclose(folded);
+	fclose(sites);
+}
+
+uint64_t
+heap_help::get_alloc_count()
+{
+	uint64_t res = 0;
+	for (heap_help_shard &s : m_shards) {
+		lock_mutex_lock(&s.mutex);
+		res += s.allocations.size();
+		lock_mutex_unlock(&s.mutex);
+	}
+	return res;
+}
+
+uint64_t
+heap_help::get_total_alloc_count()
+{
+	uint64_t res = 0;
+	for (heap_help_shard &s : m_shards) {
+		lock_mutex_lock(&s.mutex);
+		res += s.alloc_count;
+		lock_mutex_unlock(&s.mutex);
+	}
+	return res;
+}
+
+stack_trace *
+heap_help::stack_intern(void *const *frames, int count)
+{
+	uint64_t hash = frames_hash(frames, count);
+	stack_shard &s = m_stack_shards[hash & (STACK_SHARD_COUNT - 1)];
+	lock_mutex_lock(&s.mutex);
+	stack_trace *res = s.stacks.intern(frames, count, hash);
+	lock_mutex_unlock(&s.mutex);
+	return res;
+}
+
+uint64_t
+heap_help::get_stack_count()
+{
+	uint64_t res = 0;
+	for (stack_shard &s : m_stack_shards) {
+		lock_mutex_lock(&s.mutex);
+		res += s.stacks.size();
+		lock_mutex_unlock(&s.mutex);
+	}
+	return res;
+}
+
+void
+heap_help::lock_all()
+{
+	for (heap_help_shard &s : m_shards)
+		lock_mutex_lock(&s.mutex);
+}
+
+void
+heap_help::unlock_all()
+{
+	for (heap_help_shard &s : m_shards)
+		lock_mutex_unlock(&s.mutex);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -313,6 +928,168 @@ heap_help::untrace(void *ptr)
 static heap_help glob_hh;
 }
 
+uint64_t
+heaph_get_alloc_count(void)
+{
+	return glob_hh.get_alloc_count();
+}
+
+uint64_t
+heaph_get_total_alloc_count(void)
+{
+	return glob_hh.get_total_alloc_count();
+}
+
+void
+heaph_stats_begin(void)
+{
+	glob_thread_stats_begin = glob_thread_stats;
+}
+
+heaph_stats
+heaph_stats_end(void)
+{
+	const heaph_stats &now = glob_thread_stats;
+	const heaph_stats &begin = glob_thread_stats_begin;
+	heaph_stats res;
+	res.alloc_count = now.alloc_count - begin.alloc_count;
+	res.alloc_size = now.alloc_size - begin.alloc_size;
+	res.free_count = now.free_count - begin.free_count;
+	res.free_size = now.free_size - begin.free_size;
+	return res;
+}
+
+void
+heaph_trace(void *ptr, size_t size)
+{
+	inside_guard guard;
+	(void)guard;
+	glob_hh.trace(ptr, size);
+}
+
+void
+heaph_untrace(void *ptr)
+{
+	inside_guard guard;
+	(void)guard;
+	glob_hh.untrace(ptr);
+}
+
+#ifdef HEAP_HELP_PRELOAD
+
+static void *
+hooked_alloc(void *res, size_t size)
+{
+	if (res == nullptr || glob_is_inside ||
+	    glob_is_stopped.load(std::memory_order_relaxed))
+		return res;
+	inside_guard guard;
+	(void)guard;
+	glob_hh.trace(res, size);
+	return res;
+}
+
+static void
+hooked_free(void *ptr)
+{
+	if (ptr == nullptr || glob_is_inside ||
+	    glob_is_stopped.load(std::memory_order_relaxed))
+		return;
+	inside_guard guard;
+	(void)guard;
+	glob_hh.untrace(ptr);
+}
+
+extern "C" {
+
+void *
+malloc(size_t size)
+{
+	return hooked_alloc(__libc_malloc(size), size);
+}
+
+void *
+calloc(size_t count, size_t size)
+{
+	return hooked_alloc(__libc_calloc(count, size), count * size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (ptr == nullptr)
+		return malloc(size);
+	// The old block can be gone already when the new one is traced, and its address
+	// reused by another thread. So it is untraced first.
+	hooked_free(ptr);
+	void *res = __libc_realloc(ptr, size);
+	if (res == nullptr && size != 0) {
+		// Failed, the old block is still there.
+		hooked_alloc(ptr, malloc_usable_size(ptr));
+		return nullptr;
+	}
+	return hooked_alloc(res, size);
+}
+
+void *
+reallocarray(void *ptr, size_t count, size_t size)
+{
+	size_t total;
+	if (__builtin_mul_overflow(count, size, &total)) {
+		errno = ENOMEM;
+		return nullptr;
+	}
+	return realloc(ptr, total);
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+	return hooked_alloc(__libc_memalign(alignment, size), size);
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+int
+posix_memalign(void **res, size_t alignment, size_t size)
+{
+	if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+	void *mem = memalign(alignment, size);
+	if (mem == nullptr)
+		return ENOMEM;
+	*res = mem;
+	return 0;
+}
+
+void *
+valloc(size_t size)
+{
+	return memalign(getpagesize(), size);
+}
+
+void *
+pvalloc(size_t size)
+{
+	size_t page = getpagesize();
+	return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+void
+free(void *ptr)
+{
+	hooked_free(ptr);
+	__libc_free(ptr);
+}
+
+}
+
+#else
+
 void *
 operator new(std::size_t n)
 {
@@ -351,3 +1128,5 @@ operator delete(void *ptr, std::align_val_t) noexcept
 	glob_hh.untrace(ptr);
 	std::free(ptr);
 }
+
+#endif
@@ -1,6 +1,49 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
+/** Number of not freed allocations. */
 uint64_t
 heaph_get_alloc_count(void);
+
+/** Number of all the allocations done since the process start. */
+uint64_t
+heaph_get_total_alloc_count(void);
+
+struct heaph_stats {
+	uint64_t alloc_count;
+	uint64_t alloc_size;
+	uint64_t free_count;
+	uint64_t free_size;
+};
+
+/**
+ * Start counting the allocations and frees done by the current thread. Works in any
+ * mode, even without the backtraces.
+ */
+void
+heaph_stats_begin(void);
+
+/** The allocations and frees done by the current thread since heaph_stats_begin(). */
+struct heaph_stats
+heaph_stats_end(void);
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Account the memory taken not from the heap, like a mapping of an arena. It is then
+ * reported and counted the same as a heap allocation, until untraced. Must not be freed
+ * via free() or delete.
+ */
+void
+heaph_trace(void *ptr, size_t size);
+
+void
+heaph_untrace(void *ptr);
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
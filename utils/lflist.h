@@ -0,0 +1,266 @@
+#pragma once
+
+/**
+ * Lock-free intrusive containers, companions of rlist for the data shared
+ * between threads. Same as with rlist, a link is embedded into the object,
+ * and the object is found from the link via the *_entry() macros.
+ *
+ * - lf_mpsc - Vyukov's queue. Many threads push, one thread pops. Push is
+ *   one exchange, pop doesn't have any atomic read-modify-write at all.
+ *
+ * - lf_stack - Treiber's stack. Any thread pushes and pops. The head is
+ *   stored together with a counter which is bumped on each change, so a pop
+ *   doesn't succeed if the top was popped and pushed back in the meantime
+ *   (ABA).
+ *
+ * Nothing allocates memory, and a link is owned by the container from push
+ * until pop.
+ */
+#include "rlist.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Link of an object in a lock-free container. One object can be in only one
+ * container via one link at a time.
+ */
+struct lf_link {
+	struct lf_link *next;
+};
+
+#define LF_LINK_INITIALIZER { 0 }
+
+/**
+ * return entry by link
+ */
+#define lf_entry(link, type, member) rlist_entry(link, type, member)
+
+/** {{{ MPSC queue */
+
+/**
+ * The queue always has at least one link in it. When it is empty, that is
+ * the stub. Therefore the queue can't be copied or moved after creation.
+ */
+struct lf_mpsc {
+	/** The last pushed link. Producers race for it. */
+	struct lf_link *head;
+	/** Only the consumer touches it, so keep it away from the producers. */
+	struct lf_link *tail __attribute__((aligned(64)));
+	struct lf_link stub;
+};
+
+static inline void
+lf_mpsc_create(struct lf_mpsc *q)
+{
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+/**
+ * Push to the queue. Thread-safe, never fails, never waits.
+ */
+static inline void
+lf_mpsc_push(struct lf_mpsc *q, struct lf_link *item)
+{
+	__atomic_store_n(&item->next, NULL, __ATOMIC_RELAXED);
+	struct lf_link *prev = __atomic_exchange_n(&q->head, item, __ATOMIC_ACQ_REL);
+	/*
+	 * Between the exchange and this store the queue is cut into two
+	 * halves, and the consumer doesn't see the new links until it is done.
+	 */
+	__atomic_store_n(&prev->next, item, __ATOMIC_RELEASE);
+}
+
+/**
+ * Pop from the queue. Only the consumer thread can call it.
+ * @retval NULL The queue is empty, or a producer is in the middle of its push
+ *         and the next link is not reachable yet. The caller is supposed to
+ *         retry after a wakeup or a spin.
+ */
+static inline struct lf_link *
+lf_mpsc_pop(struct lf_mpsc *q)
+{
+	struct lf_link *tail = q->tail;
+	struct lf_link *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (tail == &q->stub) {
+		if (next == NULL)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	if (next != NULL) {
+		q->tail = next;
+		return tail;
+	}
+	struct lf_link *head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	if (tail != head)
+		return NULL;
+	/* The tail is the last link. Put the stub after it to be able to take it. */
+	lf_mpsc_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next == NULL)
+		return NULL;
+	q->tail = next;
+	return tail;
+}
+
+/**
+ * Check if there is nothing to pop. Only the consumer thread can call it.
+ */
+static inline bool
+lf_mpsc_empty(struct lf_mpsc *q)
+{
+	struct lf_link *tail = q->tail;
+	return tail == &q->stub &&
+	       __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE) == NULL &&
+	       __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail;
+}
+
+/**
+ * Pop and return entry. NULL when nothing is popped.
+ */
+#define lf_mpsc_pop_entry(q, type, member) ({				\
+	struct lf_link *lf_mpsc_pop_entry_l = lf_mpsc_pop(q);		\
+	lf_mpsc_pop_entry_l == NULL ? (type *)NULL :			\
+		lf_entry(lf_mpsc_pop_entry_l, type, member);		\
+})
+
+#define lf_mpsc_push_entry(q, item, member)				\
+	lf_mpsc_push((q), &(item)->member)
+
+/** }}} MPSC queue */
+
+/** {{{ Stack */
+
+/**
+ * The top link and the change counter packed into one word, so they are
+ * updated by one compare-exchange of the word size. The double-word one
+ * would need -mcx16 or libatomic. On 64 bits the user space addresses take
+ * 48 bits, and the counter gets the other 16. It wraps, but for ABA the same
+ * link would have to be popped and pushed back exactly 65536 times between
+ * the read and the compare-exchange of one pop.
+ */
+#if UINTPTR_MAX == UINT32_MAX
+#define LF_STACK_PTR_BITS 32
+#else
+#define LF_STACK_PTR_BITS 48
+#endif
+
+#define LF_STACK_PTR_MASK ((UINT64_C(1) << LF_STACK_PTR_BITS) - 1)
+
+struct lf_stack {
+	uint64_t head;
+};
+
+#define LF_STACK_INITIALIZER { 0 }
+
+static inline struct lf_link *
+lf_stack_head_link(uint64_t head)
+{
+	return (struct lf_link *)(uintptr_t)(head & LF_STACK_PTR_MASK);
+}
+
+/**
+ * The same link with the counter bumped. In a pop the link can be garbage, if
+ * the top was taken and overwritten by another thread. Then the head is
+ * already changed and the compare-exchange fails.
+ */
+static inline uint64_t
+lf_stack_head_make(uint64_t old, struct lf_link *item)
+{
+	uint64_t count = (old >> LF_STACK_PTR_BITS) + 1;
+	return (count << LF_STACK_PTR_BITS) |
+	       ((uint64_t)(uintptr_t)item & LF_STACK_PTR_MASK);
+}
+
+static inline void
+lf_stack_create(struct lf_stack *s)
+{
+	s->head = 0;
+}
+
+/**
+ * Push to the stack. Thread-safe.
+ */
+static inline void
+lf_stack_push(struct lf_stack *s, struct lf_link *item)
+{
+	assert(((uint64_t)(uintptr_t)item & ~LF_STACK_PTR_MASK) == 0);
+	uint64_t old = __atomic_load_n(&s->head, __ATOMIC_RELAXED);
+	uint64_t new_head;
+	do {
+		__atomic_store_n(&item->next, lf_stack_head_link(old), __ATOMIC_RELAXED);
+		new_head = lf_stack_head_make(old, item);
+	} while (!__atomic_compare_exchange_n(&s->head, &old, new_head, true,
+					      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * Pop from the stack. Thread-safe.
+ * @retval NULL The stack is empty.
+ *
+ * The top link is read even if another thread has just popped it. Hence the
+ * memory of a popped object must stay readable while pops can be running,
+ * like when it is reused but not unmapped.
+ */
+static inline struct lf_link *
+lf_stack_pop(struct lf_stack *s)
+{
+	uint64_t old = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+	while (true) {
+		struct lf_link *top = lf_stack_head_link(old);
+		if (top == NULL)
+			return NULL;
+		struct lf_link *next = __atomic_load_n(&top->next, __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&s->head, &old,
+						lf_stack_head_make(old, next), true,
+						__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			return top;
+	}
+}
+
+/**
+ * Take all the links at once. They stay linked via next, the latest pushed
+ * is returned. Thread-safe.
+ */
+static inline struct lf_link *
+lf_stack_pop_all(struct lf_stack *s)
+{
+	uint64_t old = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+	while (lf_stack_head_link(old) != NULL &&
+	       !__atomic_compare_exchange_n(&s->head, &old, lf_stack_head_make(old, NULL),
+					    true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	return lf_stack_head_link(old);
+}
+
+static inline bool
+lf_stack_empty(struct lf_stack *s)
+{
+	return lf_stack_head_link(__atomic_load_n(&s->head, __ATOMIC_ACQUIRE)) == NULL;
+}
+
+/**
+ * Pop and return entry. NULL when the stack is empty.
+ */
+#define lf_stack_pop_entry(s, type, member) ({				\
+	struct lf_link *lf_stack_pop_entry_l = lf_stack_pop(s);		\
+	lf_stack_pop_entry_l == NULL ? (type *)NULL :			\
+		lf_entry(lf_stack_pop_entry_l, type, member);		\
+})
+
+#define lf_stack_push_entry(s, item, member)				\
+	lf_stack_push((s), &(item)->member)
+
+/** }}} Stack */
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
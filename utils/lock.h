@@ -0,0 +1,279 @@
+#pragma once
+
+/**
+ * Locks for the threads of one process.
+ *
+ * - lock_mutex - adaptive mutex. Spins a bounded number of times when the
+ *   lock is taken, in case the owner is about to release it, then sleeps on
+ *   a futex. Unlock does a syscall only if somebody sleeps. The zeroed memory
+ *   is an unlocked mutex.
+ *
+ * - lock_ticket - ticket spinlock. The threads get the lock in the order of
+ *   their arrival. Never sleeps, so only for very short critical sections and
+ *   not more threads than cores.
+ *
+ * - lock_rw - readers-writer lock. Readers share it, a writer is exclusive.
+ *   A waiting writer blocks the new readers, so the writers don't starve.
+ *   Spins, then sleeps on a futex same as the mutex.
+ */
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum {
+	/** Iterations of the spin before going to sleep. */
+	LOCK_SPIN_COUNT = 100,
+};
+
+static inline void
+lock_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield" ::: "memory");
+#else
+	__asm__ volatile("" ::: "memory");
+#endif
+}
+
+static inline void
+lock_futex_wait(uint32_t *addr, uint32_t expected)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static inline void
+lock_futex_wake(uint32_t *addr, int count)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/** {{{ Adaptive mutex */
+
+enum lock_mutex_state {
+	LOCK_MUTEX_FREE = 0,
+	LOCK_MUTEX_LOCKED = 1,
+	/** Locked, and there might be sleepers. */
+	LOCK_MUTEX_CONTENDED = 2,
+};
+
+struct lock_mutex {
+	uint32_t state;
+};
+
+#define LOCK_MUTEX_INITIALIZER { LOCK_MUTEX_FREE }
+
+static inline void
+lock_mutex_create(struct lock_mutex *m)
+{
+	m->state = LOCK_MUTEX_FREE;
+}
+
+static inline bool
+lock_mutex_trylock(struct lock_mutex *m)
+{
+	uint32_t expected = LOCK_MUTEX_FREE;
+	return __atomic_compare_exchange_n(&m->state, &expected, LOCK_MUTEX_LOCKED,
+					   false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void
+lock_mutex_lock(struct lock_mutex *m)
+{
+	if (lock_mutex_trylock(m))
+		return;
+	for (int i = 0; i < LOCK_SPIN_COUNT; ++i) {
+		lock_cpu_relax();
+		/* Read before the CAS, to not steal the cache line from the owner. */
+		if (__atomic_load_n(&m->state, __ATOMIC_RELAXED) == LOCK_MUTEX_FREE &&
+		    lock_mutex_trylock(m))
+			return;
+	}
+	/*
+	 * From now on the mutex is taken as contended, even if it is actually
+	 * free. It is not known whether other sleepers are left.
+	 */
+	while (__atomic_exchange_n(&m->state, LOCK_MUTEX_CONTENDED, __ATOMIC_ACQUIRE) !=
+	       LOCK_MUTEX_FREE)
+		lock_futex_wait(&m->state, LOCK_MUTEX_CONTENDED);
+}
+
+static inline void
+lock_mutex_unlock(struct lock_mutex *m)
+{
+	if (__atomic_exchange_n(&m->state, LOCK_MUTEX_FREE, __ATOMIC_RELEASE) ==
+	    LOCK_MUTEX_CONTENDED)
+		lock_futex_wake(&m->state, 1);
+}
+
+/** }}} Adaptive mutex */
+
+/** {{{ Ticket lock */
+
+struct lock_ticket {
+	/** The next ticket to give out. */
+	uint32_t next;
+	/** The ticket owning the lock. */
+	uint32_t owner;
+};
+
+#define LOCK_TICKET_INITIALIZER { 0, 0 }
+
+static inline void
+lock_ticket_create(struct lock_ticket *l)
+{
+	l->next = 0;
+	l->owner = 0;
+}
+
+static inline void
+lock_ticket_lock(struct lock_ticket *l)
+{
+	uint32_t ticket = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+	while (__atomic_load_n(&l->owner, __ATOMIC_ACQUIRE) != ticket)
+		lock_cpu_relax();
+}
+
+static inline bool
+lock_ticket_trylock(struct lock_ticket *l)
+{
+	uint32_t owner = __atomic_load_n(&l->owner, __ATOMIC_RELAXED);
+	uint32_t expected = owner;
+	/* Only when nobody waits, then the ticket is taken and is the owner. */
+	return __atomic_compare_exchange_n(&l->next, &expected, owner + 1, false,
+					   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void
+lock_ticket_unlock(struct lock_ticket *l)
+{
+	/* Only the owner changes it, so no need for an atomic increment. */
+	__atomic_store_n(&l->owner, l->owner + 1, __ATOMIC_RELEASE);
+}
+
+/** }}} Ticket lock */
+
+/** {{{ Readers-writer lock */
+
+enum {
+	LOCK_RW_WRITER = 1u << 31,
+};
+
+struct lock_rw {
+	/** LOCK_RW_WRITER or the reader count. */
+	uint32_t state;
+	/** Writers waiting for the lock. The new readers wait for them. */
+	uint32_t writer_wait_count;
+	/** Threads sleeping on the wakeup sequence. */
+	uint32_t sleeper_count;
+	/** Changed on each unlock when there are sleepers. They sleep on it. */
+	uint32_t wakeup_seq;
+};
+
+#define LOCK_RW_INITIALIZER { 0, 0, 0, 0 }
+
+static inline void
+lock_rw_create(struct lock_rw *l)
+{
+	l->state = 0;
+	l->writer_wait_count = 0;
+	l->sleeper_count = 0;
+	l->wakeup_seq = 0;
+}
+
+static inline bool
+lock_rw_tryread(struct lock_rw *l)
+{
+	uint32_t state = __atomic_load_n(&l->state, __ATOMIC_RELAXED);
+	while ((state & LOCK_RW_WRITER) == 0 &&
+	       __atomic_load_n(&l->writer_wait_count, __ATOMIC_RELAXED) == 0) {
+		if (__atomic_compare_exchange_n(&l->state, &state, state + 1, true,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
+static inline bool
+lock_rw_trywrite(struct lock_rw *l)
+{
+	uint32_t expected = 0;
+	return __atomic_compare_exchange_n(&l->state, &expected, LOCK_RW_WRITER, false,
+					   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/**
+ * Spin, then sleep until the given try-function succeeds. The number of the
+ * sleepers is published before the last check, so an unlock which happens
+ * after the check sees it and wakes the sleepers up.
+ */
+static inline void
+lock_rw_wait(struct lock_rw *l, bool (*try_f)(struct lock_rw *))
+{
+	for (int i = 0; i < LOCK_SPIN_COUNT; ++i) {
+		lock_cpu_relax();
+		if (try_f(l))
+			return;
+	}
+	while (true) {
+		__atomic_fetch_add(&l->sleeper_count, 1, __ATOMIC_SEQ_CST);
+		uint32_t seq = __atomic_load_n(&l->wakeup_seq, __ATOMIC_SEQ_CST);
+		if (try_f(l)) {
+			__atomic_fetch_sub(&l->sleeper_count, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		lock_futex_wait(&l->wakeup_seq, seq);
+		__atomic_fetch_sub(&l->sleeper_count, 1, __ATOMIC_RELAXED);
+		if (try_f(l))
+			return;
+	}
+}
+
+static inline void
+lock_rw_wakeup(struct lock_rw *l)
+{
+	if (__atomic_load_n(&l->sleeper_count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	__atomic_fetch_add(&l->wakeup_seq, 1, __ATOMIC_SEQ_CST);
+	/* Everyone. The readers can all take it, and a writer retries if not. */
+	lock_futex_wake(&l->wakeup_seq, INT_MAX);
+}
+
+static inline void
+lock_rw_rdlock(struct lock_rw *l)
+{
+	if (!lock_rw_tryread(l))
+		lock_rw_wait(l, lock_rw_tryread);
+}
+
+static inline void
+lock_rw_wrlock(struct lock_rw *l)
+{
+	if (lock_rw_trywrite(l))
+		return;
+	__atomic_fetch_add(&l->writer_wait_count, 1, __ATOMIC_SEQ_CST);
+	lock_rw_wait(l, lock_rw_trywrite);
+	__atomic_fetch_sub(&l->writer_wait_count, 1, __ATOMIC_RELAXED);
+}
+
+static inline void
+lock_rw_rdunlock(struct lock_rw *l)
+{
+	uint32_t state = __atomic_sub_fetch(&l->state, 1, __ATOMIC_SEQ_CST);
+	/* Only a writer can be waiting for a read lock to end. */
+	if (state == 0)
+		lock_rw_wakeup(l);
+}
+
+static inline void
+lock_rw_wrunlock(struct lock_rw *l)
+{
+	__atomic_store_n(&l->state, 0, __ATOMIC_SEQ_CST);
+	lock_rw_wakeup(l);
+}
+
+/** }}} Readers-writer lock */
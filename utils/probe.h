@@ -0,0 +1,60 @@
+#pragma once
+
+/**
+ * Static tracepoints, USDT. A probe is a nop in the code and a note in
+ * the ELF, so it costs nothing until a tracer attaches to it in a live
+ * process, no rebuild needed:
+ *
+ *     bpftrace -e 'usdt:./test:libcoro:switch { @[arg2] = count(); }'
+ *
+ *     perf buildid-cache --add ./test
+ *     perf record -e sdt_userfs:write -p <pid>
+ *
+ * The probes, provider:name(args):
+ * - libcoro:switch(from, to, engine id);
+ * - corobus:block(channel, is_send) and corobus:unblock(...) around a
+ *   wait, corobus:select__block(count) and select__unblock(count);
+ * - userfs:write(file, offset, size, is_in_place);
+ * - thread_pool:enqueue(pool, task, priority),
+ *   thread_pool:dequeue(task, worker id, queued ns);
+ * - chat:peer__accept(socket), chat:broadcast(slab, size, receivers).
+ * The '__' is shown as '-' by the tracers.
+ *
+ * The probes are compiled out if <sys/sdt.h> (systemtap-sdt-dev) is not
+ * installed, or PROBE_DISABLE is defined. The arguments are integers or
+ * pointers. They are not evaluated at all when the probes are compiled
+ * out, so must have no side effects.
+ */
+#if !defined(PROBE_DISABLE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE_IS_ENABLED 1
+#endif
+#endif
+
+#ifdef PROBE_IS_ENABLED
+
+#define PROBE0(provider, name) DTRACE_PROBE(provider, name)
+#define PROBE1(provider, name, a1) DTRACE_PROBE1(provider, name, a1)
+#define PROBE2(provider, name, a1, a2) DTRACE_PROBE2(provider, name, a1, a2)
+#define PROBE3(provider, name, a1, a2, a3)					\
+	DTRACE_PROBE3(provider, name, a1, a2, a3)
+#define PROBE4(provider, name, a1, a2, a3, a4)					\
+	DTRACE_PROBE4(provider, name, a1, a2, a3, a4)
+
+#else
+
+/* sizeof() keeps the arguments used, but doesn't evaluate them. */
+#define PROBE0(provider, name) do {} while (0)
+#define PROBE1(provider, name, a1) do { (void)sizeof(a1); } while (0)
+#define PROBE2(provider, name, a1, a2)						\
+	do { (void)sizeof(a1); (void)sizeof(a2); } while (0)
+#define PROBE3(provider, name, a1, a2, a3)					\
+	do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); } while (0)
+#define PROBE4(provider, name, a1, a2, a3, a4)					\
+	do {									\
+		(void)sizeof(a1); (void)sizeof(a2);				\
+		(void)sizeof(a3); (void)sizeof(a4);				\
+	} while (0)
+
+#endif
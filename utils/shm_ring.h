@@ -0,0 +1,213 @@
+#pragma once
+
+/**
+ * Single producer single consumer ring buffer of bytes, which works between
+ * processes. It lives in shared memory, like an anonymous shared mapping
+ * inherited via fork() or a shm_open() object mapped by both sides.
+ *
+ * The positions are free-running counters, each changed only by its owner
+ * and published with release semantics. A side which finds the ring empty or
+ * full sets its waiting flag and sleeps on the other side's counter via a
+ * futex. The other side wakes it up after publishing, only when the flag is
+ * set. So while both are busy, no syscalls are done.
+ *
+ * The data can be published in batches: reserve a contiguous span, fill it,
+ * publish any part of it at once. The same for the consumption. Or use the
+ * blocking shm_ring_write() and shm_ring_read() for whole buffers.
+ */
+#include <assert.h>
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct shm_ring {
+	/** Written by the producer. */
+	uint32_t head __attribute__((aligned(64)));
+	/** The consumer sleeps on the head. */
+	uint32_t is_consumer_waiting;
+	/** Written by the consumer. */
+	uint32_t tail __attribute__((aligned(64)));
+	/** The producer sleeps on the tail. */
+	uint32_t is_producer_waiting;
+	/** Data size. A power of 2, not bigger than 2^31. */
+	uint32_t size __attribute__((aligned(64)));
+	char data[];
+};
+
+/**
+ * Not FUTEX_PRIVATE_FLAG, because the waiters and the wakers are in different
+ * processes.
+ */
+static inline void
+shm_ring_futex_wait(uint32_t *addr, uint32_t expected)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+static inline void
+shm_ring_futex_wake(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/** Memory size needed for a ring with the given data size. */
+static inline size_t
+shm_ring_mem_size(uint32_t size)
+{
+	return sizeof(struct shm_ring) + size;
+}
+
+/**
+ * Create a ring in the given shared memory of shm_ring_mem_size(size) bytes.
+ */
+static inline struct shm_ring *
+shm_ring_create(void *mem, uint32_t size)
+{
+	assert(size != 0 && (size & (size - 1)) == 0 && size <= (1u << 31));
+	struct shm_ring *r = (struct shm_ring *)mem;
+	r->head = 0;
+	r->is_consumer_waiting = 0;
+	r->tail = 0;
+	r->is_producer_waiting = 0;
+	r->size = size;
+	return r;
+}
+
+/**
+ * Create a ring in a new anonymous shared mapping. It is shared with the
+ * children forked after that.
+ * @retval NULL Couldn't map.
+ */
+static inline struct shm_ring *
+shm_ring_new(uint32_t size)
+{
+	void *mem = mmap(NULL, shm_ring_mem_size(size), PROT_READ | PROT_WRITE,
+			 MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+	return shm_ring_create(mem, size);
+}
+
+static inline void
+shm_ring_delete(struct shm_ring *r)
+{
+	munmap(r, shm_ring_mem_size(r->size));
+}
+
+/** {{{ Producer */
+
+/**
+ * Get the contiguous free span, wait until there is at least one byte.
+ * @retval Size of the span at the returned *data.
+ */
+static inline uint32_t
+shm_ring_reserve(struct shm_ring *r, char **data)
+{
+	uint32_t head = r->head;
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	while (head - tail == r->size) {
+		__atomic_store_n(&r->is_producer_waiting, 1, __ATOMIC_SEQ_CST);
+		/* Check again, the consumer might have missed the flag. */
+		tail = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+		if (head - tail != r->size)
+			break;
+		shm_ring_futex_wait(&r->tail, tail);
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	}
+	uint32_t pos = head & (r->size - 1);
+	uint32_t free_size = r->size - (head - tail);
+	uint32_t to_end = r->size - pos;
+	*data = r->data + pos;
+	return free_size < to_end ? free_size : to_end;
+}
+
+/** Make the given number of the reserved bytes visible to the consumer. */
+static inline void
+shm_ring_publish(struct shm_ring *r, uint32_t size)
+{
+	/* Seq-cst, so it is ordered with the flag check below. */
+	__atomic_store_n(&r->head, r->head + size, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->is_consumer_waiting, __ATOMIC_SEQ_CST) &&
+	    __atomic_exchange_n(&r->is_consumer_waiting, 0, __ATOMIC_SEQ_CST))
+		shm_ring_futex_wake(&r->head);
+}
+
+/** Write all the data. Waits when the ring is full. */
+static inline void
+shm_ring_write(struct shm_ring *r, const void *src, size_t size)
+{
+	const char *pos = (const char *)src;
+	while (size > 0) {
+		char *data;
+		uint32_t span = shm_ring_reserve(r, &data);
+		if (span > size)
+			span = (uint32_t)size;
+		memcpy(data, pos, span);
+		shm_ring_publish(r, span);
+		pos += span;
+		size -= span;
+	}
+}
+
+/** }}} Producer */
+
+/** {{{ Consumer */
+
+/**
+ * Get the contiguous span of the published data, wait until there is at
+ * least one byte.
+ * @retval Size of the span at the returned *data.
+ */
+static inline uint32_t
+shm_ring_peek(struct shm_ring *r, const char **data)
+{
+	uint32_t tail = r->tail;
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	while (head == tail) {
+		__atomic_store_n(&r->is_consumer_waiting, 1, __ATOMIC_SEQ_CST);
+		head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+		if (head != tail)
+			break;
+		shm_ring_futex_wait(&r->head, head);
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	}
+	uint32_t pos = tail & (r->size - 1);
+	uint32_t used = head - tail;
+	uint32_t to_end = r->size - pos;
+	*data = r->data + pos;
+	return used < to_end ? used : to_end;
+}
+
+/** Free the given number of the peeked bytes for the producer. */
+static inline void
+shm_ring_consume(struct shm_ring *r, uint32_t size)
+{
+	__atomic_store_n(&r->tail, r->tail + size, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->is_producer_waiting, __ATOMIC_SEQ_CST) &&
+	    __atomic_exchange_n(&r->is_producer_waiting, 0, __ATOMIC_SEQ_CST))
+		shm_ring_futex_wake(&r->tail);
+}
+
+/** Read exactly the given size. Waits when the ring is empty. */
+static inline void
+shm_ring_read(struct shm_ring *r, void *dst, size_t size)
+{
+	char *pos = (char *)dst;
+	while (size > 0) {
+		const char *data;
+		uint32_t span = shm_ring_peek(r, &data);
+		if (span > size)
+			span = (uint32_t)size;
+		memcpy(pos, data, span);
+		shm_ring_consume(r, span);
+		pos += span;
+		size -= span;
+	}
+}
+
+/** }}} Consumer */
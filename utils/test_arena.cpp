@@ -0,0 +1,366 @@
+#include "unit.h"
+#include "arena.h"
+
+#ifdef TEST_ARENA_HEAP_HELP
+#include "heap_help.h"
+#endif
+
+#include <pthread.h>
+#include <set>
+#include <stdint.h>
+#include <string.h>
+
+enum {
+	TEST_CHUNK_SIZE = 64 * 1024,
+	TEST_THREAD_COUNT = 4,
+	TEST_THREAD_OBJ_COUNT = 100,
+	TEST_THREAD_ROUND_COUNT = 2000,
+	TEST_OBJ_SIZE = 64,
+};
+
+extern "C" void *
+test_arena_c_alloc(struct arena *a, size_t size);
+
+static int
+arena_chunk_count(const struct arena *a)
+{
+	int res = 0;
+	for (struct arena_chunk *c = a->chunks; c != NULL; c = c->next)
+		++res;
+	return res;
+}
+
+/** The allocation is inside of one chunk of the arena, after its header. */
+static bool
+arena_owns(const struct arena *a, const void *ptr, size_t size)
+{
+	const char *p = (const char *)ptr;
+	for (struct arena_chunk *c = a->chunks; c != NULL; c = c->next) {
+		const char *begin = (const char *)(c + 1);
+		const char *end = (const char *)c + c->size;
+		if (p >= begin && p <= end && size <= (size_t)(end - p))
+			return true;
+	}
+	return false;
+}
+
+static void
+test_arena_alloc(void)
+{
+	unit_test_start();
+
+	struct arena a;
+	arena_create(&a, TEST_CHUNK_SIZE, 0);
+	unit_check(a.chunks == NULL && a.mapped_size == 0,
+		   "nothing is mapped before the first allocation");
+	const size_t aligns[] = {8, 64, 4096};
+	char *ptrs[300];
+	bool is_aligned = true;
+	bool is_owned = true;
+	for (int i = 0; i < 300; ++i) {
+		size_t align = aligns[i % 3];
+		ptrs[i] = (char *)arena_alloc_aligned(&a, 1000, align);
+		unit_fail_if(ptrs[i] == NULL);
+		is_aligned = is_aligned && ((uintptr_t)ptrs[i] & (align - 1)) == 0;
+		is_owned = is_owned && arena_owns(&a, ptrs[i], 1000);
+		memset(ptrs[i], i, 1000);
+	}
+	unit_check(is_aligned, "aligned allocations");
+	unit_check(is_owned, "none crosses the end of its chunk");
+	int chunk_count = arena_chunk_count(&a);
+	unit_check(chunk_count > 1, "the allocations go on in new chunks");
+	unit_check(a.mapped_size == (size_t)chunk_count * TEST_CHUNK_SIZE,
+		   "the chunks are of the given size");
+	bool is_intact = true;
+	for (int i = 0; i < 300; ++i) {
+		for (int j = 0; j < 1000; ++j)
+			is_intact = is_intact && ptrs[i][j] == (char)i;
+	}
+	unit_check(is_intact, "the allocations don't overlap");
+
+	size_t big_size = 3 * TEST_CHUNK_SIZE;
+	char *big = (char *)arena_alloc_aligned(&a, big_size, 4096);
+	unit_check(big != NULL && ((uintptr_t)big & 4095) == 0 &&
+		   arena_owns(&a, big, big_size),
+		   "an oversized allocation gets its own chunk");
+	unit_check(arena_chunk_count(&a) == chunk_count + 1 &&
+		   a.mapped_size >= (size_t)chunk_count * TEST_CHUNK_SIZE +
+		   big_size, "and it is bigger than the usual ones");
+	memset(big, 1, big_size);
+	char *small = (char *)arena_alloc(&a, 16);
+	unit_check(small != NULL && arena_owns(&a, small, 16),
+		   "the small ones go on after it");
+
+	arena_reset(&a);
+	unit_check(arena_chunk_count(&a) == 1 &&
+		   a.mapped_size == a.chunks->size, "reset keeps one chunk");
+	char *first = (char *)arena_alloc(&a, 16);
+	unit_check(first == (char *)arena_round_up((uintptr_t)(a.chunks + 1),
+						   sizeof(void *)),
+		   "and allocates from its start again");
+	arena_reset(&a);
+	arena_reset(&a);
+	unit_check(arena_chunk_count(&a) == 1, "reset twice");
+	arena_destroy(&a);
+	unit_check(a.chunks == NULL && a.mapped_size == 0, "destroy");
+	arena_reset(&a);
+	unit_check(arena_alloc(&a, 16) != NULL, "reset and alloc when empty");
+	arena_destroy(&a);
+
+	/* Without the reserved huge pages both fall back to the usual ones. */
+	const int flags[] = {ARENA_THP, ARENA_HUGETLB};
+	for (int f : flags) {
+		arena_create(&a, 0, f);
+		char *p = (char *)arena_alloc(&a, 100);
+		unit_check(p != NULL && a.mapped_size % ARENA_HUGE_PAGE_SIZE == 0,
+			   "huge page chunks are of the huge page size");
+		memset(p, 1, 100);
+		arena_destroy(&a);
+	}
+
+	unit_test_finish();
+}
+
+static void
+test_slab_set(void)
+{
+	unit_test_start();
+
+	struct slab_set s;
+	slab_set_create(&s, TEST_CHUNK_SIZE, 0);
+	unit_check(slab_set_pool(&s, 1) == &s.pools[0] &&
+		   slab_set_pool(&s, 16) == &s.pools[0], "up to 16 is the first");
+	unit_check(slab_set_pool(&s, 17) == &s.pools[1] &&
+		   slab_set_pool(&s, 32) == &s.pools[1], "17 is the second");
+	unit_check(slab_set_pool(&s, 33) == &s.pools[2], "33 is the third");
+	unit_check(slab_set_pool(&s, SLAB_SET_MAX_SIZE - 1) ==
+		   &s.pools[SLAB_SET_CLASS_COUNT - 1] &&
+		   slab_set_pool(&s, SLAB_SET_MAX_SIZE) ==
+		   &s.pools[SLAB_SET_CLASS_COUNT - 1], "64KB is the last");
+	unit_check(slab_set_pool(&s, SLAB_SET_MAX_SIZE / 2 + 1) ==
+		   &s.pools[SLAB_SET_CLASS_COUNT - 1] &&
+		   slab_set_pool(&s, SLAB_SET_MAX_SIZE / 2) ==
+		   &s.pools[SLAB_SET_CLASS_COUNT - 2], "32KB and a byte");
+	bool is_sized = true;
+	for (int i = 0; i < SLAB_SET_CLASS_COUNT; ++i)
+		is_sized = is_sized && s.pools[i].obj_size == (size_t)16 << i;
+	unit_check(is_sized, "the classes are powers of 2");
+
+	char *p = (char *)slab_set_alloc(&s, 17);
+	unit_check(p != NULL && ((uintptr_t)p & 15) == 0, "aligned by 16");
+	memset(p, 1, 32);
+	slab_set_free(&s, p, 17);
+	unit_check(slab_set_alloc(&s, 20) == p, "a freed object is reused");
+	char *big = (char *)slab_set_alloc(&s, SLAB_SET_MAX_SIZE);
+	unit_check(big != NULL, "the biggest class");
+	memset(big, 1, SLAB_SET_MAX_SIZE);
+	slab_set_free(&s, big, SLAB_SET_MAX_SIZE);
+	slab_set_free(&s, p, 20);
+	slab_set_destroy(&s);
+
+	unit_test_finish();
+}
+
+static int
+lf_list_count(struct lf_link *l)
+{
+	int res = 0;
+	for (; l != NULL; l = l->next)
+		++res;
+	return res;
+}
+
+static void
+test_slab_cache(void)
+{
+	unit_test_start();
+
+	struct slab_pool p;
+	slab_pool_create(&p, TEST_OBJ_SIZE, TEST_CHUNK_SIZE, 0);
+	struct slab_cache c;
+	slab_cache_create(&c, &p);
+	void *objs[SLAB_CACHE_MAX + 1];
+	objs[0] = slab_cache_alloc(&c);
+	unit_check(objs[0] != NULL && c.count == SLAB_CACHE_BATCH - 1,
+		   "an empty cache takes a batch of new objects");
+	for (int i = 1; i <= SLAB_CACHE_MAX; ++i)
+		objs[i] = slab_cache_alloc(&c);
+	unit_check(c.count < SLAB_CACHE_BATCH, "and more batches when drained");
+	int max_count = 0;
+	for (int i = 0; i <= SLAB_CACHE_MAX; ++i) {
+		slab_cache_free(&c, objs[i]);
+		max_count = c.count > max_count ? c.count : max_count;
+	}
+	unit_check(max_count == SLAB_CACHE_MAX, "the cache is limited");
+	unit_check(!lf_stack_empty(&p.free_objs),
+		   "the excess goes back to the pool in a batch");
+	int cached = c.count;
+	slab_cache_flush(&c);
+	struct lf_link *all = lf_stack_pop_all(&p.free_objs);
+	int total = lf_list_count(all);
+	unit_check(c.count == 0 && c.objs == NULL && total > cached,
+		   "flush returns all");
+	while (all != NULL) {
+		struct lf_link *next = all->next;
+		lf_stack_push(&p.free_objs, all);
+		all = next;
+	}
+	void *obj = slab_cache_alloc(&c);
+	unit_check(obj != NULL && c.count == SLAB_CACHE_BATCH - 1 &&
+		   lf_list_count(lf_stack_pop_all(&p.free_objs)) ==
+		   total - SLAB_CACHE_BATCH,
+		   "refill takes a batch from the pool");
+	slab_pool_destroy(&p);
+
+	unit_test_finish();
+}
+
+struct test_cache_ctx {
+	struct slab_pool *pool;
+	int id;
+	bool is_ok;
+};
+
+static void *
+test_slab_cache_worker_f(void *arg)
+{
+	struct test_cache_ctx *ctx = (struct test_cache_ctx *)arg;
+	struct slab_cache c;
+	slab_cache_create(&c, ctx->pool);
+	uint64_t *objs[TEST_THREAD_OBJ_COUNT];
+	for (int r = 0; r < TEST_THREAD_ROUND_COUNT; ++r) {
+		/* A varying count, so the caches go up and down over the batches. */
+		int count = 1 + (r * 37 + ctx->id * 11) % TEST_THREAD_OBJ_COUNT;
+		for (int i = 0; i < count; ++i) {
+			objs[i] = (uint64_t *)slab_cache_alloc(&c);
+			if (objs[i] == NULL) {
+				ctx->is_ok = false;
+				return NULL;
+			}
+			uint64_t tag = ((uint64_t)ctx->id << 32) | (uint64_t)i;
+			for (int j = 0; j < TEST_OBJ_SIZE / 8; ++j)
+				objs[i][j] = tag;
+		}
+		for (int i = 0; i < count; ++i) {
+			uint64_t tag = ((uint64_t)ctx->id << 32) | (uint64_t)i;
+			for (int j = 0; j < TEST_OBJ_SIZE / 8; ++j)
+				ctx->is_ok = ctx->is_ok && objs[i][j] == tag;
+			slab_cache_free(&c, objs[i]);
+		}
+	}
+	slab_cache_flush(&c);
+	return NULL;
+}
+
+static void
+test_slab_cache_threads(void)
+{
+	unit_test_start();
+
+	struct slab_pool p;
+	slab_pool_create(&p, TEST_OBJ_SIZE, TEST_CHUNK_SIZE, 0);
+	pthread_t threads[TEST_THREAD_COUNT];
+	struct test_cache_ctx ctxs[TEST_THREAD_COUNT];
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+		ctxs[i] = {&p, i, true};
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    test_slab_cache_worker_f,
+					    &ctxs[i]) != 0);
+	}
+	bool is_ok = true;
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+		pthread_join(threads[i], NULL);
+		is_ok = is_ok && ctxs[i].is_ok;
+	}
+	unit_check(is_ok, "an object has one owner at a time");
+	std::set<struct lf_link *> uniq;
+	int total = 0;
+	for (struct lf_link *l = lf_stack_pop_all(&p.free_objs); l != NULL;
+	     l = l->next) {
+		uniq.insert(l);
+		++total;
+	}
+	unit_check((size_t)total == uniq.size(), "each is freed once");
+	/*
+	 * New objects are made only when all the others are taken by the
+	 * threads or are in their caches.
+	 */
+	unit_check(total >= TEST_THREAD_OBJ_COUNT && total <= TEST_THREAD_COUNT *
+		   (TEST_THREAD_OBJ_COUNT + SLAB_CACHE_MAX) + SLAB_CACHE_BATCH,
+		   "the objects are reused");
+	slab_pool_destroy(&p);
+
+	unit_test_finish();
+}
+
+#ifdef TEST_ARENA_HEAP_HELP
+
+static void
+test_heap_help(void)
+{
+	unit_test_start();
+
+	struct arena a;
+	arena_create(&a, TEST_CHUNK_SIZE, 0);
+	uint64_t base = heaph_get_alloc_count();
+	heaph_stats_begin();
+	unit_fail_if(arena_alloc(&a, 16) == NULL);
+	uint64_t count1 = heaph_get_alloc_count();
+	unit_fail_if(arena_alloc(&a, TEST_CHUNK_SIZE) == NULL);
+	uint64_t count2 = heaph_get_alloc_count();
+	struct heaph_stats stats = heaph_stats_end();
+	unit_check(count1 == base + 1 && count2 == base + 2,
+		   "each chunk is an allocation");
+	unit_check(stats.alloc_count == 2 &&
+		   stats.alloc_size == a.mapped_size, "in the stats too");
+	arena_reset(&a);
+	uint64_t count3 = heaph_get_alloc_count();
+	unit_check(count3 == base + 1, "reset untraces the freed chunks");
+	arena_destroy(&a);
+	uint64_t count4 = heaph_get_alloc_count();
+	unit_check(count4 == base, "destroy untraces all");
+
+	arena_create(&a, TEST_CHUNK_SIZE, 0);
+	unit_fail_if(test_arena_c_alloc(&a, 16) == NULL);
+	uint64_t count5 = heaph_get_alloc_count();
+	unit_check(count5 == base + 1, "the chunks of C code are traced");
+	arena_destroy(&a);
+	uint64_t count6 = heaph_get_alloc_count();
+	unit_check(count6 == base, "and untraced");
+
+	unit_test_finish();
+}
+
+#endif
+
+static void
+test_arena_c(void)
+{
+	unit_test_start();
+
+	struct arena a;
+	arena_create(&a, TEST_CHUNK_SIZE, 0);
+	char *p = (char *)test_arena_c_alloc(&a, 100);
+	unit_check(p != NULL && arena_owns(&a, p, 100), "arena works in C");
+	arena_destroy(&a);
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	test_arena_alloc();
+	test_slab_set();
+	test_slab_cache();
+	test_slab_cache_threads();
+	test_arena_c();
+#ifdef TEST_ARENA_HEAP_HELP
+	test_heap_help();
+#endif
+
+	unit_test_finish();
+	return 0;
+}
@@ -0,0 +1,11 @@
+/*
+ * arena.h included into C. Its chunks must be made with the same heap_help
+ * accounting as in C++.
+ */
+#include "arena.h"
+
+void *
+test_arena_c_alloc(struct arena *a, size_t size)
+{
+	return arena_alloc(a, size);
+}
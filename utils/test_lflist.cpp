@@ -0,0 +1,237 @@
+#include "unit.h"
+#include "lflist.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+enum {
+	TEST_THREAD_COUNT = 4,
+	TEST_MPSC_PUSH_COUNT = 200000,
+	TEST_STACK_NODE_COUNT = 16,
+	TEST_STACK_ROUND_COUNT = 200000,
+};
+
+struct test_mpsc_item {
+	int producer;
+	int seq;
+	struct lf_link link;
+};
+
+static void
+test_mpsc_basic(void)
+{
+	unit_test_start();
+
+	struct lf_mpsc q;
+	lf_mpsc_create(&q);
+	unit_check(lf_mpsc_empty(&q), "new queue is empty");
+	unit_check(lf_mpsc_pop(&q) == NULL, "pop from empty");
+	struct test_mpsc_item items[3];
+	for (int i = 0; i < 3; ++i) {
+		items[i].seq = i;
+		lf_mpsc_push_entry(&q, &items[i], link);
+	}
+	unit_check(!lf_mpsc_empty(&q), "not empty after push");
+	bool is_ok = true;
+	for (int i = 0; i < 3; ++i) {
+		struct test_mpsc_item *it =
+			lf_mpsc_pop_entry(&q, struct test_mpsc_item, link);
+		is_ok = is_ok && it == &items[i];
+	}
+	unit_check(is_ok, "pop in the push order");
+	unit_check(lf_mpsc_empty(&q) && lf_mpsc_pop(&q) == NULL,
+		   "empty after all are popped");
+	/* The last link is taken via the stub, then it is usable again. */
+	lf_mpsc_push_entry(&q, &items[0], link);
+	unit_check(lf_mpsc_pop(&q) == &items[0].link, "push after drain");
+	unit_check(lf_mpsc_empty(&q), "empty again");
+
+	unit_test_finish();
+}
+
+struct test_mpsc_ctx {
+	struct lf_mpsc q;
+	struct test_mpsc_item *items;
+};
+
+struct test_mpsc_producer {
+	struct test_mpsc_ctx *ctx;
+	int id;
+};
+
+static void *
+test_mpsc_producer_f(void *arg)
+{
+	struct test_mpsc_producer *p = (struct test_mpsc_producer *)arg;
+	struct test_mpsc_item *items = p->ctx->items +
+		(size_t)p->id * TEST_MPSC_PUSH_COUNT;
+	for (int i = 0; i < TEST_MPSC_PUSH_COUNT; ++i) {
+		items[i].producer = p->id;
+		items[i].seq = i;
+		lf_mpsc_push_entry(&p->ctx->q, &items[i], link);
+	}
+	return NULL;
+}
+
+static void
+test_mpsc_stress(void)
+{
+	unit_test_start();
+
+	struct test_mpsc_ctx ctx;
+	lf_mpsc_create(&ctx.q);
+	ctx.items = new test_mpsc_item[TEST_THREAD_COUNT * TEST_MPSC_PUSH_COUNT];
+	struct test_mpsc_producer producers[TEST_THREAD_COUNT];
+	pthread_t threads[TEST_THREAD_COUNT];
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+		producers[i].ctx = &ctx;
+		producers[i].id = i;
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    test_mpsc_producer_f,
+					    &producers[i]) != 0);
+	}
+	/* The consumer is this thread, popping while they push. */
+	int next_seq[TEST_THREAD_COUNT] = {};
+	int total = 0;
+	bool is_ordered = true;
+	while (total < TEST_THREAD_COUNT * TEST_MPSC_PUSH_COUNT) {
+		struct test_mpsc_item *it =
+			lf_mpsc_pop_entry(&ctx.q, struct test_mpsc_item, link);
+		if (it == NULL)
+			continue;
+		is_ordered = is_ordered && it->seq == next_seq[it->producer];
+		next_seq[it->producer] = it->seq + 1;
+		++total;
+	}
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i)
+		pthread_join(threads[i], NULL);
+	unit_check(is_ordered, "each producer's items come in order");
+	bool is_all = true;
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i)
+		is_all = is_all && next_seq[i] == TEST_MPSC_PUSH_COUNT;
+	unit_check(is_all, "all the items are popped once");
+	unit_check(lf_mpsc_empty(&ctx.q), "nothing is left");
+	delete[] ctx.items;
+
+	unit_test_finish();
+}
+
+struct test_stack_node {
+	struct lf_link link;
+	/** Who has popped it, 0 when it is in the stack. */
+	int owner;
+	int use_count;
+};
+
+static void
+test_stack_basic(void)
+{
+	unit_test_start();
+
+	struct lf_stack s;
+	lf_stack_create(&s);
+	unit_check(lf_stack_empty(&s) && lf_stack_pop(&s) == NULL,
+		   "new stack is empty");
+	struct test_stack_node nodes[3];
+	for (int i = 0; i < 3; ++i)
+		lf_stack_push_entry(&s, &nodes[i], link);
+	unit_check(lf_stack_pop_entry(&s, struct test_stack_node, link) ==
+		   &nodes[2], "pop the last pushed");
+	struct lf_link *all = lf_stack_pop_all(&s);
+	unit_check(all == &nodes[1].link && all->next == &nodes[0].link &&
+		   all->next->next == NULL, "pop all keeps the links");
+	unit_check(lf_stack_empty(&s), "empty after pop all");
+	unit_check(lf_stack_pop_all(&s) == NULL, "pop all from empty");
+
+	unit_test_finish();
+}
+
+static void *
+test_stack_worker_f(void *arg)
+{
+	struct lf_stack *s = (struct lf_stack *)arg;
+	int self = (int)(uintptr_t)pthread_self() | 1;
+	bool *is_ok = new bool(true);
+	for (int i = 0; i < TEST_STACK_ROUND_COUNT; ++i) {
+		struct test_stack_node *n =
+			lf_stack_pop_entry(s, struct test_stack_node, link);
+		if (n == NULL)
+			continue;
+		if (__atomic_exchange_n(&n->owner, self, __ATOMIC_ACQ_REL) != 0)
+			*is_ok = false;
+		++n->use_count;
+		/* Let the others run into the window with the node taken. */
+		if (i % 64 == 0)
+			sched_yield();
+		/*
+		 * The owner uses the memory of the link as it wants. A racing
+		 * pop which has read this node as the top can see it, and must
+		 * fail its compare-exchange, not use it.
+		 */
+		__atomic_store_n(&n->link.next,
+				 (struct lf_link *)(uintptr_t)~(uintptr_t)i,
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&n->owner, 0, __ATOMIC_RELEASE);
+		lf_stack_push_entry(s, n, link);
+	}
+	return is_ok;
+}
+
+static void
+test_stack_stress(void)
+{
+	unit_test_start();
+
+	struct lf_stack s;
+	lf_stack_create(&s);
+	struct test_stack_node nodes[TEST_STACK_NODE_COUNT] = {};
+	for (int i = 0; i < TEST_STACK_NODE_COUNT; ++i)
+		lf_stack_push_entry(&s, &nodes[i], link);
+	pthread_t threads[TEST_THREAD_COUNT];
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+		unit_fail_if(pthread_create(&threads[i], NULL,
+					    test_stack_worker_f, &s) != 0);
+	}
+	bool is_exclusive = true;
+	for (int i = 0; i < TEST_THREAD_COUNT; ++i) {
+		void *res;
+		pthread_join(threads[i], &res);
+		is_exclusive = is_exclusive && *(bool *)res;
+		delete (bool *)res;
+	}
+	unit_check(is_exclusive, "a node has one owner at a time");
+	int count = 0;
+	int use_count = 0;
+	bool is_known = true;
+	for (struct lf_link *l = lf_stack_pop_all(&s); l != NULL; l = l->next) {
+		struct test_stack_node *n =
+			lf_entry(l, struct test_stack_node, link);
+		is_known = is_known && n >= nodes &&
+			   n < nodes + TEST_STACK_NODE_COUNT;
+		++count;
+		use_count += n->use_count;
+		if (count > TEST_STACK_NODE_COUNT)
+			break;
+	}
+	unit_check(is_known && count == TEST_STACK_NODE_COUNT,
+		   "all the nodes are back, each once");
+	unit_msg("%d pops succeeded", use_count);
+	unit_check(use_count > 0, "the nodes were used");
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	test_mpsc_basic();
+	test_mpsc_stress();
+	test_stack_basic();
+	test_stack_stress();
+
+	unit_test_finish();
+	return 0;
+}
@@ -0,0 +1,211 @@
+#include "unit.h"
+#include "shm_ring.h"
+
+#include <stdlib.h>
+#include <sys/wait.h>
+
+enum {
+	TEST_RING_SIZE = 4096,
+	TEST_BIG_SIZE = 8 * 1024 * 1024,
+	TEST_WAIT_TIMEOUT_MS = 5000,
+};
+
+/** Wait until the flag is set by the other process. */
+static bool
+test_wait_flag(const uint32_t *flag)
+{
+	for (int i = 0; i < TEST_WAIT_TIMEOUT_MS; ++i) {
+		if (__atomic_load_n(flag, __ATOMIC_ACQUIRE) != 0)
+			return true;
+		usleep(1000);
+	}
+	return false;
+}
+
+static bool
+test_is_alive(pid_t pid)
+{
+	int status;
+	return waitpid(pid, &status, WNOHANG) == 0;
+}
+
+static int
+test_wait_exit(pid_t pid)
+{
+	int status;
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+static void
+test_wraparound(void)
+{
+	unit_test_start();
+
+	struct shm_ring *r = shm_ring_new(64);
+	unit_fail_if(r == NULL);
+	char *wdata;
+	const char *rdata;
+	unit_check(shm_ring_reserve(r, &wdata) == 64 && wdata == r->data,
+		   "an empty ring is free whole");
+	memset(wdata, 'a', 40);
+	shm_ring_publish(r, 40);
+	unit_check(shm_ring_peek(r, &rdata) == 40 && rdata == r->data,
+		   "peek the published");
+	shm_ring_consume(r, 40);
+
+	unit_check(shm_ring_reserve(r, &wdata) == 24 && wdata == r->data + 40,
+		   "reserve returns the span to the end");
+	memset(wdata, 'b', 24);
+	shm_ring_publish(r, 24);
+	unit_check(shm_ring_reserve(r, &wdata) == 40 && wdata == r->data,
+		   "then the span from the start");
+	memset(wdata, 'c', 10);
+	shm_ring_publish(r, 10);
+
+	unit_check(shm_ring_peek(r, &rdata) == 24 && rdata == r->data + 40 &&
+		   rdata[0] == 'b' && rdata[23] == 'b',
+		   "peek returns the span to the end");
+	shm_ring_consume(r, 24);
+	unit_check(shm_ring_peek(r, &rdata) == 10 && rdata == r->data &&
+		   rdata[0] == 'c' && rdata[9] == 'c',
+		   "then the span from the start");
+	shm_ring_consume(r, 10);
+
+	/* The counters are free-running, they overflow at some point. */
+	r->head = r->tail = UINT32_MAX - 7;
+	char buf[48];
+	for (int i = 0; i < (int)sizeof(buf); ++i)
+		buf[i] = (char)i;
+	shm_ring_write(r, buf, sizeof(buf));
+	unit_check(r->head == 40, "the head overflows");
+	char out[48];
+	shm_ring_read(r, out, sizeof(out));
+	unit_check(r->tail == 40 && memcmp(buf, out, sizeof(buf)) == 0,
+		   "the data is intact across the overflow");
+	shm_ring_delete(r);
+
+	unit_test_finish();
+}
+
+static void
+test_empty_wait(void)
+{
+	unit_test_start();
+
+	struct shm_ring *r = shm_ring_new(TEST_RING_SIZE);
+	unit_fail_if(r == NULL);
+	pid_t pid = fork();
+	unit_fail_if(pid < 0);
+	if (pid == 0) {
+		char c;
+		shm_ring_read(r, &c, 1);
+		_exit(c);
+	}
+	unit_check(test_wait_flag(&r->is_consumer_waiting),
+		   "the consumer waits on an empty ring");
+	unit_check(test_is_alive(pid), "and sleeps");
+	char c = 42;
+	shm_ring_write(r, &c, 1);
+	unit_check(r->is_consumer_waiting == 0, "the producer takes the flag");
+	unit_check(test_wait_exit(pid) == 42, "and wakes the consumer up");
+	shm_ring_delete(r);
+
+	unit_test_finish();
+}
+
+static void
+test_full_wait(void)
+{
+	unit_test_start();
+
+	struct shm_ring *r = shm_ring_new(TEST_RING_SIZE);
+	unit_fail_if(r == NULL);
+	pid_t pid = fork();
+	unit_fail_if(pid < 0);
+	if (pid == 0) {
+		char buf[TEST_RING_SIZE + 1];
+		for (int i = 0; i < (int)sizeof(buf); ++i)
+			buf[i] = (char)i;
+		shm_ring_write(r, buf, sizeof(buf));
+		_exit(0);
+	}
+	unit_check(test_wait_flag(&r->is_producer_waiting),
+		   "the producer waits on a full ring");
+	unit_check(test_is_alive(pid), "and sleeps");
+	unit_check(r->head - r->tail == TEST_RING_SIZE, "the ring is full");
+	char buf[TEST_RING_SIZE + 1];
+	shm_ring_read(r, buf, sizeof(buf));
+	bool is_ok = true;
+	for (int i = 0; i < (int)sizeof(buf); ++i)
+		is_ok = is_ok && buf[i] == (char)i;
+	unit_check(is_ok, "all is read");
+	unit_check(r->is_producer_waiting == 0, "the consumer takes the flag");
+	unit_check(test_wait_exit(pid) == 0, "and wakes the producer up");
+	shm_ring_delete(r);
+
+	unit_test_finish();
+}
+
+static void
+test_big_transfer(void)
+{
+	unit_test_start();
+
+	char *src = new char[TEST_BIG_SIZE];
+	srand(1);
+	for (int i = 0; i < TEST_BIG_SIZE; ++i)
+		src[i] = (char)rand();
+	struct shm_ring *r = shm_ring_new(TEST_RING_SIZE);
+	unit_fail_if(r == NULL);
+	pid_t pid = fork();
+	unit_fail_if(pid < 0);
+	if (pid == 0) {
+		/* Odd sizes, so the spans are cut at the ring end. */
+		srand(2);
+		size_t pos = 0;
+		while (pos < TEST_BIG_SIZE) {
+			size_t size = 1 + rand() % (3 * TEST_RING_SIZE);
+			if (size > TEST_BIG_SIZE - pos)
+				size = TEST_BIG_SIZE - pos;
+			shm_ring_write(r, src + pos, size);
+			pos += size;
+		}
+		_exit(0);
+	}
+	char *dst = new char[TEST_BIG_SIZE];
+	srand(3);
+	size_t pos = 0;
+	while (pos < TEST_BIG_SIZE) {
+		size_t size = 1 + rand() % (2 * TEST_RING_SIZE);
+		if (size > TEST_BIG_SIZE - pos)
+			size = TEST_BIG_SIZE - pos;
+		shm_ring_read(r, dst + pos, size);
+		pos += size;
+	}
+	unit_check(test_wait_exit(pid) == 0, "the producer is done");
+	unit_check(memcmp(src, dst, TEST_BIG_SIZE) == 0,
+		   "the data is the same byte to byte");
+	unit_check(r->head == r->tail && r->head == (uint32_t)TEST_BIG_SIZE,
+		   "the ring is empty");
+	shm_ring_delete(r);
+	delete[] dst;
+	delete[] src;
+
+	unit_test_finish();
+}
+
+int
+main(void)
+{
+	unit_test_start();
+
+	test_wraparound();
+	test_empty_wait();
+	test_full_wait();
+	test_big_transfer();
+
+	unit_test_finish();
+	return 0;
+}
@@ -24,7 +24,7 @@ private:
 #define unit_test_start() UnitTestCaseGuard test_case_guard(__func__)
 
 #define unit_assert(cond) do {													\
-	if (cond) {																	\
+	if (not (cond)) {															\
 		std::cout <<"Test failed, line " << __LINE__ << "\n";					\
 		exit(-1);																\
 	}																			\